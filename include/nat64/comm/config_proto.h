@@ -39,6 +39,24 @@
  * probably be rethought.
  */
 #define MSG_GETCFG		0x12
+/**
+ * ID of the messages that carry BIB and session events (see DBEVENTS_GROUP).
+ */
+#define MSG_DBEVENTS		0x13
+
+/**
+ * Netlink multicast group (on Jool's socket) where the creation and deletion of BIB and session
+ * entries are published. Each message's payload is an array of struct dbevent_usr.
+ * Listeners need to be root.
+ */
+#define DBEVENTS_GROUP 23
+
+/**
+ * Maximum payload of the messages the kernel module uses to dump its tables.
+ * These are much larger than the rest so a big table doesn't need one round trip (and one hold of
+ * the table locks) per few dozen entries. The userspace app has to be able to receive them.
+ */
+#define DUMP_MSG_MAX_SIZE (60 * 1024)
 
 enum config_mode {
 	/** The current message is talking about the IPv6 pool. */
@@ -49,10 +67,18 @@ enum config_mode {
 	MODE_BIB = (1 << 3),
 	/** The current message is talking about the session tables. */
 	MODE_SESSION = (1 << 4),
-#ifdef BENCHMARK
 	/** The current message is talking about log times for benchmark. */
 	MODE_LOGTIME = (1 << 5),
-#endif
+	/** The current message is talking about Jool's packet counters. */
+	MODE_STATS = (1 << 6),
+	/** The current message is talking about the BIB and session events of a peer translator. */
+	MODE_SYNC = (1 << 7),
+	/** The current message is talking about the Explicit Address Mapping Table (SIIT only). */
+	MODE_EAMT = (1 << 8),
+	/** The current message carries packets to push through the translator (see REPLAY_OPS). */
+	MODE_REPLAY = (1 << 9),
+	/** The current message is talking about the latest BIB and session changes. */
+	MODE_CHANGES = (1 << 10),
 	/** The current message is talking about general configuration values. */
 	MODE_GENERAL = (1 << 0),
 };
@@ -66,9 +92,13 @@ enum config_mode {
 #define POOL4_OPS (OP_DISPLAY | OP_COUNT | OP_ADD | OP_REMOVE | OP_FLUSH)
 #define BIB_OPS (OP_DISPLAY | OP_COUNT | OP_ADD | OP_REMOVE)
 #define SESSION_OPS (OP_DISPLAY | OP_COUNT)
-#ifdef BENCHMARK
 #define LOGTIME_OPS (OP_DISPLAY)
-#endif
+#define STATS_OPS (OP_DISPLAY)
+#define SYNC_OPS (OP_DISPLAY | OP_ADD)
+#define EAMT_OPS (OP_DISPLAY | OP_COUNT | OP_ADD | OP_REMOVE | OP_FLUSH)
+#define REPLAY_OPS (OP_ADD)
+/** Display returns the changes since a generation; count returns the latest generation. */
+#define CHANGES_OPS (OP_DISPLAY | OP_COUNT)
 #define GENERAL_OPS (OP_DISPLAY | OP_UPDATE)
 /**
  * @}
@@ -94,17 +124,14 @@ enum config_operation {
  * Allowed modes for the operation mentioned in the name.
  * eg. DISPLAY_MODES = Allowed modes for display operations.
  */
-#ifdef BENCHMARK
 #define DISPLAY_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB | MODE_SESSION | MODE_GENERAL \
-		| MODE_LOGTIME)
-#else
-#define DISPLAY_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB | MODE_SESSION | MODE_GENERAL)
-#endif
-#define COUNT_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB | MODE_SESSION)
-#define ADD_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB)
+		| MODE_LOGTIME | MODE_STATS | MODE_SYNC | MODE_EAMT | MODE_CHANGES)
+#define COUNT_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB | MODE_SESSION | MODE_EAMT \
+		| MODE_CHANGES)
+#define ADD_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB | MODE_SYNC | MODE_EAMT | MODE_REPLAY)
 #define UPDATE_MODES (MODE_GENERAL)
-#define REMOVE_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB)
-#define FLUSH_MODES (MODE_POOL6 | MODE_POOL4)
+#define REMOVE_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BIB | MODE_EAMT)
+#define FLUSH_MODES (MODE_POOL6 | MODE_POOL4 | MODE_EAMT)
 /**
  * @}
  */
@@ -117,7 +144,7 @@ struct request_hdr {
 	/** Size of the message. Includes header (this one) and payload. */
 	__u32 length;
 	/** See "enum config_mode". */
-	__u8 mode;
+	__u16 mode;
 	/** See "enum config_operation". */
 	__u8 operation;
 };
@@ -155,10 +182,36 @@ union request_pool4 {
 	struct {
 		/** The address the user wants to add to the pool. */
 		struct in_addr addr;
+		/**
+		 * If true, "addr"/"addr_len" is a range to be mapped deterministically to "prefix6".
+		 * See pool4_register_det(). (boolean)
+		 */
+		__u8 deterministic;
+		/** "addr" is actually "addr"/"addr_len". */
+		__u8 addr_len;
+		struct ipv6_prefix prefix6;
+		__u8 subscriber_len;
+		/**
+		 * Only the ports from "port_min" through "port_max" are lent. If they're not 0-65535 or
+		 * "addr_len" is not 32, the addresses are added as a range (see pool4_register_range()).
+		 * Ignored in deterministic mode.
+		 */
+		__u16 port_min;
+		__u16 port_max;
+		/**
+		 * If nonzero, the addresses only lend the ports of the "psid_len"-bit "psid", placed
+		 * "psid_offset" bits into the port (see pool4_register_psid()). "port_min" and
+		 * "port_max" must then be 0-65535. Ignored in deterministic mode.
+		 */
+		__u8 psid_len;
+		__u8 psid_offset;
+		__u16 psid;
 	} add;
 	struct {
 		/** The address the user wants to remove from the pool. */
 		struct in_addr addr;
+		/** If not 32, the range "addr"/"addr_len" is removed instead. */
+		__u8 addr_len;
 		/* Whether the address's BIB entries and sessions should be cleared too (false) or not (true). */
 		__u8 quick;
 	} remove;
@@ -167,21 +220,43 @@ union request_pool4 {
 		__u8 quick;
 	} flush;
 };
-#ifdef BENCHMARK
+/**
+ * One entry of the Explicit Address Mapping Table (RFC 7757): the addresses from "prefix6" are
+ * translated into the ones from "prefix4" and vice versa, suffix bits preserved.
+ * The prefixes' suffixes must be the same length.
+ */
+struct eam_entry {
+	struct ipv6_prefix prefix6;
+	struct ipv4_prefix prefix4;
+};
+
+/**
+ * Configuration for the "EAMT" module.
+ */
+union request_eamt {
+	struct {
+		/* Nothing needed here ATM. */
+	} display;
+	struct {
+		/** The entry the user wants to add to the table. */
+		struct eam_entry entry;
+	} add;
+	struct {
+		/** The entry the user wants to remove from the table. */
+		struct eam_entry entry;
+	} remove;
+	struct {
+		/* Nothing needed here ATM. */
+	} flush;
+};
+
 /**
  * Configuration for the "Log time" module.
  */
 struct request_logtime {
 	__u8 l3_proto;
 	__u8 l4_proto;
-	union {
-		struct {
-			/** If this is false, this is the first chunk the app is requesting. (boolean) */
-			__u8 iterate;
-		} display;
-	};
 };
-#endif
 
 /**
  * Configuration for the "BIB" module.
@@ -224,6 +299,36 @@ struct request_bib {
 /**
  * Configuration for the "Session DB"'s tables.
  */
+/**
+ * Flags of struct session_filter; they indicate which of its fields are meaningful.
+ */
+enum session_filter_flags {
+	SFILTER_PREFIX6 = (1 << 0),
+	SFILTER_ADDR4 = (1 << 1),
+	SFILTER_PORTS = (1 << 2),
+	SFILTER_STATE = (1 << 3),
+	SFILTER_IDLE = (1 << 4),
+};
+
+/**
+ * Narrows a session display down to the sessions that match all of the flagged fields.
+ */
+struct session_filter {
+	/** Bitwise OR of enum session_filter_flags. Zero means no filtering. */
+	__u8 flags;
+	/** SFILTER_PREFIX6: The IPv6 node's address ("remote6") has to belong to this prefix. */
+	struct ipv6_prefix prefix6;
+	/** SFILTER_ADDR4: The session's pool4 address ("local4") has to be this. */
+	struct in_addr addr4;
+	/** SFILTER_PORTS: The session's pool4 port (or ICMP ID) has to be within this range. */
+	__u16 port_min;
+	__u16 port_max;
+	/** SFILTER_STATE: The session's TCP state has to be this. See enum tcp_state. */
+	__u8 state;
+	/** SFILTER_IDLE: The session has to have been idle for at least this many milliseconds. */
+	__u32 min_idle;
+};
+
 struct request_session {
 	/** Table the userspace app wants to display. See enum l4_protocol. */
 	__u8 l4_proto;
@@ -232,10 +337,13 @@ struct request_session {
 			/** If this is false, this is the first chunk the app is requesting. (boolean) */
 			__u8 iterate;
 			/**
-			 * Address the userspace app received in the last chunk. Iteration should contiue
-			 * from here.
+			 * Local and remote IPv4 addresses of the last session the userspace app received
+			 * in the last chunk. Iteration should continue from here.
 			 */
 			struct ipv4_transport_addr addr4;
+			struct ipv4_transport_addr remote4;
+			/** Only the sessions that match this are returned. Ignored by sync snapshots. */
+			struct session_filter filter;
 		} display;
 		struct {
 			/* Nothing needed here. */
@@ -251,8 +359,25 @@ enum sessiondb_type {
 	ICMP_TIMEOUT,
 	TCP_EST_TIMEOUT,
 	TCP_TRANS_TIMEOUT,
+	REFRESH_GRANULARITY,
+	MAX_SESSIONS_UDP,
+	MAX_SESSIONS_TCP,
+	MAX_SESSIONS_ICMP,
+	MAX_SESSIONS_PER_PREFIX,
+	SESSION_PREFIX_LEN,
+	/**
+	 * Adds, updates or (if the timeout is zero) removes one of the "udp_classes".
+	 * The port goes in the upper 32 bits of the value, the timeout in the lower 32.
+	 */
+	UDP_CLASS_TIMEOUT,
+	SESSION_RATE_PER_PREFIX,
+	TCP_CLOSED_TIMEOUT,
+	TIMER_SLACK,
 };
 
+/** Number of per-port UDP session lifetimes that can be configured. */
+#define UDP_CLASSES 4
+
 /**
  * Configuration of the "Session DB" module.
  *
@@ -269,18 +394,497 @@ struct sessiondb_config {
 		__u64 tcp_est;
 		/** Maximum time transitory TCP sessions will remain in the DB. */
 		__u64 tcp_trans;
+		/**
+		 * Maximum time TCP sessions closed by a RST or by both FINs will remain in the DB.
+		 * Zero means they are transitory like the rest ("tcp_trans"), as RFC 6146 wants.
+		 */
+		__u64 tcp_closed;
 	} ttl;
+	/**
+	 * Sessions whose update time is younger than this will not be refreshed by their packets.
+	 * If nonzero, packets of sessions which don't change state do not need to lock the database.
+	 * Zero means every packet refreshes its session. (TCP packets which neither change the
+	 * state nor refresh a closing session never lock the database, regardless of this value.)
+	 */
+	__u64 refresh_granularity;
+	/**
+	 * The expiration timers only wake up at multiples of this, so they tend to share their
+	 * wakeups and rarely need reprogramming. Sessions can outlive their timeouts by up to this
+	 * much. Zero means the timers are programmed to the jiffy.
+	 */
+	__u64 timer_slack;
+
+	/** Maximum number of sessions each table can hold. Zero means unlimited. */
+	struct {
+		__u64 udp;
+		__u64 tcp;
+		__u64 icmp;
+	} max_sessions;
+	/**
+	 * Maximum number of sessions (of any protocol) whose remote IPv6 addresses share their first
+	 * "session_prefix_len" bits. Zero means unlimited.
+	 */
+	__u64 max_sessions_per_prefix;
+	/** Length of the prefixes "max_sessions_per_prefix" is enforced on. */
+	__u64 session_prefix_len;
+	/**
+	 * Maximum number of sessions per second the remote IPv6 prefixes of "session_prefix_len"
+	 * bits can start. Bursts of up to a second's worth are tolerated. Zero means unlimited.
+	 */
+	__u64 session_rate_per_prefix;
+	/**
+	 * UDP sessions whose remote IPv4 port is one of these get the corresponding lifetime
+	 * instead of "ttl.udp", and a timer of their own. Unused classes have port zero.
+	 */
+	struct {
+		/** Maximum time inactive UDP sessions of this class will remain in the DB. */
+		__u64 ttl;
+		__u16 port;
+	} udp_classes[UDP_CLASSES];
+};
+
+/**
+ * Counters of the admission control, the purges and the probes of the "Session DB" module.
+ */
+struct sessiondb_stats {
+	/** New sessions refused because their table was full. */
+	__u64 rejected_table_full;
+	/** New sessions refused because their remote IPv6 prefix owned too many sessions. */
+	__u64 rejected_prefix_full;
+	/** New sessions refused because their remote IPv6 prefix was starting them too fast. */
+	__u64 rejected_prefix_rate;
+	/** Embryonic TCP sessions killed to make room for new ones. */
+	__u64 early_drops;
+	/** Sessions killed because the kernel ran low on memory (see "session_shrinker"). */
+	__u64 sessions_shrunk;
+	/** Flushes and deletions by address or prefix which are still removing sessions. */
+	__u64 purges_pending;
+	/** Sessions removed by flushes and deletions by address or prefix, since the module started. */
+	__u64 sessions_purged;
+	/** TCP probes sent to established sessions which expired. */
+	__u64 probes_sent;
+	/** TCP probes which could not be sent, or were discarded because too many were queued. */
+	__u64 probes_dropped;
+	/** Sessions removed by the expirers (including the TCP ones sent to the trans state). */
+	__u64 sessions_expired;
+	/** Nanoseconds the expirers have spent sweeping, since the module started. */
+	__u64 expire_nsecs;
 };
 
 enum fragmentation_type {
 	FRAGMENT_TIMEOUT,
+	FRAGMENT_HIGH_THRESH,
+	FRAGMENT_LOW_THRESH,
+	FRAGMENT_FORWARD_EARLY,
 };
 
 /**
- * Time interval to allow arrival of fragments, in milliseconds.
+ * Configuration of the "Fragment DB" module.
  */
 struct fragmentation_config {
+	/** Time interval to allow arrival of fragments, in milliseconds. */
 	__u64 fragment_timeout;
+	/**
+	 * Once the fragments waiting for their siblings take up more than this many bytes, the oldest
+	 * ones are evicted. Zero means unlimited.
+	 */
+	__u64 high_thresh;
+	/** Eviction stops once the waiting fragments take up this many bytes or less. */
+	__u64 low_thresh;
+	/**
+	 * Translate the first fragment of a TCP or UDP packet as soon as it arrives, and its siblings
+	 * as soon as they arrive, instead of waiting for all of them?
+	 * ICMP and zero-checksum IPv4 UDP packets are reassembled regardless, because their checksums
+	 * cannot be computed otherwise.
+	 */
+	__u8 forward_early;
+};
+
+/**
+ * Counters of the "Fragment DB" module.
+ */
+struct fragmentation_stats {
+	/** Bytes currently taken up by the fragments waiting for their siblings. */
+	__u64 bytes_queued;
+	/** Incomplete packets dropped because "high_thresh" was crossed, since the module started. */
+	__u64 evictions;
+};
+
+/**
+ * Counters of the ICMP error limiter.
+ */
+struct icmp_stats {
+	/** ICMP errors sent, since the module started. */
+	__u64 errors_sent;
+	/** ICMP errors dropped because of the rate limit or a full queue, since the module started. */
+	__u64 errors_suppressed;
+};
+
+enum dbevent_type {
+	DBEVENT_BIB_ADD = 1,
+	DBEVENT_BIB_REMOVE,
+	DBEVENT_SESSION_ADD,
+	DBEVENT_SESSION_REMOVE,
+	/** A TCP session changed state. Not written to the mapping log. */
+	DBEVENT_SESSION_UPDATE,
+};
+
+/**
+ * A BIB or session entry was created, updated or deleted.
+ * BIB events only use "remote6" (the BIB's IPv6 address) and "local4" (the BIB's IPv4 address);
+ * the rest is zero.
+ *
+ * MODE_SYNC add requests carry arrays of these as well, so a standby translator can install what
+ * an active one has published.
+ */
+struct dbevent_usr {
+	/** See enum dbevent_type. */
+	__u8 type;
+	/** See enum l4_protocol. */
+	__u8 l4_proto;
+	/** The session's TCP state (see enum tcp_state); zero for everything else. */
+	__u8 state;
+	struct ipv6_transport_addr remote6;
+	struct ipv6_transport_addr local6;
+	struct ipv4_transport_addr local4;
+	struct ipv4_transport_addr remote4;
+	/**
+	 * Packets and bytes the session translated, if the session counters are enabled (see the
+	 * session_counters module argument). Only set by session removals; zero otherwise.
+	 */
+	__u64 packets;
+	__u64 bytes;
+};
+
+/**
+ * One entry of the mapping log (see maplog.h). Every record has this exact size.
+ */
+struct maplog_record {
+	/** Wall-clock time of the event, in nanoseconds since the epoch. */
+	__u64 time;
+	struct dbevent_usr event;
+};
+
+/**
+ * One entry of the change log (see changelog.h). MODE_CHANGES display responses are a struct
+ * changes_response followed by an array of these, oldest first.
+ */
+struct changelog_record {
+	/** Position of the change among all the changes the log has seen; starts at 1. */
+	__u64 generation;
+	struct dbevent_usr event;
+};
+
+/**
+ * Configuration for the "change log" module.
+ */
+struct request_changes {
+	/**
+	 * Display requests return the changes whose generation is greater than this one (zero means
+	 * all of them). Responses that don't fit in a single message are flagged NLM_F_MULTI; ask
+	 * again with the last generation received to get the rest.
+	 */
+	__u64 since;
+};
+
+/**
+ * Header of the MODE_CHANGES display responses.
+ */
+struct changes_response {
+	/** The latest generation, as of the response. The records go up to this one. */
+	__u64 generation;
+	/**
+	 * Some of the requested changes are no longer logged (or the log was restarted), so no
+	 * records follow; the poller has to dump the tables again, and then ask for the changes
+	 * since "generation". (boolean)
+	 */
+	__u8 stale;
+};
+
+/**
+ * Counters of the BIB and session event publisher.
+ */
+struct dbevent_stats {
+	/** Events multicasted, since the module started. */
+	__u64 events_sent;
+	/** Events lost because the batch or a listener's socket couldn't keep up, since the start. */
+	__u64 events_dropped;
+	/** Records written to the mapping log, since the module started. */
+	__u64 records_logged;
+	/** Records lost because the mapping log's reader couldn't keep up, since the start. */
+	__u64 records_dropped;
+	/** Events received from a peer (MODE_SYNC) and applied, since the module started. */
+	__u64 events_imported;
+	/** Events received from a peer which could not be applied, since the module started. */
+	__u64 events_rejected;
+	/** IPFIX records sent to the collector, since the module started. */
+	__u64 ipfix_records_sent;
+	/** IPFIX records lost to full buffers or failed sends, since the module started. */
+	__u64 ipfix_records_dropped;
+};
+
+/**
+ * The steps of the translation pipeline whose cost can be measured (see the stage_timing module
+ * argument).
+ */
+enum pipeline_stage {
+	/** determine_in_tuple(). */
+	STAGE_INCOMING,
+	/** filtering_established() and filtering_and_updating(). */
+	STAGE_FILTERING,
+	/** compute_out_tuple(). */
+	STAGE_OUTGOING,
+	/** translating_the_packet() (and its in-place version). */
+	STAGE_TRANSLATE,
+	/** sendpkt_send(), which includes routing. */
+	STAGE_SEND,
+	/** Not a stage; the number of them. */
+	STAGE_COUNT,
+};
+
+/**
+ * Incoming packet kinds the stage counters are split into. In order: IPv6 TCP, IPv6 UDP,
+ * IPv6 ICMP, IPv4 TCP, IPv4 UDP and IPv4 ICMP.
+ */
+#define STAGE_PROTOS 6
+
+/**
+ * Cost of one pipeline stage for one kind of incoming packet, since stage timing was enabled.
+ */
+struct stage_stats {
+	/** Packets which went through the stage. */
+	__u64 packets;
+	/** Nanoseconds they spent in it, all of them combined. */
+	__u64 nsecs;
+};
+
+/**
+ * Indexed by packet kind (see STAGE_PROTOS) and stage. All zero if stage timing is disabled.
+ */
+struct pipeline_stats {
+	struct stage_stats stages[STAGE_PROTOS][STAGE_COUNT];
+};
+
+/**
+ * The things Jool counts about the packets it handles, mostly the reasons why it drops them.
+ * The userspace app and /proc/net/jool have a label for each; keep them in sync.
+ */
+enum jool_stat {
+	/** Packets translated and sent. */
+	JSTAT_TRANSLATED,
+	/** IPv6 packets dropped because their destination is not in pool6. */
+	JSTAT_POOL6_MISMATCH,
+	/** IPv4 packets dropped because their destination is not in pool4. */
+	JSTAT_POOL4_MISMATCH,
+	/** IPv6 packets dropped because their source is in pool6. */
+	JSTAT_HAIRPIN_LOOP,
+	/** ICMPv6 informational packets dropped due to policy. */
+	JSTAT_ICMP6_INFO_FILTERED,
+	/** IPv6 packets dropped because they couldn't be assigned an IPv4 transport address. */
+	JSTAT_BIB6_FAILED,
+	/** IPv4 packets dropped because they don't belong to any BIB entry. */
+	JSTAT_NO_BIB,
+	/** IPv4 packets dropped because of address-dependent filtering. */
+	JSTAT_ADF,
+	/** Packets dropped because their session couldn't be created (limits or memory). */
+	JSTAT_SESSION_FAILED,
+	/** TCP packets dropped because they don't fit their connection's state. */
+	JSTAT_TCP_STATE,
+	/** IPv4 TCP SYNs stored, waiting for simultaneous opens. */
+	JSTAT_PKTQUEUE_STORED,
+	/** IPv4 TCP SYNs refused because the packet queue (or its quotas) was full. */
+	JSTAT_PKTQUEUE_FULL,
+	/** Partial packets discarded because their fragments did not arrive in time. */
+	JSTAT_FRAG_TIMEOUT,
+	/** Fragments dropped because the fragment database could not store their packet. */
+	JSTAT_FRAG_STORE_FAILED,
+	/** Translated packets dropped because there was no route to their destination. */
+	JSTAT_NO_ROUTE,
+	/** Translated packets the kernel refused to send. */
+	JSTAT_SEND_FAILED,
+	/** Packets dropped in SIIT mode because neither the EAMT nor pool6 could translate an address. */
+	JSTAT_SIIT_UNTRANSLATABLE,
+	/** Not a counter; the number of them. */
+	JSTAT_COUNT,
+};
+
+/**
+ * The subsystems whose memory is accounted for (see STATS_MEMORY).
+ * The userspace app has a label for each; keep them in sync.
+ */
+enum jool_memory {
+	/** Session entries (or their arena), plus the session tables' indexes and counters. */
+	JMEM_SESSION,
+	/** BIB entries (or their arena), their IPv6 nodes' records and port blocks, and indexes. */
+	JMEM_BIB,
+	/** pool4's addresses, ranges and snapshot, and the bitmaps of their ports and blocks. */
+	JMEM_POOL4,
+	/** pool6's prefixes and snapshot. */
+	JMEM_POOL6,
+	/** The Explicit Address Mapping Table. */
+	JMEM_EAMT,
+	/** The fragment database's reassembly buffers and hole descriptors. */
+	JMEM_FRAGDB,
+	/** The fragments the fragment database is holding, in skb truesize. */
+	JMEM_FRAGDB_SKBS,
+	/** The packet queue's nodes. */
+	JMEM_PKTQUEUE,
+	/** The SYNs the packet queue is holding, in skb truesize. */
+	JMEM_PKTQUEUE_SKBS,
+	/** The benchmark's time logs. */
+	JMEM_LOGTIME,
+	/** The change log (see the changelog_size module argument). */
+	JMEM_CHANGELOG,
+	/** Not a subsystem; the number of them. */
+	JMEM_COUNT,
+};
+
+/**
+ * The spinlocks whose contention can be measured (see the lock_timing module argument). Every one
+ * stands for all of the instances of its kind, eg. JLOCK_SESSION covers the three protocols' tables
+ * (and all of their shards).
+ * The userspace app has a label for each; keep them in sync.
+ */
+enum jool_lock {
+	/** The BIB tables' locks. */
+	JLOCK_BIB,
+	/** The session tables' locks. */
+	JLOCK_SESSION,
+	/** pool4's pool_lock. */
+	JLOCK_POOL4,
+	/** The fragment database shards' locks. */
+	JLOCK_FRAGDB,
+	/** The packet queue's packets_lock. */
+	JLOCK_PKTQUEUE,
+	/** Not a lock; the number of them. */
+	JLOCK_COUNT,
+};
+
+/**
+ * What one kind of lock went through, since lock timing was enabled.
+ */
+struct lock_stats {
+	/** Times the lock was taken. */
+	__u64 acquisitions;
+	/** Times it was taken by somebody else, so the acquirer had to spin. */
+	__u64 contended;
+	/** Nanoseconds spent spinning, all of the contended acquisitions combined. */
+	__u64 wait_nsecs;
+	/** Nanoseconds the lock was held, all of the acquisitions combined. */
+	__u64 hold_nsecs;
+	/** Longest the lock was held at a time, in nanoseconds. */
+	__u64 hold_max_nsecs;
+};
+
+/**
+ * Jool's packet counters, from the eyes of userspace. Indexed by enum jool_stat.
+ */
+struct jool_stats_usr {
+	__u64 counters[JSTAT_COUNT];
+	/** Indexed by enum jool_lock. All zero if lock timing is disabled. */
+	struct lock_stats locks[JLOCK_COUNT];
+};
+
+/**
+ * What a stats request wants. See struct request_stats.
+ */
+enum stats_type {
+	/** Jool's packet counters and lock timings. The response is a struct jool_stats_usr. */
+	STATS_COUNTERS,
+	/**
+	 * How full the tables are. The response is a struct occupancy_usr, followed by one
+	 * struct pool4_usage_usr per pool4 address that lends its ports on demand.
+	 */
+	STATS_OCCUPANCY,
+	/** How much memory the subsystems are using. The response is a struct memory_usr. */
+	STATS_MEMORY,
+};
+
+/**
+ * Bytes allocated by each subsystem, at the moment. Indexed by enum jool_memory.
+ * Objects are counted at the size they were requested with, so the allocators' own overhead (slab
+ * rounding, vmalloc's page granularity) is not included.
+ */
+struct memory_usr {
+	__u64 bytes[JMEM_COUNT];
+};
+
+struct request_stats {
+	/** See enum stats_type. */
+	__u8 type;
+};
+
+/**
+ * MODE_REPLAY add requests carry a series of these, each followed by the "len" bytes of an IPv4 or
+ * IPv6 packet (from its network header onwards), padded to a multiple of REPLAY_ALIGN bytes.
+ * The kernel translates them as if they had just been received, and answers with a
+ * struct replay_result_usr.
+ */
+struct replay_pkt_usr {
+	__u16 len;
+	__u16 reserved;
+};
+
+#define REPLAY_ALIGN 4
+
+/**
+ * What the translator did with the packets of one MODE_REPLAY request.
+ */
+struct replay_result_usr {
+	/** Packets the translator took (ie. translated, queued or stored as fragments). */
+	__u32 stolen;
+	/** Packets the translator dropped. */
+	__u32 dropped;
+	/** Packets the translator returned to the kernel (eg. because they weren't for pool6/4). */
+	__u32 ignored;
+	/** Records which did not contain an IP packet. */
+	__u32 malformed;
+};
+
+/**
+ * @{
+ * Layout of the occupancy histograms.
+ *
+ * Prefix bucket i counts the prefixes which own 2^(i-1) to 2^i - 1 sessions; the last one also
+ * counts the ones which own more.
+ * Age bucket i counts the sessions that are younger than OCCUPANCY_AGE_LIMITS[i] minutes (and not
+ * younger than the previous one); the last one counts the rest.
+ */
+#define OCCUPANCY_PREFIX_BUCKETS 17
+#define OCCUPANCY_AGE_LIMITS { 1, 5, 15, 60, 240 }
+#define OCCUPANCY_AGE_BUCKETS 6
+/**
+ * @}
+ */
+
+/**
+ * How full the BIB and session tables are, from the eyes of userspace. Indexed by enum l4_protocol.
+ */
+struct occupancy_usr {
+	__u64 bibs[L4_PROTO_COUNT];
+	__u64 sessions[L4_PROTO_COUNT];
+	/** Number of different IPv6 nodes the BIB entries belong to. */
+	__u64 hosts;
+	/**
+	 * Number of remote IPv6 prefixes that own each number of sessions (see above).
+	 * The prefixes are hashed into a fixed number of counters, so a few of them might be counted
+	 * as one.
+	 */
+	__u64 prefixes[OCCUPANCY_PREFIX_BUCKETS];
+	/** Length of the prefixes "prefixes" talks about. Same as the session_prefix_len config. */
+	__u8 prefix_len;
+	/** Number of sessions whose age falls in each bucket (see above). */
+	__u64 ages[L4_PROTO_COUNT][OCCUPANCY_AGE_BUCKETS];
+};
+
+/**
+ * The ports (and ICMP IDs) one pool4 address has, and how many of them are currently borrowed.
+ * Indexed by enum l4_protocol.
+ */
+struct pool4_usage_usr {
+	struct in_addr addr;
+	__u32 total[L4_PROTO_COUNT];
+	__u32 borrowed[L4_PROTO_COUNT];
 };
 
 /**
@@ -288,6 +892,8 @@ struct fragmentation_config {
  */
 enum pktqueue_type {
 	MAX_PKTS,
+	MAX_PKTS_PER_SRC,
+	MAX_PKTS_PER_POOL4,
 };
 
 /**
@@ -295,6 +901,10 @@ enum pktqueue_type {
  */
 struct pktqueue_config {
 	__u64 max_pkts;
+	/** Maximum number of packets a single remote IPv4 address can have stored. Zero = no limit. */
+	__u64 max_pkts_per_src;
+	/** Maximum number of packets a single pool4 address can have stored. Zero = no limit. */
+	__u64 max_pkts_per_pool4;
 };
 
 /**
@@ -329,6 +939,7 @@ enum translate_type {
 	BUILD_IPV4_ID,
 	LOWER_MTU_FAIL,
 	MTU_PLATEAUS,
+	CLAMP_MSS,
 };
 
 /**
@@ -385,10 +996,17 @@ struct translate_config {
 	 * packet's Total Length field.
 	 */
 	__u16 *mtu_plateaus;
+	/**
+	 * Whether the Maximum Segment Size options of translated TCP SYNs should be lowered so the
+	 * resulting IPv6 segments fit in the minimum IPv6 MTU (sendpkt_config.min_ipv6_mtu).
+	 * Boolean.
+	 */
+	__u8 clamp_mss;
 };
 
 enum sendpkt_type {
 	MIN_IPV6_MTU,
+	DIRECT_XMIT,
 };
 
 struct sendpkt_config {
@@ -397,6 +1015,13 @@ struct sendpkt_config {
 	 * be no bigger than this amount of bytes.
 	 */
 	__u16 min_ipv6_mtu;
+	/**
+	 * Hand translated packets straight to their next hop's neighbour entry instead of
+	 * ip_local_out()/ip6_local_out()?
+	 * This skips Netfilter's LOCAL_OUT and POST_ROUTING hooks (and therefore conntrack, NAT and
+	 * any filtering rules) for them. Packets which need to be fragmented still take the long way.
+	 */
+	__u8 direct_xmit;
 };
 
 enum general_module {
@@ -412,33 +1037,71 @@ enum general_module {
 	FRAGMENT,
 
 	SENDPKT,
+	/** Indicates the presence of a struct logtime_config value. */
+	LOGTIME,
 };
 
 /**
- * A request to edit a miscellaneous configuration value.
+ * A request to edit miscellaneous configuration values.
  */
 union request_general {
 	struct {
 		/* Nothing needed here. */
 	} display;
 	struct {
-		__u8 module;
-		__u8 type;
-		/* The value is given in a variable-sized payload so it's not here. */
+		/** Number of struct general_record that follow. */
+		__u16 count;
 	} update;
 };
 
-#ifdef BENCHMARK
 /**
- * A logtime node entry, from the eyes of userspace.
+ * One of the values edited by a request_general update.
+ * The kernel applies every record of a request before it answers, and the replaced configurations
+ * are released in the background, so changing several values at once costs a single round trip.
+ */
+struct general_record {
+	/** See enum general_module. */
+	__u8 module;
+	/** The value's identifier within "module" (see enum sessiondb_type and friends). */
+	__u8 type;
+	/** Length of the value in bytes. */
+	__u16 size;
+	/*
+	 * The value is given in a variable-sized payload so it's not here. The next record starts at
+	 * the next GENERAL_RECORD_ALIGN boundary.
+	 */
+};
+
+#define GENERAL_RECORD_ALIGN 8
+/** Space "size" bytes of value take within a request_general update, including the record. */
+#define GENERAL_RECORD_LEN(size) \
+	((sizeof(struct general_record) + (size) + GENERAL_RECORD_ALIGN - 1) \
+			& ~(GENERAL_RECORD_ALIGN - 1))
+
+/**
+ * @{
+ * Layout of the translation time histograms.
  *
- * It holds the "struct timespec" which include seconds and nanoseconds, that specific how time
- * the skb need to be translated to IPv6 -> IPv4 or IPv4 -> IPv6.
+ * Durations are measured in nanoseconds. Those lower than LOGTIME_SUB_BUCKETS have a bucket each;
+ * from there on, every power of two is split into LOGTIME_SUB_BUCKETS equally wide buckets, so a
+ * bucket's width is never more than 1/LOGTIME_SUB_BUCKETS of the durations it counts. Durations
+ * of 2^LOGTIME_MAX_BITS nanoseconds (about 18 minutes) or more fall in the last bucket.
  */
-struct logtime_entry_usr {
-	struct timespec time;
+#define LOGTIME_SUB_BITS 3
+#define LOGTIME_SUB_BUCKETS (1 << LOGTIME_SUB_BITS)
+#define LOGTIME_MAX_BITS 40
+#define LOGTIME_BUCKETS ((LOGTIME_MAX_BITS - LOGTIME_SUB_BITS + 1) * LOGTIME_SUB_BUCKETS)
+/**
+ * @}
+ */
+
+/**
+ * The translation times of one (L3 protocol, L4 protocol) pair, from the eyes of userspace.
+ */
+struct logtime_usr {
+	/** Number of packets whose translation took as long as each bucket says. */
+	__u64 counts[LOGTIME_BUCKETS];
 };
-#endif
 
 /**
  * A BIB entry, from the eyes of userspace.
@@ -468,19 +1131,43 @@ struct session_entry_usr {
 	struct ipv4_transport_addr local4;
 	struct ipv4_transport_addr remote4;
 	__u64 dying_time;
+	/** Zero unless the session counters are enabled (see the session_counters module arg). */
+	__u64 packets;
+	__u64 bytes;
 	__u8 state;
 };
 
 /**
  * A copy of the entire running configuration, excluding databases.
  */
+/**
+ * Indicators of the respective fields in the logtime_config structure.
+ */
+enum logtime_type {
+	LOGTIME_ENABLED,
+};
+
+struct logtime_config {
+	/**
+	 * Measure how long every packet takes to be translated? See `jool --logTime`.
+	 * Costs a patched-out jump while it's off.
+	 */
+	__u8 enabled;
+};
+
 struct response_general {
 	struct sessiondb_config sessiondb;
+	struct sessiondb_stats sessiondb_stats;
 	struct pktqueue_config pktqueue;
 	struct filtering_config filtering;
 	struct translate_config translate;
 	struct fragmentation_config fragmentation;
+	struct fragmentation_stats fragmentation_stats;
 	struct sendpkt_config sendpkt;
+	struct icmp_stats icmp_stats;
+	struct dbevent_stats dbevent_stats;
+	struct pipeline_stats pipeline_stats;
+	struct logtime_config logtime;
 };
 
 /**
@@ -17,6 +17,12 @@
  */
 #define NF_PRI4_JOOL (NF_IP_PRI_CONNTRACK_DEFRAG - 100)
 #define NF_PRI6_JOOL (NF_IP6_PRI_CONNTRACK_DEFRAG - 100)
+/**
+ * Same as above, for when the kernel reassembles the packets (see the kernel_defrag module
+ * argument): right after the defragmentation hooks, still before conntrack.
+ */
+#define NF_PRI4_JOOL_DEFRAG (NF_IP_PRI_CONNTRACK_DEFRAG + 1)
+#define NF_PRI6_JOOL_DEFRAG (NF_IP6_PRI_CONNTRACK_DEFRAG + 1)
 
 /* -- Timeouts, defined by RFC 6146, section 4. */
 
@@ -40,6 +46,11 @@
  * In other words, the timeout of TCP sessions which are expected to terminate soon.
  */
 #define TCP_TRANS (4 * 60)
+/**
+ * Default timeout of TCP sessions the endpoints closed (in seconds).
+ * Zero means they get TCP_TRANS, like the rest of the transitory ones.
+ */
+#define TCP_CLOSED_DEF (0)
 /**
  * Timeout of TCP sessions being initialized (in seconds).
  * It's shorter since these are typical DoS attacks.
@@ -48,9 +59,27 @@
 #define TCP_INCOMING_SYN (6)
 /** Default session lifetime for ICMP bindings, in seconds. */
 #define ICMP_DEFAULT (1 * 60)
+/** Default minimum age of a session's update time before packets refresh it, in milliseconds. */
+#define REFRESH_GRANULARITY_DEF (0)
+/** Default interval the session expiration timers are aligned to, in milliseconds. */
+#define TIMER_SLACK_DEF (250)
+/** Default maximum number of sessions per table. Zero means unlimited. */
+#define MAX_SESSIONS_DEF (0)
+/** Default maximum number of sessions per remote IPv6 prefix. Zero means unlimited. */
+#define MAX_SESSIONS_PER_PREFIX_DEF (0)
+/** Default length of the prefixes the per-prefix session limit is enforced on. */
+#define SESSION_PREFIX_LEN_DEF (64)
+/** Default maximum number of sessions per second per remote IPv6 prefix. Zero means unlimited. */
+#define SESSION_RATE_PER_PREFIX_DEF (0)
 
 /** Default time interval fragments are allowed to arrive in. In seconds. */
 #define FRAGMENT_MIN (2)
+/** Default number of bytes queued fragments can take up before the oldest ones get evicted. */
+#define FRAGMENT_HIGH_THRESH_DEF (4 * 1024 * 1024)
+/** Default number of bytes eviction shrinks the queued fragments back to. */
+#define FRAGMENT_LOW_THRESH_DEF (3 * 1024 * 1024)
+/** Default value of the fragment database's "forward_early" flag. */
+#define FRAGMENT_FORWARD_EARLY_DEF false
 
 /*
  * The timers will never sleep less than this amount of jiffies. This is because I don't think we
@@ -78,6 +107,9 @@
 #define FILT_DEF_FILTER_ICMPV6_INFO false
 #define FILT_DEF_DROP_EXTERNAL_CONNECTIONS false
 #define PKTQ_DEF_MAX_STORED_PKTS 10
+/* The per-address quotas are opt-in; zero leaves max_stored_pkts as the only limit. */
+#define PKTQ_DEF_MAX_PKTS_PER_SRC 0
+#define PKTQ_DEF_MAX_PKTS_PER_POOL4 0
 
 #define TRAN_DEF_RESET_TRAFFIC_CLASS false
 #define TRAN_DEF_RESET_TOS false
@@ -85,8 +117,10 @@
 #define TRAN_DEF_DF_ALWAYS_ON true
 #define TRAN_DEF_BUILD_IPV4_ID false
 #define TRAN_DEF_LOWER_MTU_FAIL true
+#define TRAN_DEF_CLAMP_MSS false
 #define TRAN_DEF_MTU_PLATEAUS { 65535, 32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68 }
 #define TRAN_DEF_MIN_IPV6_MTU IPV6_MIN_MTU
+#define TRAN_DEF_DIRECT_XMIT false
 
 
 /* -- IPv6 Pool -- */
@@ -17,16 +17,10 @@
 #ifdef __KERNEL__
 	#include <linux/in.h>
 	#include <linux/in6.h>
-#ifdef BENCHMARK
-		#include <linux/time.h>
-#endif
 #else
 	#include <stdbool.h>
 	#include <string.h>
 	#include <arpa/inet.h>
-#ifdef BENCHMARK
-		#include <time.h>
-#endif
 #endif
 #include "nat64/comm/nat64.h"
 
@@ -116,4 +110,14 @@ struct ipv6_prefix {
 	__u8 len;
 };
 
+/**
+ * The network component of a IPv4 address (eg. one side of an EAMT entry).
+ */
+struct ipv4_prefix {
+	/** IPv4 prefix. */
+	struct in_addr address;
+	/** Number of bits from "address" which represent the network. */
+	__u8 len;
+};
+
 #endif /* _JOOL_COMM_TYPES_H */
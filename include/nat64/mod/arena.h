@@ -0,0 +1,61 @@
+#ifndef _JOOL_MOD_ARENA_H
+#define _JOOL_MOD_ARENA_H
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/**
+ * @file
+ * A fixed number of equally-sized objects, all of them allocated at once.
+ *
+ * Meant for deployments that would rather size their databases at startup than have them grow
+ * on demand: once the arena is initialized, lending and taking back objects never calls the
+ * allocator, and the memory taken up never changes.
+ *
+ * The memory comes in blocks of contiguous pages as large as the buddy allocator can provide, so
+ * the objects live in the kernel's linear map, which architectures such as x86 cover with huge
+ * pages.
+ *
+ * @author Alberto Leiva
+ */
+
+/** A block of contiguous pages from an arena. */
+struct arena_chunk {
+	/** Address of the first object of the block. */
+	void *start;
+	/** The block is 2^order pages long. */
+	unsigned int order;
+	/** Index (within the arena) of the first object of the block. */
+	u32 first;
+	/** Number of objects that fit in the block. */
+	u32 count;
+};
+
+struct arena {
+	/** Distance between two consecutive objects, in bytes. A multiple of the alignment. */
+	size_t size;
+	/** Number of objects the arena holds. Zero means the arena is not initialized. */
+	u32 capacity;
+	/** The memory, sorted by address. */
+	struct arena_chunk *chunks;
+	/** Length of "chunks". */
+	unsigned int chunk_count;
+	/** Free list. "next[i]" is the index of the free object that follows object "i". */
+	u32 *next;
+	/** Index of the first free object. */
+	u32 head;
+	/** Number of objects that are currently not lent. */
+	u32 available;
+	/** Protects "next", "head" and "available". */
+	spinlock_t lock;
+};
+
+int arena_init(struct arena *arena, size_t size, size_t align, u32 capacity);
+void arena_destroy(struct arena *arena);
+
+void *arena_alloc(struct arena *arena);
+void arena_free(struct arena *arena, void *obj);
+
+size_t arena_footprint(struct arena *arena);
+
+#endif /* _JOOL_MOD_ARENA_H */
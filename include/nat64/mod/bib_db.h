@@ -15,6 +15,24 @@
 
 /* ------------------------------ BIB Entries ----------------------------------- */
 
+/**
+ * An IPv6 node which owns BIB entries.
+ *
+ * A CGN subscriber usually has hundreds of entries, so rather than repeating the node's address in
+ * every one of them, they all point to one of these. There's only one record per address (for the
+ * three tables); bib_create() finds it or creates it.
+ */
+struct ipv6_host {
+	/** The node's address. */
+	struct in6_addr addr;
+	/**
+	 * Number of BIB entries (of any protocol) pointing to this record. It dies when this
+	 * reaches zero. Protected by the BIB module's host index lock, not the tables'.
+	 */
+	unsigned int bibs;
+	/** Appends this record to the BIB module's host index. */
+	struct hlist_node hook;
+};
 
 /**
  * A row, intended to be part of one of the BIB tables.
@@ -25,23 +43,39 @@
 struct bib_entry {
 	/** The address from the IPv4 network. */
 	const struct ipv4_transport_addr ipv4;
-	/** The address from the IPv6 network. */
-	const struct ipv6_transport_addr ipv6;
+	/**
+	 * The IPv6 node, whose address is the IPv6 transport address's (see bib_ipv6()).
+	 * It lives at least as long as the entry.
+	 */
+	struct ipv6_host *const host;
 
 	/** l4 protocol used for pool4 return. */
 	const l4_protocol l4_proto;
+	/** The port (or ICMP identifier) from the IPv6 network. */
+	const __u16 port6;
 
 	/**
 	 * Should the entry never expire?
 	 *
 	 * This field is currently only being used by the userspace app's code. If you want to do
 	 * something else with it, keep in mind that you might face the wrath of concurrence hell,
-	 * because config.c's mutex is the only thing protecting it.
+	 * because config.c's semaphore is the only thing protecting it.
 	 *
 	 * The kernel never needs to know whether the entry is static. Preventing the death of a static
 	 * entry when it runs out of sessions is handled by adding a fake user to refcounter.
 	 */
 	bool is_static;
+	/**
+	 * Was "ipv4"'s port taken from its IPv6 node's port block (as opposed to directly from the
+	 * IPv4 pool)? See pool4_get_block().
+	 */
+	bool in_block;
+	/**
+	 * Bloom filter of the remote IPv4 addresses this entry's sessions have spoken to (two bits per
+	 * address). Lets address-dependent filtering reject strangers without walking the session
+	 * trees. Bits are never cleared, so a hit still has to be confirmed by sessiondb_allow().
+	 */
+	unsigned long remote4_filter;
 
 	/**
 	 * Number of active references to this entry, excluding the ones from the table it belongs to.
@@ -49,10 +83,14 @@ struct bib_entry {
 	 */
 	struct kref refcounter;
 
+	/** Appends this entry to the database's IPv4 hash index. */
+	struct hlist_node hash4_hook;
 	/** Appends this entry to the database's IPv6 index. */
 	struct rb_node tree6_hook;
 	/** Appends this entry to the database's IPv4 index. */
 	struct rb_node tree4_hook;
+	/** Defers the freeing of this entry until the lockless readers are done with it. */
+	struct rcu_head rcu_hook;
 };
 
 /**
@@ -61,6 +99,15 @@ struct bib_entry {
  */
 struct bib_entry *bib_create(struct ipv4_transport_addr *ipv4, struct ipv6_transport_addr *ipv6,
 		bool is_static, l4_protocol l4_proto);
+
+/**
+ * Returns "bib"'s IPv6 transport address in "result".
+ */
+static inline void bib_ipv6(const struct bib_entry *bib, struct ipv6_transport_addr *result)
+{
+	result->l3 = bib->host->addr;
+	result->l4 = bib->port6;
+}
 /**
  * Roughly reverts the work of bib_create() by freeing "bib" from memory. What breaks the symmetry
  * is the return of "bib"'s IPv4 address to the IPv4 pool (the borrow doesn't happen in
@@ -96,6 +143,15 @@ int bib_return(struct bib_entry *bib);
  * this version so the return doesn't try to lock the table again.
  */
 int bib_return_lockless(struct bib_entry *bib);
+/**
+ * Records that a session of "bib" is talking to "remote4". Safe to call concurrently.
+ */
+void bib_add_remote4(struct bib_entry *bib, const struct in_addr *remote4);
+/**
+ * Returns false if "bib" has definitely never had a session involving "remote4".
+ * Returns true if it might have (the caller has to ask the session database to be sure).
+ */
+bool bib_may_know_remote4(struct bib_entry *bib, const struct in_addr *remote4);
 
 
 /** ---------------------- BIB (The database) ----------------------------------- */
@@ -103,8 +159,12 @@ int bib_return_lockless(struct bib_entry *bib);
 /**
  * Initializes the three tables (UDP, TCP and ICMP).
  * Call during initialization for the remaining functions to work properly.
+ *
+ * @param arena_size if nonzero, the memory for this many entries (shared by the three
+ *		tables) is reserved right away and the BIB never holds more than that. Otherwise the
+ *		entries are allocated on demand.
  */
-int bibdb_init(void);
+int bibdb_init(unsigned int arena_size);
 /**
  * Empties the BIB tables, freeing any memory being used by them.
  * Call during destruction to avoid memory leaks.
@@ -131,6 +191,7 @@ int bibdb_get(struct tuple *tuple, struct bib_entry **result);
  * Makes "result" point to the BIB entry from the "l4_proto" table whose IPv4 side (address and
  * port) is "addr".
  *
+ * Doesn't lock the table, so it's cheap enough to call for every inbound packet.
  * It increases "result"'s refcount. Make sure you decrement it when you're done.
  *
  * @param[in] address address and port you want the BIB entry for.
@@ -177,6 +238,16 @@ int bibdb_get_or_create_ipv6(struct sk_buff *skb, struct tuple *tuple, struct bi
  *		memory allocation failed.
  */
 int bibdb_add(struct bib_entry *entry);
+/**
+ * bibdb_add()s the "count" entries from "entries" while taking the table's lock only once. They
+ * must all belong to the same table. Meant for loading many static entries at once.
+ *
+ * The array is sorted in the process. If any of the entries collides with the table (or with
+ * another entry from the array), nothing is added. Otherwise, the first "added" entries from the
+ * (sorted) array made it into the table; this is "count" on success, but can be fewer if an
+ * allocation failed, or two of the entries share an IPv4 transport address.
+ */
+int bibdb_add_bulk(struct bib_entry **entries, unsigned int count, unsigned int *added);
 
 /**
  * Attempts to remove the "entry" entry from its BIB. It doesn't kfree "entry".
@@ -208,6 +279,10 @@ int bibdb_iterate_by_ipv4(l4_protocol l4_proto, struct ipv4_transport_addr *ipv4
  * "l4_proto".
  */
 int bibdb_count(l4_protocol proto, __u64 *result);
+/**
+ * Returns the number of different IPv6 nodes the entries belong to (struct ipv6_host records).
+ */
+__u64 bibdb_count_hosts(void);
 
 /**
  * Returns in "bib" the BIB entry you'd expect from the "tuple" tuple.
@@ -0,0 +1,50 @@
+#ifndef _JOOL_MOD_CHANGELOG_H
+#define _JOOL_MOD_CHANGELOG_H
+
+/**
+ * @file
+ * The change log: the latest BIB and session creations, updates and deletions, each stamped with
+ * a generation number, so pollers can ask for what changed since the generation they last saw
+ * instead of dumping whole tables.
+ *
+ * Generations start at 1 and grow by one per change. The log is a ring of fixed capacity; once it
+ * wraps, the oldest changes are forgotten, and pollers which hadn't seen them yet have to dump the
+ * tables again.
+ *
+ * @author Alberto Leiva
+ */
+
+#include "nat64/comm/config_proto.h"
+
+/**
+ * Creates a log which remembers the latest "capacity" changes. Zero means the log is disabled.
+ * Sleeps.
+ */
+int changelog_init(unsigned int capacity);
+void changelog_destroy(void);
+
+/**
+ * Returns whether changes are being logged; if not, changelog_write() is a no-op.
+ */
+bool changelog_is_enabled(void);
+/**
+ * Stamps "event" with the next generation and logs it. Can be called while holding spinlocks.
+ */
+void changelog_write(struct dbevent_usr *event);
+
+/**
+ * Returns the generation of the latest change (zero if there haven't been any).
+ */
+u64 changelog_generation(void);
+/**
+ * Calls "cb" on every logged change whose generation is greater than "since" and no greater than
+ * "until" (which should come from changelog_generation()), oldest first.
+ * Iteration stops early if "cb" returns nonzero, and that's what this returns.
+ * Returns -ESTALE if some of those changes have already been forgotten (or "since" comes
+ * from an earlier instance of the log), and -EINVAL if the log is disabled.
+ * "cb" runs in atomic context.
+ */
+int changelog_foreach(u64 since, u64 until, int (*cb)(struct changelog_record *, void *),
+		void *arg);
+
+#endif /* _JOOL_MOD_CHANGELOG_H */
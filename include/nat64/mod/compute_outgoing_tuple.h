@@ -12,11 +12,17 @@
  */
 
 #include "nat64/mod/types.h"
+#include "nat64/mod/session_db.h"
 
 /**
  * Computes the addresses of "in"'s opposite layer-3 protocol.
  * "out" is filled with these addresses.
  */
 verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct sk_buff *skb_in);
+/**
+ * Same as compute_out_tuple(), except "in"'s session is already known.
+ */
+void compute_out_tuple_session(struct session_entry *session, struct tuple *in,
+		struct tuple *out);
 
 #endif /* _JOOL_MOD_OUTGOING_H */
@@ -13,6 +13,32 @@
 
 #include <linux/skbuff.h>
 
+/**
+ * Prepares this module for future use.
+ *
+ * @param batch if nonzero, the hooks queue the packets instead of translating them right away, and
+ *		every CPU translates its queue in batches of up to "batch" packets.
+ * @param steer_flows if true, packets are queued in the CPU their remote IPv4 address hashes to
+ *		(instead of the one that received them), so both directions of every session are
+ *		translated by the same CPU. Requires "batch".
+ * @param port_affinity if true, the flows whose ports can be read from their first header are
+ *		steered to the CPU that lent their IPv4 port instead (see pool4_init()). Requires
+ *		"steer_flows".
+ * @param threads if true, every online CPU's queue is drained by a kernel thread bound to it
+ *		("jool/<cpu>") instead of a tasklet, so translation doesn't compete with the rest
+ *		of the softirq work, and the threads can be prioritized and isolated like any other
+ *		task. Requires "batch".
+ * @param busy_poll microseconds the threads keep polling their queues after they empty, before
+ *		they go back to sleep. Trades CPU time for wakeup latency. Requires "threads".
+ */
+int core_init(unsigned int batch, bool steer_flows, bool port_affinity, bool threads,
+		unsigned int busy_poll);
+/**
+ * Frees any memory allocated by this module, and drops the packets still queued.
+ * Unhook first.
+ */
+void core_destroy(void);
+
 /**
  * Assumes "skb" is a IPv6 packet, checks whether it should be NAT64'd and either translates and
  * sends it or does nothing.
@@ -0,0 +1,47 @@
+#ifndef _JOOL_MOD_DB_EVENTS_H
+#define _JOOL_MOD_DB_EVENTS_H
+
+/**
+ * @file
+ * Publishes the creation and deletion of BIB and session entries to the DBEVENTS_GROUP multicast
+ * group of the config module's Netlink socket, so loggers don't need to poll table dumps.
+ *
+ * Events are batched and sent from softirq context a moment later, because they are recorded
+ * while the databases' spinlocks are held. If nobody's listening, recording an event costs a
+ * single check.
+ *
+ * Every event is also appended to the mapping log, exported as IPFIX and kept in the change log,
+ * if they're enabled (see maplog.h, ipfix.h and changelog.h).
+ *
+ * @author Alberto Leiva
+ */
+
+#include <net/sock.h>
+#include "nat64/comm/config_proto.h"
+
+struct bib_entry;
+struct session_entry;
+
+/**
+ * Starts publishing through "nl_socket". Events recorded before this are ignored.
+ */
+int dbevents_init(struct sock *nl_socket);
+/**
+ * Discards the pending events and stops publishing.
+ */
+void dbevents_destroy(void);
+
+/**
+ * Queues the "type" event of "bib" for publishing. "type" is a DBEVENT_BIB_* value.
+ * Can be called while holding spinlocks.
+ */
+void dbevents_bib(enum dbevent_type type, struct bib_entry *bib);
+/**
+ * Queues the "type" event of "session" for publishing. "type" is a DBEVENT_SESSION_* value.
+ * Can be called while holding spinlocks.
+ */
+void dbevents_session(enum dbevent_type type, struct session_entry *session);
+
+void dbevents_get_stats(struct dbevent_stats *result);
+
+#endif /* _JOOL_MOD_DB_EVENTS_H */
@@ -0,0 +1,84 @@
+#ifndef _JOOL_MOD_EAM_H
+#define _JOOL_MOD_EAM_H
+
+/**
+ * @file
+ * The Explicit Address Mapping Table (RFC 7757); the SIIT mode's (see siit.h) way to translate
+ * addresses which do not follow RFC 6052.
+ *
+ * Every entry maps an IPv6 prefix to an IPv4 prefix whose suffix is as long, so the addresses
+ * beneath them pair up one to one. If several entries contain an address, the longest prefix
+ * wins.
+ *
+ * The table is managed in process context only (it sleeps).
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/types.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include "nat64/comm/types.h"
+#include "nat64/comm/config_proto.h"
+
+/**
+ * Readies the rest of this module for future use. The table starts empty.
+ */
+int eamt_init(void);
+/**
+ * Frees resources allocated by the table.
+ */
+void eamt_destroy(void);
+/**
+ * Removes all entries from the table.
+ */
+int eamt_flush(void);
+
+/**
+ * Adds the "count" entries from the "entries" array to the table, as a single transaction (if one
+ * of them cannot be added, none of them are). Copies are stored, not the entries themselves.
+ *
+ * Every call rebuilds the lookup structures, so bulk loads should use as few calls as possible.
+ */
+int eamt_add(struct eam_entry *entries, unsigned int count);
+/**
+ * Removes "entry" from the table.
+ */
+int eamt_remove(struct eam_entry *entry);
+
+/**
+ * Translates "addr6" into its IPv4 counterpart and returns it as "result".
+ *
+ * This is called on every packet, so it doesn't lock; it reads an RCU-published copy of the table,
+ * which indexes both sides in path-compressed tries. A lookup visits at most one node per bit of
+ * the address, and usually far fewer.
+ *
+ * @return zero on success, -ENOENT if no entry contains "addr6".
+ */
+int eamt_xlat_6to4(struct in6_addr *addr6, struct in_addr *result);
+/**
+ * Translates "addr4" into its IPv6 counterpart and returns it as "result".
+ * Same as eamt_xlat_6to4(), this doesn't lock.
+ *
+ * @return zero on success, -ENOENT if no entry contains "addr4".
+ */
+int eamt_xlat_4to6(struct in_addr *addr4, struct in6_addr *result);
+/**
+ * Returns whether any entry contains "addr6".
+ */
+bool eamt_contains6(struct in6_addr *addr6);
+/**
+ * Returns whether any entry contains "addr" (network byte order).
+ */
+bool eamt_contains4(__be32 addr);
+
+/**
+ * Executes the "func" function with the "arg" argument on every entry in the table.
+ */
+int eamt_for_each(int (*func)(struct eam_entry *, void *), void *arg);
+/**
+ * Copies the current number of entries in the table to "result".
+ */
+int eamt_count(__u64 *result);
+
+#endif /* _JOOL_MOD_EAM_H */
@@ -23,7 +23,36 @@ void filtering_destroy(void);
 int filtering_clone_config(struct filtering_config *clone);
 int filtering_set_config(enum filtering_type type, size_t size, void *value);
 
-verdict filtering_and_updating(struct sk_buff *skb, struct tuple *in_tuple);
+/**
+ * Decides whether "skb" should be translated, updating the BIB and session tables accordingly.
+ *
+ * If "session" is not NULL and the packet ended up with a session, it is returned there so step 3
+ * doesn't have to look it up again. ICMP errors, and TCP packets which have a BIB entry but no
+ * session yet, return NULL even on VER_CONTINUE.
+ *
+ * The caller must hold rcu_read_lock_bh(). "session" comes without a reference, so it is only
+ * guaranteed to exist until the caller unlocks (see sessiondb_find()).
+ */
+verdict filtering_and_updating(struct sk_buff *skb, struct tuple *in_tuple,
+		struct session_entry **session);
+/**
+ * Fast path of filtering_and_updating(), for packets whose session already exists.
+ *
+ * If it does, this updates it the way filtering_and_updating() would and returns it in "session"
+ * (same rules as filtering_and_updating()'s). If "session" comes back NULL and the verdict is
+ * VER_CONTINUE, the packet needs the full filtering_and_updating() instead.
+ */
+verdict filtering_established(struct sk_buff *skb, struct tuple *in_tuple,
+		struct session_entry **session);
+/**
+ * filtering_and_updating() for the second pass of a hairpinned packet, except it is run on the
+ * original IPv6 packet "skb" instead of its IPv4 translation. "tuple4" is the translation's tuple.
+ *
+ * Returns -EAGAIN if the second pass needs the actual IPv4 packet; that happens when TCP's CLOSED
+ * state might have to store it (see tcp_closed_v4_syn()). Any other nonzero means drop "skb".
+ * "session" works the same as in filtering_and_updating().
+ */
+int filtering_hairpin(struct sk_buff *skb, struct tuple *tuple4, struct session_entry **session);
 
 
 #endif /* _JOOL_MOD_FILTERING_H */
@@ -34,13 +34,44 @@
 #include "nat64/comm/config_proto.h"
 
 
-int fragdb_init(void);
+/**
+ * Call during initialization for the remaining functions to work properly.
+ *
+ * @param shards number of slices the database should be split into. Buffers are distributed among
+ *		them by hash, and each slice has its own lock, table and timer. 1 is the classic single
+ *		database; 0 means one slice per CPU.
+ */
+int fragdb_init(unsigned int shards);
 
 int fragdb_set_config(enum fragmentation_type type, size_t size, void *value);
 int fragdb_clone_config(struct fragmentation_config *clone);
+void fragdb_get_stats(struct fragmentation_stats *result);
 
-verdict fragdb_handle6(struct sk_buff *skb_in, struct sk_buff **skb_out);
-verdict fragdb_handle4(struct sk_buff *skb_in, struct sk_buff **skb_out);
+/**
+ * Groups "skb_in" with the rest of its fragments, returning VER_STOLEN until they have all arrived.
+ * Unfragmented packets are returned in "skb_out" right away.
+ *
+ * If the "forward_early" option is on, the first fragment of a packet might be returned before its
+ * siblings arrive. The caller has to hand its outgoing tuple to fragdb_remember_tuple(); the
+ * siblings are then returned one by one, and they are the only packets which come out of this
+ * function lacking layer-4 headers. In their case "tuple_out" will contain the tuple they must be
+ * translated with.
+ *
+ * @param tuple_out can be NULL if the caller cannot handle early forwarding.
+ */
+verdict fragdb_handle6(struct sk_buff *skb_in, struct sk_buff **skb_out, struct tuple *tuple_out);
+verdict fragdb_handle4(struct sk_buff *skb_in, struct sk_buff **skb_out, struct tuple *tuple_out);
+/**
+ * Tells the database "skb" (the first fragment of a packet forwarded early) is going to be
+ * translated using "tuple_out". Its siblings which had arrived in the meantime are appended to
+ * "skb"'s list so they can be translated along with it. Does nothing if "skb" is not such a fragment.
+ */
+void fragdb_remember_tuple(struct sk_buff *skb, struct tuple *tuple_out);
+/**
+ * Returns whether first fragment "skb" can be translated without looking at its siblings, which
+ * then become independent packets (the way early forwarding treats them).
+ */
+bool fragdb_is_csum_incremental(struct sk_buff *skb);
 
 void fragdb_destroy(void);
 
@@ -16,7 +16,19 @@
 
 
 bool is_hairpin(struct sk_buff *skb);
+/** Same as is_hairpin(), except it judges by the outgoing tuple, before translating the packet. */
+bool is_hairpin_tuple(struct tuple *tuple_out);
 verdict handling_hairpinning(struct sk_buff *skb_in, struct tuple *tuple_in);
+/**
+ * The part of handling_hairpinning() which does not need the IPv4 packet: runs the second pass'
+ * filtering and tuple computation on "skb", the IPv6 packet the first pass received. "tuple4" is
+ * the tuple of skb's IPv4 translation, and the tuple of the packet that should U-turn is left in
+ * "tuple6" (see translating_the_hairpin_in_place()).
+ *
+ * @return zero on success, -EAGAIN if you should translate "skb" into IPv4 and run
+ *		handling_hairpinning() on the result instead. Anything else means drop "skb".
+ */
+int handling_hairpinning_tuple(struct sk_buff *skb, struct tuple *tuple4, struct tuple *tuple6);
 
 
 #endif /* _JOOL_MOD_HARPINNING_H */
@@ -18,6 +18,7 @@
  * @author Alberto Leiva
  */
 
+#include "nat64/comm/config_proto.h"
 #include "nat64/mod/packet.h"
 
 typedef enum icmp_error_code {
@@ -32,11 +33,29 @@ typedef enum icmp_error_code {
 	ICMPERR_FILTER,
 } icmp_error_code;
 
+/**
+ * Initializes the error limiter.
+ *
+ * @param rate errors each destination is allowed to receive per second. Zero means unlimited.
+ * @param burst errors a destination is allowed to receive in a row. (Zero is treated as one.)
+ */
+int icmp64_init(unsigned int rate, unsigned int burst);
+void icmp64_destroy(void);
+
 /**
  * Wrapper for the icmp_send() and the icmpv6_send() functions.
+ *
+ * The error is not sent right away; it's queued and sent once the current batch of softirq
+ * work is done. Errors exceeding the limiter's rate (or its queue's capacity) are dropped and
+ * counted.
  */
 void icmp64_send(struct sk_buff *skb, icmp_error_code code, __u32 info);
 
+/**
+ * Copies the limiter's counters into "result".
+ */
+void icmp64_get_stats(struct icmp_stats *result);
+
 /**
  * Return the numbers of icmp error that was sent, also reset the static counter
  * This is only used in Unit Testing;
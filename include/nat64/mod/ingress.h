@@ -0,0 +1,28 @@
+#ifndef _JOOL_MOD_INGRESS_H
+#define _JOOL_MOD_INGRESS_H
+
+/**
+ * @file
+ * Optional interception of packets right as chosen interfaces receive them, before the IP stack
+ * (and therefore conntrack and iptables) sees them. Meant for dedicated translators, where the
+ * trip through IP receive before the pre-routing hook is pure overhead.
+ *
+ * The packets the core doesn't want continue up the stack as usual, so the Netfilter hooks still
+ * get to see (and translate) them. The other interfaces are only served by those hooks.
+ *
+ * @author Alberto Leiva
+ */
+
+/**
+ * Starts capturing the packets received by the "count" interfaces named "names". Call once the
+ * core is ready.
+ * Fails if one of them doesn't exist or already has a receive handler (eg. it's a bridge port or
+ * a bonding slave).
+ */
+int ingress_init(char *names[], int count);
+/**
+ * Stops capturing. Safe to call even if ingress_init() captured nothing.
+ */
+void ingress_destroy(void);
+
+#endif /* _JOOL_MOD_INGRESS_H */
@@ -0,0 +1,50 @@
+#ifndef _JOOL_MOD_IPFIX_H
+#define _JOOL_MOD_IPFIX_H
+
+/**
+ * @file
+ * Exports BIB and session creations and deletions, and pool4 exhaustion, as RFC 8158 NAT event
+ * records to an IPFIX (RFC 7011) collector, over UDP.
+ *
+ * Records are appended to a per-CPU datagram under construction, so writing one is a copy into
+ * memory the current CPU already owns. A datagram is handed to a work item once it's full, or once
+ * the export interval lapses, whichever comes first; the work item is the only one that ever
+ * touches the socket. The templates are sent when the exporter starts, and periodically after that
+ * (UDP collectors can come and go).
+ *
+ * @author Alberto Leiva
+ */
+
+#include "nat64/comm/config_proto.h"
+#include "nat64/mod/types.h"
+
+/**
+ * Starts exporting to "collector" (an IPv4 or IPv6 address) on UDP port "port".
+ * Datagrams are at most "size" bytes long, and none of them waits longer than "interval_ms"
+ * milliseconds to be sent. "domain" is the Observation Domain ID of the messages.
+ * NULL "collector" means the exporter is disabled. Sleeps.
+ */
+int ipfix_init(char *collector, unsigned int port, unsigned int size, unsigned int interval_ms,
+		unsigned int domain);
+/**
+ * Sends whatever's pending and stops exporting. Sleeps.
+ */
+void ipfix_destroy(void);
+
+/**
+ * Returns whether records are being exported; if not, the writing functions are no-ops.
+ */
+bool ipfix_is_enabled(void);
+/**
+ * Queues the record of "event". Update events are ignored. Can be called while holding spinlocks.
+ */
+void ipfix_write(struct dbevent_usr *event);
+/**
+ * Queues a record of the "proto" pool4 running out of addresses and ports. Same context as
+ * ipfix_write().
+ */
+void ipfix_pool4_exhausted(l4_protocol proto);
+
+void ipfix_get_stats(struct dbevent_stats *result);
+
+#endif /* _JOOL_MOD_IPFIX_H */
@@ -0,0 +1,40 @@
+#ifndef _JOOL_MOD_KEYED_HASH_H
+#define _JOOL_MOD_KEYED_HASH_H
+
+/**
+ * @file
+ * SipHash-2-4, for the hash tables whose keys come straight from the network.
+ *
+ * jhash with a random seed scatters honest traffic just fine, but it was never meant to resist
+ * somebody who can watch the tables slow down: collisions can be found without knowing the seed,
+ * and then every packet of a flood lands on the same chain. SipHash is a PRF; as long as the key
+ * stays secret, the chains an attacker fills are as random as anybody else's.
+ *
+ * (The kernel has its own SipHash since 4.11, but we still build on kernels much older than that.)
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/types.h>
+
+struct keyed_hash_key {
+	u64 k0;
+	u64 k1;
+};
+
+/**
+ * Fills "key" with random bits. Sleeps (well, it might, early during boot).
+ */
+void keyed_hash_init_key(struct keyed_hash_key *key);
+
+/**
+ * Returns the SipHash-2-4 of the "count" words from "words", keyed by "key".
+ * This is the standard algorithm fed with an 8 * "count" byte message, except the words are taken
+ * in host order; callers only need the hashes to be consistent within this machine.
+ *
+ * Hash table slots should be taken from the lower bits; the upper half is independent enough to
+ * choose something else (eg. a shard).
+ */
+u64 keyed_hash(const struct keyed_hash_key *key, const u64 *words, unsigned int count);
+
+#endif /* _JOOL_MOD_KEYED_HASH_H */
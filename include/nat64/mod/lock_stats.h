@@ -0,0 +1,85 @@
+#ifndef _JOOL_MOD_LOCK_STATS_H
+#define _JOOL_MOD_LOCK_STATS_H
+
+/**
+ * @file
+ * Optional contention accounting of Jool's busiest spinlocks (see enum jool_lock), so we can tell
+ * which database is worth sharding without running lockstat on a debug kernel.
+ *
+ * The databases take their locks through the functions below instead of spin_lock() and friends.
+ * While lock timing is disabled, that costs a patched-out jump (a static key). When enabled, every
+ * acquisition costs a trylock, two local_clock()s and a few per-CPU additions.
+ *
+ * The lock holders must have bottom halves disabled (Jool's always do), and must not nest two
+ * locks of the same kind; the per-CPU acquisition timestamp is shared by every lock of a kind.
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/spinlock.h>
+#include "nat64/comm/config_proto.h"
+#include "nat64/mod/static_key.h"
+
+JOOL_KEY_DECLARE(lock_timing_key);
+#define lock_timing_enabled() jool_key_enabled(lock_timing_key)
+
+void lockstats_lock(spinlock_t *lock, enum jool_lock id);
+void lockstats_unlock(spinlock_t *lock, enum jool_lock id);
+
+/**
+ * spin_lock(), except it accounts for "lock" as an "id" kind of lock.
+ */
+static inline void jool_lock(spinlock_t *lock, enum jool_lock id)
+{
+	if (lock_timing_enabled())
+		lockstats_lock(lock, id);
+	else
+		spin_lock(lock);
+}
+
+static inline void jool_unlock(spinlock_t *lock, enum jool_lock id)
+{
+	if (lock_timing_enabled())
+		lockstats_unlock(lock, id);
+	else
+		spin_unlock(lock);
+}
+
+/**
+ * spin_lock_bh(), except it accounts for "lock" as an "id" kind of lock.
+ */
+static inline void jool_lock_bh(spinlock_t *lock, enum jool_lock id)
+{
+	if (lock_timing_enabled()) {
+		local_bh_disable();
+		lockstats_lock(lock, id);
+	} else {
+		spin_lock_bh(lock);
+	}
+}
+
+static inline void jool_unlock_bh(spinlock_t *lock, enum jool_lock id)
+{
+	if (lock_timing_enabled()) {
+		lockstats_unlock(lock, id);
+		local_bh_enable();
+	} else {
+		spin_unlock_bh(lock);
+	}
+}
+
+/**
+ * Call before anything else initializes (and after everything else is destroyed); the key must not
+ * flip while any of the locks is held.
+ *
+ * @param enabled whether the locks should be timed at all.
+ */
+int lockstats_init(bool enabled);
+void lockstats_destroy(void);
+
+/**
+ * Sums every CPU's counters into "result", an array of JLOCK_COUNT.
+ */
+void lockstats_get(struct lock_stats *result);
+
+#endif /* _JOOL_MOD_LOCK_STATS_H */
@@ -1,42 +1,50 @@
-#ifndef _JOOL_COMM_LOG_TIME_H
-#define _JOOL_COMM_LOG_TIME_H
+#ifndef _JOOL_MOD_LOG_TIME_H
+#define _JOOL_MOD_LOG_TIME_H
 
 /**
  * @file
  * Log file for benchmark purpose.
  *
- * This code is not used during normal translations; we link it only when we want to measure stuff.
+ * Measures how long every packet takes to be translated, if the user enabled it (see
+ * struct logtime_config). Times are counted in per-CPU histograms (see LOGTIME_BUCKETS), so
+ * recording one doesn't allocate or lock anything, and the memory used doesn't grow with the
+ * traffic. The histograms are allocated the first time the module is enabled.
+ *
+ * While it's disabled, the packet path only pays for a patched-out jump (a static key).
  *
  * @author Daniel Hernandez
  */
 
 #include "nat64/mod/types.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/mod/static_key.h"
 
-#include <linux/spinlock.h>
 #include <linux/time.h>
 
-struct log_time_db {
-	struct list_head list;
-	spinlock_t lock;
-};
-
-struct log_node {
-	struct timespec time;
-	struct list_head list_hook;
-};
+JOOL_KEY_DECLARE(logtime_key);
+#define logtime_enabled() jool_key_enabled(logtime_key)
 
 /**
- * Increases the counter of the structure and add to the sum delta time registered.
+ * Adds the time elapsed between "start_time" and "end_time" to the histogram of the
+ * "l3_proto"/"l4_proto" pair. Only call while logtime_enabled().
  */
 int logtime(struct timespec *start_time, struct timespec *end_time, l3_protocol l3_proto,
 		l4_protocol l4_proto);
 /**
- * Iterate over a "struct log_time_db" (which is given by the l3_protocol and l4_protocol) and
- * each iteration do the "func" call and then delete the node.
+ * Copies the histogram of the "l3_proto"/"l4_proto" pair to "result". Doesn't reset it.
+ */
+int logtime_get(l3_protocol l3_proto, l4_protocol l4_proto, struct logtime_usr *result);
+
+int logtime_clone_config(struct logtime_config *clone);
+/**
+ * Turns the measurements on or off. Must not be called concurrently (the config module's
+ * semaphore takes care of that).
+ */
+int logtime_set_config(enum logtime_type type, size_t size, void *value);
+
+/**
+ * Disables the measurements and releases the histograms. Unhook first.
  */
-int logtime_iterate_and_delete(l3_protocol l3_proto, l4_protocol l4_proto,
-		int (*func)(struct log_node *, void *), void *arg);
-int logtime_init(void);
 void logtime_destroy(void);
 
 
@@ -0,0 +1,36 @@
+#ifndef _JOOL_MOD_MAPLOG_H
+#define _JOOL_MOD_MAPLOG_H
+
+/**
+ * @file
+ * The mapping log: every BIB and session creation and deletion, timestamped, written as fixed-size
+ * struct maplog_record's into per-CPU relay buffers.
+ *
+ * The buffers show up as debugfs files named "jool/mappings<cpu>", which a logging daemon can mmap
+ * or read. Writing a record is a lockless copy into the current CPU's buffer; if the daemon falls
+ * behind, new records are dropped (and counted) rather than overwriting the old ones.
+ *
+ * @author Alberto Leiva
+ */
+
+#include "nat64/comm/config_proto.h"
+
+/**
+ * Creates the buffers. Each CPU gets "subbuf_count" sub-buffers of "subbuf_size" bytes.
+ * "subbuf_count" zero means the log is disabled.
+ */
+int maplog_init(size_t subbuf_size, size_t subbuf_count);
+void maplog_destroy(void);
+
+/**
+ * Returns whether records are being written; if not, maplog_write() is a no-op.
+ */
+bool maplog_is_enabled(void);
+/**
+ * Timestamps "event" and appends it to the log. Can be called from any context.
+ */
+void maplog_write(struct dbevent_usr *event);
+
+void maplog_get_stats(struct dbevent_stats *result);
+
+#endif /* _JOOL_MOD_MAPLOG_H */
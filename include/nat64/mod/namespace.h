@@ -0,0 +1,35 @@
+#ifndef _JOOL_MOD_NAMESPACE_H
+#define _JOOL_MOD_NAMESPACE_H
+
+/**
+ * @file
+ * The network namespace Jool lives in. It is the namespace of whoever inserted the module, so a
+ * tenant who modprobes Jool from inside its own namespace gets a translator that routes, listens
+ * to userspace and publishes /proc/net/jool in that namespace only. Packets traversing the hooks
+ * from any other namespace are left alone.
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <net/net_namespace.h>
+
+/**
+ * Grabs a reference to the current process' network namespace. Call before anything that needs
+ * joolns_get().
+ */
+int joolns_init(void);
+void joolns_destroy(void);
+
+/**
+ * Returns the namespace Jool is translating for.
+ */
+struct net *joolns_get(void);
+
+/**
+ * Returns true if "skb" is traversing Jool's namespace (and is therefore Jool's business).
+ */
+bool joolns_owns(struct sk_buff *skb);
+
+#endif /* _JOOL_MOD_NAMESPACE_H */
@@ -4,8 +4,8 @@
 /**
  * @file
  * A dumb buffer that somewhat behaves like a stream (because of the write function).
- * The buffer will eventually become a single Netlink message, so it's not circular and cannot be
- * resized or anything.
+ * The buffer is the Netlink message that will eventually be sent, so it's not circular and cannot
+ * be resized or anything.
  *
  * Specifically intended for the config module's convenience.
  *
@@ -14,21 +14,41 @@
  */
 
 #include "linux/netlink.h"
+#include "nat64/comm/config_proto.h"
 
+/** Smallest capacity nlbuffer_create() falls back to. Plenty for a handful of records. */
 #define NLBUFFER_SIZE NLMSG_DEFAULT_SIZE
+/**
+ * Capacity of the buffers that dump tables, which can be arbitrarily long.
+ * (The userspace app sizes its receive buffer after it; see netlink_request().)
+ */
+#define NLBUFFER_DUMP_SIZE DUMP_MSG_MAX_SIZE
 
 struct nl_buffer {
 	struct sock *socket;
 	struct nlmsghdr *request_hdr;
 
-	unsigned char bytes[NLBUFFER_SIZE];
+	/** The response. NULL once it has been sent. */
+	struct sk_buff *skb;
+	/** "skb"'s Netlink header. */
+	struct nlmsghdr *nl_hdr;
+	/** Bytes written to "skb" so far (not counting "nl_hdr"). */
 	int len;
+	int capacity;
 };
 
 /**
- * Readies "buffer" so data can be written in it.
+ * Allocates a buffer that can hold up to "capacity" bytes, readied so data can be written in it.
+ * If memory is too fragmented for that, the buffer might turn out smaller (though never smaller
+ * than NLBUFFER_SIZE); writers find out through nlbuffer_write() as usual.
+ * Might sleep. Returns NULL on memory allocation failure.
+ */
+struct nl_buffer *nlbuffer_create(struct sock *nl_socket, struct nlmsghdr *nl_hdr,
+		int capacity);
+/**
+ * Reverts nlbuffer_create().
  */
-void nlbuffer_init(struct nl_buffer *buffer, struct sock *nl_socket, struct nlmsghdr *nl_hdr);
+void nlbuffer_free(struct nl_buffer *buffer);
 /**
  * Writes "len" bytes from "data" into "buffer". Watch out for the return values.
  *
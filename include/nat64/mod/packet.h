@@ -12,6 +12,7 @@
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <linux/tcp.h>
+#include <linux/time.h>
 
 #include "nat64/comm/types.h"
 #include "nat64/mod/ipv6_hdr_iterator.h"
@@ -131,6 +132,56 @@ static inline __be16 build_ipv4_frag_off_field(bool df, bool mf, __u16 frag_offs
 	return cpu_to_be16(result);
 }
 
+/**
+ * @{
+ * BIG TCP lets GRO and TSO super-packets grow past the 64 KB the length fields can express; those
+ * write zero in the field, and their actual length can only be inferred from the skb. (That's
+ * Linux 5.19's convention for IPv6 and 6.3's for IPv4.)
+ *
+ * The getters return the length of a packet whose IP header is "hdr", given that the packet is
+ * actually "len" bytes long (header included). The builders return the field that describes "len".
+ */
+#define BIG_PACKET_THRESHOLD 0xFFFFU
+
+static inline unsigned int get_tot_len_ipv4(struct iphdr *hdr, unsigned int len)
+{
+	unsigned int tot_len = be16_to_cpu(hdr->tot_len);
+	return (tot_len == 0 && len > BIG_PACKET_THRESHOLD) ? len : tot_len;
+}
+
+static inline unsigned int get_tot_len_ipv6(struct ipv6hdr *hdr, unsigned int len)
+{
+	unsigned int payload_len = be16_to_cpu(hdr->payload_len);
+	if (payload_len == 0 && len > sizeof(*hdr) + BIG_PACKET_THRESHOLD)
+		return len;
+	return sizeof(*hdr) + payload_len;
+}
+
+static inline __be16 build_tot_len_field(unsigned int len)
+{
+	return (len <= BIG_PACKET_THRESHOLD) ? cpu_to_be16(len) : 0;
+}
+
+static inline __be16 build_payload_len_field(unsigned int len)
+{
+	return (len <= BIG_PACKET_THRESHOLD) ? cpu_to_be16(len) : 0;
+}
+
+/**
+ * Returns true if "skb" is a TCP super-packet too big for its header's length field.
+ * "uncounted" is the part of the header the field doesn't count (zero for IPv4, the fixed header
+ * for IPv6).
+ */
+static inline bool skb_is_big_tcp(struct sk_buff *skb, unsigned int uncounted)
+{
+	return skb_is_gso(skb)
+			&& (skb_shinfo(skb)->gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6))
+			&& skb->len - skb_network_offset(skb) > uncounted + BIG_PACKET_THRESHOLD;
+}
+/**
+ * @}
+ */
+
 /**
  * Returns the size in bytes of "hdr", including options.
  * skbless variant of tcp_hdrlen().
@@ -167,6 +218,13 @@ struct jool_cb {
 	 * Skbs otherwise do not store a layer-4 identifier.
 	 */
 	__u8 l4_proto;
+	/**
+	 * If the packet is IPv6 and has a routing header, offset (from the network header) of the first
+	 * one. Else, this holds 0.
+	 * This is an offset rather than a pointer because it's rarely needed, and the control buffer is
+	 * short on space (this fits in the padding after the protocols).
+	 */
+	__u16 rt_hdr_offset;
 	/**
 	 * Pointer to the packet's payload.
 	 * Because skbs only store pointers to headers.
@@ -183,12 +241,11 @@ struct jool_cb {
 	 * translated. Also used by the packet queue.
 	 */
 	struct sk_buff *original_skb;
-#ifdef BENCHMARK
 	/**
 	 * Log the time in epoch when this skb arrives to jool. For benchmark purpouse.
+	 * Only set while the log time module is enabled (see logtime_enabled()).
 	 */
 	struct timespec start_time;
-#endif
 };
 
 /**
@@ -223,11 +280,11 @@ static inline void skb_set_jcb(struct sk_buff *skb, l3_protocol l3_proto, l4_pro
 	cb->l3_proto = l3_proto;
 	cb->l4_proto = l4_proto;
 	cb->payload = payload;
+	cb->rt_hdr_offset = 0;
 	cb->frag_hdr = fraghdr;
 	cb->original_skb = original_skb;
-#ifdef BENCHMARK
-	cb->start_time = skb_jcb(original_skb)->start_time;
-#endif
+	if (original_skb)
+		cb->start_time = skb_jcb(original_skb)->start_time;
 }
 
 /**
@@ -262,6 +319,15 @@ static inline struct frag_hdr *skb_frag_hdr(struct sk_buff *skb)
 	return skb_jcb(skb)->frag_hdr;
 }
 
+/**
+ * Returns "skb"'s first routing header, or NULL if it doesn't have any (or isn't IPv6).
+ */
+static inline struct ipv6_rt_hdr *skb_rt_hdr(struct sk_buff *skb)
+{
+	__u16 offset = skb_jcb(skb)->rt_hdr_offset;
+	return offset ? (struct ipv6_rt_hdr *) (skb_network_header(skb) + offset) : NULL;
+}
+
 /**
  * Returns the packet Jool started with, which lead to the current "skb".
  */
@@ -358,6 +424,11 @@ int validate_lengths_icmp4(unsigned int len, unsigned int l3_hdr_len);
  * kfrees "skb". The point is, if "skb" is fragmented, it also kfrees the rest of the fragments.
  */
 void kfree_skb_queued(struct sk_buff *skb);
+/**
+ * Same as kfree_skb_queued(), except for packets which were not dropped, but used up (eg. they
+ * were translated). Drop monitors don't count these.
+ */
+void consume_skb_queued(struct sk_buff *skb);
 
 /**
  * Returns "true" if "icmp_type" is defined by RFC 792 to contain a subpacket as payload.
@@ -73,6 +73,12 @@ int pktqueue_add(struct session_entry *session, struct sk_buff *skb);
  * Sends "session"'s reply and removes it from the DB.
  */
 int pktqueue_send(struct session_entry *session);
+/**
+ * Same as pktqueue_send(), for "count" sessions at once. Meant for expirers, which tend to kill
+ * embryonic sessions in bulk; the database is only locked once.
+ * Sessions which aren't holding a packet are ignored.
+ */
+void pktqueue_send_batch(struct session_entry **sessions, unsigned int count);
 /**
  * Removes "session"'s skb from the storage. There will be no ICMP error.
  */
@@ -10,10 +10,81 @@
 
 #include <linux/types.h>
 #include <linux/in.h>
+#include <linux/rcupdate.h>
 #include "nat64/comm/types.h"
 #include "nat64/comm/config_proto.h"
 #include "nat64/mod/poolnum.h"
 
+/**
+ * A range of pool addresses whose ports are not lent on demand, but mapped arithmetically to the
+ * nodes of an IPv6 prefix instead. See pool4_register_det().
+ */
+struct pool4_det {
+	/** The range's first address. */
+	struct in_addr addr;
+	/** Length of the range, as an IPv4 prefix length. */
+	__u8 addr_len;
+	/** The IPv6 nodes this range is mapped to. */
+	struct ipv6_prefix prefix6;
+	/** Length of the prefix that identifies one IPv6 node (subscriber) within "prefix6". */
+	__u8 subscriber_len;
+
+	/** Base 2 logarithm of the number of subscribers that share each address. */
+	unsigned int shift;
+	/** Number of ports (and IDs) each subscriber owns. */
+	unsigned int ports;
+	/** Number of pool4_nodes from this range that are still part of the pool. */
+	unsigned int nodes;
+	/** Appends this range to the pool's list of deterministic ranges. */
+	struct list_head list_hook;
+};
+
+/**
+ * A range of pool addresses that don't get a pool4_node until they're first needed.
+ * See pool4_register_range().
+ */
+struct pool4_range {
+	/** The range's first address. */
+	struct in_addr addr;
+	/** Length of the range, as an IPv4 prefix length. */
+	__u8 addr_len;
+	/** The range's addresses only lend the ports (and IDs) from "port_min" through "port_max". */
+	__u16 port_min;
+	__u16 port_max;
+	/**
+	 * If nonzero, the range's ports are further restricted to the set MAP (RFC 7597) assigns to
+	 * "psid", which is a "psid_len"-bit Port Set Identifier placed "psid_offset" bits into the
+	 * port. See pool4_register_psid().
+	 */
+	__u8 psid_len;
+	__u8 psid_offset;
+	__u16 psid;
+	/** The classes (see enum pool4_class) and/or blocks the port range has room for. */
+	unsigned int lends;
+
+	/** Offset (from "addr") of the next address whose node might not exist yet. */
+	__u32 next;
+	/** Number of the range's addresses that currently have a pool4_node. */
+	__u32 nodes;
+	/** Appends this range to the pool's list of ranges. */
+	struct list_head list_hook;
+};
+
+/**
+ * Sets of ports that are interchangeable as far as the RFC is concerned.
+ * They map to the pool4_node poolnums.
+ */
+enum pool4_class {
+	POOL4_CLASS_UDP_LOW_EVEN,
+	POOL4_CLASS_UDP_LOW_ODD,
+	POOL4_CLASS_UDP_HIGH_EVEN,
+	POOL4_CLASS_UDP_HIGH_ODD,
+	POOL4_CLASS_TCP_LOW,
+	POOL4_CLASS_TCP_HIGH,
+	POOL4_CLASS_ICMP,
+	POOL4_CLASS_COUNT,
+};
+
 /**
  * An address within the pool, along with its ports.
  */
@@ -40,18 +111,55 @@ struct pool4_node {
 	/** The address's ICMP IDs. */
 	struct poolnum icmp_ids;
 
+	/**
+	 * In port block mode (see pool4_init()), the ports and IDs from 1024 onwards are not borrowed
+	 * individually. These contain the indexes of the blocks they're lent in instead, and the
+	 * "high" pools above are left uninitialized.
+	 */
+	struct {
+		struct poolnum udp;
+		struct poolnum tcp;
+		struct poolnum icmp;
+	} blocks;
+
+	/**
+	 * The deterministic range this address belongs to. NULL if the address lends its ports on
+	 * demand. If not NULL, none of the pools above are initialized.
+	 */
+	struct pool4_det *det;
+	/** The range this node was created for. NULL if the address was registered on its own. */
+	struct pool4_range *range;
+
 	/** Indicates whether the node is visible to the application. */
 	bool active;
+	/**
+	 * Links to the pool's per-class lists of addresses that can lend ports dynamically.
+	 * The node is only listed in the classes it has free ports of.
+	 */
+	struct list_head candidate_hooks[POOL4_CLASS_COUNT];
+	/** Defers the node's destruction until the pool's lockless readers are done with it. */
+	struct rcu_head rcu_hook;
 };
 
+/** First port (or ICMP ID) that can be part of a port block. */
+#define POOL4_BLOCK_MIN 1024
+
 /**
  * Readies the rest of this module for future use.
  *
  * @param addr_strs array of strings denoting the IP addresses the pool should start with.
  * @param addr_count size of the "addr_strs" array.
+ * @param block_size if nonzero, the ports and IDs from POOL4_BLOCK_MIN onwards will be lent in
+ *		contiguous blocks of this many (see pool4_get_block()) instead of one by one.
+ * @param randomize whether the ports should be lent in an unpredictable order (true) or
+ *		sequentially (false).
+ * @param per_cpu_ports whether every CPU should prefer lending the ports pool4_port_cpu() maps
+ *		to it, so the IPv4 side of a flow can be steered back to the CPU that created its
+ *		BIB entry.
  * @return result status (< 0 on error).
  */
-int pool4_init(char *addr_strs[], int addr_count);
+int pool4_init(char *addr_strs[], int addr_count, unsigned int block_size, bool randomize,
+		bool per_cpu_ports);
 /**
  * Frees resources allocated by the pool.
  */
@@ -65,10 +173,55 @@ int pool4_flush(void);
  * These elements will then become borrowable through the pool_get* functions.
  */
 int pool4_register(struct in_addr *addr);
+/**
+ * Inserts the "addr"/"addr_len" range of addresses to the pool, in deterministic mode. The ports
+ * from 1024 onwards of these addresses will be divided evenly between the subscribers (the
+ * "subscriber_len" prefixes) of "prefix6", in order. Subscriber number i gets address
+ * "addr" + (i / s) and the i % s'th slice of ports, where s is the number of subscribers per
+ * address.
+ *
+ * Because of this, a subscriber's ports can be computed without the pool keeping track of them,
+ * and an IPv4 transport address can be traced back to its subscriber without logs.
+ *
+ * The addresses can then be pool4_remove()d individually.
+ */
+int pool4_register_det(struct in_addr *addr, __u8 addr_len, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len);
+/**
+ * Inserts the "addr"/"addr_len" range of addresses to the pool. Their ports and IDs will be lent
+ * on demand, like pool4_register()'s, except only the ones from "port_min" through "port_max"
+ * will be used.
+ *
+ * Unlike pool4_register(), this doesn't allocate anything per address; each address gets its
+ * node once something first needs its ports, and the pool4_get_any*() functions only wake up new
+ * addresses once the existing ones run out. Registering a large range is therefore cheap.
+ *
+ * The range can only be removed as a whole (see pool4_remove_range()).
+ */
+int pool4_register_range(struct in_addr *addr, __u8 addr_len, __u16 port_min, __u16 port_max);
+/**
+ * Like pool4_register_range(), except the addresses only lend the ports that belong to the "psid"
+ * Port Set Identifier, the way MAP-T, MAP-E and lw4o6 (RFC 7597, 7599 and 7596) share an address
+ * between several translators: the ones whose "psid_len" bits after the first "psid_offset" equal
+ * "psid", and whose first "psid_offset" bits are not all zero. (If "psid_offset" is zero, the
+ * latter doesn't apply.) Every other port of the addresses is assumed to be someone else's.
+ *
+ * The ports are not listed anywhere; whether a port belongs to the set is computed from its bits.
+ *
+ * Unavailable in port block mode (see pool4_init()).
+ */
+int pool4_register_psid(struct in_addr *addr, __u8 addr_len, __u16 psid, __u8 psid_len,
+		__u8 psid_offset);
 /**
  * Removes the "addr" address (along with its ports and IDs) from the pool.
+ * If "addr" was registered as a single-address range, the range is removed.
  */
 int pool4_remove(struct in_addr *addr);
+/**
+ * Removes the "addr"/"addr_len" range (see pool4_register_range() and pool4_register_psid()) from
+ * the pool.
+ */
+int pool4_remove_range(struct in_addr *addr, __u8 addr_len);
 
 /**
  * Borrows "addr" from the pool. This function will only succeed if the exact combination of
@@ -76,10 +229,15 @@ int pool4_remove(struct in_addr *addr);
  *
  * Also, it won't return the address and port because you already have them in "addr";
  * it will simply return 0 if you can use the combination, and nonzero on failure.
- *
- * Warning: This function is pretty slow. Do not use it during packet processing.
  */
 int pool4_get(l4_protocol l4_proto, struct ipv4_transport_addr *addr);
+/**
+ * pool4_get()s the "count" transport addresses listed in "addrs" (of the protocols listed in
+ * "l4_protos") at once; "results"[i] is the error code of "addrs"[i]. Meant for restoring many
+ * BIB entries (see sync.h), so they don't pay for the pool's lock and cache drain one by one.
+ */
+void pool4_get_bulk(l4_protocol *l4_protos, struct ipv4_transport_addr *addrs, int *results,
+		unsigned int count);
 /**
  * Borrows an acceptable match for "addr" from the pool. That is, it'll borrow the same address as
  * "addr->address", and a similar ID as "addr->l4_id".
@@ -105,30 +263,112 @@ int pool4_get_any_port(l4_protocol proto, const struct in_addr *addr, __u16 *res
  *
  * See pool4_get_match() for a definition of 'similar ID'.
  *
+ * Addresses take turns, but an address that has lent more ports than the next one in line gives
+ * it its turn. Addresses that ran out of suitable ports are not considered at all.
+ *
  * The resulting address-ID will be placed in the outgoing parameter, "result".
  */
 int pool4_get_any_addr(l4_protocol proto, __u16 l4_id, struct ipv4_transport_addr *result);
+/**
+ * Same as pool4_get_any_addr(), except the address is chosen by hashing "addr6" (the subscriber),
+ * so the subscriber's entries share an address even if none of them are alive at the moment.
+ * Falls back to pool4_get_any_addr() if that address has no similar ID left to lend.
+ *
+ * Only the addresses that were added explicitly are hashed to; the ones that belong to ranges
+ * (see pool4_register_range()) are only reached through the fallback.
+ */
+int pool4_get_affine(l4_protocol proto, __u16 l4_id, const struct in6_addr *addr6,
+		struct ipv4_transport_addr *result);
+
+/**
+ * If "addr6" belongs to a deterministic range (see pool4_register_det()), places the first
+ * address and port of the subscriber's slice in "first", and the number of ports in the slice in
+ * "count". Nothing is borrowed; these ports are the subscriber's for as long as the address stays
+ * in the pool.
+ *
+ * Returns -ENOENT if "addr6" is not mapped deterministically.
+ */
+int pool4_get_det(const struct in6_addr *addr6, struct ipv4_transport_addr *first,
+		unsigned int *count);
+
+/**
+ * Returns the number of ports each port block has, or zero if the pool is not lending blocks.
+ */
+unsigned int pool4_get_block_size(void);
+
+/**
+ * Returns the CPU that lends "port" (or ICMP ID) if pool4_init()'s "per_cpu_ports" was set, -1
+ * otherwise. Ports lent in blocks, statically or after the CPU ran out of its own don't actually
+ * come from that CPU; this is only a hint.
+ */
+int pool4_port_cpu(__u16 port);
+/**
+ * Borrows a block of contiguous ports (or IDs) from the pool for the "addr6" subscriber. Prefers
+ * "hint"'s address if it's not NULL, then the address pool4_get_affine() would choose for "addr6".
+ * The block's address and first port will be placed in "result".
+ *
+ * Return the block by pool4_return()ing any of its ports.
+ */
+int pool4_get_block(l4_protocol proto, const struct in_addr *hint, const struct in6_addr *addr6,
+		struct ipv4_transport_addr *result);
 
 /**
  * Returns the address-port combination from "addr" to the pool, so it can be borrowed again later.
+ * If "addr" belongs to a port block, the entire block is returned.
  *
  * Don't sweat it too much if this function fails; the user might have removed the address from the
  * pool.
  */
 int pool4_return(const l4_protocol l4_proto, const struct ipv4_transport_addr *addr);
+/**
+ * Makes the running CPU hold back the ports pool4_return()ed from now on, until
+ * pool4_flush_returns() hands all of them to the pool at once, address by address, under a single
+ * lock. Meant for whoever is about to release lots of BIB entries in one go. The deferred returns
+ * are not validated and always succeed.
+ *
+ * Disables bottom halves until the matching pool4_flush_returns(). Calls can be nested.
+ */
+void pool4_defer_returns(void);
+void pool4_flush_returns(void);
 
 /**
  * Returns whether the "addr" address is part of the pool.
  *
  * This function doesn't care if all of the ports and IDs from "addr" have been borrowed. All it
- * takes for an address to belong to the pool is to have been pool4_register()ed and not
- * pool4_remove()d.
+ * takes for an address to belong to the pool is to have been pool4_register*()ed and not
+ * pool4_remove*()d.
+ *
+ * This is called on every incoming IPv4 packet, so it doesn't lock; it only reads the pool's
+ * RCU-published snapshot.
  */
 bool pool4_contains(__be32 addr);
+/**
+ * Returns true if "addr" is one of the pool's ports (or IDs) and is certainly not lent, which
+ * means no BIB entry can be using it. Returns false if it might be lent, or if the pool can't tell.
+ *
+ * This is meant to turn away unsolicited IPv4 packets before the BIB lookup, so it doesn't lock
+ * either; it tests the port's bit through the snapshot. A port that is being lent at that very
+ * moment might be reported as available, but its BIB entry wouldn't have been found yet anyway.
+ */
+bool pool4_is_available(l4_protocol proto, const struct ipv4_transport_addr *addr);
 /**
  * Executes the "func" function with the "arg" argument on every address in the pool.
  */
 int pool4_for_each(int (*func)(struct pool4_node *, void *), void * arg);
+/**
+ * Executes the "func" function with the "arg" argument on every address in the pool, including
+ * the range addresses that don't have a node.
+ */
+int pool4_for_each_addr(int (*func)(struct in_addr *, void *), void *arg);
+/**
+ * Executes the "func" function with the "arg" argument on the port usage of every address that
+ * lends its ports on demand and has a node. (The range addresses that have no node have not lent
+ * anything; the deterministic ones don't borrow.)
+ *
+ * The counters are kept by the nodes themselves, so this is O(a), where a is the number of
+ * addresses. The ports the CPUs are caching (at most MAG_SIZE per class per CPU) count as borrowed.
+ */
+int pool4_for_each_usage(int (*func)(struct pool4_usage_usr *, void *), void *arg);
 /**
  * Copies the current number of addresses in the pool to "result".
  */
@@ -31,17 +31,26 @@ void pool6_destroy(void);
 int pool6_flush(void);
 
 /**
- * Returns (in "prefix") the pool's prefix corresponding to "addr".
+ * Returns (in "prefix") the pool's prefix corresponding to "addr". If several prefixes contain
+ * "addr", the longest one wins.
  *
  * Because you're not actually borrowing the prefix,
  * - you don't have to return it, and
  * - this function can also be described as a way to infer "addr"'s actual network prefix.
+ *
+ * This is called on every packet, so it doesn't lock; it reads an RCU-published copy of the pool.
  */
 int pool6_get(struct in6_addr *addr, struct ipv6_prefix *prefix);
 /**
  * Returns (in "result") any prefix from the pool.
  */
 int pool6_peek(struct ipv6_prefix *result);
+/**
+ * Same as pool6_peek() followed by addr_4to6(), except the prefix is not copied; "addr4" is
+ * appended to it straight from the RCU-published copy of the pool. Meant for the session
+ * creations triggered by IPv4 packets.
+ */
+int pool6_4to6(const struct in_addr *addr4, struct in6_addr *result);
 /**
  * Returns whether "addr"'s network prefix belongs to the pool.
  */
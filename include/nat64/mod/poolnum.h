@@ -5,37 +5,53 @@
 
 /**
  * A container of numbers other code can borrow.
+ *
+ * The numbers come in runs of "per_run" numbers each. Within a run they are "step" apart, and
+ * each run starts "stride" after the previous one; the first number is "min". The nth number is
+ * represented by the nth bit of "bits", which is set while the number is available.
+ *
+ * Most pools are a single run (min, min + step, min + 2 * step, ...). Several runs describe port
+ * sets such as the ones MAP (RFC 7597) assigns to a PSID.
  */
 struct poolnum {
-	/**
-	 * Container of the numbers in this pool.
-	 * Slots in and ahead of the "next"th slot contain numbers that haven't been borrowed.
-	 * Slots between "next" and "returned" contain plain garbage.
-	 * Slots behind "returned" are numbers that were once borrowed and recently returned.
-	 */
-	u16 *array;
-	/** Length of "array". */
+	/** One bit per number of the pool; set if the number hasn't been borrowed. */
+	unsigned long *bits;
+	/** One bit per word of "bits"; set if the word has at least one available number. */
+	unsigned long *summary;
+	/** Smallest number from the pool. */
+	u16 min;
+	/** Distance between consecutive numbers from the same run. */
+	u16 step;
+	/** Number of numbers in each run. */
+	u32 per_run;
+	/** Distance between the first numbers of consecutive runs. */
+	u32 stride;
+	/** Number of numbers in the pool (ie. length of "bits", in bits). */
 	u32 count;
-	/** The index of the next value that will be retrieved, if the pool still has values. */
+	/** Number of bits currently set in "bits". */
+	u32 available;
+	/** Index of the number poolnum_get_any() will start looking from, if not randomizing. */
 	u32 next;
-	/** The slot where the next returned value will be placed in, but only if "next" is ahead. */
-	u32 returned;
 	/**
-	 * Whether "next" is ahead of "returned". If they point to the same slot, this will tell whether
-	 * the pool is exhausted or if nothing has been retrieved.
-	 * ("returned" is logically never considered to be ahead of "next", even if the latter wraps
-	 * around.)
+	 * Whether poolnum_get_any() should start looking from a random number (true) or lend the
+	 * numbers in order (false).
 	 */
-	bool next_is_ahead;
+	bool randomize;
 };
 
-int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step);
+int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step, bool randomize);
+int poolnum_init_runs(struct poolnum *pool, u16 min, u16 step, u32 per_run, u32 stride, u32 runs,
+		bool randomize);
+int poolnum_init_empty(struct poolnum *pool);
 void poolnum_destroy(struct poolnum *pool);
 
 int poolnum_get_any(struct poolnum *pool, u16 *result);
+int poolnum_get_slice(struct poolnum *pool, unsigned int shift, unsigned int slices,
+		unsigned int slice, u16 *result);
 int poolnum_get(struct poolnum *pool, u16 value);
 int poolnum_return(struct poolnum *pool, u16 value);
 
+bool poolnum_is_available(struct poolnum *pool, u16 value);
 bool poolnum_is_full(struct poolnum *pool);
 bool poolnum_is_empty(struct poolnum *pool);
 
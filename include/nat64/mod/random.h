@@ -9,6 +9,9 @@
  * Thing is, I hate kmallocs due to their unreliability.
  * get_random_bytes() seems to beg for a buffer, so here it is.
  *
+ * There is one buffer per CPU, so this doesn't lock; it is used on the new-flow path (port
+ * randomization) and contending over a global lock there is no fun.
+ *
  * @author Alberto Leiva
  */
 
@@ -12,6 +12,17 @@
  */
 
 #include "linux/rbtree.h"
+#include <linux/prefetch.h>
+
+/**
+ * Starts fetching "node"'s children, so they are (hopefully) in the cache by the time the
+ * comparison against "node" is done and the walk descends into one of them.
+ */
+#define rbtree_prefetch_children(node) \
+	do { \
+		prefetch((node)->rb_left); \
+		prefetch((node)->rb_right); \
+	} while (0)
 
 /**
  * This is just a stock search on a Red-Black tree.
@@ -27,7 +38,10 @@
 		node = (root)->rb_node; \
 		while (node) { \
 			type *entry = rb_entry(node, type, hook_name); \
-			int comparison = compare_fn(entry, expected); \
+			int comparison; \
+			\
+			rbtree_prefetch_children(node); \
+			comparison = compare_fn(entry, expected); \
 			\
 			if (comparison < 0) { \
 				node = node->rb_right; \
@@ -56,7 +70,10 @@
 		/* Figure out where to put new node */ \
 		while (*new) { \
 			type *this = rb_entry(*new, type, hook_name); \
-			int result = compare_fn(this, key); \
+			int result; \
+			\
+			rbtree_prefetch_children(*new); \
+			result = compare_fn(this, key); \
 			\
 			parent = *new; \
 			if (result < 0) { \
@@ -90,7 +107,10 @@
 		/* Figure out where to put new node */ \
 		while (*node) { \
 			type *entry = rb_entry(*node, type, hook_name); \
-			int comparison = compare_cb(entry, expected); \
+			int comparison; \
+			\
+			rbtree_prefetch_children(*node); \
+			comparison = compare_cb(entry, expected); \
 			\
 			parent = *node; \
 			if (comparison < 0) { \
@@ -0,0 +1,22 @@
+#ifndef _JOOL_MOD_REPLAY_H
+#define _JOOL_MOD_REPLAY_H
+
+/**
+ * @file
+ * Pushes packets handed over by userspace (see MODE_REPLAY) through the translator, as if they had
+ * just been received by the loopback device of Jool's namespace. Meant for benchmarking the
+ * loaded module with captured traffic; the translated packets are routed and sent for real.
+ *
+ * @author Alberto Leiva
+ */
+
+#include "nat64/comm/config_proto.h"
+
+/**
+ * Translates the packets listed in "payload" ("len" bytes of struct replay_pkt_usr records), and
+ * tells what happened to them in "result". Returns -EINVAL if "payload" is not a whole number of
+ * records. Process context only.
+ */
+int replay_packets(void *payload, size_t len, struct replay_result_usr *result);
+
+#endif /* _JOOL_MOD_REPLAY_H */
@@ -9,21 +9,41 @@
  * @author Alberto Leiva
  */
 
+#include <linux/compiler.h>
 #include <linux/types.h>
 #include <linux/in.h>
 #include <linux/in6.h>
 #include "nat64/comm/types.h"
 
 
+/**
+ * Generic versions of addr_6to4() and addr_4to6(); they handle every prefix length.
+ * You probably want to call the wrappers below instead.
+ */
+int __addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix, struct in_addr *dst);
+int __addr_4to6(const struct in_addr *src, const struct ipv6_prefix *prefix, struct in6_addr *dst);
+
 /**
  * Translates "src" into a IPv4 address and returns it as "dst".
  *
  * In other words, removes "prefix" from "src". The result will be 32 bits of address.
  * You want to extract "prefix" from the IPv6 pool somehow.
  *
+ * /96 is by far the most common prefix length, so it is inlined and reduced to a single 32-bit
+ * copy. The rest of the lengths take the generic path.
+ *
  * @return error status.
  */
-int addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix, struct in_addr *dst);
+static inline int addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix,
+		struct in_addr *dst)
+{
+	if (likely(prefix->len == 96)) {
+		dst->s_addr = src->s6_addr32[3];
+		return 0;
+	}
+
+	return __addr_6to4(src, prefix, dst);
+}
 
 /**
  * Translates "src" into a IPv6 address and returns it as "dst.
@@ -31,9 +51,24 @@ int addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix, struct in_addr *
  * In other words, adds "prefix" to "src". The result will be 128 bits of address.
  * You want to extract "prefix" from the IPv6 pool somehow.
  *
+ * Same as addr_6to4(), /96 is inlined; it copies the prefix's three words and appends "src"
+ * without clearing "dst" first.
+ *
  * @return error status.
  */
-int addr_4to6(struct in_addr *src, struct ipv6_prefix *prefix, struct in6_addr *dst);
+static inline int addr_4to6(const struct in_addr *src, const struct ipv6_prefix *prefix,
+		struct in6_addr *dst)
+{
+	if (likely(prefix->len == 96)) {
+		dst->s6_addr32[0] = prefix->address.s6_addr32[0];
+		dst->s6_addr32[1] = prefix->address.s6_addr32[1];
+		dst->s6_addr32[2] = prefix->address.s6_addr32[2];
+		dst->s6_addr32[3] = src->s_addr;
+		return 0;
+	}
+
+	return __addr_4to6(src, prefix, dst);
+}
 
 
 #endif /* _JOOL_MOD_RFC6052_H */
@@ -32,7 +32,8 @@ int sendpkt_set_config(enum sendpkt_type type, size_t size, void *value);
  * One-liner for filling up a 'flowi' and then calling the kernel's IPv4 routing function.
  *
  * Routes the skb described by the arguments. Returns the 'destination entry' the kernel needs
- * to know which interface the skb should be forwarded through.
+ * to know which interface the skb should be forwarded through. Goes through the same per-CPU
+ * cache sendpkt_route4_cached() does.
  *
  * This function assumes "skb" isn't fragmented.
  */
@@ -43,6 +44,75 @@ int sendpkt_route4(struct sk_buff *skb);
  */
 int sendpkt_route6(struct sk_buff *skb);
 
+/**
+ * Routes a packet whose headers are "hdr_ip" and "l4_hdr" instead of the ones "skb" contains.
+ * The resulting destination entry is placed in "result"; "skb" is only queried for its mark,
+ * layer-4 protocol and stats, and is not modified.
+ *
+ * This is the way to route a packet before its headers have been written into the skb.
+ */
+int __sendpkt_route4(struct sk_buff *skb, struct iphdr *hdr_ip, void *l4_hdr,
+		struct dst_entry **result);
+/**
+ * Same as __sendpkt_route4(), except for IPv6.
+ */
+int __sendpkt_route6(struct sk_buff *skb, struct ipv6hdr *hdr_ip, void *l4_hdr,
+		struct dst_entry **result);
+
+/**
+ * Remembers the last route found by sendpkt_route4_cached() or sendpkt_route6_cached(), so a
+ * batch of packets headed to the same place needs a single lookup.
+ *
+ * Only the fields Linux's routing actually looks at are compared (ie. not the ports or the flow
+ * label).
+ */
+struct sendpkt_route_cache {
+	struct dst_entry *dst;
+	/** dst_check()'s argument; tells whether "dst" is still the current route. */
+	__u32 cookie;
+	l3_protocol l3_proto;
+	__u8 l4_proto;
+	__u8 tos;
+	__u32 mark;
+	union {
+		__be32 daddr4;
+		struct {
+			struct in6_addr saddr;
+			struct in6_addr daddr;
+		} addr6;
+	};
+};
+
+void sendpkt_route_cache_init(struct sendpkt_route_cache *cache);
+/**
+ * Releases the route "cache" holds.
+ */
+void sendpkt_route_cache_flush(struct sendpkt_route_cache *cache);
+
+/**
+ * Same as __sendpkt_route4(), except the route is picked from "cache" if it's there, and stored in
+ * there otherwise. "cache" can be NULL.
+ *
+ * Behind "cache", every CPU also keeps a small table of the routes it found lately, so only the
+ * first packet headed to a destination (and the first one after the route changes) needs a lookup
+ * in the routing table.
+ */
+int sendpkt_route4_cached(struct sk_buff *skb, struct iphdr *hdr_ip, void *l4_hdr,
+		struct sendpkt_route_cache *cache, struct dst_entry **result);
+/**
+ * Same as sendpkt_route4_cached(), except for IPv6.
+ */
+int sendpkt_route6_cached(struct sk_buff *skb, struct ipv6hdr *hdr_ip, void *l4_hdr,
+		struct sendpkt_route_cache *cache, struct dst_entry **result);
+
+/**
+ * Returns the length IPv6 packets routed through "dst" have to fit in: the user's minimum IPv6
+ * MTU, or "dst"'s path MTU if the kernel knows it's smaller. "dst" can be NULL.
+ *
+ * Bigger packets are fragmented by sendpkt_send() if they're allowed to be.
+ */
+unsigned int sendpkt_ipv6_mtu(struct dst_entry *dst);
+
 /**
  * Puts "skb" on the network.
  *
@@ -29,9 +29,14 @@ struct expire_timer;
  * Please note that modifications to this structure may need to cascade to
  * "struct session_entry_usr".
  *
- * TODO (performance) this structure is somewhat big (probably 128+ bytes) and there will be lots
- * of sessions in memory. Maybe turn l4_proto into a single-byte integer and remove some of the
- * transport addresses (since they can be extracted from bib).
+ * There will be lots of these in memory, so mind the layout:
+ * - The first cache line holds what the lookups compare against (the transport addresses and
+ *   local6_prefix) and update_time.
+ * - The next few words hold the rest of what the packet path touches (the hash chains, the
+ *   refcounter, the TCP state and the expirer).
+ * - The remaining fields are only needed by writers.
+ * session_init() refuses to compile if this layout stops fitting into SESSION_ENTRY_BUDGET bytes,
+ * and starts every entry at the beginning of a cache line.
  */
 struct session_entry {
 	/**
@@ -43,9 +48,12 @@ struct session_entry {
 	 * We've decided to rename the "Source" address the "Remote" address. The "Destination" address
 	 * is here the "Local" address.
 	 * "Local" and "Remote" as in, from the NAT64's perspective.
+	 *
+	 * The local address is not stored; it's always remote4 prefixed by one of the pool6
+	 * prefixes, so the entry only remembers which one (see local6_prefix). Use session_local6()
+	 * to get it.
 	 */
 	const struct ipv6_transport_addr remote6;
-	const struct ipv6_transport_addr local6;
 
 	/**
 	 * IPv4 version of the connection.
@@ -59,15 +67,16 @@ struct session_entry {
 	 */
 	const struct ipv4_transport_addr local4;
 	const struct ipv4_transport_addr remote4;
+	/** Index of the pool6 prefix the local IPv6 address is built with. See session_local6(). */
+	const __u8 local6_prefix;
 
 	/** Jiffy (from the epoch) this session was last updated/used. */
 	unsigned long update_time;
 
-	/**
-	 * Owner bib of this session. Used for quick access during removal.
-	 * (when the session dies, the BIB might have to die too.)
-	 */
-	struct bib_entry *const bib;
+	/** Appends this entry to the database's IPv6 hash index. */
+	struct hlist_node hash6_hook;
+	/** Appends this entry to the database's IPv4 hash index. */
+	struct hlist_node hash4_hook;
 
 	/**
 	 * Number of active references to this entry, including the ones from the table it belongs to.
@@ -75,22 +84,50 @@ struct session_entry {
 	 */
 	struct kref refcounter;
 	/**
-	 * Chainer to one of the expiration timer lists (sessions_udp, sessions_tcp_est, etc).
-	 * Used for iterating while looking for expired sessions.
+	 * Transport protocol of the table this entry is in (an l4_protocol; stored in a byte so it can
+	 * share a word with the refcounter).
+	 * Used to know which table the session should be removed from when expired.
 	 */
-	struct list_head expire_list_hook;
+	const __u8 l4_proto;
+	/** Current TCP state. Only relevant if l4_proto == L4PROTO_TCP. */
+	u_int8_t state;
+	/** Admission control counter this session is charged to. See admit(). */
+	__u16 prefix_slot;
+	/** Minute (from the epoch) the session was created in. See age_charge(). */
+	__u32 birth;
+
 	/**
 	 * Expiration timer who is supposed to delete this session when its death time is reached.
 	 */
 	struct expire_timer *expirer;
+
 	/**
-	 * Transport protocol of the table this entry is in.
-	 * Used to know which table the session should be removed from when expired.
+	 * Owner bib of this session. Used for quick access during removal.
+	 * (when the session dies, the BIB might have to die too.)
 	 */
-	const l4_protocol l4_proto;
-
-	/** Current TCP state. Only relevant if l4_proto == L4PROTO_TCP. */
-	u_int8_t state;
+	struct bib_entry *const bib;
+	/**
+	 * Where "expirer" remembers this session, in the slot it was last queued in.
+	 * Only meaningful while "expirer" is not NULL.
+	 */
+	struct session_entry **slot_entry;
+
+	union {
+		/**
+		 * Chainer to the lists of sessions which are on their way out of the database (the
+		 * ones waiting for a probe and the ones waiting to be released). The expirers don't
+		 * use it; they remember their sessions through "slot_entry".
+		 */
+		struct list_head expire_list_hook;
+		/**
+		 * Used to defer the entry's release until lockless readers of the indexes are done with
+		 * it. See session_release().
+		 * By then the entry is no longer in any of those lists, so it can reuse the list
+		 * hook's space. (The index hooks cannot be reused; the lockless readers walk
+		 * through them.)
+		 */
+		struct rcu_head rcu_hook;
+	};
 
 	/** Appends this entry to the database's IPv6 index. */
 	struct rb_node tree6_hook;
@@ -98,10 +135,19 @@ struct session_entry {
 	struct rb_node tree4_hook;
 };
 
+/**
+ * Maximum size a session entry is allowed to have: three cache lines.
+ * At the time of writing, it's 184 bytes on x86_64 (it used to be 208, then 192, then 176), which
+ * the allocator rounds up to 192, so a gigabyte fits roughly 5.6 million sessions.
+ */
+#define SESSION_ENTRY_BUDGET (3 * 64)
+
 /**
  * Allocates and initializes a session entry.
  *
  * The entry is generated in dynamic memory; remember to session_return() it or pass it along.
+ * "local6" has to be "remote4" embedded in some RFC 6052 prefix (since the entry doesn't store it
+ * anyway). If it's not, or there are already too many prefixes, the result is NULL.
  */
 struct session_entry *session_create(const struct ipv6_transport_addr *remote6,
 		const struct ipv6_transport_addr *local6,
@@ -109,6 +155,13 @@ struct session_entry *session_create(const struct ipv6_transport_addr *remote6,
 		const struct ipv4_transport_addr *remote4,
 		l4_protocol l4_proto, struct bib_entry *bib);
 
+/**
+ * Returns the local IPv6 transport address of "session" in "result".
+ * "session" only stores an index to the prefix, so this rebuilds the address on the spot; copy
+ * it once if you need it several times.
+ */
+void session_local6(const struct session_entry *session, struct ipv6_transport_addr *result);
+
 /**
  * Marks "session" as being used by the caller. The idea is to prevent the cleaners from deleting
  * it while it's being used.
@@ -143,8 +196,23 @@ enum session_timer_type {
 
 /**
  * Call during initialization for the remaining functions to work properly.
+ *
+ * @param shards number of slices the database should be split into. Sessions are distributed among
+ *		them by remote IPv6 address, and each slice has its own locks, indexes and timers. 1 is the
+ *		classic single database; 0 means one slice per CPU.
+ * @param arena_size if nonzero, the memory for this many sessions is reserved right away and
+ *		the database never holds more than that. Otherwise the sessions are allocated on
+ *		demand.
+ * @param flow_cache whether each CPU should remember the sessions its latest lookups found, so
+ *		packets of the same flows can skip the hash indexes. Costs 32 KB per CPU.
+ * @param counters whether the sessions should count the packets and bytes they translate (see
+ *		session_count()). Costs 16 bytes per session and 4 KB per CPU.
+ * @param shrink whether the kernel may take idle sessions away when it runs low on memory. The
+ *		oldest UDP and ICMP sessions go first, then the embryonic and transitory TCP ones;
+ *		established TCP sessions are left alone. Ignored if there's an arena.
  */
-int sessiondb_init(void);
+int sessiondb_init(unsigned int shards, unsigned int arena_size, bool flow_cache,
+		bool counters, bool shrink);
 /**
  * Call during destruction to avoid memory leaks.
  */
@@ -154,6 +222,18 @@ void sessiondb_destroy(void);
  * Copies the current configuration of the session database to "clone".
  */
 int sessiondb_clone_config(struct sessiondb_config *clone);
+
+/**
+ * Copies this module's admission control, purge and probe counters to "result".
+ */
+void sessiondb_get_stats(struct sessiondb_stats *result);
+/**
+ * Fills the session fields of "result" (everything but the BIB counts).
+ *
+ * The counters behind them are maintained as sessions come and go, so this doesn't walk the tables;
+ * it's O(s), where s is the number of shards.
+ */
+void sessiondb_get_occupancy(struct occupancy_usr *result);
 /**
  * Updates the configuration value of this module whose identifier is "type".
  *
@@ -175,13 +255,25 @@ int sessiondb_set_config(enum sessiondb_type type, size_t size, void *value);
  *
  * Make sure you decrement the refcount (session_return()) when you're done.
  *
+ * The lookup does not lock the table unless it collides with a writer, so it is safe to call from
+ * any number of CPUs at the same time.
+ *
  * @param[in] tuple summary of the packet. Describes the session you need.
  * @param[out] result the session entry you'd expect from the "tuple" tuple.
  * @return error status.
  *
- * O(log n), where n is the number of entries in the table.
+ * O(1) on average.
  */
 int sessiondb_get(struct tuple *tuple, struct session_entry **result);
+/**
+ * Same as sessiondb_get(), except the refcount is left alone. Meant for the packet path, which
+ * would otherwise bounce the session's cache line between CPUs on every packet.
+ *
+ * The caller must hold rcu_read_lock_bh(), and "result" is only guaranteed to exist until the
+ * caller unlocks it. (Sessions are freed one grace period after their last reference goes away.)
+ * Take a reference (session_get()) if it needs to outlive that.
+ */
+int sessiondb_find(struct tuple *tuple, struct session_entry **result);
 
 /**
  * @{
@@ -203,6 +295,17 @@ int sessiondb_get_or_create_ipv4(struct tuple *tuple, struct bib_entry *bib,
  * @}
  */
 
+/**
+ * Returns in "result" the already existing session described by "tuple", refreshing its timer if
+ * it's UDP or ICMP (TCP sessions are left to sessiondb_tcp_state_machine()).
+ *
+ * Unlike the get_or_create functions, this doesn't need the session's BIB entry, so established
+ * flows can skip the BIB lookup altogether. Returns -ENOENT if the session doesn't exist.
+ *
+ * Like sessiondb_find(), this doesn't reserve a reference; the caller must hold rcu_read_lock_bh().
+ */
+int sessiondb_get_established(struct tuple *tuple, struct session_entry **result);
+
 /**
  * Normally looks ups an entry, except it ignores "tuple"'s source port.
  * Returns "true" if such an entry could be found, "false" otherwise.
@@ -213,14 +316,15 @@ int sessiondb_get_or_create_ipv4(struct tuple *tuple, struct bib_entry *bib,
  *
  * Only works while translating from IPv4 to IPv6. Behavior is undefined otherwise.
  *
+ * @param bib the BIB entry "tuple" was matched to. Only its shard is searched.
  * @param tuple summary of the packet.
  * @return whether there's a session entry with a source IPv4 transport address equal to "tuple"'s
  *		IPv4 destination transport address, and destination IPv4 address equal to "tuple"'s source
  *		address.
  *
- * O(log n), where n is the number of entries in the table.
+ * O(log n), where n is the number of entries in the BIB's shard.
  */
-bool sessiondb_allow(struct tuple *tuple);
+bool sessiondb_allow(struct bib_entry *bib, struct tuple *tuple);
 
 /**
  * Adds "session" to the database. Make sure you initialized "session" using session_create(),
@@ -233,29 +337,54 @@ bool sessiondb_allow(struct tuple *tuple);
  */
 int sessiondb_add(struct session_entry *session, enum session_timer_type timer_type);
 
+/**
+ * Sets "session"'s TCP state to "state" and refreshes it, moving it to the "timer_type" timer.
+ * Meant for sessions learned from a peer (see sync.h), since those don't see their own packets.
+ *
+ * @return -ENOENT if "session" is no longer in the database.
+ */
+int sessiondb_sync_state(struct session_entry *session, u_int8_t state,
+		enum session_timer_type timer_type);
+
+/**
+ * Removes "session" from the database right away, regardless of its timer.
+ *
+ * @return -ENOENT if "session" had already been removed.
+ */
+int sessiondb_delete(struct session_entry *session);
+
 /**
  * Runs the "func" function for every session in the session table whose l4-protocol is "proto".
  * It sends each entry and "arg" to every call of "func".
  *
+ * If the database is sharded, the entries are visited one shard at a time, so they are not sorted.
+ *
  * O(n), where n is the number of entries in the table.
  * Warning: This locks the table while you're iterating. You want to quit early if the tree is big.
  */
 int sessiondb_for_each(l4_protocol proto, int (*func)(struct session_entry *, void *), void *arg);
 
 /**
- * Similar to sessiondb_for_each(), except it only runs the function for sessions whose local IPv4
- * transport addresses are "addr".
+ * Similar to sessiondb_for_each(), except it walks the sessions in IPv4 order (local address first,
+ * then remote address) and only runs the function for the ones that match "filter" (NULL matches
+ * everything). Unless "starting" is true, iteration resumes after the session whose IPv4 addresses
+ * are "local4" and "remote4".
  *
- * O(n), where n is the number of entries in the table whose local IPv4 addresses are "addr".
- * Warning: This locks the table while you're iterating. You want to quit early if the tree is big.
+ * If "filter" wants a particular pool4 address (and port range), the walk jumps straight to the
+ * sessions that can match and stops right after them, so it's O(log n + m) where m is the number
+ * of such sessions. Otherwise it's O(n), because no index is sorted by anything else.
+ * The shards are merged, but only one of them is locked at a time, and only for a few sessions at
+ * a time, so sessions that are added or removed during the walk might or might not be visited.
+ * "func" runs with the session's table locked. You want to quit early if the tree is big.
  */
-int sessiondb_iterate_by_ipv4(l4_protocol proto, struct ipv4_transport_addr *addr, bool starting,
+int sessiondb_iterate_by_ipv4(l4_protocol proto, struct session_filter *filter,
+		struct ipv4_transport_addr *local4, struct ipv4_transport_addr *remote4, bool starting,
 		int (*func)(struct session_entry *, void *), void *arg);
 
 /**
  * Returns in "result" the number of sessions in the table whose l4-protocol is "proto".
  *
- * O(1).
+ * O(s), where s is the number of shards.
  */
 int sessiondb_count(l4_protocol proto, __u64 *result);
 
@@ -269,21 +398,23 @@ int sessiondb_delete_by_bib(struct bib_entry *bib);
 /**
  * Deletes from the database the session entries whose local IPv4 addresses are "addr4".
  *
- * O(n), where n is the number of entries in the DB whose local IPv4 addresses are "addr4".
+ * The sessions are removed later, in batches, by a workqueue; this function only queues the job.
+ * The packet path stops finding them right away, though.
  */
 int sessiondb_delete_by_ipv4(struct in_addr *addr4);
 
 /**
  * Deletes from the database the session entries whose local IPv6 addresses contain "prefix".
  *
- * O(n), where n is the number of entries in the DB whose local IPv6 addresses contain "prefix".
+ * Asynchronous, like sessiondb_delete_by_ipv4().
  */
 int sessiondb_delete_by_ipv6_prefix(struct ipv6_prefix *prefix);
 
 /**
  * Empties the entire database.
  *
- * O(n), where n is the number of entries in the entire database.
+ * Asynchronous, like sessiondb_delete_by_ipv4(), except the sessions remain usable until the
+ * workqueue reaches them.
  */
 int sessiondb_flush(void);
 
@@ -300,6 +431,11 @@ void set_syn_timer(struct session_entry *session);
  * unfeasible.
  */
 int sessiondb_tcp_state_machine(struct sk_buff *skb, struct session_entry *session);
+/**
+ * Same as sessiondb_tcp_state_machine(), except "skb" is a hairpinned IPv6 packet and "session" is
+ * its second pass' session, so "skb" is treated as if it had arrived through the IPv4 side.
+ */
+int sessiondb_tcp_state_machine_hairpin(struct sk_buff *skb, struct session_entry *session);
 
 /**
  * Returns in "result" the amount of jiffies "session" is supposed to stay in memory.
@@ -308,4 +444,24 @@ int sessiondb_tcp_state_machine(struct sk_buff *skb, struct session_entry *sessi
  */
 int sessiondb_get_timeout(struct session_entry *session, unsigned long *result);
 
+/**
+ * Spends one of the session creations "remote6"'s prefix is allowed per second (see
+ * sessiondb_config.session_rate_per_prefix). Returns -ENOSPC if the prefix has none left; the
+ * packet should then be dropped before the BIB and pool4 are bothered.
+ *
+ * Lockless; two prefixes which hash to the same slot share their allowance.
+ */
+int sessiondb_admit_rate(const struct ipv6_transport_addr *remote6);
+
+/**
+ * Adds a packet of "len" bytes to "session"'s traffic counters, if sessiondb_init() was asked to
+ * keep them. Most calls only write to memory the running CPU owns.
+ */
+void session_count(struct session_entry *session, unsigned int len);
+/**
+ * Returns in "packets" and "bytes" the traffic "session" has been session_count()ed so far.
+ * Zero if the counters are disabled.
+ */
+void session_get_counters(struct session_entry *session, __u64 *packets, __u64 *bytes);
+
 #endif /* _JOOL_MOD_SESSION_DB_H */
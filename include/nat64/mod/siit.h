@@ -0,0 +1,52 @@
+#ifndef _JOOL_MOD_SIIT_H
+#define _JOOL_MOD_SIIT_H
+
+/**
+ * @file
+ * Stateless translation (RFC 6145), which the module performs instead of the NAT64 algorithm when
+ * it's inserted with siit=1.
+ *
+ * The packets go through the same pipeline (see core.c), except Filtering and Updating is skipped
+ * and the outgoing tuple is not taken from a session; each address is translated on its own, by
+ * the EAMT (eam.h) if one of its entries contains it, or by RFC 6052 and pool6 otherwise.
+ * Ports and ICMP identifiers are left untouched.
+ *
+ * IPv4 packets are translated if their destination belongs to the EAMT or pool4 (which, in this
+ * mode, is the set of IPv4 addresses that RFC 6052 maps into the IPv6 side). IPv6 packets are
+ * translated if their destination belongs to the EAMT or pool6.
+ *
+ * @author Alberto Leiva
+ */
+
+#include "nat64/mod/types.h"
+#include "nat64/mod/packet.h"
+#include "nat64/mod/static_key.h"
+
+JOOL_KEY_DECLARE(siit_key);
+#define siit_enabled() jool_key_enabled(siit_key)
+
+/**
+ * Call before the hooks are registered (and after they are unregistered); the mode must not flip
+ * while packets are being translated.
+ *
+ * @param enabled whether the module should translate statelessly.
+ */
+int siit_init(bool enabled);
+void siit_destroy(void);
+
+/**
+ * Returns whether an IPv4 packet headed to "addr" (network byte order) should be translated.
+ */
+bool siit_owns4(__be32 addr);
+/**
+ * Returns whether an IPv6 packet headed to "addr" should be translated.
+ */
+bool siit_owns6(struct in6_addr *addr);
+
+/**
+ * SIIT's replacement for compute_out_tuple(): translates "in"'s addresses into "out".
+ * Drops "skb" if one of them cannot be translated.
+ */
+verdict siit_compute_out_tuple(struct tuple *in, struct tuple *out, struct sk_buff *skb);
+
+#endif /* _JOOL_MOD_SIIT_H */
@@ -0,0 +1,67 @@
+#ifndef _JOOL_MOD_STAGE_STATS_H
+#define _JOOL_MOD_STAGE_STATS_H
+
+/**
+ * @file
+ * Optional per-stage cost accounting of the translation pipeline, so a slowdown can be pinned on
+ * the session lookup, the translation or the routing instead of on "Jool".
+ *
+ * While it's disabled, timing a stage costs a patched-out jump (a static key), so the calls can
+ * stay in the packet path. When enabled, every stage of every packet costs two local_clock()s and
+ * two per-CPU additions.
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/sched.h>
+#include <linux/skbuff.h>
+#include "nat64/comm/config_proto.h"
+#include "nat64/mod/static_key.h"
+
+JOOL_KEY_DECLARE(stage_timing_key);
+#define stage_timing_enabled() jool_key_enabled(stage_timing_key)
+
+/**
+ * The measurement of a packet's trip through one or more consecutive stages.
+ */
+struct stage_timer {
+	/** When the current stage started, in local_clock() time. */
+	u64 start;
+	/** The packet's kind; see STAGE_PROTOS. Negative if it doesn't have one. */
+	int proto;
+};
+
+void stagestats_begin(struct stage_timer *timer, struct sk_buff *skb);
+void stagestats_add(struct stage_timer *timer, enum pipeline_stage stage);
+
+/**
+ * Starts timing "skb"'s next stage.
+ */
+static inline void stage_start(struct stage_timer *timer, struct sk_buff *skb)
+{
+	if (stage_timing_enabled())
+		stagestats_begin(timer, skb);
+}
+
+/**
+ * Charges the time since stage_start() (or the last stage_end()) to "stage". The next stage's
+ * time starts counting right away, so consecutive stages need just one stage_start().
+ */
+static inline void stage_end(struct stage_timer *timer, enum pipeline_stage stage)
+{
+	if (stage_timing_enabled())
+		stagestats_add(timer, stage);
+}
+
+/**
+ * @param enabled whether the stages should be timed at all.
+ */
+int stagestats_init(bool enabled);
+void stagestats_destroy(void);
+
+/**
+ * Sums every CPU's counters into "result".
+ */
+void stagestats_get(struct pipeline_stats *result);
+
+#endif /* _JOOL_MOD_STAGE_STATS_H */
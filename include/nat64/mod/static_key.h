@@ -0,0 +1,38 @@
+#ifndef _JOOL_MOD_STATIC_KEY_H
+#define _JOOL_MOD_STATIC_KEY_H
+
+/**
+ * @file
+ * Switches of the optional features the packet path has to ask about on every packet.
+ *
+ * Where the kernel has static keys, a switch is one, so asking about a disabled feature costs a
+ * patched-out jump. Older kernels lack static keys; there, a switch falls back to a plain flag.
+ *
+ * Switches are not reference counted on the older kernels, so every jool_key_enable() has to be
+ * paired with exactly one jool_key_disable().
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/version.h>
+#include <linux/compiler.h>
+#include <linux/types.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
+#include <linux/jump_label.h>
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
+#define JOOL_KEY_DECLARE(name) extern struct static_key name
+#define JOOL_KEY_DEFINE(name) struct static_key name = STATIC_KEY_INIT_FALSE
+#define jool_key_enabled(name) static_key_false(&(name))
+#define jool_key_enable(name) static_key_slow_inc(&(name))
+#define jool_key_disable(name) static_key_slow_dec(&(name))
+#else
+#define JOOL_KEY_DECLARE(name) extern bool name
+#define JOOL_KEY_DEFINE(name) bool name
+#define jool_key_enabled(name) unlikely(name)
+#define jool_key_enable(name) ((name) = true)
+#define jool_key_disable(name) ((name) = false)
+#endif
+
+#endif /* _JOOL_MOD_STATIC_KEY_H */
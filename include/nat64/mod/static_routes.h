@@ -18,6 +18,15 @@
  * @return success status as a unix error code.
  */
 int add_static_route(struct request_bib *req);
+/**
+ * Adds the "count" static entries described by "requests", as a single transaction (if one of
+ * them cannot be added, none of them are).
+ *
+ * If they are all of the same protocol (which is what the userspace app's batches look like), the
+ * ports are reserved and the entries are indexed in bulk, taking each lock once instead of once
+ * per entry.
+ */
+int add_static_routes(struct request_bib *requests, unsigned int count);
 
 /**
  * Mainly deletes static entries from the BIB. It can also remove dynamic entries, though.
@@ -3,20 +3,46 @@
 
 /**
  * @file
- * A wrapper for the kernel's stat functions.
+ * A wrapper for the kernel's stat functions, and Jool's own counters.
  *
- * This exists because, based on experience, we can't really afford the assumptions that led to
- * those functions lacking argument validations.
+ * The wrapper exists because, based on experience, we can't really afford the assumptions that led
+ * to those functions lacking argument validations.
+ *
+ * The kernel's counters only say that something was dropped; Jool's (see enum jool_stat) say why.
+ * They are per-CPU, and can be read through `jool --stats` and /proc/net/jool.
  *
  * @author Alberto Leiva
  * @author Daniel Hernandez
  */
 
 #include <linux/skbuff.h>
+#include "nat64/comm/config_proto.h"
 
 /**
  * Wrapper for both IP6_INC_STATS_BH() and IP_INC_STATS_BH().
  */
 void inc_stats(struct sk_buff *skb, int field);
 
+/**
+ * Increments Jool's "field" counter. Safe in any context.
+ */
+void inc_jool_stats(enum jool_stat field);
+/**
+ * Sums every CPU's counters into "result".
+ */
+void jool_stats_get(struct jool_stats_usr *result);
+
+/**
+ * Charges "bytes" to the "field" subsystem's memory (negative "bytes" gives them back).
+ * Safe in any context; the charge and its refund can happen on different CPUs.
+ */
+void jool_mem_add(enum jool_memory field, long bytes);
+/**
+ * Sums every CPU's memory charges into "result".
+ */
+void jool_mem_get(struct memory_usr *result);
+
+int stats_init(void);
+void stats_destroy(void);
+
 #endif /* _JOOL_MOD_STATS_H */
@@ -0,0 +1,30 @@
+#ifndef _JOOL_MOD_SYNC_H
+#define _JOOL_MOD_SYNC_H
+
+/**
+ * @file
+ * The receiving end of active/standby session synchronization. The active translator publishes
+ * its BIB and session events (see db_events.h); the userspace application relays them to the
+ * standby, which installs them here. If the active node dies, the standby already knows the
+ * mappings, so its clients' flows survive and it doesn't need to allocate every one of them again.
+ *
+ * BIB events are ignored: dynamic BIB entries are created along with their first session and die
+ * with their last one, and static ones are configuration.
+ *
+ * @author Alberto Leiva
+ */
+
+#include "nat64/comm/config_proto.h"
+
+/**
+ * Applies the "count" events listed in "events". Events that cannot be applied (eg. because the
+ * IPv4 transport address is not in this translator's pool4) are counted and skipped; they don't
+ * stop the rest.
+ *
+ * Process context only.
+ */
+void sync_import(struct dbevent_usr *events, unsigned int count);
+
+void sync_get_stats(struct dbevent_stats *result);
+
+#endif /* _JOOL_MOD_SYNC_H */
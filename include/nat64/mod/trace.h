@@ -0,0 +1,240 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM jool
+
+#if !defined(_JOOL_MOD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _JOOL_MOD_TRACE_H
+
+/**
+ * @file
+ * Jool's static tracepoints, so perf and bpftrace can follow the databases and the packets'
+ * verdicts on production builds (where log_debug() is compiled out). They show up as
+ * "jool:<event>" once the module is inserted, and cost a patched-out jump while nobody is tracing.
+ *
+ * The tracepoints are defined in trace.c; everybody else just includes this header and calls
+ * trace_<event>().
+ *
+ * @author Alberto Leiva
+ */
+
+#include <linux/tracepoint.h>
+#include <linux/skbuff.h>
+#include "nat64/mod/types.h"
+#include "nat64/mod/packet.h"
+#include "nat64/mod/bib_db.h"
+#include "nat64/mod/session_db.h"
+
+DECLARE_EVENT_CLASS(jool_session,
+	TP_PROTO(struct session_entry *session),
+	TP_ARGS(session),
+
+	TP_STRUCT__entry(
+		__field(__u8, l4_proto)
+		__array(__u8, remote6, 16)
+		__field(__u16, remote6_port)
+		__array(__u8, local6, 16)
+		__field(__u16, local6_port)
+		__field(__be32, local4)
+		__field(__u16, local4_port)
+		__field(__be32, remote4)
+		__field(__u16, remote4_port)
+	),
+
+	TP_fast_assign({
+		struct ipv6_transport_addr local6;
+
+		session_local6(session, &local6);
+		__entry->l4_proto = session->l4_proto;
+		memcpy(__entry->remote6, &session->remote6.l3, 16);
+		__entry->remote6_port = session->remote6.l4;
+		memcpy(__entry->local6, &local6.l3, 16);
+		__entry->local6_port = local6.l4;
+		__entry->local4 = session->local4.l3.s_addr;
+		__entry->local4_port = session->local4.l4;
+		__entry->remote4 = session->remote4.l3.s_addr;
+		__entry->remote4_port = session->remote4.l4;
+	}),
+
+	TP_printk("proto=%u remote6=%pI6c#%u local6=%pI6c#%u local4=%pI4#%u remote4=%pI4#%u",
+		__entry->l4_proto,
+		__entry->remote6, __entry->remote6_port,
+		__entry->local6, __entry->local6_port,
+		&__entry->local4, __entry->local4_port,
+		&__entry->remote4, __entry->remote4_port)
+);
+
+/** A session entry was added to the database. */
+DEFINE_EVENT(jool_session, jool_session_add,
+	TP_PROTO(struct session_entry *session),
+	TP_ARGS(session)
+);
+
+/** A session entry was removed from the database (usually because it expired). */
+DEFINE_EVENT(jool_session, jool_session_remove,
+	TP_PROTO(struct session_entry *session),
+	TP_ARGS(session)
+);
+
+DECLARE_EVENT_CLASS(jool_bib,
+	TP_PROTO(struct bib_entry *bib),
+	TP_ARGS(bib),
+
+	TP_STRUCT__entry(
+		__field(__u8, l4_proto)
+		__field(bool, is_static)
+		__array(__u8, addr6, 16)
+		__field(__u16, port6)
+		__field(__be32, addr4)
+		__field(__u16, port4)
+	),
+
+	TP_fast_assign(
+		__entry->l4_proto = bib->l4_proto;
+		__entry->is_static = bib->is_static;
+		memcpy(__entry->addr6, &bib->host->addr, 16);
+		__entry->port6 = bib->port6;
+		__entry->addr4 = bib->ipv4.l3.s_addr;
+		__entry->port4 = bib->ipv4.l4;
+	),
+
+	TP_printk("proto=%u static=%u ipv6=%pI6c#%u ipv4=%pI4#%u",
+		__entry->l4_proto, __entry->is_static,
+		__entry->addr6, __entry->port6,
+		&__entry->addr4, __entry->port4)
+);
+
+/** A BIB entry was added to the database. */
+DEFINE_EVENT(jool_bib, jool_bib_add,
+	TP_PROTO(struct bib_entry *bib),
+	TP_ARGS(bib)
+);
+
+/** A BIB entry was removed from the database. */
+DEFINE_EVENT(jool_bib, jool_bib_remove,
+	TP_PROTO(struct bib_entry *bib),
+	TP_ARGS(bib)
+);
+
+/** pool4 could not lend a transport address, even after draining the port caches. */
+TRACE_EVENT(jool_pool4_exhausted,
+	TP_PROTO(l4_protocol l4_proto, __u16 l4_id),
+	TP_ARGS(l4_proto, l4_id),
+
+	TP_STRUCT__entry(
+		__field(__u8, l4_proto)
+		__field(__u16, l4_id)
+	),
+
+	TP_fast_assign(
+		__entry->l4_proto = l4_proto;
+		__entry->l4_id = l4_id;
+	),
+
+	TP_printk("proto=%u port=%u", __entry->l4_proto, __entry->l4_id)
+);
+
+DECLARE_EVENT_CLASS(jool_fragdb_buffer,
+	TP_PROTO(l3_protocol l3_proto, l4_protocol l4_proto, __u32 id),
+	TP_ARGS(l3_proto, l4_proto, id),
+
+	TP_STRUCT__entry(
+		__field(__u8, l3_proto)
+		__field(__u8, l4_proto)
+		__field(__u32, id)
+	),
+
+	TP_fast_assign(
+		__entry->l3_proto = l3_proto;
+		__entry->l4_proto = l4_proto;
+		__entry->id = id;
+	),
+
+	TP_printk("l3proto=%u l4proto=%u id=%u",
+		__entry->l3_proto, __entry->l4_proto, __entry->id)
+);
+
+/** A packet's first fragment arrived, so the fragment database started a buffer for it. */
+DEFINE_EVENT(jool_fragdb_buffer, jool_fragdb_buffer_create,
+	TP_PROTO(l3_protocol l3_proto, l4_protocol l4_proto, __u32 id),
+	TP_ARGS(l3_proto, l4_proto, id)
+);
+
+/** A reassembly buffer timed out before all of its fragments arrived. */
+DEFINE_EVENT(jool_fragdb_buffer, jool_fragdb_buffer_expire,
+	TP_PROTO(l3_protocol l3_proto, l4_protocol l4_proto, __u32 id),
+	TP_ARGS(l3_proto, l4_proto, id)
+);
+
+DECLARE_EVENT_CLASS(jool_pktqueue,
+	TP_PROTO(struct session_entry *session),
+	TP_ARGS(session),
+
+	TP_STRUCT__entry(
+		__field(__be32, local4)
+		__field(__u16, local4_port)
+		__field(__be32, remote4)
+		__field(__u16, remote4_port)
+	),
+
+	TP_fast_assign(
+		__entry->local4 = session->local4.l3.s_addr;
+		__entry->local4_port = session->local4.l4;
+		__entry->remote4 = session->remote4.l3.s_addr;
+		__entry->remote4_port = session->remote4.l4;
+	),
+
+	TP_printk("local4=%pI4#%u remote4=%pI4#%u",
+		&__entry->local4, __entry->local4_port,
+		&__entry->remote4, __entry->remote4_port)
+);
+
+/** An IPv4 SYN was stored, waiting for a simultaneous open. */
+DEFINE_EVENT(jool_pktqueue, jool_pktqueue_store,
+	TP_PROTO(struct session_entry *session),
+	TP_ARGS(session)
+);
+
+/** A stored SYN's simultaneous open never came, so it was answered with an ICMP error. */
+DEFINE_EVENT(jool_pktqueue, jool_pktqueue_send,
+	TP_PROTO(struct session_entry *session),
+	TP_ARGS(session)
+);
+
+/**
+ * What core_common() did with "skb". VER_CONTINUE means it was translated and sent.
+ * Stolen packets belong to somebody else by now, so they are traced as a NULL "skb" (and zero
+ * protocols and length).
+ */
+TRACE_EVENT(jool_verdict,
+	TP_PROTO(struct sk_buff *skb, verdict result),
+	TP_ARGS(skb, result),
+
+	TP_STRUCT__entry(
+		__field(__u8, l3_proto)
+		__field(__u8, l4_proto)
+		__field(unsigned int, len)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->l3_proto = skb ? skb_l3_proto(skb) : 0;
+		__entry->l4_proto = skb ? skb_l4_proto(skb) : 0;
+		__entry->len = skb ? skb->len : 0;
+		__entry->result = result;
+	),
+
+	TP_printk("l3proto=%u l4proto=%u len=%u verdict=%s",
+		__entry->l3_proto, __entry->l4_proto, __entry->len,
+		__print_symbolic(__entry->result,
+			{ VER_CONTINUE, "translated" },
+			{ VER_DROP, "dropped" },
+			{ VER_STOLEN, "stolen" }))
+);
+
+#endif /* _JOOL_MOD_TRACE_H */
+
+/* This part must be outside the include guard. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH nat64/mod
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
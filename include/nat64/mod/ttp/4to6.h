@@ -10,6 +10,10 @@
 
 #include "nat64/mod/ttp/common.h"
 
+/**
+ * Returns the length of the IPv6 header (plus fragment header, if needed) "hdr4" translates into.
+ */
+unsigned int ttp46_l3_hdr_len(struct iphdr *hdr4);
 /**
  * Creates in "out" a packet which other functions will fill with the IPv6 version of the IPv4
  * packet "in".
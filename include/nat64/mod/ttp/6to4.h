@@ -10,6 +10,10 @@
 
 #include "nat64/mod/ttp/common.h"
 
+/**
+ * Seeds the generator of IPv4 identifications. Call during initialization.
+ */
+void ttp64_init(void);
 /**
  * Creates in "out" a packet which other functions will fill with the IPv4 version of the IPv6
  * packet "in".
@@ -1,7 +1,9 @@
 #ifndef _JOOL_MOD_TTP_COMMON_H
 #define _JOOL_MOD_TTP_COMMON_H
 
+#include <linux/tcp.h>
 #include "nat64/mod/types.h"
+#include "nat64/mod/icmp_wrapper.h"
 
 /**
  * An accesor for the full unused portion of the ICMP header, which I feel is missing from
@@ -64,6 +66,27 @@ struct translation_steps {
 int ttpcomm_init(void);
 void ttpcomm_destroy(void);
 
+/**
+ * Allocates the skb a translated packet of "len" bytes will be assembled in. The result already
+ * has room for the lower layers' headers reserved.
+ */
+struct sk_buff *ttpcomm_alloc_skb(unsigned int len);
+
+/**
+ * If the configuration says so and "hdr" is a SYN whose Maximum Segment Size option would not let
+ * the peer's segments fit in the minimum IPv6 MTU once they are translated, lowers the option.
+ * "hdr_len" is the length of "hdr", options included. "hdr"'s checksum is updated incrementally,
+ * unless "update_csum" is false (eg. because somebody else is going to compute it).
+ */
+void ttpcomm_clamp_mss(struct tcphdr *hdr, unsigned int hdr_len, bool update_csum);
+
+/**
+ * Answers "skb" (an incoming packet the translation refuses) with the "error" ICMP error, counts
+ * it as a header error and returns -EINVAL. Out of line and cold, since these are the exceptions;
+ * the translation functions should spend their instruction cache on the packets they do translate.
+ */
+int ttpcomm_reject(struct sk_buff *skb, icmp_error_code error, __u32 info) __cold;
+
 /**
  * This function only makes sense if parts is an incoming packet.
  */
@@ -1,8 +1,33 @@
 #ifndef _JOOL_MOD_TTP_CONFIG_H
 #define _JOOL_MOD_TTP_CONFIG_H
 
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 #include "nat64/comm/config_proto.h"
 
+/**
+ * The parts of the outgoing layer-3 headers which only depend on the configuration.
+ * They are built whenever the configuration changes, so the packet path only has to copy them and
+ * fill in whatever comes from the packet (lengths, addresses, hop limits, IDs, checksums).
+ */
+struct ttp_templates {
+	/** Version, IHL and, if the config so dictates, the TOS and the DF flag. Everything else is 0. */
+	struct iphdr hdr4;
+	/** Version and, if the config so dictates, the (zeroed) traffic class. Everything else is 0. */
+	struct ipv6hdr hdr6;
+
+	/** Copy of the config's reset_tos; if false, "hdr4"'s TOS has to be replaced. */
+	bool reset_tos;
+	/** Copy of the config's df_always_on; if false, "hdr4"'s DF flag has to be computed. */
+	bool df_always_on;
+	/** Copy of the config's build_ipv4_id; if true, "hdr4"'s ID has to be computed. */
+	bool build_ipv4_id;
+	/** Copy of the config's reset_traffic_class; if false, "hdr6"'s traffic class has to be set. */
+	bool reset_traffic_class;
+	/** Copy of the config's clamp_mss; if true, the MSS of SYNs might have to be lowered. */
+	bool clamp_mss;
+};
+
 int ttpconfig_init(void);
 void ttpconfig_destroy(void);
 
@@ -10,5 +35,7 @@ int ttpconfig_clone(struct translate_config *clone);
 int ttpconfig_update(enum translate_type type, size_t size, void *value);
 
 struct translate_config *ttpconfig_get(void);
+/** Same as ttpconfig_get(), except for the header templates. Also requires rcu_read_lock_bh(). */
+struct ttp_templates *ttpconfig_get_templates(void);
 
 #endif /* _JOOL_MOD_TTP_CONFIG_H */
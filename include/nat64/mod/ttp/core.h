@@ -17,6 +17,7 @@
 #include "nat64/mod/types.h"
 #include "nat64/comm/config_proto.h"
 #include "nat64/mod/packet.h"
+#include "nat64/mod/send_packet.h"
 
 /**
  * Prepares this module for future use. Avoid calling the rest of the functions unless this has
@@ -54,4 +55,34 @@ int translate_set_config(enum translate_type type, size_t size, void *value);
 verdict translating_the_packet(struct tuple *out_tuple, struct sk_buff *in,
 		struct sk_buff **output);
 
+/**
+ * Translates "skb" into the protocol of "out_tuple" by rewriting its headers in place, instead of
+ * copying it into a new packet. The payload is not touched.
+ *
+ * Only single, unshared, TCP or UDP (or layer-4-headerless) packets which do not need fragmenting
+ * qualify. TCP super-packets (GSO) qualify as well; their GSO metadata is translated, so the
+ * egress device segments them. Offloaded checksums (CHECKSUM_PARTIAL) stay offloaded.
+ * If "skb" does not qualify, it is left untouched and -EAGAIN is returned, so you can fall back
+ * to translating_the_packet().
+ *
+ * "cache" is handed to sendpkt_route4_cached()/sendpkt_route6_cached(); it can be NULL.
+ *
+ * @return zero if "skb" was translated and routed, and is ready to be sent. -EAGAIN if you should
+ *		use translating_the_packet() instead. Anything else means "skb" must be dropped (an ICMP
+ *		error was already sent if the situation demanded it).
+ */
+int translating_the_packet_in_place(struct tuple *out_tuple, struct sk_buff *skb,
+		struct sendpkt_route_cache *cache);
+
+/**
+ * Same as translating_the_packet_in_place(), except for hairpinned packets: "skb" is the IPv6
+ * packet the first pass received, "tuple4" is the tuple of its IPv4 translation, and "tuple6" is
+ * the tuple of the IPv6 packet the second pass would send.
+ *
+ * "skb"'s headers end up exactly as if it had been translated into IPv4 and then back into IPv6,
+ * except the IPv4 version is never built outside of the stack.
+ */
+int translating_the_hairpin_in_place(struct tuple *tuple4, struct tuple *tuple6,
+		struct sk_buff *skb, struct sendpkt_route_cache *cache);
+
 #endif /* _JOOL_MOD_TRANSLATING_THE_PACKET_H */
@@ -10,6 +10,8 @@
 
 #include "nat64/comm/types.h"
 #include <linux/netfilter.h>
+#include <linux/hardirq.h>
+#include <linux/rcupdate.h>
 
 /**
  * Messages to help us walk through a run. Also covers normal packet drops (bad checksums,
@@ -73,6 +75,70 @@ typedef enum verdict {
 	VER_STOLEN = NF_STOLEN,
 } verdict;
 
+/**
+ * Starts a RCU-bh read-side critical section for reading a module's configuration, unless the
+ * caller is already in one.
+ *
+ * Packets are always processed with softirqs disabled, and that already is a RCU-bh read-side
+ * critical section, so the packet path skips the rcu_read_lock_bh()/rcu_read_unlock_bh() pair
+ * entirely. Everyone else (userspace requests, timers, unit tests) gets the real lock.
+ *
+ * @return whether the lock was actually taken. Hand it over to config_read_unlock().
+ */
+static inline bool config_read_lock(void)
+{
+	if (in_softirq())
+		return false;
+	rcu_read_lock_bh();
+	return true;
+}
+
+/**
+ * Ends the section started by config_read_lock().
+ */
+static inline void config_read_unlock(bool locked)
+{
+	if (locked)
+		rcu_read_unlock_bh();
+}
+
+/**
+ * Allocates "size" bytes for a configuration RCU-bh readers are going to see. The result comes
+ * with the room config_retire() needs, so it can only be released through config_retire() or
+ * config_free().
+ */
+void *config_alloc(size_t size, gfp_t flags);
+/**
+ * Frees "ptr" (which must come from config_alloc()) right away. Only for configurations no
+ * reader can reach (never published, or after rcu_barrier_bh()).
+ */
+void config_free(void *ptr);
+/**
+ * Frees "ptr" (which must come from config_alloc()) once every RCU-bh reader that might still be
+ * looking at it is done, without waiting for that to happen.
+ *
+ * This is what the *_set_config() functions use to retire the configuration they just replaced,
+ * so updating several values in a row doesn't cost a grace period each. It cannot fail and does
+ * not sleep. Whoever retires memory this way must rcu_barrier_bh() before the module goes away.
+ */
+void config_retire(void *ptr);
+
+/** Maximum length of the shard-to-node map. See shard_nodes_init(). */
+#define SHARD_NODES_MAX 64
+
+/**
+ * Tells the sharded databases which NUMA node their "i"th slice should live on: nodes[i % count].
+ * If "count" is zero, slice "i" goes to the node of CPU "i" (which is the natural choice when there
+ * is one slice per CPU).
+ * Has to be called before the databases are initialized.
+ */
+int shard_nodes_init(int *nodes, unsigned int count);
+/**
+ * Returns the NUMA node the "index"th slice of a sharded database should allocate its memory on, or
+ * NUMA_NO_NODE if it doesn't matter.
+ */
+int shard_node(unsigned int index);
+
 union transport_addr {
 	struct ipv6_transport_addr addr6;
 	struct ipv4_transport_addr addr4;
@@ -161,6 +227,7 @@ bool ipv4_transport_addr_equals(const struct ipv4_transport_addr *a,
 bool ipv6_transport_addr_equals(const struct ipv6_transport_addr *a,
 		const struct ipv6_transport_addr *b);
 bool ipv6_prefix_equals(const struct ipv6_prefix *a, const struct ipv6_prefix *b);
+bool ipv4_prefix_equals(const struct ipv4_prefix *a, const struct ipv4_prefix *b);
 /**
  * @}
  */
@@ -171,11 +238,34 @@ bool ipv6_prefix_equals(const struct ipv6_prefix *a, const struct ipv6_prefix *b
  * But the absence of ipv4_addr_cmp() does makes things look asymmetric.
  * So, booya.
  *
- * @return positive if a2 is bigger, negative if a1 is bigger, zero it they're equal.
+ * The order is the same as memcmp()'s (ie. network byte order), but this is an integer comparison
+ * instead of a function call; it runs on every level of the BIB and session trees.
+ *
+ * @return positive if a1 is bigger, negative if a2 is bigger, zero it they're equal.
  */
 static inline int ipv4_addr_cmp(const struct in_addr *a1, const struct in_addr *a2)
 {
-	return memcmp(a1, a2, sizeof(struct in_addr));
+	__u32 n1 = be32_to_cpu(a1->s_addr);
+	__u32 n2 = be32_to_cpu(a2->s_addr);
+	return (n1 > n2) - (n1 < n2);
+}
+
+/**
+ * Same as the kernel's ipv6_addr_cmp() (including the order), except it compares the addresses
+ * as two 64-bit integers instead of calling memcmp().
+ */
+static inline int ipv6_addr_cmp_fast(const struct in6_addr *a1, const struct in6_addr *a2)
+{
+	__u64 n1, n2;
+
+	n1 = ((__u64) be32_to_cpu(a1->s6_addr32[0]) << 32) | be32_to_cpu(a1->s6_addr32[1]);
+	n2 = ((__u64) be32_to_cpu(a2->s6_addr32[0]) << 32) | be32_to_cpu(a2->s6_addr32[1]);
+	if (n1 != n2)
+		return (n1 > n2) ? 1 : -1;
+
+	n1 = ((__u64) be32_to_cpu(a1->s6_addr32[2]) << 32) | be32_to_cpu(a1->s6_addr32[3]);
+	n2 = ((__u64) be32_to_cpu(a2->s6_addr32[2]) << 32) | be32_to_cpu(a2->s6_addr32[3]);
+	return (n1 > n2) - (n1 < n2);
 }
 
 /**
@@ -0,0 +1,108 @@
+#ifndef _JOOL_UNIT_BENCHMARK_H
+#define _JOOL_UNIT_BENCHMARK_H
+
+/**
+ * @file
+ * Runs a function on several kthreads at once (each bound to its own online CPU) and times them.
+ * Shared by the modules in unit/benchmark.
+ */
+
+#include <linux/types.h>
+
+/**
+ * A benchmark's workload. "thread" is the index of the kthread running it, "arg" is whatever was
+ * handed to bench_run().
+ */
+typedef void (*bench_fn)(unsigned int thread, void *arg);
+
+struct bench_result {
+	/** Nanoseconds between the start of the first thread and the end of the last one. */
+	u64 wall_ns;
+	/** Sum of the nanoseconds every thread spent running "fn". */
+	u64 busy_ns;
+};
+
+/**
+ * Runs "fn" on "threads" kthreads, which all start at the same time, and waits for them.
+ */
+int bench_run(unsigned int threads, bench_fn fn, void *arg, struct bench_result *result);
+
+/**
+ * The benchmarks run rounds with 1, 2, 4... threads, up to "max_threads". Returns the number of
+ * threads of the round that comes after the "threads"-thread one.
+ */
+unsigned int bench_next_round(unsigned int threads, unsigned int max_threads);
+
+/**
+ * Returns "ops" per second over "ns" nanoseconds, in hundredths of millions. Meant to be printed
+ * using BENCH_HUNDREDTHS.
+ */
+u64 bench_mops(u64 ops, u64 ns);
+
+/** Prints "value / 100" with two decimals; use "%llu.%02llu". */
+#define BENCH_HUNDREDTHS(value) (value) / 100, (value) % 100
+
+/** Every power of two of the latency histograms is split into 2^BENCH_HIST_SUB_BITS buckets. */
+#define BENCH_HIST_SUB_BITS 2
+#define BENCH_HIST_BUCKETS (64 << BENCH_HIST_SUB_BITS)
+
+/**
+ * A latency distribution. The buckets are logarithmic, so the percentiles are upper bounds which
+ * overshoot by less than 1 / 2^BENCH_HIST_SUB_BITS.
+ */
+struct bench_hist {
+	u64 counts[BENCH_HIST_BUCKETS];
+	u64 total;
+	u64 max;
+};
+
+/**
+ * Records a "ns"-nanoseconds sample in "hist".
+ */
+void bench_hist_add(struct bench_hist *hist, u64 ns);
+/**
+ * Adds "src"'s samples to "dst".
+ */
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+/**
+ * Returns the value below which "permille"/1000ths of "hist"'s samples fall.
+ */
+u64 bench_hist_percentile(const struct bench_hist *hist, unsigned int permille);
+/**
+ * Prints the median, p99, p99.9 and maximum of "hist", as a "Benchmark: " line named "name".
+ */
+void bench_hist_print(char *name, const struct bench_hist *hist);
+
+/**
+ * A measurement, as bench_report() prints it for unit/benchmark/compare.sh. Zero (or NULL) fields
+ * were not measured, and are left out of the line.
+ */
+struct bench_record {
+	/**
+	 * Pairs the record with its counterpart in the baseline, so it has to be unique within the
+	 * module's output and stable across runs. No double quotes.
+	 */
+	char *name;
+	/** Number of operations measured. */
+	u64 ops;
+	/** Nanoseconds the operations took, first start to last end. Yields ops/s. */
+	u64 wall_ns;
+	/** Sum of the nanoseconds every thread spent on them. Yields ns/op. Zero means wall_ns. */
+	u64 busy_ns;
+	/** The operations' latencies. Yields the percentiles. */
+	const struct bench_hist *hist;
+	/** Memory footprint, in bytes. */
+	u64 bytes;
+};
+
+/**
+ * Prints "record" as a "Benchmark: result" line. Unlike the rest of the "Benchmark: " lines, its
+ * format is fixed:
+ *
+ *	Benchmark: result name="<name>" [ops=N ns_per_op=N] [ops_per_s=N] [p50_ns=N p99_ns=N
+ *			p999_ns=N max_ns=N] [bytes=N]
+ */
+void bench_report(const struct bench_record *record);
+
+
+#endif /* _JOOL_UNIT_BENCHMARK_H */
@@ -2,9 +2,11 @@
 #define _JOOL_USR_BIB_H
 
 #include "nat64/comm/types.h"
+#include "nat64/usr/types.h"
 
 
-int bib_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_hostname, bool csv_format);
+int bib_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_hostname,
+		enum display_format format);
 int bib_count(bool use_tcp, bool use_udp, bool use_icmp);
 
 int bib_add(bool use_tcp, bool use_udp, bool use_icmp,
@@ -0,0 +1,24 @@
+#ifndef _JOOL_USR_CHANGES_H
+#define _JOOL_USR_CHANGES_H
+
+/**
+ * @file
+ * Prints the BIB and session changes the kernel's change log has seen since a generation, one
+ * JSON object per line, oldest first, followed by a line holding the latest generation:
+ *
+ *	# jool --changes --display --since 1200
+ *	{"generation":1201,"event":"session-add","proto":"TCP",...}
+ *	{"generation":1202,"event":"bib-remove","proto":"UDP",...}
+ *	{"generation":1202}
+ *
+ * Pass that last generation to the next poll. The count operation prints the latest generation
+ * alone, so a poller can note it before its initial dump.
+ */
+
+#include <linux/types.h>
+
+int changes_display(__u64 since);
+int changes_count(void);
+
+
+#endif /* _JOOL_USR_CHANGES_H */
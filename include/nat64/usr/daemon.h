@@ -0,0 +1,24 @@
+#ifndef _JOOL_USR_DAEMON_H
+#define _JOOL_USR_DAEMON_H
+
+/**
+ * @file
+ * Serves a stream of commands received through a UNIX socket, over a single Netlink connection,
+ * so orchestration doesn't have to spawn a process per change:
+ *
+ *	# jool --listen /run/jool.sock
+ *
+ * Clients connect and write one command per line. A line which starts with a dash is a regular
+ * set of jool arguments ("--bib --add --tcp ..."); it runs as soon as it arrives and its output is
+ * written back, followed by "STATUS <code>" (zero is success, anything else an errno).
+ * Any other line is a --file entry ("pool6 64:ff9b::/96", "bib tcp ..."); these are accumulated
+ * and sent in batches, until the client writes "commit", sends a regular command, or hangs up.
+ * "commit" answers with the status of the first entry which failed since the previous commit.
+ *
+ * Clients are served one at a time, in the order they connect.
+ */
+
+int daemon_run(char *path, int (*run)(int argc, char **argv));
+
+
+#endif /* _JOOL_USR_DAEMON_H */
@@ -4,10 +4,33 @@
 
 #include "nat64/comm/types.h"
 
+/**
+ * Prints "addr6" (or "addr4"), resolving its name unless "numeric_hostname" is true.
+ * Names are cached; see dns_queue6().
+ */
 void print_addr6(struct ipv6_transport_addr *addr6, bool numeric_hostname, char *separator,
 		__u8 l4_proto);
 void print_addr4(struct ipv4_transport_addr *addr4, bool numeric_hostname, char *separator,
 		__u8 l4_proto);
 
+/**
+ * Prints "addr6" (or "addr4") as the "key" and "key"_id members of a JSON object.
+ * Always numeric.
+ */
+void print_addr6_json(char *key, struct ipv6_transport_addr *addr6);
+void print_addr4_json(char *key, struct ipv4_transport_addr *addr4);
+
+/**
+ * Marks "addr" as an address whose name is going to be printed soon. The queued names are then
+ * resolved concurrently by dns_resolve_queued(), instead of one by one while printing.
+ * Does nothing if the name is already cached.
+ */
+void dns_queue6(struct in6_addr *addr);
+void dns_queue4(struct in_addr *addr);
+/**
+ * Resolves the names of every dns_queue*()d address, several of them at a time.
+ */
+void dns_resolve_queued(void);
+
 
 #endif /* _JOOL_USR_DNS_H */
@@ -0,0 +1,55 @@
+#ifndef _JOOL_USR_FILE_H
+#define _JOOL_USR_FILE_H
+
+/**
+ * @file
+ * Adds the pool6 prefixes, pool4 addresses and static BIB entries listed in a file, one per line:
+ *
+ *	pool6 <prefix>
+ *	pool4 <address>
+ *	bib <tcp|udp|icmp> <IPv6 address>#<port> <IPv4 address>#<port>
+ *
+ * Lines starting with '#' are ignored. Consecutive lines of the same kind are sent to the kernel
+ * in batches; a batch is added as a single transaction. Processing stops at the first error.
+ */
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/**
+ * Maximum size of a batch message. libnl refuses to send messages bigger than a page, so this
+ * leaves room for the Netlink header.
+ */
+#define BATCH_MAX_LEN 3072
+
+/**
+ * Consecutive lines of the same kind, waiting to be sent to the kernel as a single add request.
+ * Zero it before use.
+ */
+struct file_batch {
+	unsigned char buffer[BATCH_MAX_LEN];
+	/** See enum config_mode. Zero means the batch is empty. */
+	__u16 mode;
+	/** Only meaningful in BIB mode. */
+	__u8 l4_proto;
+	size_t entry_size;
+	unsigned int count;
+	/** Number of lines successfully sent so far. */
+	unsigned int total;
+};
+
+int file_load(char *file_name);
+
+/**
+ * Queues the entry "line" describes into "batch". Entries of a different kind, and entries which
+ * don't fit anymore, make the pending ones go to the kernel first.
+ */
+int file_parse_line(struct file_batch *batch, char *line);
+/**
+ * Sends the pending entries of "batch" to the kernel. They are dropped even if the kernel
+ * rejects them.
+ */
+int file_flush(struct file_batch *batch);
+
+
+#endif /* _JOOL_USR_FILE_H */
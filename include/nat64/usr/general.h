@@ -12,7 +12,19 @@
 #define ICMP_TIMEOUT_OPT		"toICMP"
 #define TCP_EST_TIMEOUT_OPT		"toTCPest"
 #define TCP_TRANS_TIMEOUT_OPT 	"toTCPtrans"
+#define TCP_CLOSED_TIMEOUT_OPT	"toTCPclosed"
+#define REFRESH_GRANULARITY_OPT	"refreshGranularity"
+#define TIMER_SLACK_OPT		"timerSlack"
+#define MAX_SESSIONS_UDP_OPT	"maxSessionsUDP"
+#define MAX_SESSIONS_TCP_OPT	"maxSessionsTCP"
+#define MAX_SESSIONS_ICMP_OPT	"maxSessionsICMP"
+#define MAX_SESSIONS_PREFIX_OPT	"maxSessionsPerPrefix"
+#define SESSION_PREFIX_LEN_OPT	"sessionPrefixLen"
+#define SESSION_RATE_PREFIX_OPT	"sessionRatePerPrefix"
+#define UDP_CLASS_TIMEOUT_OPT	"toUDPPort"
 #define STORED_PKTS_OPT			"maxStoredPkts"
+#define STORED_PKTS_SRC_OPT		"maxStoredPktsPerSrc"
+#define STORED_PKTS_POOL4_OPT	"maxStoredPktsPerPool4"
 
 #define RESET_TCLASS_OPT		"setTC"
 #define RESET_TOS_OPT			"setTOS"
@@ -20,16 +32,27 @@
 #define DF_ALWAYS_ON_OPT		"setDF"
 #define BUILD_IPV4_ID_OPT		"genID"
 #define LOWER_MTU_FAIL_OPT		"boostMTU"
+#define CLAMP_MSS_OPT			"clampMSS"
 #define IPV6_NEXTHOP_MTU_OPT	"nextMTU6"
 #define IPV4_NEXTHOP_MTU_OPT	"nextMTU4"
 #define MTU_PLATEAUS_OPT		"plateaus"
 #define MIN_IPV6_MTU_OPT		"minMTU6"
+#define DIRECT_XMIT_OPT			"directXmit"
 
 #define FRAG_TIMEOUT_OPT		"toFrag"
+#define FRAG_HIGH_THRESH_OPT	"fragHighThresh"
+#define FRAG_LOW_THRESH_OPT		"fragLowThresh"
+#define FRAG_FORWARD_EARLY_OPT	"fragForwardEarly"
+
+#define LOGTIME_ENABLED_OPT		"benchmark"
 
 
 int general_display(void);
-int general_update(enum general_module module, __u8 type, size_t size, void *data);
+/**
+ * Sends the "count" struct general_records in "records" ("len" bytes) to the kernel, in a single
+ * request.
+ */
+int general_update(void *records, size_t len, __u16 count);
 
 
 #endif /* _JOOL_USR_GENERAL_H */
@@ -15,6 +15,8 @@
 	#error "Unsupported LIBNL library version number (< 3.0)."
 #endif
 
+int netlink_open(void);
+void netlink_close(void);
 int netlink_request(void *request, __u16 request_len, int (*cb)(struct nl_msg *, void *),
 		void *cb_arg);
 
@@ -3,12 +3,18 @@
 
 #include <stdbool.h>
 #include <arpa/inet.h>
+#include "nat64/comm/types.h"
 
 
 int pool4_display(void);
 int pool4_count(void);
 int pool4_add(struct in_addr *addr);
-int pool4_remove(struct in_addr *addr, bool quick);
+int pool4_add_det(struct in_addr *addr, __u8 addr_len, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len);
+int pool4_add_range(struct in_addr *addr, __u8 addr_len, __u16 port_min, __u16 port_max);
+int pool4_add_psid(struct in_addr *addr, __u8 addr_len, __u16 psid, __u8 psid_len,
+		__u8 psid_offset);
+int pool4_remove(struct in_addr *addr, __u8 addr_len, bool quick);
 int pool4_flush(bool quick);
 
 
@@ -0,0 +1,18 @@
+#ifndef _JOOL_USR_REPLAY_H
+#define _JOOL_USR_REPLAY_H
+
+/**
+ * @file
+ * Reads a pcap capture from standard input and pushes its IPv4 and IPv6 packets through the
+ * kernel module, as fast as it can take them, "repeat" times:
+ *
+ *	# jool --replay --repeat 10 < subscribers.pcap
+ *
+ * Every second, it prints the packet rate and how full the BIB, session and pool4 tables are.
+ * The translated packets are sent for real, so mind where they're routed to.
+ */
+
+int replay_run(unsigned int repeat);
+
+
+#endif /* _JOOL_USR_REPLAY_H */
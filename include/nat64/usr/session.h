@@ -2,11 +2,22 @@
 #define _JOOL_USR_SESSION_H
 
 #include <stdbool.h>
+#include "nat64/comm/config_proto.h"
+#include "nat64/comm/session.h"
+#include "nat64/usr/types.h"
 
 
+/**
+ * Prints the sessions of the selected tables that match "filter". The kernel does the filtering.
+ */
 int session_display(bool use_tcp, bool use_udp, bool use_icmpm, bool numeric_hostname,
-		bool csv_format);
+		enum display_format format, struct session_filter *filter);
 int session_count(bool use_tcp, bool use_udp, bool use_icmp);
+char *tcp_state_to_string(enum tcp_state state);
+/**
+ * Parses "str" (a TCP state, as tcp_state_to_string() would print it) into "out".
+ */
+int str_to_tcp_state(const char *str, __u8 *out);
 
 
 #endif /* _JOOL_USR_SESSION_H */
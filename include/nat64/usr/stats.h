@@ -0,0 +1,22 @@
+#ifndef _JOOL_USR_STATS_H
+#define _JOOL_USR_STATS_H
+
+/**
+ * @file
+ * Prints the kernel module's packet counters (see enum jool_stat). They are also readable from
+ * /proc/net/jool.
+ */
+
+int stats_display(void);
+/**
+ * Prints how full the BIB and session tables and the IPv4 pool are (see STATS_OCCUPANCY).
+ * The kernel maintains these as the tables change, so this is cheap enough to poll.
+ */
+int stats_display_occupancy(void);
+/**
+ * Prints how many bytes each subsystem of the kernel module is using (see STATS_MEMORY).
+ */
+int stats_display_memory(void);
+
+
+#endif /* _JOOL_USR_STATS_H */
@@ -58,6 +58,32 @@ int str_to_addr6_port(const char *str, struct ipv6_transport_addr *out);
  * Parses "str" as a IPv6 prefix (<prefix address>/<mask>), which it then copies to "out".
  */
 int str_to_prefix(const char *str, struct ipv6_prefix *out);
+/**
+ * Same as str_to_prefix(), except any length is accepted (for EAMT entries, which are not bound to
+ * RFC 6052).
+ */
+int str_to_eam_prefix6(const char *str, struct ipv6_prefix *out);
+/**
+ * Parses "str" as a IPv4 prefix (<prefix address>/<mask>), which it then copies to "out".
+ */
+int str_to_prefix4(const char *str, struct ipv4_prefix *out);
+
+/**
+ * Parses "str" as a range of ports (<min>-<max>), which it then copies to "min" and "max".
+ */
+int str_to_port_range(const char *str, __u16 *min, __u16 *max);
+
+/**
+ * Parses "str" as a Port Set Identifier and its length (<PSID>/<length>), which it then copies to
+ * "psid" and "len".
+ */
+int str_to_psid(const char *str, __u16 *psid, __u8 *len);
+
+/**
+ * Parses "str" as a port and a session lifetime in seconds (<port>=<seconds>), which it then
+ * copies to "port" and "seconds".
+ */
+int str_to_port_timeout(const char *str, __u16 *port, __u64 *seconds);
 
 /**
  * Prints the "millis" amount of milliseconds as spreadsheet-friendly format in the console.
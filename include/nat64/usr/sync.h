@@ -0,0 +1,28 @@
+#ifndef _JOOL_USR_SYNC_H
+#define _JOOL_USR_SYNC_H
+
+/**
+ * @file
+ * Relays BIB and session events from an active translator to a standby one. The display mode
+ * writes the kernel's events to standard output; the add mode reads events from standard input
+ * and hands them to the kernel. Chain them through any byte stream:
+ *
+ *	active# jool --sync --display | ssh standby jool --sync --add
+ *
+ * The snapshot writes the current sessions to standard output (as addition events) and exits,
+ * so the tables can be restored after the module is reloaded:
+ *
+ *	# jool --sync --display --snapshot > sessions.bin
+ *	# modprobe -r jool && modprobe jool (...)
+ *	# jool --sync --add < sessions.bin
+ *
+ * The stream is an array of struct dbevent_usr, in the host's byte order, so both translators
+ * need to share an architecture and a Jool version.
+ */
+
+int sync_display(void);
+int sync_snapshot(void);
+int sync_add(void);
+
+
+#endif /* _JOOL_USR_SYNC_H */
@@ -8,5 +8,17 @@
 #define log_info(text, ...) log_debug(text, ##__VA_ARGS__)
 #define log_err(text, ...) log_debug(text, ##__VA_ARGS__)
 
+/**
+ * The ways the database tables (BIB and sessions) can be printed.
+ */
+enum display_format {
+	/** Meant for humans. */
+	FORMAT_FRIENDLY,
+	/** Comma-separated values; one line per entry. */
+	FORMAT_CSV,
+	/** One JSON object per line, per entry. The addresses are always printed numerically. */
+	FORMAT_JSON,
+};
+
 
 #endif /* _JOOL_USR_TYPES_H */
@@ -0,0 +1,246 @@
+#include "nat64/mod/arena.h"
+
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/mod/types.h"
+
+
+/** "next" value of the last free object. */
+#define ARENA_NONE ((u32) -1)
+
+static void free_chunks(struct arena *arena)
+{
+	unsigned int i;
+
+	for (i = 0; i < arena->chunk_count; i++)
+		free_pages((unsigned long) arena->chunks[i].start, arena->chunks[i].order);
+	vfree(arena->chunks);
+	arena->chunks = NULL;
+	arena->chunk_count = 0;
+}
+
+static int compare_chunks(const void *c1, const void *c2)
+{
+	const struct arena_chunk *chunk1 = c1;
+	const struct arena_chunk *chunk2 = c2;
+
+	if (chunk1->start == chunk2->start)
+		return 0;
+	return (chunk1->start < chunk2->start) ? -1 : 1;
+}
+
+/**
+ * Requests the arena's memory from the buddy allocator, in blocks as large as it can provide.
+ */
+static int alloc_chunks(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+	unsigned int min_order = get_order(arena->size);
+	unsigned int order = MAX_ORDER - 1;
+	unsigned int max_chunks;
+	u32 remaining = arena->capacity;
+	unsigned long pages;
+
+	/* Worst case, every chunk is as small as it can be. */
+	max_chunks = DIV_ROUND_UP(arena->capacity, (PAGE_SIZE << min_order) / arena->size);
+	arena->chunks = vmalloc(max_chunks * sizeof(*arena->chunks));
+	if (!arena->chunks)
+		return -ENOMEM;
+	arena->chunk_count = 0;
+
+	while (remaining > 0) {
+		/* Don't ask for more than what's left. */
+		while (order > min_order
+				&& ((PAGE_SIZE << (order - 1)) / arena->size) >= remaining)
+			order--;
+
+		pages = __get_free_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, order);
+		if (!pages) {
+			if (order == min_order) {
+				free_chunks(arena);
+				return -ENOMEM;
+			}
+			order--;
+			continue;
+		}
+
+		chunk = &arena->chunks[arena->chunk_count++];
+		chunk->start = (void *) pages;
+		chunk->order = order;
+		chunk->count = min_t(u32, (PAGE_SIZE << order) / arena->size, remaining);
+		remaining -= chunk->count;
+	}
+
+	return 0;
+}
+
+/**
+ * Initializes "arena" as "capacity" objects of "size" bytes each, every one of them starting at a
+ * multiple of "align" (a power of two no bigger than a page). Sleeps.
+ */
+int arena_init(struct arena *arena, size_t size, size_t align, u32 capacity)
+{
+	u32 first;
+	u32 i;
+	int error;
+
+	memset(arena, 0, sizeof(*arena));
+	if (capacity == 0 || capacity == ARENA_NONE)
+		return -EINVAL;
+	if (WARN(!is_power_of_2(align) || align > PAGE_SIZE, "Bad arena alignment: %zu", align))
+		return -EINVAL;
+	/* The chunks start at page boundaries, so this is all the objects need. */
+	arena->size = ALIGN(size, align);
+	arena->capacity = capacity;
+
+	error = alloc_chunks(arena);
+	if (error)
+		goto fail;
+
+	/* Sort the chunks so arena_free() can binary search them. */
+	sort(arena->chunks, arena->chunk_count, sizeof(*arena->chunks), compare_chunks, NULL);
+	first = 0;
+	for (i = 0; i < arena->chunk_count; i++) {
+		arena->chunks[i].first = first;
+		first += arena->chunks[i].count;
+	}
+
+	arena->next = vmalloc(capacity * sizeof(*arena->next));
+	if (!arena->next) {
+		free_chunks(arena);
+		error = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < capacity - 1; i++)
+		arena->next[i] = i + 1;
+	arena->next[capacity - 1] = ARENA_NONE;
+	arena->head = 0;
+	arena->available = capacity;
+	spin_lock_init(&arena->lock);
+
+	log_debug("Preallocated %u objects of %zu bytes in %u chunks.", capacity, arena->size,
+			arena->chunk_count);
+	return 0;
+
+fail:
+	arena->capacity = 0;
+	return error;
+}
+
+/**
+ * Releases "arena"'s memory. Whatever was lent from it is gone too.
+ */
+void arena_destroy(struct arena *arena)
+{
+	if (!arena->capacity)
+		return;
+
+	vfree(arena->next);
+	free_chunks(arena);
+	arena->capacity = 0;
+}
+
+/**
+ * Returns the bytes "arena" took from the kernel, lent or not. Zero if it's not initialized.
+ */
+size_t arena_footprint(struct arena *arena)
+{
+	size_t result;
+	unsigned int i;
+
+	if (!arena->capacity)
+		return 0;
+
+	result = arena->capacity * sizeof(*arena->next);
+	for (i = 0; i < arena->chunk_count; i++)
+		result += PAGE_SIZE << arena->chunks[i].order;
+	return result;
+}
+
+static void *index_to_obj(struct arena *arena, u32 index)
+{
+	unsigned int min = 0;
+	unsigned int max = arena->chunk_count - 1;
+	unsigned int mid;
+	struct arena_chunk *chunk;
+
+	while (true) {
+		mid = (min + max) / 2;
+		chunk = &arena->chunks[mid];
+		if (index < chunk->first)
+			max = mid - 1;
+		else if (index >= chunk->first + chunk->count)
+			min = mid + 1;
+		else
+			return chunk->start + (index - chunk->first) * arena->size;
+	}
+}
+
+/**
+ * Returns the index of "obj" within "arena", or ARENA_NONE if "obj" wasn't lent by "arena".
+ */
+static u32 obj_to_index(struct arena *arena, void *obj)
+{
+	int min = 0;
+	int max = arena->chunk_count - 1;
+	int mid;
+	struct arena_chunk *chunk;
+	size_t offset;
+
+	while (min <= max) {
+		mid = (min + max) / 2;
+		chunk = &arena->chunks[mid];
+		if (obj < chunk->start) {
+			max = mid - 1;
+		} else if (obj >= chunk->start + chunk->count * arena->size) {
+			min = mid + 1;
+		} else {
+			offset = obj - chunk->start;
+			if (offset % arena->size)
+				return ARENA_NONE;
+			return chunk->first + offset / arena->size;
+		}
+	}
+
+	return ARENA_NONE;
+}
+
+/**
+ * Lends an object from "arena". Returns NULL if all of them are already lent.
+ * The object is not zeroed. Can be called from any context other than hardirq.
+ */
+void *arena_alloc(struct arena *arena)
+{
+	u32 index;
+
+	spin_lock_bh(&arena->lock);
+	index = arena->head;
+	if (index != ARENA_NONE) {
+		arena->head = arena->next[index];
+		arena->available--;
+	}
+	spin_unlock_bh(&arena->lock);
+
+	return (index != ARENA_NONE) ? index_to_obj(arena, index) : NULL;
+}
+
+/**
+ * Takes "obj" back. "obj" must have been lent by arena_alloc().
+ */
+void arena_free(struct arena *arena, void *obj)
+{
+	u32 index = obj_to_index(arena, obj);
+
+	if (WARN(index == ARENA_NONE, "Something's returning an object the arena didn't lend."))
+		return;
+
+	spin_lock_bh(&arena->lock);
+	arena->next[index] = arena->head;
+	arena->head = index;
+	arena->available++;
+	spin_unlock_bh(&arena->lock);
+}
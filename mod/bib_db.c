@@ -1,16 +1,93 @@
 #include "nat64/mod/bib_db.h"
 
+#include <linux/bitops.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/ipv6.h>
+#include "nat64/mod/arena.h"
 #include "nat64/mod/rbtree.h"
 #include "nat64/mod/pool4.h"
 #include "nat64/mod/packet.h"
 #include "nat64/mod/icmp_wrapper.h"
+#include "nat64/mod/db_events.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/stats.h"
+#include "nat64/mod/trace.h"
+
+/**
+ * Number of slots in each of the BIB tables' IPv4 hash index. Must be a power of two.
+ */
+#define BIB_HASH_BITS 14
+#define BIB_HASH_SIZE (1 << BIB_HASH_BITS)
+/** Number of distinct IPv4 addresses a struct bib_host can keep track of. */
+#define BIB_HOST_ADDRS 4
+/** Maximum number of port blocks an IPv6 node can hold per protocol. */
+#define BIB_HOST_BLOCKS 4
+
+/** Number of preallocated BIB entries each CPU keeps at hand. */
+#define BIB_POOL_SIZE 64
+/** If a CPU's pool drops below this many entries, it gets refilled. */
+#define BIB_POOL_LOW 16
+
+/**
+ * A block of contiguous ports lent to an IPv6 node by the IPv4 pool. See pool4_get_block().
+ */
+struct bib_block {
+	/** The block's address. */
+	struct in_addr addr;
+	/** The block's first port. */
+	__u16 first;
+	/** Number of bits set in "ports". */
+	unsigned int used;
+	/** One bit per port of the block; set if taken. NULL if this slot holds no block. */
+	unsigned long *ports;
+};
+
+/**
+ * Summary of the BIB entries of one IPv6 node, so allocate_transport_address() doesn't have to
+ * walk all of them to find out which IPv4 addresses the node is already masked with.
+ *
+ * Protected by its table's lock.
+ */
+struct bib_host {
+	/** The IPv6 node's address. */
+	struct in6_addr addr;
+	/** The IPv4 addresses the node's BIB entries are using. */
+	struct {
+		struct in_addr addr;
+		/** Number of the node's entries which use "addr". Zero means the slot is free. */
+		unsigned int bibs;
+	} addrs[BIB_HOST_ADDRS];
+	/**
+	 * Number of the node's entries whose addresses didn't fit in "addrs". While this is nonzero,
+	 * "addrs" is not the full picture, so the allocator falls back to walking the tree.
+	 */
+	unsigned int overflow;
+	/** The node's ports, if the pool is lending port blocks. */
+	struct bib_block blocks[BIB_HOST_BLOCKS];
+	/** Appends this record to its table's "hosts" index. */
+	struct hlist_node hook;
+};
 
 /**
  * BIB table definition.
  * Holds two red-black trees, one for each indexing need (IPv4 and IPv6).
+ *
+ * Every IPv4 packet that doesn't have a session yet needs an exact-match lookup by IPv4 transport
+ * address, so there's also a hash index for that. It's an RCU list, so bibdb_get_by_ipv4() can
+ * walk it without grabbing "lock". The trees, which are only touched by the slower operations,
+ * still require the lock.
  */
 struct bib_table {
+	/** Indexes the entries using their IPv4 identifiers, for the packet path. */
+	struct hlist_head *hash4;
+	/** Indexes the struct bib_hosts using their IPv6 addresses. */
+	struct hlist_head *hosts;
 	/** Indexes the entries using their IPv6 identifiers. */
 	struct rb_root tree6;
 	/** Indexes the entries using their IPv4 identifiers. */
@@ -19,9 +96,10 @@ struct bib_table {
 	u64 count;
 	/**
 	 * Lock to sync access.
-	 * Note, this protects the structure of the trees, not the entries.
+	 * Note, this protects the structure of the indexes, not the entries.
 	 * The entries are immutable, and when they're part of the database, they can only be killed by
-	 * bib_release(), which spinlockly deletes them from the trees first.
+	 * bib_release(), which spinlockly deletes them from the indexes first, and then leaves the
+	 * actual freeing to RCU.
 	 */
 	spinlock_t lock;
 };
@@ -35,23 +113,288 @@ static struct bib_table bib_icmp;
 
 /** Cache for struct bib_entrys, for efficient allocation. */
 static struct kmem_cache *entry_cache;
+/**
+ * Preallocated memory for the BIB entries, if the user asked for it (see bibdb_init()).
+ * Unless its capacity is zero, entries come from here instead of "entry_cache".
+ */
+static struct arena arena;
+
+static struct bib_entry *entry_alloc(gfp_t flags)
+{
+	struct bib_entry *bib;
+
+	if (arena.capacity)
+		return arena_alloc(&arena);
+
+	bib = kmem_cache_alloc(entry_cache, flags);
+	if (bib)
+		jool_mem_add(JMEM_BIB, sizeof(*bib));
+	return bib;
+}
+
+static void entry_free(struct bib_entry *bib)
+{
+	if (arena.capacity) {
+		arena_free(&arena, bib);
+	} else {
+		kmem_cache_free(entry_cache, bib);
+		jool_mem_add(JMEM_BIB, -(long) sizeof(*bib));
+	}
+}
+
+/** Bytes of the bitmap of a port block (see block_get()). */
+static size_t block_bytes(void)
+{
+	return BITS_TO_LONGS(pool4_get_block_size()) * sizeof(unsigned long);
+}
+
+/** Bytes of the indexes of one table. */
+#define INDEX_BYTES (2 * BIB_HASH_SIZE * sizeof(struct hlist_head))
+
+/**
+ * A stash of ready-to-use BIB entries. Same as the session database's pools (struct session_pool),
+ * and for the same reason: floods of short-lived mappings (ICMP query probes, most notably) would
+ * otherwise allocate and free an entry per conversation, in atomic context.
+ *
+ * This only makes the entries cheaper to come by. ICMP query sessions still get a full BIB entry,
+ * pool4 identifier and tree placement each; there is no lighter session tier for them.
+ *
+ * A pool is only ever touched by its own CPU, with bottom halves disabled.
+ */
+struct bib_pool {
+	/** Number of valid elements in "entries". */
+	unsigned int count;
+	struct bib_entry *entries[BIB_POOL_SIZE];
+	/** Tops the pool up. See pool_refill(). */
+	struct work_struct refill;
+};
+
+/** The pools, one per CPU. */
+static struct bib_pool __percpu *pools;
+
+/** Random seed for the hash indexes, initialized at startup. */
+static u32 hash_rnd;
+
+/**
+ * Indexes the struct ipv6_hosts using their addresses. Shared by the three tables, so it has its
+ * own lock, which also protects the records' "bibs" counters.
+ * The tables' lock can be held while grabbing this one, but not the other way around.
+ */
+static struct hlist_head *hosts6;
+/** Number of records in "hosts6". */
+static u64 hosts6_count;
+static DEFINE_SPINLOCK(hosts6_lock);
+
+/** Bytes of "hosts6". */
+#define HOSTS6_BYTES (BIB_HASH_SIZE * sizeof(struct hlist_head))
+
+static struct hlist_head *host6_head(const struct in6_addr *addr)
+{
+	u32 hash = jhash2((__force const u32 *) addr->s6_addr32, 4, hash_rnd);
+	return &hosts6[hash & (BIB_HASH_SIZE - 1)];
+}
+
+/**
+ * Returns the record of the "addr" IPv6 node, creating it if the node has no entries yet.
+ * The result counts one more entry; revert with host6_put().
+ */
+static struct ipv6_host *host6_get(const struct in6_addr *addr)
+{
+	struct hlist_head *head = host6_head(addr);
+	struct ipv6_host *host;
+	struct hlist_node *pos;
+
+	spin_lock_bh(&hosts6_lock);
+
+	hlist_for_each(pos, head) {
+		host = hlist_entry(pos, struct ipv6_host, hook);
+		if (ipv6_addr_equal(&host->addr, addr)) {
+			host->bibs++;
+			goto end;
+		}
+	}
+
+	host = kmalloc(sizeof(*host), GFP_ATOMIC);
+	if (!host) {
+		log_debug("Could not allocate the BIB entry's IPv6 node record.");
+		goto end;
+	}
+	jool_mem_add(JMEM_BIB, sizeof(*host));
+	host->addr = *addr;
+	host->bibs = 1;
+	hlist_add_head(&host->hook, head);
+	hosts6_count++;
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&hosts6_lock);
+	return host;
+}
+
+/**
+ * Reverts host6_get(). Deletes "host" if it doesn't have any entries left.
+ */
+static void host6_put(struct ipv6_host *host)
+{
+	bool dead;
+
+	spin_lock_bh(&hosts6_lock);
+	dead = (--host->bibs == 0);
+	if (dead) {
+		hlist_del(&host->hook);
+		hosts6_count--;
+	}
+	spin_unlock_bh(&hosts6_lock);
+
+	if (dead) {
+		kfree(host);
+		jool_mem_add(JMEM_BIB, -(long) sizeof(*host));
+	}
+}
+
+/**
+ * Process context work which fills the pool it belongs to.
+ */
+static void pool_refill(struct work_struct *work)
+{
+	struct bib_pool *pool = container_of(work, struct bib_pool, refill);
+	struct bib_entry *bib;
+
+	do {
+		bib = entry_alloc(GFP_KERNEL);
+		if (!bib)
+			return;
+
+		local_bh_disable();
+		/* The work might have been moved to another CPU (eg. hotplug), so make sure. */
+		if (pool != this_cpu_ptr(pools) || pool->count >= BIB_POOL_SIZE) {
+			local_bh_enable();
+			entry_free(bib);
+			return;
+		}
+		pool->entries[pool->count++] = bib;
+		local_bh_enable();
+	} while (true);
+}
+
+/**
+ * Returns an uninitialized BIB entry, preferably from the current CPU's pool.
+ */
+static struct bib_entry *bib_alloc(void)
+{
+	struct bib_pool *pool;
+	struct bib_entry *bib = NULL;
+
+	local_bh_disable();
+	pool = this_cpu_ptr(pools);
+	if (pool->count)
+		bib = pool->entries[--pool->count];
+	if (pool->count < BIB_POOL_LOW)
+		schedule_work_on(smp_processor_id(), &pool->refill);
+	local_bh_enable();
+
+	return bib ? bib : entry_alloc(GFP_ATOMIC);
+}
+
+/**
+ * Returns "bib" to the current CPU's pool, or to the allocator if the pool is full.
+ */
+static void bib_free(struct bib_entry *bib)
+{
+	struct bib_pool *pool;
+
+	host6_put(bib->host);
+
+	local_bh_disable();
+	pool = this_cpu_ptr(pools);
+	if (pool->count < BIB_POOL_SIZE) {
+		pool->entries[pool->count++] = bib;
+		bib = NULL;
+	}
+	local_bh_enable();
+
+	if (bib)
+		entry_free(bib);
+}
+
+static int pools_init(void)
+{
+	struct bib_pool *pool;
+	int cpu;
+
+	pools = alloc_percpu(struct bib_pool);
+	if (!pools)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(pools, cpu);
+		INIT_WORK(&pool->refill, pool_refill);
+		/* Nobody's using the pools yet, so there's no need to be on the right CPU. */
+		for (pool->count = 0; pool->count < BIB_POOL_SIZE; pool->count++) {
+			pool->entries[pool->count] = entry_alloc(GFP_KERNEL);
+			if (!pool->entries[pool->count])
+				break;
+		}
+	}
+
+	return 0;
+}
+
+static void pools_destroy(void)
+{
+	struct bib_pool *pool;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(pools, cpu);
+		cancel_work_sync(&pool->refill);
+		while (pool->count)
+			entry_free(pool->entries[--pool->count]);
+	}
+	free_percpu(pools);
+}
+
+static void bib_free_rcu(struct rcu_head *head)
+{
+	bib_free(container_of(head, struct bib_entry, rcu_hook));
+}
+
+static int get_bibdb_table(l4_protocol l4_proto, struct bib_table **result);
+static void unindex_bib(struct bib_table *table, struct bib_entry *bib);
 
 /**
  * Removes the BIB entry from the database and kfrees it.
  *
+ * The lockless readers might still be looking at the entry, so the memory is only released after
+ * an RCU grace period. They can't revive it, though (see bib_get_unless_zero()).
+ *
  * @param ref kref field of the entry you want to remove.
  */
 static void bib_release(struct kref *ref, bool lock)
 {
 	struct bib_entry *bib;
-	int error;
+	struct bib_table *table;
 
 	bib = container_of(ref, struct bib_entry, refcounter);
 
-	error = bibdb_remove(bib, lock);
-	WARN(error, "Error code %d when trying to remove a dying BIB entry from the DB. "
-			"Maybe it should have been kfreed directly instead?", error);
-	bib_kfree(bib);
+	if (!WARN(get_bibdb_table(bib->l4_proto, &table), "Dying BIB entry has no table.")) {
+		if (lock)
+			jool_lock_bh(&table->lock, JLOCK_BIB);
+		/* If a locked lookup found it dead, it might have already been unindexed. */
+		if (!RB_EMPTY_NODE(&bib->tree6_hook))
+			unindex_bib(table, bib);
+		if (lock)
+			jool_unlock_bh(&table->lock, JLOCK_BIB);
+	}
+
+	/*
+	 * We ignore the error of pool4_return(),
+	 * because the user might have removed the address from the pool with --quick.
+	 * Ports from port blocks were already dealt with by unindex_bib().
+	 */
+	if (!bib->in_block)
+		pool4_return(bib->l4_proto, &bib->ipv4);
+	call_rcu_bh(&bib->rcu_hook, bib_free_rcu);
 }
 
 static void bib_release_lock(struct kref *ref)
@@ -67,19 +410,28 @@ static void bib_release_lockless(struct kref *ref)
 struct bib_entry *bib_create(struct ipv4_transport_addr *addr4, struct ipv6_transport_addr *addr6,
 		bool is_static, l4_protocol l4_proto)
 {
+	struct ipv6_host *host = host6_get(&addr6->l3);
 	struct bib_entry tmp = {
 			.ipv4 = *addr4,
-			.ipv6 = *addr6,
+			.host = host,
 			.l4_proto = l4_proto,
+			.port6 = addr6->l4,
 			.is_static = is_static,
 	};
+	struct bib_entry *result;
 
-	struct bib_entry *result = kmem_cache_alloc(entry_cache, GFP_ATOMIC);
-	if (!result)
+	if (!host)
 		return NULL;
 
+	result = bib_alloc();
+	if (!result) {
+		host6_put(host);
+		return NULL;
+	}
+
 	memcpy(result, &tmp, sizeof(tmp));
 	kref_init(&result->refcounter);
+	INIT_HLIST_NODE(&result->hash4_hook);
 	RB_CLEAR_NODE(&result->tree6_hook);
 	RB_CLEAR_NODE(&result->tree4_hook);
 
@@ -93,7 +445,7 @@ void bib_kfree(struct bib_entry *bib)
 	 * because the user might have removed the address from the pool with --quick.
 	 */
 	pool4_return(bib->l4_proto, &bib->ipv4);
-	kmem_cache_free(entry_cache, bib);
+	bib_free(bib);
 }
 
 void bib_get(struct bib_entry *bib)
@@ -101,6 +453,15 @@ void bib_get(struct bib_entry *bib)
 	kref_get(&bib->refcounter);
 }
 
+/**
+ * Same as bib_get(), except for entries found through the database while their refcount might be
+ * dropping to zero. Returns false (and does nothing) if "bib" is already dying.
+ */
+static bool bib_get_unless_zero(struct bib_entry *bib)
+{
+	return kref_get_unless_zero(&bib->refcounter);
+}
+
 int bib_return(struct bib_entry *bib)
 {
 	return kref_put(&bib->refcounter, bib_release_lock);
@@ -111,6 +472,33 @@ int bib_return_lockless(struct bib_entry *bib)
 	return kref_put(&bib->refcounter, bib_release_lockless);
 }
 
+/**
+ * Returns the two positions "remote4" occupies in a BIB entry's remote4_filter.
+ */
+static void remote4_bits(const struct in_addr *remote4, unsigned int *bit1, unsigned int *bit2)
+{
+	u32 hash = jhash_1word((__force u32) remote4->s_addr, hash_rnd);
+	*bit1 = hash % BITS_PER_LONG;
+	*bit2 = (hash >> 16) % BITS_PER_LONG;
+}
+
+void bib_add_remote4(struct bib_entry *bib, const struct in_addr *remote4)
+{
+	unsigned int bit1, bit2;
+
+	remote4_bits(remote4, &bit1, &bit2);
+	set_bit(bit1, &bib->remote4_filter);
+	set_bit(bit2, &bib->remote4_filter);
+}
+
+bool bib_may_know_remote4(struct bib_entry *bib, const struct in_addr *remote4)
+{
+	unsigned int bit1, bit2;
+
+	remote4_bits(remote4, &bit1, &bit2);
+	return test_bit(bit1, &bib->remote4_filter) && test_bit(bit2, &bib->remote4_filter);
+}
+
 /**
  * One-liner to get the BIB table corresponding to the "l4_proto" protocol.
  */
@@ -133,19 +521,19 @@ static int get_bibdb_table(l4_protocol l4_proto, struct bib_table **result)
 }
 
 /**
- * Returns > 0 if bib->ipv6.l3 > addr.
- * Returns < 0 if bib->ipv6.l3 < addr.
- * Returns 0 if bib->ipv6.l3 == addr.
+ * Returns > 0 if bib's IPv6 address > addr.
+ * Returns < 0 if bib's IPv6 address < addr.
+ * Returns 0 if bib's IPv6 address == addr.
  */
 static int compare_addr6(const struct bib_entry *bib, const struct in6_addr *addr)
 {
-	return ipv6_addr_cmp(&bib->ipv6.l3, addr);
+	return ipv6_addr_cmp_fast(&bib->host->addr, addr);
 }
 
 /**
- * Returns > 0 if bib->ipv6 > addr.
- * Returns < 0 if bib->ipv6 < addr.
- * Returns 0 if bib->ipv6 == addr.
+ * Returns > 0 if bib's IPv6 transport address > addr.
+ * Returns < 0 if bib's IPv6 transport address < addr.
+ * Returns 0 if bib's IPv6 transport address == addr.
  */
 static int compare_full6(const struct bib_entry *bib, const struct ipv6_transport_addr *addr)
 {
@@ -155,7 +543,25 @@ static int compare_full6(const struct bib_entry *bib, const struct ipv6_transpor
 	if (gap)
 		return gap;
 
-	gap = bib->ipv6.l4 - addr->l4;
+	gap = bib->port6 - addr->l4;
+	return gap;
+}
+
+/**
+ * Same as compare_full6(), except "key"'s transport address is compared against "bib"'s.
+ * The hosts are interned, so entries of the same node don't need to compare the addresses.
+ */
+static int compare_bib6(const struct bib_entry *bib, const struct bib_entry *key)
+{
+	int gap;
+
+	if (bib->host != key->host) {
+		gap = compare_addr6(bib, &key->host->addr);
+		if (gap)
+			return gap;
+	}
+
+	gap = bib->port6 - key->port6;
 	return gap;
 }
 
@@ -186,49 +592,507 @@ static int compare_full4(const struct bib_entry *bib, const struct ipv4_transpor
 	return gap;
 }
 
+/**
+ * Returns the slot of "table"'s hash index where the entries whose IPv4 side is "addr" belong.
+ */
+static struct hlist_head *hash4_head(struct bib_table *table,
+		const struct ipv4_transport_addr *addr)
+{
+	u32 hash = jhash_2words((__force u32) addr->l3.s_addr, addr->l4, hash_rnd);
+	return &table->hash4[hash & (BIB_HASH_SIZE - 1)];
+}
+
+/**
+ * Returns the slot of "table"'s host index where "addr"'s record belongs.
+ */
+static struct hlist_head *host_head(struct bib_table *table, const struct in6_addr *addr)
+{
+	u32 hash = jhash2((__force const u32 *) addr->s6_addr32, 4, hash_rnd);
+	return &table->hosts[hash & (BIB_HASH_SIZE - 1)];
+}
+
+/**
+ * Returns the record of the "addr" IPv6 node, or NULL if it has no BIB entries in "table".
+ *
+ * "table"'s spinlock must already be held.
+ */
+static struct bib_host *host_find(struct bib_table *table, const struct in6_addr *addr)
+{
+	struct bib_host *host;
+	struct hlist_node *pos;
+
+	hlist_for_each(pos, host_head(table, addr)) {
+		host = hlist_entry(pos, struct bib_host, hook);
+		if (ipv6_addr_equal(&host->addr, addr))
+			return host;
+	}
+
+	return NULL;
+}
+
+/**
+ * Accounts "bib" in its IPv6 node's record, creating the record if needed.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static struct bib_host *host_get(struct bib_table *table, const struct in6_addr *addr)
+{
+	struct bib_host *host;
+
+	host = host_find(table, addr);
+	if (host)
+		return host;
+
+	host = kzalloc(sizeof(*host), GFP_ATOMIC);
+	if (!host) {
+		log_debug("Could not allocate the BIB entry's host record.");
+		return NULL;
+	}
+	jool_mem_add(JMEM_BIB, sizeof(*host));
+	host->addr = *addr;
+	hlist_add_head(&host->hook, host_head(table, &host->addr));
+	return host;
+}
+
+/**
+ * Deletes "host" if it doesn't account for anything anymore.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static void host_put(struct bib_host *host)
+{
+	int i;
+
+	if (host->overflow)
+		return;
+	for (i = 0; i < BIB_HOST_ADDRS; i++)
+		if (host->addrs[i].bibs)
+			return;
+	for (i = 0; i < BIB_HOST_BLOCKS; i++)
+		if (host->blocks[i].ports)
+			return;
+
+	hlist_del(&host->hook);
+	kfree(host);
+	jool_mem_add(JMEM_BIB, -(long) sizeof(*host));
+}
+
+/**
+ * Returns true if "port" is one of "block"'s ports.
+ */
+static bool block_contains(struct bib_block *block, const struct ipv4_transport_addr *addr)
+{
+	return block->ports && ipv4_addr_equals(&block->addr, &addr->l3)
+			&& block->first <= addr->l4
+			&& addr->l4 - block->first < pool4_get_block_size();
+}
+
+/**
+ * Takes "port" from "block". "port" is assumed to be available.
+ */
+static void block_take(struct bib_block *block, __u16 port, struct ipv4_transport_addr *result)
+{
+	set_bit(port - block->first, block->ports);
+	block->used++;
+	result->l3 = block->addr;
+	result->l4 = port;
+}
+
+/**
+ * Borrows a new port block for "host", storing it in "block".
+ *
+ * "table"'s spinlock must already be held.
+ */
+static int block_get(struct bib_host *host, struct bib_block *block, l4_protocol l4_proto,
+		const struct in_addr *hint)
+{
+	unsigned int size = pool4_get_block_size();
+	struct ipv4_transport_addr first;
+	int error;
+
+	block->ports = kzalloc(block_bytes(), GFP_ATOMIC);
+	if (!block->ports)
+		return -ENOMEM;
+
+	error = pool4_get_block(l4_proto, hint, &host->addr, &first);
+	if (error) {
+		kfree(block->ports);
+		block->ports = NULL;
+		return error;
+	}
+	jool_mem_add(JMEM_BIB, block_bytes());
+
+	block->addr = first.l3;
+	block->first = first.l4;
+	block->used = 0;
+
+	log_info("%s port block %pI4#%u-%u assigned to %pI6c.", l4proto_to_string(l4_proto),
+			&block->addr, block->first, block->first + size - 1, &host->addr);
+	return 0;
+}
+
+/**
+ * Returns "addr"'s port to "host"'s block. The block goes back to the IPv4 pool if it was its last
+ * port in use.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static void block_return(struct bib_host *host, l4_protocol l4_proto,
+		const struct ipv4_transport_addr *addr)
+{
+	struct bib_block *block;
+	struct ipv4_transport_addr first;
+	int i;
+
+	for (i = 0; i < BIB_HOST_BLOCKS; i++) {
+		block = &host->blocks[i];
+		if (!block_contains(block, addr))
+			continue;
+
+		if (WARN(!test_and_clear_bit(addr->l4 - block->first, block->ports),
+				"Returned a port block's port twice."))
+			return;
+
+		block->used--;
+		if (block->used)
+			return;
+
+		first.l3 = block->addr;
+		first.l4 = block->first;
+		pool4_return(l4_proto, &first);
+		log_info("%s port block %pI4#%u-%u released by %pI6c.", l4proto_to_string(l4_proto),
+				&block->addr, block->first, block->first + pool4_get_block_size() - 1,
+				&host->addr);
+
+		kfree(block->ports);
+		block->ports = NULL;
+		jool_mem_add(JMEM_BIB, -(long) block_bytes());
+		return;
+	}
+
+	WARN(true, "Port %pI4#%u doesn't belong to any of %pI6c's port blocks.", &addr->l3,
+			addr->l4, &host->addr);
+}
+
+/**
+ * allocate_transport_address(), for when the pool is lending port blocks.
+ * Tries to preserve the port number, then to use any port from the node's blocks, and only borrows
+ * another block if the node ran out.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static int allocate_from_block(struct bib_table *table, struct tuple *tuple6,
+		struct ipv4_transport_addr *result)
+{
+	unsigned int size = pool4_get_block_size();
+	struct ipv4_transport_addr wanted;
+	struct bib_host *host;
+	struct bib_block *block, *free_slot = NULL;
+	const struct in_addr *hint = NULL;
+	unsigned long bit;
+	int error;
+	int i;
+
+	host = host_get(table, &tuple6->src.addr6.l3);
+	if (!host)
+		return -ENOMEM;
+
+	wanted.l4 = tuple6->src.addr6.l4;
+	for (i = 0; i < BIB_HOST_BLOCKS; i++) {
+		block = &host->blocks[i];
+		if (!block->ports) {
+			if (!free_slot)
+				free_slot = block;
+			continue;
+		}
+
+		hint = &block->addr;
+		wanted.l3 = block->addr;
+		if (block_contains(block, &wanted)
+				&& !test_bit(wanted.l4 - block->first, block->ports)) {
+			block_take(block, wanted.l4, result);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < BIB_HOST_BLOCKS; i++) {
+		block = &host->blocks[i];
+		if (!block->ports || block->used >= size)
+			continue;
+
+		bit = find_first_zero_bit(block->ports, size);
+		block_take(block, block->first + bit, result);
+		return 0;
+	}
+
+	if (!free_slot) {
+		log_debug("%pI6c already has %u port blocks.", &host->addr, BIB_HOST_BLOCKS);
+		error = -ESRCH;
+		goto fail;
+	}
+
+	error = block_get(host, free_slot, tuple6->l4_proto, hint);
+	if (error)
+		goto fail;
+
+	wanted.l3 = free_slot->addr;
+	block_take(free_slot, block_contains(free_slot, &wanted) ? wanted.l4 : free_slot->first,
+			result);
+	return 0;
+
+fail:
+	host_put(host);
+	return error;
+}
+
+/**
+ * allocate_transport_address(), for IPv6 nodes whose ports are mapped deterministically (see
+ * pool4_register_det()). The pool only tells us the node's slice; the port is the first free
+ * one from the slice, starting from the one that best resembles the node's own port.
+ *
+ * Returns -ENOENT if "tuple6"'s source is not mapped deterministically.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static int allocate_deterministic(struct bib_table *table, struct tuple *tuple6,
+		struct ipv4_transport_addr *result)
+{
+	struct ipv4_transport_addr first;
+	struct bib_entry *bib;
+	unsigned int count, offset, i;
+	__u16 port;
+	bool taken;
+	int error;
+
+	error = pool4_get_det(&tuple6->src.addr6.l3, &first, &count);
+	if (error)
+		return error;
+
+	port = tuple6->src.addr6.l4;
+	offset = (port >= first.l4 && port - first.l4 < count) ? (port - first.l4) : (port % count);
+
+	result->l3 = first.l3;
+	for (i = 0; i < count; i++) {
+		result->l4 = first.l4 + (offset + i) % count;
+
+		taken = false;
+		hlist_for_each_entry(bib, hash4_head(table, result), hash4_hook) {
+			if (compare_full4(bib, result) == 0) {
+				taken = true;
+				break;
+			}
+		}
+		if (!taken)
+			return 0;
+	}
+
+	log_debug("%pI6c ran out of ports (%pI4#%u-%u).", &tuple6->src.addr6.l3, &first.l3, first.l4,
+			first.l4 + count - 1);
+	return -ESRCH;
+}
+
+/**
+ * Reverts allocate_transport_address(), for when the BIB entry could not be created.
+ * "in_block" is whether "addr" was taken from a port block.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static void release_transport_address(struct bib_table *table, struct tuple *tuple6,
+		struct ipv4_transport_addr *addr, bool in_block)
+{
+	struct bib_host *host;
+
+	if (!in_block) {
+		pool4_return(tuple6->l4_proto, addr);
+		return;
+	}
+
+	host = host_find(table, &tuple6->src.addr6.l3);
+	if (WARN(!host, "Port block owner has no host record."))
+		return;
+	block_return(host, tuple6->l4_proto, addr);
+	host_put(host);
+}
+
+static int host_attach(struct bib_table *table, struct bib_entry *bib)
+{
+	struct bib_host *host;
+	int free_slot = -1;
+	int i;
+
+	host = host_get(table, &bib->host->addr);
+	if (!host)
+		return -ENOMEM;
+
+	for (i = 0; i < BIB_HOST_ADDRS; i++) {
+		if (!host->addrs[i].bibs) {
+			if (free_slot == -1)
+				free_slot = i;
+		} else if (ipv4_addr_equals(&host->addrs[i].addr, &bib->ipv4.l3)) {
+			host->addrs[i].bibs++;
+			return 0;
+		}
+	}
+
+	if (free_slot != -1) {
+		host->addrs[free_slot].addr = bib->ipv4.l3;
+		host->addrs[free_slot].bibs = 1;
+	} else {
+		host->overflow++;
+	}
+
+	return 0;
+}
+
+/**
+ * Reverts host_attach(). Deletes the record if "bib" was its node's last entry.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static void host_detach(struct bib_table *table, struct bib_entry *bib)
+{
+	struct bib_host *host;
+	bool found = false;
+	int i;
+
+	host = host_find(table, &bib->host->addr);
+	if (WARN(!host, "BIB entry has no host record."))
+		return;
+
+	for (i = 0; i < BIB_HOST_ADDRS; i++) {
+		if (!found && host->addrs[i].bibs
+				&& ipv4_addr_equals(&host->addrs[i].addr, &bib->ipv4.l3)) {
+			host->addrs[i].bibs--;
+			found = true;
+		}
+	}
+
+	if (!found && !WARN(!host->overflow, "BIB entry is not accounted in its host record."))
+		host->overflow--;
+
+	if (bib->in_block)
+		block_return(host, bib->l4_proto, &bib->ipv4);
+
+	host_put(host);
+}
+
+/**
+ * Indexes "bib" in "table"'s trees and hash indexes. Its IPv6 tree slot is "parent" and "node",
+ * as computed by rbtree_find_node().
+ *
+ * "table"'s spinlock must already be held.
+ */
+static int index_bib(struct bib_table *table, struct bib_entry *bib, struct rb_node *parent,
+		struct rb_node **node)
+{
+	int error;
+
+	rb_link_node(&bib->tree6_hook, parent, node);
+	rb_insert_color(&bib->tree6_hook, &table->tree6);
+
+	error = rbtree_add(bib, &bib->ipv4, &table->tree4, compare_full4, struct bib_entry,
+			tree4_hook);
+	if (error)
+		goto tree4_fail;
+
+	error = host_attach(table, bib);
+	if (error)
+		goto host_fail;
+
+	hlist_add_head_rcu(&bib->hash4_hook, hash4_head(table, &bib->ipv4));
+	table->count++;
+	trace_jool_bib_add(bib);
+	dbevents_bib(DBEVENT_BIB_ADD, bib);
+	return 0;
+
+host_fail:
+	rb_erase(&bib->tree4_hook, &table->tree4);
+	RB_CLEAR_NODE(&bib->tree4_hook);
+tree4_fail:
+	rb_erase(&bib->tree6_hook, &table->tree6);
+	RB_CLEAR_NODE(&bib->tree6_hook);
+	return error;
+}
+
+/**
+ * Removes "bib" from "table"'s indexes.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static void unindex_bib(struct bib_table *table, struct bib_entry *bib)
+{
+	host_detach(table, bib);
+	hlist_del_init_rcu(&bib->hash4_hook);
+	rb_erase(&bib->tree6_hook, &table->tree6);
+	RB_CLEAR_NODE(&bib->tree6_hook);
+	rb_erase(&bib->tree4_hook, &table->tree4);
+	RB_CLEAR_NODE(&bib->tree4_hook);
+	table->count--;
+	trace_jool_bib_remove(bib);
+	dbevents_bib(DBEVENT_BIB_REMOVE, bib);
+}
+
 struct iteration_args {
 	struct tuple *tuple6;
 	struct ipv4_transport_addr *result;
 };
 
 /**
- * Evaluates "bib", and returns whether it is a perfect match to "void_args"'s tuple.
- * See allocate_ipv4_transport_address().
+ * Tries to borrow the port "args"'s tuple wants (or a compatible one) from "addr".
+ * Returns 1 on success, 0 if "addr" doesn't have such a port available.
+ * See allocate_transport_address().
  */
-static int find_perfect_addr4(struct bib_entry *bib, void *void_args)
+static int try_perfect_addr4(const struct in_addr *addr4, struct iteration_args *args)
 {
-	struct iteration_args *args = void_args;
 	struct ipv4_transport_addr addr;
 	int error;
 
-	addr.l3 = bib->ipv4.l3;
+	addr.l3 = *addr4;
 	addr.l4 = args->tuple6->src.addr6.l4;
 
 	error = pool4_get_match(args->tuple6->l4_proto, &addr, &args->result->l4);
 	if (error)
 		return 0; /* Not a satisfactory match; keep looking.*/
 
-	args->result->l3 = bib->ipv4.l3;
+	args->result->l3 = *addr4;
 	return 1; /* Found a match; break the iteration with a no-error (but still non-zero) status. */
 }
 
 /**
- * Evaluates "bib", and returns whether it is an acceptable match to "void_args"'s tuple.
- * See allocate_ipv4_transport_address().
+ * Tries to borrow any port from "addr".
+ * Returns 1 on success, 0 if "addr" is exhausted.
+ * See allocate_transport_address().
  */
-static int find_runnerup_addr4(struct bib_entry *bib, void *void_args)
+static int try_runnerup_addr4(const struct in_addr *addr4, struct iteration_args *args)
 {
-	struct iteration_args *args = void_args;
 	int error;
 
-	error = pool4_get_any_port(args->tuple6->l4_proto, &bib->ipv4.l3, &args->result->l4);
+	error = pool4_get_any_port(args->tuple6->l4_proto, addr4, &args->result->l4);
 	if (error)
 		return 0; /* Not a satisfactory match; keep looking.*/
 
-	args->result->l3 = bib->ipv4.l3;
+	args->result->l3 = *addr4;
 	return 1; /* Found a match; break the iteration with a no-error (but still non-zero) status. */
 }
 
+/**
+ * Evaluates "bib", and returns whether it is a perfect match to "void_args"'s tuple.
+ * See allocate_ipv4_transport_address().
+ */
+static int find_perfect_addr4(struct bib_entry *bib, void *void_args)
+{
+	return try_perfect_addr4(&bib->ipv4.l3, void_args);
+}
+
+/**
+ * Evaluates "bib", and returns whether it is an acceptable match to "void_args"'s tuple.
+ * See allocate_ipv4_transport_address().
+ */
+static int find_runnerup_addr4(struct bib_entry *bib, void *void_args)
+{
+	return try_runnerup_addr4(&bib->ipv4.l3, void_args);
+}
+
 /**
  * Runs the "func" function on every entry in "table" whose IPv6 address is "addr".
  * Aside from each entry, it always sends "args" as a parameter to "func".
@@ -305,12 +1169,32 @@ static int for_each_bib_ipv6(struct bib_table *table, struct in6_addr *addr,
 static int allocate_transport_address(struct bib_table *table, struct tuple *tuple6,
 		struct ipv4_transport_addr *result)
 {
+	struct bib_host *host;
 	int error;
+	int i;
 	struct iteration_args args = {
 			.tuple6 = tuple6,
 			.result = result
 	};
 
+	if (pool4_get_block_size())
+		return allocate_from_block(table, tuple6, result);
+
+	host = host_find(table, &tuple6->src.addr6.l3);
+	if (!host)
+		goto any_addr; /* The node has no entries, so there's nothing to preserve. */
+
+	if (!host->overflow) {
+		/* The quick version of the iterations below. */
+		for (i = 0; i < BIB_HOST_ADDRS; i++)
+			if (host->addrs[i].bibs && try_perfect_addr4(&host->addrs[i].addr, &args))
+				return 0;
+		for (i = 0; i < BIB_HOST_ADDRS; i++)
+			if (host->addrs[i].bibs && try_runnerup_addr4(&host->addrs[i].addr, &args))
+				return 0;
+		goto any_addr;
+	}
+
 	/* First, try to find a perfect match (Same address and a compatible port or id). */
 	error = for_each_bib_ipv6(table, &tuple6->src.addr6.l3, find_perfect_addr4, &args);
 	if (error > 0)
@@ -328,18 +1212,22 @@ static int allocate_transport_address(struct bib_table *table, struct tuple *tup
 	else if (error > 0)
 		return 0;
 
+	/* Fall through. */
+
+any_addr:
 	/*
-	 * There are no good matches. Just use any available IPv4 address and hope for the best.
-	 * Alternatively, this could be the first BIB entry being created, so assign any address
-	 * anyway.
+	 * There are no good matches. This is most likely the node's first BIB entry (or the first
+	 * one in a while), so use the address the pool pairs it with.
 	 */
-	return pool4_get_any_addr(tuple6->l4_proto, tuple6->src.addr6.l4, result);
+	return pool4_get_affine(tuple6->l4_proto, tuple6->src.addr6.l4, &tuple6->src.addr6.l3,
+			result);
 }
 
-int bibdb_init(void)
+int bibdb_init(unsigned int arena_size)
 {
 	struct bib_table *tables[] = { &bib_udp, &bib_tcp, &bib_icmp };
-	int i;
+	int i, j;
+	int error;
 
 	entry_cache = kmem_cache_create("jool_bib_entries", sizeof(struct bib_entry), 0, 0, NULL);
 	if (!entry_cache) {
@@ -347,7 +1235,54 @@ int bibdb_init(void)
 		return -ENOMEM;
 	}
 
+	if (arena_size) {
+		/* Same alignment as the slab's, which has no layout to protect. */
+		error = arena_init(&arena, sizeof(struct bib_entry), __alignof__(struct bib_entry),
+				arena_size);
+		if (error) {
+			log_err("Could not preallocate %u BIB entries.", arena_size);
+			kmem_cache_destroy(entry_cache);
+			return error;
+		}
+		jool_mem_add(JMEM_BIB, arena_footprint(&arena));
+	}
+
+	if (pools_init()) {
+		log_err("Could not allocate the BIB entry pools.");
+		jool_mem_add(JMEM_BIB, -(long) arena_footprint(&arena));
+		arena_destroy(&arena);
+		kmem_cache_destroy(entry_cache);
+		return -ENOMEM;
+	}
+
+	get_random_bytes(&hash_rnd, sizeof(hash_rnd));
+
+	hosts6 = vmalloc(HOSTS6_BYTES);
+	if (!hosts6) {
+		log_err("Could not allocate the BIB's IPv6 node index.");
+		i = 0;
+		goto fail;
+	}
+	for (j = 0; j < BIB_HASH_SIZE; j++)
+		INIT_HLIST_HEAD(&hosts6[j]);
+	hosts6_count = 0;
+	jool_mem_add(JMEM_BIB, HOSTS6_BYTES);
+
 	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		tables[i]->hash4 = vmalloc(BIB_HASH_SIZE * sizeof(*tables[i]->hash4));
+		tables[i]->hosts = vmalloc(BIB_HASH_SIZE * sizeof(*tables[i]->hosts));
+		if (!tables[i]->hash4 || !tables[i]->hosts) {
+			log_err("Could not allocate the BIB's indexes.");
+			vfree(tables[i]->hash4);
+			vfree(tables[i]->hosts);
+			goto fail;
+		}
+		for (j = 0; j < BIB_HASH_SIZE; j++) {
+			INIT_HLIST_HEAD(&tables[i]->hash4[j]);
+			INIT_HLIST_HEAD(&tables[i]->hosts[j]);
+		}
+		jool_mem_add(JMEM_BIB, INDEX_BYTES);
+
 		tables[i]->tree6 = RB_ROOT;
 		tables[i]->tree4 = RB_ROOT;
 		tables[i]->count = 0;
@@ -355,11 +1290,81 @@ int bibdb_init(void)
 	}
 
 	return 0;
+
+fail:
+	for (i--; i >= 0; i--) {
+		vfree(tables[i]->hash4);
+		vfree(tables[i]->hosts);
+		jool_mem_add(JMEM_BIB, -(long) INDEX_BYTES);
+	}
+	if (hosts6) {
+		vfree(hosts6);
+		hosts6 = NULL;
+		jool_mem_add(JMEM_BIB, -(long) HOSTS6_BYTES);
+	}
+	pools_destroy();
+	jool_mem_add(JMEM_BIB, -(long) arena_footprint(&arena));
+	arena_destroy(&arena);
+	kmem_cache_destroy(entry_cache);
+	return -ENOMEM;
 }
 
 static void bibdb_destroy_aux(struct rb_node *node)
 {
-	bib_kfree(rb_entry(node, struct bib_entry, tree6_hook));
+	struct bib_entry *bib = rb_entry(node, struct bib_entry, tree6_hook);
+
+	/* The port blocks die along with the pool. */
+	if (bib->in_block) {
+		host6_put(bib->host);
+		entry_free(bib);
+	} else {
+		bib_kfree(bib);
+	}
+}
+
+/**
+ * Releases the IPv6 node records nobody is going to return anymore, and their index. By now, the
+ * entries have all been freed, so there shouldn't be any.
+ */
+static void destroy_hosts6(void)
+{
+	struct ipv6_host *host;
+	struct hlist_node *pos, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < BIB_HASH_SIZE; i++) {
+		hlist_for_each_safe(pos, tmp, &hosts6[i]) {
+			host = hlist_entry(pos, struct ipv6_host, hook);
+			WARN(true, "IPv6 node %pI6c still has %u BIB entries.", &host->addr,
+					host->bibs);
+			kfree(host);
+			jool_mem_add(JMEM_BIB, -(long) sizeof(*host));
+		}
+	}
+	vfree(hosts6);
+	hosts6 = NULL;
+	jool_mem_add(JMEM_BIB, -(long) HOSTS6_BYTES);
+}
+
+static void destroy_hosts(struct bib_table *table)
+{
+	struct bib_host *host;
+	struct hlist_node *pos, *tmp;
+	unsigned int i, j;
+
+	for (i = 0; i < BIB_HASH_SIZE; i++) {
+		hlist_for_each_safe(pos, tmp, &table->hosts[i]) {
+			host = hlist_entry(pos, struct bib_host, hook);
+			for (j = 0; j < BIB_HOST_BLOCKS; j++) {
+				if (host->blocks[j].ports)
+					jool_mem_add(JMEM_BIB, -(long) block_bytes());
+				kfree(host->blocks[j].ports);
+			}
+			kfree(host);
+			jool_mem_add(JMEM_BIB, -(long) sizeof(*host));
+		}
+	}
+	vfree(table->hosts);
 }
 
 void bibdb_destroy(void)
@@ -373,9 +1378,19 @@ void bibdb_destroy(void)
 	 * because both of them point to the same values.
 	 */
 
-	for (i = 0; i < ARRAY_SIZE(tables); i++)
+	for (i = 0; i < ARRAY_SIZE(tables); i++) {
 		rbtree_clear(&tables[i]->tree6, bibdb_destroy_aux);
+		vfree(tables[i]->hash4);
+		destroy_hosts(tables[i]);
+		jool_mem_add(JMEM_BIB, -(long) INDEX_BYTES);
+	}
 
+	/* Wait for the bib_free_rcu()s. */
+	rcu_barrier_bh();
+	destroy_hosts6();
+	pools_destroy();
+	jool_mem_add(JMEM_BIB, -(long) arena_footprint(&arena));
+	arena_destroy(&arena);
 	kmem_cache_destroy(entry_cache);
 }
 
@@ -399,6 +1414,7 @@ int bibdb_get_by_ipv4(const struct ipv4_transport_addr *addr, l4_protocol l4_pro
 		struct bib_entry **result)
 {
 	struct bib_table *table;
+	struct bib_entry *bib;
 	int error;
 
 	/* Sanitize */
@@ -409,13 +1425,17 @@ int bibdb_get_by_ipv4(const struct ipv4_transport_addr *addr, l4_protocol l4_pro
 		return error;
 
 	/* Find it */
-	spin_lock_bh(&table->lock);
+	*result = NULL;
 
-	*result = rbtree_find(addr, &table->tree4, compare_full4, struct bib_entry, tree4_hook);
-	if (*result)
-		bib_get(*result);
-
-	spin_unlock_bh(&table->lock);
+	rcu_read_lock_bh();
+	hlist_for_each_entry_rcu(bib, hash4_head(table, addr), hash4_hook) {
+		if (compare_full4(bib, addr) == 0) {
+			if (bib_get_unless_zero(bib))
+				*result = bib;
+			break;
+		}
+	}
+	rcu_read_unlock_bh();
 
 	return (*result) ? 0 : -ENOENT;
 }
@@ -434,19 +1454,20 @@ int bibdb_get_by_ipv6(const struct ipv6_transport_addr *addr, l4_protocol l4_pro
 		return error;
 
 	/* Find it */
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 
 	*result = rbtree_find(addr, &table->tree6, compare_full6, struct bib_entry, tree6_hook);
-	if (*result)
-		bib_get(*result);
+	if (*result && !bib_get_unless_zero(*result))
+		*result = NULL;
 
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 
 	return (*result) ? 0 : -ENOENT;
 }
 
 int bibdb_add(struct bib_entry *entry)
 {
+	struct rb_node **node, *parent;
 	struct bib_table *table;
 	int error;
 
@@ -458,33 +1479,115 @@ int bibdb_add(struct bib_entry *entry)
 		return error;
 
 	/* Index */
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 
-	error = rbtree_add(entry, &entry->ipv6, &table->tree6, compare_full6, struct bib_entry,
-			tree6_hook);
-	if (error) {
+	rbtree_find_node(entry, &table->tree6, compare_bib6, struct bib_entry, tree6_hook,
+			parent, node);
+	if (*node) {
 		log_debug("IPv6 index failed.");
+		error = -EEXIST;
 		goto spin_exit;
 	}
 
-	error = rbtree_add(entry, &entry->ipv4, &table->tree4, compare_full4, struct bib_entry,
-			tree4_hook);
+	error = index_bib(table, entry, parent, node);
 	if (error) {
 		/*
 		 * This can happen if there's already a BIB entry with the same IPv4 transport address,
 		 * and it's mapped to some other IPv6 transport address. It's normal when this is called
 		 * from static_routes.
 		 */
-		rb_erase(&entry->tree6_hook, &table->tree6);
 		log_debug("IPv4 index failed.");
 		goto spin_exit;
 	}
-
-	table->count++;
 	/* Fall through. */
 
 spin_exit:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
+	return error;
+}
+
+static int compare_bulk6(const void *a, const void *b)
+{
+	const struct bib_entry *bib1 = *((const struct bib_entry **) a);
+	const struct bib_entry *bib2 = *((const struct bib_entry **) b);
+	return compare_bib6(bib1, bib2);
+}
+
+static void swap_bulk(void *a, void *b, int size)
+{
+	struct bib_entry **entry1 = a;
+	struct bib_entry **entry2 = b;
+	struct bib_entry *tmp = *entry1;
+
+	*entry1 = *entry2;
+	*entry2 = tmp;
+}
+
+/**
+ * Returns whether "bib" (which is assumed to not be in the database) collides with anything that
+ * is already in "table".
+ *
+ * "table"'s spinlock must already be held.
+ */
+static bool bulk_collides(struct bib_table *table, struct bib_entry *bib)
+{
+	return rbtree_find(bib, &table->tree6, compare_bib6, struct bib_entry, tree6_hook)
+			|| rbtree_find(&bib->ipv4, &table->tree4, compare_full4, struct bib_entry,
+					tree4_hook);
+}
+
+int bibdb_add_bulk(struct bib_entry **entries, unsigned int count, unsigned int *added)
+{
+	struct rb_node **node, *parent;
+	struct bib_table *table;
+	unsigned int i;
+	int error;
+
+	*added = 0;
+	if (!count)
+		return 0;
+
+	error = get_bibdb_table(entries[0]->l4_proto, &table);
+	if (error)
+		return error;
+	for (i = 1; i < count; i++) {
+		if (WARN(entries[i]->l4_proto != entries[0]->l4_proto,
+				"The BIB entries of a bulk add belong to different tables."))
+			return -EINVAL;
+	}
+
+	/*
+	 * Sorted, consecutive insertions walk mostly the same tree path, and duplicates within the
+	 * batch end up next to each other.
+	 */
+	sort(entries, count, sizeof(*entries), compare_bulk6, swap_bulk);
+
+	jool_lock_bh(&table->lock, JLOCK_BIB);
+
+	/* Validate first, so an invalid batch leaves no trace. */
+	for (i = 0; i < count; i++) {
+		if ((i > 0 && compare_bulk6(&entries[i - 1], &entries[i]) == 0)
+				|| bulk_collides(table, entries[i])) {
+			log_debug("BIB entry %pI6c#%u collides with another entry.",
+					&entries[i]->host->addr, entries[i]->port6);
+			error = -EEXIST;
+			goto end;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		rbtree_find_node(entries[i], &table->tree6, compare_bib6, struct bib_entry,
+				tree6_hook, parent, node);
+		/* Only fails on ENOMEM, or if two of the entries share an IPv4 address. */
+		error = index_bib(table, entries[i], parent, node);
+		if (error)
+			goto end;
+		(*added)++;
+	}
+	/* Fall through. */
+
+end:
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	return error;
 }
 
@@ -504,15 +1607,11 @@ int bibdb_remove(struct bib_entry *entry, const bool lock)
 		return error;
 
 	if (lock) {
-		spin_lock_bh(&table->lock);
-		rb_erase(&entry->tree6_hook, &table->tree6);
-		rb_erase(&entry->tree4_hook, &table->tree4);
-		table->count--;
-		spin_unlock_bh(&table->lock);
+		jool_lock_bh(&table->lock, JLOCK_BIB);
+		unindex_bib(table, entry);
+		jool_unlock_bh(&table->lock, JLOCK_BIB);
 	} else {
-		rb_erase(&entry->tree6_hook, &table->tree6);
-		rb_erase(&entry->tree4_hook, &table->tree4);
-		table->count--;
+		unindex_bib(table, entry);
 	}
 
 	return 0;
@@ -528,13 +1627,13 @@ int bibdb_for_each(l4_protocol l4_proto, int (*func)(struct bib_entry *, void *)
 	if (error)
 		return error;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 
 	for (node = rb_first(&table->tree4); node && !error; node = rb_next(node)) {
 		error = func(rb_entry(node, struct bib_entry, tree4_hook), arg);
 	}
 
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	return error;
 }
 
@@ -582,12 +1681,12 @@ int bibdb_iterate_by_ipv4(l4_protocol l4_proto, struct ipv4_transport_addr *addr
 	if (error)
 		return error;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 	for (node = find_next_chunk(table, addr, starting); node && !error; node = rb_next(node)) {
 		error = func(rb_entry(node, struct bib_entry, tree4_hook), arg);
 	}
 
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	return error;
 }
 
@@ -600,17 +1699,29 @@ int bibdb_count(l4_protocol proto, u64 *result)
 	if (error)
 		return error;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 	*result = table->count;
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	return 0;
 }
 
+__u64 bibdb_count_hosts(void)
+{
+	u64 result;
+
+	spin_lock_bh(&hosts6_lock);
+	result = hosts6_count;
+	spin_unlock_bh(&hosts6_lock);
+
+	return result;
+}
+
 int bibdb_get_or_create_ipv6(struct sk_buff *skb, struct tuple *tuple6, struct bib_entry **bib)
 {
 	struct ipv4_transport_addr addr4;
 	struct rb_node **node, *parent;
 	struct bib_table *table;
+	bool in_block = false;
 	int error;
 
 	/* Sanitize */
@@ -622,21 +1733,33 @@ int bibdb_get_or_create_ipv6(struct sk_buff *skb, struct tuple *tuple6, struct b
 		return error;
 
 	/* Find it */
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 
 	rbtree_find_node(&tuple6->src.addr6, &table->tree6, compare_full6, struct bib_entry,
 			tree6_hook, parent, node);
 	if (*node) {
 		*bib = rb_entry(*node, struct bib_entry, tree6_hook);
-		bib_get(*bib);
-		goto end;
+		if (bib_get_unless_zero(*bib))
+			goto end;
+
+		/*
+		 * It's dying; bib_release() is waiting for the lock we have. Take it out of the way
+		 * ourselves so the replacement can be indexed.
+		 */
+		unindex_bib(table, *bib);
+		rbtree_find_node(&tuple6->src.addr6, &table->tree6, compare_full6, struct bib_entry,
+				tree6_hook, parent, node);
 	}
 
 	/* The entry is not in the table, so create it. */
-	error = allocate_transport_address(table, tuple6, &addr4);
+	error = allocate_deterministic(table, tuple6, &addr4);
+	if (error == -ENOENT) {
+		error = allocate_transport_address(table, tuple6, &addr4);
+		in_block = pool4_get_block_size() != 0;
+	}
 	if (error) {
 		log_debug("Error code %d while 'allocating' an address for a BIB entry.", error);
-		spin_unlock_bh(&table->lock);
+		jool_unlock_bh(&table->lock, JLOCK_BIB);
 		if (tuple6->l4_proto != L4PROTO_ICMP) {
 			/* I don't know why this is not supposed to happen with ICMP, but the RFC says so... */
 			icmp64_send(skb, ICMPERR_ADDR_UNREACHABLE, 0);
@@ -647,28 +1770,23 @@ int bibdb_get_or_create_ipv6(struct sk_buff *skb, struct tuple *tuple6, struct b
 	*bib = bib_create(&addr4, &tuple6->src.addr6, false, tuple6->l4_proto);
 	if (!(*bib)) {
 		log_debug("Failed to allocate a BIB entry.");
+		release_transport_address(table, tuple6, &addr4, in_block);
 		error = -ENOMEM;
 		goto end;
 	}
+	(*bib)->in_block = in_block;
 
-	/* Index it by IPv6. We already have the slot, so we don't need to do another rbtree_find(). */
-	rb_link_node(&(*bib)->tree6_hook, parent, node);
-	rb_insert_color(&(*bib)->tree6_hook, &table->tree6);
-
-	/* Index it by IPv4. */
-	error = rbtree_add(*bib, &(*bib)->ipv4, &table->tree4, compare_full4, struct bib_entry,
-			tree4_hook);
+	/* We already have the IPv6 slot, so we don't need to do another rbtree_find(). */
+	error = index_bib(table, *bib, parent, node);
 	if (WARN(error, "The BIB entry could be indexed by IPv6 but not by IPv4.")) {
-		rb_erase(&(*bib)->tree6_hook, &table->tree6);
-		bib_kfree(*bib);
+		release_transport_address(table, tuple6, &addr4, in_block);
+		bib_free(*bib);
 		goto end;
 	}
-
-	table->count++;
 	/* Fall through. */
 
 end:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	return error;
 }
 
@@ -697,7 +1815,7 @@ static void delete_bibs_by_ipv4(struct bib_table *table, struct in_addr *addr)
 	struct rb_node *node;
 	int b = 0;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 
 	/* This is very similar to the for_each function. See that it you want comments. */
 	root_bib = rbtree_find(addr, &table->tree4, compare_addr4, struct bib_entry, tree4_hook);
@@ -728,7 +1846,7 @@ static void delete_bibs_by_ipv4(struct bib_table *table, struct in_addr *addr)
 	/* Fall through. */
 
 success:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	log_debug("Deleted %d BIB entries.", b);
 }
 
@@ -750,7 +1868,7 @@ static void flush_aux(struct bib_table *table)
 	struct rb_node *node;
 	int b = 0;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_BIB);
 
 	/* This is very similar to the for_each function. See that it you want comments. */
 	node = (&table->tree4)->rb_node;
@@ -779,7 +1897,7 @@ static void flush_aux(struct bib_table *table)
 	/* Fall through. */
 
 success:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_BIB);
 	log_debug("Deleted %d BIB entries.", b);
 }
 
@@ -0,0 +1,106 @@
+#include "nat64/mod/changelog.h"
+#include "nat64/mod/stats.h"
+#include "nat64/mod/types.h"
+
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+/** The latest changes, as a ring. NULL if the log is disabled. */
+static struct changelog_record *records;
+static unsigned int capacity;
+/** Index of "records" the next change goes to. */
+static unsigned int head;
+/** Generation of the latest change. */
+static u64 generation;
+/** Protects "records", "head" and "generation". */
+static DEFINE_SPINLOCK(lock);
+
+int changelog_init(unsigned int size)
+{
+	if (!size)
+		return 0;
+
+	records = vmalloc(size * sizeof(*records));
+	if (!records) {
+		log_err("Could not allocate a change log of %u records.", size);
+		return -ENOMEM;
+	}
+	capacity = size;
+	head = 0;
+	generation = 0;
+	jool_mem_add(JMEM_CHANGELOG, capacity * sizeof(*records));
+
+	return 0;
+}
+
+void changelog_destroy(void)
+{
+	jool_mem_add(JMEM_CHANGELOG, -(long) (capacity * sizeof(*records)));
+	vfree(records);
+	records = NULL;
+	capacity = 0;
+}
+
+bool changelog_is_enabled(void)
+{
+	return records != NULL;
+}
+
+void changelog_write(struct dbevent_usr *event)
+{
+	struct changelog_record *record;
+
+	if (!records)
+		return;
+
+	spin_lock_bh(&lock);
+	record = &records[head];
+	record->generation = ++generation;
+	record->event = *event;
+	head = (head + 1 < capacity) ? (head + 1) : 0;
+	spin_unlock_bh(&lock);
+}
+
+u64 changelog_generation(void)
+{
+	u64 result;
+
+	spin_lock_bh(&lock);
+	result = generation;
+	spin_unlock_bh(&lock);
+
+	return result;
+}
+
+int changelog_foreach(u64 since, u64 until, int (*cb)(struct changelog_record *, void *),
+		void *arg)
+{
+	unsigned int pending;
+	unsigned int unseen;
+	unsigned int i;
+	int error = 0;
+
+	if (!records)
+		return -EINVAL;
+
+	spin_lock_bh(&lock);
+
+	/* Everything the caller hasn't seen has to still be in the ring. */
+	if (since > until || until > generation || generation - since > capacity) {
+		spin_unlock_bh(&lock);
+		return -ESTALE;
+	}
+
+	unseen = generation - since;
+	pending = until - since;
+	i = (head >= unseen) ? (head - unseen) : (head + capacity - unseen);
+	for (; pending > 0; pending--) {
+		error = cb(&records[i], arg);
+		if (error)
+			break;
+		i = (i + 1 < capacity) ? (i + 1) : 0;
+	}
+
+	spin_unlock_bh(&lock);
+	return error;
+}
@@ -2,6 +2,28 @@
 #include "nat64/mod/session_db.h"
 #include "nat64/mod/stats.h"
 
+void compute_out_tuple_session(struct session_entry *session, struct tuple *in,
+		struct tuple *out)
+{
+	switch (in->l3_proto) {
+	case L3PROTO_IPV6:
+		out->l3_proto = L3PROTO_IPV4;
+		out->l4_proto = in->l4_proto;
+		out->src.addr4 = session->local4;
+		out->dst.addr4 = session->remote4;
+		break;
+
+	case L3PROTO_IPV4:
+		out->l3_proto = L3PROTO_IPV6;
+		out->l4_proto = in->l4_proto;
+		session_local6(session, &out->src.addr6);
+		out->dst.addr6 = session->remote6;
+		break;
+	}
+
+	log_tuple(out);
+}
+
 verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct sk_buff *skb_in)
 {
 	struct session_entry *session;
@@ -9,8 +31,10 @@ verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct sk_buff *s
 
 	log_debug("Step 3: Computing the Outgoing Tuple");
 
-	error = sessiondb_get(in, &session);
+	rcu_read_lock_bh();
+	error = sessiondb_find(in, &session);
 	if (error) {
+		rcu_read_unlock_bh();
 		/*
 		 * Bogus ICMP errors might cause this because Filtering never cares for them,
 		 * so it's not critical.
@@ -43,24 +67,8 @@ verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct sk_buff *s
 	 * makes sense even in a general sense.
 	 */
 
-	switch (in->l3_proto) {
-	case L3PROTO_IPV6:
-		out->l3_proto = L3PROTO_IPV4;
-		out->l4_proto = in->l4_proto;
-		out->src.addr4 = session->local4;
-		out->dst.addr4 = session->remote4;
-		break;
-
-	case L3PROTO_IPV4:
-		out->l3_proto = L3PROTO_IPV6;
-		out->l4_proto = in->l4_proto;
-		out->src.addr6 = session->local6;
-		out->dst.addr6 = session->remote6;
-		break;
-	}
-
-	session_return(session);
-	log_tuple(out);
+	compute_out_tuple_session(session, in, out);
+	rcu_read_unlock_bh();
 
 	log_debug("Done step 3.");
 	return VER_CONTINUE;
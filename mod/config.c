@@ -4,6 +4,7 @@
 #include "nat64/comm/config_proto.h"
 #include "nat64/mod/nl_buffer.h"
 #include "nat64/mod/pool6.h"
+#include "nat64/mod/eam.h"
 #include "nat64/mod/pool4.h"
 #include "nat64/mod/bib_db.h"
 #include "nat64/mod/session_db.h"
@@ -13,12 +14,20 @@
 #include "nat64/mod/filtering_and_updating.h"
 #include "nat64/mod/ttp/core.h"
 #include "nat64/mod/send_packet.h"
-#ifdef BENCHMARK
+#include "nat64/mod/icmp_wrapper.h"
+#include "nat64/mod/db_events.h"
+#include "nat64/mod/changelog.h"
+#include "nat64/mod/stage_stats.h"
 #include "nat64/mod/log_time.h"
-#endif
+#include "nat64/mod/stats.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/namespace.h"
+#include "nat64/mod/sync.h"
+#include "nat64/mod/replay.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/rwsem.h>
 #include <linux/version.h>
 
 
@@ -29,8 +38,13 @@ static struct sock *nl_socket;
 
 /**
  * A lock, used to avoid sync issues when receiving messages from userspace.
+ *
+ * Requests which only read (see is_read_only()) can run alongside each other, so monitoring
+ * doesn't queue up behind a long dump. The databases already cope with the packet path reading
+ * them while somebody writes, and readers don't need anything else from each other.
+ * Everything else holds it exclusively, so changes still happen one at a time.
  */
-static DEFINE_MUTEX(my_mutex);
+static DECLARE_RWSEM(config_sem);
 
 
 /**
@@ -99,6 +113,43 @@ static int verify_superpriv(struct request_hdr *nat64_hdr)
 	return 0;
 }
 
+/**
+ * Add requests can carry several entries back-to-back, which are then added as a single
+ * transaction (if one of them fails, the ones before it are reverted).
+ *
+ * Returns the number of "entry_size"-sized entries "hdr" carries, or zero if its length is not a
+ * whole number of them.
+ */
+static unsigned int get_entry_count(struct request_hdr *hdr, size_t entry_size)
+{
+	size_t payload_len;
+
+	if (hdr->length < sizeof(*hdr) + entry_size)
+		return 0;
+
+	payload_len = hdr->length - sizeof(*hdr);
+	return (payload_len % entry_size) ? 0 : (payload_len / entry_size);
+}
+
+static int add_pool6_entries(union request_pool6 *requests, unsigned int count)
+{
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		error = pool6_add(&requests[i].add.prefix);
+		if (error)
+			goto revert;
+	}
+
+	return 0;
+
+revert:
+	while (i-- > 0)
+		pool6_remove(&requests[i].add.prefix);
+	return error;
+}
+
 static int pool6_entry_to_userspace(struct ipv6_prefix *prefix, void *arg)
 {
 	struct nl_buffer *buffer = (struct nl_buffer *) arg;
@@ -116,17 +167,16 @@ static int handle_pool6_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 	case OP_DISPLAY:
 		log_debug("Sending IPv6 pool to userspace.");
 
-		buffer = kmalloc(sizeof(*buffer), GFP_ATOMIC);
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
 		if (!buffer) {
 			log_err("Could not allocate an output buffer to userspace.");
 			return respond_error(nl_hdr, -ENOMEM);
 		}
 
-		nlbuffer_init(buffer, nl_socket, nl_hdr);
 		error = pool6_for_each(pool6_entry_to_userspace, buffer);
 		nlbuffer_close(buffer);
 
-		kfree(buffer);
+		nlbuffer_free(buffer);
 		return error;
 
 	case OP_COUNT:
@@ -140,9 +190,12 @@ static int handle_pool6_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 		if (verify_superpriv(nat64_hdr))
 			return respond_error(nl_hdr, -EPERM);
 
-		log_debug("Adding a prefix to the IPv6 pool.");
+		count = get_entry_count(nat64_hdr, sizeof(*request));
+		if (!count)
+			return respond_error(nl_hdr, -EINVAL);
 
-		return respond_error(nl_hdr, pool6_add(&request->add.prefix));
+		log_debug("Adding %llu prefix(es) to the IPv6 pool.", count);
+		return respond_error(nl_hdr, add_pool6_entries(request, count));
 
 	case OP_REMOVE:
 		if (verify_superpriv(nat64_hdr))
@@ -179,9 +232,152 @@ static int handle_pool6_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 	}
 }
 
-static int pool4_entry_to_userspace(struct pool4_node *node, void *arg)
+static int add_eamt_entries(union request_eamt *requests, unsigned int count)
+{
+	/* The add requests are just the entries, back-to-back. */
+	BUILD_BUG_ON(sizeof(*requests) != sizeof(requests->add.entry));
+	return eamt_add(&requests->add.entry, count);
+}
+
+static int eamt_entry_to_userspace(struct eam_entry *entry, void *arg)
+{
+	return nlbuffer_write(arg, entry, sizeof(*entry));
+}
+
+static int handle_eamt_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		union request_eamt *request)
+{
+	struct nl_buffer *buffer;
+	__u64 count;
+	int error;
+
+	switch (nat64_hdr->operation) {
+	case OP_DISPLAY:
+		log_debug("Sending the EAMT to userspace.");
+
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
+		if (!buffer) {
+			log_err("Could not allocate an output buffer to userspace.");
+			return respond_error(nl_hdr, -ENOMEM);
+		}
+
+		error = eamt_for_each(eamt_entry_to_userspace, buffer);
+		nlbuffer_close(buffer);
+
+		nlbuffer_free(buffer);
+		return error;
+
+	case OP_COUNT:
+		log_debug("Returning EAMT entry count.");
+		error = eamt_count(&count);
+		if (error)
+			return respond_error(nl_hdr, error);
+		return respond_setcfg(nl_hdr, &count, sizeof(count));
+
+	case OP_ADD:
+		if (verify_superpriv(nat64_hdr))
+			return respond_error(nl_hdr, -EPERM);
+
+		count = get_entry_count(nat64_hdr, sizeof(*request));
+		if (!count)
+			return respond_error(nl_hdr, -EINVAL);
+
+		log_debug("Adding %llu entry(ies) to the EAMT.", count);
+		return respond_error(nl_hdr, add_eamt_entries(request, count));
+
+	case OP_REMOVE:
+		if (verify_superpriv(nat64_hdr))
+			return respond_error(nl_hdr, -EPERM);
+
+		log_debug("Removing an entry from the EAMT.");
+		return respond_error(nl_hdr, eamt_remove(&request->remove.entry));
+
+	case OP_FLUSH:
+		if (verify_superpriv(nat64_hdr))
+			return respond_error(nl_hdr, -EPERM);
+
+		log_debug("Flushing the EAMT...");
+		return respond_error(nl_hdr, eamt_flush());
+
+	default:
+		log_err("Unknown operation: %d", nat64_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int pool4_entry_to_userspace(struct in_addr *addr, void *arg)
+{
+	return nlbuffer_write(arg, addr, sizeof(*addr));
+}
+
+static int add_pool4_entry(union request_pool4 *request)
+{
+	if (request->add.deterministic) {
+		log_debug("Adding a deterministic range to the IPv4 pool.");
+		return pool4_register_det(&request->add.addr, request->add.addr_len,
+				&request->add.prefix6, request->add.subscriber_len);
+	}
+
+	if (request->add.psid_len) {
+		if (request->add.port_min != 0 || request->add.port_max != 65535) {
+			log_err("PSIDs and port ranges cannot be combined.");
+			return -EINVAL;
+		}
+		log_debug("Adding a PSID range to the IPv4 pool.");
+		return pool4_register_psid(&request->add.addr, request->add.addr_len,
+				request->add.psid, request->add.psid_len, request->add.psid_offset);
+	}
+
+	if (request->add.addr_len != 32 || request->add.port_min != 0
+			|| request->add.port_max != 65535) {
+		log_debug("Adding a range to the IPv4 pool.");
+		return pool4_register_range(&request->add.addr, request->add.addr_len,
+				request->add.port_min, request->add.port_max);
+	}
+
+	log_debug("Adding an address to the IPv4 pool.");
+	return pool4_register(&request->add.addr);
+}
+
+/**
+ * Reverts add_pool4_entry(). Deterministic ranges cannot be removed, so they are not allowed to be
+ * batched.
+ */
+static void revert_pool4_entry(union request_pool4 *request)
 {
-	return nlbuffer_write(arg, &node->addr, sizeof(node->addr));
+	if (request->add.addr_len != 32 || request->add.psid_len || request->add.port_min != 0
+			|| request->add.port_max != 65535)
+		pool4_remove_range(&request->add.addr, request->add.addr_len);
+	else
+		pool4_remove(&request->add.addr);
+}
+
+static int add_pool4_entries(union request_pool4 *requests, unsigned int count)
+{
+	unsigned int i;
+	int error;
+
+	if (count > 1) {
+		for (i = 0; i < count; i++) {
+			if (requests[i].add.deterministic) {
+				log_err("Deterministic ranges have to be added one at a time.");
+				return -EINVAL;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		error = add_pool4_entry(&requests[i]);
+		if (error)
+			goto revert;
+	}
+
+	return 0;
+
+revert:
+	while (i-- > 0)
+		revert_pool4_entry(&requests[i]);
+	return error;
 }
 
 static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
@@ -195,17 +391,16 @@ static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 	case OP_DISPLAY:
 		log_debug("Sending IPv4 pool to userspace.");
 
-		buffer = kmalloc(sizeof(*buffer), GFP_ATOMIC);
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
 		if (!buffer) {
 			log_err("Could not allocate an output buffer to userspace.");
 			return respond_error(nl_hdr, -ENOMEM);
 		}
 
-		nlbuffer_init(buffer, nl_socket, nl_hdr);
-		error = pool4_for_each(pool4_entry_to_userspace, buffer);
+		error = pool4_for_each_addr(pool4_entry_to_userspace, buffer);
 		nlbuffer_close(buffer);
 
-		kfree(buffer);
+		nlbuffer_free(buffer);
 		return error;
 
 	case OP_COUNT:
@@ -219,24 +414,42 @@ static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 		if (verify_superpriv(nat64_hdr))
 			return respond_error(nl_hdr, -EPERM);
 
-		log_debug("Adding an address to the IPv4 pool.");
-		return respond_error(nl_hdr, pool4_register(&request->add.addr));
+		count = get_entry_count(nat64_hdr, sizeof(*request));
+		if (!count)
+			return respond_error(nl_hdr, -EINVAL);
+
+		return respond_error(nl_hdr, add_pool4_entries(request, count));
 
 	case OP_REMOVE:
 		if (verify_superpriv(nat64_hdr))
 			return respond_error(nl_hdr, -EPERM);
 
-		log_debug("Removing an address from the IPv4 pool.");
-
-		error = pool4_remove(&request->remove.addr);
+		if (request->remove.addr_len != 32) {
+			log_debug("Removing a range from the IPv4 pool.");
+			error = pool4_remove_range(&request->remove.addr, request->remove.addr_len);
+		} else {
+			log_debug("Removing an address from the IPv4 pool.");
+			error = pool4_remove(&request->remove.addr);
+		}
 		if (error)
 			return respond_error(nl_hdr, error);
 
 		if (!request->remove.quick) {
-			error = sessiondb_delete_by_ipv4(&request->remove.addr);
-			if (error)
-				return respond_error(nl_hdr, error);
-			error = bibdb_delete_by_ipv4(&request->remove.addr);
+			/* pool4_remove_range() already validated the length. */
+			__u32 first = be32_to_cpu(request->remove.addr.s_addr);
+			__u32 count = 1u << (32 - request->remove.addr_len);
+			struct in_addr addr;
+			__u32 i;
+
+			for (i = 0; i < count; i++) {
+				addr.s_addr = cpu_to_be32(first + i);
+				error = sessiondb_delete_by_ipv4(&addr);
+				if (error)
+					return respond_error(nl_hdr, error);
+				error = bibdb_delete_by_ipv4(&addr);
+				if (error)
+					return respond_error(nl_hdr, error);
+			}
 		}
 
 		return respond_error(nl_hdr, error);
@@ -266,48 +479,112 @@ static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat6
 	}
 }
 
-#ifdef BENCHMARK
-static int logtime_entry_to_userspace(struct log_node *node, void *arg)
+static int handle_logtime_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		struct request_logtime *request)
 {
-	struct nl_buffer *buffer = (struct nl_buffer *) arg;
-	struct logtime_entry_usr entry_usr;
+	struct logtime_usr *histogram;
+	int error;
+
+	switch (nat64_hdr->operation) {
+	case OP_DISPLAY:
+		log_debug("Sending logs time to userspace.");
 
-	entry_usr.time = node->time;
+		histogram = kmalloc(sizeof(*histogram), GFP_KERNEL);
+		if (!histogram)
+			return respond_error(nl_hdr, -ENOMEM);
 
-	return nlbuffer_write(buffer, &entry_usr, sizeof(entry_usr));
+		error = logtime_get(request->l3_proto, request->l4_proto, histogram);
+		if (!error)
+			error = respond_setcfg(nl_hdr, histogram, sizeof(*histogram));
+
+		kfree(histogram);
+		return respond_error(nl_hdr, error);
+	default:
+		log_err("Unknown operation: %d", nat64_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
 }
 
-static int handle_logtime_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
-		struct request_logtime *request)
+static int pool4_usage_to_userspace(struct pool4_usage_usr *usage, void *arg)
+{
+	return nlbuffer_write(arg, usage, sizeof(*usage));
+}
+
+/**
+ * Sends the occupancy of the tables to userspace. See STATS_OCCUPANCY.
+ */
+static int send_occupancy(struct nlmsghdr *nl_hdr)
 {
+	struct occupancy_usr occupancy;
 	struct nl_buffer *buffer;
+	l4_protocol proto;
 	int error;
+
+	memset(&occupancy, 0, sizeof(occupancy));
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		error = bibdb_count(proto, &occupancy.bibs[proto]);
+		if (error)
+			return respond_error(nl_hdr, error);
+	}
+	occupancy.hosts = bibdb_count_hosts();
+	sessiondb_get_occupancy(&occupancy);
+
+	buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
+	if (!buffer) {
+		log_err("Could not allocate an output buffer to userspace.");
+		return respond_error(nl_hdr, -ENOMEM);
+	}
+
+	error = nlbuffer_write(buffer, &occupancy, sizeof(occupancy));
+	if (!error)
+		error = pool4_for_each_usage(pool4_usage_to_userspace, buffer);
+	if (error > 0)
+		log_info("Too many pool4 addresses; only the first ones were reported.");
+	if (error >= 0)
+		error = nlbuffer_close(buffer);
+
+	nlbuffer_free(buffer);
+	return (error < 0) ? respond_error(nl_hdr, error) : error;
+}
+
+static int handle_stats_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		struct request_stats *request)
+{
+	struct jool_stats_usr *stats;
+	int error;
+
 	switch (nat64_hdr->operation) {
 	case OP_DISPLAY:
-		log_debug("Sending logs time to userspace.");
+		if (request->type == STATS_OCCUPANCY) {
+			log_debug("Sending the occupancy of the tables to userspace.");
+			return send_occupancy(nl_hdr);
+		}
+		if (request->type == STATS_MEMORY) {
+			struct memory_usr memory;
 
-		buffer = kmalloc(sizeof(*buffer), GFP_ATOMIC);
-		if (!buffer) {
-			log_err("Could not allocate an output buffer to userpace.");
-			return respond_error(nl_hdr, -ENOMEM);
+			log_debug("Sending the memory usage to userspace.");
+			memset(&memory, 0, sizeof(memory));
+			jool_mem_get(&memory);
+			return respond_setcfg(nl_hdr, &memory, sizeof(memory));
 		}
 
-		nlbuffer_init(buffer, nl_socket, nl_hdr);
-		error = logtime_iterate_and_delete(request->l3_proto, request->l4_proto,
-				logtime_entry_to_userspace, buffer);
-		if (error > 0)
-			error = nlbuffer_close_continue(buffer);
-		else
-			error = nlbuffer_close(buffer);
+		log_debug("Sending Jool's counters to userspace.");
 
-		kfree(buffer);
-		return error;
+		stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+		if (!stats)
+			return respond_error(nl_hdr, -ENOMEM);
+
+		jool_stats_get(stats);
+		lockstats_get(stats->locks);
+		error = respond_setcfg(nl_hdr, stats, sizeof(*stats));
+
+		kfree(stats);
+		return respond_error(nl_hdr, error);
 	default:
 		log_err("Unknown operation: %d", nat64_hdr->operation);
 		return respond_error(nl_hdr, -EINVAL);
 	}
 }
-#endif
 
 static int bib_entry_to_userspace(struct bib_entry *entry, void *arg)
 {
@@ -315,7 +592,7 @@ static int bib_entry_to_userspace(struct bib_entry *entry, void *arg)
 	struct bib_entry_usr entry_usr;
 
 	entry_usr.addr4 = entry->ipv4;
-	entry_usr.addr6 = entry->ipv6;
+	bib_ipv6(entry, &entry_usr.addr6);
 	entry_usr.is_static = entry->is_static;
 
 	return nlbuffer_write(buffer, &entry_usr, sizeof(entry_usr));
@@ -332,13 +609,12 @@ static int handle_bib_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_
 	case OP_DISPLAY:
 		log_debug("Sending BIB to userspace.");
 
-		buffer = kmalloc(sizeof(*buffer), GFP_ATOMIC);
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
 		if (!buffer) {
 			log_err("Could not allocate an output buffer to userspace.");
 			return respond_error(nl_hdr, -ENOMEM);
 		}
 
-		nlbuffer_init(buffer, nl_socket, nl_hdr);
 		error = bibdb_iterate_by_ipv4(request->l4_proto, &request->display.addr4,
 				!request->display.iterate, bib_entry_to_userspace, buffer);
 		if (error > 0) {
@@ -347,7 +623,7 @@ static int handle_bib_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_
 			error = nlbuffer_close(buffer);
 		}
 
-		kfree(buffer);
+		nlbuffer_free(buffer);
 		return error;
 
 	case OP_COUNT:
@@ -361,8 +637,12 @@ static int handle_bib_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_
 		if (verify_superpriv(nat64_hdr))
 			return respond_error(nl_hdr, -EPERM);
 
-		log_debug("Adding BIB entry.");
-		return respond_error(nl_hdr, add_static_route(request));
+		count = get_entry_count(nat64_hdr, sizeof(*request));
+		if (!count)
+			return respond_error(nl_hdr, -EINVAL);
+
+		log_debug("Adding %llu BIB entry(ies).", count);
+		return respond_error(nl_hdr, add_static_routes(request, count));
 
 	case OP_REMOVE:
 		if (verify_superpriv(nat64_hdr))
@@ -377,6 +657,168 @@ static int handle_bib_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_
 	}
 }
 
+static int session_entry_to_event(struct session_entry *entry, void *arg)
+{
+	struct nl_buffer *buffer = (struct nl_buffer *) arg;
+	struct dbevent_usr event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = DBEVENT_SESSION_ADD;
+	event.l4_proto = entry->l4_proto;
+	if (entry->l4_proto == L4PROTO_TCP)
+		event.state = entry->state;
+	event.remote6 = entry->remote6;
+	session_local6(entry, &event.local6);
+	event.local4 = entry->local4;
+	event.remote4 = entry->remote4;
+
+	return nlbuffer_write(buffer, &event, sizeof(event));
+}
+
+/**
+ * Display requests dump a table's sessions as DBEVENT_SESSION_ADD events (the snapshot); they
+ * carry a struct request_session. Add requests carry the events to install.
+ */
+static int handle_sync_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		void *payload)
+{
+	struct request_session *request = payload;
+	struct dbevent_usr *events = payload;
+	struct nl_buffer *buffer;
+	unsigned int count;
+	int error;
+
+	switch (nat64_hdr->operation) {
+	case OP_DISPLAY:
+		log_debug("Sending a snapshot of the session table to userspace.");
+
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
+		if (!buffer) {
+			log_err("Could not allocate an output buffer to userspace.");
+			return respond_error(nl_hdr, -ENOMEM);
+		}
+
+		error = sessiondb_iterate_by_ipv4(request->l4_proto, NULL, &request->display.addr4,
+				&request->display.remote4, !request->display.iterate,
+				session_entry_to_event, buffer);
+		if (error > 0) {
+			error = nlbuffer_close_continue(buffer);
+		} else {
+			error = nlbuffer_close(buffer);
+		}
+
+		nlbuffer_free(buffer);
+		return error;
+
+	case OP_ADD:
+		if (verify_superpriv(nat64_hdr))
+			return respond_error(nl_hdr, -EPERM);
+
+		count = get_entry_count(nat64_hdr, sizeof(*events));
+		if (!count)
+			return respond_error(nl_hdr, -EINVAL);
+
+		log_debug("Importing %u BIB/session event(s).", count);
+		sync_import(events, count);
+		return respond_error(nl_hdr, 0);
+
+	default:
+		log_err("Unknown operation: %d", nat64_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int changelog_record_to_usr(struct changelog_record *record, void *arg)
+{
+	return nlbuffer_write(arg, record, sizeof(*record));
+}
+
+static int handle_changes_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		struct request_changes *request)
+{
+	struct changes_response response;
+	struct nl_buffer *buffer;
+	__u64 generation;
+	int error;
+
+	if (!changelog_is_enabled()) {
+		log_err("The change log is disabled. (See the changelog_size module argument.)");
+		return respond_error(nl_hdr, -EINVAL);
+	}
+
+	switch (nat64_hdr->operation) {
+	case OP_DISPLAY:
+		if (nat64_hdr->length < sizeof(*nat64_hdr) + sizeof(*request)) {
+			log_err("The request is too small to contain a generation.");
+			return respond_error(nl_hdr, -EINVAL);
+		}
+
+		log_debug("Sending the changes since generation %llu to userspace.",
+				(unsigned long long) request->since);
+
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
+		if (!buffer) {
+			log_err("Could not allocate an output buffer to userspace.");
+			return respond_error(nl_hdr, -ENOMEM);
+		}
+
+		memset(&response, 0, sizeof(response));
+		response.generation = changelog_generation();
+		error = nlbuffer_write(buffer, &response, sizeof(response));
+		if (!error) {
+			error = changelog_foreach(request->since, response.generation,
+					changelog_record_to_usr, buffer);
+		}
+
+		if (error == -ESTALE) {
+			nlbuffer_free(buffer);
+			response.stale = true;
+			return respond_setcfg(nl_hdr, &response, sizeof(response));
+		}
+
+		if (error < 0)
+			error = respond_error(nl_hdr, error);
+		else if (error > 0)
+			error = nlbuffer_close_continue(buffer);
+		else
+			error = nlbuffer_close(buffer);
+
+		nlbuffer_free(buffer);
+		return error;
+
+	case OP_COUNT:
+		log_debug("Returning the latest generation.");
+		generation = changelog_generation();
+		return respond_setcfg(nl_hdr, &generation, sizeof(generation));
+
+	default:
+		log_err("Unknown operation: %d", nat64_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int handle_replay_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
+		void *payload)
+{
+	struct replay_result_usr result;
+	int error;
+
+	if (nat64_hdr->operation != OP_ADD) {
+		log_err("Unknown operation: %d", nat64_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+	if (verify_superpriv(nat64_hdr))
+		return respond_error(nl_hdr, -EPERM);
+
+	error = replay_packets(payload, nat64_hdr->length - sizeof(*nat64_hdr), &result);
+	if (error) {
+		log_err("The replay request is not a series of packets.");
+		return respond_error(nl_hdr, error);
+	}
+
+	return respond_setcfg(nl_hdr, &result, sizeof(result));
+}
+
 static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 {
 	struct nl_buffer *buffer = (struct nl_buffer *) arg;
@@ -390,11 +832,12 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 	dying_time += entry->update_time;
 
 	entry_usr.remote6 = entry->remote6;
-	entry_usr.local6 = entry->local6;
+	session_local6(entry, &entry_usr.local6);
 	entry_usr.local4 = entry->local4;
 	entry_usr.remote4 = entry->remote4;
 	entry_usr.state = entry->state;
 	entry_usr.dying_time = (dying_time > jiffies) ? jiffies_to_msecs(dying_time - jiffies) : 0;
+	session_get_counters(entry, &entry_usr.packets, &entry_usr.bytes);
 
 	return nlbuffer_write(buffer, &entry_usr, sizeof(entry_usr));
 }
@@ -402,6 +845,7 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
 		struct request_session *request)
 {
+	struct session_filter *filter;
 	struct nl_buffer *buffer;
 	__u64 count;
 	int error;
@@ -410,22 +854,32 @@ static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *na
 	case OP_DISPLAY:
 		log_debug("Sending session table to userspace.");
 
-		buffer = kmalloc(sizeof(*buffer), GFP_ATOMIC);
+		filter = &request->display.filter;
+		if ((filter->flags & SFILTER_PREFIX6) && filter->prefix6.len > 128) {
+			log_err("%u is not a valid prefix length.", filter->prefix6.len);
+			return respond_error(nl_hdr, -EINVAL);
+		}
+		if ((filter->flags & SFILTER_PORTS) && filter->port_min > filter->port_max) {
+			log_err("The port range %u-%u is empty.", filter->port_min, filter->port_max);
+			return respond_error(nl_hdr, -EINVAL);
+		}
+
+		buffer = nlbuffer_create(nl_socket, nl_hdr, NLBUFFER_DUMP_SIZE);
 		if (!buffer) {
 			log_err("Could not allocate an output buffer to userspace.");
 			return respond_error(nl_hdr, -ENOMEM);
 		}
 
-		nlbuffer_init(buffer, nl_socket, nl_hdr);
-		error = sessiondb_iterate_by_ipv4(request->l4_proto, &request->display.addr4,
-				!request->display.iterate, session_entry_to_userspace, buffer);
+		error = sessiondb_iterate_by_ipv4(request->l4_proto, filter, &request->display.addr4,
+				&request->display.remote4, !request->display.iterate,
+				session_entry_to_userspace, buffer);
 		if (error > 0) {
 			error = nlbuffer_close_continue(buffer);
 		} else {
 			error = nlbuffer_close(buffer);
 		}
 
-		kfree(buffer);
+		nlbuffer_free(buffer);
 		return error;
 
 	case OP_COUNT:
@@ -441,6 +895,77 @@ static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *na
 	}
 }
 
+static int update_general_value(struct general_record *record)
+{
+	void *value = record + 1;
+
+	switch (record->module) {
+	case SESSIONDB:
+		return sessiondb_set_config(record->type, record->size, value);
+	case PKTQUEUE:
+		return pktqueue_set_config(record->type, record->size, value);
+	case FILTERING:
+		return filtering_set_config(record->type, record->size, value);
+	case TRANSLATE:
+		return translate_set_config(record->type, record->size, value);
+	case FRAGMENT:
+		return fragdb_set_config(record->type, record->size, value);
+	case SENDPKT:
+		return sendpkt_set_config(record->type, record->size, value);
+	case LOGTIME:
+		return logtime_set_config(record->type, record->size, value);
+	}
+
+	log_err("Unknown module: %u", record->module);
+	return -EINVAL;
+}
+
+/**
+ * Applies the "count" records userspace packed in "buffer".
+ *
+ * The records are validated up front, so a malformed request changes nothing. The old
+ * configurations are retired in the background (see config_retire()), so this doesn't wait for
+ * a grace period per value. The first value a module rejects stops the update; the ones before it
+ * stay.
+ */
+static int update_general_config(__u16 count, unsigned char *buffer, size_t buffer_len)
+{
+	struct general_record *record;
+	size_t offset;
+	__u16 i;
+	int error;
+
+	if (count == 0) {
+		log_err("The request contains no values.");
+		return -EINVAL;
+	}
+
+	for (i = 0, offset = 0; i < count; i++) {
+		if (offset + sizeof(*record) > buffer_len)
+			goto truncated;
+		record = (struct general_record *) (buffer + offset);
+		if (offset + sizeof(*record) + record->size > buffer_len)
+			goto truncated;
+		offset += GENERAL_RECORD_LEN(record->size);
+	}
+
+	for (i = 0, offset = 0; i < count; i++) {
+		record = (struct general_record *) (buffer + offset);
+		error = update_general_value(record);
+		if (error) {
+			log_err("Value #%u of the request could not be applied.", i + 1);
+			return error;
+		}
+		offset += GENERAL_RECORD_LEN(record->size);
+	}
+
+	return 0;
+
+truncated:
+	log_err("The request is truncated; value #%u does not fit in it.", i + 1);
+	return -EINVAL;
+}
+
 static int handle_general_config(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr,
 		union request_general *request)
 {
@@ -456,6 +981,7 @@ static int handle_general_config(struct nlmsghdr *nl_hdr, struct request_hdr *na
 		error = sessiondb_clone_config(&response.sessiondb);
 		if (error)
 			goto end;
+		sessiondb_get_stats(&response.sessiondb_stats);
 		error = pktqueue_clone_config(&response.pktqueue);
 		if (error)
 			goto end;
@@ -468,7 +994,15 @@ static int handle_general_config(struct nlmsghdr *nl_hdr, struct request_hdr *na
 		error = fragdb_clone_config(&response.fragmentation);
 		if (error)
 			goto end;
+		fragdb_get_stats(&response.fragmentation_stats);
 		error = sendpkt_clone_config(&response.sendpkt);
+		if (error)
+			goto end;
+		icmp64_get_stats(&response.icmp_stats);
+		dbevents_get_stats(&response.dbevent_stats);
+		sync_get_stats(&response.dbevent_stats);
+		stagestats_get(&response.pipeline_stats);
+		error = logtime_clone_config(&response.logtime);
 		if (error)
 			goto end;
 
@@ -486,32 +1020,14 @@ static int handle_general_config(struct nlmsghdr *nl_hdr, struct request_hdr *na
 
 		log_debug("Updating 'General' options.");
 
+		if (nat64_hdr->length < sizeof(*nat64_hdr) + sizeof(*request)) {
+			log_err("The request is too small to contain an update header.");
+			return respond_error(nl_hdr, -EINVAL);
+		}
+
 		buffer = (unsigned char *) (request + 1);
 		buffer_len = nat64_hdr->length - sizeof(*nat64_hdr) - sizeof(*request);
-
-		switch (request->update.module) {
-		case SESSIONDB:
-			error = sessiondb_set_config(request->update.type, buffer_len, buffer);
-			break;
-		case PKTQUEUE:
-			error = pktqueue_set_config(request->update.type, buffer_len, buffer);
-			break;
-		case FILTERING:
-			error = filtering_set_config(request->update.type, buffer_len, buffer);
-			break;
-		case TRANSLATE:
-			error = translate_set_config(request->update.type, buffer_len, buffer);
-			break;
-		case FRAGMENT:
-			error = fragdb_set_config(request->update.type, buffer_len, buffer);
-			break;
-		case SENDPKT:
-			error = sendpkt_set_config(request->update.type, buffer_len, buffer);
-			break;
-		default:
-			log_err("Unknown module: %u", request->update.module);
-			error = -EINVAL;
-		}
+		error = update_general_config(request->update.count, buffer, buffer_len);
 		break;
 
 	default:
@@ -524,6 +1040,46 @@ end:
 	return respond_error(nl_hdr, error);
 }
 
+static int dispatch_request(struct nlmsghdr *nl_hdr, struct request_hdr *nat64_hdr, void *request)
+{
+	switch (nat64_hdr->mode) {
+	case MODE_POOL6:
+		return handle_pool6_config(nl_hdr, nat64_hdr, request);
+	case MODE_POOL4:
+		return handle_pool4_config(nl_hdr, nat64_hdr, request);
+	case MODE_BIB:
+		return handle_bib_config(nl_hdr, nat64_hdr, request);
+	case MODE_SESSION:
+		return handle_session_config(nl_hdr, nat64_hdr, request);
+	case MODE_LOGTIME:
+		return handle_logtime_config(nl_hdr, nat64_hdr, request);
+	case MODE_STATS:
+		return handle_stats_config(nl_hdr, nat64_hdr, request);
+	case MODE_SYNC:
+		return handle_sync_config(nl_hdr, nat64_hdr, request);
+	case MODE_EAMT:
+		return handle_eamt_config(nl_hdr, nat64_hdr, request);
+	case MODE_REPLAY:
+		return handle_replay_config(nl_hdr, nat64_hdr, request);
+	case MODE_CHANGES:
+		return handle_changes_config(nl_hdr, nat64_hdr, request);
+	case MODE_GENERAL:
+		return handle_general_config(nl_hdr, nat64_hdr, request);
+	}
+
+	log_err("Unknown configuration mode: %d", nat64_hdr->mode);
+	return respond_error(nl_hdr, -EINVAL);
+}
+
+/**
+ * Returns whether "hdr"'s request leaves everything the way it was.
+ * (Sync displays only read too; the sessions they dump stay where they are.)
+ */
+static bool is_read_only(struct request_hdr *hdr)
+{
+	return hdr->operation == OP_DISPLAY || hdr->operation == OP_COUNT;
+}
+
 /**
  * Gets called by "netlink_rcv_skb" when the userspace application wants to interact with us.
  *
@@ -534,7 +1090,7 @@ end:
 static int handle_netlink_message(struct sk_buff *skb_in, struct nlmsghdr *nl_hdr)
 {
 	struct request_hdr *nat64_hdr;
-	void *request;
+	int error;
 
 	if (nl_hdr->nlmsg_type != MSG_TYPE_JOOL) {
 		log_debug("Expecting %#x but got %#x.", MSG_TYPE_JOOL, nl_hdr->nlmsg_type);
@@ -542,27 +1098,22 @@ static int handle_netlink_message(struct sk_buff *skb_in, struct nlmsghdr *nl_hd
 	}
 
 	nat64_hdr = NLMSG_DATA(nl_hdr);
-	request = nat64_hdr + 1;
+	if (nlmsg_len(nl_hdr) < sizeof(*nat64_hdr) || nat64_hdr->length > nlmsg_len(nl_hdr)) {
+		log_debug("The request's length doesn't match its Netlink message's.");
+		return respond_error(nl_hdr, -EINVAL);
+	}
 
-	switch (nat64_hdr->mode) {
-	case MODE_POOL6:
-		return handle_pool6_config(nl_hdr, nat64_hdr, request);
-	case MODE_POOL4:
-		return handle_pool4_config(nl_hdr, nat64_hdr, request);
-	case MODE_BIB:
-		return handle_bib_config(nl_hdr, nat64_hdr, request);
-	case MODE_SESSION:
-		return handle_session_config(nl_hdr, nat64_hdr, request);
-#ifdef BENCHMARK
-	case MODE_LOGTIME:
-		return handle_logtime_config(nl_hdr, nat64_hdr, request);
-#endif
-	case MODE_GENERAL:
-		return handle_general_config(nl_hdr, nat64_hdr, request);
+	if (is_read_only(nat64_hdr)) {
+		down_read(&config_sem);
+		error = dispatch_request(nl_hdr, nat64_hdr, nat64_hdr + 1);
+		up_read(&config_sem);
+	} else {
+		down_write(&config_sem);
+		error = dispatch_request(nl_hdr, nat64_hdr, nat64_hdr + 1);
+		up_write(&config_sem);
 	}
 
-	log_err("Unknown configuration mode: %d", nat64_hdr->mode);
-	return respond_error(nl_hdr, -EINVAL);
+	return error;
 }
 
 /**
@@ -573,13 +1124,13 @@ static int handle_netlink_message(struct sk_buff *skb_in, struct nlmsghdr *nl_hd
 static void receive_from_userspace(struct sk_buff *skb)
 {
 	log_debug("Message arrived.");
-	mutex_lock(&my_mutex);
 	netlink_rcv_skb(skb, &handle_netlink_message);
-	mutex_unlock(&my_mutex);
 }
 
 int config_init(void)
 {
+	int error;
+
 	/*
 	 * The function changed between Linux 3.5.7 and 3.6, and then again from 3.6.11 to 3.7.
 	 *
@@ -588,14 +1139,14 @@ int config_init(void)
 	 * 9f00d9776bc5beb92e8bfc884a7e96ddc5589e2e (v3.7-rc1~145^2~194).
 	 */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 6, 0)
-	nl_socket = netlink_kernel_create(&init_net, NETLINK_USERSOCK, 0, receive_from_userspace,
+	nl_socket = netlink_kernel_create(joolns_get(), NETLINK_USERSOCK, 0, receive_from_userspace,
 			NULL, THIS_MODULE);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 7, 0)
 	struct netlink_kernel_cfg nl_cfg = { .input  = receive_from_userspace };
-	nl_socket = netlink_kernel_create(&init_net, NETLINK_USERSOCK, THIS_MODULE, &nl_cfg);
+	nl_socket = netlink_kernel_create(joolns_get(), NETLINK_USERSOCK, THIS_MODULE, &nl_cfg);
 #else
 	struct netlink_kernel_cfg nl_cfg = { .input  = receive_from_userspace };
-	nl_socket = netlink_kernel_create(&init_net, NETLINK_USERSOCK, &nl_cfg);
+	nl_socket = netlink_kernel_create(joolns_get(), NETLINK_USERSOCK, &nl_cfg);
 #endif
 	
 	if (!nl_socket) {
@@ -604,10 +1155,17 @@ int config_init(void)
 	}
 	log_debug("Netlink socket created.");
 
+	error = dbevents_init(nl_socket);
+	if (error) {
+		netlink_kernel_release(nl_socket);
+		return error;
+	}
+
 	return 0;
 }
 
 void config_destroy(void)
 {
+	dbevents_destroy();
 	netlink_kernel_release(nl_socket);
 }
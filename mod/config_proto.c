@@ -10,6 +10,7 @@ int serialize_general_config(struct response_general *config, unsigned char **bu
 	struct fragmentation_config *fconfig;
 	unsigned char *buffer;
 	size_t mtus_len;
+	unsigned int i;
 
 	mtus_len = config->translate.mtu_plateau_count * sizeof(*config->translate.mtu_plateaus);
 
@@ -26,7 +27,12 @@ int serialize_general_config(struct response_general *config, unsigned char **bu
 	sconfig->ttl.udp = jiffies_to_msecs(config->sessiondb.ttl.udp);
 	sconfig->ttl.tcp_est = jiffies_to_msecs(config->sessiondb.ttl.tcp_est);
 	sconfig->ttl.tcp_trans = jiffies_to_msecs(config->sessiondb.ttl.tcp_trans);
+	sconfig->ttl.tcp_closed = jiffies_to_msecs(config->sessiondb.ttl.tcp_closed);
 	sconfig->ttl.icmp = jiffies_to_msecs(config->sessiondb.ttl.icmp);
+	sconfig->refresh_granularity = jiffies_to_msecs(config->sessiondb.refresh_granularity);
+	sconfig->timer_slack = jiffies_to_msecs(config->sessiondb.timer_slack);
+	for (i = 0; i < UDP_CLASSES; i++)
+		sconfig->udp_classes[i].ttl = jiffies_to_msecs(sconfig->udp_classes[i].ttl);
 
 	fconfig = &((struct response_general *) buffer)->fragmentation;
 	fconfig->fragment_timeout = jiffies_to_msecs(config->fragmentation.fragment_timeout);
@@ -42,6 +48,7 @@ int deserialize_general_config(void *buffer, __u16 buffer_len, struct response_g
 	struct translate_config *tconfig;
 	struct fragmentation_config *fconfig;
 	size_t mtus_len;
+	unsigned int i;
 
 	memcpy(target_out, buffer, sizeof(*target_out));
 
@@ -49,7 +56,12 @@ int deserialize_general_config(void *buffer, __u16 buffer_len, struct response_g
 	sconfig->ttl.udp = msecs_to_jiffies(sconfig->ttl.udp);
 	sconfig->ttl.tcp_est = msecs_to_jiffies(sconfig->ttl.tcp_est);
 	sconfig->ttl.tcp_trans = msecs_to_jiffies(sconfig->ttl.tcp_trans);
+	sconfig->ttl.tcp_closed = msecs_to_jiffies(sconfig->ttl.tcp_closed);
 	sconfig->ttl.icmp = msecs_to_jiffies(sconfig->ttl.icmp);
+	sconfig->refresh_granularity = msecs_to_jiffies(sconfig->refresh_granularity);
+	sconfig->timer_slack = msecs_to_jiffies(sconfig->timer_slack);
+	for (i = 0; i < UDP_CLASSES; i++)
+		sconfig->udp_classes[i].ttl = msecs_to_jiffies(sconfig->udp_classes[i].ttl);
 
 	tconfig = &target_out->translate;
 	tconfig->mtu_plateaus = NULL;
@@ -7,55 +7,376 @@
 #include "nat64/mod/compute_outgoing_tuple.h"
 #include "nat64/mod/ttp/core.h"
 #include "nat64/mod/handling_hairpinning.h"
+#include "nat64/mod/siit.h"
 #include "nat64/mod/send_packet.h"
 #include "nat64/mod/stats.h"
+#include "nat64/mod/stage_stats.h"
+#include "nat64/mod/trace.h"
+#include "nat64/mod/namespace.h"
+#include "nat64/mod/rfc6052.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/interrupt.h>
+#include <linux/jhash.h>
+#include <linux/kthread.h>
+#include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <net/ipv6.h>
 
 
-static unsigned int core_common(struct sk_buff *skb_in)
+/*
+ * Build-time trimming (see Kbuild). It's a constant so the compiler drops whatever it guards.
+ */
+#ifdef JOOL_NO_HAIRPINNING
+#define HAIRPINNING_ENABLED false
+#else
+#define HAIRPINNING_ENABLED true
+#endif
+
+static int linearize(struct sk_buff *skb)
 {
-	struct sk_buff *skb_out;
+	int error;
+
+	error = skb_linearize(skb);
+	if (error) {
+		log_debug("Packet linearization failed with error code %u; cannot translate.", error);
+		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		return error;
+	}
+
+	return 0;
+}
+
+/**
+ * Leaves "skb" the way the copy path needs it: linear, and with its layer-4 checksum computed
+ * (the copy path updates it instead of computing it, so it can't be offloaded).
+ * This happens after its control buffer has been initialized, so the pointers the control buffer
+ * stores are updated accordingly.
+ */
+static int prepare_for_copy(struct sk_buff *skb)
+{
+	struct jool_cb *cb = skb_jcb(skb);
+	unsigned int payload_offset, frag_hdr_offset = 0;
+	int error;
+
+	if (!skb_is_nonlinear(skb) && skb->ip_summed != CHECKSUM_PARTIAL)
+		return 0;
+
+	payload_offset = skb_payload(skb) - (void *) skb_network_header(skb);
+	if (cb->frag_hdr)
+		frag_hdr_offset = (void *) cb->frag_hdr - (void *) skb_network_header(skb);
+
+	error = linearize(skb);
+	if (error)
+		return error;
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		error = skb_checksum_help(skb);
+		if (error) {
+			log_debug("skb_checksum_help() failed with error code %d; cannot translate.", error);
+			inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+			return error;
+		}
+	}
+
+	cb->payload = skb_network_header(skb) + payload_offset;
+	if (cb->frag_hdr)
+		cb->frag_hdr = (struct frag_hdr *) (skb_network_header(skb) + frag_hdr_offset);
+	return 0;
+}
+
+/**
+ * A packet going through the algorithm, along with the state the steps hand to each other.
+ *
+ * This is the only per-packet context; the steps take it (or the fields they need) rather than
+ * rederiving things. What's known about the packet itself (protocols, header offsets) lives in
+ * its control buffer instead (see struct jool_cb), because that has to survive copies and the
+ * fragment database.
+ */
+struct core_pkt {
+	struct sk_buff *skb;
 	struct tuple tuple_in;
 	struct tuple tuple_out;
+	/**
+	 * If true, "skb" is a fragment whose packet was already translated, so the first three steps
+	 * are skipped and "tuple_out" is used instead (see fragdb_handle4()).
+	 */
+	bool tuple_known;
+	/** "skb"'s session, if step 2 found it. Borrowed; only valid until step 3 is done. */
+	struct session_entry *session;
+	/** Whether "tuple_out" U-turns (see is_hairpin_tuple()). Set by step 3. */
+	bool hairpin;
+	/** VER_CONTINUE while "skb" still has steps to go through. */
 	verdict result;
+	/** Device reference held while "skb" waited in a batch queue. */
+	struct net_device *dev;
+};
 
-	result = determine_in_tuple(skb_in, &tuple_in);
-	if (result != VER_CONTINUE)
-		goto end;
-	result = filtering_and_updating(skb_in, &tuple_in);
-	if (result != VER_CONTINUE)
-		goto end;
-	result = compute_out_tuple(&tuple_in, &tuple_out, skb_in);
-	if (result != VER_CONTINUE)
-		goto end;
-	result = translating_the_packet(&tuple_out, skb_in, &skb_out);
+/**
+ * Step 5 of the algorithm, for packets whose translation would U-turn (pkt->tuple_out is that
+ * translation's tuple).
+ *
+ * Instead of building the IPv4 packet and running the whole algorithm on it, the second pass runs
+ * on pkt->skb itself, whose headers are then rewritten into the second pass' output in one go.
+ */
+static verdict hairpin_and_send(struct core_pkt *pkt, struct sendpkt_route_cache *cache,
+		struct stage_timer *timer)
+{
+	struct sk_buff *skb_in = pkt->skb;
+	struct tuple *tuple4 = &pkt->tuple_out;
+	struct sk_buff *skb_out;
+	struct tuple tuple6;
+	verdict result;
+	int error;
+
+	error = handling_hairpinning_tuple(skb_in, tuple4, &tuple6);
+	if (!error)
+		error = translating_the_hairpin_in_place(tuple4, &tuple6, skb_in, cache);
+	if (!error) {
+		stage_end(timer, STAGE_TRANSLATE);
+		sendpkt_send(skb_in, skb_in);
+		stage_end(timer, STAGE_SEND);
+		/* skb_in became the outgoing packet, and send_pkt released it. */
+		return VER_STOLEN;
+	}
+	if (error != -EAGAIN)
+		return VER_DROP;
+
+	/*
+	 * Fall back to the IPv4 detour. The second pass might need to answer the original packet
+	 * with an ICMP error, so it gets a copy.
+	 * If the second pass' filtering already ran, running it again on the same packet leaves the
+	 * tables the way they are.
+	 */
+	if (prepare_for_copy(skb_in) != 0)
+		return VER_DROP;
+
+	result = translating_the_packet(tuple4, skb_in, &skb_out);
 	if (result != VER_CONTINUE)
-		goto end;
+		return result;
+	stage_end(timer, STAGE_TRANSLATE);
 
-	if (is_hairpin(skb_out)) {
-		result = handling_hairpinning(skb_out, &tuple_out);
-		kfree_skb_queued(skb_out);
-	} else {
-		result = sendpkt_send(skb_in, skb_out);
-		/* send_pkt releases skb_out regardless of verdict. */
+	result = handling_hairpinning(skb_out, tuple4);
+	kfree_skb_queued(skb_out);
+	return result;
+}
+
+/**
+ * Steps 4 and 5 of the algorithm, for packets which don't U-turn: translates "skb_in" (and its
+ * list) using "tuple_out" and sends the result.
+ */
+static verdict translate_one(struct sk_buff *skb_in, struct tuple *tuple_out,
+		struct sendpkt_route_cache *cache, struct stage_timer *timer)
+{
+	struct sk_buff *skb_out;
+	verdict result;
+	int error;
+
+	error = translating_the_packet_in_place(tuple_out, skb_in, cache);
+	if (!error) {
+		stage_end(timer, STAGE_TRANSLATE);
+		sendpkt_send(skb_in, skb_in);
+		stage_end(timer, STAGE_SEND);
+		/* skb_in became the outgoing packet, and send_pkt released it. */
+		return VER_STOLEN;
 	}
+	if (error != -EAGAIN)
+		return VER_DROP;
+
+	if (prepare_for_copy(skb_in) != 0)
+		return VER_DROP;
 
+	result = translating_the_packet(tuple_out, skb_in, &skb_out);
 	if (result != VER_CONTINUE)
-		goto end;
+		return result;
+	stage_end(timer, STAGE_TRANSLATE);
 
-	log_debug("Success.");
-	/* The new packet was sent, so the original one can die; drop it. */
-	result = VER_DROP;
-	/* Fall through. */
+	result = sendpkt_send(skb_in, skb_out);
+	/* send_pkt releases skb_out regardless of verdict. */
+	stage_end(timer, STAGE_SEND);
+	return result;
+}
 
-end:
+/**
+ * Translates and sends the fragments from "skb" onwards (a list whose first fragment was already
+ * handled) one by one, using "tuple_out". They are released here, whatever happens to them.
+ */
+static void translate_siblings(struct sk_buff *skb, struct tuple *tuple_out,
+		struct sendpkt_route_cache *cache)
+{
+	struct sk_buff *next;
+	struct stage_timer timer;
+	verdict result;
+
+	for (; skb; skb = next) {
+		next = skb->next;
+		skb->next = skb->prev = NULL;
+
+		stage_start(&timer, skb);
+		result = translate_one(skb, tuple_out, cache, &timer);
+		if (result == VER_CONTINUE)
+			consume_skb_queued(skb);
+		else if (result == VER_DROP)
+			kfree_skb_queued(skb);
+	}
+}
+
+/**
+ * Steps 4 and 5 of the algorithm: translates pkt->skb using pkt->tuple_out and sends the result (or
+ * U-turns it).
+ *
+ * The translated version of a list of fragments would normally be built from scratch, because its
+ * first fragment's checksum might depend on its siblings. When it doesn't, the fragments are split
+ * and translated separately instead (the way early forwarding handles them anyway), which lets
+ * each of them have its headers rewritten in place rather than have its payload copied. sendpkt
+ * then refragments whatever is too big by sharing the pages.
+ */
+static verdict translate_and_send(struct core_pkt *pkt, struct sendpkt_route_cache *cache)
+{
+	struct sk_buff *skb_in = pkt->skb;
+	struct sk_buff *siblings;
+	struct stage_timer timer;
+	verdict result;
+
+	stage_start(&timer, skb_in);
+
+	if (HAIRPINNING_ENABLED && pkt->hairpin)
+		return hairpin_and_send(pkt, cache, &timer);
+
+	if (!skb_in->next || !skb_has_l4_hdr(skb_in) || !fragdb_is_csum_incremental(skb_in))
+		return translate_one(skb_in, &pkt->tuple_out, cache, &timer);
+
+	siblings = skb_in->next;
+	skb_in->next = NULL;
+	siblings->prev = NULL;
+
+	result = translate_one(skb_in, &pkt->tuple_out, cache, &timer);
 	if (result == VER_DROP)
-		kfree_skb_queued(skb_in);
-	return NF_STOLEN;
+		kfree_skb_queued(siblings);
+	else
+		translate_siblings(siblings, &pkt->tuple_out, cache);
+	return result;
+}
+
+/**
+ * Runs the whole algorithm on the "count" packets from "pkts".
+ *
+ * Every step handles the whole batch before the next one starts, so each step's code and data
+ * (eg. the session database's buckets) stay warm in the cache, and packets headed to the same
+ * place share one route lookup through "cache" (which can be NULL).
+ */
+static void core_common(struct core_pkt *pkts, unsigned int count,
+		struct sendpkt_route_cache *cache)
+{
+	struct core_pkt *pkt;
+	struct stage_timer timer;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+		pkt->session = NULL;
+		if (pkt->tuple_known) {
+			/* The fragment database never remembers U-turning tuples, but still. */
+			pkt->hairpin = HAIRPINNING_ENABLED && is_hairpin_tuple(&pkt->tuple_out);
+			continue;
+		}
+
+		stage_start(&timer, pkt->skb);
+		pkt->result = determine_in_tuple(pkt->skb, &pkt->tuple_in);
+		stage_end(&timer, STAGE_INCOMING);
+	}
+
+	/*
+	 * Steps 2 and 3 hand the sessions over without touching their refcounts (so the cache
+	 * line of a busy session doesn't bounce between the CPUs handling its packets). This is
+	 * what keeps them from being freed meanwhile.
+	 */
+	rcu_read_lock_bh();
+
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+		if (pkt->tuple_known || pkt->result != VER_CONTINUE)
+			continue;
+
+		if (siit_enabled())
+			continue; /* Stateless; there is nothing to filter nor update. */
+
+		stage_start(&timer, pkt->skb);
+		/*
+		 * Established flows don't need the BIB. Either way, whatever session step 2 finds
+		 * spares step 3 a second lookup.
+		 */
+		pkt->result = filtering_established(pkt->skb, &pkt->tuple_in, &pkt->session);
+		if (pkt->result == VER_CONTINUE && !pkt->session)
+			pkt->result = filtering_and_updating(pkt->skb, &pkt->tuple_in,
+					&pkt->session);
+		stage_end(&timer, STAGE_FILTERING);
+	}
+
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+		if (pkt->tuple_known || pkt->result != VER_CONTINUE)
+			continue;
+
+		stage_start(&timer, pkt->skb);
+		if (siit_enabled()) {
+			pkt->result = siit_compute_out_tuple(&pkt->tuple_in, &pkt->tuple_out, pkt->skb);
+		} else if (pkt->session) {
+			compute_out_tuple_session(pkt->session, &pkt->tuple_in, &pkt->tuple_out);
+			session_count(pkt->session, pkt->skb->len);
+			pkt->session = NULL;
+		} else {
+			pkt->result = compute_out_tuple(&pkt->tuple_in, &pkt->tuple_out, pkt->skb);
+		}
+		stage_end(&timer, STAGE_OUTGOING);
+		/*
+		 * If skb is a first fragment forwarded early, its siblings need to know the tuple.
+		 * Hairpinning re-runs the algorithm, which can't be done on fragments lacking layer-4
+		 * headers, so those siblings stay behind and time out instead.
+		 */
+		if (pkt->result != VER_CONTINUE)
+			continue;
+		pkt->hairpin = HAIRPINNING_ENABLED && is_hairpin_tuple(&pkt->tuple_out);
+		if (!pkt->hairpin)
+			fragdb_remember_tuple(pkt->skb, &pkt->tuple_out);
+	}
+
+	rcu_read_unlock_bh();
+
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+		if (pkt->result == VER_CONTINUE) {
+			pkt->result = translate_and_send(pkt, cache);
+			if (pkt->result == VER_CONTINUE) {
+				log_debug("Success.");
+				inc_jool_stats(JSTAT_TRANSLATED);
+			}
+		}
+
+		trace_jool_verdict((pkt->result != VER_STOLEN) ? pkt->skb : NULL, pkt->result);
+	}
+
+	/*
+	 * The originals are released only once the whole batch has been sent, so the sends aren't
+	 * held back by the frees, and the frees run back to back.
+	 */
+	for (i = 0; i < count; i++) {
+		pkt = &pkts[i];
+		if (pkt->result == VER_CONTINUE)
+			/* The new packet was sent, so the original one can die. */
+			consume_skb_queued(pkt->skb);
+		else if (pkt->result == VER_DROP)
+			kfree_skb_queued(pkt->skb);
+	}
 }
 
 /**
@@ -80,28 +401,589 @@ static int ensure_good_citizens(struct sk_buff *skb)
 	return 0;
 }
 
-static int linearize(struct sk_buff *skb)
+/**
+ * Makes sure "skb"'s layer-4 header (which starts "l4_offset" bytes after the network header,
+ * protocol being "proto") lies in its linear area, along with everything before it.
+ *
+ * Protocols whose payload also needs to be read (ICMP, because of the checksum validation and the
+ * inner packets) and anything unexpected get the whole packet linearized instead.
+ */
+static int pull_l4_hdr(struct sk_buff *skb, unsigned int l4_offset, __u8 proto)
 {
+	unsigned int l4_hdr_len;
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (!pskb_may_pull(skb, l4_offset + sizeof(struct tcphdr)))
+			return linearize(skb);
+		l4_hdr_len = tcp_hdr_len((struct tcphdr *) (skb->data + l4_offset));
+		break;
+	case IPPROTO_UDP:
+		l4_hdr_len = sizeof(struct udphdr);
+		break;
+	default:
+		return linearize(skb);
+	}
+
+	/* If this fails, the packet is truncated; let validation find out in the usual way. */
+	if (!pskb_may_pull(skb, l4_offset + l4_hdr_len))
+		return linearize(skb);
+
+	return 0;
+}
+
+/**
+ * Makes sure the pipeline can read "skb"'s headers without linearizing it (which, for paged
+ * skbs, means reallocating and copying the whole thing). The payload stays paged.
+ *
+ * Fragments are linearized anyway; the fragment database and the copy path read them whole.
+ */
+static int pull_headers4(struct sk_buff *skb)
+{
+	struct iphdr *hdr = ip_hdr(skb);
+	unsigned int l4_offset = 4 * hdr->ihl;
+	struct udphdr *hdr_udp;
 	int error;
 
-	error = skb_linearize(skb);
-	if (error) {
-		log_debug("Packet linearization failed with error code %u; cannot translate.", error);
-		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+	if (!skb_is_nonlinear(skb))
+		return 0;
+	if (is_fragmented_ipv4(hdr))
+		return linearize(skb);
+
+	error = pull_l4_hdr(skb, l4_offset, hdr->protocol);
+	if (error || !skb_is_nonlinear(skb))
 		return error;
+
+	/* Do not use hdr from now on. */
+	if (ip_hdr(skb)->protocol == IPPROTO_UDP) {
+		/* Zero checksums have to be computed from scratch, which means reading the payload. */
+		hdr_udp = (struct udphdr *) (skb->data + l4_offset);
+		if (hdr_udp->check == 0)
+			return linearize(skb);
+	}
+
+	return 0;
+}
+
+/**
+ * Same as pull_headers4(), except for IPv6.
+ */
+static int pull_headers6(struct sk_buff *skb)
+{
+	unsigned int l4_offset = sizeof(struct ipv6hdr);
+	__u8 nexthdr = ipv6_hdr(skb)->nexthdr;
+	struct ipv6_opt_hdr *hdr_opt;
+
+	if (!skb_is_nonlinear(skb))
+		return 0;
+
+	while (nexthdr == NEXTHDR_HOP || nexthdr == NEXTHDR_ROUTING || nexthdr == NEXTHDR_DEST) {
+		if (!pskb_may_pull(skb, l4_offset + sizeof(*hdr_opt)))
+			return linearize(skb);
+		hdr_opt = (struct ipv6_opt_hdr *) (skb->data + l4_offset);
+		nexthdr = hdr_opt->nexthdr;
+		l4_offset += ipv6_optlen(hdr_opt);
+	}
+
+	/* Fragment headers fall in pull_l4_hdr()'s default case. */
+	return pull_l4_hdr(skb, l4_offset, nexthdr);
+}
+
+/**
+ * Validates "skb" and hands it over to the fragment database.
+ *
+ * If this returns VER_CONTINUE, "pkt" is ready for core_common(). VER_DROP means the caller
+ * should drop "skb", and VER_STOLEN means somebody else already took care of it.
+ */
+static verdict prepare4(struct sk_buff *skb, struct core_pkt *pkt)
+{
+	int error;
+	verdict result;
+
+	if (pull_headers4(skb) != 0) /* Do not use ip_hdr(skb)'s old value from now on. */
+		return VER_DROP;
+
+	error = skb_init_cb_ipv4(skb);
+	if (error)
+		return VER_DROP;
+
+	result = fragdb_handle4(skb, &pkt->skb, &pkt->tuple_out);
+	if (result != VER_CONTINUE)
+		return result;
+
+	pkt->result = VER_CONTINUE;
+	pkt->tuple_known = !skb_has_l4_hdr(pkt->skb);
+	if (pkt->tuple_known)
+		return VER_CONTINUE;
+
+	error = validate_icmp4_csum(pkt->skb);
+	if (error) {
+		inc_stats(pkt->skb, IPSTATS_MIB_INHDRERRORS);
+		kfree_skb_queued(pkt->skb);
+		return VER_STOLEN;
+	}
+
+	return VER_CONTINUE;
+}
+
+/**
+ * Same as prepare4(), except for IPv6.
+ */
+static verdict prepare6(struct sk_buff *skb, struct core_pkt *pkt)
+{
+	int error;
+	verdict result;
+
+	if (pull_headers6(skb) != 0) /* Do not use ipv6_hdr(skb)'s old value from now on. */
+		return VER_DROP;
+
+	error = skb_init_cb_ipv6(skb);
+	if (error)
+		return VER_DROP;
+
+	result = fragdb_handle6(skb, &pkt->skb, &pkt->tuple_out);
+	if (result != VER_CONTINUE)
+		return result;
+
+	pkt->result = VER_CONTINUE;
+	pkt->tuple_known = !skb_has_l4_hdr(pkt->skb);
+	if (pkt->tuple_known)
+		return VER_CONTINUE;
+
+	error = validate_icmp6_csum(pkt->skb);
+	if (error) {
+		inc_stats(pkt->skb, IPSTATS_MIB_INHDRERRORS);
+		kfree_skb_queued(pkt->skb);
+		return VER_STOLEN;
+	}
+
+	return VER_CONTINUE;
+}
+
+/** Maximum value of the batch_size module parameter. */
+#define CORE_BATCH_MAX 64
+/** Packets arriving while a CPU's queue is this long are dropped. */
+#define CORE_QUEUE_MAX 1024
+
+/**
+ * A CPU's queue of packets waiting to be translated together.
+ */
+struct core_batch {
+	struct sk_buff_head queue;
+	/** Drains "queue"; scheduled whenever a packet is queued. */
+	struct tasklet_struct tasklet;
+	/** Working space for the tasklet (or the thread). */
+	struct core_pkt pkts[CORE_BATCH_MAX];
+	/** Schedules "tasklet" on the batch's own CPU, when some other CPU filled "queue". */
+	struct work_struct kick;
+	/**
+	 * If the batches are drained by threads, the one pinned to the batch's CPU, which is woken
+	 * up instead of "tasklet". NULL if the CPU was offline when the module was inserted, in
+	 * which case the batch falls back to "tasklet".
+	 */
+	struct task_struct *thread;
+};
+
+/** Maximum number of packets translated together. Zero means no batching. */
+static unsigned int batch_size;
+static struct core_batch __percpu *batches;
+
+/** Whether packets are moved to the CPU their session belongs to. See steer_cpu(). */
+static bool steer;
+/** Whether steering follows the ports pool4 deals to every CPU. See steer_port_cpu(). */
+static bool steer_ports;
+/** Runs the batches' "kick"s. */
+static struct workqueue_struct *steer_wq;
+static u32 steer_secret;
+
+/** Whether the batches are drained by batch_thread()s instead of tasklets. */
+static bool use_threads;
+/** Nanoseconds a thread keeps polling its empty queue before it goes to sleep. */
+static u64 poll_ns;
+
+/**
+ * Translates the next "batch_size" packets from "batch"'s queue. Softirqs have to be disabled.
+ */
+static void batch_translate(struct core_batch *batch)
+{
+	struct sendpkt_route_cache cache;
+	struct sk_buff *skb;
+	struct net_device *dev;
+	unsigned int count = 0;
+	unsigned int i;
+	verdict result;
+
+	while (count < batch_size && (skb = skb_dequeue(&batch->queue)) != NULL) {
+		dev = skb->dev;
+		result = (skb->protocol == htons(ETH_P_IP))
+				? prepare4(skb, &batch->pkts[count])
+				: prepare6(skb, &batch->pkts[count]);
+
+		switch (result) {
+		case VER_CONTINUE:
+			batch->pkts[count].dev = dev;
+			count++;
+			continue;
+		case VER_DROP:
+			kfree_skb(skb);
+			break;
+		case VER_STOLEN:
+			break;
+		}
+		dev_put(dev);
+	}
+
+	sendpkt_route_cache_init(&cache);
+	core_common(batch->pkts, count, &cache);
+	sendpkt_route_cache_flush(&cache);
+
+	for (i = 0; i < count; i++)
+		dev_put(batch->pkts[i].dev);
+}
+
+static void batch_run(unsigned long data)
+{
+	struct core_batch *batch = (struct core_batch *) data;
+
+	batch_translate(batch);
+
+	/* Let the rest of the softirqs breathe; whatever's left is handled next round. */
+	if (!skb_queue_empty(&batch->queue))
+		tasklet_schedule(&batch->tasklet);
+}
+
+/**
+ * Drains "data"'s queue, from the CPU it's bound to, for as long as the module lives.
+ *
+ * The translation code expects softirq context, so softirqs are disabled while it runs; they're
+ * reenabled between batches, which is when anything else that wants the CPU gets it.
+ */
+static int batch_thread(void *data)
+{
+	struct core_batch *batch = data;
+	u64 poll_end = 0;
+
+	while (!kthread_should_stop()) {
+		if (!skb_queue_empty(&batch->queue)) {
+			local_bh_disable();
+			batch_translate(batch);
+			local_bh_enable();
+			cond_resched();
+			poll_end = local_clock() + poll_ns;
+			continue;
+		}
+
+		if (local_clock() < poll_end) {
+			cpu_relax();
+			cond_resched();
+			continue;
+		}
+
+		/* batch_add() queues before it wakes us up, so nothing can slip in between. */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (skb_queue_empty(&batch->queue) && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static void batch_kick(struct work_struct *work)
+{
+	struct core_batch *batch = container_of(work, struct core_batch, kick);
+
+	/* The work runs in the batch's CPU, so this is where the tasklet will run. */
+	local_bh_disable();
+	tasklet_schedule(&batch->tasklet);
+	local_bh_enable();
+}
+
+/**
+ * Returns the CPU that owns the BIB entry of "skb"'s flow if pool4 lends every CPU its own ports,
+ * or -1 if it can't tell from the packet's first header.
+ *
+ * The IPv6 side is hashed over the source transport address (which is all the BIB entry is keyed
+ * on), so the CPU it lands on is the one that borrows the entry's port. pool4_port_cpu() maps that
+ * port back to the same CPU, which is where the IPv4 side is sent.
+ */
+static int steer_port_cpu(struct sk_buff *skb)
+{
+	struct iphdr *hdr4;
+	struct ipv6hdr *hdr6;
+	__be16 _ports[2], *ports;
+	struct icmphdr _icmp4, *icmp4;
+	struct icmp6hdr _icmp6, *icmp6;
+	unsigned int offset;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		hdr4 = ip_hdr(skb);
+		if (hdr4->frag_off & htons(IP_OFFSET))
+			return -1;
+		offset = skb_network_offset(skb) + 4 * hdr4->ihl;
+
+		switch (hdr4->protocol) {
+		case IPPROTO_TCP:
+		case IPPROTO_UDP:
+			ports = skb_header_pointer(skb, offset, sizeof(_ports), _ports);
+			return ports ? pool4_port_cpu(be16_to_cpu(ports[1])) : -1;
+		case IPPROTO_ICMP:
+			icmp4 = skb_header_pointer(skb, offset, sizeof(_icmp4), &_icmp4);
+			if (!icmp4 || (icmp4->type != ICMP_ECHO && icmp4->type != ICMP_ECHOREPLY))
+				return -1;
+			return pool4_port_cpu(be16_to_cpu(icmp4->un.echo.id));
+		}
+		return -1;
+	}
+
+	hdr6 = ipv6_hdr(skb);
+	offset = skb_network_offset(skb) + sizeof(*hdr6);
+
+	switch (hdr6->nexthdr) {
+	case NEXTHDR_TCP:
+	case NEXTHDR_UDP:
+		ports = skb_header_pointer(skb, offset, sizeof(_ports), _ports);
+		if (!ports)
+			return -1;
+		return jhash_3words(ipv6_addr_hash(&hdr6->saddr), (__force u32) ports[0],
+				hdr6->nexthdr, steer_secret) % nr_cpu_ids;
+	case NEXTHDR_ICMP:
+		icmp6 = skb_header_pointer(skb, offset, sizeof(_icmp6), &_icmp6);
+		if (!icmp6 || icmp6->icmp6_type != ICMPV6_ECHO_REQUEST)
+			return -1;
+		return jhash_3words(ipv6_addr_hash(&hdr6->saddr),
+				(__force u32) icmp6->icmp6_identifier, hdr6->nexthdr,
+				steer_secret) % nr_cpu_ids;
+	}
+
+	return -1;
+}
+
+/**
+ * Returns the CPU that should translate "skb", so both directions of its session are handled by
+ * the same CPU and the session's cache lines don't bounce around. Returns -1 if it doesn't matter.
+ *
+ * The only part of a session both directions know before the lookup is the remote IPv4 address
+ * (the IPv4 packet's source, embedded in the IPv6 packet's destination), so that's the key. Ports
+ * are left out so every fragment of a packet lands in the same CPU.
+ */
+static int steer_cpu(struct sk_buff *skb)
+{
+	struct ipv6_prefix prefix;
+	struct in_addr remote4;
+	int cpu;
+
+	if (siit_enabled())
+		return -1; /* Stateless; no sessions to keep together. */
+
+	if (steer_ports) {
+		cpu = steer_port_cpu(skb);
+		if (cpu != -1)
+			return cpu_online(cpu) ? cpu : -1;
+		/* Fragments, ICMP errors and extension headers; keep what the address says. */
+	}
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		remote4.s_addr = ip_hdr(skb)->saddr;
+	} else {
+		if (pool6_get(&ipv6_hdr(skb)->daddr, &prefix))
+			return -1;
+		if (addr_6to4(&ipv6_hdr(skb)->daddr, &prefix, &remote4))
+			return -1;
+	}
+
+	cpu = jhash_1word((__force u32) remote4.s_addr, steer_secret) % nr_cpu_ids;
+	return cpu_online(cpu) ? cpu : -1;
+}
+
+/**
+ * Queues "skb" for batch_run() if batching is enabled. Returns false if it isn't, in which case
+ * "skb" should be translated right away.
+ */
+static bool batch_add(struct sk_buff *skb)
+{
+	struct core_batch *batch;
+	int cpu;
+
+	if (!batch_size)
+		return false;
+
+	cpu = steer ? steer_cpu(skb) : -1;
+	if (cpu == smp_processor_id())
+		cpu = -1;
+
+	batch = (cpu != -1) ? per_cpu_ptr(batches, cpu) : this_cpu_ptr(batches);
+	if (skb_queue_len(&batch->queue) >= CORE_QUEUE_MAX) {
+		log_debug("The batch queue is full; dropping packet.");
+		kfree_skb(skb);
+		return true;
+	}
+
+	/* The packet outlives the hook, so the device must not go away in the meantime. */
+	dev_hold(skb->dev);
+	skb_queue_tail(&batch->queue, skb);
+	if (batch->thread)
+		wake_up_process(batch->thread);
+	else if (cpu != -1)
+		queue_work_on(cpu, steer_wq, &batch->kick);
+	else
+		tasklet_schedule(&batch->tasklet);
+	return true;
+}
+
+static void stop_threads(void)
+{
+	struct core_batch *current_batch;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		current_batch = per_cpu_ptr(batches, cpu);
+		if (current_batch->thread) {
+			kthread_stop(current_batch->thread);
+			put_task_struct(current_batch->thread);
+			current_batch->thread = NULL;
+		}
+	}
+}
+
+static int start_threads(void)
+{
+	struct core_batch *current_batch;
+	struct task_struct *thread;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		current_batch = per_cpu_ptr(batches, cpu);
+		thread = kthread_create_on_node(batch_thread, current_batch, cpu_to_node(cpu),
+				"jool/%d", cpu);
+		if (IS_ERR(thread)) {
+			log_err("Could not create the translation thread of CPU %d.", cpu);
+			stop_threads();
+			return PTR_ERR(thread);
+		}
+		kthread_bind(thread, cpu);
+		/* Keep it around until kthread_stop(), even if it were to exit on its own. */
+		get_task_struct(thread);
+		current_batch->thread = thread;
+		wake_up_process(thread);
 	}
 
 	return 0;
 }
 
+int core_init(unsigned int batch, bool steer_flows, bool port_affinity, bool threads,
+		unsigned int busy_poll)
+{
+	struct core_batch *current_batch;
+	int cpu;
+	int error;
+
+	if (batch > CORE_BATCH_MAX) {
+		log_err("The batch size cannot exceed %u.", CORE_BATCH_MAX);
+		return -EINVAL;
+	}
+	if (steer_flows && !batch) {
+		log_err("Flow steering needs batching (batch_size).");
+		return -EINVAL;
+	}
+	if (port_affinity && !steer_flows) {
+		log_err("Port affinity needs flow steering (steer_flows).");
+		return -EINVAL;
+	}
+	if (threads && !batch) {
+		log_err("Translation threads need batching (batch_size).");
+		return -EINVAL;
+	}
+	if (busy_poll && !threads) {
+		log_err("Busy polling needs translation threads (batch_threads).");
+		return -EINVAL;
+	}
+	batch_size = batch;
+	steer = steer_flows;
+	steer_ports = port_affinity;
+	use_threads = threads;
+	poll_ns = (u64) busy_poll * NSEC_PER_USEC;
+	if (!batch_size)
+		return 0;
+
+	if (steer) {
+		steer_wq = alloc_workqueue("jool_steer", WQ_HIGHPRI, 0);
+		if (!steer_wq)
+			return -ENOMEM;
+		get_random_bytes(&steer_secret, sizeof(steer_secret));
+	}
+
+	batches = alloc_percpu(struct core_batch);
+	if (!batches) {
+		if (steer_wq) {
+			destroy_workqueue(steer_wq);
+			steer_wq = NULL;
+		}
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		current_batch = per_cpu_ptr(batches, cpu);
+		skb_queue_head_init(&current_batch->queue);
+		tasklet_init(&current_batch->tasklet, batch_run, (unsigned long) current_batch);
+		INIT_WORK(&current_batch->kick, batch_kick);
+		current_batch->thread = NULL;
+	}
+
+	if (use_threads) {
+		error = start_threads();
+		if (error) {
+			free_percpu(batches);
+			if (steer_wq) {
+				destroy_workqueue(steer_wq);
+				steer_wq = NULL;
+			}
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+void core_destroy(void)
+{
+	struct core_batch *current_batch;
+	struct sk_buff *skb;
+	int cpu;
+
+	if (!batch_size)
+		return;
+
+	if (use_threads)
+		stop_threads();
+
+	/* Kicks schedule tasklets, so they have to die first. */
+	if (steer_wq) {
+		destroy_workqueue(steer_wq);
+		steer_wq = NULL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		current_batch = per_cpu_ptr(batches, cpu);
+		tasklet_kill(&current_batch->tasklet);
+		while ((skb = skb_dequeue(&current_batch->queue)) != NULL) {
+			dev_put(skb->dev);
+			kfree_skb(skb);
+		}
+	}
+
+	free_percpu(batches);
+}
+
 unsigned int core_4to6(struct sk_buff *skb)
 {
 	struct iphdr *hdr = ip_hdr(skb);
-	struct sk_buff *skbs;
-	int error;
+	struct core_pkt pkt;
 	verdict result;
 
-	if (!pool4_contains(hdr->daddr))
+	if (!joolns_owns(skb))
+		return NF_ACCEPT; /* Some other namespace's packet. */
+	if (siit_enabled() ? !siit_owns4(hdr->daddr) : !pool4_contains(hdr->daddr))
 		return NF_ACCEPT; /* Not meant for translation; let the kernel handle it. */
 
 	log_debug("===============================================");
@@ -109,35 +991,26 @@ unsigned int core_4to6(struct sk_buff *skb)
 
 	if (ensure_good_citizens(skb) != 0)
 		return NF_ACCEPT;
-	if (linearize(skb) != 0) /* Do not use hdr from now on. */
-		return NF_DROP;
-
-	error = skb_init_cb_ipv4(skb);
-	if (error)
-		return NF_DROP;
+	if (batch_add(skb))
+		return NF_STOLEN;
 
-	result = fragdb_handle4(skb, &skbs);
+	result = prepare4(skb, &pkt);
 	if (result != VER_CONTINUE)
 		return (unsigned int) result;
 
-	error = validate_icmp4_csum(skbs);
-	if (error) {
-		inc_stats(skbs, IPSTATS_MIB_INHDRERRORS);
-		kfree_skb_queued(skbs);
-		return NF_STOLEN;
-	}
-
-	return core_common(skbs);
+	core_common(&pkt, 1, NULL);
+	return NF_STOLEN;
 }
 
 unsigned int core_6to4(struct sk_buff *skb)
 {
 	struct ipv6hdr *hdr = ipv6_hdr(skb);
-	struct sk_buff *skbs;
-	int error;
+	struct core_pkt pkt;
 	verdict result;
 
-	if (!pool6_contains(&hdr->daddr))
+	if (!joolns_owns(skb))
+		return NF_ACCEPT; /* Some other namespace's packet. */
+	if (siit_enabled() ? !siit_owns6(&hdr->daddr) : !pool6_contains(&hdr->daddr))
 		return NF_ACCEPT; /* Not meant for translation; let the kernel handle it. */
 
 	log_debug("===============================================");
@@ -145,23 +1018,13 @@ unsigned int core_6to4(struct sk_buff *skb)
 
 	if (ensure_good_citizens(skb) != 0)
 		return NF_ACCEPT;
-	if (linearize(skb) != 0) /* Do not use hdr from now on. */
-		return NF_DROP;
-
-	error = skb_init_cb_ipv6(skb);
-	if (error)
-		return NF_DROP;
+	if (batch_add(skb))
+		return NF_STOLEN;
 
-	result = fragdb_handle6(skb, &skbs);
+	result = prepare6(skb, &pkt);
 	if (result != VER_CONTINUE)
 		return (unsigned int) result;
 
-	error = validate_icmp6_csum(skbs);
-	if (error) {
-		inc_stats(skbs, IPSTATS_MIB_INHDRERRORS);
-		kfree_skb_queued(skbs);
-		return NF_STOLEN;
-	}
-
-	return core_common(skbs);
+	core_common(&pkt, 1, NULL);
+	return NF_STOLEN;
 }
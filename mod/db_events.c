@@ -0,0 +1,190 @@
+#include "nat64/mod/db_events.h"
+#include "nat64/mod/types.h"
+#include "nat64/mod/bib_db.h"
+#include "nat64/mod/session_db.h"
+#include "nat64/mod/maplog.h"
+#include "nat64/mod/ipfix.h"
+#include "nat64/mod/changelog.h"
+
+#include <linux/interrupt.h>
+#include <linux/timer.h>
+#include <net/netlink.h>
+
+/** Number of events that fit in one Netlink message. */
+#define DBEVENTS_PER_MSG (NLMSG_DEFAULT_SIZE / sizeof(struct dbevent_usr))
+/** Maximum time an event waits for its batch to fill up before it's sent anyway. */
+#define DBEVENTS_DELAY (HZ / 10)
+
+/** Events waiting to be multicasted. Protected by "lock". */
+static struct {
+	struct dbevent_usr events[DBEVENTS_PER_MSG];
+	unsigned int count;
+} batch;
+/** The config module's socket; NULL when we're not publishing. Protected by "lock". */
+static struct sock *socket;
+static DEFINE_SPINLOCK(lock);
+
+/** Sends partial batches once they have waited DBEVENTS_DELAY. */
+static struct timer_list timer;
+/** Sends full batches. */
+static struct tasklet_struct tasklet;
+
+/** See struct dbevent_stats. */
+static atomic64_t events_sent = ATOMIC64_INIT(0);
+static atomic64_t events_dropped = ATOMIC64_INIT(0);
+
+/**
+ * Multicasts the pending events. Called from softirq context (by "timer" or "tasklet").
+ */
+static void flush(unsigned long arg)
+{
+	struct sk_buff *skb;
+	struct nlmsghdr *hdr;
+	struct sock *sk;
+	unsigned int count;
+	int error;
+
+	if (!ACCESS_ONCE(batch.count))
+		return;
+
+	skb = nlmsg_new(sizeof(batch.events), GFP_ATOMIC);
+
+	spin_lock_bh(&lock);
+	sk = socket;
+	count = batch.count;
+	if (!sk || !skb || !count) {
+		batch.count = 0;
+		spin_unlock_bh(&lock);
+		if (!skb)
+			atomic64_add(count, &events_dropped);
+		kfree_skb(skb);
+		return;
+	}
+
+	hdr = nlmsg_put(skb, 0, 0, MSG_DBEVENTS, count * sizeof(*batch.events), 0);
+	memcpy(nlmsg_data(hdr), batch.events, count * sizeof(*batch.events));
+	batch.count = 0;
+	spin_unlock_bh(&lock);
+
+	/* Also fails if a listener's receive queue is full; that's our backpressure. */
+	error = nlmsg_multicast(sk, skb, 0, DBEVENTS_GROUP, GFP_ATOMIC);
+	if (error) {
+		log_debug("Multicasting the DB events failed (error code %d).", error);
+		atomic64_add(count, &events_dropped);
+	} else {
+		atomic64_add(count, &events_sent);
+	}
+}
+
+/**
+ * Returns whether anyone would receive the events right now. Lockless, so it can be stale; flush()
+ * rechecks the socket.
+ */
+static bool is_listened(void)
+{
+	struct sock *sk = ACCESS_ONCE(socket);
+	return sk && netlink_has_listeners(sk, DBEVENTS_GROUP);
+}
+
+static void record(struct dbevent_usr *event)
+{
+	spin_lock_bh(&lock);
+
+	if (batch.count >= DBEVENTS_PER_MSG) {
+		/* The tasklet hasn't caught up yet. */
+		spin_unlock_bh(&lock);
+		atomic64_inc(&events_dropped);
+		return;
+	}
+
+	batch.events[batch.count] = *event;
+	batch.count++;
+	if (batch.count == 1)
+		mod_timer(&timer, jiffies + DBEVENTS_DELAY);
+	else if (batch.count == DBEVENTS_PER_MSG)
+		tasklet_schedule(&tasklet);
+
+	spin_unlock_bh(&lock);
+}
+
+int dbevents_init(struct sock *nl_socket)
+{
+	setup_timer(&timer, flush, 0);
+	tasklet_init(&tasklet, flush, 0);
+	batch.count = 0;
+
+	spin_lock_bh(&lock);
+	socket = nl_socket;
+	spin_unlock_bh(&lock);
+
+	return 0;
+}
+
+void dbevents_destroy(void)
+{
+	spin_lock_bh(&lock);
+	socket = NULL;
+	batch.count = 0;
+	spin_unlock_bh(&lock);
+
+	del_timer_sync(&timer);
+	tasklet_kill(&tasklet);
+}
+
+void dbevents_bib(enum dbevent_type type, struct bib_entry *bib)
+{
+	struct dbevent_usr event;
+	bool listened = is_listened();
+
+	if (!listened && !maplog_is_enabled() && !ipfix_is_enabled() && !changelog_is_enabled())
+		return;
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.l4_proto = bib->l4_proto;
+	bib_ipv6(bib, &event.remote6);
+	event.local4 = bib->ipv4;
+
+	maplog_write(&event);
+	ipfix_write(&event);
+	changelog_write(&event);
+	if (listened)
+		record(&event);
+}
+
+void dbevents_session(enum dbevent_type type, struct session_entry *session)
+{
+	struct dbevent_usr event;
+	bool listened = is_listened();
+
+	if (!listened && !maplog_is_enabled() && !ipfix_is_enabled() && !changelog_is_enabled())
+		return;
+
+	memset(&event, 0, sizeof(event)); /* Don't leak the padding. */
+	event.type = type;
+	event.l4_proto = session->l4_proto;
+	if (session->l4_proto == L4PROTO_TCP)
+		event.state = session->state;
+	event.remote6 = session->remote6;
+	session_local6(session, &event.local6);
+	event.local4 = session->local4;
+	event.remote4 = session->remote4;
+	if (type == DBEVENT_SESSION_REMOVE)
+		session_get_counters(session, &event.packets, &event.bytes);
+
+	if (type != DBEVENT_SESSION_UPDATE) {
+		maplog_write(&event);
+		ipfix_write(&event);
+	}
+	changelog_write(&event);
+	if (listened)
+		record(&event);
+}
+
+void dbevents_get_stats(struct dbevent_stats *result)
+{
+	result->events_sent = atomic64_read(&events_sent);
+	result->events_dropped = atomic64_read(&events_dropped);
+	maplog_get_stats(result);
+	ipfix_get_stats(result);
+}
@@ -59,7 +59,7 @@ static verdict ipv4_icmp_info(struct sk_buff *skb, struct tuple *tuple4)
 	return VER_CONTINUE;
 }
 
-static verdict ipv4_icmp_err(struct sk_buff *skb, struct tuple *tuple4)
+static noinline __cold verdict ipv4_icmp_err(struct sk_buff *skb, struct tuple *tuple4)
 {
 	struct iphdr *inner_ipv4 = (struct iphdr *) (icmp_hdr(skb) + 1);
 	struct udphdr *inner_udp;
@@ -142,7 +142,7 @@ static verdict ipv6_icmp_info(struct sk_buff *skb, struct tuple *tuple6)
 	return VER_CONTINUE;
 }
 
-static verdict ipv6_icmp_err(struct sk_buff *skb, struct tuple *tuple6)
+static noinline __cold verdict ipv6_icmp_err(struct sk_buff *skb, struct tuple *tuple6)
 {
 	struct ipv6hdr *inner_ipv6 = (struct ipv6hdr *) (icmp6_hdr(skb) + 1);
 	struct hdr_iterator iterator = HDR_ITERATOR_INIT(inner_ipv6);
@@ -197,6 +197,29 @@ static verdict ipv6_icmp_err(struct sk_buff *skb, struct tuple *tuple6)
  * @}
  */
 
+/**
+ * ICMP errors and unknown ICMP types are rare, so they're kept out of determine_in_tuple()'s way
+ * (the hot path is a UDP, TCP or echo packet).
+ */
+static noinline __cold verdict unknown_icmp_type(struct sk_buff *skb, char *proto, __u8 type)
+{
+	log_debug("Unknown %s type: %u. Dropping packet...", proto, type);
+	inc_stats(skb, IPSTATS_MIB_INHDRERRORS);
+	return VER_DROP;
+}
+
+/*
+ * Build-time trimming (see Kbuild): without ICMP informational support, echoes are treated like
+ * unknown ICMP types.
+ */
+#ifdef JOOL_NO_ICMP_INFO
+#define icmp4_info_supported(type) false
+#define icmp6_info_supported(type) false
+#else
+#define icmp4_info_supported(type) is_icmp4_info(type)
+#define icmp6_info_supported(type) is_icmp6_info(type)
+#endif
+
 /**
  * Extracts relevant data from "skb" and stores it in the "tuple" tuple.
  *
@@ -223,15 +246,12 @@ verdict determine_in_tuple(struct sk_buff *skb, struct tuple *in_tuple)
 			break;
 		case L4PROTO_ICMP:
 			icmp4 = icmp_hdr(skb);
-			if (is_icmp4_info(icmp4->type)) {
+			if (likely(icmp4_info_supported(icmp4->type)))
 				result = ipv4_icmp_info(skb, in_tuple);
-			} else if (is_icmp4_error(icmp4->type)) {
+			else if (is_icmp4_error(icmp4->type))
 				result = ipv4_icmp_err(skb, in_tuple);
-			} else {
-				log_debug("Unknown ICMPv4 type: %u. Dropping packet...", icmp4->type);
-				inc_stats(skb, IPSTATS_MIB_INHDRERRORS);
-				result = VER_DROP;
-			}
+			else
+				result = unknown_icmp_type(skb, "ICMPv4", icmp4->type);
 			break;
 		}
 		break;
@@ -246,15 +266,12 @@ verdict determine_in_tuple(struct sk_buff *skb, struct tuple *in_tuple)
 			break;
 		case L4PROTO_ICMP:
 			icmp6 = icmp6_hdr(skb);
-			if (is_icmp6_info(icmp6->icmp6_type)) {
+			if (likely(icmp6_info_supported(icmp6->icmp6_type)))
 				result = ipv6_icmp_info(skb, in_tuple);
-			} else if (is_icmp6_error(icmp6->icmp6_type)) {
+			else if (is_icmp6_error(icmp6->icmp6_type))
 				result = ipv6_icmp_err(skb, in_tuple);
-			} else {
-				log_debug("Unknown ICMPv6 type: %u. Dropping packet...", icmp6->icmp6_type);
-				inc_stats(skb, IPSTATS_MIB_INHDRERRORS);
-				result = VER_DROP;
-			}
+			else
+				result = unknown_icmp_type(skb, "ICMPv6", icmp6->icmp6_type);
 			break;
 		}
 		break;
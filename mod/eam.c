@@ -0,0 +1,650 @@
+#include "nat64/mod/eam.h"
+#include "nat64/mod/stats.h"
+#include "nat64/mod/types.h"
+
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <net/ipv6.h>
+
+
+/**
+ * An entry within the table.
+ */
+struct eamt_node {
+	struct eam_entry entry;
+	/** The thing that connects this object to the "table" list. */
+	struct list_head list_hook;
+};
+
+/**
+ * The global container of the entire table.
+ * The list contains nodes of type eamt_node, in the order they were added. Packets don't walk it;
+ * they query the snapshot instead.
+ *
+ * Only the configuration touches the list, so it is protected by a mutex; that way the snapshots
+ * (which can be large) can be allocated and released while sleeping.
+ */
+static LIST_HEAD(table);
+static u64 table_count;
+static DEFINE_MUTEX(table_mutex);
+
+/** "No node" and "no entry", as far as trie_node's indexes are concerned. */
+#define TRIE_NONE ((__u32) -1)
+
+/**
+ * A node of a path-compressed binary trie. Nodes without an entry only exist where two branches
+ * part ways, so the tries stay as shallow as the table's prefixes allow.
+ *
+ * The tries live in arrays and refer to their nodes by index, so they can be built in one
+ * allocation and are compact enough for two nodes to share a cache line.
+ */
+struct trie_node {
+	/** The first "len" bits of this are the node's prefix; the rest are garbage. */
+	__u8 key[16];
+	__u8 len;
+	/** Indexes of the nodes whose next bit is 0 and 1, respectively. */
+	__u32 children[2];
+	/** Index of the snapshot entry whose prefix is this node's, if any. */
+	__u32 entry;
+};
+
+/**
+ * A trie of the table's IPv6 prefixes or of its IPv4 prefixes. The root (nodes[0]) is always the
+ * zero-length prefix.
+ */
+struct trie {
+	struct trie_node *nodes;
+	/** Nodes in use. Every entry adds at most two, so "nodes" has room for 2 * entries + 1. */
+	__u32 count;
+};
+
+/**
+ * A read-only copy of the table, so packets don't need table_mutex.
+ * Readers need rcu_read_lock_bh(); writers need table_mutex.
+ */
+struct eamt_snapshot {
+	unsigned int count;
+	struct eam_entry *entries;
+	struct trie trie6;
+	struct trie trie4;
+	/** Retires the snapshot once the readers are done with it. */
+	struct rcu_head rcu_hook;
+	/** Links the snapshot to "dead_snapshots" while it waits for reap_work. */
+	struct list_head list_hook;
+};
+
+/** NULL means the table is empty. */
+static struct eamt_snapshot __rcu *snapshot;
+
+/**
+ * vmalloc()ed snapshots the readers are done with. vfree() can't be called from an RCU callback on
+ * every kernel, so reap_work releases them from process context.
+ */
+static LIST_HEAD(dead_snapshots);
+static DEFINE_SPINLOCK(dead_lock);
+static void reap_snapshots(struct work_struct *work);
+static DECLARE_WORK(reap_work, reap_snapshots);
+
+/**
+ * Returns the network mask of an IPv4 prefix of length "len".
+ */
+static __be32 mask4(__u8 len)
+{
+	return len ? htonl(~0U << (32 - len)) : 0;
+}
+
+static int validate_entry(struct eam_entry *entry)
+{
+	struct in6_addr network6;
+
+	if (entry->prefix6.len > 128 || entry->prefix4.len > 32) {
+		log_err("%u/%u are not valid prefix lengths.", entry->prefix6.len, entry->prefix4.len);
+		return -EINVAL;
+	}
+	/* Otherwise the addresses wouldn't pair up one to one. */
+	if (128 - entry->prefix6.len != 32 - entry->prefix4.len) {
+		log_err("The suffixes of %pI6c/%u and %pI4/%u are not the same length.",
+				&entry->prefix6.address, entry->prefix6.len,
+				&entry->prefix4.address, entry->prefix4.len);
+		return -EINVAL;
+	}
+
+	ipv6_addr_prefix(&network6, &entry->prefix6.address, entry->prefix6.len);
+	if (!ipv6_addr_equal(&network6, &entry->prefix6.address)) {
+		log_err("%pI6c/%u seems to have a suffix.", &entry->prefix6.address, entry->prefix6.len);
+		return -EINVAL;
+	}
+	if (entry->prefix4.address.s_addr & ~mask4(entry->prefix4.len)) {
+		log_err("%pI4/%u seems to have a suffix.", &entry->prefix4.address, entry->prefix4.len);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static unsigned int get_bit(const __u8 *key, unsigned int index)
+{
+	return (key[index >> 3] >> (7 - (index & 7))) & 1;
+}
+
+/**
+ * Returns whether the first "len" bits of "a" and "b" are the same.
+ */
+static bool prefix_equal(const __u8 *a, const __u8 *b, unsigned int len)
+{
+	unsigned int bytes = len >> 3;
+	unsigned int bits = len & 7;
+
+	if (memcmp(a, b, bytes) != 0)
+		return false;
+	return !bits || !((a[bytes] ^ b[bytes]) & (0xFF << (8 - bits)));
+}
+
+/**
+ * Returns the number of leading bits "a" and "b" have in common, up to "max".
+ */
+static unsigned int common_len(const __u8 *a, const __u8 *b, unsigned int max)
+{
+	unsigned int i;
+	__u8 diff;
+
+	for (i = 0; 8 * i < max; i++) {
+		diff = a[i] ^ b[i];
+		if (diff)
+			return min(max, 8 * i + 8 - fls(diff));
+	}
+
+	return max;
+}
+
+static __u32 trie_new_node(struct trie *trie, const __u8 *key, unsigned int key_len,
+		__u8 len, __u32 entry)
+{
+	struct trie_node *node = &trie->nodes[trie->count];
+
+	memcpy(node->key, key, key_len);
+	node->len = len;
+	node->children[0] = TRIE_NONE;
+	node->children[1] = TRIE_NONE;
+	node->entry = entry;
+
+	return trie->count++;
+}
+
+/**
+ * Indexes entry number "entry", whose prefix is "key"/"len", in "trie".
+ * "key_len" is the size in bytes of the addresses.
+ *
+ * @return zero, or -EEXIST if some other entry already has the same prefix.
+ */
+static int trie_add(struct trie *trie, const __u8 *key, unsigned int key_len, __u8 len,
+		__u32 entry)
+{
+	struct trie_node *cur = &trie->nodes[0];
+	struct trie_node *child;
+	__u32 *slot;
+	__u32 split;
+	unsigned int common;
+
+	/* Invariant: "cur"'s prefix contains "key", and is no longer. */
+	while (cur->len < len) {
+		slot = &cur->children[get_bit(key, cur->len)];
+		if (*slot == TRIE_NONE) {
+			*slot = trie_new_node(trie, key, key_len, len, entry);
+			return 0;
+		}
+
+		child = &trie->nodes[*slot];
+		common = common_len(key, child->key, min(len, child->len));
+		if (common == child->len) {
+			cur = child;
+			continue;
+		}
+
+		/* "key"/"len" and "child" part ways (or "key"/"len" contains "child") at "common". */
+		split = trie_new_node(trie, key, key_len, common,
+				(common == len) ? entry : TRIE_NONE);
+		trie->nodes[split].children[get_bit(child->key, common)] = *slot;
+		if (common < len)
+			trie->nodes[split].children[get_bit(key, common)]
+					= trie_new_node(trie, key, key_len, len, entry);
+		*slot = split;
+		return 0;
+	}
+
+	if (cur->entry != TRIE_NONE)
+		return -EEXIST;
+	cur->entry = entry;
+	return 0;
+}
+
+/**
+ * Returns the index of the entry whose prefix is the longest one (from "trie") that contains
+ * "addr", which is "bits" long. Returns TRIE_NONE if there's none.
+ */
+static __u32 trie_get(struct trie *trie, const __u8 *addr, unsigned int bits)
+{
+	struct trie_node *cur = &trie->nodes[0];
+	__u32 result = TRIE_NONE;
+	__u32 next;
+
+	while (true) {
+		if (cur->entry != TRIE_NONE)
+			result = cur->entry;
+		if (cur->len == bits)
+			break;
+
+		next = cur->children[get_bit(addr, cur->len)];
+		if (next == TRIE_NONE)
+			break;
+		cur = &trie->nodes[next];
+		/* Path compression skipped some bits; make sure they match. */
+		if (!prefix_equal(addr, cur->key, cur->len))
+			break;
+	}
+
+	return result;
+}
+
+/**
+ * Returns the length of a snapshot of "count" entries; see build_snapshot() for the layout.
+ */
+static size_t snapshot_size(unsigned int count)
+{
+	struct eamt_snapshot *snap;
+
+	return sizeof(*snap) + count * sizeof(*snap->entries)
+			+ 2 * (2 * count + 1) * sizeof(struct trie_node);
+}
+
+static struct eamt_snapshot *snapshot_alloc(unsigned int count)
+{
+	size_t size = snapshot_size(count);
+	struct eamt_snapshot *snap;
+
+	/* Big tables are too big to be asking for physically contiguous memory. */
+	snap = (size > PAGE_SIZE) ? vmalloc(size) : kmalloc(size, GFP_KERNEL);
+	if (snap) {
+		snap->count = count;
+		jool_mem_add(JMEM_EAMT, size);
+	}
+	return snap;
+}
+
+static void snapshot_free(struct eamt_snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	jool_mem_add(JMEM_EAMT, -(long) snapshot_size(snap->count));
+	if (is_vmalloc_addr(snap))
+		vfree(snap);
+	else
+		kfree(snap);
+}
+
+static void reap_snapshots(struct work_struct *work)
+{
+	struct eamt_snapshot *snap, *tmp;
+	LIST_HEAD(victims);
+
+	spin_lock_bh(&dead_lock);
+	list_splice_init(&dead_snapshots, &victims);
+	spin_unlock_bh(&dead_lock);
+
+	list_for_each_entry_safe(snap, tmp, &victims, list_hook)
+		snapshot_free(snap);
+}
+
+static void snapshot_free_rcu(struct rcu_head *rcu_hook)
+{
+	struct eamt_snapshot *snap = container_of(rcu_hook, struct eamt_snapshot, rcu_hook);
+
+	if (!is_vmalloc_addr(snap)) {
+		snapshot_free(snap);
+		return;
+	}
+
+	spin_lock(&dead_lock);
+	list_add_tail(&snap->list_hook, &dead_snapshots);
+	spin_unlock(&dead_lock);
+	schedule_work(&reap_work);
+}
+
+/**
+ * Builds a snapshot of the table's current entries. Returns NULL in "result" if the table is
+ * empty.
+ *
+ * Assumes that table has already been locked (table_mutex).
+ *
+ * @return zero, -ENOMEM, or -EEXIST if two entries share a prefix.
+ */
+static int build_snapshot(struct eamt_snapshot **result)
+{
+	struct eamt_snapshot *snap;
+	struct eamt_node *node;
+	size_t trie_size;
+	__u32 i = 0;
+	int error = 0;
+
+	*result = NULL;
+	if (!table_count)
+		return 0;
+
+	trie_size = (2 * table_count + 1) * sizeof(struct trie_node);
+	snap = snapshot_alloc(table_count);
+	if (!snap) {
+		log_err("Could not allocate the EAMT's snapshot.");
+		return -ENOMEM;
+	}
+
+	snap->entries = (struct eam_entry *) (snap + 1);
+	snap->trie6.nodes = (struct trie_node *) (snap->entries + table_count);
+	snap->trie6.count = 0;
+	snap->trie4.nodes = (struct trie_node *) ((__u8 *) snap->trie6.nodes + trie_size);
+	snap->trie4.count = 0;
+
+	trie_new_node(&snap->trie6, (__u8 *) &in6addr_any, 16, 0, TRIE_NONE);
+	trie_new_node(&snap->trie4, (__u8 *) &in6addr_any, 4, 0, TRIE_NONE);
+
+	list_for_each_entry(node, &table, list_hook) {
+		snap->entries[i] = node->entry;
+		error = trie_add(&snap->trie6, node->entry.prefix6.address.s6_addr, 16,
+				node->entry.prefix6.len, i);
+		if (!error)
+			error = trie_add(&snap->trie4, (__u8 *) &node->entry.prefix4.address, 4,
+					node->entry.prefix4.len, i);
+		if (error) {
+			/* Otherwise one of the sides would become ambiguous. */
+			log_err("%pI6c/%u or %pI4/%u already belongs to the EAMT.",
+					&node->entry.prefix6.address, node->entry.prefix6.len,
+					&node->entry.prefix4.address, node->entry.prefix4.len);
+			snapshot_free(snap);
+			return error;
+		}
+		i++;
+	}
+
+	*result = snap;
+	return 0;
+}
+
+/**
+ * Builds and publishes a snapshot of the table's current entries. The old snapshot stays if this
+ * fails.
+ *
+ * Assumes that table has already been locked (table_mutex).
+ */
+static int publish_snapshot(void)
+{
+	struct eamt_snapshot *new, *old;
+	int error;
+
+	error = build_snapshot(&new);
+	if (error)
+		return error;
+
+	old = rcu_dereference_protected(snapshot, lockdep_is_held(&table_mutex));
+	rcu_assign_pointer(snapshot, new);
+	/* Don't make the control path wait for the grace period. */
+	if (old)
+		call_rcu_bh(&old->rcu_hook, snapshot_free_rcu);
+
+	return 0;
+}
+
+/**
+ * Forgets the last "count" entries that were added to the list.
+ *
+ * Assumes that table has already been locked (table_mutex).
+ */
+static void drop_newest(unsigned int count)
+{
+	struct eamt_node *node;
+
+	while (count-- > 0) {
+		node = container_of(table.prev, struct eamt_node, list_hook);
+		list_del(&node->list_hook);
+		kfree(node);
+		jool_mem_add(JMEM_EAMT, -(long) sizeof(*node));
+		table_count--;
+	}
+}
+
+/**
+ * Forgets the table's entries. Remember to publish_snapshot() afterwards.
+ *
+ * Assumes that table has already been locked (table_mutex).
+ */
+static void empty_list(void)
+{
+	drop_newest(table_count);
+}
+
+/**
+ * Returns (in "result") the entry whose IPv6 prefix is the longest one that contains "addr".
+ */
+static int get6(const struct in6_addr *addr, struct eam_entry *result)
+{
+	struct eamt_snapshot *snap;
+	__u32 entry = TRIE_NONE;
+
+	rcu_read_lock_bh();
+	snap = rcu_dereference_bh(snapshot);
+	if (snap) {
+		entry = trie_get(&snap->trie6, addr->s6_addr, 128);
+		if (entry != TRIE_NONE)
+			*result = snap->entries[entry];
+	}
+	rcu_read_unlock_bh();
+
+	return (entry != TRIE_NONE) ? 0 : -ENOENT;
+}
+
+/**
+ * Same as get6(), except for IPv4.
+ */
+static int get4(__be32 addr, struct eam_entry *result)
+{
+	struct eamt_snapshot *snap;
+	__u32 entry = TRIE_NONE;
+
+	rcu_read_lock_bh();
+	snap = rcu_dereference_bh(snapshot);
+	if (snap) {
+		entry = trie_get(&snap->trie4, (__u8 *) &addr, 32);
+		if (entry != TRIE_NONE)
+			*result = snap->entries[entry];
+	}
+	rcu_read_unlock_bh();
+
+	return (entry != TRIE_NONE) ? 0 : -ENOENT;
+}
+
+int eamt_init(void)
+{
+	table_count = 0;
+	RCU_INIT_POINTER(snapshot, NULL);
+	return 0;
+}
+
+void eamt_destroy(void)
+{
+	struct eamt_snapshot *snap;
+
+	mutex_lock(&table_mutex);
+	empty_list();
+	snap = rcu_dereference_protected(snapshot, lockdep_is_held(&table_mutex));
+	RCU_INIT_POINTER(snapshot, NULL);
+	mutex_unlock(&table_mutex);
+
+	if (snap)
+		call_rcu_bh(&snap->rcu_hook, snapshot_free_rcu);
+
+	rcu_barrier_bh(); /* Wait for every retired snapshot, this one included. */
+	cancel_work_sync(&reap_work);
+	reap_snapshots(&reap_work);
+}
+
+int eamt_flush(void)
+{
+	int error;
+
+	mutex_lock(&table_mutex);
+	empty_list();
+	error = publish_snapshot(); /* Empty tables don't allocate, so this can't fail. */
+	mutex_unlock(&table_mutex);
+
+	return error;
+}
+
+int eamt_add(struct eam_entry *entries, unsigned int count)
+{
+	struct eamt_node *node;
+	unsigned int i;
+	int error;
+
+	if (WARN(!entries, "NULL is not a valid EAMT entry."))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		error = validate_entry(&entries[i]);
+		if (error)
+			return error; /* Error msg already printed. */
+	}
+
+	mutex_lock(&table_mutex);
+
+	for (i = 0; i < count; i++) {
+		node = kmalloc(sizeof(*node), GFP_KERNEL);
+		if (!node) {
+			log_err("Allocation of EAMT node failed.");
+			error = -ENOMEM;
+			goto revert;
+		}
+		jool_mem_add(JMEM_EAMT, sizeof(*node));
+		node->entry = entries[i];
+		list_add_tail(&node->list_hook, &table);
+		table_count++;
+	}
+
+	/* This is also where the repeated prefixes are caught. */
+	error = publish_snapshot();
+	if (error)
+		goto revert;
+
+	mutex_unlock(&table_mutex);
+	return 0;
+
+revert:
+	drop_newest(i);
+	mutex_unlock(&table_mutex);
+	return error;
+}
+
+int eamt_remove(struct eam_entry *entry)
+{
+	struct eamt_node *node;
+	int error;
+
+	if (WARN(!entry, "NULL is not a valid EAMT entry."))
+		return -EINVAL;
+
+	mutex_lock(&table_mutex);
+	list_for_each_entry(node, &table, list_hook) {
+		if (ipv6_prefix_equals(&node->entry.prefix6, &entry->prefix6)
+				&& ipv4_prefix_equals(&node->entry.prefix4, &entry->prefix4)) {
+			list_del(&node->list_hook);
+			table_count--;
+			error = publish_snapshot();
+			if (error) {
+				/* Its position doesn't matter, since the prefixes can't overlap exactly. */
+				list_add_tail(&node->list_hook, &table);
+				table_count++;
+			} else {
+				kfree(node);
+				jool_mem_add(JMEM_EAMT, -(long) sizeof(*node));
+			}
+			mutex_unlock(&table_mutex);
+			return error;
+		}
+	}
+	mutex_unlock(&table_mutex);
+
+	log_err("The entry is not part of the EAMT.");
+	return -ENOENT;
+}
+
+int eamt_xlat_6to4(struct in6_addr *addr6, struct in_addr *result)
+{
+	struct eam_entry entry;
+	__be32 mask;
+	int error;
+
+	error = get6(addr6, &entry);
+	if (error)
+		return error;
+
+	/* The suffixes are at most 32 bits long, so they live in the last word. */
+	mask = mask4(entry.prefix4.len);
+	result->s_addr = entry.prefix4.address.s_addr | (addr6->s6_addr32[3] & ~mask);
+	return 0;
+}
+
+int eamt_xlat_4to6(struct in_addr *addr4, struct in6_addr *result)
+{
+	struct eam_entry entry;
+	__be32 mask;
+	int error;
+
+	error = get4(addr4->s_addr, &entry);
+	if (error)
+		return error;
+
+	mask = mask4(entry.prefix4.len);
+	*result = entry.prefix6.address;
+	result->s6_addr32[3] |= addr4->s_addr & ~mask;
+	return 0;
+}
+
+bool eamt_contains6(struct in6_addr *addr6)
+{
+	struct eam_entry entry;
+	return !get6(addr6, &entry);
+}
+
+bool eamt_contains4(__be32 addr)
+{
+	struct eam_entry entry;
+	return !get4(addr, &entry);
+}
+
+int eamt_for_each(int (*func)(struct eam_entry *, void *), void *arg)
+{
+	struct eamt_node *node;
+	int error;
+
+	mutex_lock(&table_mutex);
+	list_for_each_entry(node, &table, list_hook) {
+		error = func(&node->entry, arg);
+		if (error) {
+			mutex_unlock(&table_mutex);
+			return error;
+		}
+	}
+	mutex_unlock(&table_mutex);
+
+	return 0;
+}
+
+int eamt_count(__u64 *result)
+{
+	mutex_lock(&table_mutex);
+	*result = table_count;
+	mutex_unlock(&table_mutex);
+	return 0;
+}
@@ -33,10 +33,11 @@ static struct filtering_config *config;
 static bool filter_icmpv6_info(void)
 {
 	bool result;
+	bool locked;
 
-	rcu_read_lock_bh();
+	locked = config_read_lock();
 	result = rcu_dereference_bh(config)->drop_icmp6_info;
-	rcu_read_unlock_bh();
+	config_read_unlock(locked);
 
 	return result;
 }
@@ -50,10 +51,11 @@ static bool filter_icmpv6_info(void)
 static bool address_dependent_filtering(void)
 {
 	bool result;
+	bool locked;
 
-	rcu_read_lock_bh();
+	locked = config_read_lock();
 	result = rcu_dereference_bh(config)->drop_by_addr;
-	rcu_read_unlock_bh();
+	config_read_unlock(locked);
 
 	return result;
 }
@@ -67,10 +69,11 @@ static bool address_dependent_filtering(void)
 static bool drop_external_connections(void)
 {
 	bool result;
+	bool locked;
 
-	rcu_read_lock_bh();
+	locked = config_read_lock();
 	result = rcu_dereference_bh(config)->drop_external_tcp;
-	rcu_read_unlock_bh();
+	config_read_unlock(locked);
 
 	return result;
 }
@@ -87,7 +90,7 @@ static void log_bib(struct bib_entry *bib)
 {
 	if (bib)
 		log_debug("BIB entry: %pI6c#%u - %pI4#%u",
-				&bib->ipv6.l3, bib->ipv6.l4,
+				&bib->host->addr, bib->port6,
 				&bib->ipv4.l3, bib->ipv4.l4);
 	else
 		log_debug("BIB entry: None");
@@ -95,14 +98,43 @@ static void log_bib(struct bib_entry *bib)
 
 static void log_session(struct session_entry *session)
 {
-	if (session)
-		log_debug("Session entry: %pI6c#%u - %pI6c#%u | %pI4#%u - %pI4#%u",
-				&session->remote6.l3, session->remote6.l4,
-				&session->local6.l3, session->local6.l4,
-				&session->local4.l3, session->local4.l4,
-				&session->remote4.l3, session->remote4.l4);
-	else
+	struct ipv6_transport_addr local6;
+
+	if (!session) {
 		log_debug("Session entry: None");
+		return;
+	}
+
+	session_local6(session, &local6);
+	log_debug("Session entry: %pI6c#%u - %pI6c#%u | %pI4#%u - %pI4#%u",
+			&session->remote6.l3, session->remote6.l4,
+			&local6.l3, local6.l4,
+			&session->local4.l3, session->local4.l4,
+			&session->remote4.l3, session->remote4.l4);
+}
+
+/**
+ * Hands "session" over to "out", so the later steps don't have to look it up again, and drops the
+ * caller's reference. The database still holds its own, and even if the session dies, it won't be
+ * freed while "out"'s owner is in its RCU read-side critical section.
+ */
+static void hand_over(struct session_entry *session, struct session_entry **out)
+{
+	if (out)
+		*out = session;
+	session_return(session);
+}
+
+/**
+ * Same as bibdb_get(), except ports the pool hasn't lent are known to have no BIB entry without
+ * looking. Port scans against pool4 are mostly made of those.
+ * Assumes "tuple" represents a IPv4 packet.
+ */
+static int bibdb_get4(struct tuple *tuple4, struct bib_entry **bib)
+{
+	if (pool4_is_available(tuple4->l4_proto, &tuple4->dst.addr4))
+		return -ENOENT;
+	return bibdb_get(tuple4, bib);
 }
 
 /**
@@ -113,11 +145,12 @@ static int get_bib_ipv4(struct sk_buff *skb, struct tuple *tuple4, struct bib_en
 {
 	int error;
 
-	error = bibdb_get(tuple4, bib);
+	error = bibdb_get4(tuple4, bib);
 	if (error) {
 		if (error == -ENOENT) {
 			log_debug("There is no BIB entry for the incoming IPv4 packet.");
 			inc_stats(skb, IPSTATS_MIB_INNOROUTES);
+			inc_jool_stats(JSTAT_NO_BIB);
 		} else {
 			log_debug("Error code %d while finding a BIB entry for the incoming packet.", error);
 			inc_stats(skb, IPSTATS_MIB_INDISCARDS);
@@ -126,10 +159,14 @@ static int get_bib_ipv4(struct sk_buff *skb, struct tuple *tuple4, struct bib_en
 		return error;
 	}
 
-	if (address_dependent_filtering() && !sessiondb_allow(tuple4)) {
+	/* The BIB entry's filter rules out most strangers without touching the session trees. */
+	if (address_dependent_filtering()
+			&& (!bib_may_know_remote4(*bib, &tuple4->src.addr4.l3)
+			|| !sessiondb_allow(*bib, tuple4))) {
 		log_debug("Packet was blocked by address-dependent filtering.");
 		icmp64_send(skb, ICMPERR_FILTER, 0);
 		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		inc_jool_stats(JSTAT_ADF);
 		bib_return(*bib);
 		return -EPERM;
 	}
@@ -196,16 +233,11 @@ static int create_session_ipv6(struct tuple *tuple6, struct bib_entry *bib,
 static int create_session_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 		struct session_entry **session)
 {
-	struct ipv6_prefix prefix;
 	struct in6_addr ipv6_src;
 	struct tuple tuple6;
 	int error;
 
-	error = pool6_peek(&prefix);
-	if (error)
-		return error;
-
-	error = addr_4to6(&tuple4->src.addr4.l3, &prefix, &ipv6_src);
+	error = pool6_4to6(&tuple4->src.addr4.l3, &ipv6_src);
 	if (error) {
 		log_debug("Error code %d while translating the packet's address.", error);
 		return error;
@@ -216,7 +248,7 @@ static int create_session_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 	 * of section 3.5, so we can use the tuple as shortcuts for the packet's fields.
 	 */
 	if (bib)
-		tuple6.src.addr6 = bib->ipv6;
+		bib_ipv6(bib, &tuple6.src.addr6);
 	else
 		memset(&tuple6.src.addr6, 0, sizeof(tuple6.src.addr6));
 	tuple6.dst.addr6.l3 = ipv6_src;
@@ -241,17 +273,26 @@ static int create_session_ipv4(struct tuple *tuple4, struct bib_entry *bib,
  *
  * @param[in] skb tuple's packet. This is actually only used for error reporting.
  * @param[in] tuple summary of the packet Jool is currently translating.
+ * @param[out] out the packet's session, if you want it (see hand_over()).
  * @return VER_CONTINUE if everything went OK, VER_DROP otherwise.
  */
-static verdict ipv6_simple(struct sk_buff *skb, struct tuple *tuple6)
+static verdict ipv6_simple(struct sk_buff *skb, struct tuple *tuple6,
+		struct session_entry **out)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
 	int error;
 
+	if (sessiondb_admit_rate(&tuple6->src.addr6)) {
+		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		inc_jool_stats(JSTAT_SESSION_FAILED);
+		return VER_DROP;
+	}
+
 	error = bibdb_get_or_create_ipv6(skb, tuple6, &bib);
 	if (error) {
 		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		inc_jool_stats(JSTAT_BIB6_FAILED);
 		return VER_DROP;
 	}
 	log_bib(bib);
@@ -259,12 +300,13 @@ static verdict ipv6_simple(struct sk_buff *skb, struct tuple *tuple6)
 	error = sessiondb_get_or_create_ipv6(tuple6, bib, &session);
 	if (error) {
 		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		inc_jool_stats(JSTAT_SESSION_FAILED);
 		bib_return(bib);
 		return VER_DROP;
 	}
 	log_session(session);
 
-	session_return(session);
+	hand_over(session, out);
 	bib_return(bib);
 
 	return VER_CONTINUE;
@@ -277,9 +319,11 @@ static verdict ipv6_simple(struct sk_buff *skb, struct tuple *tuple6)
  *
  * @param[in] skb tuple's packet. This is actually only used for error reporting.
  * @param[in] tuple summary of the packet Jool is currently translating.
+ * @param[out] out the packet's session, if you want it (see hand_over()).
  * @return VER_CONTINUE if everything went OK, VER_DROP otherwise.
  */
-static verdict ipv4_simple(struct sk_buff *skb, struct tuple *tuple4)
+static verdict ipv4_simple(struct sk_buff *skb, struct tuple *tuple4,
+		struct session_entry **out)
 {
 	int error;
 	struct bib_entry *bib;
@@ -293,12 +337,13 @@ static verdict ipv4_simple(struct sk_buff *skb, struct tuple *tuple4)
 	error = sessiondb_get_or_create_ipv4(tuple4, bib, &session);
 	if (error) {
 		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		inc_jool_stats(JSTAT_SESSION_FAILED);
 		bib_return(bib);
 		return VER_DROP;
 	}
 	log_session(session);
 
-	session_return(session);
+	hand_over(session, out);
 	bib_return(bib);
 
 	return VER_CONTINUE;
@@ -309,12 +354,17 @@ static verdict ipv4_simple(struct sk_buff *skb, struct tuple *tuple4)
  * Processes IPv6 SYN packets when there's no state.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_closed_v6_syn(struct sk_buff *skb, struct tuple *tuple6)
+static int tcp_closed_v6_syn(struct sk_buff *skb, struct tuple *tuple6,
+		struct session_entry **out)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
 	int error;
 
+	error = sessiondb_admit_rate(&tuple6->src.addr6);
+	if (error)
+		return error;
+
 	error = bibdb_get_or_create_ipv6(skb, tuple6, &bib);
 	if (error)
 		return error;
@@ -327,7 +377,7 @@ static int tcp_closed_v6_syn(struct sk_buff *skb, struct tuple *tuple6)
 	}
 	log_session(session);
 
-	session_return(session);
+	hand_over(session, out);
 	bib_return(bib);
 
 	return 0;
@@ -338,7 +388,8 @@ static int tcp_closed_v6_syn(struct sk_buff *skb, struct tuple *tuple6)
  * Processes IPv4 SYN packets when there's no state.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static verdict tcp_closed_v4_syn(struct sk_buff *skb, struct tuple *tuple4)
+static verdict tcp_closed_v4_syn(struct sk_buff *skb, struct tuple *tuple4,
+		struct session_entry **out)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
@@ -350,7 +401,7 @@ static verdict tcp_closed_v4_syn(struct sk_buff *skb, struct tuple *tuple4)
 		return VER_DROP;
 	}
 
-	error = bibdb_get(tuple4, &bib);
+	error = bibdb_get4(tuple4, &bib);
 	if (error) {
 		if (error != -ENOENT)
 			return VER_DROP;
@@ -358,6 +409,15 @@ static verdict tcp_closed_v4_syn(struct sk_buff *skb, struct tuple *tuple4)
 	}
 	log_bib(bib);
 
+#ifdef JOOL_NO_SIMULTANEOUS_OPEN
+	/* Built without Simultaneous Open (see Kbuild); same as if the packet queue were full. */
+	if (!bib || address_dependent_filtering()) {
+		icmp64_send(skb, ICMPERR_PORT_UNREACHABLE, 0);
+		inc_jool_stats(JSTAT_PKTQUEUE_FULL);
+		goto end_bib;
+	}
+#endif
+
 	error = create_session_ipv4(tuple4, bib, &session);
 	if (error)
 		goto end_bib;
@@ -371,9 +431,11 @@ static verdict tcp_closed_v4_syn(struct sk_buff *skb, struct tuple *tuple4)
 			if (error == -E2BIG) {
 				/* Fall back to assume there's no Simultaneous Open. */
 				icmp64_send(skb, ICMPERR_PORT_UNREACHABLE, 0);
+				inc_jool_stats(JSTAT_PKTQUEUE_FULL);
 			}
 			goto end_session;
 		}
+		inc_jool_stats(JSTAT_PKTQUEUE_STORED);
 
 		/* At this point, skb's original skb completely belongs to pktqueue. */
 		result = VER_STOLEN;
@@ -393,6 +455,8 @@ static verdict tcp_closed_v4_syn(struct sk_buff *skb, struct tuple *tuple4)
 		}
 
 		result = VER_CONTINUE;
+		hand_over(session, out);
+		goto end_bib;
 	}
 
 	/* Fall through. */
@@ -411,7 +475,8 @@ end_bib:
  * Filtering and updating done during the CLOSED state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static verdict tcp_closed_state_handle(struct sk_buff *skb, struct tuple *tuple)
+static verdict tcp_closed_state_handle(struct sk_buff *skb, struct tuple *tuple,
+		struct session_entry **out)
 {
 	struct bib_entry *bib;
 	verdict result;
@@ -420,24 +485,28 @@ static verdict tcp_closed_state_handle(struct sk_buff *skb, struct tuple *tuple)
 	switch (skb_l3_proto(skb)) {
 	case L3PROTO_IPV6:
 		if (tcp_hdr(skb)->syn) {
-			result = is_error(tcp_closed_v6_syn(skb, tuple)) ? VER_DROP : VER_CONTINUE;
+			error = tcp_closed_v6_syn(skb, tuple, out);
+			result = is_error(error) ? VER_DROP : VER_CONTINUE;
 			goto syn_out;
 		}
 		break;
 
 	case L3PROTO_IPV4:
 		if (tcp_hdr(skb)->syn) {
-			result = tcp_closed_v4_syn(skb, tuple);
+			result = tcp_closed_v4_syn(skb, tuple, out);
 			goto syn_out;
 		}
 		break;
 	}
 
-	error = bibdb_get(tuple, &bib);
+	error = (tuple->l3_proto == L3PROTO_IPV4)
+			? bibdb_get4(tuple, &bib)
+			: bibdb_get(tuple, &bib);
 	if (error) {
 		log_debug("Closed state: Packet is not SYN and there is no BIB entry, so discarding. "
 				"ERRcode %d", error);
 		inc_stats(skb, IPSTATS_MIB_INNOROUTES);
+		inc_jool_stats(JSTAT_NO_BIB);
 		return VER_DROP;
 	}
 
@@ -456,12 +525,12 @@ syn_out:
  *
  * This is RFC 6146 section 3.5.2.
  */
-static verdict tcp(struct sk_buff *skb, struct tuple *tuple)
+static verdict tcp(struct sk_buff *skb, struct tuple *tuple, struct session_entry **out)
 {
 	struct session_entry *session;
 	int error;
 
-	error = sessiondb_get(tuple, &session);
+	error = sessiondb_find(tuple, &session);
 	if (error != 0 && error != -ENOENT) {
 		log_debug("Error code %d while trying to find a TCP session.", error);
 		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
@@ -469,15 +538,64 @@ static verdict tcp(struct sk_buff *skb, struct tuple *tuple)
 	}
 
 	if (error == -ENOENT)
-		return tcp_closed_state_handle(skb, tuple);
+		return tcp_closed_state_handle(skb, tuple, out);
 
 	log_session(session);
 	error = sessiondb_tcp_state_machine(skb, session);
-	session_return(session);
 	if (error) {
 		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		inc_jool_stats(JSTAT_TCP_STATE);
 		return VER_DROP;
 	}
+
+	if (out)
+		*out = session;
+	return VER_CONTINUE;
+}
+
+verdict filtering_established(struct sk_buff *skb, struct tuple *in_tuple,
+		struct session_entry **session)
+{
+	int error;
+
+	*session = NULL;
+
+	/*
+	 * Anything which would need one of filtering_and_updating()'s checks is left to it.
+	 * (The pool checks are not here because the hooks already did them.)
+	 */
+	switch (skb_l3_proto(skb)) {
+	case L3PROTO_IPV6:
+		if (skb_l4_proto(skb) == L4PROTO_ICMP && (is_icmp6_error(icmp6_hdr(skb)->icmp6_type)
+				|| filter_icmpv6_info()))
+			return VER_CONTINUE;
+		if (pool6_contains(&ipv6_hdr(skb)->saddr))
+			return VER_CONTINUE;
+		break;
+	case L3PROTO_IPV4:
+		if (skb_l4_proto(skb) == L4PROTO_ICMP && is_icmp4_error(icmp_hdr(skb)->type))
+			return VER_CONTINUE;
+		break;
+	}
+
+	if (sessiondb_get_established(in_tuple, session) != 0) {
+		*session = NULL;
+		return VER_CONTINUE;
+	}
+
+	log_debug("Step 2: Established session; skipping the BIB.");
+	log_session(*session);
+
+	if (in_tuple->l4_proto == L4PROTO_TCP) {
+		error = sessiondb_tcp_state_machine(skb, *session);
+		if (error) {
+			inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+			inc_jool_stats(JSTAT_TCP_STATE);
+			*session = NULL;
+			return VER_DROP;
+		}
+	}
+
 	return VER_CONTINUE;
 }
 
@@ -489,7 +607,7 @@ static verdict tcp(struct sk_buff *skb, struct tuple *tuple)
  */
 int filtering_init(void)
 {
-	config = kmalloc(sizeof(*config), GFP_ATOMIC);
+	config = config_alloc(sizeof(*config), GFP_ATOMIC);
 	if (!config) {
 		log_debug("Could not allocate memory to store the filtering config.");
 		return -ENOMEM;
@@ -507,7 +625,8 @@ int filtering_init(void)
  */
 void filtering_destroy(void)
 {
-	kfree(config);
+	rcu_barrier_bh(); /* Wait for the configurations retired by config_retire(). */
+	config_free(config);
 }
 
 /**
@@ -543,7 +662,7 @@ int filtering_set_config(enum filtering_type type, size_t size, void *value)
 	}
 	value8 = *((__u8 *) value);
 
-	tmp_config = kmalloc(sizeof(*tmp_config), GFP_KERNEL);
+	tmp_config = config_alloc(sizeof(*tmp_config), GFP_KERNEL);
 	if (!tmp_config)
 		return -ENOMEM;
 
@@ -562,17 +681,29 @@ int filtering_set_config(enum filtering_type type, size_t size, void *value)
 		break;
 	default:
 		log_err("Unknown config type for the 'filtering and updating' module: %u", type);
-		kfree(tmp_config);
+		config_free(tmp_config);
 		return -EINVAL;
 	}
 
 	rcu_assign_pointer(config, tmp_config);
-	synchronize_rcu_bh();
-	kfree(old_config);
+	config_retire(old_config);
 
 	return 0;
 }
 
+/**
+ * Counts and drops a packet the filtering rejected before it reached the tables. Kept out of line
+ * so filtering_and_updating()'s common case (a packet which is let through) stays compact.
+ */
+static noinline __cold verdict reject(struct sk_buff *skb, int mib, enum jool_stat stat,
+		char *reason)
+{
+	log_debug("%s; dropping...", reason);
+	inc_stats(skb, mib);
+	inc_jool_stats(stat);
+	return VER_DROP;
+}
+
 /**
  * Main F&U routine. Called during the processing of every packet.
  *
@@ -580,9 +711,11 @@ int filtering_set_config(enum filtering_type type, size_t size, void *value)
  *
  * @param[in] skb packet being translated.
  * @param[in] tuple skb's summary.
+ * @param[out] session skb's session, if it has one and you want it (see the header).
  * @return indicator of what should happen to skb.
  */
-verdict filtering_and_updating(struct sk_buff* skb, struct tuple *in_tuple)
+verdict filtering_and_updating(struct sk_buff* skb, struct tuple *in_tuple,
+		struct session_entry **session)
 {
 	struct ipv6hdr *hdr_ip6;
 	verdict result = VER_CONTINUE;
@@ -592,35 +725,31 @@ verdict filtering_and_updating(struct sk_buff* skb, struct tuple *in_tuple)
 	switch (skb_l3_proto(skb)) {
 	case L3PROTO_IPV6:
 		/* ICMP errors should not be filtered or affect the tables. */
-		if (skb_l4_proto(skb) == L4PROTO_ICMP && is_icmp6_error(icmp6_hdr(skb)->icmp6_type)) {
+		if (unlikely(skb_l4_proto(skb) == L4PROTO_ICMP
+				&& is_icmp6_error(icmp6_hdr(skb)->icmp6_type))) {
 			log_debug("Packet is ICMPv6 error; skipping step...");
 			return VER_CONTINUE;
 		}
 		/* Get rid of hairpinning loops and unwanted packets. */
 		hdr_ip6 = ipv6_hdr(skb);
-		if (pool6_contains(&hdr_ip6->saddr)) {
-			log_debug("Hairpinning loop. Dropping...");
-			inc_stats(skb, IPSTATS_MIB_INADDRERRORS);
-			return VER_DROP;
-		}
-		if (!pool6_contains(&hdr_ip6->daddr)) {
-			log_debug("Packet was rejected by pool6; dropping...");
-			inc_stats(skb, IPSTATS_MIB_INADDRERRORS);
-			return VER_DROP;
-		}
+		if (unlikely(pool6_contains(&hdr_ip6->saddr)))
+			return reject(skb, IPSTATS_MIB_INADDRERRORS, JSTAT_HAIRPIN_LOOP,
+					"Hairpinning loop");
+		if (unlikely(!pool6_contains(&hdr_ip6->daddr)))
+			return reject(skb, IPSTATS_MIB_INADDRERRORS, JSTAT_POOL6_MISMATCH,
+					"Packet was rejected by pool6");
 		break;
 	case L3PROTO_IPV4:
 		/* ICMP errors should not be filtered or affect the tables. */
-		if (skb_l4_proto(skb) == L4PROTO_ICMP && is_icmp4_error(icmp_hdr(skb)->type)) {
+		if (unlikely(skb_l4_proto(skb) == L4PROTO_ICMP
+				&& is_icmp4_error(icmp_hdr(skb)->type))) {
 			log_debug("Packet is ICMPv4 error; skipping step...");
 			return VER_CONTINUE;
 		}
 		/* Get rid of unexpected packets */
-		if (!pool4_contains(ip_hdr(skb)->daddr)) {
-			log_debug("Packet was rejected by pool4; dropping...");
-			inc_stats(skb, IPSTATS_MIB_INADDRERRORS);
-			return VER_DROP;
-		}
+		if (unlikely(!pool4_contains(ip_hdr(skb)->daddr)))
+			return reject(skb, IPSTATS_MIB_INADDRERRORS, JSTAT_POOL4_MISMATCH,
+					"Packet was rejected by pool4");
 		break;
 	}
 
@@ -630,31 +759,30 @@ verdict filtering_and_updating(struct sk_buff* skb, struct tuple *in_tuple)
 	case L4PROTO_UDP:
 		switch (skb_l3_proto(skb)) {
 		case L3PROTO_IPV6:
-			result = ipv6_simple(skb, in_tuple);
+			result = ipv6_simple(skb, in_tuple, session);
 			break;
 		case L3PROTO_IPV4:
-			result = ipv4_simple(skb, in_tuple);
+			result = ipv4_simple(skb, in_tuple, session);
 			break;
 		}
 		break;
 
 	case L4PROTO_TCP:
-		result = tcp(skb, in_tuple);
+		result = tcp(skb, in_tuple, session);
 		break;
 
 	case L4PROTO_ICMP:
 		switch (skb_l3_proto(skb)) {
 		case L3PROTO_IPV6:
-			if (filter_icmpv6_info()) {
-				log_debug("Packet is ICMPv6 info (ping); dropping due to policy.");
-				inc_stats(skb, IPSTATS_MIB_INDISCARDS);
-				return VER_DROP;
-			}
+			if (unlikely(filter_icmpv6_info()))
+				return reject(skb, IPSTATS_MIB_INDISCARDS,
+						JSTAT_ICMP6_INFO_FILTERED,
+						"Packet is ICMPv6 info (ping), which is filtered");
 
-			result = ipv6_simple(skb, in_tuple);
+			result = ipv6_simple(skb, in_tuple, session);
 			break;
 		case L3PROTO_IPV4:
-			result = ipv4_simple(skb, in_tuple);
+			result = ipv4_simple(skb, in_tuple, session);
 			break;
 		}
 		break;
@@ -663,3 +791,46 @@ verdict filtering_and_updating(struct sk_buff* skb, struct tuple *in_tuple)
 	log_debug("Done: Step 2.");
 	return result;
 }
+
+int filtering_hairpin(struct sk_buff *skb, struct tuple *tuple4, struct session_entry **out)
+{
+	struct session_entry *session;
+	int error;
+
+	log_debug("Step 2: Filtering and Updating (hairpin)");
+
+	/* The first pass already checked the IPv6 side, and tuple4's destination is pool4's. */
+	switch (tuple4->l4_proto) {
+	case L4PROTO_UDP:
+		return (ipv4_simple(skb, tuple4, out) == VER_CONTINUE) ? 0 : -EINVAL;
+
+	case L4PROTO_TCP:
+		error = sessiondb_find(tuple4, &session);
+		if (error == -ENOENT)
+			return -EAGAIN;
+		if (error) {
+			log_debug("Error code %d while trying to find a TCP session.", error);
+			inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+			return error;
+		}
+
+		log_session(session);
+		error = sessiondb_tcp_state_machine_hairpin(skb, session);
+		if (error) {
+			inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+			inc_jool_stats(JSTAT_TCP_STATE);
+			return error;
+		}
+
+		if (out)
+			*out = session;
+		return 0;
+
+	case L4PROTO_ICMP:
+		/* RFC 6146 section 2 (Definition of "Hairpinning"). */
+		log_debug("ICMP is not supported by hairpinning. Dropping packet...");
+		return -EINVAL;
+	}
+
+	return -EINVAL;
+}
@@ -1,16 +1,40 @@
 #include "nat64/mod/fragment_db.h"
 #include "nat64/comm/constants.h"
 #include "nat64/mod/stats.h"
+#include "nat64/mod/log_time.h"
 #include "nat64/mod/packet.h"
-#include "nat64/mod/random.h"
+#include "nat64/mod/keyed_hash.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/trace.h"
 
 #include <linux/version.h>
+#include <linux/timer.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/udp.h>
 #include <net/ipv6.h>
 
 #define INFINITY 60000
 
+/** Maximum number of slices the database can be split into. */
+#define FRAGDB_MAX_SHARDS 64
+
+/**
+ * Holes a reassembly buffer can track without allocating. A packet fragmented in order never has
+ * more than one; a disordered one rarely has more than a couple.
+ */
+#define INLINE_HOLES 4
+
+/** Maximum number of buffers evict_buffers() destroys per lock of a shard. */
+#define EVICT_BATCH 64
+
+/** A hole, as stored inline in its buffer. */
+struct hole_range {
+	u16 first;
+	u16 last;
+};
+
+/** A hole, as stored once its buffer ran out of inline space. */
 struct hole_descriptor {
 	u16 first;
 	u16 last;
@@ -40,12 +64,35 @@ struct reassembly_buffer_key {
 };
 
 struct reassembly_buffer {
-	/* The "hole descriptor list". */
+	/* The descriptor the buffer is indexed by. */
+	struct reassembly_buffer_key key;
+	/*
+	 * The "hole descriptor list". The holes live in "hole_arr" (sorted, "hole_count" of them)
+	 * until there are too many to fit; from then on they live in "holes" instead. Only one of
+	 * them is ever in use.
+	 */
+	struct hole_range hole_arr[INLINE_HOLES];
+	unsigned int hole_count;
 	struct list_head holes;
-	/* The "buffer". */
+	/*
+	 * The "buffer". Circular list of the fragments that are waiting. NULL if none is (which only
+	 * happens if "forwarded").
+	 */
 	struct sk_buff *skb;
 	/* Jiffy at which the fragment timer will delete this buffer. */
 	unsigned long dying_time;
+	/* Bytes this buffer is accounted for in "bytes_queued". */
+	unsigned int mem;
+
+	/*
+	 * The first fragment was released without waiting for its siblings (see "forward_early"),
+	 * so the buffer now only tracks the holes and the first fragment's outgoing tuple.
+	 */
+	bool forwarded;
+	/* If "forwarded", whether "tuple" has been computed yet. Fragments wait until it has. */
+	bool tuple_known;
+	/* If "tuple_known", the outgoing tuple of the first fragment. */
+	struct tuple tuple;
 
 	struct list_head list_hook;
 };
@@ -53,26 +100,62 @@ struct reassembly_buffer {
 /** Cache for struct reassembly_buffers, for efficient allocation. */
 static struct kmem_cache *buffer_cache;
 
+/*
+ * Fragments only live for a couple of seconds, so the shards' tables don't need to grow as much as
+ * the other databases'.
+ * They stay on the chained variant because it never refuses a PUT; once the array stops growing,
+ * the lists simply get longer. The open addressing variant would start dropping fragments as soon
+ * as a shard held a few thousand incomplete packets, long before high_thresh kicks in.
+ */
 #define HTABLE_NAME fragdb_table
 #define KEY_TYPE struct reassembly_buffer_key
 #define VALUE_TYPE struct reassembly_buffer
+#define HASH_TABLE_MAX_SIZE (4 * 1024)
 #include "hash_table.c"
 
 /**
- * Just a random number, initialized at startup.
- * Used to prevent attackers from crafting special packets that will have the same hash code but
- * different hash slots. See
- * http://stackoverflow.com/questions/12175109/why-does-the-linux-ipv4-stack-need-random-numbers.
+ * Secret key of the buffer hashes, initialized at startup.
+ * Fragment identifications are chosen by whoever sends them, so without this, attackers could craft
+ * fragments that all land in the same place. See keyed_hash.h.
  */
-static u32 rnd;
+static struct keyed_hash_key secret;
 
-static struct fragdb_table table;
-static DEFINE_SPINLOCK(table_lock);
+/**
+ * A slice of the fragment database.
+ *
+ * Buffers are assigned to shards by hash_function() (see get_shard()), so CPUs reassembling
+ * unrelated packets don't fight over the same lock.
+ */
+struct fragdb_shard {
+	struct fragdb_table table;
+	/** Protects "table", "expire_list" and the buffers they contain. */
+	spinlock_t lock;
+
+	/** Deletes the buffers from "expire_list" once they time out. */
+	struct timer_list expire_timer;
+	/** The shard's buffers, sorted by dying_time (because they're all created with the same TTL). */
+	struct list_head expire_list;
+
+	/** NUMA node the shard's buffers and holes are allocated on. See shard_node(). */
+	int node;
+};
+
+/** The database. An array of "shard_count" slices. */
+static struct fragdb_shard *shards;
+/** Length of "shards". */
+static unsigned int shard_count;
 
 static struct fragmentation_config *config;
 
-static struct timer_list expire_timer;
-static LIST_HEAD(expire_list);
+/**
+ * Memory taken up by all the shards' buffers and their fragments, in bytes.
+ * Compared against "config".high_thresh and low_thresh. See evict_buffers().
+ */
+static atomic64_t bytes_queued = ATOMIC64_INIT(0);
+/** Buffers destroyed by evict_buffers(). See struct fragmentation_stats. */
+static atomic64_t evictions = ATOMIC64_INIT(0);
+/** Makes sure only one CPU at a time is evicting; the rest needn't wait for it. */
+static DEFINE_SPINLOCK(evict_lock);
 
 
 /**
@@ -84,10 +167,42 @@ static LIST_HEAD(expire_list);
 static unsigned long get_fragment_timeout(void)
 {
 	unsigned long result;
+	bool locked;
 
-	rcu_read_lock_bh();
+	locked = config_read_lock();
 	result = rcu_dereference_bh(config)->fragment_timeout;
-	rcu_read_unlock_bh();
+	config_read_unlock(locked);
+
+	return result;
+}
+
+/**
+ * Synchronization-safely returns the current configuration's memory watermarks.
+ */
+static void get_thresholds(__u64 *high, __u64 *low)
+{
+	struct fragmentation_config *tmp;
+	bool locked;
+
+	locked = config_read_lock();
+	tmp = rcu_dereference_bh(config);
+	*high = tmp->high_thresh;
+	*low = tmp->low_thresh;
+	config_read_unlock(locked);
+}
+
+/**
+ * Synchronization-safely returns whether first fragments should be released as soon as they
+ * arrive.
+ */
+static bool get_forward_early(void)
+{
+	bool result;
+	bool locked;
+
+	locked = config_read_lock();
+	result = rcu_dereference_bh(config)->forward_early;
+	config_read_unlock(locked);
 
 	return result;
 }
@@ -133,57 +248,59 @@ static bool equals_function(const struct reassembly_buffer_key *key1,
 }
 
 /**
- * Hash function for IPv4 keys. Generally a blatant ripoff of ip_fragment.c's function of the same
- * name.
+ * Returns the keyed hash of every field equals_function() compares.
  */
-static unsigned int ipqhashfn(__be16 id, __be32 saddr, __be32 daddr, u8 prot)
+static u64 hash_key(const struct reassembly_buffer_key *key)
 {
-	return jhash_3words((__force u32)id << 16 | prot, (__force u32)saddr, (__force u32)daddr, rnd);
-}
+	u64 words[5];
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
-/**
- * Hash function for IPv6 keys from reassembly.c
- */
-static unsigned int inet6_hash_frag(__be32 id, const struct in6_addr *saddr,
-		const struct in6_addr *daddr, u32 rnd)
-{
-	u32 c;
-	c = jhash_3words(ipv6_addr_hash(saddr), ipv6_addr_hash(daddr), (__force u32)id, rnd);
-	return c & (INETFRAGS_HASHSZ - 1);
+	switch (key->l3_proto) {
+	case L3PROTO_IPV4:
+		words[0] = ((u64) (__force u32) key->ipv4.src_addr.s_addr << 32)
+				| (__force u32) key->ipv4.dst_addr.s_addr;
+		words[1] = ((u64) (__force u16) key->ipv4.identification << 32) | key->l4_proto;
+		return keyed_hash(&secret, words, 2);
+	case L3PROTO_IPV6:
+		memcpy(&words[0], &key->ipv6.src_addr, sizeof(key->ipv6.src_addr));
+		memcpy(&words[2], &key->ipv6.dst_addr, sizeof(key->ipv6.dst_addr));
+		words[4] = ((u64) (__force u32) key->ipv6.identification << 32) | key->l4_proto;
+		return keyed_hash(&secret, words, 5);
+	}
+
+	return 0;
 }
-#endif
 
 /**
  * As specified above, the database is (mostly) a hash table. This is one of two functions used
  * internally by the table to search for values.
+ * The table masks the result itself, so every one of its slots is reachable.
  */
 static unsigned int hash_function(const struct reassembly_buffer_key *key)
 {
-	unsigned int result = 0;
-
-	switch (key->l3_proto) {
-	case L3PROTO_IPV4:
-		result = ipqhashfn(key->ipv4.identification, key->ipv4.src_addr.s_addr,
-				key->ipv4.dst_addr.s_addr, key->l4_proto);
-		break;
-	case L3PROTO_IPV6:
-		result = inet6_hash_frag(key->ipv6.identification, &key->ipv6.src_addr,
-				&key->ipv6.dst_addr, rnd);
-		break;
-	}
+	return (u32) hash_key(key);
+}
 
-	return result;
+/**
+ * Returns the slice of the database "key"'s buffer belongs to.
+ * It's chosen from the other half of the hash, so the shard and the slot within its table don't
+ * correlate.
+ */
+static struct fragdb_shard *get_shard(const struct reassembly_buffer_key *key)
+{
+	if (shard_count == 1)
+		return &shards[0];
+	return &shards[(u32) (hash_key(key) >> 32) % shard_count];
 }
 
 /**
  * Just a one-liner for constructing hole_descriptors.
  */
-static struct hole_descriptor *hole_alloc(u16 first, u16 last)
+static struct hole_descriptor *hole_alloc(u16 first, u16 last, int node)
 {
-	struct hole_descriptor *hd = kmem_cache_alloc(hole_cache, GFP_ATOMIC);
+	struct hole_descriptor *hd = kmem_cache_alloc_node(hole_cache, GFP_ATOMIC, node);
 	if (!hd)
 		return NULL;
+	jool_mem_add(JMEM_FRAGDB, sizeof(*hd));
 
 	hd->first = first;
 	hd->last = last;
@@ -193,25 +310,100 @@ static struct hole_descriptor *hole_alloc(u16 first, u16 last)
 }
 
 /**
- * Just a one-liner for constructing reassembly_buffers.
+ * Just a one-liner for constructing reassembly_buffers. The result is empty; see buffer_add_skb().
  */
-static struct reassembly_buffer *buffer_alloc(struct sk_buff *skb)
+static struct reassembly_buffer *buffer_alloc(struct reassembly_buffer_key *key, int node)
 {
 	struct reassembly_buffer *buffer;
 
-	buffer = kmem_cache_alloc(buffer_cache, GFP_ATOMIC);
+	buffer = kmem_cache_alloc_node(buffer_cache, GFP_ATOMIC, node);
 	if (!buffer)
 		return NULL;
+	jool_mem_add(JMEM_FRAGDB, sizeof(*buffer));
 
-	skb->next = skb->prev = skb;
-
+	buffer->key = *key;
+	/* "We create a hole descriptor list containing one descriptor: from 0 to infinity." */
+	buffer->hole_arr[0].first = 0;
+	buffer->hole_arr[0].last = INFINITY;
+	buffer->hole_count = 1;
 	INIT_LIST_HEAD(&buffer->holes);
-	buffer->skb = skb;
+	buffer->skb = NULL;
 	buffer->dying_time = jiffies + get_fragment_timeout();
+	buffer->mem = sizeof(*buffer);
+	atomic64_add(buffer->mem, &bytes_queued);
+	buffer->forwarded = false;
+	buffer->tuple_known = false;
 
 	return buffer;
 }
 
+static bool is_first(struct sk_buff *skb)
+{
+	switch (skb_l3_proto(skb)) {
+	case L3PROTO_IPV4:
+		return is_first_fragment_ipv4(ip_hdr(skb));
+	case L3PROTO_IPV6:
+		return is_first_fragment_ipv6(skb_frag_hdr(skb));
+	}
+	return false;
+}
+
+static struct sk_buff *skb_add_frag(struct sk_buff *main, struct sk_buff *addend)
+{
+	if (is_first(addend)) {
+		addend->prev = main->prev;
+		addend->next = main;
+		main->prev = addend;
+		addend->prev->next = addend;
+		return addend;
+	}
+
+	main->prev->next = addend;
+	addend->prev = main->prev;
+	addend->next = main;
+	main->prev = addend;
+	return main;
+}
+
+/**
+ * Stores "skb" in "buffer"'s list of waiting fragments.
+ */
+static void buffer_add_skb(struct reassembly_buffer *buffer, struct sk_buff *skb)
+{
+	if (buffer->skb) {
+		buffer->skb = skb_add_frag(buffer->skb, skb);
+	} else {
+		skb->next = skb->prev = skb;
+		buffer->skb = skb;
+	}
+
+	buffer->mem += skb->truesize;
+	atomic64_add(skb->truesize, &bytes_queued);
+	jool_mem_add(JMEM_FRAGDB_SKBS, skb->truesize);
+}
+
+/**
+ * Removes the waiting fragments from "buffer" and returns them as a NULL-terminated list.
+ * The first fragment, if present, is the head.
+ */
+static struct sk_buff *buffer_take_skbs(struct reassembly_buffer *buffer)
+{
+	struct sk_buff *skb = buffer->skb;
+
+	if (!skb)
+		return NULL;
+
+	skb->prev->next = NULL;
+	skb->prev = NULL;
+	buffer->skb = NULL;
+
+	atomic64_sub(buffer->mem - sizeof(*buffer), &bytes_queued);
+	jool_mem_add(JMEM_FRAGDB_SKBS, -(long) (buffer->mem - sizeof(*buffer)));
+	buffer->mem = sizeof(*buffer);
+
+	return skb;
+}
+
 /**
  * Just a one-liner for populating reassembly_buffer_keys.
  */
@@ -243,32 +435,34 @@ static int skb_to_key(struct sk_buff *skb, struct reassembly_buffer_key *key)
 }
 
 /**
- * Returns the reassembly buffer described by "key" from the database.
+ * Returns the reassembly buffer described by "key" from "shard".
  */
-static struct reassembly_buffer *buffer_get(struct reassembly_buffer_key *key)
+static struct reassembly_buffer *buffer_get(struct fragdb_shard *shard,
+		struct reassembly_buffer_key *key)
 {
-	return fragdb_table_get(&table, key);
+	return fragdb_table_get(&shard->table, key);
 }
 
 /**
- * Inserts "buffer" into the database, mapping it to the descriptor "key".
- *
- * "key" is assumed to have been constructed from "buffer"; it is not inferred internally for silly
- * performance reasons.
+ * Inserts "buffer" into "shard", mapping it to its key.
  */
-static int buffer_put(struct reassembly_buffer_key *key, struct reassembly_buffer *buffer)
+static int buffer_put(struct fragdb_shard *shard, struct reassembly_buffer *buffer)
 {
+	struct timer_list *timer = &shard->expire_timer;
+	unsigned long dying_time;
 	int error;
 
-	error = fragdb_table_put(&table, key, buffer);
+	error = fragdb_table_put(&shard->table, &buffer->key, buffer);
 	if (error)
 		return error;
 
-	list_add(&buffer->list_hook, expire_list.prev);
-	if (!timer_pending(&expire_timer) || time_before(buffer->dying_time, expire_timer.expires)) {
-		mod_timer(&expire_timer, buffer->dying_time);
+	list_add(&buffer->list_hook, shard->expire_list.prev);
+	/* Rounded so the buffers of the same second don't keep reprogramming the timer. */
+	dying_time = round_jiffies_up(buffer->dying_time);
+	if (!timer_pending(timer) || time_before(dying_time, timer->expires)) {
+		mod_timer(timer, dying_time);
 		log_debug("The buffer cleaning timer will awake in %u msecs.",
-				jiffies_to_msecs(expire_timer.expires - jiffies));
+				jiffies_to_msecs(timer->expires - jiffies));
 	}
 
 	return 0;
@@ -282,6 +476,7 @@ static void buffer_dealloc(struct reassembly_buffer *buffer)
 		hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
 		list_del(&hole->list_hook);
 		kmem_cache_free(hole_cache, hole);
+		jool_mem_add(JMEM_FRAGDB, -(long) sizeof(*hole));
 	}
 
 	if (buffer->skb) {
@@ -291,26 +486,26 @@ static void buffer_dealloc(struct reassembly_buffer *buffer)
 		kfree_skb_queued(buffer->skb);
 	}
 
+	jool_mem_add(JMEM_FRAGDB_SKBS, -(long) (buffer->mem - sizeof(*buffer)));
+	jool_mem_add(JMEM_FRAGDB, -(long) sizeof(*buffer));
 	kmem_cache_free(buffer_cache, buffer);
 }
 
 /**
- * Removes "buffer" from the database and destroys it.
- *
- * "key" is assumed to have been constructed from "buffer"; it is not inferred internally for silly
- * performance reasons.
+ * Removes "buffer" from "shard" and destroys it.
  */
-static void buffer_destroy(struct reassembly_buffer_key *key, struct reassembly_buffer *buffer)
+static void buffer_destroy(struct fragdb_shard *shard, struct reassembly_buffer *buffer)
 {
 	bool success;
 
 	/* Remove it from the DB. */
-	success = fragdb_table_remove(&table, key, NULL);
+	success = fragdb_table_remove(&shard->table, &buffer->key, NULL);
 	if (WARN(!success, "Something is attempting to delete a buffer that wasn't stored "
 			"in the database."))
 		return;
 
 	list_del(&buffer->list_hook);
+	atomic64_sub(buffer->mem, &bytes_queued);
 
 	/* Deallocate it. */
 	buffer_dealloc(buffer);
@@ -355,87 +550,198 @@ static bool is_mf_set(struct sk_buff *skb)
 }
 
 /**
- * Core of the cleaner_timer() function, intended to actually clean the database from obsolete
+ * Fires the "event" tracepoint of "buffer".
+ */
+#define trace_buffer(event, buffer) \
+	trace_##event((buffer)->key.l3_proto, (buffer)->key.l4_proto, \
+			((buffer)->key.l3_proto == L3PROTO_IPV6) \
+					? be32_to_cpu((buffer)->key.ipv6.identification) \
+					: be16_to_cpu((buffer)->key.ipv4.identification))
+
+/**
+ * Core of the cleaner_timer() function, intended to actually clean "shard" from obsolete
  * fragments.
  */
-static void clean_expired_buffers(void)
+static void clean_expired_buffers(struct fragdb_shard *shard)
 {
 	unsigned int b = 0;
-	struct reassembly_buffer_key key;
 	struct reassembly_buffer *buffer;
 
 	log_debug("Deleting expired reassembly buffers...");
 
-	spin_lock_bh(&table_lock);
+	jool_lock_bh(&shard->lock, JLOCK_FRAGDB);
 
-	while (!list_empty(&expire_list)) {
-		buffer = list_entry(expire_list.next, struct reassembly_buffer, list_hook);
+	while (!list_empty(&shard->expire_list)) {
+		buffer = list_entry(shard->expire_list.next, struct reassembly_buffer, list_hook);
 
 		if (time_after(buffer->dying_time, jiffies)) {
-			spin_unlock_bh(&table_lock);
+			jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
 			log_debug("Deleted %u reassembly buffers.", b);
 			return;
 		}
 
-		if (!is_error(skb_to_key(buffer->skb, &key))) {
-			buffer_destroy(&key, buffer);
-			b++;
-		}
+		trace_buffer(jool_fragdb_buffer_expire, buffer);
+		buffer_destroy(shard, buffer);
+		inc_jool_stats(JSTAT_FRAG_TIMEOUT);
+		b++;
 	}
 
-	spin_unlock_bh(&table_lock);
-	log_debug("Deleted %u reassembly buffers. The database is now empty.", b);
+	jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+	log_debug("Deleted %u reassembly buffers. The shard is now empty.", b);
 }
 
 /**
  * Executed by the kernel every once in a while to extermine expired fragments.
+ * "param" is the shard the timer belongs to.
  */
 static void cleaner_timer(unsigned long param)
 {
+	struct fragdb_shard *shard = (struct fragdb_shard *) param;
 	struct reassembly_buffer *buffer;
 	unsigned long next_expire;
 	unsigned long min_time = jiffies + MIN_TIMER_SLEEP;
 
-	clean_expired_buffers();
+	clean_expired_buffers(shard);
 
-	spin_lock_bh(&table_lock);
+	jool_lock_bh(&shard->lock, JLOCK_FRAGDB);
 
-	if (list_empty(&expire_list)) {
-		spin_unlock_bh(&table_lock);
+	if (list_empty(&shard->expire_list)) {
+		jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
 		/* No need to re-schedule the timer. */
 		return;
 	}
 
 	/* Restart the timer. */
-	buffer = list_entry(expire_list.next, struct reassembly_buffer, list_hook);
+	buffer = list_entry(shard->expire_list.next, struct reassembly_buffer, list_hook);
 	next_expire = buffer->dying_time;
-	spin_unlock_bh(&table_lock);
+	jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
 
-	if (next_expire < min_time)
+	if (time_before(next_expire, min_time))
 		next_expire = min_time;
 
-	mod_timer(&expire_timer, next_expire);
+	mod_timer(&shard->expire_timer, round_jiffies_up(next_expire));
+}
+
+/**
+ * Destroys "shard"'s oldest buffers until they add up to "quota" bytes or more, EVICT_BATCH
+ * buffers are gone, or the shard runs out of them. Returns the number of buffers destroyed.
+ *
+ * Assumes "shard" has not been locked.
+ */
+static unsigned int evict_from_shard(struct fragdb_shard *shard, __u64 quota)
+{
+	struct reassembly_buffer *buffer;
+	__u64 freed = 0;
+	unsigned int b = 0;
+
+	jool_lock_bh(&shard->lock, JLOCK_FRAGDB);
+	while (freed < quota && b < EVICT_BATCH && !list_empty(&shard->expire_list)) {
+		buffer = list_entry(shard->expire_list.next, struct reassembly_buffer, list_hook);
+		if (buffer->skb)
+			inc_stats(buffer->skb, IPSTATS_MIB_REASMFAILS);
+		freed += buffer->mem;
+		buffer_destroy(shard, buffer);
+		b++;
+	}
+	jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+
+	return b;
+}
+
+/**
+ * If the queued fragments take up more than "config".high_thresh bytes, destroys old buffers
+ * until they take up "config".low_thresh bytes or less.
+ *
+ * Every shard gives up its oldest buffers for an even share of the excess, one lock per shard
+ * per pass. The buffers are spread over the shards by hash, and they all live for the same time,
+ * so each shard's oldest are about as old as the database's; finding the exact oldest would cost
+ * a lock of every shard per buffer.
+ *
+ * Assumes no shard has been locked.
+ */
+static void evict_buffers(void)
+{
+	__u64 high, low, queued, share;
+	unsigned int evicted, b = 0;
+	unsigned int s;
+
+	get_thresholds(&high, &low);
+	if (!high || atomic64_read(&bytes_queued) <= high)
+		return;
+	/* Somebody else is already on it. */
+	if (!spin_trylock_bh(&evict_lock))
+		return;
+
+	while ((queued = atomic64_read(&bytes_queued)) > low) {
+		share = div64_u64(queued - low + shard_count - 1, shard_count);
+		evicted = 0;
+		for (s = 0; s < shard_count; s++)
+			evicted += evict_from_shard(&shards[s], share);
+		if (!evicted)
+			break;
+		b += evicted;
+	}
+
+	spin_unlock_bh(&evict_lock);
+
+	atomic64_add(b, &evictions);
+	log_debug("Evicted %u reassembly buffers.", b);
+}
+
+/**
+ * Auxiliar for fragdb_init(). Encapsulates initialization of a fragdb_shard structure.
+ */
+static int init_shard(struct fragdb_shard *shard, int node)
+{
+	int error;
+
+	shard->node = node;
+
+	error = fragdb_table_init(&shard->table, equals_function, hash_function);
+	if (error)
+		return error;
+	spin_lock_init(&shard->lock);
+
+	/* Fragments can wait a little longer; see buffer_put(). */
+	init_timer_deferrable(&shard->expire_timer);
+	shard->expire_timer.function = cleaner_timer;
+	shard->expire_timer.expires = 0;
+	shard->expire_timer.data = (unsigned long) shard;
+	INIT_LIST_HEAD(&shard->expire_list);
+
+	return 0;
 }
 
 /**
  * Call during initialization for the remaining functions to work properly.
+ *
+ * @param shards_requested number of slices the database should be split into; 0 means one per CPU.
  */
-int fragdb_init(void)
+int fragdb_init(unsigned int shards_requested)
 {
+	int i;
 	int error;
 
-	config = kmalloc(sizeof(*config), GFP_ATOMIC);
+	if (shards_requested == 0)
+		shards_requested = num_possible_cpus();
+	shard_count = min_t(unsigned int, shards_requested, FRAGDB_MAX_SHARDS);
+
+	config = config_alloc(sizeof(*config), GFP_ATOMIC);
 
 	if (!config) {
 		log_err("Could not allocate memory to store the fragmentation config.");
 		return -ENOMEM;
 	}
 	config->fragment_timeout = msecs_to_jiffies(1000 * FRAGMENT_MIN);
+	config->high_thresh = FRAGMENT_HIGH_THRESH_DEF;
+	config->low_thresh = FRAGMENT_LOW_THRESH_DEF;
+	config->forward_early = FRAGMENT_FORWARD_EARLY_DEF;
+	atomic64_set(&bytes_queued, 0);
 
 	hole_cache = kmem_cache_create("jool_hole_descriptors", sizeof(struct hole_descriptor),
 			0, 0, NULL);
 	if (!hole_cache) {
-		kfree(config);
+		config_free(config);
 		log_err("Could not allocate the hole descriptor cache.");
 		return -ENOMEM;
 	}
@@ -444,25 +750,36 @@ int fragdb_init(void)
 	if (!buffer_cache) {
 		kmem_cache_destroy(hole_cache);
 		log_err("Could not allocate the reassembly buffer cache.");
-		kfree(config);
+		config_free(config);
 		return -ENOMEM;
 	}
 
-	error = fragdb_table_init(&table, equals_function, hash_function);
-	if (error) {
+	shards = kcalloc(shard_count, sizeof(*shards), GFP_KERNEL);
+	if (!shards) {
 		kmem_cache_destroy(buffer_cache);
 		kmem_cache_destroy(hole_cache);
-		kfree(config);
-		return error;
+		log_err("Could not allocate the fragment database.");
+		config_free(config);
+		return -ENOMEM;
 	}
 
-	init_timer(&expire_timer);
-	expire_timer.function = cleaner_timer;
-	expire_timer.expires = 0;
-	expire_timer.data = 0;
+	for (i = 0; i < shard_count; i++) {
+		error = init_shard(&shards[i], shard_node(i));
+		if (error) {
+			while (i-- > 0)
+				fragdb_table_destroy(&shards[i].table, NULL);
+			kfree(shards);
+			kmem_cache_destroy(buffer_cache);
+			kmem_cache_destroy(hole_cache);
+			config_free(config);
+			return error;
+		}
+	}
 
-	rnd = get_random_u32();
+	keyed_hash_init_key(&secret);
 
+	if (shard_count > 1)
+		log_info("The fragment database was split into %u shards.", shard_count);
 	return 0;
 }
 
@@ -481,6 +798,12 @@ int fragdb_clone_config(struct fragmentation_config *clone)
 	return 0;
 }
 
+void fragdb_get_stats(struct fragmentation_stats *result)
+{
+	result->bytes_queued = atomic64_read(&bytes_queued);
+	result->evictions = atomic64_read(&evictions);
+}
+
 /**
  * Updates the configuration of this module.
  *
@@ -496,132 +819,163 @@ int fragdb_set_config(enum fragmentation_type type, size_t size, void *value)
 	__u32 max_u32 = 0xFFFFFFFFL; /* Max value in milliseconds */
 	unsigned long fragment_min = msecs_to_jiffies(1000 * FRAGMENT_MIN);
 
-	if (type != FRAGMENT_TIMEOUT) {
-		log_err("Unknown config type for the 'fragment db' module: %u", type);
-		return -EINVAL;
-	}
-
-	if (size != sizeof(__u64)) {
-		log_err("Expected an 8-byte integer, got %zu bytes.", size);
-		return -EINVAL;
-	}
-
-	value64 = *((__u64 *) value);
-	if (value64 > max_u32) {
-		log_err("Expected a timeout less than %u seconds", max_u32 / 1000);
-		return -EINVAL;
-	}
-
-	value64 = msecs_to_jiffies(value64);
-	if (value64 < fragment_min) {
-		log_err("The fragment timeout must be at least %u seconds.", FRAGMENT_MIN);
-		return -EINVAL;
+	if (type == FRAGMENT_FORWARD_EARLY) {
+		if (size != sizeof(__u8)) {
+			log_err("Expected a boolean, got %zu bytes.", size);
+			return -EINVAL;
+		}
+		value64 = *((__u8 *) value);
+	} else {
+		if (size != sizeof(__u64)) {
+			log_err("Expected an 8-byte integer, got %zu bytes.", size);
+			return -EINVAL;
+		}
+		value64 = *((__u64 *) value);
 	}
 
-	tmp_config = kmalloc(sizeof(*tmp_config), GFP_KERNEL);
+	tmp_config = config_alloc(sizeof(*tmp_config), GFP_KERNEL);
 	if (!tmp_config)
 		return -ENOMEM;
 
 	old_config = config;
 	*tmp_config = *old_config;
 
-	tmp_config->fragment_timeout = value64;
+	switch (type) {
+	case FRAGMENT_TIMEOUT:
+		if (value64 > max_u32) {
+			log_err("Expected a timeout less than %u seconds", max_u32 / 1000);
+			goto fail;
+		}
+		value64 = msecs_to_jiffies(value64);
+		if (value64 < fragment_min) {
+			log_err("The fragment timeout must be at least %u seconds.", FRAGMENT_MIN);
+			goto fail;
+		}
+		tmp_config->fragment_timeout = value64;
+		break;
+	case FRAGMENT_HIGH_THRESH:
+		tmp_config->high_thresh = value64;
+		break;
+	case FRAGMENT_LOW_THRESH:
+		tmp_config->low_thresh = value64;
+		break;
+	case FRAGMENT_FORWARD_EARLY:
+		tmp_config->forward_early = value64;
+		break;
+	default:
+		log_err("Unknown config type for the 'fragment db' module: %u", type);
+		goto fail;
+	}
+
+	if (tmp_config->high_thresh && tmp_config->low_thresh > tmp_config->high_thresh) {
+		log_err("The low fragment memory threshold (%llu) cannot exceed the high one (%llu).",
+				tmp_config->low_thresh, tmp_config->high_thresh);
+		goto fail;
+	}
 
 	rcu_assign_pointer(config, tmp_config);
-	synchronize_rcu_bh();
-	kfree(old_config);
+	config_retire(old_config);
 	return 0;
+
+fail:
+	config_free(tmp_config);
+	return -EINVAL;
 }
 
-static bool is_first(struct sk_buff *skb)
+/**
+ * Returns whether "buffer" has no holes left (ie. all of its fragments have arrived).
+ */
+static bool buffer_is_complete(struct reassembly_buffer *buffer)
 {
-	switch (skb_l3_proto(skb)) {
-	case L3PROTO_IPV4:
-		return is_first_fragment_ipv4(ip_hdr(skb));
-	case L3PROTO_IPV6:
-		return is_first_fragment_ipv6(skb_frag_hdr(skb));
-	}
-	return false;
+	return buffer->hole_count == 0 && list_empty(&buffer->holes);
 }
 
-static struct sk_buff *skb_add_frag(struct sk_buff *main, struct sk_buff *addend)
+/**
+ * Moves the "count" holes from "holes" to "buffer"'s hole descriptor list, which is assumed empty.
+ * If this fails, the holes moved so far stay in the list, so buffer_dealloc() still cleans up.
+ */
+static int spill_holes(struct reassembly_buffer *buffer, struct hole_range *holes,
+		unsigned int count, int node)
 {
-	if (is_first(addend)) {
-		addend->prev = main->prev;
-		addend->next = main;
-		main->prev = addend;
-		addend->prev->next = addend;
-		return addend;
+	struct hole_descriptor *hole;
+	unsigned int i;
+
+	buffer->hole_count = 0;
+	for (i = 0; i < count; i++) {
+		hole = hole_alloc(holes[i].first, holes[i].last, node);
+		if (!hole)
+			return -ENOMEM;
+		list_add_tail(&hole->list_hook, &buffer->holes);
 	}
 
-	main->prev->next = addend;
-	addend->prev = main->prev;
-	addend->next = main;
-	main->prev = addend;
-	return main;
+	return 0;
 }
 
 /**
- * Groups "skb_in" with the rest of its fragments.
- * If the rest of the fragments have not yet arrived, this will return VER_STOLEN and store skb_in.
- * If all of the fragments have arrived, this will return VER_CONTINUE and the zero-offset fragment
- * will be returned in "skb_out". The rest of the fragments can be accesed via skb_out's list
- * (skb_out->next).
- *
- * RFC 815, section 3.
+ * update_holes(), for buffers whose holes still fit in "hole_arr".
+ * Same steps as update_hole_list(), except the surviving holes are copied to a scratch array
+ * instead of being spliced in place.
  */
-static verdict fragment_arrives(struct sk_buff *skb_in, struct sk_buff **skb_out)
+static int update_hole_array(struct reassembly_buffer *buffer, u16 fragment_first,
+		u16 fragment_last, bool mf, int node)
 {
-	/* The fragment collector skb belongs to. */
-	struct reassembly_buffer *buffer;
-	/* This is just a helper that allows us to quickly find buffer. */
-	struct reassembly_buffer_key key;
-	/* THE hole, repeatedly addressed by the RFC. */
-	struct hole_descriptor *hole;
-	/* Only helps to safely iterate. You generally needn't mind this one. */
-	struct hole_descriptor *hole_aux;
-	/* "fragment.first" as stated by the RFC. Spans 8 bytes. */
-	u16 fragment_first = 0;
-	/* "fragment.last" as stated by the RFC. Spans 8 bytes. */
-	u16 fragment_last = 0;
-
-	inc_stats(skb_in, IPSTATS_MIB_REASMREQDS);
+	/*
+	 * The holes are sorted and disjoint, so only the first hole the fragment touches can leave
+	 * something to its left, and only the last one can leave something to its right. A fragment
+	 * therefore adds one hole at most.
+	 */
+	struct hole_range result[INLINE_HOLES + 1];
+	struct hole_range *hole;
+	unsigned int count = 0;
+	unsigned int i;
 
-	/* Store buffer's accesor so we don't have to recalculate it all the time. */
-	if (is_error(skb_to_key(skb_in, &key))) {
-		inc_stats(skb_in, IPSTATS_MIB_REASMFAILS);
-		return VER_DROP;
-	}
+	/* Step 1 */
+	for (i = 0; i < buffer->hole_count; i++) {
+		hole = &buffer->hole_arr[i];
 
-	spin_lock_bh(&table_lock);
+		/* Steps 2 and 3 */
+		if (fragment_first > hole->last || fragment_last < hole->first) {
+			result[count++] = *hole;
+			continue;
+		}
 
-	/* Start reading page 4 here. "We start the algorithm when the earliest fragment..." */
-	buffer = buffer_get(&key);
-	if (buffer) {
-		buffer->skb = skb_add_frag(buffer->skb, skb_in);
+		/* Step 4 consists of not copying "hole". */
 
-	} else {
-		buffer = buffer_alloc(skb_in);
-		if (!buffer)
-			goto fail;
+		/* Step 5 */
+		if (fragment_first > hole->first) {
+			result[count].first = hole->first;
+			result[count].last = fragment_first - 1;
+			count++;
+		}
 
-		hole = hole_alloc(0, INFINITY);
-		if (!hole) {
-			kmem_cache_free(buffer_cache, buffer);
-			goto fail;
+		/* Step 6 */
+		if (fragment_last < hole->last && mf) {
+			result[count].first = fragment_last + 1;
+			result[count].last = hole->last;
+			count++;
 		}
+	} /* Step 7 */
 
-		list_add(&hole->list_hook, &buffer->holes);
+	if (unlikely(count > INLINE_HOLES))
+		return spill_holes(buffer, result, count, node);
 
-		if (is_error(buffer_put(&key, buffer))) {
-			kmem_cache_free(hole_cache, hole);
-			kmem_cache_free(buffer_cache, buffer);
-			goto fail;
-		}
-	}
+	memcpy(buffer->hole_arr, result, count * sizeof(*result));
+	buffer->hole_count = count;
+	return 0;
+}
 
-	fragment_first = compute_fragment_first(skb_in);
-	fragment_last = compute_fragment_last(fragment_first, skb_in);
+/**
+ * update_holes(), for buffers that ran out of inline holes. This is the pathological case, so it's
+ * just the RFC's list walk.
+ */
+static int update_hole_list(struct reassembly_buffer *buffer, u16 fragment_first,
+		u16 fragment_last, bool mf, int node)
+{
+	/* THE hole, repeatedly addressed by the RFC. */
+	struct hole_descriptor *hole;
+	/* Only helps to safely iterate. You generally needn't mind this one. */
+	struct hole_descriptor *hole_aux;
+	struct hole_descriptor *new_hole;
 
 	/* Step 1 */
 	list_for_each_entry_safe(hole, hole_aux, &buffer->holes, list_hook) {
@@ -635,23 +989,17 @@ static verdict fragment_arrives(struct sk_buff *skb_in, struct sk_buff **skb_out
 
 		/* Step 5 */
 		if (fragment_first > hole->first) {
-			struct hole_descriptor *new_hole;
-			new_hole = hole_alloc(hole->first, fragment_first - 1);
-			if (!new_hole) {
-				buffer_destroy(&key, buffer);
-				goto fail;
-			}
+			new_hole = hole_alloc(hole->first, fragment_first - 1, node);
+			if (!new_hole)
+				return -ENOMEM;
 			list_add(&new_hole->list_hook, hole->list_hook.prev);
 		}
 
 		/* Step 6 */
-		if (fragment_last < hole->last && is_mf_set(skb_in)) {
-			struct hole_descriptor *new_hole;
-			new_hole = hole_alloc(fragment_last + 1, hole->last);
-			if (!new_hole) {
-				buffer_destroy(&key, buffer);
-				goto fail;
-			}
+		if (fragment_last < hole->last && mf) {
+			new_hole = hole_alloc(fragment_last + 1, hole->last, node);
+			if (!new_hole)
+				return -ENOMEM;
 			list_add(&new_hole->list_hook, &hole->list_hook);
 		}
 
@@ -662,54 +1010,233 @@ static verdict fragment_arrives(struct sk_buff *skb_in, struct sk_buff **skb_out
 		 */
 		list_del(&hole->list_hook);
 		kmem_cache_free(hole_cache, hole);
+		jool_mem_add(JMEM_FRAGDB, -(long) sizeof(*hole));
 	} /* Step 7 */
 
+	return 0;
+}
+
+/**
+ * The core of RFC 815: updates "buffer"'s hole descriptor list, now that "skb" has arrived.
+ * Does not store "skb". New hole descriptors, if any, are allocated on NUMA node "node".
+ */
+static int update_holes(struct reassembly_buffer *buffer, struct sk_buff *skb, int node)
+{
+	/* "fragment.first" as stated by the RFC. Spans 8 bytes. */
+	u16 fragment_first = compute_fragment_first(skb);
+	/* "fragment.last" as stated by the RFC. Spans 8 bytes. */
+	u16 fragment_last = compute_fragment_last(fragment_first, skb);
+	bool mf = is_mf_set(skb);
+
+	if (!list_empty(&buffer->holes))
+		return update_hole_list(buffer, fragment_first, fragment_last, mf, node);
+	return update_hole_array(buffer, fragment_first, fragment_last, mf, node);
+}
+
+/**
+ * Returns whether "skb"'s layer-4 checksum can be translated without looking at the rest of its
+ * fragments. Translation only adjusts the pseudoheader and the ports, so it usually can. The
+ * exceptions are ICMP (whose pseudoheader change needs the packet's total length) and zero-checksum
+ * IPv4 UDP (whose checksum has to be computed from scratch).
+ */
+bool fragdb_is_csum_incremental(struct sk_buff *skb)
+{
+	switch (skb_l4_proto(skb)) {
+	case L4PROTO_TCP:
+		return true;
+	case L4PROTO_UDP:
+		return skb_l3_proto(skb) == L3PROTO_IPV6 || udp_hdr(skb)->check != 0;
+	case L4PROTO_ICMP:
+		return false;
+	}
+
+	return false;
+}
+
+/**
+ * Groups "skb_in" with the rest of its fragments.
+ * If the rest of the fragments have not yet arrived, this will return VER_STOLEN and store skb_in.
+ * If all of the fragments have arrived, this will return VER_CONTINUE and the zero-offset fragment
+ * will be returned in "skb_out". The rest of the fragments can be accesed via skb_out's list
+ * (skb_out->next).
+ *
+ * If "forward_early" is on and "tuple_out" is not NULL, a first fragment whose checksum doesn't
+ * need its siblings is returned right away instead (along with any siblings that arrived before
+ * it). Once fragdb_remember_tuple() has been told its outgoing tuple, the remaining fragments are
+ * returned one by one as they arrive, and the tuple is copied to "tuple_out".
+ *
+ * RFC 815, section 3.
+ */
+static verdict fragment_arrives(struct sk_buff *skb_in, struct sk_buff **skb_out,
+		struct tuple *tuple_out)
+{
+	/* The slice of the database "buffer" belongs to. */
+	struct fragdb_shard *shard;
+	/* The fragment collector skb belongs to. */
+	struct reassembly_buffer *buffer;
+	/* This is just a helper that allows us to quickly find buffer. */
+	struct reassembly_buffer_key key;
+	/* Whether skb_in's packet can be forwarded without being reassembled. */
+	bool early = tuple_out && get_forward_early();
+	int error;
+
+	inc_stats(skb_in, IPSTATS_MIB_REASMREQDS);
+
+	/* Store buffer's accesor so we don't have to recalculate it all the time. */
+	if (is_error(skb_to_key(skb_in, &key))) {
+		inc_stats(skb_in, IPSTATS_MIB_REASMFAILS);
+		return VER_DROP;
+	}
+
+	shard = get_shard(&key);
+	jool_lock_bh(&shard->lock, JLOCK_FRAGDB);
+
+	/* Start reading page 4 here. "We start the algorithm when the earliest fragment..." */
+	buffer = buffer_get(shard, &key);
+	if (!buffer) {
+		buffer = buffer_alloc(&key, shard->node);
+		if (!buffer)
+			goto fail;
+
+		error = buffer_put(shard, buffer);
+		if (is_error(error)) {
+			log_warn_once("Could not index a reassembly buffer (error %d). "
+					"Dropping the fragment.", error);
+			inc_jool_stats(JSTAT_FRAG_STORE_FAILED);
+			atomic64_sub(buffer->mem, &bytes_queued);
+			buffer_dealloc(buffer);
+			goto fail;
+		}
+
+		trace_buffer(jool_fragdb_buffer_create, buffer);
+	}
+
+	if (is_error(update_holes(buffer, skb_in, shard->node))) {
+		buffer_destroy(shard, buffer);
+		goto fail;
+	}
+
+	if (buffer->forwarded) {
+		if (!buffer->tuple_known || !tuple_out) {
+			/* Wait for fragdb_remember_tuple(). */
+			buffer_add_skb(buffer, skb_in);
+			goto stolen;
+		}
+
+		*skb_out = skb_in;
+		*tuple_out = buffer->tuple;
+		if (buffer_is_complete(buffer))
+			buffer_destroy(shard, buffer);
+		jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+		return VER_CONTINUE;
+	}
+
+	if (early && !buffer_is_complete(buffer) && is_first(skb_in)
+			&& fragdb_is_csum_incremental(skb_in)) {
+		buffer->forwarded = true;
+		skb_in->prev = NULL;
+		skb_in->next = buffer_take_skbs(buffer);
+		if (skb_in->next)
+			skb_in->next->prev = skb_in;
+		jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+
+		*skb_out = skb_in;
+		return VER_CONTINUE;
+	}
+
+	buffer_add_skb(buffer, skb_in);
+
 	/* Step 8 */
-	if (list_empty(&buffer->holes)) {
-		*skb_out = buffer->skb;
-		buffer->skb = NULL;
-		buffer_destroy(&key, buffer);
-		spin_unlock_bh(&table_lock);
-
-#ifdef BENCHMARK
-		getnstimeofday(&skb_jcb(*skb_out)->start_time);
-#endif
-		(*skb_out)->prev->next = NULL;
-		(*skb_out)->prev = NULL;
+	if (buffer_is_complete(buffer)) {
+		*skb_out = buffer_take_skbs(buffer);
+		buffer_destroy(shard, buffer);
+		jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+
+		if (logtime_enabled())
+			getnstimeofday(&skb_jcb(*skb_out)->start_time);
 
 		inc_stats(*skb_out, IPSTATS_MIB_REASMOKS);
 		return VER_CONTINUE;
 	}
 
 	/* RFC 815 ends here. */
+	/* Fall through. */
 
-	spin_unlock_bh(&table_lock);
+stolen:
+	jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+	evict_buffers();
 	return VER_STOLEN;
 
 fail:
-	spin_unlock_bh(&table_lock);
+	jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
 	inc_stats(skb_in, IPSTATS_MIB_REASMFAILS);
 	return VER_DROP;
 }
 
-verdict fragdb_handle6(struct sk_buff *skb_in, struct sk_buff **skb_out)
+verdict fragdb_handle6(struct sk_buff *skb_in, struct sk_buff **skb_out, struct tuple *tuple_out)
 {
 	if (!is_fragmented_ipv6(skb_frag_hdr(skb_in))) {
 		*skb_out = skb_in;
 		return VER_CONTINUE;
 	}
 
-	return fragment_arrives(skb_in, skb_out);
+	return fragment_arrives(skb_in, skb_out, tuple_out);
 }
 
-verdict fragdb_handle4(struct sk_buff *skb_in, struct sk_buff **skb_out)
+verdict fragdb_handle4(struct sk_buff *skb_in, struct sk_buff **skb_out, struct tuple *tuple_out)
 {
 	if (!is_fragmented_ipv4(ip_hdr(skb_in))) {
 		*skb_out = skb_in;
 		return VER_CONTINUE;
 	}
 
-	return fragment_arrives(skb_in, skb_out);
+	return fragment_arrives(skb_in, skb_out, tuple_out);
+}
+
+void fragdb_remember_tuple(struct sk_buff *skb, struct tuple *tuple_out)
+{
+	struct fragdb_shard *shard;
+	struct reassembly_buffer *buffer;
+	struct reassembly_buffer_key key;
+	struct sk_buff *waiting = NULL;
+	struct sk_buff *last;
+
+	switch (skb_l3_proto(skb)) {
+	case L3PROTO_IPV4:
+		if (!is_fragmented_ipv4(ip_hdr(skb)))
+			return;
+		break;
+	case L3PROTO_IPV6:
+		if (!is_fragmented_ipv6(skb_frag_hdr(skb)))
+			return;
+		break;
+	}
+
+	if (!get_forward_early() || is_error(skb_to_key(skb, &key)))
+		return;
+
+	shard = get_shard(&key);
+	jool_lock_bh(&shard->lock, JLOCK_FRAGDB);
+
+	buffer = buffer_get(shard, &key);
+	if (buffer && buffer->forwarded && !buffer->tuple_known) {
+		buffer->tuple = *tuple_out;
+		buffer->tuple_known = true;
+		waiting = buffer_take_skbs(buffer);
+		if (buffer_is_complete(buffer))
+			buffer_destroy(shard, buffer);
+	}
+
+	jool_unlock_bh(&shard->lock, JLOCK_FRAGDB);
+
+	if (!waiting)
+		return;
+
+	/* The siblings that arrived in the meantime can be translated along with "skb". */
+	for (last = skb; last->next; last = last->next)
+		/* Nothing. */;
+	last->next = waiting;
+	waiting->prev = last;
 }
 
 /**
@@ -717,10 +1244,16 @@ verdict fragdb_handle4(struct sk_buff *skb_in, struct sk_buff **skb_out)
  */
 void fragdb_destroy(void)
 {
-	del_timer_sync(&expire_timer);
-	fragdb_table_empty(&table, buffer_dealloc);
+	int i;
+
+	for (i = 0; i < shard_count; i++) {
+		del_timer_sync(&shards[i].expire_timer);
+		fragdb_table_destroy(&shards[i].table, buffer_dealloc);
+	}
+	kfree(shards);
 
 	kmem_cache_destroy(hole_cache);
 	kmem_cache_destroy(buffer_cache);
-	kfree(config);
+	rcu_barrier_bh(); /* Wait for the configurations retired by config_retire(). */
+	config_free(config);
 }
@@ -2,6 +2,7 @@
 #include "nat64/mod/pool4.h"
 #include "nat64/mod/filtering_and_updating.h"
 #include "nat64/mod/compute_outgoing_tuple.h"
+#include "nat64/mod/siit.h"
 #include "nat64/mod/ttp/core.h"
 #include "nat64/mod/send_packet.h"
 #include "nat64/mod/stats.h"
@@ -13,9 +14,35 @@
  * @param pkt outgoing packet the NAT64 would send if it's not a hairpin.
  * @return whether pkt is a hairpin packet.
  */
+static bool is_hairpin_addr(__be32 addr)
+{
+	return siit_enabled() ? siit_owns4(addr) : pool4_contains(addr);
+}
+
 bool is_hairpin(struct sk_buff *skb)
 {
-	return (skb_l3_proto(skb) == L3PROTO_IPV4) ? pool4_contains(ip_hdr(skb)->daddr) : false;
+	return (skb_l3_proto(skb) == L3PROTO_IPV4) ? is_hairpin_addr(ip_hdr(skb)->daddr) : false;
+}
+
+bool is_hairpin_tuple(struct tuple *tuple_out)
+{
+	return (tuple_out->l3_proto == L3PROTO_IPV4)
+			? is_hairpin_addr(tuple_out->dst.addr4.l3.s_addr)
+			: false;
+}
+
+/**
+ * Step 3, using step 2's "session" if it found one.
+ * The caller must still be in the RCU read-side critical section step 2 ran in.
+ */
+static verdict out_tuple(struct session_entry *session, struct tuple *in, struct tuple *out,
+		struct sk_buff *skb)
+{
+	if (!session)
+		return compute_out_tuple(in, out, skb);
+
+	compute_out_tuple_session(session, in, out);
+	return VER_CONTINUE;
 }
 
 /**
@@ -28,6 +55,7 @@ bool is_hairpin(struct sk_buff *skb)
  */
 verdict handling_hairpinning(struct sk_buff *skb_in, struct tuple *tuple_in)
 {
+	struct session_entry *session = NULL;
 	struct sk_buff *skb_out;
 	struct tuple tuple_out;
 	verdict result;
@@ -40,10 +68,15 @@ verdict handling_hairpinning(struct sk_buff *skb_in, struct tuple *tuple_in)
 		return VER_DROP;
 	}
 
-	result = filtering_and_updating(skb_in, tuple_in);
-	if (result != VER_CONTINUE)
-		return result;
-	result = compute_out_tuple(tuple_in, &tuple_out, skb_in);
+	if (siit_enabled()) {
+		result = siit_compute_out_tuple(tuple_in, &tuple_out, skb_in);
+	} else {
+		rcu_read_lock_bh();
+		result = filtering_and_updating(skb_in, tuple_in, &session);
+		if (result == VER_CONTINUE)
+			result = out_tuple(session, tuple_in, &tuple_out, skb_in);
+		rcu_read_unlock_bh();
+	}
 	if (result != VER_CONTINUE)
 		return result;
 	result = translating_the_packet(&tuple_out, skb_in, &skb_out);
@@ -56,3 +89,31 @@ verdict handling_hairpinning(struct sk_buff *skb_in, struct tuple *tuple_in)
 	log_debug("Done step 5.");
 	return VER_CONTINUE;
 }
+
+int handling_hairpinning_tuple(struct sk_buff *skb, struct tuple *tuple4, struct tuple *tuple6)
+{
+	struct session_entry *session = NULL;
+	int error;
+
+	log_debug("Step 5: Handling Hairpinning (without the IPv4 packet)...");
+
+	if (siit_enabled()) {
+		if (skb_l4_proto(skb) == L4PROTO_ICMP)
+			return -EINVAL; /* Same as handling_hairpinning(). */
+		if (siit_compute_out_tuple(tuple4, tuple6, skb) != VER_CONTINUE)
+			return -EINVAL;
+		log_debug("Done step 5.");
+		return 0;
+	}
+
+	rcu_read_lock_bh();
+	error = filtering_hairpin(skb, tuple4, &session);
+	if (!error && out_tuple(session, tuple4, tuple6, skb) != VER_CONTINUE)
+		error = -EINVAL;
+	rcu_read_unlock_bh();
+	if (error)
+		return error;
+
+	log_debug("Done step 5.");
+	return 0;
+}
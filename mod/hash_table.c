@@ -2,10 +2,12 @@
  * @file
  * A generic hash table implementation. Its design is largely based off Java's
  * java.util.LinkedHashMap.
- * One difference is that the internal array does not resize. One important similarity is that it
- * is not synchronized.
+ * Like it, the internal array grows (and shrinks) with the number of entries, so idle instances
+ * don't pay for slots they don't use. One important similarity is that it is not synchronized;
+ * resizing happens within PUT and REMOVE, so it is covered by whatever lock the caller already
+ * holds around them.
  *
- * Uses the kernel's hlist internally.
+ * By default, uses the kernel's hlist internally.
  * We're not using hlist directly because it implies a lot of code rewriting (eg. the entry
  * retrieval function; "get") and we need at least four different hash tables.
  * (Update 2014-01-10 - now it's two, actually. This module will probably die when we address the
@@ -17,12 +19,18 @@
  * @macro HTABLE_NAME name of the hash table structure to generate. Optional; Default: hash_table.
  * @macro KEY_TYPE data type of the table's keys.
  * @macro VALUE_TYPE data type of the table's values.
- * @macro HASH_TABLE_SIZE The size of the internal array, in slots. Optional;
- *		Default = Max = 64k - 1.
+ * @macro HASH_TABLE_MIN_SIZE The initial (and smallest) size of the internal array, in slots. Has
+ *		to be a power of two. Optional; Default = 16.
+ * @macro HASH_TABLE_MAX_SIZE The size beyond which the internal array will not grow, in slots. Has
+ *		to be a power of two. Optional; Default = 64k. The chained variant also stops at
+ *		HTABLE_ATOMIC_MAX_BYTES.
  * @macro GENERATE_PRINT just define it if you want the print function; otherwise it will not be
  *		generated.
  * @macro GENERATE_FOR_EACH just define it if you want the for_each function; otherwise it will not
  *		be generated.
+ * @macro HTABLE_OPEN_ADDRESSING just define it if you want the entries stored in the array itself
+ *		rather than in separately allocated nodes. Best for small keys and tables whose users
+ *		only need the generated functions (the node list is not available); see below.
  *
  * This module contains no header file; it needs to be #included directly.
  */
@@ -38,11 +46,30 @@
 #define HTABLE_NAME hash_table
 #endif
 
-#ifndef HASH_TABLE_SIZE
-/**
- * This number should not exceed unsigned int's maximum.
+#ifndef HASH_TABLE_MIN_SIZE
+#define HASH_TABLE_MIN_SIZE 16
+#endif
+
+#ifndef HASH_TABLE_MAX_SIZE
+#define HASH_TABLE_MAX_SIZE (64 * 1024)
+#endif
+
+/*
+ * These do not depend on the instance, so they're only defined once.
+ * The chained table doubles when it holds more than HTABLE_GROW_LOAD entries per slot on average, and
+ * halves when it holds less than one entry every HTABLE_SHRINK_LOAD slots. The gap between both
+ * prevents a table hovering around a threshold from resizing on every PUT and REMOVE.
+ */
+#ifndef HTABLE_GROW_LOAD
+#define HTABLE_GROW_LOAD 2
+#define HTABLE_SHRINK_LOAD 2
+/*
+ * RESIZE runs under the users' locks, so it can only allocate atomically, and atomic allocations
+ * bigger than PAGE_ALLOC_COSTLY_ORDER pages fail often. The chained table can live with longer
+ * lists, so it doesn't grow past this many bytes of slots. The open addressing table cannot, so it
+ * keeps trying up to HASH_TABLE_MAX_SIZE.
  */
-#define HASH_TABLE_SIZE (64 * 1024 - 1)
+#define HTABLE_ATOMIC_MAX_BYTES (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
 #endif
 
 /** Creates a token name by concatenating prefix and suffix. */
@@ -62,12 +89,376 @@
 #define REMOVE			CONCAT(HTABLE_NAME, _remove)
 /** The name of the empty function. */
 #define EMPTY			CONCAT(HTABLE_NAME, _empty)
+/** The name of the destroy function. */
+#define DESTROY			CONCAT(HTABLE_NAME, _destroy)
+/** The name of the resize function. */
+#define RESIZE			CONCAT(HTABLE_NAME, _resize)
 /** The name of the auxiliary get function. */
 #define GET_AUX			CONCAT(HTABLE_NAME, _get_aux)
 /** The name of the print function. */
 #define PRINT			CONCAT(HTABLE_NAME, _print)
 /** The name of the for_each function. */
 #define FOR_EACH		CONCAT(HTABLE_NAME, _for_each)
+/** The name of the open addressing variant's insertion function. */
+#define INSERT			CONCAT(HTABLE_NAME, _insert)
+
+#ifdef HTABLE_OPEN_ADDRESSING
+
+/********************************************
+ * Open addressing variant.
+ ********************************************/
+
+/*
+ * The entries live in the array itself, so a PUT costs no allocation and a GET usually touches a
+ * single cache line. Collisions are resolved by linear probing with Robin Hood displacement (an
+ * entry being inserted takes the slot of any entry that is closer to its home slot), which keeps
+ * probe sequences short and lets failed lookups quit early. Removals shift the rest of the cluster
+ * back instead of leaving tombstones.
+ *
+ * The array doubles once it is three quarters full, and halves once it is less than one eighth
+ * full. Because the entries have nowhere else to go, a table that has already reached
+ * HASH_TABLE_MAX_SIZE (or cannot allocate a bigger array) keeps filling up, and PUT fails once a
+ * single free slot is left.
+ */
+
+/** Every entry in the table; the key used to access the value and the value. */
+struct KEY_VALUE_PAIR {
+	/** Dictates where in the table the value is. */
+	KEY_TYPE key;
+	/** The value the user wants to store in the table. NULL means the slot is free. */
+	VALUE_TYPE *value;
+	/** Cached result of hash_function(&key), so moving the entry doesn't need to rehash it. */
+	unsigned int hash;
+};
+
+/** The hash table. */
+struct HTABLE_NAME {
+	/** The entries themselves. */
+	struct KEY_VALUE_PAIR *table;
+	/** Length of "table". Always a power of two. */
+	unsigned int slots;
+	unsigned int node_count;
+	/** Number of times RESIZE could not allocate the new array. */
+	unsigned int resize_failures;
+
+	/** Used to locate the slot (within the cluster) of a value. */
+	bool (*equals_function)(const KEY_TYPE *, const KEY_TYPE *);
+	/** Used to locate the home slot (within the array) of a value. */
+	unsigned int (*hash_function)(const KEY_TYPE *);
+};
+
+/**
+ * Places "entry" in the "slots"-sized "array", displacing entries as Robin Hood hashing mandates.
+ * Assumes there's at least one free slot.
+ */
+static void INSERT(struct KEY_VALUE_PAIR *array, unsigned int slots, struct KEY_VALUE_PAIR entry)
+{
+	struct KEY_VALUE_PAIR tmp;
+	unsigned int mask = slots - 1;
+	unsigned int i = entry.hash & mask;
+	unsigned int distance = 0;
+	unsigned int other_distance;
+
+	while (array[i].value) {
+		other_distance = (i - array[i].hash) & mask;
+		if (other_distance < distance) {
+			tmp = array[i];
+			array[i] = entry;
+			entry = tmp;
+			distance = other_distance;
+		}
+		i = (i + 1) & mask;
+		distance++;
+	}
+
+	array[i] = entry;
+}
+
+/**
+ * Moves every entry of "table" to a new array of "new_slots" slots.
+ * If the new array cannot be allocated, the table simply stays the way it was.
+ */
+static void RESIZE(struct HTABLE_NAME *table, unsigned int new_slots)
+{
+	struct KEY_VALUE_PAIR *new_table;
+	unsigned int i;
+
+	new_table = kcalloc(new_slots, sizeof(*new_table), GFP_ATOMIC | __GFP_NOWARN);
+	if (!new_table) {
+		table->resize_failures++;
+		log_warn_once("Could not allocate %u slots; the table stays at %u.", new_slots,
+				table->slots);
+		return;
+	}
+
+	for (i = 0; i < table->slots; i++)
+		if (table->table[i].value)
+			INSERT(new_table, new_slots, table->table[i]);
+
+	kfree(table->table);
+	table->table = new_table;
+	table->slots = new_slots;
+}
+
+/**
+ * Returns the slot where "key" is stored in "table", NULL if there's no mapping for the key.
+ * To be used by hash table functions; outside code should use GET instead.
+ */
+static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, const KEY_TYPE *key)
+{
+	struct KEY_VALUE_PAIR *slot;
+	unsigned int mask, hash, i, distance;
+
+	if (WARN(!table, "The table is NULL."))
+		return NULL;
+
+	mask = table->slots - 1;
+	hash = table->hash_function(key);
+	i = hash & mask;
+
+	for (distance = 0; distance < table->slots; distance++) {
+		slot = &table->table[i];
+		if (!slot->value)
+			return NULL;
+		/* If "key" were here, Robin Hood would have placed it before this one. */
+		if (((i - slot->hash) & mask) < distance)
+			return NULL;
+		if (slot->hash == hash && table->equals_function(key, &slot->key))
+			return slot;
+		i = (i + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/**
+ * Readies "table" for future use.
+ * Call DESTROY once you don't need it anymore.
+ *
+ * @param table the HTABLE_NAME instance you want to initialize.
+ * @param equals_function function the table will use to locate slots.
+ * @param hash_function function the table will use to locate home slots.
+ */
+static int INIT(struct HTABLE_NAME *table,
+		bool (*equals_function)(const KEY_TYPE *, const KEY_TYPE *),
+		unsigned int (*hash_function)(const KEY_TYPE *))
+{
+	if (WARN(!table, "The table is NULL."))
+		return -EINVAL;
+	if (WARN(!equals_function, "The equals function is NULL."))
+		return -EINVAL;
+	if (WARN(!hash_function, "The hash code function is NULL."))
+		return -EINVAL;
+
+	table->table = kcalloc(HASH_TABLE_MIN_SIZE, sizeof(*table->table), GFP_KERNEL);
+	if (!table->table) {
+		log_err("Could not allocate the hash table's slots.");
+		return -ENOMEM;
+	}
+	table->slots = HASH_TABLE_MIN_SIZE;
+	table->node_count = 0;
+	table->resize_failures = 0;
+
+	table->equals_function = equals_function;
+	table->hash_function = hash_function;
+
+	return 0;
+}
+
+/**
+ * Inserts "value" to the "table" table in the slot described by the "key" key.
+ *
+ * Important: The table stores a copy of key. If you kmalloc'd it, free it.
+ *
+ * Also important: This function doesn't validate whether the value is already in the table before
+ * inserting.
+ *
+ * @param table the HTABLE_NAME instance you want to insert a value to.
+ * @param key descriptor of the slot to place "value" in.
+ * @param value element to store in the table. Cannot be NULL.
+ * @return error status.
+ */
+static int PUT(struct HTABLE_NAME *table, KEY_TYPE *key, VALUE_TYPE *value)
+{
+	struct KEY_VALUE_PAIR entry;
+
+	if (WARN(!table, "The table is NULL."))
+		return -EINVAL;
+	if (WARN(!value, "The value is NULL."))
+		return -EINVAL;
+
+	if (4 * (table->node_count + 1) > 3 * table->slots && table->slots < HASH_TABLE_MAX_SIZE)
+		RESIZE(table, table->slots << 1);
+	if (table->node_count + 1 >= table->slots) {
+		log_debug("The hash table is full.");
+		return -ENOMEM;
+	}
+
+	entry.key = *key;
+	entry.value = value;
+	entry.hash = table->hash_function(key);
+	INSERT(table->table, table->slots, entry);
+	table->node_count++;
+
+	return 0;
+}
+
+/**
+ * Returns from "table" the value mapped to the "key" key, if available.
+ *
+ * You will receive the actual stored value. Please don't release it from memory (use the REMOVE
+ * function instead).
+ *
+ * @param table the HTABLE_NAME instance you want the value from.
+ * @param key descriptor to which the associated value is to be returned.
+ * @return the value to which "table" maps "key", "null" if there's no mapping for the key.
+ */
+static VALUE_TYPE *GET(struct HTABLE_NAME *table, const KEY_TYPE *key)
+{
+	struct KEY_VALUE_PAIR *slot = GET_AUX(table, key);
+	return (slot != NULL) ? slot->value : NULL;
+}
+
+/**
+ * Stops "key" from accesing its value in the "table" table.
+ *
+ * @param table the HTABLE_NAME instance you want to stop mapping "key" from.
+ * @param key descriptor whose associated value will be removed from "table".
+ */
+static bool REMOVE(struct HTABLE_NAME *table, KEY_TYPE *key, void (*destructor)(VALUE_TYPE *))
+{
+	struct KEY_VALUE_PAIR *slot = GET_AUX(table, key);
+	unsigned int mask, i, next;
+
+	if (slot == NULL)
+		return false;
+
+	if (destructor)
+		destructor(slot->value);
+
+	/* Pull the rest of the cluster one slot closer to home. */
+	mask = table->slots - 1;
+	i = slot - table->table;
+	next = (i + 1) & mask;
+	while (table->table[next].value && ((next - table->table[next].hash) & mask) != 0) {
+		table->table[i] = table->table[next];
+		i = next;
+		next = (next + 1) & mask;
+	}
+	table->table[i].value = NULL;
+	table->node_count--;
+
+	if (8 * table->node_count < table->slots && table->slots > HASH_TABLE_MIN_SIZE)
+		RESIZE(table, table->slots >> 1);
+
+	return true;
+}
+
+/**
+ * Removes (and destroys, if "destructor" is not NULL) every value in the table.
+ * The table remains usable; see DESTROY.
+ *
+ * @param table the HTABLE_NAME instance you want to clear.
+ */
+static void EMPTY(struct HTABLE_NAME *table, void (*destructor)(VALUE_TYPE *))
+{
+	unsigned int i;
+
+	if (WARN(!table, "The table is NULL."))
+		return;
+
+	for (i = 0; i < table->slots; i++) {
+		if (!table->table[i].value)
+			continue;
+		if (destructor)
+			destructor(table->table[i].value);
+		table->table[i].value = NULL;
+	}
+
+	table->node_count = 0;
+	if (table->slots > HASH_TABLE_MIN_SIZE)
+		RESIZE(table, HASH_TABLE_MIN_SIZE);
+}
+
+/**
+ * Clears all memory allocated by the table. You definitely want to call this before your table goes
+ * into oblivion!!!
+ *
+ * @param table the HTABLE_NAME instance you want to destroy.
+ */
+static void DESTROY(struct HTABLE_NAME *table, void (*destructor)(VALUE_TYPE *))
+{
+	if (WARN(!table, "The table is NULL."))
+		return;
+
+	EMPTY(table, destructor);
+	kfree(table->table);
+	table->table = NULL;
+	table->slots = 0;
+}
+
+#ifdef GENERATE_PRINT
+/**
+ * Printks the content of the table in KERN_DEBUG level.
+ * Use for debugging purposes.
+ *
+ * @param the HTABLE_NAME instance you want to print.
+ * @param header a header label for the table. Will precede the table so you can locate it in dmesg
+ *		or something.
+ */
+static void PRINT(struct HTABLE_NAME *table, char *header)
+{
+	unsigned int i;
+
+	log_debug("** Printing table: %s **", header);
+
+	if (!table)
+		goto end;
+
+	for (i = 0; i < table->slots; i++) {
+		if (table->table[i].value)
+			log_debug("  slot:%u hash:%u", i, table->table[i].hash & (table->slots - 1));
+	}
+
+	/* Fall through.*/
+end:
+	log_debug("** End of table **");
+}
+#endif
+
+#ifdef GENERATE_FOR_EACH
+/**
+ * Executes the "func" function for every element in the table.
+ *
+ * Unlike the chained table's, "func" must not PUT or REMOVE anything; entries move around when
+ * that happens, so some could be skipped or visited twice.
+ *
+ * @param table the HTABLE_NAME instance you want to walk-through.
+ * @param func function you want executed for each table entry. Will receive each value and "arg".
+ * @param arg anything you want "func" to receive on every call.
+ * @return error status.
+ */
+static int FOR_EACH(struct HTABLE_NAME *table, int (*func)(VALUE_TYPE *, void *), void *arg)
+{
+	unsigned int i;
+	int error;
+
+	if (!table)
+		return -EINVAL;
+
+	for (i = 0; i < table->slots; i++) {
+		if (!table->table[i].value)
+			continue;
+		error = func(table->table[i].value, arg);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+#endif
+
+#else /* HTABLE_OPEN_ADDRESSING */
 
 /********************************************
  * Structures.
@@ -79,9 +470,13 @@ struct HTABLE_NAME {
 	 * The array of linked lists.
 	 * Each of these contains the values mapped to its index's hash code.
 	 */
-	struct hlist_head table[HASH_TABLE_SIZE];
+	struct hlist_head *table;
+	/** Length of "table". Always a power of two. */
+	unsigned int slots;
 	struct list_head list;
 	unsigned int node_count;
+	/** Number of times RESIZE could not allocate the new array. */
+	unsigned int resize_failures;
 
 	/** Used to locate the slot (within the linked list) of a value. */
 	bool (*equals_function)(const KEY_TYPE *, const KEY_TYPE *);
@@ -108,6 +503,39 @@ struct KEY_VALUE_PAIR {
  * Private "methods".
  ********************************************/
 
+/**
+ * Moves every entry of "table" to a new array of "new_slots" slots.
+ * If the new array cannot be allocated, the table simply stays the way it was; it will still work,
+ * only with longer lists.
+ */
+static void RESIZE(struct HTABLE_NAME *table, unsigned int new_slots)
+{
+	struct hlist_head *new_table;
+	struct KEY_VALUE_PAIR *current_pair;
+	unsigned int i;
+
+	new_table = kmalloc(new_slots * sizeof(*new_table), GFP_ATOMIC | __GFP_NOWARN);
+	if (!new_table) {
+		table->resize_failures++;
+		log_warn_once("Could not allocate %u slots; the table stays at %u.", new_slots,
+				table->slots);
+		return;
+	}
+	for (i = 0; i < new_slots; i++)
+		INIT_HLIST_HEAD(&new_table[i]);
+
+	/* The list already links every entry, so use it instead of walking the old slots. */
+	list_for_each_entry(current_pair, &table->list, list_hook) {
+		hlist_del(&current_pair->hlist_hook);
+		i = table->hash_function(&current_pair->key) & (new_slots - 1);
+		hlist_add_head(&current_pair->hlist_hook, &new_table[i]);
+	}
+
+	kfree(table->table);
+	table->table = new_table;
+	table->slots = new_slots;
+}
+
 /**
  * Returns the key-value mapped to the "key" key within the table.
  *
@@ -126,7 +554,7 @@ static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, const KEY_TYPE
 	if (WARN(!table, "The table is NULL."))
 		return NULL;
 
-	hash_code = table->hash_function(key) % HASH_TABLE_SIZE;
+	hash_code = table->hash_function(key) & (table->slots - 1);
 	hlist_for_each(current_node, &table->table[hash_code]) {
 		current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, hlist_hook);
 		if (table->equals_function(key, &current_pair->key))
@@ -142,6 +570,7 @@ static struct KEY_VALUE_PAIR *GET_AUX(struct HTABLE_NAME *table, const KEY_TYPE
 
 /**
  * Readies "table" for future use.
+ * Call DESTROY once you don't need it anymore.
  *
  * @param table the HTABLE_NAME instance you want to initialize.
  * @param equals_function function the table will use to locate slots.
@@ -160,10 +589,18 @@ static int INIT(struct HTABLE_NAME *table,
 	if (WARN(!hash_function, "The hash code function is NULL."))
 		return -EINVAL;
 
-	for (i = 0; i < HASH_TABLE_SIZE; i++)
+	table->table = kmalloc(HASH_TABLE_MIN_SIZE * sizeof(*table->table), GFP_KERNEL);
+	if (!table->table) {
+		log_err("Could not allocate the hash table's slots.");
+		return -ENOMEM;
+	}
+	table->slots = HASH_TABLE_MIN_SIZE;
+
+	for (i = 0; i < HASH_TABLE_MIN_SIZE; i++)
 		INIT_HLIST_HEAD(&table->table[i]);
 	INIT_LIST_HEAD(&table->list);
 	table->node_count = 0;
+	table->resize_failures = 0;
 
 	table->equals_function = equals_function;
 	table->hash_function = hash_function;
@@ -206,11 +643,16 @@ static int PUT(struct HTABLE_NAME *table, KEY_TYPE *key, VALUE_TYPE *value)
 	key_value->value = value;
 
 	/* Insert the key-value to the table. */
-	hash_code = table->hash_function(key) % HASH_TABLE_SIZE;
+	hash_code = table->hash_function(key) & (table->slots - 1);
 	hlist_add_head(&key_value->hlist_hook, &table->table[hash_code]);
 	list_add_tail(&key_value->list_hook, &table->list);
 	table->node_count++;
 
+	if (table->node_count > HTABLE_GROW_LOAD * table->slots
+			&& table->slots < HASH_TABLE_MAX_SIZE
+			&& 2 * table->slots * sizeof(*table->table) <= HTABLE_ATOMIC_MAX_BYTES)
+		RESIZE(table, table->slots << 1);
+
 	return 0;
 }
 
@@ -250,12 +692,16 @@ static bool REMOVE(struct HTABLE_NAME *table, KEY_TYPE *key, void (*destructor)(
 		destructor(key_value->value);
 	kfree(key_value);
 
+	if (HTABLE_SHRINK_LOAD * table->node_count < table->slots
+			&& table->slots > HASH_TABLE_MIN_SIZE)
+		RESIZE(table, table->slots >> 1);
+
 	return true;
 }
 
 /**
- * Clears all memory allocated by the table. You definitely want to call this before your table goes
- * into oblivion!!!
+ * Removes (and destroys, if "destructor" is not NULL) every value in the table.
+ * The table remains usable; see DESTROY.
  *
  * @param table the HTABLE_NAME instance you want to clear.
  */
@@ -280,6 +726,25 @@ static void EMPTY(struct HTABLE_NAME *table, void (*destructor)(VALUE_TYPE *))
 	}
 
 	table->node_count = 0;
+	if (table->slots > HASH_TABLE_MIN_SIZE)
+		RESIZE(table, HASH_TABLE_MIN_SIZE);
+}
+
+/**
+ * Clears all memory allocated by the table. You definitely want to call this before your table goes
+ * into oblivion!!!
+ *
+ * @param table the HTABLE_NAME instance you want to destroy.
+ */
+static void DESTROY(struct HTABLE_NAME *table, void (*destructor)(VALUE_TYPE *))
+{
+	if (WARN(!table, "The table is NULL."))
+		return;
+
+	EMPTY(table, destructor);
+	kfree(table->table);
+	table->table = NULL;
+	table->slots = 0;
 }
 
 #ifdef GENERATE_PRINT
@@ -306,7 +771,7 @@ static void PRINT(struct HTABLE_NAME *table, char *header)
 	 * hash codes will appear sorted, so they're easier to read.
 	 * This code is for debugging purposes anyway, so it doesn't matter if it's slow.
 	 */
-	for (row = 0; row < HASH_TABLE_SIZE; row++) {
+	for (row = 0; row < table->slots; row++) {
 		hlist_for_each(current_node, &table->table[row]) {
 			current_pair = hlist_entry(current_node, struct KEY_VALUE_PAIR, hlist_hook);
 			log_debug("  hash:%u", row);
@@ -348,6 +813,8 @@ static int FOR_EACH(struct HTABLE_NAME *table, int (*func)(VALUE_TYPE *, void *)
 }
 #endif
 
+#endif /* HTABLE_OPEN_ADDRESSING */
+
 /*
  * Compiler cleanup. The macros are freed, just so you can define another kind
  * of hash table in the same file without compiler warnings.
@@ -355,6 +822,8 @@ static int FOR_EACH(struct HTABLE_NAME *table, int (*func)(VALUE_TYPE *, void *)
 #undef HTABLE_NAME
 #undef KEY_TYPE
 #undef VALUE_TYPE
-#undef HASH_TABLE_SIZE
+#undef HASH_TABLE_MIN_SIZE
+#undef HASH_TABLE_MAX_SIZE
 #undef GENERATE_PRINT
 #undef GENERATE_FOR_EACH
+#undef HTABLE_OPEN_ADDRESSING
@@ -2,9 +2,61 @@
 #include "nat64/mod/types.h"
 
 #include <linux/version.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/interrupt.h>
 #include <net/icmp.h>
 #include <linux/icmpv6.h>
 
+/** Maximum number of errors waiting to be sent, per CPU. */
+#define ICMP_QUEUE_MAX 256
+/** Number of destinations whose error rate is tracked at the same time, per CPU. */
+#define ICMP_BUCKETS 64
+
+/**
+ * Token bucket limiting the errors sent to one address.
+ * Every error takes a token; the bucket regains "rate" tokens per second, up to "burst".
+ */
+struct icmp_bucket {
+	/** The address the errors are sent to (ie. the offending packets' source). */
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+	} dst;
+	/** l3_protocol of "dst". */
+	__u8 l3_proto;
+	/** Whether "dst" and "l3_proto" mean anything yet. (L3PROTO_IPV6 is zero.) */
+	bool used;
+	unsigned int tokens;
+	/** Jiffy the bucket was last refilled. */
+	unsigned long stamp;
+};
+
+struct icmp_limiter {
+	/** Destinations are hashed into these; colliding ones take over the slot. */
+	struct icmp_bucket buckets[ICMP_BUCKETS];
+	/** Copies of the offending packets, waiting for "tasklet" to send their errors. */
+	struct sk_buff_head queue;
+	struct tasklet_struct tasklet;
+};
+
+/** What has to be sent for the packet; stored in its copy's control buffer while it's queued. */
+struct icmp_job {
+	icmp_error_code error;
+	__u32 info;
+};
+
+/** Errors allowed per second and destination. Zero means unlimited. */
+static unsigned int rate;
+/** Errors a destination which has been quiet for a while is allowed to receive in a row. */
+static unsigned int burst;
+static struct icmp_limiter __percpu *limiters;
+static u32 hash_rnd;
+
+/** See struct icmp_stats. */
+static atomic64_t errors_sent = ATOMIC64_INIT(0);
+static atomic64_t errors_suppressed = ATOMIC64_INIT(0);
+
 static char *icmp_error_to_string(icmp_error_code error) {
 	switch (error) {
 	case ICMPERR_SILENT:
@@ -127,16 +179,11 @@ static void icmp6_send(struct sk_buff *skb, icmp_error_code error, __u32 info)
 #endif
 }
 
-void icmp64_send(struct sk_buff *skb, icmp_error_code error, __u32 info)
+static void icmp64_send_now(struct sk_buff *skb, icmp_error_code error, __u32 info)
 {
 	struct sk_buff *prev, *next;
 	struct jool_cb cb;
 
-	skb = skb_original_skb(skb);
-
-	if (!skb || !skb->dev)
-		return;
-
 	/* We're going to use kernel functions, so let's clean our garbage first. */
 	prev = skb->prev;
 	next = skb->next;
@@ -159,3 +206,189 @@ void icmp64_send(struct sk_buff *skb, icmp_error_code error, __u32 info)
 	skb->next = next;
 	memcpy(&skb->cb, &cb, sizeof(cb));
 }
+
+/**
+ * Takes a token from "bucket", after giving it back the ones it earned since its last refill.
+ * Returns false if there was none left.
+ */
+static bool bucket_take(struct icmp_bucket *bucket, unsigned long now)
+{
+	unsigned long elapsed = now - bucket->stamp;
+	unsigned long refill;
+
+	/* A second's worth is enough to refill most buckets, and prevents overflows. */
+	if (elapsed > HZ)
+		elapsed = HZ;
+	refill = elapsed * rate / HZ;
+	if (refill) {
+		bucket->tokens = min_t(unsigned long, bucket->tokens + refill, burst);
+		bucket->stamp = now;
+	}
+
+	if (!bucket->tokens)
+		return false;
+
+	bucket->tokens--;
+	return true;
+}
+
+/**
+ * Returns the bucket of the node "skb"'s error would be sent to.
+ * If somebody else was using the slot, it becomes that node's (and starts full).
+ */
+static struct icmp_bucket *get_bucket(struct icmp_limiter *limiter, struct sk_buff *skb,
+		unsigned long now)
+{
+	struct icmp_bucket *bucket;
+	u32 hash;
+
+	switch (ntohs(skb->protocol)) {
+	case ETH_P_IP:
+		hash = jhash_1word((__force u32) ip_hdr(skb)->saddr, hash_rnd);
+		bucket = &limiter->buckets[hash % ICMP_BUCKETS];
+		if (bucket->used && bucket->l3_proto == L3PROTO_IPV4
+				&& bucket->dst.v4.s_addr == ip_hdr(skb)->saddr)
+			return bucket;
+		bucket->l3_proto = L3PROTO_IPV4;
+		bucket->dst.v4.s_addr = ip_hdr(skb)->saddr;
+		break;
+	case ETH_P_IPV6:
+		hash = jhash(&ipv6_hdr(skb)->saddr, sizeof(struct in6_addr), hash_rnd);
+		bucket = &limiter->buckets[hash % ICMP_BUCKETS];
+		if (bucket->used && bucket->l3_proto == L3PROTO_IPV6
+				&& ipv6_addr_equal(&bucket->dst.v6, &ipv6_hdr(skb)->saddr))
+			return bucket;
+		bucket->l3_proto = L3PROTO_IPV6;
+		bucket->dst.v6 = ipv6_hdr(skb)->saddr;
+		break;
+	default:
+		return NULL;
+	}
+
+	bucket->used = true;
+	bucket->tokens = burst;
+	bucket->stamp = now;
+	return bucket;
+}
+
+/**
+ * Sends the errors icmp64_send() queued in "data"'s limiter.
+ */
+static void icmp64_flush(unsigned long data)
+{
+	struct icmp_limiter *limiter = (struct icmp_limiter *) data;
+	struct sk_buff *skb;
+	struct net_device *dev;
+	struct icmp_job job;
+
+	while ((skb = skb_dequeue(&limiter->queue)) != NULL) {
+		memcpy(&job, skb->cb, sizeof(job));
+		skb_clear_cb(skb);
+		dev = skb->dev;
+
+		icmp64_send_now(skb, job.error, job.info);
+		atomic64_inc(&errors_sent);
+
+		dev_put(dev);
+		kfree_skb(skb);
+	}
+}
+
+void icmp64_send(struct sk_buff *skb, icmp_error_code error, __u32 info)
+{
+	struct icmp_limiter *limiter;
+	struct icmp_bucket *bucket;
+	struct sk_buff *copy;
+	struct icmp_job *job;
+
+	skb = skb_original_skb(skb);
+
+	if (!skb || !skb->dev || error == ICMPERR_SILENT)
+		return;
+
+	/*
+	 * Sending an error is a lot more work than most translations, so they're rationed per
+	 * destination and left for later, when the packets that can actually be translated are done.
+	 * The offending packet is copied because it will likely be translated or released by then.
+	 * Like the kernel's own limiter, Packet Too Bigs are exempt from the rate; Path MTU
+	 * Discovery breaks if they are suppressed.
+	 */
+	local_bh_disable();
+	limiter = this_cpu_ptr(limiters);
+
+	if (rate && error != ICMPERR_FRAG_NEEDED) {
+		bucket = get_bucket(limiter, skb, jiffies);
+		if (bucket && !bucket_take(bucket, jiffies))
+			goto suppress;
+	}
+	if (skb_queue_len(&limiter->queue) >= ICMP_QUEUE_MAX)
+		goto suppress;
+
+	copy = pskb_copy(skb, GFP_ATOMIC);
+	if (!copy)
+		goto suppress;
+
+	job = (struct icmp_job *) copy->cb;
+	job->error = error;
+	job->info = info;
+	dev_hold(copy->dev);
+	skb_queue_tail(&limiter->queue, copy);
+	tasklet_schedule(&limiter->tasklet);
+
+	local_bh_enable();
+	return;
+
+suppress:
+	local_bh_enable();
+	log_debug("Suppressing %s.", icmp_error_to_string(error));
+	atomic64_inc(&errors_suppressed);
+}
+
+int icmp64_init(unsigned int error_rate, unsigned int error_burst)
+{
+	struct icmp_limiter *limiter;
+	int cpu;
+
+	BUILD_BUG_ON(sizeof(struct icmp_job) > sizeof(((struct sk_buff *) 0)->cb));
+
+	rate = error_rate;
+	burst = error_burst ? : 1;
+	get_random_bytes(&hash_rnd, sizeof(hash_rnd));
+
+	limiters = alloc_percpu(struct icmp_limiter);
+	if (!limiters)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		limiter = per_cpu_ptr(limiters, cpu);
+		memset(limiter->buckets, 0, sizeof(limiter->buckets));
+		skb_queue_head_init(&limiter->queue);
+		tasklet_init(&limiter->tasklet, icmp64_flush, (unsigned long) limiter);
+	}
+
+	return 0;
+}
+
+void icmp64_destroy(void)
+{
+	struct icmp_limiter *limiter;
+	struct sk_buff *skb;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		limiter = per_cpu_ptr(limiters, cpu);
+		tasklet_kill(&limiter->tasklet);
+		while ((skb = skb_dequeue(&limiter->queue)) != NULL) {
+			dev_put(skb->dev);
+			kfree_skb(skb);
+		}
+	}
+
+	free_percpu(limiters);
+}
+
+void icmp64_get_stats(struct icmp_stats *result)
+{
+	result->errors_sent = atomic64_read(&errors_sent);
+	result->errors_suppressed = atomic64_read(&errors_suppressed);
+}
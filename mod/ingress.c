@@ -0,0 +1,224 @@
+#include "nat64/mod/ingress.h"
+#include "nat64/mod/core.h"
+#include "nat64/mod/namespace.h"
+#include "nat64/mod/packet.h"
+#include "nat64/mod/types.h"
+
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/rtnetlink.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+
+
+/** Maximum number of interfaces that can be captured. */
+#define INGRESS_MAX 8
+
+/** The captured interfaces; a reference is held to each. Protected by the RTNL. */
+static struct net_device *devs[INGRESS_MAX];
+/** Whether ingress_nb is listening; ie. whether there's anything to undo. */
+static bool notifier_registered;
+
+/**
+ * Does the bare minimum ip_rcv() would have done before the pre-routing hook, so the core finds
+ * "skb" the way it's used to. Everything else is validated by the core itself.
+ * Returns false if "skb" should be left to the kernel.
+ */
+static bool prepare4(struct sk_buff *skb)
+{
+	struct iphdr *hdr;
+	unsigned int len;
+
+	if (!pskb_may_pull(skb, sizeof(*hdr)))
+		return false;
+	hdr = ip_hdr(skb);
+	if (hdr->version != 4 || hdr->ihl < 5 || !pskb_may_pull(skb, 4 * hdr->ihl))
+		return false;
+
+	hdr = ip_hdr(skb);
+	len = be16_to_cpu(hdr->tot_len);
+	if (!len && skb_is_big_tcp(skb, 0))
+		len = skb->len;
+	if (skb->len < len || len < 4 * hdr->ihl)
+		return false;
+	/* Drop the link layer's padding. */
+	if (pskb_trim_rcsum(skb, len))
+		return false;
+
+	skb_set_transport_header(skb, 4 * hdr->ihl);
+	return true;
+}
+
+/**
+ * prepare4()'s IPv6 counterpart; mirrors ipv6_rcv().
+ */
+static bool prepare6(struct sk_buff *skb)
+{
+	struct ipv6hdr *hdr;
+	unsigned int len;
+
+	if (!pskb_may_pull(skb, sizeof(*hdr)))
+		return false;
+	hdr = ipv6_hdr(skb);
+	if (hdr->version != 6)
+		return false;
+
+	len = be16_to_cpu(hdr->payload_len);
+	if (len) {
+		len += sizeof(*hdr);
+	} else if (skb_is_big_tcp(skb, sizeof(*hdr))) {
+		len = skb->len;
+	} else {
+		/* Actual jumbogram (hop-by-hop jumbo option); Jool doesn't translate those. */
+		return false;
+	}
+	if (skb->len < len || pskb_trim_rcsum(skb, len))
+		return false;
+
+	skb_set_transport_header(skb, sizeof(*hdr));
+	return true;
+}
+
+static rx_handler_result_t ingress_rx(struct sk_buff **pskb)
+{
+	struct sk_buff *skb = *pskb;
+	unsigned int result;
+
+	if (skb->pkt_type == PACKET_OTHERHOST || skb->pkt_type == PACKET_LOOPBACK)
+		return RX_HANDLER_PASS;
+
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (!skb)
+		return RX_HANDLER_CONSUMED;
+	*pskb = skb;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (!prepare4(skb))
+			return RX_HANDLER_PASS;
+		result = core_4to6(skb);
+		break;
+	case htons(ETH_P_IPV6):
+		if (!prepare6(skb))
+			return RX_HANDLER_PASS;
+		result = core_6to4(skb);
+		break;
+	default:
+		return RX_HANDLER_PASS;
+	}
+
+	switch (result) {
+	case NF_STOLEN:
+		return RX_HANDLER_CONSUMED;
+	case NF_DROP:
+		kfree_skb(skb);
+		return RX_HANDLER_CONSUMED;
+	}
+
+	return RX_HANDLER_PASS;
+}
+
+/**
+ * Stops capturing devs[i]. The RTNL must be held.
+ */
+static void release(unsigned int i)
+{
+	netdev_rx_handler_unregister(devs[i]);
+	dev_put(devs[i]);
+	devs[i] = NULL;
+}
+
+/**
+ * Lets go of the captured interfaces that are going away, so they can.
+ */
+static int ingress_notify(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+#else
+	struct net_device *dev = ptr;
+#endif
+	unsigned int i;
+
+	if (event != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+
+	for (i = 0; i < INGRESS_MAX; i++) {
+		if (devs[i] == dev) {
+			log_info("Interface %s is going away; no longer capturing it.", dev->name);
+			release(i);
+		}
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block ingress_nb = {
+	.notifier_call = ingress_notify,
+};
+
+int ingress_init(char *names[], int count)
+{
+	struct net_device *dev;
+	int i;
+	int error;
+
+	if (!count)
+		return 0;
+	if (count > INGRESS_MAX) {
+		log_err("Only %u interfaces can be captured.", INGRESS_MAX);
+		return -EINVAL;
+	}
+
+	/* First, so no interface can vanish while it's captured. This takes the RTNL itself. */
+	error = register_netdevice_notifier(&ingress_nb);
+	if (error)
+		return error;
+	notifier_registered = true;
+
+	rtnl_lock();
+	for (i = 0; i < count; i++) {
+		dev = __dev_get_by_name(joolns_get(), names[i]);
+		if (!dev) {
+			log_err("Interface '%s' does not exist.", names[i]);
+			error = -ENODEV;
+			goto fail;
+		}
+
+		error = netdev_rx_handler_register(dev, ingress_rx, NULL);
+		if (error) {
+			log_err("Interface '%s' is already claimed by someone else (error %d).",
+					names[i], error);
+			goto fail;
+		}
+
+		dev_hold(dev);
+		devs[i] = dev;
+		log_info("Capturing the packets received by %s.", dev->name);
+	}
+	rtnl_unlock();
+	return 0;
+
+fail:
+	rtnl_unlock();
+	ingress_destroy();
+	return error;
+}
+
+void ingress_destroy(void)
+{
+	unsigned int i;
+
+	if (!notifier_registered)
+		return;
+
+	rtnl_lock();
+	for (i = 0; i < INGRESS_MAX; i++)
+		if (devs[i])
+			release(i);
+	rtnl_unlock();
+
+	unregister_netdevice_notifier(&ingress_nb);
+	notifier_registered = false;
+}
@@ -0,0 +1,673 @@
+#include "nat64/mod/ipfix.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/mod/namespace.h"
+
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/net.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/socket.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <net/sock.h>
+
+#define IPFIX_VERSION 10
+/** Set ID of template sets. */
+#define SET_TEMPLATES 2
+/** How often the templates are sent again. */
+#define TEMPLATE_REFRESH (60 * HZ)
+/** Full datagrams allowed to wait for the work item; records are dropped past this. */
+#define MAX_READY 64
+
+/** Template (and therefore data set) IDs. */
+enum template_id {
+	TEMPLATE_SESSION = 256,
+	TEMPLATE_BIB,
+	TEMPLATE_EXHAUSTED,
+};
+
+/** Values of the natEvent information element (RFC 8158 section 4.1). */
+enum nat_event {
+	NAT_EVENT_ADDRESSES_EXHAUSTED = 3,
+	NAT_EVENT_SESSION64_CREATE = 6,
+	NAT_EVENT_SESSION64_DELETE = 7,
+	NAT_EVENT_BIB64_CREATE = 10,
+	NAT_EVENT_BIB64_DELETE = 11,
+};
+
+/** Information element IDs, from IANA's IPFIX registry. */
+enum ie_id {
+	IE_PROTOCOL = 4,
+	IE_SRC_PORT = 7,
+	IE_DST_PORT = 11,
+	IE_SRC_ADDR6 = 27,
+	IE_DST_ADDR6 = 28,
+	IE_OCTET_TOTAL = 85,
+	IE_PACKET_TOTAL = 86,
+	IE_POST_NAT_SRC_ADDR4 = 225,
+	IE_POST_NAT_DST_ADDR4 = 226,
+	IE_POST_NAPT_SRC_PORT = 227,
+	IE_POST_NAPT_DST_PORT = 228,
+	IE_NAT_EVENT = 230,
+	IE_TIME_MS = 323,
+};
+
+struct ipfix_hdr {
+	__be16 version;
+	__be16 length;
+	__be32 export_time;
+	__be32 sequence;
+	__be32 domain;
+} __packed;
+
+struct set_hdr {
+	__be16 id;
+	__be16 length;
+} __packed;
+
+/*
+ * The data records. Their layouts have to match the templates below, field by field.
+ * "src" is the IPv6 node's side; "dst" is the IPv4 node's.
+ */
+
+struct session_record {
+	__be64 time;
+	__u8 event;
+	__u8 proto;
+	struct in6_addr src6;
+	__be16 src_port6;
+	struct in6_addr dst6;
+	__be16 dst_port6;
+	struct in_addr src4;
+	__be16 src_port4;
+	struct in_addr dst4;
+	__be16 dst_port4;
+	/** Zero unless the session counters are enabled; always zero in creation events. */
+	__be64 packets;
+	__be64 bytes;
+} __packed;
+
+struct bib_record {
+	__be64 time;
+	__u8 event;
+	__u8 proto;
+	struct in6_addr src6;
+	__be16 src_port6;
+	struct in_addr src4;
+	__be16 src_port4;
+} __packed;
+
+struct exhausted_record {
+	__be64 time;
+	__u8 event;
+	__u8 proto;
+} __packed;
+
+struct template_field {
+	__u16 id;
+	__u16 len;
+};
+
+static const struct template_field session_fields[] = {
+	{ IE_TIME_MS, 8 },
+	{ IE_NAT_EVENT, 1 },
+	{ IE_PROTOCOL, 1 },
+	{ IE_SRC_ADDR6, 16 },
+	{ IE_SRC_PORT, 2 },
+	{ IE_DST_ADDR6, 16 },
+	{ IE_DST_PORT, 2 },
+	{ IE_POST_NAT_SRC_ADDR4, 4 },
+	{ IE_POST_NAPT_SRC_PORT, 2 },
+	{ IE_POST_NAT_DST_ADDR4, 4 },
+	{ IE_POST_NAPT_DST_PORT, 2 },
+	{ IE_PACKET_TOTAL, 8 },
+	{ IE_OCTET_TOTAL, 8 },
+};
+
+static const struct template_field bib_fields[] = {
+	{ IE_TIME_MS, 8 },
+	{ IE_NAT_EVENT, 1 },
+	{ IE_PROTOCOL, 1 },
+	{ IE_SRC_ADDR6, 16 },
+	{ IE_SRC_PORT, 2 },
+	{ IE_POST_NAT_SRC_ADDR4, 4 },
+	{ IE_POST_NAPT_SRC_PORT, 2 },
+};
+
+static const struct template_field exhausted_fields[] = {
+	{ IE_TIME_MS, 8 },
+	{ IE_NAT_EVENT, 1 },
+	{ IE_PROTOCOL, 1 },
+};
+
+/** Length of the template set; 4 bytes per template header and per field, plus the set header. */
+#define TEMPLATES_LEN (sizeof(struct set_hdr) + 4 * (3 + ARRAY_SIZE(session_fields) \
+		+ ARRAY_SIZE(bib_fields) + ARRAY_SIZE(exhausted_fields)))
+
+/** A datagram's sets (everything but the IPFIX header), either under construction or ready. */
+struct ipfix_msg {
+	struct list_head list_hook;
+	/** Bytes of "data" in use. */
+	unsigned int len;
+	/** Number of data records in "data". */
+	unsigned int records;
+	/** Offset, within "data", of the set new records are appended to. */
+	unsigned int set_offset;
+	__u8 data[];
+};
+
+struct ipfix_cpu {
+	spinlock_t lock;
+	/** The datagram this CPU is filling. NULL if the last allocation failed. */
+	struct ipfix_msg *msg;
+};
+
+/** NULL if the exporter is disabled. Only the work items touch it once it's set. */
+static struct socket *sock;
+static struct ipfix_cpu __percpu *cpus;
+/** Maximum length of ipfix_msg.data. */
+static unsigned int capacity;
+static unsigned long interval;
+static u32 domain_id;
+
+/** Full datagrams waiting to be sent. Protected by "ready_lock". */
+static LIST_HEAD(ready);
+static unsigned int ready_count;
+static DEFINE_SPINLOCK(ready_lock);
+
+/** Sends the full datagrams. */
+static struct work_struct flush_work;
+/** Sends the partial datagrams every "interval". */
+static struct delayed_work tick_work;
+/** Serializes the work items, which share the socket and the following. */
+static DEFINE_MUTEX(send_mutex);
+/** Data records sent so far; it's the IPFIX header's sequence number. */
+static u32 sequence;
+/** Jiffy the templates were last sent at. */
+static unsigned long templates_time;
+static bool templates_sent;
+
+/** See struct dbevent_stats. */
+static atomic64_t records_sent = ATOMIC64_INIT(0);
+static atomic64_t records_dropped = ATOMIC64_INIT(0);
+
+static struct ipfix_msg *alloc_msg(gfp_t flags)
+{
+	struct ipfix_msg *msg;
+
+	msg = kmalloc(sizeof(*msg) + capacity, flags);
+	if (msg) {
+		msg->len = 0;
+		msg->records = 0;
+		msg->set_offset = 0;
+	}
+
+	return msg;
+}
+
+static int transmit(void *data, unsigned int len)
+{
+	struct ipfix_hdr hdr;
+	struct kvec iov[2];
+	struct msghdr msg;
+
+	hdr.version = cpu_to_be16(IPFIX_VERSION);
+	hdr.length = cpu_to_be16(sizeof(hdr) + len);
+	hdr.export_time = cpu_to_be32(get_seconds());
+	hdr.sequence = cpu_to_be32(sequence);
+	hdr.domain = cpu_to_be32(domain_id);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_flags = MSG_DONTWAIT;
+
+	return kernel_sendmsg(sock, &msg, iov, ARRAY_SIZE(iov), sizeof(hdr) + len);
+}
+
+static __be16 *put_template(__be16 *cursor, enum template_id id,
+		const struct template_field *fields, unsigned int count)
+{
+	unsigned int i;
+
+	*(cursor++) = cpu_to_be16(id);
+	*(cursor++) = cpu_to_be16(count);
+	for (i = 0; i < count; i++) {
+		*(cursor++) = cpu_to_be16(fields[i].id);
+		*(cursor++) = cpu_to_be16(fields[i].len);
+	}
+
+	return cursor;
+}
+
+static void send_templates(void)
+{
+	__be16 buffer[TEMPLATES_LEN / 2];
+	__be16 *cursor = buffer;
+	int error;
+
+	*(cursor++) = cpu_to_be16(SET_TEMPLATES);
+	*(cursor++) = cpu_to_be16(TEMPLATES_LEN);
+	cursor = put_template(cursor, TEMPLATE_SESSION, session_fields,
+			ARRAY_SIZE(session_fields));
+	cursor = put_template(cursor, TEMPLATE_BIB, bib_fields, ARRAY_SIZE(bib_fields));
+	cursor = put_template(cursor, TEMPLATE_EXHAUSTED, exhausted_fields,
+			ARRAY_SIZE(exhausted_fields));
+
+	error = transmit(buffer, sizeof(buffer));
+	if (error < 0) {
+		log_debug("Could not send the IPFIX templates (error code %d).", error);
+		return;
+	}
+
+	templates_time = jiffies;
+	templates_sent = true;
+}
+
+/**
+ * Sends the datagrams on the "ready" list. Called by the work items, with "send_mutex" held.
+ */
+static void flush_ready(void)
+{
+	LIST_HEAD(list);
+	struct ipfix_msg *msg, *tmp;
+	int error;
+
+	if (!templates_sent || time_after(jiffies, templates_time + TEMPLATE_REFRESH))
+		send_templates();
+
+	spin_lock_bh(&ready_lock);
+	list_splice_init(&ready, &list);
+	ready_count = 0;
+	spin_unlock_bh(&ready_lock);
+
+	list_for_each_entry_safe(msg, tmp, &list, list_hook) {
+		list_del(&msg->list_hook);
+		error = transmit(msg->data, msg->len);
+		if (error < 0) {
+			log_debug("Could not send an IPFIX message (error code %d).", error);
+			atomic64_add(msg->records, &records_dropped);
+		} else {
+			atomic64_add(msg->records, &records_sent);
+		}
+		/* Lost records count too; that's how the collector notices them. */
+		sequence += msg->records;
+		kfree(msg);
+	}
+}
+
+static void flush_full(struct work_struct *work)
+{
+	mutex_lock(&send_mutex);
+	flush_ready();
+	mutex_unlock(&send_mutex);
+}
+
+/**
+ * Queues "msg" for sending. Returns the datagram the CPU should continue with.
+ * Requires the CPU's lock.
+ */
+static struct ipfix_msg *retire(struct ipfix_msg *msg)
+{
+	spin_lock(&ready_lock);
+	if (ready_count >= MAX_READY) {
+		/* The work item is not keeping up; start over on the same memory. */
+		spin_unlock(&ready_lock);
+		atomic64_add(msg->records, &records_dropped);
+		msg->len = 0;
+		msg->records = 0;
+		msg->set_offset = 0;
+		return msg;
+	}
+	list_add_tail(&msg->list_hook, &ready);
+	ready_count++;
+	spin_unlock(&ready_lock);
+
+	schedule_work(&flush_work);
+	return alloc_msg(GFP_ATOMIC);
+}
+
+/**
+ * Hands every CPU's partial datagram to flush_ready(), and gives the CPUs whose allocation failed
+ * a new one.
+ */
+static void collect(void)
+{
+	struct ipfix_cpu *cpu;
+	struct ipfix_msg *fresh = NULL;
+	struct ipfix_msg *old;
+	int i;
+
+	for_each_possible_cpu(i) {
+		if (!fresh)
+			fresh = alloc_msg(GFP_KERNEL);
+		if (!fresh)
+			return;
+
+		cpu = per_cpu_ptr(cpus, i);
+		spin_lock_bh(&cpu->lock);
+		old = cpu->msg;
+		if (!old || old->records) {
+			cpu->msg = fresh;
+			fresh = NULL;
+		}
+		spin_unlock_bh(&cpu->lock);
+
+		if (old && old->records) {
+			spin_lock_bh(&ready_lock);
+			list_add_tail(&old->list_hook, &ready);
+			ready_count++;
+			spin_unlock_bh(&ready_lock);
+		}
+	}
+
+	kfree(fresh);
+}
+
+static void tick(struct work_struct *work)
+{
+	mutex_lock(&send_mutex);
+	collect();
+	flush_ready();
+	mutex_unlock(&send_mutex);
+
+	schedule_delayed_work(&tick_work, interval);
+}
+
+/**
+ * Appends the "size"-byte "record" to the current CPU's datagram, in a "set_id" set.
+ */
+static void append(enum template_id set_id, void *record, unsigned int size)
+{
+	struct ipfix_cpu *cpu;
+	struct ipfix_msg *msg;
+	struct set_hdr *set;
+	bool new_set;
+
+	local_bh_disable();
+	cpu = this_cpu_ptr(cpus);
+	spin_lock(&cpu->lock);
+
+	msg = cpu->msg;
+	if (!msg)
+		goto drop;
+
+	set = (struct set_hdr *) (msg->data + msg->set_offset);
+	new_set = !msg->len || set->id != cpu_to_be16(set_id);
+	if (msg->len + (new_set ? sizeof(*set) : 0) + size > capacity) {
+		msg = retire(msg);
+		cpu->msg = msg;
+		if (!msg)
+			goto drop;
+		new_set = true;
+	}
+
+	if (new_set) {
+		msg->set_offset = msg->len;
+		set = (struct set_hdr *) (msg->data + msg->set_offset);
+		set->id = cpu_to_be16(set_id);
+		set->length = cpu_to_be16(sizeof(*set));
+		msg->len += sizeof(*set);
+	}
+
+	memcpy(msg->data + msg->len, record, size);
+	msg->len += size;
+	be16_add_cpu(&set->length, size);
+	msg->records++;
+
+	spin_unlock(&cpu->lock);
+	local_bh_enable();
+	return;
+
+drop:
+	spin_unlock(&cpu->lock);
+	local_bh_enable();
+	atomic64_inc(&records_dropped);
+}
+
+static __be64 now(void)
+{
+	return cpu_to_be64(div_u64(ktime_to_ns(ktime_get_real()), NSEC_PER_MSEC));
+}
+
+static __u8 to_iana_proto(l4_protocol proto)
+{
+	switch (proto) {
+	case L4PROTO_TCP:
+		return IPPROTO_TCP;
+	case L4PROTO_UDP:
+		return IPPROTO_UDP;
+	case L4PROTO_ICMP:
+		return IPPROTO_ICMP;
+	}
+
+	return 0;
+}
+
+static void write_session(struct dbevent_usr *event, enum nat_event nat_event)
+{
+	struct session_record record;
+
+	record.time = now();
+	record.event = nat_event;
+	record.proto = to_iana_proto(event->l4_proto);
+	record.src6 = event->remote6.l3;
+	record.src_port6 = cpu_to_be16(event->remote6.l4);
+	record.dst6 = event->local6.l3;
+	record.dst_port6 = cpu_to_be16(event->local6.l4);
+	record.src4 = event->local4.l3;
+	record.src_port4 = cpu_to_be16(event->local4.l4);
+	record.dst4 = event->remote4.l3;
+	record.dst_port4 = cpu_to_be16(event->remote4.l4);
+	record.packets = cpu_to_be64(event->packets);
+	record.bytes = cpu_to_be64(event->bytes);
+
+	append(TEMPLATE_SESSION, &record, sizeof(record));
+}
+
+static void write_bib(struct dbevent_usr *event, enum nat_event nat_event)
+{
+	struct bib_record record;
+
+	record.time = now();
+	record.event = nat_event;
+	record.proto = to_iana_proto(event->l4_proto);
+	record.src6 = event->remote6.l3;
+	record.src_port6 = cpu_to_be16(event->remote6.l4);
+	record.src4 = event->local4.l3;
+	record.src_port4 = cpu_to_be16(event->local4.l4);
+
+	append(TEMPLATE_BIB, &record, sizeof(record));
+}
+
+static int create_socket(char *collector, unsigned int port)
+{
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr4;
+	struct sockaddr *addr;
+	int addr_len;
+	int error;
+
+	memset(&addr4, 0, sizeof(addr4));
+	memset(&addr6, 0, sizeof(addr6));
+
+	if (!str_to_addr4(collector, &addr4.sin_addr)) {
+		addr4.sin_family = AF_INET;
+		addr4.sin_port = cpu_to_be16(port);
+		addr = (struct sockaddr *) &addr4;
+		addr_len = sizeof(addr4);
+	} else if (!str_to_addr6(collector, &addr6.sin6_addr)) {
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_port = cpu_to_be16(port);
+		addr = (struct sockaddr *) &addr6;
+		addr_len = sizeof(addr6);
+	} else {
+		log_err("'%s' is not a valid IPFIX collector address.", collector);
+		return -EINVAL;
+	}
+
+	error = __sock_create(joolns_get(), addr->sa_family, SOCK_DGRAM, IPPROTO_UDP, &sock, 1);
+	if (error) {
+		log_err("Could not create the IPFIX socket (error code %d).", error);
+		sock = NULL;
+		return error;
+	}
+
+	error = kernel_connect(sock, addr, addr_len, 0);
+	if (error) {
+		log_err("Could not connect the IPFIX socket to %s (error code %d).", collector,
+				error);
+		sock_release(sock);
+		sock = NULL;
+		return error;
+	}
+
+	return 0;
+}
+
+static void free_cpus(void)
+{
+	int i;
+
+	for_each_possible_cpu(i)
+		kfree(per_cpu_ptr(cpus, i)->msg);
+	free_percpu(cpus);
+	cpus = NULL;
+}
+
+int ipfix_init(char *collector, unsigned int port, unsigned int size, unsigned int interval_ms,
+		unsigned int domain)
+{
+	struct ipfix_cpu *cpu;
+	int i;
+	int error;
+
+	if (!collector)
+		return 0;
+
+	if (size > 0xFFFF || size < sizeof(struct ipfix_hdr) + TEMPLATES_LEN
+			|| size < sizeof(struct ipfix_hdr) + sizeof(struct set_hdr)
+					+ sizeof(struct session_record)) {
+		log_err("IPFIX datagrams have to be %zu to 65535 bytes long.",
+				sizeof(struct ipfix_hdr) + TEMPLATES_LEN);
+		return -EINVAL;
+	}
+	if (!interval_ms) {
+		log_err("The IPFIX export interval cannot be zero.");
+		return -EINVAL;
+	}
+
+	capacity = size - sizeof(struct ipfix_hdr);
+	interval = msecs_to_jiffies(interval_ms);
+	domain_id = domain;
+	sequence = 0;
+	templates_sent = false;
+
+	cpus = alloc_percpu(struct ipfix_cpu);
+	if (!cpus)
+		return -ENOMEM;
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cpus, i);
+		spin_lock_init(&cpu->lock);
+		cpu->msg = alloc_msg(GFP_KERNEL);
+		if (!cpu->msg) {
+			free_cpus();
+			return -ENOMEM;
+		}
+	}
+
+	error = create_socket(collector, port);
+	if (error) {
+		free_cpus();
+		return error;
+	}
+
+	INIT_WORK(&flush_work, flush_full);
+	INIT_DELAYED_WORK(&tick_work, tick);
+	schedule_delayed_work(&tick_work, interval);
+	return 0;
+}
+
+void ipfix_destroy(void)
+{
+	struct ipfix_msg *msg, *tmp;
+
+	if (!sock)
+		return;
+
+	cancel_delayed_work_sync(&tick_work);
+	cancel_work_sync(&flush_work);
+
+	/* Whatever the databases said on their way out. */
+	mutex_lock(&send_mutex);
+	collect();
+	flush_ready();
+	mutex_unlock(&send_mutex);
+
+	/* collect() gives up if it runs out of memory. */
+	list_for_each_entry_safe(msg, tmp, &ready, list_hook) {
+		list_del(&msg->list_hook);
+		kfree(msg);
+	}
+	ready_count = 0;
+
+	sock_release(sock);
+	sock = NULL;
+	free_cpus();
+}
+
+bool ipfix_is_enabled(void)
+{
+	return sock != NULL;
+}
+
+void ipfix_write(struct dbevent_usr *event)
+{
+	if (!sock)
+		return;
+
+	switch (event->type) {
+	case DBEVENT_BIB_ADD:
+		write_bib(event, NAT_EVENT_BIB64_CREATE);
+		break;
+	case DBEVENT_BIB_REMOVE:
+		write_bib(event, NAT_EVENT_BIB64_DELETE);
+		break;
+	case DBEVENT_SESSION_ADD:
+		write_session(event, NAT_EVENT_SESSION64_CREATE);
+		break;
+	case DBEVENT_SESSION_REMOVE:
+		write_session(event, NAT_EVENT_SESSION64_DELETE);
+		break;
+	case DBEVENT_SESSION_UPDATE:
+		break;
+	}
+}
+
+void ipfix_pool4_exhausted(l4_protocol proto)
+{
+	struct exhausted_record record;
+
+	if (!sock)
+		return;
+
+	record.time = now();
+	record.event = NAT_EVENT_ADDRESSES_EXHAUSTED;
+	record.proto = to_iana_proto(proto);
+
+	append(TEMPLATE_EXHAUSTED, &record, sizeof(record));
+}
+
+void ipfix_get_stats(struct dbevent_stats *result)
+{
+	result->ipfix_records_sent = atomic64_read(&records_sent);
+	result->ipfix_records_dropped = atomic64_read(&records_dropped);
+}
@@ -0,0 +1,51 @@
+#include "nat64/mod/keyed_hash.h"
+
+#include <linux/random.h>
+
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+void keyed_hash_init_key(struct keyed_hash_key *key)
+{
+	get_random_bytes(key, sizeof(*key));
+}
+
+u64 keyed_hash(const struct keyed_hash_key *key, const u64 *words, unsigned int count)
+{
+	/* "somepseudorandomlygeneratedbytes", as the paper puts it. */
+	u64 v0 = key->k0 ^ 0x736f6d6570736575ULL;
+	u64 v1 = key->k1 ^ 0x646f72616e646f6dULL;
+	u64 v2 = key->k0 ^ 0x6c7967656e657261ULL;
+	u64 v3 = key->k1 ^ 0x7465646279746573ULL;
+	/* The last block only holds the length, since the message never has leftover bytes. */
+	u64 last = ((u64) (count << 3)) << 56;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		v3 ^= words[i];
+		SIPROUND;
+		SIPROUND;
+		v0 ^= words[i];
+	}
+
+	v3 ^= last;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
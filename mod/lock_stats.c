@@ -0,0 +1,98 @@
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/types.h"
+
+#include <linux/percpu.h>
+#include <linux/sched.h>
+
+JOOL_KEY_DEFINE(lock_timing_key);
+
+struct lockstats_cpu {
+	struct lock_stats locks[JLOCK_COUNT];
+	/** When this CPU took the lock of each kind it is holding, in local_clock() time. */
+	u64 held_since[JLOCK_COUNT];
+};
+
+/** NULL while lock timing is disabled. */
+static struct lockstats_cpu __percpu *stats;
+
+void lockstats_lock(spinlock_t *lock, enum jool_lock id)
+{
+	struct lockstats_cpu *cpu_stats;
+	u64 start = 0;
+	bool contended;
+
+	contended = !spin_trylock(lock);
+	if (contended) {
+		start = local_clock();
+		spin_lock(lock);
+	}
+
+	/* Holding a spinlock; no preemption. */
+	cpu_stats = this_cpu_ptr(stats);
+	cpu_stats->held_since[id] = local_clock();
+	cpu_stats->locks[id].acquisitions++;
+	if (contended) {
+		cpu_stats->locks[id].contended++;
+		cpu_stats->locks[id].wait_nsecs += cpu_stats->held_since[id] - start;
+	}
+}
+
+void lockstats_unlock(spinlock_t *lock, enum jool_lock id)
+{
+	struct lockstats_cpu *cpu_stats = this_cpu_ptr(stats);
+	u64 held = local_clock() - cpu_stats->held_since[id];
+
+	cpu_stats->locks[id].hold_nsecs += held;
+	if (held > cpu_stats->locks[id].hold_max_nsecs)
+		cpu_stats->locks[id].hold_max_nsecs = held;
+
+	spin_unlock(lock);
+}
+
+int lockstats_init(bool enabled)
+{
+	if (!enabled)
+		return 0;
+
+	stats = alloc_percpu(struct lockstats_cpu);
+	if (!stats) {
+		log_err("Could not allocate the lock timing counters.");
+		return -ENOMEM;
+	}
+
+	jool_key_enable(lock_timing_key);
+	return 0;
+}
+
+void lockstats_destroy(void)
+{
+	if (!stats)
+		return;
+
+	jool_key_disable(lock_timing_key);
+	free_percpu(stats);
+	stats = NULL;
+}
+
+void lockstats_get(struct lock_stats *result)
+{
+	struct lock_stats *cpu_locks;
+	unsigned int id;
+	int cpu;
+
+	memset(result, 0, JLOCK_COUNT * sizeof(*result));
+	if (!stats)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		cpu_locks = per_cpu_ptr(stats, cpu)->locks;
+		for (id = 0; id < JLOCK_COUNT; id++) {
+			result[id].acquisitions += cpu_locks[id].acquisitions;
+			result[id].contended += cpu_locks[id].contended;
+			result[id].wait_nsecs += cpu_locks[id].wait_nsecs;
+			result[id].hold_nsecs += cpu_locks[id].hold_nsecs;
+			result[id].hold_max_nsecs = max(result[id].hold_max_nsecs,
+					cpu_locks[id].hold_max_nsecs);
+		}
+	}
+}
@@ -1,106 +1,85 @@
 #include "nat64/mod/log_time.h"
+#include "nat64/mod/stats.h"
 
-static struct log_time_db logs_ipv6_tcp;
-static struct log_time_db logs_ipv6_udp;
-static struct log_time_db logs_ipv6_icmp;
-static struct log_time_db logs_ipv4_tcp;
-static struct log_time_db logs_ipv4_udp;
-static struct log_time_db logs_ipv4_icmp;
+#include <linux/bitops.h>
+#include <linux/percpu.h>
 
-/** Cache for struct log_node, for efficient allocation. */
-static struct kmem_cache *entry_cache;
+/** One histogram per (L3 protocol, L4 protocol) pair. See logtime_get_index(). */
+#define LOGTIME_DBS 6
 
-#ifndef NSEC_PER_SEC
-#define NSEC_PER_SEC 1000000000L
-#endif
+struct log_time_db {
+	u64 counts[LOGTIME_BUCKETS];
+};
+
+JOOL_KEY_DEFINE(logtime_key);
 
 /**
- * Init the struct of log_node.
+ * Each CPU only writes its own histograms, so nothing needs to be locked.
+ * NULL until the module is enabled for the first time; disabling it keeps the counts around.
  */
-static int logtime_create_node(struct log_node **node)
+static struct log_time_db __percpu *dbs;
+/** What "dbs" costs, for the memory counters. */
+#define DBS_BYTES (num_possible_cpus() * LOGTIME_DBS * sizeof(struct log_time_db))
+/** Whether logtime_key is currently incremented. */
+static bool enabled;
+
+static int logtime_get_index(l3_protocol l3_proto, l4_protocol l4_proto)
 {
-	struct log_node *tmp_node;
+	int l4_index;
 
-	tmp_node = kmem_cache_alloc(entry_cache, GFP_ATOMIC);
-	if (!tmp_node) {
-		log_err("Allocation of IPv6 pool node failed.");
-		return -ENOMEM;
+	switch (l4_proto) {
+	case L4PROTO_TCP:
+		l4_index = 0;
+		break;
+	case L4PROTO_UDP:
+		l4_index = 1;
+		break;
+	case L4PROTO_ICMP:
+		l4_index = 2;
+		break;
+	default:
+		return -EINVAL;
 	}
 
-	INIT_LIST_HEAD(&tmp_node->list_hook);
-	*node = tmp_node;
-	return 0;
-}
-
-/**
- * An spinlock must be hold.
- */
-static void logtime_delete_node(struct log_node *node) {
-	list_del(&node->list_hook);
-	kmem_cache_free(entry_cache, node);
-}
-
-static void logtime_get_db(struct log_time_db **log_db, l3_protocol l3_proto, l4_protocol l4_proto)
-{
 	switch (l3_proto) {
 	case L3PROTO_IPV6:
-		switch (l4_proto) {
-		case L4PROTO_TCP:
-			*log_db = &logs_ipv6_tcp;
-			return;
-		case L4PROTO_UDP:
-			*log_db = &logs_ipv6_udp;
-			return;
-		case L4PROTO_ICMP:
-			*log_db = &logs_ipv6_icmp;
-			return;
-		}
-		break;
+		return l4_index;
 	case L3PROTO_IPV4:
-		switch (l4_proto) {
-		case L4PROTO_TCP:
-			*log_db = &logs_ipv4_tcp;
-			return;
-		case L4PROTO_UDP:
-			*log_db = &logs_ipv4_udp;
-			return;
-		case L4PROTO_ICMP:
-			*log_db = &logs_ipv4_icmp;
-			return;
-		}
-		break;
+		return 3 + l4_index;
 	}
-	*log_db = NULL;
+
+	return -EINVAL;
 }
 
-static void subtract_timespec(struct timespec *start, struct timespec *end,
-		struct log_node *node)
+/**
+ * Returns the histogram bucket "nsecs" belongs to.
+ */
+static unsigned int get_bucket(u64 nsecs)
 {
-	if (start->tv_nsec > end->tv_nsec) {
-		end->tv_nsec += NSEC_PER_SEC; /* Add one second (in ns 1,000,000,000) to the minuend. */
-		start->tv_sec += 1L; /* Add one second to the subtrahend. */
-	}
-	node->time.tv_sec = end->tv_sec - start->tv_sec;
-	node->time.tv_nsec = end->tv_nsec - start->tv_nsec;
-	log_debug("Translation time: %ld.%9ld", node->time.tv_sec, node->time.tv_nsec);
+	unsigned int shift;
 
-}
+	if (nsecs < LOGTIME_SUB_BUCKETS)
+		return nsecs;
+	if (nsecs >= (1ULL << LOGTIME_MAX_BITS))
+		return LOGTIME_BUCKETS - 1;
 
-static void logtime_db_add(struct log_time_db *log_db, struct log_node *node)
-{
-	spin_lock_bh(&log_db->lock);
-	list_add_tail(&node->list_hook, &log_db->list);
-	spin_unlock_bh(&log_db->lock);
+	shift = fls64(nsecs) - 1 - LOGTIME_SUB_BITS;
+	return (shift + 1) * LOGTIME_SUB_BUCKETS + (nsecs >> shift) - LOGTIME_SUB_BUCKETS;
 }
 
 /**
- * Increases the counter of the structure and add to the sum delta time registered.
+ * Returns the nanoseconds between "start" and "end". Zero if the clock went backwards.
  */
+static u64 subtract_timespec(struct timespec *start, struct timespec *end)
+{
+	s64 delta = timespec_to_ns(end) - timespec_to_ns(start);
+	return (delta > 0) ? delta : 0;
+}
+
 int logtime(struct timespec *start_time, struct timespec *end_time, l3_protocol l3_proto,
 		l4_protocol l4_proto)
 {
-	struct log_time_db *log_db;
-	struct log_node *log_node;
+	int index;
 
 	if (!start_time) {
 		log_debug("There's not start_time ");
@@ -112,90 +91,105 @@ int logtime(struct timespec *start_time, struct timespec *end_time, l3_protocol
 		return -EINVAL;
 	}
 
-	logtime_get_db(&log_db, l3_proto, l4_proto);
-	if (!log_db) {
+	/* The packet arrived before the module was enabled. */
+	if (!start_time->tv_sec && !start_time->tv_nsec)
+		return 0;
+
+	index = logtime_get_index(l3_proto, l4_proto);
+	if (index < 0) {
 		log_err("Invalid L3 or L4 protocol.");
 		return -EINVAL;
 	}
 
-	if (logtime_create_node(&log_node))
-		return -ENOMEM; /* Error message already printed. */
-
-	subtract_timespec(start_time, end_time, log_node);
-	logtime_db_add(log_db, log_node);
+	this_cpu_inc((dbs + index)->counts[get_bucket(subtract_timespec(start_time, end_time))]);
 
 	return 0;
 }
 
-int logtime_iterate_and_delete(l3_protocol l3_proto, l4_protocol l4_proto,
-		int (*func)(struct log_node *, void *), void *arg)
+int logtime_get(l3_protocol l3_proto, l4_protocol l4_proto, struct logtime_usr *result)
 {
-	struct list_head *current_hook, *next_hook;
-	struct log_node *node;
-	struct log_time_db *log_db;
-	int error;
+	struct log_time_db *db;
+	int index;
+	int cpu;
+	unsigned int i;
 
-	logtime_get_db(&log_db, l3_proto, l4_proto);
-	if (!log_db) {
+	index = logtime_get_index(l3_proto, l4_proto);
+	if (index < 0) {
 		log_err("Invalid L3 or L4 protocol.");
 		return -EINVAL;
 	}
 
-	spin_lock_bh(&log_db->lock);
-	list_for_each_safe(current_hook, next_hook, &log_db->list) {
-		node = list_entry(current_hook, struct log_node, list_hook);
-		error = func(node, arg);
-		if (error) {
-			spin_unlock_bh(&log_db->lock);
-			return error;
-		}
-		logtime_delete_node(node);
+	/* The counters are read while other CPUs write them; a slightly stale copy is fine. */
+	memset(result, 0, sizeof(*result));
+	if (!dbs)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		db = per_cpu_ptr(dbs, cpu);
+		for (i = 0; i < LOGTIME_BUCKETS; i++)
+			result->counts[i] += ACCESS_ONCE(db[index].counts[i]);
 	}
-	spin_unlock_bh(&log_db->lock);
 
 	return 0;
 }
 
-int logtime_init(void)
+static int enable(void)
 {
-	int i;
-	struct log_time_db *logs_db[] = { &logs_ipv6_tcp, &logs_ipv6_udp, &logs_ipv6_icmp,
-			&logs_ipv4_tcp, &logs_ipv4_udp, &logs_ipv4_icmp	};
-
-	for (i = 0; i < ARRAY_SIZE(logs_db); i++) {
-		spin_lock_init(&logs_db[i]->lock);
-		INIT_LIST_HEAD(&logs_db[i]->list);
-	}
-
-	entry_cache = kmem_cache_create("jool_logtime_nodes", sizeof(struct log_node), 0, 0, NULL);
-	if (!entry_cache) {
-		log_err("Could not allocate the BIB entry cache.");
-		return -ENOMEM;
+	if (enabled)
+		return 0;
+
+	if (!dbs) {
+		dbs = __alloc_percpu(LOGTIME_DBS * sizeof(*dbs), __alignof__(*dbs));
+		if (!dbs) {
+			log_err("Could not allocate the translation time histograms.");
+			return -ENOMEM;
+		}
+		jool_mem_add(JMEM_LOGTIME, DBS_BYTES);
 	}
 
+	jool_key_enable(logtime_key);
+	enabled = true;
 	return 0;
 }
 
-static void destroy_aux(struct log_time_db *db)
+static void disable(void)
 {
-	struct list_head *current_hook, *next_hook;
-	struct log_node *node;
+	if (!enabled)
+		return;
 
-	list_for_each_safe(current_hook, next_hook, &db->list) {
-		node = list_entry(current_hook, struct log_node, list_hook);
-		logtime_delete_node(node);
-	}
+	jool_key_disable(logtime_key);
+	enabled = false;
 }
 
-void logtime_destroy(void)
+int logtime_clone_config(struct logtime_config *clone)
 {
-	int i;
-	struct log_time_db *logs_db[] = { &logs_ipv6_tcp, &logs_ipv6_udp, &logs_ipv6_icmp,
-			&logs_ipv4_tcp, &logs_ipv4_udp, &logs_ipv4_icmp	};
+	clone->enabled = enabled;
+	return 0;
+}
 
-	for (i = 0; i < ARRAY_SIZE(logs_db); i++) {
-		destroy_aux(logs_db[i]);
+int logtime_set_config(enum logtime_type type, size_t size, void *value)
+{
+	if (type != LOGTIME_ENABLED) {
+		log_err("Unknown config type for the 'log time' module: %u", type);
+		return -EINVAL;
+	}
+	if (size != sizeof(__u8)) {
+		log_err("Expected a boolean, got %zu bytes.", size);
+		return -EINVAL;
 	}
 
-	kmem_cache_destroy(entry_cache);
+	if (*((__u8 *) value))
+		return enable();
+
+	disable();
+	return 0;
+}
+
+void logtime_destroy(void)
+{
+	disable();
+	if (dbs)
+		jool_mem_add(JMEM_LOGTIME, -(long) DBS_BYTES);
+	free_percpu(dbs);
+	dbs = NULL;
 }
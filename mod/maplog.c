@@ -0,0 +1,149 @@
+#include "nat64/mod/maplog.h"
+#include "nat64/mod/types.h"
+
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/relay.h>
+
+/** NULL if the log is disabled. */
+static struct rchan *channel;
+/** The debugfs directory the buffers live in. */
+static struct dentry *dir;
+
+/*
+ * See struct dbevent_stats. These are per-CPU because they are hit as often as the buffers are.
+ * "written" includes the records that were dropped.
+ */
+static u64 __percpu *written;
+static u64 __percpu *dropped;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 3, 0)
+static struct dentry *create_buf_file(const char *filename, struct dentry *parent, int mode,
+		struct rchan_buf *buf, int *is_global)
+#else
+static struct dentry *create_buf_file(const char *filename, struct dentry *parent, umode_t mode,
+		struct rchan_buf *buf, int *is_global)
+#endif
+{
+	return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+/**
+ * Called by relay whenever a record doesn't fit in the current sub-buffer.
+ * Refusing the switch drops the record, and relay keeps asking for every record that comes after,
+ * until the reader frees a sub-buffer.
+ */
+static int subbuf_start(struct rchan_buf *buf, void *subbuf, void *prev_subbuf,
+		size_t prev_padding)
+{
+	if (relay_buf_full(buf)) {
+		this_cpu_inc(*dropped);
+		return 0;
+	}
+
+	return 1;
+}
+
+static struct rchan_callbacks callbacks = {
+	.subbuf_start = subbuf_start,
+	.create_buf_file = create_buf_file,
+	.remove_buf_file = remove_buf_file,
+};
+
+int maplog_init(size_t subbuf_size, size_t subbuf_count)
+{
+	if (!subbuf_count)
+		return 0;
+
+	if (subbuf_size < sizeof(struct maplog_record)) {
+		log_err("The mapping log's sub-buffers cannot be smaller than a record (%zu bytes).",
+				sizeof(struct maplog_record));
+		return -EINVAL;
+	}
+
+	written = alloc_percpu(u64);
+	if (!written)
+		return -ENOMEM;
+	dropped = alloc_percpu(u64);
+	if (!dropped)
+		goto written_fail;
+
+	dir = debugfs_create_dir("jool", NULL);
+	if (IS_ERR_OR_NULL(dir)) {
+		log_err("Could not create the mapping log's debugfs directory. Is debugfs available?");
+		goto dropped_fail;
+	}
+
+	channel = relay_open("mappings", dir, subbuf_size, subbuf_count, &callbacks, NULL);
+	if (!channel) {
+		log_err("Could not create the mapping log's buffers.");
+		goto dir_fail;
+	}
+
+	return 0;
+
+dir_fail:
+	debugfs_remove(dir);
+dropped_fail:
+	free_percpu(dropped);
+written_fail:
+	free_percpu(written);
+	return -ENOMEM;
+}
+
+void maplog_destroy(void)
+{
+	if (!channel)
+		return;
+
+	relay_close(channel);
+	channel = NULL;
+	debugfs_remove(dir);
+	free_percpu(dropped);
+	free_percpu(written);
+}
+
+bool maplog_is_enabled(void)
+{
+	return channel != NULL;
+}
+
+void maplog_write(struct dbevent_usr *event)
+{
+	struct maplog_record record;
+
+	if (!channel)
+		return;
+
+	memset(&record, 0, sizeof(record)); /* Don't leak the padding. */
+	record.time = ktime_to_ns(ktime_get_real());
+	record.event = *event;
+
+	relay_write(channel, &record, sizeof(record));
+	this_cpu_inc(*written);
+}
+
+void maplog_get_stats(struct dbevent_stats *result)
+{
+	u64 total_written = 0;
+	u64 total_dropped = 0;
+	int cpu;
+
+	if (channel) {
+		for_each_possible_cpu(cpu) {
+			total_written += *per_cpu_ptr(written, cpu);
+			total_dropped += *per_cpu_ptr(dropped, cpu);
+		}
+	}
+
+	result->records_logged = total_written - total_dropped;
+	result->records_dropped = total_dropped;
+}
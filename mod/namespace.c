@@ -0,0 +1,31 @@
+#include "nat64/mod/namespace.h"
+#include "nat64/mod/types.h"
+
+#include <linux/sched.h>
+#include <linux/nsproxy.h>
+
+static struct net *jool_net;
+
+int joolns_init(void)
+{
+	jool_net = get_net(current->nsproxy->net_ns);
+	if (!net_eq(jool_net, &init_net))
+		log_info("Translating for a network namespace other than the initial one.");
+	return 0;
+}
+
+void joolns_destroy(void)
+{
+	put_net(jool_net);
+	jool_net = NULL;
+}
+
+struct net *joolns_get(void)
+{
+	return jool_net;
+}
+
+bool joolns_owns(struct sk_buff *skb)
+{
+	return net_eq(dev_net(skb->dev), jool_net);
+}
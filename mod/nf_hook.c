@@ -3,6 +3,8 @@
 #include "nat64/mod/packet.h"
 #include "nat64/mod/pool4.h"
 #include "nat64/mod/pool6.h"
+#include "nat64/mod/eam.h"
+#include "nat64/mod/siit.h"
 #include "nat64/mod/pkt_queue.h"
 #include "nat64/mod/bib_db.h"
 #include "nat64/mod/session_db.h"
@@ -12,15 +14,28 @@
 #include "nat64/mod/ttp/core.h"
 #include "nat64/mod/send_packet.h"
 #include "nat64/mod/core.h"
-#ifdef BENCHMARK
+#include "nat64/mod/ingress.h"
+#include "nat64/mod/icmp_wrapper.h"
+#include "nat64/mod/maplog.h"
+#include "nat64/mod/ipfix.h"
+#include "nat64/mod/changelog.h"
+#include "nat64/mod/stage_stats.h"
 #include "nat64/mod/log_time.h"
-#endif
+#include "nat64/mod/stats.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/namespace.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6.h>
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV4)
+#include <net/netfilter/ipv4/nf_defrag_ipv4.h>
+#endif
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV6)
+#include <net/netfilter/ipv6/nf_defrag_ipv6.h>
+#endif
 
 
 MODULE_LICENSE("GPL");
@@ -36,6 +51,119 @@ static char *pool4[5];
 static int pool4_size;
 module_param_array(pool4, charp, &pool4_size, 0);
 MODULE_PARM_DESC(pool4, "The IPv4 pool's addresses.");
+static unsigned int session_arena = 0;
+module_param(session_arena, uint, 0);
+MODULE_PARM_DESC(session_arena, "If nonzero, memory for this many sessions (and as many BIB "
+		"entries) is reserved at startup, and the databases never grow past it.");
+static unsigned int session_shards = 1;
+module_param(session_shards, uint, 0);
+MODULE_PARM_DESC(session_shards, "Number of slices the session database is split into "
+		"(0 = one per CPU).");
+static bool session_flow_cache = false;
+module_param(session_flow_cache, bool, 0);
+MODULE_PARM_DESC(session_flow_cache, "Remember the sessions of recent lookups in per-CPU "
+		"caches, so packets of the same flows can skip the session table.");
+static bool session_counters = false;
+module_param(session_counters, bool, 0);
+MODULE_PARM_DESC(session_counters, "Count the packets and bytes of every session, so session "
+		"displays and removal events can report them.");
+static bool session_shrinker = false;
+module_param(session_shrinker, bool, 0);
+MODULE_PARM_DESC(session_shrinker, "Let the kernel reclaim the oldest idle sessions when it runs "
+		"low on memory, instead of failing new ones.");
+static unsigned int fragdb_shards = 1;
+module_param(fragdb_shards, uint, 0);
+MODULE_PARM_DESC(fragdb_shards, "Number of slices the fragment database is split into "
+		"(0 = one per CPU).");
+static bool kernel_defrag = false;
+module_param(kernel_defrag, bool, 0);
+MODULE_PARM_DESC(kernel_defrag, "Let the kernel's defragmenters (nf_defrag_ipv4/ipv6) "
+		"reassemble the fragments, and translate whole packets, instead of using the "
+		"fragment database?");
+static int shard_nodes[SHARD_NODES_MAX];
+static int shard_nodes_size;
+module_param_array(shard_nodes, int, &shard_nodes_size, 0);
+MODULE_PARM_DESC(shard_nodes, "NUMA node of each slice of the session and fragment databases "
+		"(repeated cyclically; default: the node of the slice's CPU).");
+static unsigned int pool4_block_size = 0;
+module_param(pool4_block_size, uint, 0);
+MODULE_PARM_DESC(pool4_block_size, "If nonzero, IPv6 nodes get the IPv4 pool's ports in "
+		"contiguous blocks of this size.");
+static bool pool4_randomize = true;
+module_param(pool4_randomize, bool, 0);
+MODULE_PARM_DESC(pool4_randomize, "Lend the IPv4 pool's ports in random order? "
+		"(Otherwise they're lent sequentially.)");
+static unsigned int batch_size = 0;
+module_param(batch_size, uint, 0);
+MODULE_PARM_DESC(batch_size, "If nonzero, packets are queued and translated in batches of up to "
+		"this many (max 64).");
+static bool steer_flows = false;
+module_param(steer_flows, bool, 0);
+MODULE_PARM_DESC(steer_flows, "Translate both directions of every session in the same CPU? "
+		"(Requires batch_size.)");
+static bool port_affinity = false;
+module_param(port_affinity, bool, 0);
+MODULE_PARM_DESC(port_affinity, "Give every CPU its own slices of the IPv4 pool's ports, and "
+		"steer the flows by them? (Requires steer_flows.)");
+static bool batch_threads = false;
+module_param(batch_threads, bool, 0);
+MODULE_PARM_DESC(batch_threads, "Translate the batches in kernel threads pinned to every CPU, "
+		"instead of softirqs? (Requires batch_size.)");
+static unsigned int busy_poll = 0;
+module_param(busy_poll, uint, 0);
+MODULE_PARM_DESC(busy_poll, "Microseconds the translation threads keep polling for packets "
+		"before they sleep. (Requires batch_threads.)");
+static char *ingress_devs[8];
+static int ingress_devs_size;
+module_param_array(ingress_devs, charp, &ingress_devs_size, 0);
+MODULE_PARM_DESC(ingress_devs, "Interfaces whose packets are translated as soon as they are "
+		"received, before the IP stack (and iptables) sees them.");
+static unsigned int icmp_rate = 10;
+module_param(icmp_rate, uint, 0);
+MODULE_PARM_DESC(icmp_rate, "ICMP errors each node is allowed to receive per second "
+		"(0 = unlimited).");
+static unsigned int icmp_burst = 10;
+module_param(icmp_burst, uint, 0);
+MODULE_PARM_DESC(icmp_burst, "ICMP errors a node is allowed to receive in a row.");
+static unsigned int maplog_subbufs = 0;
+module_param(maplog_subbufs, uint, 0);
+MODULE_PARM_DESC(maplog_subbufs, "Sub-buffers of the mapping log, per CPU (0 = no mapping log).");
+static unsigned int maplog_subbuf_size = 256 * 1024;
+module_param(maplog_subbuf_size, uint, 0);
+MODULE_PARM_DESC(maplog_subbuf_size, "Size in bytes of each of the mapping log's sub-buffers.");
+static char *ipfix_collector = NULL;
+module_param(ipfix_collector, charp, 0);
+MODULE_PARM_DESC(ipfix_collector, "IPv4 or IPv6 address of the IPFIX collector NAT events are "
+		"exported to (unset = no export).");
+static unsigned int ipfix_port = 4739;
+module_param(ipfix_port, uint, 0);
+MODULE_PARM_DESC(ipfix_port, "UDP port of the IPFIX collector.");
+static unsigned int ipfix_size = 1400;
+module_param(ipfix_size, uint, 0);
+MODULE_PARM_DESC(ipfix_size, "Maximum size in bytes of the IPFIX datagrams.");
+static unsigned int ipfix_interval = 1000;
+module_param(ipfix_interval, uint, 0);
+MODULE_PARM_DESC(ipfix_interval, "Milliseconds an IPFIX record can wait for its datagram to "
+		"fill up.");
+static unsigned int ipfix_domain = 0;
+module_param(ipfix_domain, uint, 0);
+MODULE_PARM_DESC(ipfix_domain, "Observation Domain ID of the IPFIX messages.");
+static unsigned int changelog_size = 0;
+module_param(changelog_size, uint, 0);
+MODULE_PARM_DESC(changelog_size, "Number of BIB and session changes remembered for "
+		"`jool --changes` (0 = no change log).");
+static bool stage_timing = false;
+module_param(stage_timing, bool, 0);
+MODULE_PARM_DESC(stage_timing, "Measure the time every stage of the translation takes? "
+		"(See the counters in `jool --general`.)");
+static bool lock_timing = false;
+module_param(lock_timing, bool, 0);
+MODULE_PARM_DESC(lock_timing, "Measure the contention of the databases' locks? "
+		"(See the counters in `jool --stats`.)");
+static bool siit = false;
+module_param(siit, bool, 0);
+MODULE_PARM_DESC(siit, "Translate statelessly (RFC 6145, with the EAMT from `jool --eamt`) "
+		"instead of acting as a NAT64?");
 
 
 static char *banner = "\n"
@@ -91,6 +219,39 @@ static struct nf_hook_ops nfho[] = {
 	}
 };
 
+/**
+ * Makes the kernel reassemble the fragments before they reach the hooks, and moves the hooks
+ * behind the defragmenters. The fragment database then only sees whole packets, which it lets
+ * through untouched.
+ */
+static int enable_kernel_defrag(void)
+{
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV4) && IS_ENABLED(CONFIG_NF_DEFRAG_IPV6)
+	int error;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	error = nf_defrag_ipv4_enable(joolns_get());
+	if (error)
+		return error;
+	error = nf_defrag_ipv6_enable(joolns_get());
+	if (error)
+		return error;
+#else
+	nf_defrag_ipv4_enable();
+	nf_defrag_ipv6_enable();
+	error = 0;
+#endif
+
+	nfho[0].priority = NF_PRI6_JOOL_DEFRAG;
+	nfho[1].priority = NF_PRI4_JOOL_DEFRAG;
+	log_info("Fragments will be reassembled by the kernel.");
+	return error;
+#else
+	log_err("This kernel was built without nf_defrag_ipv4 or nf_defrag_ipv6.");
+	return -EINVAL;
+#endif
+}
+
 static int __init nat64_init(void)
 {
 	int error;
@@ -99,25 +260,54 @@ static int __init nat64_init(void)
 	log_debug("Inserting the module...");
 
 	/* Init Jool's submodules. */
+	error = joolns_init();
+	if (error)
+		goto joolns_failure;
+	error = stats_init();
+	if (error)
+		goto stats_failure;
+	error = lockstats_init(lock_timing);
+	if (error)
+		goto lockstats_failure;
 	error = config_init();
 	if (error)
 		goto config_failure;
+	error = icmp64_init(icmp_rate, icmp_burst);
+	if (error)
+		goto icmp_failure;
+	error = maplog_init(maplog_subbuf_size, maplog_subbufs);
+	if (error)
+		goto maplog_failure;
+	error = ipfix_init(ipfix_collector, ipfix_port, ipfix_size, ipfix_interval, ipfix_domain);
+	if (error)
+		goto ipfix_failure;
+	error = changelog_init(changelog_size);
+	if (error)
+		goto changelog_failure;
 	error = pool6_init(pool6, pool6_size);
 	if (error)
 		goto pool6_failure;
-	error = pool4_init(pool4, pool4_size);
+	error = eamt_init();
+	if (error)
+		goto eamt_failure;
+	error = pool4_init(pool4, pool4_size, pool4_block_size, pool4_randomize,
+			port_affinity);
 	if (error)
 		goto pool4_failure;
 	error = pktqueue_init();
 	if (error)
 		goto pktqueue_failure;
-	error = bibdb_init();
+	error = bibdb_init(session_arena);
 	if (error)
 		goto bib_failure;
-	error = sessiondb_init();
+	error = shard_nodes_init(shard_nodes, shard_nodes_size);
+	if (error)
+		goto session_failure;
+	error = sessiondb_init(session_shards, session_arena, session_flow_cache,
+			session_counters, session_shrinker);
 	if (error)
 		goto session_failure;
-	error = fragdb_init();
+	error = fragdb_init(fragdb_shards);
 	if (error)
 		goto fragdb_failure;
 	error = filtering_init();
@@ -129,27 +319,47 @@ static int __init nat64_init(void)
 	error = sendpkt_init();
 	if (error)
 		goto sendpkt_failure;
-#ifdef BENCHMARK
-	error = logtime_init();
+	error = stagestats_init(stage_timing);
 	if (error)
-		goto log_time_failure;
-#endif
+		goto stagestats_failure;
+	error = siit_init(siit);
+	if (error)
+		goto siit_failure;
+	error = core_init(batch_size, steer_flows, port_affinity, batch_threads, busy_poll);
+	if (error)
+		goto core_failure;
 
 	/* Hook Jool to Netfilter. */
+	if (kernel_defrag) {
+		error = enable_kernel_defrag();
+		if (error)
+			goto nf_register_hooks_failure;
+	}
 	error = nf_register_hooks(nfho, ARRAY_SIZE(nfho));
 	if (error)
 		goto nf_register_hooks_failure;
+	error = ingress_init(ingress_devs, ingress_devs_size);
+	if (error)
+		goto ingress_failure;
 
 	/* Yay */
 	log_info(MODULE_NAME " module inserted.");
 	return error;
 
+ingress_failure:
+	nf_unregister_hooks(nfho, ARRAY_SIZE(nfho));
+
 nf_register_hooks_failure:
-#ifdef BENCHMARK
 	logtime_destroy();
+	core_destroy();
 
-log_time_failure:
-#endif
+core_failure:
+	siit_destroy();
+
+siit_failure:
+	stagestats_destroy();
+
+stagestats_failure:
 	sendpkt_destroy();
 
 sendpkt_failure:
@@ -174,24 +384,50 @@ pktqueue_failure:
 	pool4_destroy();
 
 pool4_failure:
+	eamt_destroy();
+
+eamt_failure:
 	pool6_destroy();
 
 pool6_failure:
+	changelog_destroy();
+
+changelog_failure:
+	ipfix_destroy();
+
+ipfix_failure:
+	maplog_destroy();
+
+maplog_failure:
+	icmp64_destroy();
+
+icmp_failure:
 	config_destroy();
 
 config_failure:
+	lockstats_destroy();
+
+lockstats_failure:
+	stats_destroy();
+
+stats_failure:
+	joolns_destroy();
+
+joolns_failure:
 	return error;
 }
 
 static void __exit nat64_exit(void)
 {
-	/* Release the hook. */
+	/* Release the hooks. */
+	ingress_destroy();
 	nf_unregister_hooks(nfho, ARRAY_SIZE(nfho));
 
 	/* Deinitialize the submodules. */
-#ifdef BENCHMARK
 	logtime_destroy();
-#endif
+	core_destroy();
+	siit_destroy();
+	stagestats_destroy();
 	sendpkt_destroy();
 	translate_packet_destroy();
 	filtering_destroy();
@@ -200,8 +436,16 @@ static void __exit nat64_exit(void)
 	bibdb_destroy();
 	pktqueue_destroy();
 	pool4_destroy();
+	eamt_destroy();
 	pool6_destroy();
+	changelog_destroy();
+	ipfix_destroy();
+	maplog_destroy();
+	icmp64_destroy();
 	config_destroy();
+	lockstats_destroy();
+	stats_destroy();
+	joolns_destroy();
 
 	log_info(MODULE_NAME " module removed.");
 }
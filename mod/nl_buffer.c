@@ -1,45 +1,78 @@
 #include "nat64/mod/nl_buffer.h"
+#include <linux/slab.h>
 #include "net/netlink.h"
 #include "nat64/mod/types.h"
 
 
 static int flush(struct nl_buffer *buffer, __u16 nlmsg_type, __u16	nlmsg_flags)
 {
-	struct sk_buff *skb_out;
-	struct nlmsghdr *nl_hdr_out;
 	int res;
 
-	skb_out = nlmsg_new(NLMSG_ALIGN(buffer->len), GFP_ATOMIC);
-	if (!skb_out) {
-		log_err("Failed to allocate a response skb to the user.");
-		return -ENOMEM;
-	}
-
-	nl_hdr_out = nlmsg_put(skb_out,
-			0, /* src_pid (0 = kernel) */
-			buffer->request_hdr->nlmsg_seq, /* seq */
-			nlmsg_type, /* type */
-			buffer->len, /* payload len */
-			nlmsg_flags); /* flags. */
-	memcpy(nlmsg_data(nl_hdr_out), buffer->bytes, buffer->len);
+	buffer->nl_hdr->nlmsg_type = nlmsg_type;
+	buffer->nl_hdr->nlmsg_flags = nlmsg_flags;
+	nlmsg_end(buffer->skb, buffer->nl_hdr);
 	/* NETLINK_CB(skb_out).dst_group = 0; */
 
-	res = nlmsg_unicast(buffer->socket, skb_out, buffer->request_hdr->nlmsg_pid);
+	/* The skb is gone after this, whatever happens. */
+	res = nlmsg_unicast(buffer->socket, buffer->skb, buffer->request_hdr->nlmsg_pid);
+	buffer->skb = NULL;
 	if (res < 0) {
 		log_err("Error code %d while returning response to the user.", res);
 		return res;
 	}
 
-	buffer->len = 0;
-
 	return 0;
 }
 
-void nlbuffer_init(struct nl_buffer *stream, struct sock *nl_socket, struct nlmsghdr *nl_hdr)
+struct nl_buffer *nlbuffer_create(struct sock *nl_socket, struct nlmsghdr *nl_hdr,
+		int capacity)
 {
+	struct nl_buffer *stream;
+	struct sk_buff *skb = NULL;
+
+	stream = kmalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return NULL;
+
+	/*
+	 * The data is written straight into the message that's going to be sent, so a dump is only
+	 * copied once. The table dumps are too big to be demanding physically contiguous memory
+	 * though, so settle for smaller messages if it's scarce. (netlink_dump() does the same.)
+	 * config.c's semaphore is held, so this is not atomic context.
+	 */
+	while (capacity > NLBUFFER_SIZE) {
+		skb = nlmsg_new(capacity, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY);
+		if (skb)
+			break;
+		capacity /= 2;
+	}
+	if (!skb)
+		skb = nlmsg_new(capacity, GFP_KERNEL);
+	if (!skb) {
+		log_err("Failed to allocate a response skb to the user.");
+		kfree(stream);
+		return NULL;
+	}
+
 	stream->socket = nl_socket;
 	stream->request_hdr = nl_hdr;
+	stream->skb = skb;
+	stream->nl_hdr = nlmsg_put(skb,
+			0, /* src_pid (0 = kernel) */
+			nl_hdr->nlmsg_seq, /* seq */
+			NLMSG_DONE, /* type; flush() decides. */
+			0, /* payload len; grows as data is written. */
+			0); /* flags; flush() decides. */
 	stream->len = 0;
+	stream->capacity = capacity;
+
+	return stream;
+}
+
+void nlbuffer_free(struct nl_buffer *stream)
+{
+	kfree_skb(stream->skb);
+	kfree(stream);
 }
 
 int nlbuffer_write(struct nl_buffer *stream, void *payload, int payload_len)
@@ -47,13 +80,13 @@ int nlbuffer_write(struct nl_buffer *stream, void *payload, int payload_len)
 	if (payload == NULL || payload_len == 0)
 		return 0;
 
-	if (payload_len > NLBUFFER_SIZE) {
+	if (payload_len > stream->capacity) {
 		/* This will never happen in this project, so fail blatantly :p. */
 		log_err("The data is too big to be streamed. Failing...");
 		return -EINVAL;
 	}
 
-	if (stream->len + payload_len > NLBUFFER_SIZE) {
+	if (stream->len + payload_len > stream->capacity) {
 		/*
 		 * Caller must flush and try again.
 		 * Why don't we do that ourselves? the flush might be expensive, so the caller should let
@@ -62,7 +95,7 @@ int nlbuffer_write(struct nl_buffer *stream, void *payload, int payload_len)
 		return 1;
 	}
 
-	memcpy(stream->bytes + stream->len, payload, payload_len);
+	memcpy(skb_put(stream->skb, payload_len), payload, payload_len);
 	stream->len += payload_len;
 
 	return 0;
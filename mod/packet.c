@@ -8,6 +8,7 @@
 #include "nat64/mod/types.h"
 #include "nat64/mod/icmp_wrapper.h"
 #include "nat64/mod/stats.h"
+#include "nat64/mod/log_time.h"
 
 
 #define MIN_IPV6_HDR_LEN sizeof(struct ipv6hdr)
@@ -29,6 +30,17 @@ void kfree_skb_queued(struct sk_buff *skb)
 	}
 }
 
+void consume_skb_queued(struct sk_buff *skb)
+{
+	struct sk_buff *next_skb;
+	while (skb) {
+		next_skb = skb->next;
+		skb->next = skb->prev = NULL;
+		consume_skb(skb);
+		skb = next_skb;
+	}
+}
+
 int skb_aggregate_ipv4_payload_len(struct sk_buff *skb, unsigned int *len)
 {
 	struct iphdr *hdr;
@@ -117,27 +129,69 @@ int validate_lengths_icmp4(unsigned int len, unsigned int l3_hdr_len)
 	return 0;
 }
 
-int validate_ipv6_integrity(struct ipv6hdr *hdr, unsigned int len, bool is_truncated,
-		struct hdr_iterator *iterator, int *field)
+static int validate_ipv6_lengths(struct ipv6hdr *hdr, unsigned int len, bool is_truncated,
+		int *field)
 {
-	enum hdr_iterator_result result;
-
 	if (len < MIN_IPV6_HDR_LEN) {
 		log_debug("Packet is too small to contain a basic IPv6 header.");
 		*field = IPSTATS_MIB_INTRUNCATEDPKTS;
 		return -EINVAL;
 	}
-	if (!is_truncated && len != MIN_IPV6_HDR_LEN + be16_to_cpu(hdr->payload_len)) {
+	if (!is_truncated && len != get_tot_len_ipv6(hdr, len)) {
 		log_debug("The packet's length does not match the IPv6 header's payload length field.");
 		*field = IPSTATS_MIB_INHDRERRORS;
 		return -EINVAL;
 	}
 
+	return 0;
+}
+
+/**
+ * Takes note of the header "iterator" is visiting, if it's one of the ones the rest of the pipeline
+ * wants to know about. Only the first one of each type is recorded.
+ */
+static void record_ext_hdr(struct jool_cb *cb, struct ipv6hdr *hdr, struct hdr_iterator *iterator)
+{
+	switch (iterator->hdr_type) {
+	case NEXTHDR_FRAGMENT:
+		if (!cb->frag_hdr)
+			cb->frag_hdr = iterator->data;
+		break;
+	case NEXTHDR_ROUTING:
+		if (!cb->rt_hdr_offset)
+			cb->rt_hdr_offset = iterator->data - (void *) hdr;
+		break;
+	}
+}
+
+/**
+ * Same as validate_ipv6_integrity(), except if "cb" is not NULL, the extension headers later
+ * stages need are recorded in it on the way, so nobody has to iterate over them again.
+ */
+static int __validate_ipv6_integrity(struct ipv6hdr *hdr, unsigned int len, bool is_truncated,
+		struct hdr_iterator *iterator, struct jool_cb *cb, int *field)
+{
+	enum hdr_iterator_result result;
+	int error;
+
+	error = validate_ipv6_lengths(hdr, len, is_truncated, field);
+	if (error)
+		return error;
+
 	if (is_truncated)
 		hdr_iterator_init_truncated(iterator, hdr, len);
 	else
 		hdr_iterator_init(iterator, hdr);
-	result = hdr_iterator_last(iterator);
+
+	if (cb) {
+		cb->frag_hdr = NULL;
+		cb->rt_hdr_offset = 0;
+	}
+	do {
+		if (cb)
+			record_ext_hdr(cb, hdr, iterator);
+		result = hdr_iterator_next(iterator);
+	} while (result == HDR_ITERATOR_SUCCESS);
 
 	switch (result) {
 	case HDR_ITERATOR_SUCCESS:
@@ -161,6 +215,12 @@ int validate_ipv6_integrity(struct ipv6hdr *hdr, unsigned int len, bool is_trunc
 	return -EINVAL;
 }
 
+int validate_ipv6_integrity(struct ipv6hdr *hdr, unsigned int len, bool is_truncated,
+		struct hdr_iterator *iterator, int *field)
+{
+	return __validate_ipv6_integrity(hdr, len, is_truncated, iterator, NULL, field);
+}
+
 bool icmp4_has_inner_packet(__u8 icmp_type)
 {
 	return is_icmp4_error(icmp_type);
@@ -231,6 +291,23 @@ static int validate_inner_packet6(struct ipv6hdr *hdr6, unsigned int len, int *f
 	return 0;
 }
 
+/**
+ * Returns true if "skb" is a TCP or UDP packet with no extension headers, which is what most of
+ * the traffic looks like.
+ * These cannot have fragment headers, unsupported headers or inner packets, so they can skip the
+ * header iterator (the length checks still apply).
+ */
+static bool is_simple_ipv6(struct sk_buff *skb)
+{
+	__u8 nexthdr;
+
+	if (skb->len < MIN_IPV6_HDR_LEN)
+		return false;
+
+	nexthdr = ipv6_hdr(skb)->nexthdr;
+	return nexthdr == NEXTHDR_TCP || nexthdr == NEXTHDR_UDP;
+}
+
 int skb_init_cb_ipv6(struct sk_buff *skb)
 {
 	struct jool_cb *cb = skb_jcb(skb);
@@ -238,11 +315,19 @@ int skb_init_cb_ipv6(struct sk_buff *skb)
 	int error;
 	int field = 0;
 
-#ifdef BENCHMARK
-	getnstimeofday(&cb->start_time);
-#endif
+	if (logtime_enabled())
+		getnstimeofday(&cb->start_time);
 
-	error = validate_ipv6_integrity(ipv6_hdr(skb), skb->len, false, &iterator, &field);
+	if (is_simple_ipv6(skb)) {
+		error = validate_ipv6_lengths(ipv6_hdr(skb), skb->len, false, &field);
+		iterator.hdr_type = ipv6_hdr(skb)->nexthdr;
+		iterator.data = ipv6_hdr(skb) + 1;
+		cb->frag_hdr = NULL;
+		cb->rt_hdr_offset = 0;
+	} else {
+		error = __validate_ipv6_integrity(ipv6_hdr(skb), skb->len, false, &iterator, cb,
+				&field);
+	}
 	if (error) {
 		inc_stats(skb, field);
 		return error;
@@ -257,7 +342,6 @@ int skb_init_cb_ipv6(struct sk_buff *skb)
 	 */
 
 	cb->l3_proto = L3PROTO_IPV6;
-	cb->frag_hdr = get_extension_header(ipv6_hdr(skb), NEXTHDR_FRAGMENT);
 	cb->original_skb = skb;
 	skb_set_transport_header(skb, iterator.data - (void *) skb_network_header(skb));
 	cb->payload = iterator.data;
@@ -347,7 +431,7 @@ int validate_ipv4_integrity(struct iphdr *hdr, unsigned int len, bool is_truncat
 	if (is_truncated)
 		return 0;
 
-	if (len != be16_to_cpu(hdr->tot_len)) {
+	if (len != get_tot_len_ipv4(hdr, len)) {
 		log_debug("The packet's length does not equal the IPv4 header's lengh field.");
 		*field = IPSTATS_MIB_INHDRERRORS;
 		return -EINVAL;
@@ -424,9 +508,8 @@ int skb_init_cb_ipv4(struct sk_buff *skb)
 	int error;
 	int field = 0;
 
-#ifdef BENCHMARK
-	getnstimeofday(&cb->start_time);
-#endif
+	if (logtime_enabled())
+		getnstimeofday(&cb->start_time);
 
 	error = validate_ipv4_integrity(hdr4, skb->len, false, &field);
 	if (error) {
@@ -451,6 +534,7 @@ int skb_init_cb_ipv4(struct sk_buff *skb)
 #endif
 
 	cb->l3_proto = L3PROTO_IPV4;
+	cb->rt_hdr_offset = 0;
 	cb->frag_hdr = NULL;
 	cb->original_skb = skb;
 	skb_set_transport_header(skb, 4 * hdr4->ihl);
@@ -666,6 +750,19 @@ void skb_print(struct sk_buff *skb)
 	printk("\n");
 }
 
+/**
+ * Returns the sum of "skb"'s layer-4 datagram, picking it from the hardware's sum if there's one.
+ */
+static __wsum l4_csum(struct sk_buff *skb, unsigned int datagram_len)
+{
+	if (skb->ip_summed == CHECKSUM_COMPLETE) {
+		/* The hardware summed everything from skb->data; take out what precedes layer 4. */
+		return csum_sub(skb->csum, csum_partial(skb->data, skb_transport_offset(skb), 0));
+	}
+
+	return csum_partial(skb_transport_header(skb), datagram_len, 0);
+}
+
 int validate_icmp6_csum(struct sk_buff *skb) {
 	struct ipv6hdr *ip6_hdr;
 	struct icmp6hdr *hdr_icmp6;
@@ -678,11 +775,14 @@ int validate_icmp6_csum(struct sk_buff *skb) {
 	hdr_icmp6 = icmp6_hdr(skb);
 	if (!is_icmp6_error(hdr_icmp6->icmp6_type))
 		return 0;
+	/* Somebody (probably the NIC) already did it. */
+	if (skb_csum_unnecessary(skb))
+		return 0;
 
 	ip6_hdr = ipv6_hdr(skb);
 	datagram_len = skb_l4hdr_len(skb) + skb_payload_len(skb);
 	csum = csum_ipv6_magic(&ip6_hdr->saddr, &ip6_hdr->daddr, datagram_len, NEXTHDR_ICMP,
-			csum_partial(hdr_icmp6, datagram_len, 0));
+			l4_csum(skb, datagram_len));
 	if (csum != 0) {
 		log_debug("Checksum doesn't match.");
 		return -EINVAL;
@@ -701,8 +801,10 @@ int validate_icmp4_csum(struct sk_buff *skb) {
 	hdr = icmp_hdr(skb);
 	if (!is_icmp4_error(hdr->type))
 		return 0;
+	if (skb_csum_unnecessary(skb))
+		return 0;
 
-	csum = ip_compute_csum(hdr, skb_l4hdr_len(skb) + skb_payload_len(skb));
+	csum = csum_fold(l4_csum(skb, skb_l4hdr_len(skb) + skb_payload_len(skb)));
 	if (csum != 0) {
 		log_debug("Checksum doesn't match.");
 		return -EINVAL;
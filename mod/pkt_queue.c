@@ -1,12 +1,24 @@
 #include "nat64/mod/pkt_queue.h"
 #include "nat64/mod/icmp_wrapper.h"
-#include "nat64/mod/rbtree.h"
 #include "nat64/comm/constants.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/stats.h"
+#include "nat64/mod/trace.h"
 
 #include <linux/printk.h>
 #include <linux/timer.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 
 
+/** Number of slots in the packet index. Must be a power of two. */
+#define PKTQUEUE_SLOTS 1024
+/**
+ * Number of counters the quotas spread the IPv4 addresses over. Must be a power of two.
+ * As with the session database's prefix counters, two addresses can end up sharing a budget, but
+ * with this many counters it should be rare for two busy ones to do so.
+ */
+#define PKTQUEUE_COUNTER_SLOTS 256
 
 /**
  * A stored packet.
@@ -17,16 +29,26 @@ struct packet_node {
 	/** The packet. */
 	struct sk_buff *skb;
 
-	/** Links this packet to the tree. See "packets". */
-	struct rb_node tree_hook;
+	/** Links this packet to its slot in the index. See "packets". */
+	struct hlist_node hash_hook;
+	/** Links this packet to the rest of them. See "packet_list". */
+	struct list_head list_hook;
 };
 
-/** The same packets, sorted by IPv4 identifiers. */
-static struct rb_root packets;
+/** The packets, indexed by the hash of their sessions' IPv4 identifiers. */
+static struct hlist_head packets[PKTQUEUE_SLOTS];
+/** The same packets, sorted by arrival. Used to walk the whole queue. */
+static LIST_HEAD(packet_list);
 /** Current number of packets in the database. */
 static int packet_count = 0;
-/** Protects "packets" and "packet_count". */
+/** Number of packets charged to each remote IPv4 address. See pktqueue_config.max_pkts_per_src. */
+static unsigned int src_counters[PKTQUEUE_COUNTER_SLOTS];
+/** Number of packets charged to each pool4 address. See pktqueue_config.max_pkts_per_pool4. */
+static unsigned int pool4_counters[PKTQUEUE_COUNTER_SLOTS];
+/** Protects "packets", "packet_list", "packet_count" and the counters. */
 static DEFINE_SPINLOCK(packets_lock);
+/** Scrambles the hashes, so attackers cannot choose which slots and counters their packets hit. */
+static u32 hash_rnd;
 
 /** Cache for struct packet_nodes, for efficient allocation. */
 static struct kmem_cache *node_cache;
@@ -36,46 +58,113 @@ static struct pktqueue_config *config;
 
 
 /**
- * Returns > 0 if node.session.*4 > session.*4.
- * Returns < 0 if node.session.*4 < session.*4.
- * Returns 0 if node.session.*4 == session.*4.
+ * Returns the slot of "packets" where "session"'s packet belongs to.
+ */
+static struct hlist_head *get_slot(struct session_entry *session)
+{
+	u32 hash;
+
+	hash = jhash_3words((__force u32) session->remote4.l3.s_addr,
+			(__force u32) session->local4.l3.s_addr,
+			(session->remote4.l4 << 16) | session->local4.l4, hash_rnd);
+	return &packets[hash & (PKTQUEUE_SLOTS - 1)];
+}
+
+/**
+ * Returns the index of the quota counter "addr" is charged to.
+ */
+static unsigned int get_counter(const struct in_addr *addr)
+{
+	return jhash_1word((__force u32) addr->s_addr, hash_rnd) & (PKTQUEUE_COUNTER_SLOTS - 1);
+}
+
+/**
+ * Returns true if "node" is the packet held by "session" (or by a session with the same IPv4
+ * identifiers).
+ */
+static bool node_matches(const struct packet_node *node, struct session_entry *session)
+{
+	return ipv4_addr_equals(&node->session->remote4.l3, &session->remote4.l3)
+			&& node->session->remote4.l4 == session->remote4.l4
+			&& ipv4_addr_equals(&node->session->local4.l3, &session->local4.l3)
+			&& node->session->local4.l4 == session->local4.l4;
+}
+
+/**
+ * Returns the packet "session" is holding, NULL if there's none.
  *
- * Doesn't care about spinlocks.
+ * Assumes packets_lock has already been locked.
  */
-static int compare_fn(const struct packet_node *node, struct session_entry *session)
+static struct packet_node *find_node(struct session_entry *session)
 {
-	int gap;
+	struct packet_node *node;
+	struct hlist_node *pos;
+
+	hlist_for_each(pos, get_slot(session)) {
+		node = hlist_entry(pos, struct packet_node, hash_hook);
+		if (node_matches(node, session))
+			return node;
+	}
 
-	gap = ipv4_addr_cmp(&node->session->remote4.l3, &session->remote4.l3);
-	if (gap)
-		return gap;
+	return NULL;
+}
 
-	gap = node->session->remote4.l4 - session->remote4.l4;
-	if (gap)
-		return gap;
+/**
+ * Removes "node" from the database and refunds its quotas.
+ *
+ * Assumes packets_lock has already been locked.
+ */
+static void detach_node(struct packet_node *node)
+{
+	hlist_del(&node->hash_hook);
+	list_del(&node->list_hook);
+	packet_count--;
+	src_counters[get_counter(&node->session->remote4.l3)]--;
+	pool4_counters[get_counter(&node->session->local4.l3)]--;
+}
 
-	gap = ipv4_addr_cmp(&node->session->local4.l3, &session->local4.l3);
-	if (gap)
-		return gap;
+/**
+ * Releases "node" and its packet. Doesn't touch the session.
+ */
+static void free_node(struct packet_node *node)
+{
+	jool_mem_add(JMEM_PKTQUEUE_SKBS, -(long) node->skb->truesize);
+	jool_mem_add(JMEM_PKTQUEUE, -(long) sizeof(*node));
+	kfree_skb_queued(node->skb);
+	kmem_cache_free(node_cache, node);
+}
 
-	gap = node->session->local4.l4 - session->local4.l4;
-	return gap;
+/**
+ * Replies "node"'s packet with an ICMP error and releases it. "node" has to be already detached.
+ */
+static void send_node(struct packet_node *node)
+{
+	trace_jool_pktqueue_send(node->session);
+	icmp64_send(node->skb, ICMPERR_PORT_UNREACHABLE, 0);
+	session_return(node->session);
+	free_node(node);
 }
 
 int pktqueue_add(struct session_entry *session, struct sk_buff *skb)
 {
 	struct packet_node *node;
-	unsigned int max_pkts;
+	struct pktqueue_config *cfg;
+	unsigned int max_pkts, max_per_src, max_per_pool4;
+	unsigned int src, pool4;
 	int error;
+	bool locked;
 
 	if (WARN(!session, "Cannot insert a packet with a NULL session."))
 		return -EINVAL;
 	if (WARN(!skb, "Cannot insert NULL as a packet."))
 		return -EINVAL;
 
-	rcu_read_lock_bh();
-	max_pkts = rcu_dereference_bh(config)->max_pkts;
-	rcu_read_unlock_bh();
+	locked = config_read_lock();
+	cfg = rcu_dereference_bh(config);
+	max_pkts = cfg->max_pkts;
+	max_per_src = cfg->max_pkts_per_src;
+	max_per_pool4 = cfg->max_pkts_per_pool4;
+	config_read_unlock(locked);
 
 	node = kmem_cache_alloc(node_cache, GFP_ATOMIC);
 	if (!node) {
@@ -85,34 +174,60 @@ int pktqueue_add(struct session_entry *session, struct sk_buff *skb)
 
 	node->session = session;
 	node->skb = skb_original_skb(skb);
-	RB_CLEAR_NODE(&node->tree_hook);
 
 	/* Don't need to store fragments other than the first one. */
 	kfree_skb_queued(node->skb->next);
 	node->skb->next = NULL;
 
-	spin_lock_bh(&packets_lock);
+	src = get_counter(&session->remote4.l3);
+	pool4 = get_counter(&session->local4.l3);
+
+	jool_lock_bh(&packets_lock, JLOCK_PKTQUEUE);
 
+	/*
+	 * A SYN scan can easily outnumber the legitimate simultaneous opens, so the quotas keep any
+	 * single source (or any single pool4 address under attack) from taking the whole queue.
+	 */
 	if (packet_count + 1 >= max_pkts) {
+		log_debug("Someone is trying to force lots of IPv4-TCP connections.");
 		error = -E2BIG;
 		goto fail;
 	}
-
-	error = rbtree_add(node, session, &packets, compare_fn, struct packet_node, tree_hook);
-	if (error)
+	if (max_per_src && src_counters[src] >= max_per_src) {
+		log_debug("%pI4 is trying to force lots of IPv4-TCP connections.",
+				&session->remote4.l3);
+		error = -E2BIG;
+		goto fail;
+	}
+	if (max_per_pool4 && pool4_counters[pool4] >= max_per_pool4) {
+		log_debug("Someone is trying to force lots of IPv4-TCP connections on %pI4.",
+				&session->local4.l3);
+		error = -E2BIG;
 		goto fail;
+	}
+	if (find_node(session)) {
+		error = -EEXIST;
+		goto fail;
+	}
+
+	hlist_add_head(&node->hash_hook, get_slot(session));
+	list_add_tail(&node->list_hook, &packet_list);
 	packet_count++;
+	src_counters[src]++;
+	pool4_counters[pool4]++;
 
-	spin_unlock_bh(&packets_lock);
+	jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
 
+	jool_mem_add(JMEM_PKTQUEUE, sizeof(*node));
+	jool_mem_add(JMEM_PKTQUEUE_SKBS, node->skb->truesize);
 	session_get(session);
+	trace_jool_pktqueue_store(session);
 	log_debug("Pkt queue - I just stored a packet.");
 	return 0;
 
 fail:
-	spin_unlock_bh(&packets_lock);
+	jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
 	kmem_cache_free(node_cache, node);
-	log_debug("Someone is trying to force lots of IPv4-TCP connections.");
 	return error;
 }
 
@@ -123,64 +238,89 @@ int pktqueue_send(struct session_entry *session)
 	if (WARN(!session, "Cannot remove a packet with a NULL session."))
 		return -EINVAL;
 
-	spin_lock_bh(&packets_lock);
+	jool_lock_bh(&packets_lock, JLOCK_PKTQUEUE);
 
-	node = rbtree_find(session, &packets, compare_fn, struct packet_node, tree_hook);
+	node = find_node(session);
 	if (!node) {
-		spin_unlock_bh(&packets_lock);
+		jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
 		log_debug("I've been asked to send a packet I don't know.");
 		return -ENOENT;
 	}
+	detach_node(node);
 
-	rb_erase(&node->tree_hook, &packets);
-	packet_count--;
+	jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
 
-	spin_unlock_bh(&packets_lock);
-
-	icmp64_send(node->skb, ICMPERR_PORT_UNREACHABLE, 0);
-	kfree_skb_queued(node->skb);
-	session_return(node->session);
-	kmem_cache_free(node_cache, node);
+	send_node(node);
 
 	log_debug("Pkt queue - I just sent a ICMP error.");
 	return 0;
 }
 
+void pktqueue_send_batch(struct session_entry **sessions, unsigned int count)
+{
+	struct packet_node *node, *tmp;
+	LIST_HEAD(batch);
+	unsigned int i;
+
+	if (!count)
+		return;
+
+	jool_lock_bh(&packets_lock, JLOCK_PKTQUEUE);
+	for (i = 0; i < count; i++) {
+		node = find_node(sessions[i]);
+		if (!node)
+			continue;
+		detach_node(node);
+		list_add_tail(&node->list_hook, &batch);
+	}
+	jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
+
+	list_for_each_entry_safe(node, tmp, &batch, list_hook)
+		send_node(node);
+}
+
 int pktqueue_init(void)
 {
+	unsigned int i;
+
 	node_cache = kmem_cache_create("jool_pkt_queue", sizeof(struct packet_node), 0, 0, NULL);
 	if (!node_cache) {
 		log_err("Could not allocate the packet queue's node cache.");
 		return -ENOMEM;
 	}
 
-	config = kmalloc(sizeof(*config), GFP_KERNEL);
+	config = config_alloc(sizeof(*config), GFP_KERNEL);
 	if (!config) {
 		kmem_cache_destroy(node_cache);
 		return -ENOMEM;
 	}
 	config->max_pkts = PKTQ_DEF_MAX_STORED_PKTS;
+	config->max_pkts_per_src = PKTQ_DEF_MAX_PKTS_PER_SRC;
+	config->max_pkts_per_pool4 = PKTQ_DEF_MAX_PKTS_PER_POOL4;
 
-	packets = RB_ROOT;
+	for (i = 0; i < PKTQUEUE_SLOTS; i++)
+		INIT_HLIST_HEAD(&packets[i]);
+	INIT_LIST_HEAD(&packet_list);
+	packet_count = 0;
+	memset(src_counters, 0, sizeof(src_counters));
+	memset(pool4_counters, 0, sizeof(pool4_counters));
+	get_random_bytes(&hash_rnd, sizeof(hash_rnd));
 
 	return 0;
 }
 
-static void pktqueue_destroy_aux(struct rb_node *hook)
-{
-	struct packet_node *node;
-	node = rb_entry(hook, struct packet_node, tree_hook);
-
-	icmp64_send(node->skb, ICMPERR_PORT_UNREACHABLE, 0);
-	kfree_skb_queued(node->skb);
-	kmem_cache_free(node_cache, node);
-}
-
 void pktqueue_destroy(void)
 {
-	rbtree_clear(&packets, pktqueue_destroy_aux);
-	packets.rb_node = NULL;
+	struct packet_node *node, *tmp;
+
+	list_for_each_entry_safe(node, tmp, &packet_list, list_hook) {
+		icmp64_send(node->skb, ICMPERR_PORT_UNREACHABLE, 0);
+		free_node(node);
+	}
+	INIT_LIST_HEAD(&packet_list);
 	kmem_cache_destroy(node_cache);
+	rcu_barrier_bh(); /* Wait for the configurations retired by config_retire(). */
+	config_free(config);
 }
 
 int pktqueue_clone_config(struct pktqueue_config *clone)
@@ -196,28 +336,36 @@ int pktqueue_set_config(enum pktqueue_type type, size_t size, void *value)
 	struct pktqueue_config *tmp_config;
 	struct pktqueue_config *old_config;
 
-	if (type != MAX_PKTS) {
-		log_err("Unknown config type for the 'packet queue' module: %u", type);
-		return -EINVAL;
-	}
-
 	if (size != sizeof(__u64)) {
 		log_err("Expected an 8-byte integer, got %zu bytes.", size);
 		return -EINVAL;
 	}
 
-	tmp_config = kmalloc(sizeof(*tmp_config), GFP_KERNEL);
+	tmp_config = config_alloc(sizeof(*tmp_config), GFP_KERNEL);
 	if (!tmp_config)
 		return -ENOMEM;
 
 	old_config = config;
 	*tmp_config = *old_config;
 
-	tmp_config->max_pkts = *((__u64 *) value);
+	switch (type) {
+	case MAX_PKTS:
+		tmp_config->max_pkts = *((__u64 *) value);
+		break;
+	case MAX_PKTS_PER_SRC:
+		tmp_config->max_pkts_per_src = *((__u64 *) value);
+		break;
+	case MAX_PKTS_PER_POOL4:
+		tmp_config->max_pkts_per_pool4 = *((__u64 *) value);
+		break;
+	default:
+		log_err("Unknown config type for the 'packet queue' module: %u", type);
+		config_free(tmp_config);
+		return -EINVAL;
+	}
 
 	rcu_assign_pointer(config, tmp_config);
-	synchronize_rcu_bh();
-	kfree(old_config);
+	config_retire(old_config);
 	return 0;
 }
 
@@ -228,19 +376,17 @@ int pktqueue_remove(struct session_entry *session)
 	if (WARN(!session, "The packet table cannot contain NULL."))
 		return -EINVAL;
 
-	spin_lock_bh(&packets_lock);
-	node = rbtree_find(session, &packets, compare_fn, struct packet_node, tree_hook);
+	jool_lock_bh(&packets_lock, JLOCK_PKTQUEUE);
+	node = find_node(session);
 	if (!node) {
-		spin_unlock_bh(&packets_lock);
+		jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
 		return -ENOENT;
 	}
+	detach_node(node);
+	jool_unlock_bh(&packets_lock, JLOCK_PKTQUEUE);
 
-	rb_erase(&node->tree_hook, &packets);
-	packet_count--;
-	spin_unlock_bh(&packets_lock);
-	kfree_skb_queued(node->skb);
 	session_return(node->session);
-	kmem_cache_free(node_cache, node);
+	free_node(node);
 
 	log_debug("Pkt queue - I just cancelled a ICMP error.");
 	return 0;
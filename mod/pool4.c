@@ -1,25 +1,167 @@
 #include "nat64/mod/pool4.h"
 #include "nat64/comm/constants.h"
 #include "nat64/comm/str_utils.h"
-
+#include "nat64/mod/ipfix.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/stats.h"
+#include "nat64/mod/trace.h"
+
+#include <linux/bitmap.h>
+#include <linux/bsearch.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/workqueue.h>
+#include <net/ipv6.h>
 
 
 #define HTABLE_NAME pool4_table
 #define KEY_TYPE struct in_addr
 #define VALUE_TYPE struct pool4_node
-#define HASH_TABLE_SIZE 256
+#define HASH_TABLE_MAX_SIZE 256
 #define GENERATE_FOR_EACH
 #include "hash_table.c"
 
 
 static struct pool4_table pool;
 static DEFINE_SPINLOCK(pool_lock);
-static struct in_addr *last_used_addr;
+/** Seed of the hash that pairs IPv6 subscribers with IPv4 addresses (see affine_index()). */
+static u32 affinity_rnd;
 static int inactives_pool4_node_counter;
+/** Size of the port blocks. Zero if the pool lends ports one by one. See pool4_init(). */
+static unsigned int block_size;
+/** Number of port blocks each address can lend, per protocol. */
+static unsigned int block_count;
+/** Lend ports (and blocks) in random order? See poolnum_init(). */
+static bool randomize;
+/** Refill every CPU's magazines with the ports pool4_port_cpu() maps to it? */
+static bool port_affinity;
+/** With "port_affinity", the CPUs are dealt the ports in chunks of 2^PORT_SLICE_SHIFT. */
+#define PORT_SLICE_SHIFT 6
 
 /** Cache for struct pool4_nodes, for efficient allocation. */
 static struct kmem_cache *node_cache;
+/** The deterministic ranges (struct pool4_det) the pool's addresses belong to. */
+static LIST_HEAD(det_ranges);
+/**
+ * The active on-demand addresses that still have ports of each class to lend individually
+ * (listed through pool4_node.candidate_hooks). Protected by pool_lock.
+ * Dynamic allocation only looks at these, so exhausted addresses don't cost anything.
+ */
+static struct list_head candidates[POOL4_CLASS_COUNT];
+
+/** The ranges (struct pool4_range) whose addresses get nodes lazily. */
+static LIST_HEAD(ranges);
+/** Maximum length of a lazy range, as a power of two. */
+#define RANGE_MAX_BITS 16
+/** pool4_range.lends flag meaning the range's port range has room for at least one block. */
+#define RANGE_LENDS_BLOCKS (1u << POOL4_CLASS_COUNT)
+
+/** Number of ports (and IDs) deterministic ranges divide between their subscribers. */
+#define DET_PORTS (65536 - 1024)
+/** Maximum base 2 logarithm of the number of subscribers that can share a deterministic address. */
+#define DET_MAX_SHIFT 10
+/** Maximum length of a deterministic range, as a power of two. */
+#define DET_MAX_BITS 16
+
+/*
+ * Each CPU keeps a few free ports of its own ("magazines"), so most gets and returns don't have to
+ * touch pool_lock. The magazines are refilled from and drained into the pool in batches.
+ *
+ * Ports sitting in a magazine are still borrowed as far as their pool4_nodes are concerned.
+ * Whenever an address leaves the pool, "generation" is incremented and every magazine is emptied,
+ * so the node can die and its ports can't be lent anymore.
+ */
+
+/** Number of ports a CPU can hold per class. */
+#define MAG_SIZE 32
+/** Number of ports moved between a magazine and the pool at a time. */
+#define MAG_BATCH (MAG_SIZE / 2)
+
+/** Free ports of one class. The most recently added one is at the top ("count" - 1). */
+struct magazine {
+	struct ipv4_transport_addr entries[MAG_SIZE];
+	unsigned int count;
+};
+
+/** One CPU's magazines. */
+struct port_cache {
+	/** Protects the magazines. Always taken before pool_lock. */
+	spinlock_t lock;
+	/** Value "generation" had when the magazines were last emptied. */
+	unsigned int generation;
+	struct magazine mags[POOL4_CLASS_COUNT];
+};
+
+static struct port_cache __percpu *caches;
+/** Incremented whenever addresses leave the pool. Protected by pool_lock. */
+static unsigned int generation;
+
+/** Maximum number of returns a CPU holds back before handing them over anyway. */
+#define DEFERRED_MAX 256
+
+/**
+ * Ports a CPU is holding back between pool4_defer_returns() and pool4_flush_returns().
+ * Only touched by its own CPU, with bottom halves disabled.
+ */
+struct return_batch {
+	/** Number of pool4_defer_returns() calls that haven't been flushed yet. */
+	unsigned int depth;
+	unsigned int count;
+	struct deferred_return {
+		l4_protocol proto;
+		struct ipv4_transport_addr addr;
+	} entries[DEFERRED_MAX];
+};
+
+static struct return_batch __percpu *batches;
+
+/** What "caches" and "batches" cost, for the memory counters. */
+#define PERCPU_BYTES (num_possible_cpus() \
+		* (sizeof(struct port_cache) + sizeof(struct return_batch)))
+
+/**
+ * A sorted copy of the pool's active addresses, so lookups don't need pool_lock.
+ * Readers need rcu_read_lock_bh(); writers need pool_lock.
+ *
+ * "blocks" summarizes "entries" as one 256-bit membership bitmap per /24, sorted by prefix.
+ * pool4_contains() only needs those, so the packets that don't belong to the pool are rejected
+ * from a handful of read-only cache lines.
+ */
+struct pool4_snapshot {
+	unsigned int count;
+	unsigned int block_count;
+	struct pool4_snapshot_block {
+		/** The address's 24 most significant bits, in host byte order. */
+		__u32 prefix;
+		DECLARE_BITMAP(hosts, 256);
+	} *blocks;
+	/** The lazy ranges, which might not have entries yet. Sorted. */
+	unsigned int range_count;
+	struct pool4_snapshot_range {
+		/** The range's first and last addresses, in host byte order. */
+		__u32 first;
+		__u32 last;
+	} *ranges;
+	struct rcu_head rcu_hook;
+	struct pool4_snapshot_entry {
+		__u32 addr;
+		struct pool4_node *node;
+	} entries[0];
+};
+
+/** NULL means the snapshot could not be allocated; the lockless paths are then skipped. */
+static struct pool4_snapshot __rcu *snapshot;
+
+/**
+ * Rebuilds the snapshot on behalf of the packet path (see materialize()), which shouldn't be
+ * sorting the pool while it holds pool_lock.
+ */
+static void refresh_snapshot(struct work_struct *work);
+static DECLARE_WORK(snapshot_work, refresh_snapshot);
 
 static unsigned int ipv4_addr_hashcode(const struct in_addr *addr)
 {
@@ -44,16 +186,30 @@ static unsigned int ipv4_addr_hashcode(const struct in_addr *addr)
  */
 static bool pool4_is_full(struct pool4_node *node)
 {
+	if (node->det)
+		return true; /* Deterministic addresses don't lend anything. */
+
 	if (!poolnum_is_full(&node->icmp_ids))
 		goto is_not_full;
-	if (!poolnum_is_full(&node->tcp_ports.high))
-		goto is_not_full;
 	if (!poolnum_is_full(&node->tcp_ports.low))
 		goto is_not_full;
 	if (!poolnum_is_full(&node->udp_ports.low_even))
 		goto is_not_full;
 	if (!poolnum_is_full(&node->udp_ports.low_odd))
 		goto is_not_full;
+
+	if (block_size) {
+		if (!poolnum_is_full(&node->blocks.udp))
+			goto is_not_full;
+		if (!poolnum_is_full(&node->blocks.tcp))
+			goto is_not_full;
+		if (!poolnum_is_full(&node->blocks.icmp))
+			goto is_not_full;
+		return true;
+	}
+
+	if (!poolnum_is_full(&node->tcp_ports.high))
+		goto is_not_full;
 	if (!poolnum_is_full(&node->udp_ports.high_even))
 		goto is_not_full;
 	if (!poolnum_is_full(&node->udp_ports.high_odd))
@@ -66,11 +222,55 @@ is_not_full:
 }
 
 /**
+ * Returns the pool of "node" which contains the "l4_proto" block indexes.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct poolnum *get_blocks_from_pool4_node(struct pool4_node *node, l4_protocol l4_proto)
+{
+	switch (l4_proto) {
+	case L4PROTO_UDP:
+		return &node->blocks.udp;
+	case L4PROTO_TCP:
+		return &node->blocks.tcp;
+	case L4PROTO_ICMP:
+		return &node->blocks.icmp;
+	}
+
+	WARN(true, "Unsupported transport protocol: %u.", l4_proto);
+	return NULL;
+}
+
+/**
+ * Returns true if "id" is lent as part of a port block.
+ */
+static bool is_block_id(__u16 id)
+{
+	return block_size && id >= POOL4_BLOCK_MIN;
+}
+
+/**
+ * Returns the index of the block "id" belongs to, or -EINVAL if it doesn't belong to any.
+ * "id" is assumed to be a block ID (see is_block_id()).
+ */
+static int get_block_index(__u16 id)
+{
+	unsigned int index = (id - POOL4_BLOCK_MIN) / block_size;
+	return (index < block_count) ? index : -EINVAL;
+}
+
+/**
+ * Returns the pool "id" has to be borrowed from or returned to, assuming it's lent individually.
+ * Returns NULL if the pool lends "id" as part of a block.
+ *
  * Assumes that pool has already been locked (pool_lock).
  */
 static struct poolnum *get_poolnum_from_pool4_node(struct pool4_node *node, l4_protocol l4_proto,
 		__u16 id)
 {
+	if (is_block_id(id))
+		return NULL;
+
 	switch (l4_proto) {
 	case L4PROTO_UDP:
 		if (id < 1024)
@@ -89,44 +289,252 @@ static struct poolnum *get_poolnum_from_pool4_node(struct pool4_node *node, l4_p
 	return NULL;
 }
 
-static void initialize_last_used_addr(void)
+/**
+ * Returns the pool "node" lends its "class" ports from, or NULL if they're lent in blocks.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct poolnum *get_poolnum_by_class(struct pool4_node *node, int class)
 {
-	struct pool4_table_key_value *keyval;
-	keyval = list_entry(pool.list.next, struct pool4_table_key_value, list_hook);
-	last_used_addr = &keyval->key;
+	switch (class) {
+	case POOL4_CLASS_UDP_LOW_EVEN:
+		return &node->udp_ports.low_even;
+	case POOL4_CLASS_UDP_LOW_ODD:
+		return &node->udp_ports.low_odd;
+	case POOL4_CLASS_UDP_HIGH_EVEN:
+		return block_size ? NULL : &node->udp_ports.high_even;
+	case POOL4_CLASS_UDP_HIGH_ODD:
+		return block_size ? NULL : &node->udp_ports.high_odd;
+	case POOL4_CLASS_TCP_LOW:
+		return &node->tcp_ports.low;
+	case POOL4_CLASS_TCP_HIGH:
+		return block_size ? NULL : &node->tcp_ports.high;
+	case POOL4_CLASS_ICMP:
+		return &node->icmp_ids;
+	}
+
+	return NULL;
 }
 
-static void increment_last_used_addr(void)
+/**
+ * Lists "node" as a "class" candidate if it can lend one of those ports, and unlists it otherwise.
+ * Has to be called whenever the node's "class" ports, or its status, change.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void update_candidate(struct pool4_node *node, int class)
 {
-	struct pool4_table_key_value *keyval;
+	struct list_head *hook;
+	struct poolnum *ids;
+	bool candidate;
 
-	if (!last_used_addr) {
-		initialize_last_used_addr();
+	if (class < 0)
 		return;
+
+	hook = &node->candidate_hooks[class];
+	ids = node->det ? NULL : get_poolnum_by_class(node, class);
+	candidate = node->active && ids && !poolnum_is_empty(ids);
+
+	if (candidate && list_empty(hook))
+		list_add_tail(hook, &candidates[class]);
+	else if (!candidate && !list_empty(hook))
+		list_del_init(hook);
+}
+
+/**
+ * update_candidate()s every class of "node".
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void update_candidates(struct pool4_node *node)
+{
+	int class;
+
+	for (class = 0; class < POOL4_CLASS_COUNT; class++)
+		update_candidate(node, class);
+}
+
+static __u32 range_first(struct pool4_range *range)
+{
+	return be32_to_cpu(range->addr.s_addr);
+}
+
+static __u32 range_size(struct pool4_range *range)
+{
+	return 1u << (32 - range->addr_len);
+}
+
+/**
+ * Returns the range "addr" belongs to, or NULL if it's not part of any.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_range *find_range(const struct in_addr *addr)
+{
+	struct pool4_range *range;
+	__u32 addr32 = be32_to_cpu(addr->s_addr);
+
+	list_for_each_entry(range, &ranges, list_hook) {
+		if (addr32 - range_first(range) < range_size(range))
+			return range;
 	}
 
-	keyval = pool4_table_get_aux(&pool, last_used_addr);
-	if (WARN(!keyval, "The last used address is not part of the pool.")) {
-		initialize_last_used_addr();
-		return;
+	return NULL;
+}
+
+/**
+ * Sets "min", "max" and "step" as the numbers nodes lend as "class" ports.
+ * Returns false if the class is not lent one by one (ie. it's lent in blocks).
+ */
+static bool get_class_bounds(int class, int *min, int *max, int *step)
+{
+	switch (class) {
+	case POOL4_CLASS_UDP_LOW_EVEN:
+		*min = 0; *max = 1022; *step = 2;
+		return true;
+	case POOL4_CLASS_UDP_LOW_ODD:
+		*min = 1; *max = 1023; *step = 2;
+		return true;
+	case POOL4_CLASS_UDP_HIGH_EVEN:
+		*min = 1024; *max = 65534; *step = 2;
+		return !block_size;
+	case POOL4_CLASS_UDP_HIGH_ODD:
+		*min = 1025; *max = 65535; *step = 2;
+		return !block_size;
+	case POOL4_CLASS_TCP_LOW:
+		*min = 0; *max = 1023; *step = 1;
+		return true;
+	case POOL4_CLASS_TCP_HIGH:
+		*min = 1024; *max = 65535; *step = 1;
+		return !block_size;
+	case POOL4_CLASS_ICMP:
+		*min = 0; *max = block_size ? (POOL4_BLOCK_MIN - 1) : 65535; *step = 1;
+		return true;
 	}
 
-	if (list_is_last(&keyval->list_hook, &pool.list)) {
-		/* Wrap around. */
-		initialize_last_used_addr();
+	return false;
+}
 
-	} else {
-		/* Increment. */
-		keyval = list_entry(keyval->list_hook.next, struct pool4_table_key_value, list_hook);
-		last_used_addr = &keyval->key;
+/**
+ * Like get_class_bounds(), except the numbers are narrowed down to "port_min"-"port_max".
+ * Returns false if that leaves the class with no numbers.
+ */
+static bool clamp_class(int class, __u16 port_min, __u16 port_max, int *min, int *max,
+		int *step)
+{
+	if (!get_class_bounds(class, min, max, step))
+		return false;
+
+	if (*min < port_min)
+		*min += roundup(port_min - *min, *step);
+	if (*max > port_max)
+		*max -= roundup(*max - port_max, *step);
+
+	return *min <= *max;
+}
+
+/**
+ * The numbers a node lends as the ports of one class. See poolnum_init_runs().
+ */
+struct class_layout {
+	int min;
+	int step;
+	unsigned int per_run;
+	unsigned int stride;
+	unsigned int runs;
+};
+
+/**
+ * Sets "layout" as the numbers from the "min"-"max" class (whose numbers are "step" apart) that
+ * also belong to "range"'s PSID (see pool4_register_psid()). Each value of the port's first
+ * "psid_offset" bits yields one run of the set; only the runs that lie entirely within the class
+ * are kept (pool4_register_psid() makes sure no run straddles two classes).
+ * Returns false if that leaves the class with no numbers.
+ */
+static bool clamp_psid(struct pool4_range *range, int min, int max, int step,
+		struct class_layout *layout)
+{
+	unsigned int bits = 16 - range->psid_offset - range->psid_len;
+	unsigned int run = 1u << bits;
+	unsigned int stride = 1u << (16 - range->psid_offset);
+	unsigned int base = range->psid << bits;
+	/* The ports the class spans, regardless of parity. */
+	unsigned int lo = min - min % step;
+	unsigned int hi = max - max % step + step - 1;
+	unsigned int first, last, offset;
+
+	/* The runs whose first bits are all zero are excluded, unless there's nothing else. */
+	first = range->psid_offset ? 1 : 0;
+	last = (1u << range->psid_offset) - 1;
+
+	if (lo > base && DIV_ROUND_UP(lo - base, stride) > first)
+		first = DIV_ROUND_UP(lo - base, stride);
+	if (hi < base + run - 1)
+		return false;
+	if ((hi - base - run + 1) / stride < last)
+		last = (hi - base - run + 1) / stride;
+	if (first > last)
+		return false;
+
+	/* The runs start at multiples of "run", so they share their parity. */
+	offset = (min % step + step - base % step) % step;
+	if (offset >= run)
+		return false;
+
+	layout->min = base + first * stride + offset;
+	layout->step = step;
+	layout->per_run = DIV_ROUND_UP(run - offset, step);
+	layout->stride = stride;
+	layout->runs = last - first + 1;
+	return true;
+}
+
+/**
+ * Sets "layout" as the numbers nodes from "range" lend as "class" ports. "range" can be NULL, in
+ * which case the node is not restricted to any ports.
+ * Returns false if the class is left with no numbers, or is lent in blocks.
+ */
+static bool get_class_layout(int class, struct pool4_range *range, struct class_layout *layout)
+{
+	int min, max, step;
+
+	if (range && range->psid_len) {
+		return get_class_bounds(class, &min, &max, &step)
+				&& clamp_psid(range, min, max, step, layout);
 	}
+
+	if (!clamp_class(class, range ? range->port_min : 0, range ? range->port_max : 65535,
+			&min, &max, &step))
+		return false;
+
+	layout->min = min;
+	layout->step = step;
+	layout->per_run = (max - min) / step + 1;
+	layout->stride = layout->per_run * step;
+	layout->runs = 1;
+	return true;
 }
 
 /**
- * Assumes that pool has already been locked (pool_lock).
+ * Sets "first" and "last" as the indexes of the blocks that fit within "port_min"-"port_max".
+ * Returns false if there's none.
  */
-static void destroy_pool4_node(struct pool4_node *node)
+static bool clamp_blocks(__u16 port_min, __u16 port_max, int *first, int *last)
+{
+	*first = (port_min > POOL4_BLOCK_MIN)
+			? DIV_ROUND_UP(port_min - POOL4_BLOCK_MIN, block_size)
+			: 0;
+	*last = ((int) port_max + 1 - POOL4_BLOCK_MIN) / (int) block_size - 1;
+	if (*last > (int) block_count - 1)
+		*last = block_count - 1;
+
+	return *first <= *last;
+}
+
+static void free_pool4_node_rcu(struct rcu_head *rcu_hook)
 {
+	struct pool4_node *node = container_of(rcu_hook, struct pool4_node, rcu_hook);
+
 	poolnum_destroy(&node->udp_ports.low_even);
 	poolnum_destroy(&node->udp_ports.low_odd);
 	poolnum_destroy(&node->udp_ports.high_even);
@@ -134,27 +542,310 @@ static void destroy_pool4_node(struct pool4_node *node)
 	poolnum_destroy(&node->tcp_ports.low);
 	poolnum_destroy(&node->tcp_ports.high);
 	poolnum_destroy(&node->icmp_ids);
+	poolnum_destroy(&node->blocks.udp);
+	poolnum_destroy(&node->blocks.tcp);
+	poolnum_destroy(&node->blocks.icmp);
 
 	kmem_cache_free(node_cache, node);
+	jool_mem_add(JMEM_POOL4, -(long) sizeof(*node));
+}
+
+/**
+ * The node must no longer be reachable from the published snapshot.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void destroy_pool4_node(struct pool4_node *node)
+{
+	int class;
+
+	for (class = 0; class < POOL4_CLASS_COUNT; class++)
+		list_del_init(&node->candidate_hooks[class]);
+
+	if (node->det) {
+		node->det->nodes--;
+		if (!node->det->nodes) {
+			list_del(&node->det->list_hook);
+			kfree(node->det);
+			jool_mem_add(JMEM_POOL4, -(long) sizeof(*node->det));
+		}
+		node->det = NULL;
+	}
+
+	if (node->range) {
+		node->range->nodes--;
+		node->range = NULL;
+	}
+
+	if (!node->active)
+		inactives_pool4_node_counter--;
+
+	call_rcu_bh(&node->rcu_hook, free_pool4_node_rcu);
+}
+
+static int count_active(struct pool4_node *node, void *arg)
+{
+	if (node->active)
+		(*((unsigned int *) arg))++;
+	return 0;
+}
+
+static int add_to_snapshot(struct pool4_node *node, void *arg)
+{
+	struct pool4_snapshot *new = arg;
+
+	if (node->active) {
+		new->entries[new->count].addr = be32_to_cpu(node->addr.s_addr);
+		new->entries[new->count].node = node;
+		new->count++;
+	}
+	return 0;
+}
+
+static int compare_snapshot_entries(const void *a, const void *b)
+{
+	const struct pool4_snapshot_entry *entry1 = a;
+	const struct pool4_snapshot_entry *entry2 = b;
+
+	if (entry1->addr < entry2->addr)
+		return -1;
+	return entry1->addr > entry2->addr;
+}
+
+/**
+ * Fills "snap"'s blocks out of its entries, which must already be sorted.
+ */
+static void build_snapshot_blocks(struct pool4_snapshot *snap)
+{
+	struct pool4_snapshot_block *block = NULL;
+	unsigned int i;
+
+	snap->block_count = 0;
+	for (i = 0; i < snap->count; i++) {
+		__u32 addr = snap->entries[i].addr;
+
+		if (!block || block->prefix != (addr >> 8)) {
+			block = &snap->blocks[snap->block_count++];
+			block->prefix = addr >> 8;
+			bitmap_zero(block->hosts, 256);
+		}
+		__set_bit(addr & 0xFFu, block->hosts);
+	}
+}
+
+static int compare_snapshot_blocks(const void *key, const void *elem)
+{
+	__u32 prefix = *((const __u32 *) key);
+	const struct pool4_snapshot_block *block = elem;
+
+	if (prefix < block->prefix)
+		return -1;
+	return prefix > block->prefix;
+}
+
+static int compare_snapshot_ranges(const void *a, const void *b)
+{
+	const struct pool4_snapshot_range *range1 = a;
+	const struct pool4_snapshot_range *range2 = b;
+
+	if (range1->first < range2->first)
+		return -1;
+	return range1->first > range2->first;
+}
+
+/**
+ * bsearch() comparator; "key" is a __u32 address.
+ */
+static int compare_addr_to_range(const void *key, const void *elem)
+{
+	__u32 addr = *((const __u32 *) key);
+	const struct pool4_snapshot_range *range = elem;
+
+	if (addr < range->first)
+		return -1;
+	return addr > range->last;
+}
+
+/**
+ * Returns the length of a snapshot of "count" addresses and "range_count" ranges.
+ */
+static size_t snapshot_size(unsigned int count, unsigned int range_count)
+{
+	struct pool4_snapshot *snap;
+
+	return sizeof(*snap) + count * sizeof(snap->entries[0]) + count * sizeof(snap->blocks[0])
+			+ range_count * sizeof(snap->ranges[0]);
+}
+
+static void free_snapshot(struct pool4_snapshot *snap)
+{
+	if (snap) {
+		jool_mem_add(JMEM_POOL4, -(long) snapshot_size(snap->count, snap->range_count));
+		kfree(snap);
+	}
+}
+
+static void free_snapshot_rcu(struct rcu_head *rcu_hook)
+{
+	free_snapshot(container_of(rcu_hook, struct pool4_snapshot, rcu_hook));
+}
+
+/**
+ * Publishes a new snapshot, to reflect the pool's current active addresses.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void rebuild_snapshot(void)
+{
+	struct pool4_snapshot *new, *old;
+	struct pool4_range *range;
+	unsigned int count = 0;
+	unsigned int range_count = 0;
+
+	pool4_table_for_each(&pool, count_active, &count);
+	list_for_each_entry(range, &ranges, list_hook)
+		range_count++;
+
+	/* There can't be more /24s than addresses, so all the arrays can share the allocation. */
+	new = kmalloc(snapshot_size(count, range_count), GFP_ATOMIC);
+	if (new) {
+		jool_mem_add(JMEM_POOL4, snapshot_size(count, range_count));
+		new->count = 0;
+		new->blocks = (struct pool4_snapshot_block *) &new->entries[count];
+		pool4_table_for_each(&pool, add_to_snapshot, new);
+		sort(new->entries, new->count, sizeof(new->entries[0]), compare_snapshot_entries, NULL);
+		build_snapshot_blocks(new);
+
+		new->ranges = (struct pool4_snapshot_range *) &new->blocks[count];
+		new->range_count = 0;
+		list_for_each_entry(range, &ranges, list_hook) {
+			new->ranges[new->range_count].first = range_first(range);
+			new->ranges[new->range_count].last = range_first(range) + range_size(range) - 1;
+			new->range_count++;
+		}
+		sort(new->ranges, new->range_count, sizeof(new->ranges[0]), compare_snapshot_ranges,
+				NULL);
+	} else {
+		log_err("Could not allocate the IPv4 pool's snapshot; it will be slower for a while.");
+	}
+
+	old = rcu_dereference_protected(snapshot, lockdep_is_held(&pool_lock));
+	rcu_assign_pointer(snapshot, new);
+	if (old)
+		call_rcu_bh(&old->rcu_hook, free_snapshot_rcu);
+}
+
+static void refresh_snapshot(struct work_struct *work)
+{
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	rebuild_snapshot();
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+}
+
+/**
+ * Returns the active node whose address is "addr", or NULL if it doesn't exist or "snap" is NULL.
+ * The caller must hold rcu_read_lock_bh().
+ */
+static struct pool4_node *snapshot_find(struct pool4_snapshot *snap, const struct in_addr *addr)
+{
+	struct pool4_snapshot_entry key, *entry;
+
+	if (!snap)
+		return NULL;
+
+	key.addr = be32_to_cpu(addr->s_addr);
+	entry = bsearch(&key, snap->entries, snap->count, sizeof(key), compare_snapshot_entries);
+	return entry ? entry->node : NULL;
+}
+
+/**
+ * Returns whether "addr" (host byte order) is one of "snap"'s addresses.
+ * "snap" cannot be NULL. The caller must hold rcu_read_lock_bh().
+ */
+static bool snapshot_contains(struct pool4_snapshot *snap, __u32 addr)
+{
+	__u32 prefix = addr >> 8;
+	struct pool4_snapshot_block *block;
+
+	block = bsearch(&prefix, snap->blocks, snap->block_count, sizeof(*block),
+			compare_snapshot_blocks);
+	if (block && test_bit(addr & 0xFFu, block->hosts))
+		return true;
+
+	return bsearch(&addr, snap->ranges, snap->range_count, sizeof(snap->ranges[0]),
+			compare_addr_to_range) != NULL;
+}
+
+/**
+ * Returns the index of the entry from "snap" whose address "addr6" should prefer, so the same
+ * subscriber keeps getting the same address without the pool needing to remember anything about
+ * it. "snap" must not be empty.
+ */
+static unsigned int affine_index(struct pool4_snapshot *snap, const struct in6_addr *addr6)
+{
+	return jhash2((const u32 *) addr6->s6_addr32, 4, affinity_rnd) % snap->count;
 }
 
-int pool4_init(char *addr_strs[], int addr_count)
+int pool4_init(char *addr_strs[], int addr_count, unsigned int block_size_requested,
+		bool randomize_ports, bool per_cpu_ports)
 {
 	char *defaults[] = POOL4_DEF;
 	unsigned int i;
+	int cpu;
 	int error;
 
+	if (block_size_requested > 65536 - POOL4_BLOCK_MIN) {
+		log_err("Port blocks cannot be larger than %u ports.", 65536 - POOL4_BLOCK_MIN);
+		return -EINVAL;
+	}
+	block_size = block_size_requested;
+	randomize = randomize_ports;
+	port_affinity = per_cpu_ports;
+	block_count = block_size ? ((65536 - POOL4_BLOCK_MIN) / block_size) : 0;
+	if (block_size)
+		log_info("The IPv4 pool will lend ports in blocks of %u.", block_size);
+
 	error = pool4_table_init(&pool, ipv4_addr_equals, ipv4_addr_hashcode);
 	if (error)
 		return error;
 
 	node_cache = kmem_cache_create("jool_pool4_nodes", sizeof(struct pool4_node), 0, 0, NULL);
 	if (!node_cache) {
-		pool4_table_empty(&pool, destroy_pool4_node);
+		pool4_table_destroy(&pool, destroy_pool4_node);
 		log_err("Could not allocate the IPv4 node cache.");
 		return -ENOMEM;
 	}
 
+	caches = alloc_percpu(struct port_cache);
+	if (!caches) {
+		pool4_table_destroy(&pool, destroy_pool4_node);
+		kmem_cache_destroy(node_cache);
+		log_err("Could not allocate the IPv4 pool's port caches.");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		struct port_cache *cache = per_cpu_ptr(caches, cpu);
+		memset(cache, 0, sizeof(*cache));
+		spin_lock_init(&cache->lock);
+	}
+	batches = alloc_percpu(struct return_batch);
+	if (!batches) {
+		free_percpu(caches);
+		pool4_table_destroy(&pool, destroy_pool4_node);
+		kmem_cache_destroy(node_cache);
+		log_err("Could not allocate the IPv4 pool's return batches.");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(batches, cpu), 0, sizeof(struct return_batch));
+	for (i = 0; i < POOL4_CLASS_COUNT; i++)
+		INIT_LIST_HEAD(&candidates[i]);
+	jool_mem_add(JMEM_POOL4, PERCPU_BYTES);
+	generation = 0;
+	RCU_INIT_POINTER(snapshot, NULL);
+	get_random_bytes(&affinity_rnd, sizeof(affinity_rnd));
+	inactives_pool4_node_counter = 0;
+
 	if (!addr_strs || addr_count == 0) {
 		addr_strs = defaults;
 		addr_count = ARRAY_SIZE(defaults);
@@ -175,9 +866,6 @@ int pool4_init(char *addr_strs[], int addr_count)
 			goto fail;
 	}
 
-	last_used_addr = NULL;
-	inactives_pool4_node_counter = 0;
-
 	return 0;
 
 fail:
@@ -185,388 +873,1888 @@ fail:
 	return error;
 }
 
+/**
+ * Forgets every range. Their nodes must have already been detached from them.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void free_ranges(void)
+{
+	struct pool4_range *range, *tmp;
+
+	list_for_each_entry_safe(range, tmp, &ranges, list_hook) {
+		list_del(&range->list_hook);
+		kfree(range);
+		jool_mem_add(JMEM_POOL4, -(long) sizeof(*range));
+	}
+}
+
 void pool4_destroy(void)
 {
-	pool4_table_empty(&pool, destroy_pool4_node);
+	struct pool4_snapshot *snap;
+
+	cancel_work_sync(&snapshot_work);
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	snap = rcu_dereference_protected(snapshot, lockdep_is_held(&pool_lock));
+	RCU_INIT_POINTER(snapshot, NULL);
+	pool4_table_destroy(&pool, destroy_pool4_node);
+	free_ranges();
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	free_snapshot(snap);
+	free_percpu(caches);
+	free_percpu(batches);
+	jool_mem_add(JMEM_POOL4, -(long) PERCPU_BYTES);
+	/* Wait for the nodes' RCU callbacks before their cache dies. */
+	rcu_barrier_bh();
 	kmem_cache_destroy(node_cache);
 }
 
 /**
+ * Stops "node" from being lent. It will actually die once all of its ports have been returned.
+ * Remember to rebuild_snapshot() afterwards.
+ *
  * Assumes that pool has already been locked (pool_lock).
  */
-static int deactivate_or_destroy_pool4_node(struct pool4_node *node, void * arg)
+static int deactivate_pool4_node(struct pool4_node *node, void *arg)
 {
-	int error = 0;
-
-	if (!node) {
-		error = -EINVAL;
-		goto end;
-	}
-	if (!pool4_is_full(node)) {
-		if (node->active) {
-			node->active = false;
-			inactives_pool4_node_counter++;
+	if (node->active) {
+		node->active = false;
+		inactives_pool4_node_counter++;
+		update_candidates(node);
+		/* The range might die before the node does. */
+		if (node->range) {
+			node->range->nodes--;
+			node->range = NULL;
 		}
-		error =  0;
-		goto end;
 	}
-	if (!pool4_table_remove(&pool, &node->addr, destroy_pool4_node))
-		error = -EINVAL;
-
-end:
-	return error;
-}
-
-int pool4_flush(void)
-{
-	pool4_for_each(deactivate_or_destroy_pool4_node, NULL);
 	return 0;
 }
 
-int pool4_register(struct in_addr *addr)
-{
+/**
+ * Destroys "node" if it's inactive and all of its ports have been returned.
+ * The snapshot must already not contain "node".
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int destroy_if_idle(struct pool4_node *node, void *arg)
+{
+	if (node->active || !pool4_is_full(node))
+		return 0;
+	return pool4_table_remove(&pool, &node->addr, destroy_pool4_node) ? 0 : -EINVAL;
+}
+
+/**
+ * Which protocol "class"'s ports belong to.
+ */
+static const l4_protocol class_protos[] = {
+	L4PROTO_UDP, L4PROTO_UDP, L4PROTO_UDP, L4PROTO_UDP, L4PROTO_TCP, L4PROTO_TCP, L4PROTO_ICMP,
+};
+
+/**
+ * Returns the class "id" belongs to, or -1 if "id" is not cached (ie. it's lent in blocks).
+ */
+static int get_class(l4_protocol proto, __u16 id)
+{
+	if (is_block_id(id))
+		return -1;
+
+	switch (proto) {
+	case L4PROTO_UDP:
+		if (id < 1024)
+			return (id % 2 == 0) ? POOL4_CLASS_UDP_LOW_EVEN : POOL4_CLASS_UDP_LOW_ODD;
+		return (id % 2 == 0) ? POOL4_CLASS_UDP_HIGH_EVEN : POOL4_CLASS_UDP_HIGH_ODD;
+	case L4PROTO_TCP:
+		return (id < 1024) ? POOL4_CLASS_TCP_LOW : POOL4_CLASS_TCP_HIGH;
+	case L4PROTO_ICMP:
+		return POOL4_CLASS_ICMP;
+	}
+
+	return -1;
+}
+
+static int return_locked(const l4_protocol l4_proto, const struct ipv4_transport_addr *addr);
+
+/**
+ * Hands all of "cache"'s ports back to the pool.
+ *
+ * "cache"'s lock and pool_lock must already be held.
+ */
+static void cache_drain(struct port_cache *cache)
+{
+	struct magazine *mag;
+	unsigned int c, i;
+
+	for (c = 0; c < POOL4_CLASS_COUNT; c++) {
+		mag = &cache->mags[c];
+		for (i = 0; i < mag->count; i++)
+			return_locked(class_protos[c], &mag->entries[i]);
+		mag->count = 0;
+	}
+
+	cache->generation = generation;
+}
+
+/**
+ * Locks and returns the running CPU's port cache, emptying it first if it's outdated.
+ */
+static struct port_cache *cache_lock(void)
+{
+	struct port_cache *cache;
+
+	local_bh_disable();
+	cache = this_cpu_ptr(caches);
+	spin_lock(&cache->lock);
+
+	if (cache->generation != ACCESS_ONCE(generation)) {
+		jool_lock(&pool_lock, JLOCK_POOL4);
+		cache_drain(cache);
+		jool_unlock(&pool_lock, JLOCK_POOL4);
+	}
+
+	return cache;
+}
+
+static void cache_unlock(struct port_cache *cache)
+{
+	spin_unlock(&cache->lock);
+	local_bh_enable();
+}
+
+/**
+ * Empties every CPU's port cache. Slow; only meant for the configuration and exhaustion paths.
+ */
+static void drain_all_caches(void)
+{
+	struct port_cache *cache;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(caches, cpu);
+		spin_lock_bh(&cache->lock);
+		jool_lock(&pool_lock, JLOCK_POOL4);
+		cache_drain(cache);
+		jool_unlock(&pool_lock, JLOCK_POOL4);
+		spin_unlock_bh(&cache->lock);
+	}
+}
+
+/**
+ * Removes "mag"'s "index"th entry, preserving the order of the rest.
+ */
+static void mag_take(struct magazine *mag, unsigned int index, struct ipv4_transport_addr *result)
+{
+	*result = mag->entries[index];
+	mag->count--;
+	memmove(&mag->entries[index], &mag->entries[index + 1],
+			(mag->count - index) * sizeof(mag->entries[0]));
+}
+
+/**
+ * Looks for a port of "addr" in "mag". Returns its index, or -ENOENT.
+ */
+static int mag_find_addr(struct magazine *mag, const struct in_addr *addr)
+{
+	int i;
+
+	for (i = mag->count - 1; i >= 0; i--)
+		if (ipv4_addr_equals(&mag->entries[i].l3, addr))
+			return i;
+
+	return -ENOENT;
+}
+
+int pool4_flush(void)
+{
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	pool4_table_for_each(&pool, deactivate_pool4_node, NULL);
+	free_ranges();
+	rebuild_snapshot();
+	generation++;
+	pool4_table_for_each(&pool, destroy_if_idle, NULL);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	drain_all_caches();
+	return 0;
+}
+
+/**
+ * Initializes "node"'s ports and IDs, except the ones "range" doesn't lend. "range" can be NULL,
+ * in which case all of them are initialized.
+ */
+static int init_poolnums(struct pool4_node *node, struct pool4_range *range)
+{
+	struct poolnum *ids;
+	struct class_layout layout;
+	int class, min, max;
+	int error;
+
+	for (class = 0; class < POOL4_CLASS_COUNT; class++) {
+		ids = get_poolnum_by_class(node, class);
+		if (!ids)
+			continue;
+
+		error = get_class_layout(class, range, &layout)
+				? poolnum_init_runs(ids, layout.min, layout.step, layout.per_run,
+						layout.stride, layout.runs, randomize)
+				: poolnum_init_empty(ids);
+		if (error)
+			return error;
+	}
+
+	if (!block_size)
+		return 0;
+
+	/* PSID ranges don't exist in port block mode. */
+	if (!clamp_blocks(range ? range->port_min : 0, range ? range->port_max : 65535, &min, &max)) {
+		poolnum_init_empty(&node->blocks.udp);
+		poolnum_init_empty(&node->blocks.tcp);
+		return poolnum_init_empty(&node->blocks.icmp);
+	}
+
+	error = poolnum_init(&node->blocks.udp, min, max, 1, randomize);
+	if (error)
+		return error;
+	error = poolnum_init(&node->blocks.tcp, min, max, 1, randomize);
+	if (error)
+		return error;
+	return poolnum_init(&node->blocks.icmp, min, max, 1, randomize);
+}
+
+/**
+ * Returns the pool4_range.lends flags of "range".
+ */
+static unsigned int get_lent_classes(struct pool4_range *range)
+{
+	struct class_layout layout;
+	unsigned int result = 0;
+	int class, min, max;
+
+	for (class = 0; class < POOL4_CLASS_COUNT; class++)
+		if (get_class_layout(class, range, &layout))
+			result |= 1u << class;
+	if (block_size && clamp_blocks(range->port_min, range->port_max, &min, &max))
+		result |= RANGE_LENDS_BLOCKS;
+
+	return result;
+}
+
+/**
+ * Allocates a node for "addr". It's active but nothing else is initialized.
+ */
+static struct pool4_node *alloc_node(const struct in_addr *addr)
+{
+	struct pool4_node *node;
+	int class;
+
+	node = kmem_cache_alloc(node_cache, GFP_ATOMIC);
+	if (!node) {
+		log_err("Allocation of IPv4 pool node failed.");
+		return NULL;
+	}
+	jool_mem_add(JMEM_POOL4, sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	for (class = 0; class < POOL4_CLASS_COUNT; class++)
+		INIT_LIST_HEAD(&node->candidate_hooks[class]);
+
+	node->addr = *addr;
+	node->active = true;
+	return node;
+}
+
+/**
+ * Adds "addr" to the pool. If "det" is NULL, it will lend its ports on demand. Otherwise it will
+ * become part of the "det" range.
+ */
+static int register_addr(struct in_addr *addr, struct pool4_det *det)
+{
 	struct pool4_node *new_node, *node;
 	int error;
 
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	node = pool4_table_get(&pool, addr);
+	if (find_range(addr) || (node && (node->active || det))) {
+		jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+		log_err("Address %pI4 already belongs to the pool.", addr);
+		return -EINVAL;
+	}
+	if (node) {
+		node->active = true;
+		inactives_pool4_node_counter--;
+		update_candidates(node);
+		rebuild_snapshot();
+		jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+		return 0;
+	}
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	new_node = alloc_node(addr);
+	if (!new_node)
+		return -ENOMEM;
+	if (!det) {
+		error = init_poolnums(new_node, NULL);
+		if (error)
+			goto failure;
+	}
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	if (find_range(addr)) {
+		log_err("Address %pI4 already belongs to the pool.", addr);
+		error = -EINVAL;
+	} else {
+		error = pool4_table_put(&pool, addr, new_node);
+	}
+	if (!error) {
+		if (det) {
+			/* pool4_register_det() rebuilds the snapshot once it's done. */
+			new_node->det = det;
+			det->nodes++;
+		} else {
+			update_candidates(new_node);
+			rebuild_snapshot();
+		}
+	}
+
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	if (error)
+		goto failure;
+	return 0;
+
+failure:
+	destroy_pool4_node(new_node);
+	return error;
+}
+
+int pool4_register(struct in_addr *addr)
+{
 	if (WARN(!addr, "NULL cannot be inserted to the pool."))
 		return -EINVAL;
+	return register_addr(addr, NULL);
+}
+
+/**
+ * Gives "addr", which belongs to "range", a node. If "addr" has an inactive node left over from a
+ * previous configuration, that one is recycled (along with whatever ports it had).
+ * Returns NULL on allocation failure.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_node *materialize(struct pool4_range *range, const struct in_addr *addr)
+{
+	struct pool4_node *node;
 
-	spin_lock_bh(&pool_lock);
 	node = pool4_table_get(&pool, addr);
 	if (node) {
-		if (node->active) {
-			spin_unlock_bh(&pool_lock);
-			log_err("Address %pI4 already belongs to the pool.", addr);
-			return -EINVAL;
-		} else {
-			node->active = true;
-			inactives_pool4_node_counter--;
-			spin_unlock_bh(&pool_lock);
-			return 0;
+		node->active = true;
+		inactives_pool4_node_counter--;
+		goto adopt;
+	}
+
+	node = alloc_node(addr);
+	if (!node)
+		return NULL;
+	if (init_poolnums(node, range)
+			|| pool4_table_put(&pool, addr, node)) {
+		log_err("Could not create %pI4's node.", addr);
+		destroy_pool4_node(node);
+		return NULL;
+	}
+	/* Fall through. */
+
+adopt:
+	node->range = range;
+	range->nodes++;
+	update_candidates(node);
+	/*
+	 * This usually runs on the packet path, so the rebuild is left to snapshot_work. Until it
+	 * catches up, the old snapshot simply lacks the new node, which the lockless paths already
+	 * treat as "ask the locked path" (and pool4_contains() finds the node's range anyway).
+	 */
+	schedule_work(&snapshot_work);
+	return node;
+}
+
+/**
+ * Returns "addr"'s active node, creating it if "addr" belongs to a range and has never been needed
+ * before. Returns NULL if "addr" is not part of the pool.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_node *get_node(const struct in_addr *addr)
+{
+	struct pool4_node *node;
+	struct pool4_range *range;
+
+	node = pool4_table_get(&pool, addr);
+	if (node && node->active)
+		return node;
+
+	range = find_range(addr);
+	return range ? materialize(range, addr) : NULL;
+}
+
+/**
+ * Creates the node of the first range address that doesn't have one yet, looking only in the
+ * ranges that can lend "lends" (see pool4_range.lends). Returns NULL if there's no such address.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_node *materialize_next(unsigned int lends)
+{
+	struct pool4_range *range;
+	struct pool4_node *node;
+	struct in_addr addr;
+
+	list_for_each_entry(range, &ranges, list_hook) {
+		if (!(range->lends & lends))
+			continue;
+
+		while (range->next < range_size(range)) {
+			addr.s_addr = cpu_to_be32(range_first(range) + range->next);
+			node = pool4_table_get(&pool, &addr);
+			if (node && node->active) {
+				range->next++;
+				continue;
+			}
+
+			node = materialize(range, &addr);
+			if (node)
+				range->next++;
+			return node;
 		}
 	}
-	spin_unlock_bh(&pool_lock);
 
-	new_node = kmem_cache_alloc(node_cache, GFP_ATOMIC);
-	if (!new_node) {
-		log_err("Allocation of IPv4 pool node failed.");
+	return NULL;
+}
+
+/**
+ * Returns true if "a" and "b" intersect.
+ */
+static bool prefixes6_intersect(struct ipv6_prefix *a, struct ipv6_prefix *b)
+{
+	return ipv6_prefix_equal(&a->address, &b->address, min(a->len, b->len));
+}
+
+int pool4_register_det(struct in_addr *addr, __u8 addr_len, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len)
+{
+	struct pool4_det *det, *tmp;
+	struct pool4_node *node;
+	struct in_addr current_addr;
+	__u32 first, count, i;
+	int shift;
+	int error;
+
+	if (WARN(!addr || !prefix6, "NULL cannot be inserted to the pool."))
+		return -EINVAL;
+
+	if (addr_len > 32 || 32 - addr_len > DET_MAX_BITS) {
+		log_err("Deterministic ranges must contain between 1 and %u addresses.",
+				1 << DET_MAX_BITS);
+		return -EINVAL;
+	}
+	if (prefix6->len > 128 || subscriber_len > 128 || subscriber_len < prefix6->len) {
+		log_err("The subscriber length must be between the prefix length and 128.");
+		return -EINVAL;
+	}
+	shift = (subscriber_len - prefix6->len) - (32 - addr_len);
+	if (shift < 0 || shift > DET_MAX_SHIFT) {
+		log_err("%pI6c/%u has 2^%u subscribers; the range %pI4/%u can only serve between 2^%u "
+				"and 2^%u of them.", &prefix6->address, prefix6->len,
+				subscriber_len - prefix6->len, addr, addr_len, 32 - addr_len,
+				32 - addr_len + DET_MAX_SHIFT);
+		return -EINVAL;
+	}
+
+	first = be32_to_cpu(addr->s_addr);
+	count = 1 << (32 - addr_len);
+	if (first & (count - 1)) {
+		log_err("%pI4 is not the first address of a /%u range.", addr, addr_len);
+		return -EINVAL;
+	}
+
+	det = kmalloc(sizeof(*det), GFP_ATOMIC);
+	if (!det) {
+		log_err("Allocation of deterministic range failed.");
 		return -ENOMEM;
 	}
-	memset(new_node, 0, sizeof(*new_node));
+	jool_mem_add(JMEM_POOL4, sizeof(*det));
+	det->addr = *addr;
+	det->addr_len = addr_len;
+	det->prefix6 = *prefix6;
+	det->subscriber_len = subscriber_len;
+	det->shift = shift;
+	det->ports = DET_PORTS >> shift;
+	det->nodes = 0;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	list_for_each_entry(tmp, &det_ranges, list_hook) {
+		if (prefixes6_intersect(&tmp->prefix6, prefix6)) {
+			jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+			log_err("%pI6c/%u is already mapped to %pI4/%u.", &tmp->prefix6.address,
+					tmp->prefix6.len, &tmp->addr, tmp->addr_len);
+			kfree(det);
+			jool_mem_add(JMEM_POOL4, -(long) sizeof(*det));
+			return -EEXIST;
+		}
+	}
+	list_add_tail(&det->list_hook, &det_ranges);
+	/* Hold the range until every address has been registered. */
+	det->nodes++;
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	for (i = 0; i < count; i++) {
+		current_addr.s_addr = cpu_to_be32(first + i);
+		error = register_addr(&current_addr, det);
+		if (error)
+			goto failure;
+	}
 
-	new_node->addr = *addr;
-	new_node->active = true;
-	error = poolnum_init(&new_node->udp_ports.low_even, 0, 1022, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->udp_ports.low_odd, 1, 1023, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->udp_ports.high_even, 1024, 65534, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->udp_ports.high_odd, 1025, 65535, 2);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->tcp_ports.low, 0, 1023, 1);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->tcp_ports.high, 1024, 65535, 1);
-	if (error)
-		goto failure;
-	error = poolnum_init(&new_node->icmp_ids, 0, 65535, 1);
-	if (error)
-		goto failure;
+	log_info("%pI4/%u is now mapped deterministically to %pI6c/%u (%u ports per /%u).",
+			addr, addr_len, &prefix6->address, prefix6->len, det->ports, subscriber_len);
+	error = 0;
+	goto end;
+
+failure:
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	while (i > 0) {
+		i--;
+		current_addr.s_addr = cpu_to_be32(first + i);
+		node = pool4_table_get(&pool, &current_addr);
+		if (node)
+			deactivate_pool4_node(node, NULL);
+	}
+	/* Make sure the nodes are unreachable before they die. */
+	rebuild_snapshot();
+	pool4_table_for_each(&pool, destroy_if_idle, NULL);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	/* Fall through. */
+
+end:
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	rebuild_snapshot();
+	det->nodes--;
+	if (!det->nodes) {
+		list_del(&det->list_hook);
+		kfree(det);
+		jool_mem_add(JMEM_POOL4, -(long) sizeof(*det));
+	}
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return error;
+}
+
+/**
+ * pool4_table_for_each() callback; fails if "node" is active and within "arg"'s bounds.
+ */
+static int node_within(struct pool4_node *node, void *arg)
+{
+	__u32 *bounds = arg;
+	__u32 addr = be32_to_cpu(node->addr.s_addr);
+
+	return (node->active && addr - bounds[0] < bounds[1]) ? -EEXIST : 0;
+}
+
+/**
+ * Returns true if the ranges "first1"/"count1" and "first2"/"count2" intersect.
+ */
+static bool ranges4_intersect(__u32 first1, __u32 count1, __u32 first2, __u32 count2)
+{
+	return (__u64) first1 < (__u64) first2 + count2 && (__u64) first2 < (__u64) first1 + count1;
+}
+
+/**
+ * Allocates a range for "addr"/"addr_len", after validating them.
+ * The caller has to initialize the range's ports.
+ */
+static struct pool4_range *alloc_range(struct in_addr *addr, __u8 addr_len)
+{
+	struct pool4_range *range;
+	__u32 size;
+
+	if (WARN(!addr, "NULL cannot be inserted to the pool."))
+		return ERR_PTR(-EINVAL);
+
+	if (addr_len > 32 || 32 - addr_len > RANGE_MAX_BITS) {
+		log_err("Address ranges must contain between 1 and %u addresses.", 1 << RANGE_MAX_BITS);
+		return ERR_PTR(-EINVAL);
+	}
+	size = 1u << (32 - addr_len);
+	if (be32_to_cpu(addr->s_addr) & (size - 1)) {
+		log_err("%pI4 is not the first address of a /%u range.", addr, addr_len);
+		return ERR_PTR(-EINVAL);
+	}
 
-	spin_lock_bh(&pool_lock);
+	range = kmalloc(sizeof(*range), GFP_ATOMIC);
+	if (!range) {
+		log_err("Allocation of IPv4 range failed.");
+		return ERR_PTR(-ENOMEM);
+	}
+	jool_mem_add(JMEM_POOL4, sizeof(*range));
+	range->addr = *addr;
+	range->addr_len = addr_len;
+	range->port_min = 0;
+	range->port_max = 65535;
+	range->psid_len = 0;
+	range->psid_offset = 0;
+	range->psid = 0;
+	range->next = 0;
+	range->nodes = 0;
+	return range;
+}
 
-	error = pool4_table_put(&pool, addr, new_node);
+/**
+ * Adds "range" to the pool, or frees it if it intersects with the pool's addresses.
+ */
+static int add_range(struct pool4_range *range)
+{
+	struct pool4_range *tmp;
+	struct pool4_det *det;
+	__u32 bounds[2];
+	int error;
 
-	spin_unlock_bh(&pool_lock);
+	bounds[0] = range_first(range);
+	bounds[1] = range_size(range);
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	list_for_each_entry(tmp, &ranges, list_hook) {
+		if (ranges4_intersect(bounds[0], bounds[1], range_first(tmp), range_size(tmp)))
+			goto exists;
+	}
+	list_for_each_entry(det, &det_ranges, list_hook) {
+		if (ranges4_intersect(bounds[0], bounds[1], be32_to_cpu(det->addr.s_addr),
+				1u << (32 - det->addr_len)))
+			goto exists;
+	}
+	error = pool4_table_for_each(&pool, node_within, bounds);
+	if (error)
+		goto exists;
+
+	list_add_tail(&range->list_hook, &ranges);
+	rebuild_snapshot();
+
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return 0;
+
+exists:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	log_err("%pI4/%u intersects with addresses that already belong to the pool.", &range->addr,
+			range->addr_len);
+	kfree(range);
+	jool_mem_add(JMEM_POOL4, -(long) sizeof(*range));
+	return -EEXIST;
+}
+
+int pool4_register_range(struct in_addr *addr, __u8 addr_len, __u16 port_min, __u16 port_max)
+{
+	struct pool4_range *range;
+	int error;
+
+	if (port_min > port_max) {
+		log_err("The port range %u-%u is empty.", port_min, port_max);
+		return -EINVAL;
+	}
+
+	range = alloc_range(addr, addr_len);
+	if (IS_ERR(range))
+		return PTR_ERR(range);
+	range->port_min = port_min;
+	range->port_max = port_max;
+	range->lends = get_lent_classes(range);
+
+	if (!range->lends) {
+		log_err("Ports %u-%u are not enough to lend anything.", port_min, port_max);
+		kfree(range);
+		jool_mem_add(JMEM_POOL4, -(long) sizeof(*range));
+		return -EINVAL;
+	}
+
+	error = add_range(range);
+	if (error)
+		return error;
+
+	log_info("%pI4/%u (ports %u-%u) was added to the pool.", addr, addr_len, port_min,
+			port_max);
+	return 0;
+}
+
+int pool4_register_psid(struct in_addr *addr, __u8 addr_len, __u16 psid, __u8 psid_len,
+		__u8 psid_offset)
+{
+	struct pool4_range *range;
+	int error;
+
+	if (block_size) {
+		log_err("PSIDs cannot be used in port block mode.");
+		return -EINVAL;
+	}
+	/*
+	 * The runs of ports have to be aligned to the well-known ports boundary (1024), so none of
+	 * them is split between two classes.
+	 */
+	if (psid_len < 1 || psid_offset + psid_len > 16 || psid_offset + psid_len < 6) {
+		log_err("The PSID offset and length must add up to 6-16 (and the length can't be zero).");
+		return -EINVAL;
+	}
+	if (psid >> psid_len) {
+		log_err("PSID %u does not fit in %u bits.", psid, psid_len);
+		return -EINVAL;
+	}
+
+	range = alloc_range(addr, addr_len);
+	if (IS_ERR(range))
+		return PTR_ERR(range);
+	range->psid = psid;
+	range->psid_len = psid_len;
+	range->psid_offset = psid_offset;
+	range->lends = get_lent_classes(range);
+
+	error = add_range(range);
+	if (error)
+		return error;
+
+	log_info("%pI4/%u (PSID %u, length %u, offset %u) was added to the pool.", addr, addr_len,
+			psid, psid_len, psid_offset);
+	return 0;
+}
+
+/**
+ * pool4_table_for_each() callback; deactivates "node" if it belongs to the "arg" range.
+ */
+static int deactivate_if_ranged(struct pool4_node *node, void *arg)
+{
+	return (node->range == arg) ? deactivate_pool4_node(node, NULL) : 0;
+}
+
+/**
+ * Removes "range" and its addresses from the pool.
+ * Remember to drain_all_caches() afterwards, once the lock is released.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void remove_range(struct pool4_range *range)
+{
+	pool4_table_for_each(&pool, deactivate_if_ranged, range);
+	list_del(&range->list_hook);
+	kfree(range);
+	jool_mem_add(JMEM_POOL4, -(long) sizeof(*range));
+
+	rebuild_snapshot();
+	generation++;
+	pool4_table_for_each(&pool, destroy_if_idle, NULL);
+}
+
+int pool4_remove_range(struct in_addr *addr, __u8 addr_len)
+{
+	struct pool4_range *range;
+
+	if (WARN(!addr, "NULL is not a valid address."))
+		return -EINVAL;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	list_for_each_entry(range, &ranges, list_hook) {
+		if (range->addr.s_addr == addr->s_addr && range->addr_len == addr_len) {
+			remove_range(range);
+			jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+			drain_all_caches();
+			return 0;
+		}
+	}
+
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	log_err("%pI4/%u is not a range of the pool.", addr, addr_len);
+	return -ENOENT;
+}
+
+int pool4_remove(struct in_addr *addr)
+{
+	struct pool4_node *node;
+	struct pool4_range *range;
+
+	if (WARN(!addr, "NULL is not a valid address."))
+		return -EINVAL;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	range = find_range(addr);
+	if (range) {
+		if (range->addr_len != 32) {
+			jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+			log_err("%pI4 belongs to the range %pI4/%u, which can only be removed as a whole.",
+					addr, &range->addr, range->addr_len);
+			return -EINVAL;
+		}
+		remove_range(range);
+		goto success;
+	}
+
+	node = pool4_table_get(&pool, addr);
+	if (!node || !node->active)
+		goto not_found;
+
+	deactivate_pool4_node(node, NULL);
+	rebuild_snapshot();
+	generation++;
+	destroy_if_idle(node, NULL);
+	/* Fall through. */
+
+success:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	/* Some of the address's ports might be sitting in the magazines. */
+	drain_all_caches();
+	return 0;
+
+not_found:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	log_err("The address is not part of the pool.");
+	return -ENOENT;
+}
+
+/**
+ * "pool_lock" must be held.
+ */
+static int get_specific_locked(l4_protocol l4_proto, struct ipv4_transport_addr *addr)
+{
+	struct pool4_node *node;
+	struct poolnum *ids;
+	int error;
+
+	node = get_node(&addr->l3);
+	if (!node || !node->active) {
+		log_debug("%pI4 does not belong to the pool.", &addr->l3);
+		return -EINVAL;
+	}
+	if (node->det) {
+		log_debug("%pI4's ports are mapped deterministically.", &addr->l3);
+		return -EINVAL;
+	}
+
+	if (is_block_id(addr->l4)) {
+		/* The whole block goes to the caller. */
+		error = get_block_index(addr->l4);
+		ids = get_blocks_from_pool4_node(node, l4_proto);
+		if (error < 0 || !ids)
+			return -EINVAL;
+		return poolnum_get(ids, error);
+	}
+
+	ids = get_poolnum_from_pool4_node(node, l4_proto, addr->l4);
+	if (!ids)
+		return -EINVAL;
+
+	error = poolnum_get(ids, addr->l4);
+	if (!error)
+		update_candidate(node, get_class(l4_proto, addr->l4));
+	return error;
+}
+
+static int get_specific(l4_protocol l4_proto, struct ipv4_transport_addr *addr)
+{
+	int error;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	error = get_specific_locked(l4_proto, addr);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+
+	return error;
+}
+
+int pool4_get(l4_protocol l4_proto, struct ipv4_transport_addr *addr)
+{
+	int error;
+
+	if (WARN(!addr, "NULL is not a valid address."))
+		return -EINVAL;
+
+	error = get_specific(l4_proto, addr);
+	if (error == -ESRCH) {
+		/* Maybe one of the CPUs is holding it. */
+		drain_all_caches();
+		error = get_specific(l4_proto, addr);
+	}
+
+	return error;
+}
+
+void pool4_get_bulk(l4_protocol *l4_protos, struct ipv4_transport_addr *addrs, int *results,
+		unsigned int count)
+{
+	unsigned int i;
+
+	if (!count)
+		return;
+
+	/* Once for the whole batch, rather than once per port that happens to be cached. */
+	drain_all_caches();
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	for (i = 0; i < count; i++)
+		results[i] = get_specific_locked(l4_protos[i], &addrs[i]);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+}
+
+/**
+ * Returns the running CPU's magazine of "class" ports, with its port cache locked.
+ * Returns NULL (and doesn't lock anything) if "class" is not cached.
+ */
+static struct magazine *mag_lock(int class, struct port_cache **cache)
+{
+	if (class < 0)
+		return NULL;
+	*cache = cache_lock();
+	return &(*cache)->mags[class];
+}
+
+int pool4_get_match(l4_protocol proto, struct ipv4_transport_addr *addr, __u16 *result)
+{
+	struct pool4_node *node;
+	struct poolnum *ids;
+	struct port_cache *cache;
+	struct magazine *mag;
+	struct ipv4_transport_addr extra;
+	int index;
+	int error;
+
+	if (WARN(!addr, "NULL is not a valid address."))
+		return -EINVAL;
+
+	mag = mag_lock(get_class(proto, addr->l4), &cache);
+	if (mag) {
+		index = mag_find_addr(mag, &addr->l3);
+		if (index >= 0) {
+			mag_take(mag, index, &extra);
+			*result = extra.l4;
+			cache_unlock(cache);
+			return 0;
+		}
+		jool_lock(&pool_lock, JLOCK_POOL4);
+	} else {
+		jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	}
+
+	node = get_node(&addr->l3);
+	if (!node || !node->active || node->det) {
+		log_debug("%pI4 does not lend ports on demand.", &addr->l3);
+		error = -EINVAL;
+		goto end;
+	}
+
+	ids = get_poolnum_from_pool4_node(node, proto, addr->l4);
+	if (!ids) {
+		error = -EINVAL;
+		goto end;
+	}
+	error = poolnum_get_any(ids, result);
+	if (error)
+		goto end;
+
+	if (mag) {
+		/* This address is likely going to be requested again soon. */
+		extra.l3 = addr->l3;
+		while (mag->count < MAG_BATCH && !poolnum_get_any(ids, &extra.l4))
+			mag->entries[mag->count++] = extra;
+	}
+	update_candidate(node, get_class(proto, addr->l4));
+	/* Fall through. */
+
+end:
+	if (mag) {
+		jool_unlock(&pool_lock, JLOCK_POOL4);
+		cache_unlock(cache);
+	} else {
+		jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	}
+	return error;
+}
+
+/**
+ * Returns the classes of "proto" ports, by order of preference, terminated by -1.
+ * High ports go first so the privileged ones are spared.
+ */
+static const int *get_proto_classes(l4_protocol proto)
+{
+	static const int udp_classes[] = { POOL4_CLASS_UDP_HIGH_EVEN, POOL4_CLASS_UDP_HIGH_ODD,
+			POOL4_CLASS_UDP_LOW_EVEN, POOL4_CLASS_UDP_LOW_ODD, -1 };
+	static const int tcp_classes[] = { POOL4_CLASS_TCP_HIGH, POOL4_CLASS_TCP_LOW, -1 };
+	static const int icmp_classes[] = { POOL4_CLASS_ICMP, -1 };
+
+	switch (proto) {
+	case L4PROTO_UDP:
+		return udp_classes;
+	case L4PROTO_TCP:
+		return tcp_classes;
+	case L4PROTO_ICMP:
+		return icmp_classes;
+	}
+
+	return NULL;
+}
+
+static int get_any_port(struct pool4_node *node, l4_protocol proto, __u16 *result)
+{
+	const int *classes;
+	struct poolnum *ids;
+	int i;
+
+	classes = get_proto_classes(proto);
+	if (!classes)
+		return -EINVAL;
+
+	for (i = 0; classes[i] != -1; i++) {
+		ids = get_poolnum_by_class(node, classes[i]);
+		if (ids && !poolnum_get_any(ids, result)) {
+			update_candidate(node, classes[i]);
+			return 0;
+		}
+	}
+
+	return -ESRCH;
+}
+
+/**
+ * Takes a port of "addr" from the running CPU's magazines, if there's one.
+ * Honors get_any_port()'s preference for high ports.
+ */
+static int cache_get_any_port(l4_protocol proto, const struct in_addr *addr, __u16 *result)
+{
+	const int *classes;
+	struct port_cache *cache;
+	struct magazine *mag;
+	struct ipv4_transport_addr taken;
+	int i, index;
+
+	classes = get_proto_classes(proto);
+	if (!classes)
+		return -EINVAL;
+
+	cache = cache_lock();
+	for (i = 0; classes[i] != -1; i++) {
+		mag = &cache->mags[classes[i]];
+		index = mag_find_addr(mag, addr);
+		if (index >= 0) {
+			mag_take(mag, index, &taken);
+			*result = taken.l4;
+			cache_unlock(cache);
+			return 0;
+		}
+	}
+	cache_unlock(cache);
+
+	return -ESRCH;
+}
+
+int pool4_get_any_port(l4_protocol proto, const struct in_addr *addr, __u16 *result)
+{
+	struct pool4_node *node;
+	int error = -EINVAL;
+
+	if (WARN(!addr, "NULL is not a valid address."))
+		return -EINVAL;
+
+	if (!cache_get_any_port(proto, addr, result))
+		return 0;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	node = get_node(addr);
+	if (!node || !node->active || node->det) {
+		log_debug("%pI4 does not lend ports on demand.", addr);
+		goto end;
+	}
+
+	error = get_any_port(node, proto, result);
+	/* Fall through. */
+
+end:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return error;
+}
+
+/**
+ * Returns the "class" candidate that should lend the next port, or NULL if there's none.
+ *
+ * The candidates are served in round-robin order, except the next in line is skipped if the one
+ * after it has more ports left. This way, addresses that have been drained by other means
+ * (pool4_get() and pool4_get_match()) are given time to catch up.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct pool4_node *choose_candidate(int class)
+{
+	struct list_head *list = &candidates[class];
+	struct pool4_node *first, *second;
+
+	if (list_empty(list))
+		return NULL;
+
+	first = list_entry(list->next, struct pool4_node, candidate_hooks[class]);
+	if (list_is_singular(list))
+		return first;
+	second = list_entry(list->next->next, struct pool4_node, candidate_hooks[class]);
+
+	return (get_poolnum_by_class(second, class)->available
+			> get_poolnum_by_class(first, class)->available) ? second : first;
+}
+
+/**
+ * Borrows a port from "ids", preferring the ones that belong to the running CPU if ports are
+ * affine to CPUs. The other ones are lent once those run out, so allocation doesn't fail early.
+ */
+static int lend_port(struct poolnum *ids, __u16 *result)
+{
+	if (port_affinity && !poolnum_get_slice(ids, PORT_SLICE_SHIFT, nr_cpu_ids,
+			smp_processor_id(), result))
+		return 0;
+	return poolnum_get_any(ids, result);
+}
+
+/**
+ * Borrows a "class" port from whichever address choose_candidate() prefers.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int get_from_candidates(int class, struct ipv4_transport_addr *result)
+{
+	struct pool4_node *node;
+
+	node = choose_candidate(class);
+	while (!node) {
+		/* The existing nodes are out of "class" ports; wake up the ranges. */
+		if (!materialize_next(1u << class))
+			return -ESRCH;
+		node = choose_candidate(class);
+	}
+
+	if (WARN(lend_port(get_poolnum_by_class(node, class), &result->l4),
+			"%pI4 was a candidate, but it has no ports.", &node->addr)) {
+		list_del_init(&node->candidate_hooks[class]);
+		return -ESRCH;
+	}
+	result->l3 = node->addr;
+
+	/* To the back of the line, unless it's out of ports. */
+	list_move_tail(&node->candidate_hooks[class], &candidates[class]);
+	update_candidate(node, class);
+	return 0;
+}
+
+/**
+ * Borrows, from the next address that has one, a port that is similar to "l4_id".
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int get_similar(l4_protocol proto, __u16 l4_id, struct ipv4_transport_addr *result)
+{
+	int class = get_class(proto, l4_id);
+
+	if (class < 0)
+		return -ESRCH; /* Block mode; no "similar" individual IDs. */
+	return get_from_candidates(class, result);
+}
+
+static int get_any_addr(l4_protocol proto, __u16 l4_id, struct ipv4_transport_addr *result)
+{
+	const int *classes;
+	int i;
+	int error = -EINVAL;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	if (pool.node_count == 0 && list_empty(&ranges)) {
+		log_warn_once("The IPv4 pool is empty.");
+		goto end;
+	}
+
+	error = get_similar(proto, l4_id, result);
+	if (!error)
+		goto end;
+
+	/* We have NO addresses with compatible ports. Fall back to using any address. */
+	classes = get_proto_classes(proto);
+	if (!classes) {
+		error = -EINVAL;
+		goto end;
+	}
+	for (i = 0; classes[i] != -1; i++) {
+		error = get_from_candidates(classes[i], result);
+		if (!error)
+			goto end;
+	}
+	/* Fall through. */
+
+end:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return error;
+}
+
+/**
+ * Refills empty "mag" with ports similar to "l4_id", in the order get_similar() lends them.
+ *
+ * "mag"'s cache must already be locked.
+ */
+static void mag_refill(struct magazine *mag, l4_protocol proto, __u16 l4_id)
+{
+	struct ipv4_transport_addr batch[MAG_BATCH];
+	unsigned int count, i;
+
+	jool_lock(&pool_lock, JLOCK_POOL4);
+	for (count = 0; count < MAG_BATCH; count++)
+		if (get_similar(proto, l4_id, &batch[count]))
+			break;
+	jool_unlock(&pool_lock, JLOCK_POOL4);
+
+	/* The top is popped first. */
+	for (i = 0; i < count; i++)
+		mag->entries[i] = batch[count - i - 1];
+	mag->count = count;
+}
+
+int pool4_get_any_addr(l4_protocol proto, __u16 l4_id, struct ipv4_transport_addr *result)
+{
+	struct port_cache *cache;
+	struct magazine *mag;
+	int error;
+
+	mag = mag_lock(get_class(proto, l4_id), &cache);
+	if (mag) {
+		if (!mag->count)
+			mag_refill(mag, proto, l4_id);
+		if (mag->count) {
+			*result = mag->entries[--mag->count];
+			cache_unlock(cache);
+			return 0;
+		}
+		cache_unlock(cache);
+	}
+
+	error = get_any_addr(proto, l4_id, result);
+	if (error == -ESRCH) {
+		/* The other CPUs might be hoarding the last ports. */
+		drain_all_caches();
+		error = get_any_addr(proto, l4_id, result);
+		if (error == -ESRCH) {
+			trace_jool_pool4_exhausted(proto, l4_id);
+			ipfix_pool4_exhausted(proto);
+			log_warn_once("I completely ran out of IPv4 addresses and ports.");
+		}
+	}
+
+	return error;
+}
+
+/**
+ * Returns the number formed by bits "from" through "to" - 1 of "addr".
+ */
+static __u32 get_bits(const struct in6_addr *addr, unsigned int from, unsigned int to)
+{
+	__u32 result = 0;
+	unsigned int i;
+
+	for (i = from; i < to; i++) {
+		result <<= 1;
+		result |= (be32_to_cpu(addr->s6_addr32[i >> 5]) >> (31 - (i & 31))) & 1;
+	}
+
+	return result;
+}
+
+int pool4_get_det(const struct in6_addr *addr6, struct ipv4_transport_addr *first,
+		unsigned int *count)
+{
+	struct pool4_det *det;
+	struct pool4_node *node;
+	__u32 subscriber;
+	int error = -ENOENT;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	list_for_each_entry(det, &det_ranges, list_hook) {
+		if (!ipv6_prefix_equal(&det->prefix6.address, addr6, det->prefix6.len))
+			continue;
+
+		subscriber = get_bits(addr6, det->prefix6.len, det->subscriber_len);
+		first->l3.s_addr = cpu_to_be32(be32_to_cpu(det->addr.s_addr)
+				+ (subscriber >> det->shift));
+		first->l4 = 1024 + (subscriber & ((1 << det->shift) - 1)) * det->ports;
+		*count = det->ports;
+
+		/* The address might have been removed from the pool. */
+		node = pool4_table_get(&pool, &first->l3);
+		error = (node && node->active && node->det == det) ? 0 : -ESRCH;
+		if (error)
+			log_debug("%pI6c's address (%pI4) is no longer part of the pool.", addr6,
+					&first->l3);
+		break;
+	}
+
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return error;
+}
+
+unsigned int pool4_get_block_size(void)
+{
+	return block_size;
+}
+
+int pool4_port_cpu(__u16 port)
+{
+	return port_affinity ? ((port >> PORT_SLICE_SHIFT) % nr_cpu_ids) : -1;
+}
+
+int pool4_get_affine(l4_protocol proto, __u16 l4_id, const struct in6_addr *addr6,
+		struct ipv4_transport_addr *result)
+{
+	struct pool4_snapshot *snap;
+	struct pool4_node *node;
+	struct poolnum *ids;
+	int class = get_class(proto, l4_id);
+
+	if (class < 0)
+		goto fallback;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	snap = rcu_dereference_protected(snapshot, lockdep_is_held(&pool_lock));
+	if (!snap || !snap->count)
+		goto unlock;
+
+	node = snap->entries[affine_index(snap, addr6)].node;
+	ids = node->det ? NULL : get_poolnum_by_class(node, class);
+	if (!ids || poolnum_get_any(ids, &result->l4))
+		goto unlock;
+
+	result->l3 = node->addr;
+	update_candidate(node, class);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return 0;
+
+unlock:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	/* Fall through. */
+
+fallback:
+	/* The subscriber's address is out of similar ports; anything else will do. */
+	return pool4_get_any_addr(proto, l4_id, result);
+}
+
+/**
+ * Borrows any block from "node", and returns its first port in "result".
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int get_any_block(struct pool4_node *node, l4_protocol proto, __u16 *result)
+{
+	struct poolnum *blocks;
+	__u16 index;
+	int error;
+
+	blocks = get_blocks_from_pool4_node(node, proto);
+	if (!blocks)
+		return -EINVAL;
 
+	error = poolnum_get_any(blocks, &index);
 	if (error)
-		goto failure;
-	return 0;
+		return error;
 
-failure:
-	destroy_pool4_node(new_node);
-	return error;
+	*result = POOL4_BLOCK_MIN + index * block_size;
+	return 0;
 }
 
-int pool4_remove(struct in_addr *addr)
+int pool4_get_block(l4_protocol proto, const struct in_addr *hint, const struct in6_addr *addr6,
+		struct ipv4_transport_addr *result)
 {
+	struct pool4_snapshot *snap;
+	struct pool4_table_key_value *keyval;
 	struct pool4_node *node;
+	unsigned int start, i;
+	int error = -EINVAL;
 
-	if (WARN(!addr, "NULL is not a valid address."))
+	if (WARN(!block_size, "The pool is not lending port blocks."))
 		return -EINVAL;
 
-	spin_lock_bh(&pool_lock);
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
 
-	node = pool4_table_get(&pool, addr);
-	if (!node || !node->active)
-		goto not_found;
-	if (deactivate_or_destroy_pool4_node(node, NULL))
-		goto not_found;
+	if (hint) {
+		node = get_node(hint);
+		if (node && node->active && !node->det
+				&& !get_any_block(node, proto, &result->l4)) {
+			result->l3 = *hint;
+			goto success;
+		}
+	}
 
-	spin_unlock_bh(&pool_lock);
+	if (pool.node_count == 0 && list_empty(&ranges)) {
+		log_warn_once("The IPv4 pool is empty.");
+		goto failure;
+	}
 
-	return 0;
+	/* Start from the subscriber's own address, so its blocks tend to share it. */
+	snap = rcu_dereference_protected(snapshot, lockdep_is_held(&pool_lock));
+	if (snap && snap->count) {
+		start = affine_index(snap, addr6);
+		i = start;
+		do {
+			node = snap->entries[i].node;
+			if (!node->det && !get_any_block(node, proto, &result->l4)) {
+				result->l3 = node->addr;
+				goto success;
+			}
+			i = (i + 1 < snap->count) ? (i + 1) : 0;
+		} while (i != start);
+	} else if (pool.node_count) {
+		/* No snapshot (it couldn't be allocated); do it the slow way. */
+		list_for_each_entry(keyval, &pool.list, list_hook) {
+			node = keyval->value;
+			if (!node->active || node->det)
+				continue;
+			if (!get_any_block(node, proto, &result->l4)) {
+				result->l3 = node->addr;
+				goto success;
+			}
+		}
+	}
 
-not_found:
-	spin_unlock_bh(&pool_lock);
-	log_err("The address is not part of the pool.");
-	return -ENOENT;
+	/* The existing nodes are out of blocks; wake up the ranges. */
+	while ((node = materialize_next(RANGE_LENDS_BLOCKS)) != NULL) {
+		if (!get_any_block(node, proto, &result->l4)) {
+			result->l3 = node->addr;
+			goto success;
+		}
+	}
+
+	log_warn_once("I completely ran out of IPv4 port blocks.");
+	error = -ESRCH;
+	/* Fall through. */
+
+failure:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return error;
+
+success:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
+	return 0;
 }
 
-int pool4_get(l4_protocol l4_proto, struct ipv4_transport_addr *addr)
+/**
+ * Returns "addr" to "node", which is the pool4_node of its address. Doesn't kill "node" if it was
+ * waiting for this; that's the caller's job.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int return_to_node(struct pool4_node *node, const l4_protocol l4_proto,
+		const struct ipv4_transport_addr *addr)
 {
-	struct pool4_node *node;
 	struct poolnum *ids;
 	int error;
 
-	if (WARN(!addr, "NULL is not a valid address."))
+	if (node->det)
+		return 0; /* Nothing was borrowed. */
+
+	if (is_block_id(addr->l4)) {
+		error = get_block_index(addr->l4);
+		ids = get_blocks_from_pool4_node(node, l4_proto);
+		if (error < 0 || !ids)
+			return -EINVAL;
+		return poolnum_return(ids, error);
+	}
+
+	ids = get_poolnum_from_pool4_node(node, l4_proto, addr->l4);
+	if (!ids)
 		return -EINVAL;
+	error = poolnum_return(ids, addr->l4);
+	if (!error)
+		update_candidate(node, get_class(l4_proto, addr->l4));
+	return error;
+}
 
-	spin_lock_bh(&pool_lock);
+/**
+ * Returns "addr" to its pool4_node.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static int return_locked(const l4_protocol l4_proto, const struct ipv4_transport_addr *addr)
+{
+	struct pool4_node *node;
+	int error;
 
 	node = pool4_table_get(&pool, &addr->l3);
-	if (!node || !node->active) {
+	if (!node) {
 		log_debug("%pI4 does not belong to the pool.", &addr->l3);
-		spin_unlock_bh(&pool_lock);
 		return -EINVAL;
 	}
 
-	ids = get_poolnum_from_pool4_node(node, l4_proto, addr->l4);
-	if (!ids) {
-		spin_unlock_bh(&pool_lock);
+	error = return_to_node(node, l4_proto, addr);
+	if (error)
+		return error;
+
+	if (destroy_if_idle(node, NULL)) {
+		log_err("Failure when tried to remove an inactive pool4 node.");
 		return -EINVAL;
 	}
 
-	error = poolnum_get(ids, addr->l4);
-	spin_unlock_bh(&pool_lock);
-	return error;
+	return 0;
 }
 
-int pool4_get_match(l4_protocol proto, struct ipv4_transport_addr *addr, __u16 *result)
+static int compare_deferred(const void *a, const void *b)
 {
-	struct pool4_node *node;
-	struct poolnum *ids;
-	int error;
+	const struct deferred_return *r1 = a;
+	const struct deferred_return *r2 = b;
+	__u32 addr1 = be32_to_cpu(r1->addr.l3.s_addr);
+	__u32 addr2 = be32_to_cpu(r2->addr.l3.s_addr);
+
+	if (addr1 != addr2)
+		return (addr1 < addr2) ? -1 : 1;
+	return (int) r1->addr.l4 - (int) r2->addr.l4;
+}
 
-	if (WARN(!addr, "NULL is not a valid address."))
-		return -EINVAL;
+/**
+ * Hands all of "batch"'s ports back to the pool, under a single lock, visiting every address only
+ * once.
+ *
+ * Bottom halves must be disabled.
+ */
+static void batch_flush(struct return_batch *batch)
+{
+	struct deferred_return *entries = batch->entries;
+	struct pool4_node *node;
+	unsigned int i, j;
 
-	spin_lock_bh(&pool_lock);
+	if (!batch->count)
+		return;
 
-	node = pool4_table_get(&pool, &addr->l3);
-	if (!node || !node->active) {
-		log_debug("%pI4 does not belong to the pool.", &addr->l3);
-		error = -EINVAL;
-		goto end;
+	sort(entries, batch->count, sizeof(*entries), compare_deferred, NULL);
+
+	jool_lock(&pool_lock, JLOCK_POOL4);
+	for (i = 0; i < batch->count; i = j) {
+		node = pool4_table_get(&pool, &entries[i].addr.l3);
+		for (j = i; j < batch->count; j++) {
+			if (!ipv4_addr_equals(&entries[j].addr.l3, &entries[i].addr.l3))
+				break;
+			/* The address might have been removed with --quick. */
+			if (node)
+				return_to_node(node, entries[j].proto, &entries[j].addr);
+		}
+		if (node && destroy_if_idle(node, NULL))
+			log_err("Failure when tried to remove an inactive pool4 node.");
 	}
+	jool_unlock(&pool_lock, JLOCK_POOL4);
 
-	ids = get_poolnum_from_pool4_node(node, proto, addr->l4);
-	if (!ids) {
-		error = -EINVAL;
-		goto end;
-	}
-	error = poolnum_get_any(ids, result);
-	if (error)
-		goto end;
+	batch->count = 0;
+}
 
-end:
-	spin_unlock_bh(&pool_lock);
-	return error;
+void pool4_defer_returns(void)
+{
+	local_bh_disable();
+	this_cpu_ptr(batches)->depth++;
 }
 
-static int get_any_port(struct pool4_node *node, l4_protocol proto, __u16 *result)
+void pool4_flush_returns(void)
 {
-	int error = -EINVAL;
+	struct return_batch *batch = this_cpu_ptr(batches);
 
-	switch (proto) {
-	case L4PROTO_UDP:
-		error = poolnum_get_any(&node->udp_ports.high_even, result);
-		if (!error)
-			return 0;
-		error = poolnum_get_any(&node->udp_ports.high_odd, result);
-		if (!error)
-			return 0;
-		error = poolnum_get_any(&node->udp_ports.low_even, result);
-		if (!error)
-			return 0;
-		error = poolnum_get_any(&node->udp_ports.low_odd, result);
-		break;
-	case L4PROTO_TCP:
-		error = poolnum_get_any(&node->tcp_ports.high, result);
-		if (!error)
-			return 0;
-		error = poolnum_get_any(&node->tcp_ports.low, result);
-		break;
-	case L4PROTO_ICMP:
-		error = poolnum_get_any(&node->icmp_ids, result);
-		break;
+	if (!WARN(!batch->depth, "Unbalanced pool4_flush_returns().")) {
+		batch->depth--;
+		if (!batch->depth)
+			batch_flush(batch);
 	}
+	local_bh_enable();
+}
 
-	return error;
+/**
+ * Queues "addr" in the running CPU's return batch, if the CPU is deferring returns.
+ * Returns whether it did.
+ */
+static bool batch_return(const l4_protocol l4_proto, const struct ipv4_transport_addr *addr)
+{
+	struct return_batch *batch;
+	bool deferred = false;
+
+	local_bh_disable();
+	batch = this_cpu_ptr(batches);
+	if (batch->depth) {
+		if (batch->count == DEFERRED_MAX)
+			batch_flush(batch);
+		batch->entries[batch->count].proto = l4_proto;
+		batch->entries[batch->count].addr = *addr;
+		batch->count++;
+		deferred = true;
+	}
+	local_bh_enable();
+
+	return deferred;
 }
 
-int pool4_get_any_port(l4_protocol proto, const struct in_addr *addr, __u16 *result)
+/**
+ * Puts "addr" in the running CPU's magazine of "class" ports.
+ * Returns -EAGAIN if the pool itself has to deal with "addr".
+ */
+static int cache_return(int class, const l4_protocol l4_proto,
+		const struct ipv4_transport_addr *addr)
 {
+	struct port_cache *cache;
+	struct magazine *mag;
 	struct pool4_node *node;
-	int error = -EINVAL;
+	struct poolnum *ids;
+	unsigned int i;
+	int error = 0;
 
-	if (WARN(!addr, "NULL is not a valid address."))
-		return -EINVAL;
+	mag = mag_lock(class, &cache);
 
-	spin_lock_bh(&pool_lock);
+	rcu_read_lock_bh();
+	node = snapshot_find(rcu_dereference_bh(snapshot), &addr->l3);
+	if (!node) {
+		/* Unknown, or leaving the pool. */
+		error = -EAGAIN;
+		goto end;
+	}
+	if (node->det)
+		goto end; /* Nothing was borrowed. */
 
-	node = pool4_table_get(&pool, addr);
-	if (!node || !node->active) {
-		log_debug("%pI4 does not belong to the pool.", addr);
+	/*
+	 * These validations are not bulletproof (the bits are read without the lock, and the other
+	 * CPUs' magazines are not checked), but they catch the obvious mistakes.
+	 */
+	ids = get_poolnum_from_pool4_node(node, l4_proto, addr->l4);
+	if (!ids || poolnum_is_available(ids, addr->l4)) {
+		log_debug("%pI4#%u was not borrowed.", &addr->l3, addr->l4);
+		error = -EINVAL;
 		goto end;
 	}
+	for (i = 0; i < mag->count; i++) {
+		if (ipv4_transport_addr_equals(&mag->entries[i], addr)) {
+			log_debug("%pI4#%u was returned twice.", &addr->l3, addr->l4);
+			error = -EINVAL;
+			goto end;
+		}
+	}
 
-	error = get_any_port(node, proto, result);
+	if (mag->count == MAG_SIZE) {
+		/* Drain the oldest ones. */
+		jool_lock(&pool_lock, JLOCK_POOL4);
+		for (i = 0; i < MAG_BATCH; i++)
+			return_locked(l4_proto, &mag->entries[i]);
+		jool_unlock(&pool_lock, JLOCK_POOL4);
+		mag->count -= MAG_BATCH;
+		memmove(&mag->entries[0], &mag->entries[MAG_BATCH],
+				mag->count * sizeof(mag->entries[0]));
+	}
+	mag->entries[mag->count++] = *addr;
 	/* Fall through. */
 
 end:
-	spin_unlock_bh(&pool_lock);
+	rcu_read_unlock_bh();
+	cache_unlock(cache);
 	return error;
 }
 
-int pool4_get_any_addr(l4_protocol proto, __u16 l4_id, struct ipv4_transport_addr *result)
+int pool4_return(const l4_protocol l4_proto, const struct ipv4_transport_addr *addr)
 {
-	struct pool4_node *node;
-	struct in_addr *original_addr;
-	struct poolnum *ids;
-	int error = -EINVAL;
+	int class;
+	int error;
+
+	if (WARN(!addr, "NULL is not a valid address."))
+		return -EINVAL;
 
-	spin_lock_bh(&pool_lock);
+	if (batch_return(l4_proto, addr))
+		return 0;
 
-	if (pool.node_count == 0) {
-		log_warn_once("The IPv4 pool is empty.");
-		goto failure;
+	class = get_class(l4_proto, addr->l4);
+	if (class >= 0) {
+		error = cache_return(class, l4_proto, addr);
+		if (error != -EAGAIN)
+			return error;
 	}
 
-	/* Iterate through all of the addresses until we find one that has a compatible port. */
-	original_addr = last_used_addr;
-	do {
-		increment_last_used_addr();
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	error = return_locked(l4_proto, addr);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
 
-		node = pool4_table_get(&pool, last_used_addr);
-		if (!node || !node->active)
-			continue;
+	return error;
+}
 
-		ids = get_poolnum_from_pool4_node(node, proto, l4_id);
-		if (!ids)
-			goto failure;
+bool pool4_contains(__be32 addr)
+{
+	struct pool4_snapshot *snap;
+	struct pool4_node *node;
+	struct in_addr inaddr = { .s_addr = addr };
+	bool result = false;
 
-		error = poolnum_get_any(ids, &result->l4);
-		if (!error)
-			goto success;
-	} while (original_addr != last_used_addr);
+	rcu_read_lock_bh();
+	snap = rcu_dereference_bh(snapshot);
+	if (snap) {
+		result = snapshot_contains(snap, be32_to_cpu(addr));
+		rcu_read_unlock_bh();
+		return result;
+	}
+	rcu_read_unlock_bh();
 
-	/* We have NO addresses with compatible ports. Fall back to using any address. */
-	original_addr = last_used_addr;
-	do {
-		increment_last_used_addr();
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	node = pool4_table_get(&pool, &inaddr);
+	result = (node && node->active) || find_range(&inaddr);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
 
-		node = pool4_table_get(&pool, last_used_addr);
-		if (!node || !node->active)
-			continue;
+	return result;
+}
 
-		error = get_any_port(node, proto, &result->l4);
-		if (!error)
-			goto success;
-	} while (original_addr != last_used_addr);
+bool pool4_is_available(l4_protocol proto, const struct ipv4_transport_addr *addr)
+{
+	struct pool4_node *node;
+	struct poolnum *ids;
+	int index;
+	bool result = false;
 
-	log_warn_once("I completely ran out of IPv4 addresses and ports.");
-	error = -ESRCH;
+	rcu_read_lock_bh();
 
-failure:
-	spin_unlock_bh(&pool_lock);
-	return error;
+	/* Lazy addresses that haven't been materialized are not in the snapshot; no verdict. */
+	node = snapshot_find(rcu_dereference_bh(snapshot), &addr->l3);
+	if (!node || node->det)
+		goto end;
 
-success:
-	result->l3 = *last_used_addr;
-	spin_unlock_bh(&pool_lock);
-	return 0;
+	if (is_block_id(addr->l4)) {
+		index = get_block_index(addr->l4);
+		ids = get_blocks_from_pool4_node(node, proto);
+		result = index >= 0 && ids && poolnum_is_available(ids, index);
+	} else {
+		ids = get_poolnum_from_pool4_node(node, proto, addr->l4);
+		result = ids && poolnum_is_available(ids, addr->l4);
+	}
+	/* Fall through. */
+
+end:
+	rcu_read_unlock_bh();
+	return result;
 }
 
-int pool4_return(const l4_protocol l4_proto, const struct ipv4_transport_addr *addr)
+int pool4_for_each(int (*func)(struct pool4_node *, void *), void * arg)
 {
-	struct pool4_node *node;
-	struct poolnum *ids;
 	int error;
 
-	if (WARN(!addr, "NULL is not a valid address."))
-		return -EINVAL;
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	error = pool4_table_for_each(&pool, func, arg);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
 
-	spin_lock_bh(&pool_lock);
+	return error;
+}
 
-	node = pool4_table_get(&pool, &addr->l3);
-	if (!node) {
-		log_debug("%pI4 does not belong to the pool.", &addr->l3);
-		error = -EINVAL;
-		goto failure;
-	}
+struct addr_walk {
+	int (*func)(struct in_addr *, void *);
+	void *arg;
+};
 
-	ids = get_poolnum_from_pool4_node(node, l4_proto, addr->l4);
-	if (!ids) {
-		error = -EINVAL;
-		goto failure;
-	}
+/**
+ * pool4_table_for_each() callback; visits the active nodes that don't belong to a range.
+ */
+static int walk_unranged_node(struct pool4_node *node, void *arg)
+{
+	struct addr_walk *walk = arg;
 
-	error = poolnum_return(ids, addr->l4);
+	if (!node->active || node->range)
+		return 0;
+	return walk->func(&node->addr, walk->arg);
+}
+
+int pool4_for_each_addr(int (*func)(struct in_addr *, void *), void *arg)
+{
+	struct addr_walk walk = { .func = func, .arg = arg };
+	struct pool4_range *range;
+	struct in_addr addr;
+	__u32 i;
+	int error;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+
+	error = pool4_table_for_each(&pool, walk_unranged_node, &walk);
 	if (error)
-		goto failure;
+		goto end;
 
-	if (!node->active) {
-		error = deactivate_or_destroy_pool4_node(node, NULL);
-		if (error) {
-			log_err("Failure when tried to remove an inactive pool4 node.");
-			goto failure;
+	list_for_each_entry(range, &ranges, list_hook) {
+		for (i = 0; i < range_size(range); i++) {
+			addr.s_addr = cpu_to_be32(range_first(range) + i);
+			error = func(&addr, arg);
+			if (error)
+				goto end;
 		}
 	}
+	/* Fall through. */
 
-	spin_unlock_bh(&pool_lock);
-	return 0;
-
-failure:
-	spin_unlock_bh(&pool_lock);
+end:
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
 	return error;
 }
 
-bool pool4_contains(__be32 addr)
+/**
+ * Adds the numbers of "ids" to "usage"'s "l4_proto" counters. Each number counts as "weight".
+ */
+static void add_usage(struct pool4_usage_usr *usage, l4_protocol l4_proto, struct poolnum *ids,
+		unsigned int weight)
 {
-	struct pool4_node *node;
-	struct in_addr inaddr = { .s_addr = addr };
-	bool result = false;
+	usage->total[l4_proto] += ids->count * weight;
+	usage->borrowed[l4_proto] += (ids->count - ids->available) * weight;
+}
 
-	spin_lock_bh(&pool_lock);
-	node = pool4_table_get(&pool, &inaddr);
-	if (node)
-		result = node->active;
-	spin_unlock_bh(&pool_lock);
+struct usage_walk {
+	int (*func)(struct pool4_usage_usr *, void *);
+	void *arg;
+};
 
-	return result;
+/**
+ * pool4_table_for_each() callback; reports the active nodes that lend their ports on demand.
+ */
+static int walk_node_usage(struct pool4_node *node, void *arg)
+{
+	struct usage_walk *walk = arg;
+	struct pool4_usage_usr usage;
+
+	if (!node->active || node->det)
+		return 0;
+
+	memset(&usage, 0, sizeof(usage));
+	usage.addr = node->addr;
+
+	add_usage(&usage, L4PROTO_UDP, &node->udp_ports.low_even, 1);
+	add_usage(&usage, L4PROTO_UDP, &node->udp_ports.low_odd, 1);
+	add_usage(&usage, L4PROTO_TCP, &node->tcp_ports.low, 1);
+	add_usage(&usage, L4PROTO_ICMP, &node->icmp_ids, 1);
+
+	if (block_size) {
+		add_usage(&usage, L4PROTO_UDP, &node->blocks.udp, block_size);
+		add_usage(&usage, L4PROTO_TCP, &node->blocks.tcp, block_size);
+		add_usage(&usage, L4PROTO_ICMP, &node->blocks.icmp, block_size);
+	} else {
+		add_usage(&usage, L4PROTO_UDP, &node->udp_ports.high_even, 1);
+		add_usage(&usage, L4PROTO_UDP, &node->udp_ports.high_odd, 1);
+		add_usage(&usage, L4PROTO_TCP, &node->tcp_ports.high, 1);
+	}
+
+	return walk->func(&usage, walk->arg);
 }
 
-int pool4_for_each(int (*func)(struct pool4_node *, void *), void * arg)
+int pool4_for_each_usage(int (*func)(struct pool4_usage_usr *, void *), void *arg)
 {
+	struct usage_walk walk = { .func = func, .arg = arg };
 	int error;
 
-	spin_lock_bh(&pool_lock);
-	error = pool4_table_for_each(&pool, func, arg);
-	spin_unlock_bh(&pool_lock);
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
+	error = pool4_table_for_each(&pool, walk_node_usage, &walk);
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
 
 	return error;
 }
 
 int pool4_count(__u64 *result)
 {
-	spin_lock_bh(&pool_lock);
+	struct pool4_range *range;
+
+	jool_lock_bh(&pool_lock, JLOCK_POOL4);
 	*result = pool.node_count - inactives_pool4_node_counter;
-	spin_unlock_bh(&pool_lock);
+	/* The nodes of the ranges were already counted. */
+	list_for_each_entry(range, &ranges, list_hook)
+		*result += range_size(range) - range->nodes;
+	jool_unlock_bh(&pool_lock, JLOCK_POOL4);
 	return 0;
 }
@@ -1,9 +1,14 @@
 #include "nat64/mod/pool6.h"
 #include "nat64/comm/constants.h"
 #include "nat64/comm/str_utils.h"
+#include "nat64/mod/rfc6052.h"
+#include "nat64/mod/stats.h"
 #include "nat64/mod/types.h"
 
 #include <linux/inet.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <net/ipv6.h>
 
 
@@ -19,13 +24,49 @@ struct pool_node {
 
 /**
  * The global container of the entire pool.
- * It can be a linked list because we're assuming we won't be holding too many prefixes.
- * The list contains nodes of type pool_node.
+ * The list contains nodes of type pool_node, in the order they were added. Packets don't walk it;
+ * they query the snapshot instead.
  */
 static LIST_HEAD(pool);
 static u64 pool_count;
 static DEFINE_SPINLOCK(pool_lock);
 
+/** The prefix lengths RFC 6052 allows, longest first (which is the order lookups try them in). */
+static const __u8 lengths[] = { 96, 64, 56, 48, 40, 32 };
+#define LENGTH_COUNT ARRAY_SIZE(lengths)
+
+/**
+ * A read-only copy of the pool, so packets don't need pool_lock.
+ * Readers need rcu_read_lock_bh(); writers need pool_lock.
+ *
+ * "prefixes" is sorted by length (longest first) and then by address; "groups" indexes it by
+ * length. RFC 6052 lengths are multiples of 8, so matching a group is a binary search over whole
+ * bytes, and the first group that matches holds the longest match.
+ *
+ * Every RFC 6052 prefix is at least 32 bits long, so "heads" (the distinct first 32 bits of
+ * "prefixes", in host byte order and sorted) tells most of the addresses that don't belong to the
+ * pool apart from a single small array. That's the typical packet the hooks see on a router that
+ * is not only a NAT64.
+ */
+struct pool6_snapshot {
+	/** A copy of the oldest prefix in the pool; see pool6_peek(). Garbage if "count" is 0. */
+	struct ipv6_prefix oldest;
+	unsigned int count;
+	struct pool6_group {
+		/** Index of the group's first prefix within "prefixes". */
+		unsigned int offset;
+		unsigned int count;
+	} groups[LENGTH_COUNT];
+	unsigned int head_count;
+	/** Lives in the same allocation, after "prefixes". */
+	__u32 *heads;
+	struct rcu_head rcu_hook;
+	struct ipv6_prefix prefixes[0];
+};
+
+/** NULL means the snapshot could not be allocated; lookups then fall back to the list. */
+static struct pool6_snapshot __rcu *snapshot;
+
 static int verify_prefix(int start, struct ipv6_prefix *prefix)
 {
 	int i;
@@ -62,6 +103,189 @@ static int validate_prefix(struct ipv6_prefix *prefix)
 	}
 }
 
+static int compare_prefixes(const void *a, const void *b)
+{
+	const struct ipv6_prefix *prefix1 = a;
+	const struct ipv6_prefix *prefix2 = b;
+
+	if (prefix1->len != prefix2->len)
+		return (prefix1->len > prefix2->len) ? -1 : 1;
+	/* validate_prefix() made sure the suffixes are zero, so they don't alter the order. */
+	return memcmp(&prefix1->address, &prefix2->address, sizeof(prefix1->address));
+}
+
+static int compare_heads(const void *a, const void *b)
+{
+	__u32 head1 = *((const __u32 *) a);
+	__u32 head2 = *((const __u32 *) b);
+
+	if (head1 == head2)
+		return 0;
+	return (head1 < head2) ? -1 : 1;
+}
+
+/**
+ * Returns the length of a snapshot of "count" prefixes.
+ */
+static size_t snapshot_size(unsigned int count)
+{
+	struct pool6_snapshot *snap;
+
+	return sizeof(*snap) + count * (sizeof(snap->prefixes[0]) + sizeof(__u32));
+}
+
+static void free_snapshot(struct pool6_snapshot *snap)
+{
+	if (snap) {
+		jool_mem_add(JMEM_POOL6, -(long) snapshot_size(snap->count));
+		kfree(snap);
+	}
+}
+
+static void free_snapshot_rcu(struct rcu_head *rcu_hook)
+{
+	free_snapshot(container_of(rcu_hook, struct pool6_snapshot, rcu_hook));
+}
+
+/**
+ * Publishes a new snapshot, to reflect the pool's current prefixes.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void rebuild_snapshot(void)
+{
+	struct pool6_snapshot *new, *old;
+	struct pool_node *node;
+	unsigned int i, g;
+
+	new = kmalloc(snapshot_size(pool_count), GFP_ATOMIC);
+	if (new) {
+		jool_mem_add(JMEM_POOL6, snapshot_size(pool_count));
+		new->count = 0;
+		list_for_each_entry(node, &pool, list_hook)
+			new->prefixes[new->count++] = node->prefix;
+		if (new->count)
+			new->oldest = new->prefixes[0];
+		sort(new->prefixes, new->count, sizeof(new->prefixes[0]), compare_prefixes, NULL);
+
+		for (i = 0, g = 0; g < LENGTH_COUNT; g++) {
+			new->groups[g].offset = i;
+			while (i < new->count && new->prefixes[i].len == lengths[g])
+				i++;
+			new->groups[g].count = i - new->groups[g].offset;
+		}
+
+		new->heads = (__u32 *) &new->prefixes[new->count];
+		for (i = 0; i < new->count; i++)
+			new->heads[i] = be32_to_cpu(new->prefixes[i].address.s6_addr32[0]);
+		sort(new->heads, new->count, sizeof(new->heads[0]), compare_heads, NULL);
+		new->head_count = 0;
+		for (i = 0; i < new->count; i++)
+			if (!new->head_count || new->heads[new->head_count - 1] != new->heads[i])
+				new->heads[new->head_count++] = new->heads[i];
+	} else {
+		log_err("Could not allocate the IPv6 pool's snapshot; it will be slower for a while.");
+	}
+
+	old = rcu_dereference_protected(snapshot, lockdep_is_held(&pool_lock));
+	rcu_assign_pointer(snapshot, new);
+	if (old)
+		call_rcu_bh(&old->rcu_hook, free_snapshot_rcu);
+}
+
+/**
+ * Returns whether "addr"'s first 32 bits are one of "snap"'s heads; ie. whether it's worth
+ * looking for its prefix. The caller must hold rcu_read_lock_bh().
+ */
+static bool snapshot_has_head(struct pool6_snapshot *snap, const struct in6_addr *addr)
+{
+	__u32 head = be32_to_cpu(addr->s6_addr32[0]);
+	unsigned int low = 0, high = snap->head_count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (snap->heads[mid] == head)
+			return true;
+		if (head < snap->heads[mid])
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return false;
+}
+
+/**
+ * Returns the longest prefix from "snap" that contains "addr", or NULL if there's none.
+ * The caller must hold rcu_read_lock_bh().
+ */
+static struct ipv6_prefix *snapshot_get(struct pool6_snapshot *snap, const struct in6_addr *addr)
+{
+	struct pool6_group *group;
+	unsigned int low, high, mid;
+	int gap;
+	int g;
+
+	if (!snapshot_has_head(snap, addr))
+		return NULL;
+
+	for (g = 0; g < LENGTH_COUNT; g++) {
+		group = &snap->groups[g];
+		low = group->offset;
+		high = group->offset + group->count;
+
+		while (low < high) {
+			mid = low + (high - low) / 2;
+			gap = memcmp(addr, &snap->prefixes[mid].address, lengths[g] >> 3);
+			if (gap == 0)
+				return &snap->prefixes[mid];
+			if (gap < 0)
+				high = mid;
+			else
+				low = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Same as snapshot_get(), except it walks the list.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static struct ipv6_prefix *list_get(const struct in6_addr *addr)
+{
+	struct pool_node *node;
+	struct ipv6_prefix *result = NULL;
+
+	list_for_each_entry(node, &pool, list_hook) {
+		if (ipv6_prefix_equal(&node->prefix.address, addr, node->prefix.len)
+				&& (!result || node->prefix.len > result->len))
+			result = &node->prefix;
+	}
+
+	return result;
+}
+
+/**
+ * Forgets the pool's prefixes. Remember to rebuild_snapshot() afterwards.
+ *
+ * Assumes that pool has already been locked (pool_lock).
+ */
+static void empty_list(void)
+{
+	struct pool_node *node;
+
+	while (!list_empty(&pool)) {
+		node = container_of(pool.next, struct pool_node, list_hook);
+		list_del(&node->list_hook);
+		kfree(node);
+		jool_mem_add(JMEM_POOL6, -(long) sizeof(*node));
+	}
+	pool_count = 0;
+}
+
 int pool6_init(char *pref_strs[], int pref_count)
 {
 	char *defaults[] = POOL6_DEF;
@@ -73,6 +297,7 @@ int pool6_init(char *pref_strs[], int pref_count)
 	}
 
 	pool_count = 0;
+	RCU_INIT_POINTER(snapshot, NULL);
 
 	for (i = 0; i < pref_count; i++) {
 		struct ipv6_prefix pref;
@@ -99,66 +324,120 @@ silent_failure:
 
 void pool6_destroy(void)
 {
-	while (!list_empty(&pool)) {
-		struct pool_node *node = container_of(pool.next, struct pool_node, list_hook);
-		list_del(&node->list_hook);
-		kfree(node);
-	}
+	struct pool6_snapshot *snap;
+
+	spin_lock_bh(&pool_lock);
+	empty_list();
+	snap = rcu_dereference_protected(snapshot, lockdep_is_held(&pool_lock));
+	RCU_INIT_POINTER(snapshot, NULL);
+	spin_unlock_bh(&pool_lock);
+
+	free_snapshot(snap);
+	/* Wait for the old snapshots' callbacks. */
+	rcu_barrier_bh();
 }
 
 int pool6_flush(void)
 {
 	spin_lock_bh(&pool_lock);
-	pool6_destroy();
+	empty_list();
+	rebuild_snapshot();
 	spin_unlock_bh(&pool_lock);
 	return 0;
 }
 
 int pool6_get(struct in6_addr *addr, struct ipv6_prefix *result)
 {
-	struct pool_node *node;
+	struct pool6_snapshot *snap;
+	struct ipv6_prefix *prefix;
+	bool empty;
 
 	if (WARN(!addr, "NULL is not a valid address."))
 		return -EINVAL;
 
-	spin_lock_bh(&pool_lock);
-
-	if (list_empty(&pool)) {
-		spin_unlock_bh(&pool_lock);
-		log_warn_once("The IPv6 pool is empty.");
-		return -ENOENT;
-	}
-
-	list_for_each_entry(node, &pool, list_hook) {
-		if (ipv6_prefix_equal(&node->prefix.address, addr, node->prefix.len)) {
-			*result = node->prefix;
-			spin_unlock_bh(&pool_lock);
-			return 0;
-		}
+	rcu_read_lock_bh();
+	snap = rcu_dereference_bh(snapshot);
+	if (snap) {
+		empty = !snap->count;
+		prefix = snapshot_get(snap, addr);
+		if (prefix)
+			*result = *prefix;
+		rcu_read_unlock_bh();
+		goto end;
 	}
+	rcu_read_unlock_bh();
 
+	spin_lock_bh(&pool_lock);
+	empty = list_empty(&pool);
+	prefix = list_get(addr);
+	if (prefix)
+		*result = *prefix;
 	spin_unlock_bh(&pool_lock);
-	return -ENOENT;
+	/* Fall through. */
+
+end:
+	if (empty)
+		log_warn_once("The IPv6 pool is empty.");
+	return prefix ? 0 : -ENOENT;
 }
 
 int pool6_peek(struct ipv6_prefix *result)
 {
+	struct pool6_snapshot *snap;
 	struct pool_node *node;
+	int error = 0;
+
+	rcu_read_lock_bh();
+	snap = rcu_dereference_bh(snapshot);
+	if (snap) {
+		if (snap->count)
+			*result = snap->oldest;
+		else
+			error = -ENOENT;
+		rcu_read_unlock_bh();
+		goto end;
+	}
+	rcu_read_unlock_bh();
 
 	spin_lock_bh(&pool_lock);
-
 	if (list_empty(&pool)) {
-		spin_unlock_bh(&pool_lock);
-		log_warn_once("The IPv6 pool is empty.");
-		return -ENOENT;
+		error = -ENOENT;
+	} else {
+		/* Just return the first one. */
+		node = container_of(pool.next, struct pool_node, list_hook);
+		*result = node->prefix;
 	}
+	spin_unlock_bh(&pool_lock);
+	/* Fall through. */
 
-	/* Just return the first one. */
-	node = container_of(pool.next, struct pool_node, list_hook);
-	*result = node->prefix;
+end:
+	if (error)
+		log_warn_once("The IPv6 pool is empty.");
+	return error;
+}
 
-	spin_unlock_bh(&pool_lock);
-	return 0;
+int pool6_4to6(const struct in_addr *addr4, struct in6_addr *result)
+{
+	struct pool6_snapshot *snap;
+	struct ipv6_prefix prefix;
+	int error;
+
+	rcu_read_lock_bh();
+	snap = rcu_dereference_bh(snapshot);
+	if (likely(snap)) {
+		error = snap->count ? addr_4to6(addr4, &snap->oldest, result) : -ENOENT;
+		rcu_read_unlock_bh();
+		if (error == -ENOENT)
+			log_warn_once("The IPv6 pool is empty.");
+		return error;
+	}
+	rcu_read_unlock_bh();
+
+	/* No snapshot; pool6_peek() knows how to deal with the list. */
+	error = pool6_peek(&prefix);
+	if (error)
+		return error;
+	return addr_4to6(addr4, &prefix, result);
 }
 
 bool pool6_contains(struct in6_addr *addr)
@@ -194,10 +473,12 @@ int pool6_add(struct ipv6_prefix *prefix)
 		log_err("Allocation of IPv6 pool node failed.");
 		return -ENOMEM;
 	}
+	jool_mem_add(JMEM_POOL6, sizeof(*node));
 	node->prefix = *prefix;
 
 	list_add_tail(&node->list_hook, &pool);
 	pool_count++;
+	rebuild_snapshot();
 	spin_unlock_bh(&pool_lock);
 
 	return 0;
@@ -222,7 +503,9 @@ int pool6_remove(struct ipv6_prefix *prefix)
 		if (ipv6_prefix_equals(&node->prefix, prefix)) {
 			list_del(&node->list_hook);
 			kfree(node);
+			jool_mem_add(JMEM_POOL6, -(long) sizeof(*node));
 			pool_count--;
+			rebuild_snapshot();
 			spin_unlock_bh(&pool_lock);
 			return 0;
 		}
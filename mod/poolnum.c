@@ -1,41 +1,115 @@
 #include "nat64/mod/poolnum.h"
 
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
 #include <linux/slab.h>
 
 #include "nat64/mod/types.h"
 #include "nat64/mod/random.h"
+#include "nat64/mod/stats.h"
 
 
 /**
  * @file
  * A pool of 16-bit numbers, which are assumed to be going to be used as ports.
  *
- * The pool tries to be as efficient as possible during packet processing, so it assumes it is used
- * in very controlled environments, which sacrifices robustness. Do *not* return numbers that were
- * originally not part of the pool; validations against this are very ineffective.
+ * The pool is a bitmap with a one-bit-per-word summary on top, so borrowing and returning any
+ * number, including a specific one, takes constant time. (Finding an available word takes at most
+ * count / BITS_PER_LONG^2 word reads, which is 16 on 32-bit machines for a full port range.)
+ *
+ * The bitmap is not allocated until the first number is borrowed. A large pool4 is mostly made of
+ * pools nobody has needed yet, so this way they cost nothing more than the struct (and registering
+ * thousands of addresses doesn't take thousands of bitmaps worth of work).
+ *
+ * The pool assumes it is used in very controlled environments. Returned numbers are validated
+ * against the range, but not against the caller; do *not* return other people's numbers.
  *
  * @author Alberto Leiva
  */
 
 
 /**
- * Returns a two-byte random number between min and max, inclusive.
+ * Returns the length of the allocation that holds the bitmap and summary of "count" numbers.
+ */
+static size_t bits_size(u32 count)
+{
+	u32 words = BITS_TO_LONGS(count);
+
+	return (words + BITS_TO_LONGS(words)) * sizeof(unsigned long);
+}
+
+/**
+ * Returns the index "value" would have in "pool", or -EINVAL if "value" is not part of the pool.
+ */
+static int value_to_index(struct poolnum *pool, u16 value)
+{
+	u32 offset, run;
+
+	if (value < pool->min)
+		return -EINVAL;
+	offset = value - pool->min;
+	run = offset / pool->stride;
+	offset %= pool->stride;
+	if (offset % pool->step || offset / pool->step >= pool->per_run)
+		return -EINVAL;
+
+	offset = run * pool->per_run + offset / pool->step;
+	return (offset < pool->count) ? offset : -EINVAL;
+}
+
+/**
+ * Returns the number whose index in "pool" is "index".
+ */
+static u16 index_to_value(struct poolnum *pool, u32 index)
+{
+	return pool->min + (index / pool->per_run) * pool->stride
+			+ (index % pool->per_run) * pool->step;
+}
+
+/**
+ * Allocates "pool"'s bitmap, unless it already exists. Every number starts available.
+ */
+static int alloc_bits(struct poolnum *pool)
+{
+	if (likely(pool->bits))
+		return 0;
+
+	pool->bits = kmalloc(bits_size(pool->count), GFP_ATOMIC);
+	if (!pool->bits)
+		return -ENOMEM;
+	pool->summary = pool->bits + BITS_TO_LONGS(pool->count);
+	jool_mem_add(JMEM_POOL4, bits_size(pool->count));
+
+	bitmap_fill(pool->bits, pool->count);
+	bitmap_fill(pool->summary, BITS_TO_LONGS(pool->count));
+	return 0;
+}
+
+/**
+ * Marks the "index"th number as borrowed.
  */
-static int random_by_range(u16 min, u16 max)
+static void take(struct poolnum *pool, u32 index)
 {
-	u32 random_num = get_random_u32();
-	return min + random_num % (max - min + 1);
+	u32 word = BIT_WORD(index);
+
+	__clear_bit(index, pool->bits);
+	if (!pool->bits[word])
+		__clear_bit(word, pool->summary);
+	pool->available--;
 }
 
 /**
  * Initializes "pool".
- * "pool" will contain every number in "step" increments between "min" and "max" (inclusive) in a
- * random order.
- * eg. poolnum_init(pool, 1, 10, 3) will fill pool with 1, 4, 7 and 10.
+ * "pool" will contain every number in "step" increments between "min" and "max" (inclusive).
+ * eg. poolnum_init(pool, 1, 10, 3, false) will fill pool with 1, 4, 7 and 10.
+ *
+ * If "randomize" is true, the numbers will be lent in an order that is hard to predict. We're not
+ * really sure this serves any purpose; it makes the source ports Jool uses unpredictable to some
+ * extent, but that probably doesn't add any security.
  */
-int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step)
+int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step, bool randomize)
 {
-	u32 i, j;
+	u32 count;
 
 	if (min > max) {
 		u16 temp = min;
@@ -43,29 +117,41 @@ int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step)
 		max = temp;
 	}
 
+	count = (max - min) / step + 1;
+	return poolnum_init_runs(pool, min, step, count, count * step, 1, randomize);
+}
 
-	pool->count = (max - min) / step + 1;
-	pool->array = kmalloc(pool->count * sizeof(u16), GFP_ATOMIC);
-	if (!pool->array)
-		return -ENOMEM;
-	/*
-	 * Initialize and shuffle the numbers (http://en.wikipedia.org/wiki/Fisher-Yates_shuffle).
-	 *
-	 * We're not really sure if we should do this. Randomizing the order upon initialization likely
-	 * doesn't serve any purpose; it makes the source ports Jool uses unpredictable to some extent,
-	 * but that probably doesn't add any security.
-	 */
-	pool->array[0] = min;
-	for (i = 1; i < pool->count; i++) {
-		j = random_by_range(0, i);
-		pool->array[i] = pool->array[j];
-		pool->array[j] = min + step * i;
-	}
-
+/**
+ * Initializes "pool" as "runs" runs of "per_run" numbers. The numbers within a run are "step"
+ * apart, and the runs are "stride" apart.
+ * eg. poolnum_init_runs(pool, 8, 1, 2, 16, 3, false) will fill pool with 8, 9, 24, 25, 40 and 41.
+ *
+ * The last number must fit in 16 bits. See poolnum_init() for "randomize".
+ */
+int poolnum_init_runs(struct poolnum *pool, u16 min, u16 step, u32 per_run, u32 stride, u32 runs,
+		bool randomize)
+{
+	pool->bits = NULL;
+	pool->summary = NULL;
+	pool->min = min;
+	pool->step = step;
+	pool->per_run = per_run;
+	pool->stride = stride;
+	pool->count = per_run * runs;
+	pool->available = pool->count;
 	pool->next = 0;
-	pool->returned = 0;
-	pool->next_is_ahead = false;
+	pool->randomize = randomize;
+	return 0;
+}
 
+/**
+ * Initializes "pool" as a pool that contains no numbers at all.
+ */
+int poolnum_init_empty(struct poolnum *pool)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->step = 1;
+	pool->stride = 1;
 	return 0;
 }
 
@@ -74,19 +160,33 @@ int poolnum_init(struct poolnum *pool, u16 min, u16 max, u16 step)
  */
 void poolnum_destroy(struct poolnum *pool)
 {
-	if (pool)
-		kfree(pool->array);
+	/* "summary" lives in the same allocation. */
+	if (pool && pool->bits) {
+		jool_mem_add(JMEM_POOL4, -(long) bits_size(pool->count));
+		kfree(pool->bits);
+	}
 }
 
 /**
- * Returns "index"'s successor. Wraps "index" around "max" (i. e. (max - 1)'s successor is zero).
+ * Returns the index of the first available number at or after "start", wrapping around.
+ * The pool is assumed to not be empty.
  */
-static u32 get_next_index(u32 index, u32 max)
+static u32 find_available(struct poolnum *pool, u32 start)
 {
-	index++;
-	if (index >= max)
-		index = 0;
-	return index;
+	u32 words = BITS_TO_LONGS(pool->count);
+	u32 word = BIT_WORD(start);
+	unsigned long bits;
+
+	/* The rest of "start"'s own word. */
+	bits = pool->bits[word] & (~0UL << (start % BITS_PER_LONG));
+	if (bits)
+		return word * BITS_PER_LONG + __ffs(bits);
+
+	word = find_next_bit(pool->summary, words, word + 1);
+	if (word >= words)
+		word = find_first_bit(pool->summary, words);
+
+	return word * BITS_PER_LONG + __ffs(pool->bits[word]);
 }
 
 /**
@@ -94,64 +194,139 @@ static u32 get_next_index(u32 index, u32 max)
  */
 int poolnum_get_any(struct poolnum *pool, u16 *result)
 {
+	u32 index;
+	int error;
+
 	if (poolnum_is_empty(pool))
 		return -ESRCH; /* We ran out of values. */
+	error = alloc_bits(pool);
+	if (error)
+		return error;
+
+	index = find_available(pool, pool->randomize ? (get_random_u32() % pool->count) : pool->next);
+	take(pool, index);
+
+	/* Lend the numbers in order, so the recently returned ones rest for a while. */
+	pool->next = (index + 1 < pool->count) ? (index + 1) : 0;
 
-	*result = pool->array[pool->next];
-	pool->next = get_next_index(pool->next, pool->count);
-	pool->next_is_ahead = true;
+	*result = index_to_value(pool, index);
 	return 0;
 }
 
 /**
- * Borrows "value" from "pool".
- * This function is slow; avoid it during packet processing.
+ * Borrows and sets "result" as a number from "pool" whose value, divided by 2^"shift", is congruent
+ * to "slice" modulo "slices". In other words, the values are cut into chunks of 2^"shift"
+ * numbers, which are dealt to "slices" owners in turn, and this only lends from "slice"'s chunks.
+ *
+ * Only single-run pools are sliced; returns -ESRCH if "pool" has several runs, or if the chunks of
+ * "slice" are all borrowed.
  */
-int poolnum_get(struct poolnum *pool, u16 value)
+int poolnum_get_slice(struct poolnum *pool, unsigned int shift, unsigned int slices,
+		unsigned int slice, u16 *result)
 {
-	u32 current_index;
+	u32 owned, k, n, first, lo, hi, index;
 
-	if (poolnum_is_empty(pool))
+	if (poolnum_is_empty(pool) || pool->per_run != pool->count || slice >= slices)
+		return -ESRCH;
+	if (alloc_bits(pool))
+		return -ENOMEM;
+
+	/* Chunks 0 through the last number's; "slice" owns every "slices"th, from "slice" on. */
+	n = (index_to_value(pool, pool->count - 1) >> shift) + 1;
+	if (n <= slice)
 		return -ESRCH;
+	owned = (n - slice - 1) / slices + 1;
+
+	index = pool->randomize ? (get_random_u32() % pool->count) : pool->next;
+	first = index_to_value(pool, index) >> shift;
+	k = (first <= slice) ? 0 : DIV_ROUND_UP(first - slice, slices);
+
+	for (n = 0; n < owned; n++, k++) {
+		if (k >= owned)
+			k = 0;
+
+		/* The chunk's values, as indexes. */
+		lo = (slice + k * slices) << shift;
+		hi = lo + (1 << shift);
+		lo = (lo <= pool->min) ? 0 : DIV_ROUND_UP(lo - pool->min, pool->step);
+		hi = (hi <= pool->min) ? 0 : DIV_ROUND_UP(hi - pool->min, pool->step);
+		if (hi > pool->count)
+			hi = pool->count;
+		if (lo >= hi)
+			continue;
 
-	current_index = pool->next;
-	do {
-		if (pool->array[current_index] == value) {
-			pool->array[current_index] = pool->array[pool->next];
-			pool->next = get_next_index(pool->next, pool->count);
-			pool->next_is_ahead = true;
+		index = find_next_bit(pool->bits, hi, lo);
+		if (index < hi) {
+			take(pool, index);
+			pool->next = (index + 1 < pool->count) ? (index + 1) : 0;
+			*result = index_to_value(pool, index);
 			return 0;
 		}
-		current_index = get_next_index(current_index, pool->count);
-	} while (current_index != pool->returned);
+	}
 
 	return -ESRCH;
 }
 
+/**
+ * Borrows "value" from "pool".
+ */
+int poolnum_get(struct poolnum *pool, u16 value)
+{
+	int index;
+
+	index = value_to_index(pool, value);
+	if (index < 0)
+		return -ESRCH;
+	if (alloc_bits(pool))
+		return -ENOMEM;
+	if (!test_bit(index, pool->bits))
+		return -ESRCH;
+
+	take(pool, index);
+	return 0;
+}
+
 /**
  * Returns "value" to "pool".
  */
 int poolnum_return(struct poolnum *pool, u16 value)
 {
-	if (WARN_IF_REAL(poolnum_is_full(pool), "Something's trying to return values that were "
-			"originally not part of the pool."))
+	int index;
+
+	index = value_to_index(pool, value);
+	if (WARN_IF_REAL(index < 0, "Something's trying to return values that were originally not "
+			"part of the pool."))
+		return -EINVAL;
+	if (WARN_IF_REAL(!pool->bits || test_bit(index, pool->bits), "Something's trying to "
+			"return a value that was not borrowed."))
 		return -EINVAL;
 
-	pool->array[pool->returned] = value;
-	pool->returned = get_next_index(pool->returned, pool->count);
-	if (pool->next == pool->returned)
-		pool->next_is_ahead = false;
+	__set_bit(index, pool->bits);
+	__set_bit(BIT_WORD(index), pool->summary);
+	pool->available++;
 
 	return 0;
 }
 
+/**
+ * Returns whether "value" belongs to "pool" and hasn't been borrowed.
+ */
+bool poolnum_is_available(struct poolnum *pool, u16 value)
+{
+	int index = value_to_index(pool, value);
+	if (index < 0)
+		return false;
+	/* No bitmap means nothing has been borrowed yet. */
+	return !pool->bits || test_bit(index, pool->bits);
+}
+
 /**
  * Returns whether the pool has all of its values (ie. nobody has requested anything, or everyone
  * has returned everything).
  */
 bool poolnum_is_full(struct poolnum *pool)
 {
-	return (!pool->next_is_ahead) && (pool->returned == pool->next);
+	return pool->available == pool->count;
 }
 
 /**
@@ -159,5 +334,5 @@ bool poolnum_is_full(struct poolnum *pool)
  */
 bool poolnum_is_empty(struct poolnum *pool)
 {
-	return pool->next_is_ahead && (pool->returned == pool->next);
+	return pool->available == 0;
 }
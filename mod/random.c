@@ -1,40 +1,43 @@
 #include "nat64/mod/random.h"
 #include "nat64/comm/types.h"
 #include <linux/random.h>
-#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/interrupt.h>
 
 
-#define BUFFER_SIZE 1024
-static u8 buffer[BUFFER_SIZE];
-static DEFINE_SPINLOCK(buffer_lock);
-static u32 last_returned = BUFFER_SIZE;
+#define BUFFER_WORDS 256
 
+/**
+ * A CPU's stash of get_random_bytes() output.
+ * Every CPU has its own, so nobody ever waits for anybody else.
+ */
+struct random_buffer {
+	u32 words[BUFFER_WORDS];
+	/** Index of the next word to return. BUFFER_WORDS means "refill first". */
+	unsigned int next;
+};
 
-static u8 get_next_byte(void)
-{
-	u8 result;
-
-	if (last_returned >= BUFFER_SIZE) {
-		get_random_bytes(buffer, sizeof(buffer));
-		last_returned = 0;
-	}
-
-	result = buffer[last_returned];
-	last_returned++;
+static DEFINE_PER_CPU(struct random_buffer, buffers) = { .next = BUFFER_WORDS };
 
-	return result;
-}
 
 u32 get_random_u32(void)
 {
+	struct random_buffer *buffer;
 	u32 result;
-	spin_lock_bh(&buffer_lock);
 
-	result = (get_next_byte() << 24)
-				| (get_next_byte() << 16)
-				| (get_next_byte() << 8)
-				| get_next_byte();
+	/*
+	 * Callers live in both process and softirq context, so the only thing that can step on
+	 * our toes is a softirq on this same CPU. Fence those out, and we're on our own.
+	 */
+	local_bh_disable();
+	buffer = this_cpu_ptr(&buffers);
+
+	if (buffer->next >= BUFFER_WORDS) {
+		get_random_bytes(buffer->words, sizeof(buffer->words));
+		buffer->next = 0;
+	}
+	result = buffer->words[buffer->next++];
 
-	spin_unlock_bh(&buffer_lock);
+	local_bh_enable();
 	return result;
 }
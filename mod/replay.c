@@ -0,0 +1,112 @@
+#include "nat64/mod/replay.h"
+#include "nat64/mod/types.h"
+#include "nat64/mod/core.h"
+#include "nat64/mod/namespace.h"
+
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/skbuff.h>
+
+/**
+ * Builds a freshly received skb out of the "len" bytes of "pkt". Returns NULL if "pkt" is not an
+ * IP packet, or if there's no memory.
+ *
+ * Captures include the link layer's padding, so like ip_rcv() and ipv6_rcv(), this trims the
+ * packet to the length its header claims.
+ */
+static struct sk_buff *build_skb_from(void *pkt, unsigned int len, struct net_device *dev)
+{
+	struct sk_buff *skb;
+	__be16 protocol;
+	unsigned int ip_len;
+
+	if (len < 1)
+		return NULL;
+	switch ((*(__u8 *) pkt) >> 4) {
+	case 4:
+		if (len < sizeof(struct iphdr))
+			return NULL;
+		protocol = htons(ETH_P_IP);
+		ip_len = be16_to_cpu(((struct iphdr *) pkt)->tot_len);
+		break;
+	case 6:
+		if (len < sizeof(struct ipv6hdr))
+			return NULL;
+		protocol = htons(ETH_P_IPV6);
+		ip_len = sizeof(struct ipv6hdr)
+				+ be16_to_cpu(((struct ipv6hdr *) pkt)->payload_len);
+		break;
+	default:
+		return NULL;
+	}
+
+	if (ip_len > len)
+		return NULL;
+	len = ip_len;
+
+	skb = alloc_skb(LL_MAX_HEADER + len, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, LL_MAX_HEADER);
+	memcpy(skb_put(skb, len), pkt, len);
+	skb_reset_mac_header(skb);
+	skb_reset_network_header(skb);
+	skb->protocol = protocol;
+	skb->pkt_type = PACKET_HOST;
+	skb->ip_summed = CHECKSUM_NONE;
+	skb->dev = dev;
+
+	return skb;
+}
+
+int replay_packets(void *payload, size_t len, struct replay_result_usr *result)
+{
+	struct replay_pkt_usr *hdr;
+	struct net_device *dev = joolns_get()->loopback_dev;
+	struct sk_buff *skb;
+	size_t offset = 0;
+	unsigned int verdict;
+
+	memset(result, 0, sizeof(*result));
+
+	while (offset < len) {
+		if (len - offset < sizeof(*hdr))
+			return -EINVAL;
+		hdr = payload + offset;
+		offset += sizeof(*hdr);
+		if (len - offset < hdr->len)
+			return -EINVAL;
+
+		skb = build_skb_from(payload + offset, hdr->len, dev);
+		offset += ALIGN(hdr->len, REPLAY_ALIGN);
+		if (!skb) {
+			result->malformed++;
+			continue;
+		}
+
+		/* The hooks run in softirq context, and so does everything they call. */
+		local_bh_disable();
+		verdict = (skb->protocol == htons(ETH_P_IP)) ? core_4to6(skb) : core_6to4(skb);
+		local_bh_enable();
+
+		switch (verdict) {
+		case NF_STOLEN:
+			result->stolen++;
+			break;
+		case NF_DROP:
+			kfree_skb(skb);
+			result->dropped++;
+			break;
+		default:
+			kfree_skb(skb);
+			result->ignored++;
+			break;
+		}
+	}
+
+	return 0;
+}
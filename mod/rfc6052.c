@@ -10,7 +10,7 @@ union ipv4_address {
 	__u8 as8[4];
 };
 
-int addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix, struct in_addr *dst)
+int __addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix, struct in_addr *dst)
 {
 	union ipv4_address dst_aux;
 
@@ -55,7 +55,7 @@ int addr_6to4(struct in6_addr *src, struct ipv6_prefix *prefix, struct in_addr *
 	return 0;
 }
 
-int addr_4to6(struct in_addr *src, struct ipv6_prefix *prefix, struct in6_addr *dst)
+int __addr_4to6(const struct in_addr *src, const struct ipv6_prefix *prefix, struct in6_addr *dst)
 {
 	union ipv4_address src_aux;
 
@@ -3,34 +3,83 @@
 #include "nat64/comm/types.h"
 #include "nat64/mod/stats.h"
 #include "nat64/mod/icmp_wrapper.h"
-#ifdef BENCHMARK
 #include "nat64/mod/log_time.h"
-#endif
+#include "nat64/mod/namespace.h"
 
 #include <linux/version.h>
 #include <linux/list.h>
 #include <linux/icmp.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <net/arp.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
 #include <net/ip6_route.h>
+#include <net/ndisc.h>
+#include <net/neighbour.h>
 #include <net/route.h>
 
 
 static struct sendpkt_config *config;
 
+/** Number of routes each CPU remembers. Has to be a power of two. */
+#define ROUTE_CACHE_SLOTS 64
+
+/**
+ * The routes the current CPU has found lately, indexed by destination. Saves most of the packets
+ * from a routing table lookup; sendpkt_route4_cached() and sendpkt_route6_cached() explain how.
+ */
+struct route_cache {
+	struct sendpkt_route_cache slots[ROUTE_CACHE_SLOTS];
+};
+
+static struct route_cache __percpu *route_caches;
+static u32 hash_rnd;
+
 int sendpkt_init(void)
 {
-	config = kmalloc(sizeof(*config), GFP_ATOMIC);
+	struct route_cache *cache;
+	unsigned int i;
+	int cpu;
+
+	config = config_alloc(sizeof(*config), GFP_ATOMIC);
 	if (!config)
 		return -ENOMEM;
 
 	config->min_ipv6_mtu = TRAN_DEF_MIN_IPV6_MTU;
+	config->direct_xmit = TRAN_DEF_DIRECT_XMIT;
+
+	route_caches = alloc_percpu(struct route_cache);
+	if (!route_caches) {
+		config_free(config);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(route_caches, cpu);
+		for (i = 0; i < ROUTE_CACHE_SLOTS; i++)
+			sendpkt_route_cache_init(&cache->slots[i]);
+	}
+	get_random_bytes(&hash_rnd, sizeof(hash_rnd));
 
 	return 0;
 }
 
 void sendpkt_destroy(void)
 {
-	kfree(config);
+	struct route_cache *cache;
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(route_caches, cpu);
+		for (i = 0; i < ROUTE_CACHE_SLOTS; i++)
+			sendpkt_route_cache_flush(&cache->slots[i]);
+	}
+	free_percpu(route_caches);
+
+	rcu_barrier_bh(); /* Wait for the configurations retired by config_retire(). */
+	config_free(config);
 }
 
 int sendpkt_clone_config(struct sendpkt_config *clone)
@@ -46,42 +95,48 @@ int sendpkt_set_config(enum sendpkt_type type, size_t size, void *value)
 	struct sendpkt_config *tmp_config;
 	struct sendpkt_config *old_config;
 
-	if (type != MIN_IPV6_MTU) {
+	switch (type) {
+	case MIN_IPV6_MTU:
+		if (size != sizeof(__u16)) {
+			log_err("Expected an 2-byte integer, got %zu bytes.", size);
+			return -EINVAL;
+		}
+		break;
+	case DIRECT_XMIT:
+		if (size != sizeof(__u8)) {
+			log_err("Expected a boolean, got %zu bytes.", size);
+			return -EINVAL;
+		}
+		break;
+	default:
 		log_err("Unknown config type for the 'send packet' module: %u", type);
 		return -EINVAL;
 	}
 
-	if (size != sizeof(__u16)) {
-		log_err("Expected an 2-byte integer, got %zu bytes.", size);
-		return -EINVAL;
-	}
-
-	tmp_config = kmalloc(sizeof(*tmp_config), GFP_KERNEL);
+	tmp_config = config_alloc(sizeof(*tmp_config), GFP_KERNEL);
 	if (!tmp_config)
 		return -ENOMEM;
 
 	old_config = config;
 	*tmp_config = *old_config;
 
-	tmp_config->min_ipv6_mtu = *((__u16 *) value);
+	if (type == MIN_IPV6_MTU)
+		tmp_config->min_ipv6_mtu = *((__u16 *) value);
+	else
+		tmp_config->direct_xmit = *((__u8 *) value);
 
 	rcu_assign_pointer(config, tmp_config);
-	synchronize_rcu_bh();
-	kfree(old_config);
+	config_retire(old_config);
 	return 0;
 }
 
-int sendpkt_route4(struct sk_buff *skb)
+int __sendpkt_route4(struct sk_buff *skb, struct iphdr *hdr_ip, void *l4_hdr,
+		struct dst_entry **result)
 {
-	struct iphdr *hdr_ip = ip_hdr(skb);
 	struct flowi4 flow;
 	struct rtable *table;
 	int error;
 
-	/* Sometimes Jool needs to route prematurely, so don't sweat this on the normal pipelines. */
-	if (skb_dst(skb))
-		return 0;
-
 	memset(&flow, 0, sizeof(flow));
 	/* flow.flowi4_oif; */
 	/* flow.flowi4_iif; */
@@ -109,17 +164,17 @@ int sendpkt_route4(struct sk_buff *skb)
 
 		switch (skb_l4_proto(skb)) {
 		case L4PROTO_TCP:
-			hdr_tcp = tcp_hdr(skb);
+			hdr_tcp = l4_hdr;
 			flow.fl4_sport = hdr_tcp->source;
 			flow.fl4_dport = hdr_tcp->dest;
 			break;
 		case L4PROTO_UDP:
-			hdr_udp = udp_hdr(skb);
+			hdr_udp = l4_hdr;
 			flow.fl4_sport = hdr_udp->source;
 			flow.fl4_dport = hdr_udp->dest;
 			break;
 		case L4PROTO_ICMP:
-			hdr_icmp4 = icmp_hdr(skb);
+			hdr_icmp4 = l4_hdr;
 			flow.fl4_icmp_type = hdr_icmp4->type;
 			flow.fl4_icmp_code = hdr_icmp4->code;
 			break;
@@ -132,43 +187,59 @@ int sendpkt_route4(struct sk_buff *skb)
 	 * protocols that protect IP header information are essentially incompatible with NAT64"
 	 * (RFC 6146).
 	 */
-	table = __ip_route_output_key(&init_net, &flow);
+	table = __ip_route_output_key(joolns_get(), &flow);
 	if (!table || IS_ERR(table)) {
 		error = abs(PTR_ERR(table));
 		log_debug("__ip_route_output_key() returned %d. Cannot route packet.", error);
 		inc_stats(skb, IPSTATS_MIB_OUTNOROUTES);
+		inc_jool_stats(JSTAT_NO_ROUTE);
 		return -error;
 	}
 	if (table->dst.error) {
 		error = abs(table->dst.error);
 		log_debug("__ip_route_output_key() returned error %d. Cannot route packet.", error);
 		inc_stats(skb, IPSTATS_MIB_OUTNOROUTES);
+		inc_jool_stats(JSTAT_NO_ROUTE);
 		return -error;
 	}
 	if (!table->dst.dev) {
 		dst_release(&table->dst);
 		log_debug("I found a dst entry with no dev. I don't know what to do; failing...");
 		inc_stats(skb, IPSTATS_MIB_OUTNOROUTES);
+		inc_jool_stats(JSTAT_NO_ROUTE);
 		return -EINVAL;
 	}
 
-	skb_dst_set(skb, &table->dst);
-	skb->dev = table->dst.dev;
+	*result = &table->dst;
+	return 0;
+}
+
+int sendpkt_route4(struct sk_buff *skb)
+{
+	struct dst_entry *dst;
+	int error;
 
+	/* Sometimes Jool needs to route prematurely, so don't sweat this on the normal pipelines. */
+	if (skb_dst(skb))
+		return 0;
+
+	error = sendpkt_route4_cached(skb, ip_hdr(skb), skb_transport_header(skb), NULL, &dst);
+	if (error)
+		return error;
+
+	skb_dst_set(skb, dst);
+	skb->dev = dst->dev;
 	return 0;
 }
 
-int sendpkt_route6(struct sk_buff *skb)
+int __sendpkt_route6(struct sk_buff *skb, struct ipv6hdr *hdr_ip, void *l4_hdr,
+		struct dst_entry **result)
 {
-	struct ipv6hdr *hdr_ip = ipv6_hdr(skb);
 	struct flowi6 flow;
 	struct dst_entry *dst;
 	struct hdr_iterator iterator;
 	hdr_iterator_result iterator_result;
 
-	if (skb_dst(skb))
-		return 0;
-
 	hdr_iterator_init(&iterator, hdr_ip);
 	iterator_result = hdr_iterator_last(&iterator);
 
@@ -191,42 +262,239 @@ int sendpkt_route6(struct sk_buff *skb)
 
 		switch (skb_l4_proto(skb)) {
 		case L4PROTO_TCP:
-			hdr_tcp = tcp_hdr(skb);
+			hdr_tcp = l4_hdr;
 			flow.fl6_sport = hdr_tcp->source;
 			flow.fl6_dport = hdr_tcp->dest;
 			break;
 		case L4PROTO_UDP:
-			hdr_udp = udp_hdr(skb);
+			hdr_udp = l4_hdr;
 			flow.fl6_sport = hdr_udp->source;
 			flow.fl6_dport = hdr_udp->dest;
 			break;
 		case L4PROTO_ICMP:
-			hdr_icmp6 = icmp6_hdr(skb);
+			hdr_icmp6 = l4_hdr;
 			flow.fl6_icmp_type = hdr_icmp6->icmp6_type;
 			flow.fl6_icmp_code = hdr_icmp6->icmp6_code;
 			break;
 		}
 	}
 
-	dst = ip6_route_output(&init_net, NULL, &flow);
+	dst = ip6_route_output(joolns_get(), NULL, &flow);
 	if (!dst) {
 		log_debug("ip6_route_output() returned NULL. Cannot route packet.");
 		inc_stats(skb, IPSTATS_MIB_OUTNOROUTES);
+		inc_jool_stats(JSTAT_NO_ROUTE);
 		return -EINVAL;
 	}
 	if (dst->error) {
 		int error = abs(dst->error);
 		log_debug("ip6_route_output() returned error %d. Cannot route packet.", error);
 		inc_stats(skb, IPSTATS_MIB_OUTNOROUTES);
+		inc_jool_stats(JSTAT_NO_ROUTE);
 		return -error;
 	}
 
+	*result = dst;
+	return 0;
+}
+
+int sendpkt_route6(struct sk_buff *skb)
+{
+	struct dst_entry *dst;
+	int error;
+
+	if (skb_dst(skb))
+		return 0;
+
+	error = sendpkt_route6_cached(skb, ipv6_hdr(skb), skb_transport_header(skb), NULL, &dst);
+	if (error)
+		return error;
+
 	skb_dst_set(skb, dst);
 	skb->dev = dst->dev;
-
 	return 0;
 }
 
+void sendpkt_route_cache_init(struct sendpkt_route_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+}
+
+void sendpkt_route_cache_flush(struct sendpkt_route_cache *cache)
+{
+	if (cache->dst)
+		dst_release(cache->dst);
+	cache->dst = NULL;
+}
+
+/**
+ * Returns the value dst_check() needs to tell whether "dst" is still "l3_proto"'s current route.
+ */
+static __u32 route_cookie(struct dst_entry *dst, l3_protocol l3_proto)
+{
+	struct rt6_info *rt;
+
+	if (l3_proto == L3PROTO_IPV4)
+		return 0; /* IPv4 routes go stale through the route genid; no cookie needed. */
+
+	rt = (struct rt6_info *) dst;
+	return rt->rt6i_node ? rt->rt6i_node->fn_sernum : 0;
+}
+
+/**
+ * Returns a new reference to "cache"'s route, or NULL if there's none or it has changed since it
+ * was cached (in which case it's forgotten).
+ */
+static struct dst_entry *route_cache_get(struct sendpkt_route_cache *cache)
+{
+	if (!cache->dst)
+		return NULL;
+
+	if (!dst_check(cache->dst, cache->cookie)) {
+		sendpkt_route_cache_flush(cache);
+		return NULL;
+	}
+
+	return dst_clone(cache->dst);
+}
+
+static bool route_cache_match4(struct sendpkt_route_cache *cache, struct sk_buff *skb,
+		struct iphdr *hdr_ip)
+{
+	return cache->dst && cache->l3_proto == L3PROTO_IPV4
+			&& cache->daddr4 == hdr_ip->daddr
+			&& cache->tos == RT_TOS(hdr_ip->tos)
+			&& cache->l4_proto == hdr_ip->protocol
+			&& cache->mark == skb->mark;
+}
+
+/**
+ * Makes "cache" remember "dst" as the route of the packets that look like "skb"/"hdr_ip".
+ * "cache" takes over the caller's reference to "dst".
+ */
+static void route_cache_store4(struct sendpkt_route_cache *cache, struct sk_buff *skb,
+		struct iphdr *hdr_ip, struct dst_entry *dst)
+{
+	sendpkt_route_cache_flush(cache);
+	cache->dst = dst;
+	cache->cookie = route_cookie(dst, L3PROTO_IPV4);
+	cache->l3_proto = L3PROTO_IPV4;
+	cache->daddr4 = hdr_ip->daddr;
+	cache->tos = RT_TOS(hdr_ip->tos);
+	cache->l4_proto = hdr_ip->protocol;
+	cache->mark = skb->mark;
+}
+
+static bool route_cache_match6(struct sendpkt_route_cache *cache, struct sk_buff *skb,
+		struct ipv6hdr *hdr_ip, __u8 l4_proto)
+{
+	return cache->dst && cache->l3_proto == L3PROTO_IPV6
+			&& ipv6_addr_equal(&cache->addr6.daddr, &hdr_ip->daddr)
+			&& ipv6_addr_equal(&cache->addr6.saddr, &hdr_ip->saddr)
+			&& cache->tos == get_traffic_class(hdr_ip)
+			&& cache->l4_proto == l4_proto
+			&& cache->mark == skb->mark;
+}
+
+/**
+ * Same as route_cache_store4(), except for IPv6.
+ */
+static void route_cache_store6(struct sendpkt_route_cache *cache, struct sk_buff *skb,
+		struct ipv6hdr *hdr_ip, __u8 l4_proto, struct dst_entry *dst)
+{
+	sendpkt_route_cache_flush(cache);
+	cache->dst = dst;
+	cache->cookie = route_cookie(dst, L3PROTO_IPV6);
+	cache->l3_proto = L3PROTO_IPV6;
+	cache->addr6.daddr = hdr_ip->daddr;
+	cache->addr6.saddr = hdr_ip->saddr;
+	cache->tos = get_traffic_class(hdr_ip);
+	cache->l4_proto = l4_proto;
+	cache->mark = skb->mark;
+}
+
+/**
+ * Returns the slot of the current CPU's route cache IPv4 packets headed to "hdr_ip"'s destination
+ * use. BHs must be disabled.
+ */
+static struct sendpkt_route_cache *route_slot4(struct sk_buff *skb, struct iphdr *hdr_ip)
+{
+	u32 hash = jhash_2words((__force u32) hdr_ip->daddr, skb->mark, hash_rnd);
+	return &this_cpu_ptr(route_caches)->slots[hash & (ROUTE_CACHE_SLOTS - 1)];
+}
+
+/**
+ * Same as route_slot4(), except for IPv6.
+ */
+static struct sendpkt_route_cache *route_slot6(struct sk_buff *skb, struct ipv6hdr *hdr_ip)
+{
+	u32 hash = jhash_3words(ipv6_addr_hash(&hdr_ip->daddr), ipv6_addr_hash(&hdr_ip->saddr),
+			skb->mark, hash_rnd);
+	return &this_cpu_ptr(route_caches)->slots[hash & (ROUTE_CACHE_SLOTS - 1)];
+}
+
+int sendpkt_route4_cached(struct sk_buff *skb, struct iphdr *hdr_ip, void *l4_hdr,
+		struct sendpkt_route_cache *cache, struct dst_entry **result)
+{
+	struct sendpkt_route_cache *slot;
+	int error = 0;
+
+	if (cache && route_cache_match4(cache, skb, hdr_ip)) {
+		*result = route_cache_get(cache);
+		if (*result)
+			return 0;
+	}
+
+	local_bh_disable();
+
+	slot = route_slot4(skb, hdr_ip);
+	*result = route_cache_match4(slot, skb, hdr_ip) ? route_cache_get(slot) : NULL;
+	if (!(*result)) {
+		error = __sendpkt_route4(skb, hdr_ip, l4_hdr, result);
+		if (!error)
+			route_cache_store4(slot, skb, hdr_ip, dst_clone(*result));
+	}
+
+	local_bh_enable();
+
+	if (!error && cache)
+		route_cache_store4(cache, skb, hdr_ip, dst_clone(*result));
+	return error;
+}
+
+int sendpkt_route6_cached(struct sk_buff *skb, struct ipv6hdr *hdr_ip, void *l4_hdr,
+		struct sendpkt_route_cache *cache, struct dst_entry **result)
+{
+	struct hdr_iterator iterator = HDR_ITERATOR_INIT(hdr_ip);
+	struct sendpkt_route_cache *slot;
+	__u8 l4_proto;
+	int error = 0;
+
+	l4_proto = (hdr_iterator_last(&iterator) == HDR_ITERATOR_END) ? iterator.hdr_type : 0;
+
+	if (cache && route_cache_match6(cache, skb, hdr_ip, l4_proto)) {
+		*result = route_cache_get(cache);
+		if (*result)
+			return 0;
+	}
+
+	local_bh_disable();
+
+	slot = route_slot6(skb, hdr_ip);
+	*result = route_cache_match6(slot, skb, hdr_ip, l4_proto) ? route_cache_get(slot) : NULL;
+	if (!(*result)) {
+		error = __sendpkt_route6(skb, hdr_ip, l4_hdr, result);
+		if (!error)
+			route_cache_store6(slot, skb, hdr_ip, l4_proto, dst_clone(*result));
+	}
+
+	local_bh_enable();
+
+	if (!error && cache)
+		route_cache_store6(cache, skb, hdr_ip, l4_proto, dst_clone(*result));
+	return error;
+}
+
 static void set_frag_headers(struct ipv6hdr *hdr6_old, struct ipv6hdr *hdr6_new,
 		u16 packet_size, u16 offset, bool mf)
 {
@@ -245,10 +513,68 @@ static void set_frag_headers(struct ipv6hdr *hdr6_old, struct ipv6hdr *hdr6_new,
 
 
 /**
- * Fragments "frag" until all the pieces are at most "min_ipv6_mtu" bytes long.
- * "min_ipv6_mtu" comes from the user's configuration.
+ * Returns true if divide() can make the fragments point to "skb"'s pages instead of copying them.
+ */
+static bool can_share_pages(struct sk_buff *skb)
+{
+	return !skb_has_frag_list(skb) && !(skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY);
+}
+
+/**
+ * Appends "len" bytes of "from", starting "offset" bytes after from->data, to "to".
+ *
+ * Whatever lives in "from"'s paged area is not copied; "to" takes references to the pages instead.
+ * The linear area is copied, because it's the original packet's (which is going to become the
+ * first fragment) and it could still be written by someone down the line.
+ * This is also what the kernel's skb_split() does.
+ *
+ * "to" must have enough tailroom for the part of the bytes which lives in "from"'s linear area.
+ */
+static void share_pages(struct sk_buff *to, struct sk_buff *from, unsigned int offset,
+		unsigned int len)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(from);
+	unsigned int headlen = skb_headlen(from);
+	unsigned int size;
+	skb_frag_t *frag;
+	unsigned int i;
+
+	if (offset < headlen) {
+		size = min(len, headlen - offset);
+		memcpy(skb_put(to, size), from->data + offset, size);
+		offset += size;
+		len -= size;
+	}
+	offset -= headlen;
+
+	for (i = 0; i < shinfo->nr_frags && len > 0; i++) {
+		frag = &shinfo->frags[i];
+		if (offset >= skb_frag_size(frag)) {
+			offset -= skb_frag_size(frag);
+			continue;
+		}
+
+		size = min(len, skb_frag_size(frag) - offset);
+		__skb_frag_ref(frag);
+		skb_fill_page_desc(to, skb_shinfo(to)->nr_frags, skb_frag_page(frag),
+				frag->page_offset + offset, size);
+		to->len += size;
+		to->data_len += size;
+		to->truesize += size;
+
+		offset = 0;
+		len -= size;
+	}
+}
+
+/**
+ * Fragments "frag" until all the pieces are at most "mtu" bytes long.
+ * "mtu" normally comes from the user's configuration (see sendpkt_ipv6_mtu()).
  * The resulting smaller fragments are appended to frag's list (frag->next).
  *
+ * If frag's payload is paged, the new fragments share its pages, so fragmenting costs little more
+ * than writing the headers. Otherwise the payload is copied.
+ *
  * Assumes frag has a fragment header.
  * Also assumes the following fields from frag->skb are properly set: network_header, head, data
  * and tail.
@@ -256,24 +582,27 @@ static void set_frag_headers(struct ipv6hdr *hdr6_old, struct ipv6hdr *hdr6_new,
  * Sorry, this function is probably our most convoluted one, but everything in it is too
  * inter-related so I don't know how to fix it without creating thousand-argument functions.
  */
-static int divide(struct sk_buff *skb, __u16 min_ipv6_mtu)
+static int divide(struct sk_buff *skb, __u16 mtu)
 {
-	unsigned char *current_p;
 	struct sk_buff *new_skb;
 	struct sk_buff *prev_skb;
 	/* "last" skb involved here. Not necessarily the last skb of the list. */
 	struct sk_buff *last_skb;
 	struct ipv6hdr *first_hdr6 = ipv6_hdr(skb);
-	u16 hdrs_size;
-	u16 payload_max_size;
+	/* Position (from skb->data) of the first byte of payload not yet assigned to a fragment. */
+	unsigned int offset;
+	unsigned int hdrs_size;
+	unsigned int payload_max_size;
+	unsigned int linear_size;
 	u16 original_fragment_offset;
 	bool original_mf;
+	bool share = can_share_pages(skb);
 
 	/* Prepare the helper values. */
-	min_ipv6_mtu &= 0xFFF8;
+	mtu &= 0xFFF8;
 
 	hdrs_size = sizeof(struct ipv6hdr) + sizeof(struct frag_hdr);
-	payload_max_size = min_ipv6_mtu - hdrs_size;
+	payload_max_size = mtu - hdrs_size;
 
 	{
 		struct frag_hdr *frag_header = (struct frag_hdr *) (first_hdr6 + 1);
@@ -282,21 +611,29 @@ static int divide(struct sk_buff *skb, __u16 min_ipv6_mtu)
 		original_mf = is_more_fragments_set_ipv6(frag_header);
 	}
 
-	set_frag_headers(first_hdr6, first_hdr6, min_ipv6_mtu, original_fragment_offset, true);
+	set_frag_headers(first_hdr6, first_hdr6, mtu, original_fragment_offset, true);
 	prev_skb = skb;
 	last_skb = skb->next;
 
-	/* Copy frag's overweight to newly-created fragments.  */
-	current_p = skb_network_header(skb) + min_ipv6_mtu;
+	/* Move frag's overweight to newly-created fragments.  */
+	offset = mtu;
 	do {
-		bool is_last = (skb_tail_pointer(skb) - current_p <= payload_max_size);
+		bool is_last = (skb->len - offset <= payload_max_size);
 		u16 actual_payload_size = is_last
-					? (skb_tail_pointer(skb) - current_p)
+					? (skb->len - offset)
 					: (payload_max_size & 0xFFF8);
 		u16 actual_total_size = hdrs_size + actual_payload_size;
 
+		if (!share)
+			linear_size = actual_payload_size;
+		else if (offset < skb_headlen(skb))
+			linear_size = min_t(unsigned int, actual_payload_size, skb_headlen(skb) - offset);
+		else
+			linear_size = 0;
+
 		new_skb = alloc_skb(LL_MAX_HEADER /* kernel's reserved + layer 2. */
-				+ actual_total_size, /* l3 header + l4 header + packet data. */
+				+ hdrs_size /* l3 headers. */
+				+ linear_size, /* whatever part of the payload has to be copied. */
 				GFP_ATOMIC);
 		if (!new_skb) {
 			inc_stats(skb, IPSTATS_MIB_FRAGFAILS);
@@ -304,7 +641,7 @@ static int divide(struct sk_buff *skb, __u16 min_ipv6_mtu)
 		}
 
 		skb_reserve(new_skb, LL_MAX_HEADER);
-		skb_put(new_skb, actual_total_size);
+		skb_put(new_skb, hdrs_size);
 		skb_reset_mac_header(new_skb);
 		skb_reset_network_header(new_skb);
 		skb_set_transport_header(new_skb, hdrs_size);
@@ -314,9 +651,16 @@ static int divide(struct sk_buff *skb, __u16 min_ipv6_mtu)
 		new_skb->dev = skb->dev;
 
 		set_frag_headers(first_hdr6, ipv6_hdr(new_skb), actual_total_size,
-				original_fragment_offset + (current_p - skb->data - hdrs_size),
+				original_fragment_offset + (offset - hdrs_size),
 				is_last ? original_mf : true);
-		memcpy(skb_network_header(new_skb) + hdrs_size, current_p, actual_payload_size);
+		if (share)
+			share_pages(new_skb, skb, offset, actual_payload_size);
+		else if (skb_copy_bits(skb, offset, skb_put(new_skb, actual_payload_size),
+				actual_payload_size)) {
+			kfree_skb(new_skb);
+			inc_stats(skb, IPSTATS_MIB_FRAGFAILS);
+			return -EINVAL;
+		}
 
 		skb_set_jcb(new_skb, L3PROTO_IPV6, skb_l4_proto(skb),
 				skb_transport_header(new_skb),
@@ -326,12 +670,12 @@ static int divide(struct sk_buff *skb, __u16 min_ipv6_mtu)
 		prev_skb->next = new_skb;
 		new_skb->prev = prev_skb;
 
-		current_p += actual_payload_size;
+		offset += actual_payload_size;
 		prev_skb = new_skb;
 
 		new_skb->next = NULL;
 		inc_stats(skb, IPSTATS_MIB_FRAGCREATES);
-	} while (current_p < skb_tail_pointer(skb));
+	} while (offset < skb->len);
 
 	if (last_skb) {
 		last_skb->prev = new_skb;
@@ -339,7 +683,10 @@ static int divide(struct sk_buff *skb, __u16 min_ipv6_mtu)
 	}
 
 	/* Finally truncate the original packet and we're done. */
-	skb_put(skb, -(skb->len - min_ipv6_mtu));
+	if (pskb_trim(skb, mtu)) {
+		inc_stats(skb, IPSTATS_MIB_FRAGFAILS);
+		return -ENOMEM;
+	}
 	inc_stats(skb, IPSTATS_MIB_FRAGOKS);
 	return 0;
 }
@@ -382,9 +729,84 @@ static int icmp6_trim(struct sk_buff *skb, __u16 new_len)
 	return 0;
 }
 
-static int fragment_if_too_big(struct sk_buff *skb_in, struct sk_buff *skb_out)
+unsigned int sendpkt_ipv6_mtu(struct dst_entry *dst)
+{
+	unsigned int mtu;
+	bool locked;
+
+	locked = config_read_lock();
+	mtu = rcu_dereference_bh(config)->min_ipv6_mtu;
+	config_read_unlock(locked);
+
+	/* If a Packet Too Big ever told the kernel about this path, the route remembers. */
+	if (dst)
+		mtu = min(mtu, dst_mtu(dst));
+
+	return mtu;
+}
+
+static bool get_direct_xmit(void)
 {
-	__u16 min_ipv6_mtu;
+	bool result;
+	bool locked;
+
+	locked = config_read_lock();
+	result = rcu_dereference_bh(config)->direct_xmit;
+	config_read_unlock(locked);
+
+	return result;
+}
+
+/**
+ * What the skbs sendpkt_send() sends in one go have in common (they are usually the fragments of
+ * one packet), so it's only figured out once.
+ */
+struct xmit_burst {
+	/** Whether the user wants the skbs to skip the kernel's output path (see xmit4()). */
+	bool direct;
+	/**
+	 * The neighbour the last direct skb was handed to, and the route and next hop it was found
+	 * through. "neigh" is NULL if there's none yet.
+	 */
+	struct dst_entry *dst;
+	union {
+		u32 nexthop4;
+		struct in6_addr nexthop6;
+	};
+	struct neighbour *neigh;
+	/**
+	 * sendpkt_ipv6_mtu() of "mtu_dst", which is the route the last IPv6 skb was checked
+	 * against.
+	 * "mtu_dst" is NULL if there's none yet.
+	 */
+	struct dst_entry *mtu_dst;
+	unsigned int mtu6;
+};
+
+/**
+ * Returns sendpkt_ipv6_mtu() of "skb"'s route. The skbs of a burst usually share it, so it's only
+ * computed once per burst. The caller holds rcu_read_lock_bh(), so a route cannot be freed (and its
+ * address reused) while "burst" still remembers it.
+ */
+static unsigned int burst_ipv6_mtu(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	struct dst_entry *dst = skb_dst(skb);
+
+	if (!dst || dst != burst->mtu_dst) {
+		burst->mtu6 = sendpkt_ipv6_mtu(dst);
+		burst->mtu_dst = dst;
+	}
+
+	return burst->mtu6;
+}
+
+static int fragment_if_too_big(struct sk_buff *skb_in, struct sk_buff *skb_out,
+		struct xmit_burst *burst)
+{
+	unsigned int mtu;
+
+	if (skb_is_gso(skb_out))
+		return 0; /* The device (or the kernel's GSO code) will segment it; see ttp/core.c. */
 
 	if (skb_l3_proto(skb_out) == L3PROTO_IPV4) {
 #ifndef UNIT_TESTING
@@ -399,65 +821,224 @@ static int fragment_if_too_big(struct sk_buff *skb_in, struct sk_buff *skb_out)
 		return 0; /* IPv4 routers fragment dandily, so let them do it. */
 	}
 
-	rcu_read_lock_bh();
-	min_ipv6_mtu = rcu_dereference_bh(config)->min_ipv6_mtu;
-	rcu_read_unlock_bh();
-
-	if (skb_out->len <= min_ipv6_mtu)
+	mtu = burst_ipv6_mtu(skb_out, burst);
+	if (skb_out->len <= mtu)
 		return 0; /* No need for fragmentation. */
 
 	if (skb_l4_proto(skb_out) == L4PROTO_ICMP && is_icmp6_error(icmp6_hdr(skb_out)->icmp6_type)) {
 		/* ICMP errors are supposed to be truncated, not fragmented. */
-		return icmp6_trim(skb_out, min_ipv6_mtu);
+		return icmp6_trim(skb_out, mtu);
+	}
+
+	if (skb_in == skb_out) {
+		/*
+		 * Translated in place, so the IPv4 header is gone. The translator only lets fragmentable
+		 * packets get this big (see translating_the_packet_in_place()), but better safe.
+		 */
+		if (!skb_frag_hdr(skb_out) || skb_out->ip_summed == CHECKSUM_PARTIAL) {
+			log_debug("Packet is too big (%u bytes; MTU: %u); dropping.", skb_out->len, mtu);
+			inc_stats(skb_out, IPSTATS_MIB_FRAGFAILS);
+			return -EINVAL;
+		}
+		return divide(skb_out, mtu);
 	}
 
 	if (is_dont_fragment_set(ip_hdr(skb_in))) {
 		/* We're not supposed to fragment; yay. */
-		icmp64_send(skb_in, ICMPERR_FRAG_NEEDED, min_ipv6_mtu - 20);
-		log_debug("Packet is too big (%u bytes; MTU: %u); dropping.", skb_out->len, min_ipv6_mtu);
+		icmp64_send(skb_in, ICMPERR_FRAG_NEEDED, mtu - 20);
+		log_debug("Packet is too big (%u bytes; MTU: %u); dropping.", skb_out->len, mtu);
 		inc_stats(skb_in, IPSTATS_MIB_INTOOBIGERRORS);
 		return -EINVAL;
 	}
 
-	return divide(skb_out, min_ipv6_mtu);
+	return divide(skb_out, mtu);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+
+/**
+ * Returns true if "skb" can skip straight to dst_neigh_output(), false if it needs something only
+ * the kernel's full output path does (fragmentation or more headroom).
+ */
+static bool can_xmit_direct(struct sk_buff *skb, struct dst_entry *dst)
+{
+	if (!skb_is_gso(skb) && skb->len > dst_mtu(dst))
+		return false;
+	return skb_headroom(skb) >= LL_RESERVED_SPACE(dst->dev);
+}
+
+/**
+ * Hands "neigh" the already routed "skb". This is the tail of ip_finish_output2() and
+ * ip6_finish_output2(). Consumes "skb" regardless of the result.
+ *
+ * Must be called inside an RCU-bh read-side critical section, since that's what keeps "neigh"
+ * alive.
+ */
+static int xmit_neigh(struct sk_buff *skb, struct neighbour *neigh)
+{
+	if (IS_ERR(neigh)) {
+		kfree_skb(skb);
+		return PTR_ERR(neigh);
+	}
+
+	return dst_neigh_output(skb_dst(skb), neigh, skb);
+}
+
+/**
+ * ip_local_out() without the LOCAL_OUT and POST_ROUTING hooks.
+ * If this returns -ENOTSUPP, "skb" was not sent nor freed and should take the long way.
+ *
+ * The neighbour is only looked up if "burst"'s last skb had a different route or next hop.
+ * Must be called inside an RCU-bh read-side critical section, which has to last until "burst" is
+ * done.
+ */
+static int xmit4_direct(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	struct dst_entry *dst = skb_dst(skb);
+	struct rtable *rt = (struct rtable *) dst;
+	struct iphdr *hdr = ip_hdr(skb);
+	u32 nexthop;
+
+	if (rt->rt_type != RTN_UNICAST || !can_xmit_direct(skb, dst))
+		return -ENOTSUPP;
+
+	hdr->tot_len = build_tot_len_field(skb->len);
+	ip_send_check(hdr);
+	skb->dev = dst->dev;
+	skb->protocol = htons(ETH_P_IP);
+
+	nexthop = (__force u32) rt_nexthop(rt, hdr->daddr);
+	if (!burst->neigh || burst->dst != dst || burst->nexthop4 != nexthop) {
+		burst->neigh = __ipv4_neigh_lookup_noref(dst->dev, nexthop);
+		if (unlikely(!burst->neigh))
+			burst->neigh = __neigh_create(&arp_tbl, &nexthop, dst->dev, false);
+		burst->dst = dst;
+		burst->nexthop4 = nexthop;
+	}
+
+	return xmit_neigh(skb, burst->neigh);
+}
+
+/**
+ * Same as xmit4_direct(), except for IPv6.
+ */
+static int xmit6_direct(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	struct dst_entry *dst = skb_dst(skb);
+	struct ipv6hdr *hdr = ipv6_hdr(skb);
+	struct in6_addr *nexthop;
+	unsigned int payload_len;
+
+	if (ipv6_addr_is_multicast(&hdr->daddr) || dst_allfrag(dst) || !can_xmit_direct(skb, dst))
+		return -ENOTSUPP;
+
+	payload_len = skb->len - sizeof(*hdr);
+	hdr->payload_len = build_payload_len_field(payload_len);
+	skb->dev = dst->dev;
+	skb->protocol = htons(ETH_P_IPV6);
+
+	nexthop = rt6_nexthop((struct rt6_info *) dst, &hdr->daddr);
+	if (!burst->neigh || burst->dst != dst || !ipv6_addr_equal(&burst->nexthop6, nexthop)) {
+		burst->neigh = __ipv6_neigh_lookup_noref(dst->dev, nexthop);
+		if (unlikely(!burst->neigh))
+			burst->neigh = __neigh_create(&nd_tbl, nexthop, dst->dev, false);
+		burst->dst = dst;
+		burst->nexthop6 = *nexthop;
+	}
+
+	return xmit_neigh(skb, burst->neigh);
+}
+
+#else
+
+static int xmit4_direct(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	return -ENOTSUPP;
+}
+
+static int xmit6_direct(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	return -ENOTSUPP;
+}
+
+#endif
+
+/**
+ * Sends "skb" through ip_local_out(), or directly to its neighbour if the user wants that and it's
+ * possible. Consumes "skb" regardless of the result.
+ */
+static int xmit4(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	int error;
+
+	if (burst->direct) {
+		error = xmit4_direct(skb, burst);
+		if (error != -ENOTSUPP)
+			return error;
+	}
+
+	return ip_local_out(skb);
+}
+
+/**
+ * Same as xmit4(), except for IPv6.
+ */
+static int xmit6(struct sk_buff *skb, struct xmit_burst *burst)
+{
+	int error;
+
+	if (burst->direct) {
+		error = xmit6_direct(skb, burst);
+		if (error != -ENOTSUPP)
+			return error;
+	}
+
+	return ip6_local_out(skb);
 }
 
 verdict sendpkt_send(struct sk_buff *in_skb, struct sk_buff *out_skb)
 {
 	struct sk_buff *next_skb = out_skb;
+	struct xmit_burst burst;
 	struct dst_entry *dst;
 	int error = 0;
-#ifdef BENCHMARK
 	struct timespec end_time;
-	getnstimeofday(&end_time);
-	logtime(&skb_jcb(out_skb)->start_time, &end_time, skb_l3_proto(out_skb),
-			skb_l4_proto(out_skb));
-#endif
+
+	if (logtime_enabled()) {
+		getnstimeofday(&end_time);
+		logtime(&skb_jcb(out_skb)->start_time, &end_time, skb_l3_proto(out_skb),
+				skb_l4_proto(out_skb));
+	}
+
+	/* Whatever the skbs share is only looked up once; see struct xmit_burst. */
+	burst.direct = get_direct_xmit();
+	burst.dst = NULL;
+	burst.neigh = NULL;
+	burst.mtu_dst = NULL;
+	rcu_read_lock_bh();
+
 	while (next_skb) {
-		if (is_error(fragment_if_too_big(in_skb, next_skb)))
+		if (is_error(fragment_if_too_big(in_skb, next_skb, &burst)))
+			goto fail;
+
+		dst = skb_dst(next_skb);
+		if (WARN(!dst || !dst->dev, "I'm trying to send a packet that isn't routed."))
 			goto fail;
 
 		out_skb = next_skb;
 		next_skb = out_skb->next;
 		out_skb->next = out_skb->prev = NULL;
 
-		dst = skb_dst(out_skb);
-
-		if (WARN(!dst || !dst->dev, "I'm trying to send a packet that isn't routed.")) {
-			kfree_skb(out_skb);
-			goto fail;
-		}
-
 		log_debug("Sending skb via device '%s'...", dst->dev->name);
 
 		switch (skb_l3_proto(out_skb)) {
 		case L3PROTO_IPV6:
 			skb_clear_cb(out_skb);
-			error = ip6_local_out(out_skb); /* Implicit kfree_skb(out_skb) goes here. */
+			error = xmit6(out_skb, &burst); /* Implicit kfree_skb(out_skb) goes here. */
 			break;
 		case L3PROTO_IPV4:
 			skb_clear_cb(out_skb);
-			error = ip_local_out(out_skb); /* Implicit kfree_skb(out_skb) goes here. */
+			error = xmit4(out_skb, &burst); /* Implicit kfree_skb(out_skb) goes here. */
 			break;
 		}
 
@@ -468,6 +1049,7 @@ verdict sendpkt_send(struct sk_buff *in_skb, struct sk_buff *out_skb)
 		}
 	}
 
+	rcu_read_unlock_bh();
 	return VER_CONTINUE;
 
 fail:
@@ -475,8 +1057,13 @@ fail:
 	 * The rest will also probably fail, so don't waste time trying to send them.
 	 * If there were more skbs, they were fragments anyway, so the receiving node will
 	 * fail to reassemble them.
+	 * The skbs handed to the kernel are gone by now (even the one that failed), so only the
+	 * ones still in the list can be counted.
 	 */
-	inc_stats(out_skb, IPSTATS_MIB_OUTDISCARDS);
+	inc_jool_stats(JSTAT_SEND_FAILED);
+	if (next_skb)
+		inc_stats(next_skb, IPSTATS_MIB_OUTDISCARDS);
 	kfree_skb_queued(next_skb);
+	rcu_read_unlock_bh();
 	return VER_DROP;
 }
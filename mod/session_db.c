@@ -1,19 +1,149 @@
 #include "nat64/mod/session_db.h"
 
+#include <linux/cache.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/shrinker.h>
+#include <linux/topology.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <net/dst.h>
 #include <net/ipv6.h>
 #include "nat64/comm/constants.h"
+#include "nat64/mod/arena.h"
+#include "nat64/mod/keyed_hash.h"
+#include "nat64/mod/lock_stats.h"
+#include "nat64/mod/stats.h"
+#include "nat64/mod/trace.h"
 #include "nat64/mod/rbtree.h"
 #include "nat64/mod/pkt_queue.h"
+#include "nat64/mod/pool4.h"
 #include "nat64/mod/pool6.h"
 #include "nat64/mod/bib_db.h"
+#include "nat64/mod/db_events.h"
 #include "nat64/mod/rfc6052.h"
 #include "nat64/mod/send_packet.h"
 
+/* Older kernels only have ACCESS_ONCE(). */
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#endif
+#ifndef WRITE_ONCE
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+/**
+ * Number of slots the session tables' hash indexes start with. Must be a power of two.
+ * 16k slots cost 128 KB per table-side. If the database is sharded, the slots are divided among
+ * the shards.
+ */
+#define SESSION_HASH_BITS 14
+#define SESSION_HASH_SIZE (1 << SESSION_HASH_BITS)
+/**
+ * Size the indexes stop doubling at, divided among the shards the same way. Must be a power of
+ * two. 1M slots keep the chains short up to a couple of million sessions per protocol, and cost
+ * 8 MB per table-side.
+ */
+#define SESSION_HASH_MAX_SIZE (1 << 20)
+/** An index is doubled once its table holds this many sessions per slot. See grow_work_fn(). */
+#define SESSION_HASH_LOAD 2
+
+/** Maximum number of slices the database can be split into. */
+#define SESSIONDB_MAX_SHARDS 64
+
+/** Number of slots in each expiration timer's wheel. Must be a power of two. */
+#define EXPIRER_SLOTS 64
+/** Maximum number of sessions a cleaner will kill before releasing the table's lock. */
+#define EXPIRER_BATCH 1024
+
+/**
+ * Number of counters the per-prefix admission control spreads the remote IPv6 prefixes over.
+ * Must be a power of two, and smaller than PREFIX_SLOT_NONE.
+ */
+#define PREFIX_COUNTER_SLOTS (1 << 14)
+/** session_entry.prefix_slot value of a session which isn't charged to any counter. */
+#define PREFIX_SLOT_NONE 0xFFFF
+/** Number of minutes the session age counters remember. Must be a power of two. */
+#define AGE_SLOTS 256
+/** If a TCP table is this close (in sixteenths) to its limit, embryonic sessions start dying. */
+#define EARLY_DROP_THRESHOLD 15
+/** Maximum number of sessions early_drop_from() will inspect before giving up. */
+#define EARLY_DROP_SCAN 16
+
+/** Maximum number of sessions sessiondb_iterate_by_ipv4() visits per lock of a table. */
+#define ITERATE_BATCH 64
+
+/** Maximum number of sessions a purge will remove before releasing the table's lock. */
+#define PURGE_BATCH 1024
+/** Number of batches the purger runs before yielding the worker thread. */
+#define PURGE_CHUNKS 16
+
+/** Maximum number of TCP probes and ICMP errors waiting for the probe sender. */
+#define PROBE_QUEUE_MAX 4096
+/** Maximum number of packets the probe sender sends per run. */
+#define PROBE_BATCH 64
+/** Minimum time between two runs of the probe sender. */
+#define PROBE_INTERVAL msecs_to_jiffies(10)
+
+/**
+ * Number of different pool6 prefixes the sessions can be built with; see local6_prefixes.
+ * Must fit in session_entry.local6_prefix.
+ */
+#define LOCAL6_PREFIXES 64
+
+/** Number of preallocated session entries each CPU keeps at hand. */
+#define SESSION_POOL_SIZE 64
+/** If a CPU's pool drops below this many entries, it gets refilled. */
+#define SESSION_POOL_LOW 16
+
+/**
+ * The hash indexes of a session table. Replaced as a whole when the table outgrows them.
+ */
+struct session_index {
+	/** Number of slots in "hash6" and "hash4", minus one. */
+	unsigned int mask;
+	/** Indexes the entries using their full IPv6 identifiers (local6 + remote6). */
+	struct hlist_head *hash6;
+	/** Indexes the entries using their full IPv4 identifiers (remote4 + local4). */
+	struct hlist_head *hash4;
+	/** Storage of "hash6" and "hash4". */
+	struct hlist_head slots[];
+};
+
 /**
  * Session table definition.
- * Holds red-black trees, one for each indexing need (IPv4 and IPv6).
+ *
+ * Exact-match lookups (the ones the packet path needs) go through the hash indexes, one for each
+ * side of the translator. The red-black trees are still here because some queries need the entries
+ * sorted: the userspace app pages through them, and the deletes by address and prefix need ranges.
+ *
+ * The packet path looks sessions up without grabbing "lock". The hash chains are RCU lists, so
+ * they can be walked while writers are editing them, and the nodes themselves are kept alive by
+ * RCU (see session_release()). When a table outgrows its index, grow_work_fn() moves the sessions
+ * to a bigger one; the lockless lookups that miss during the move try again with the lock (see
+ * hash_find6_rcu()). The trees are another story: their rotations are not published in
+ * any way a lockless reader could survive, so walking them always requires "lock".
  */
 struct session_table {
+	/** The hash indexes. Only grow_work_fn() replaces them. */
+	struct session_index __rcu *index;
+	/**
+	 * hash_add() asks grow_work_fn() for a bigger index once "count" reaches this.
+	 * Zero means the request is pending, or the index cannot grow anymore.
+	 */
+	u64 grow_at;
+	/**
+	 * Odd while grow_work_fn() is moving the sessions to a new index. Lockless lookups that
+	 * miss check it, because the chains they walked might have moved under them.
+	 */
+	unsigned int rehashes;
 	/** Indexes the entries using their IPv6 identifiers. */
 	struct rb_root tree6;
 	/** Indexes the entries using their IPv4 identifiers. */
@@ -21,19 +151,45 @@ struct session_table {
 	/** Number of session entries in this table. */
 	u64 count;
 	/**
-	 * Lock to sync access. This protects both the trees and the entries, but if you only need to
+	 * Lock to sync writers. This protects both the trees and the entries, but if you only need to
 	 * read the const portion of the entries, you can get away with only incresing their reference
 	 * counter.
 	 */
 	spinlock_t lock;
 };
 
-/** The session table for UDP conversations. */
-static struct session_table session_table_udp;
-/** The session table for TCP connections. */
-static struct session_table session_table_tcp;
-/** The session table for ICMP conversations. */
-static struct session_table session_table_icmp;
+/**
+ * A page worth of the sessions of an expiry_slot. Chunks are page-aligned, so an entry can find its
+ * chunk by rounding its own address down (see entry_chunk()).
+ */
+struct expiry_chunk {
+	/** Chains the chunks of the slot, oldest first. */
+	struct list_head list_hook;
+	struct expiry_slot *slot;
+	/** Number of used entries, including the ones whose session left (which are NULL). */
+	unsigned int len;
+	/** Number of entries whose session is still here. */
+	unsigned int live;
+	struct session_entry *sessions[0];
+};
+
+/** Number of sessions an expiry_chunk can hold. */
+#define EXPIRY_CHUNK_LEN \
+	((PAGE_SIZE - sizeof(struct expiry_chunk)) / sizeof(struct session_entry *))
+
+/**
+ * The sessions queued during one of the periods of an expirer's wheel, as an array (chunked, so it
+ * can grow without moving) of pointers.
+ *
+ * Sessions which leave the slot leave holes behind instead of having the rest closed in, since that
+ * would mean writing to the sessions that moved. The sweep frees the chunks once it's done with
+ * them.
+ */
+struct expiry_slot {
+	struct list_head chunks;
+	/** Number of sessions queued in the slot. */
+	unsigned int count;
+};
 
 /**
  * A timer which will delete expired sessions every once in a while.
@@ -42,21 +198,40 @@ static struct session_table session_table_icmp;
  * Why not a single timer which takes care of all the sessions? Some reasons I remember:
  * - When the user updates timeouts, this makes updating existing sessions a O(1) operation (since
  *   the timer holds the timeout, not the sessions).
- * - It makes timer rescheduling trivial (sessions are sorted by expiration date, so new sessions
- *   are always simply added to the end of the list (O(1)) and knowing when the timer should be
- *   triggered next is a matter of peeking the first element (also O(1)).
  * - I seem to recall it takes care of some sync concern, but I can't remember what it was.
  *
  * Why not a timer per session? Well I don't know, it sounds like a lot of stress to the kernel
  * since we expect lots and lots of sessions.
+ *
+ * The sessions are kept in a wheel of EXPIRER_SLOTS slots. Each slot collects the sessions which
+ * were queued during one "granularity"-long period of time, and "cursor" sweeps the slots in order
+ * as their periods become older than the timeout. Refreshing a session only updates its
+ * update_time; the session stays in its old slot, and the sweep moves it forward when it notices.
+ * That way the packet path rarely ever has to touch the slots.
+ *
+ * The slots are not lists but arrays (see struct expiry_slot): the sweep reads them sequentially
+ * instead of chasing pointers through the sessions, and queueing or dequeueing a session doesn't
+ * write to its neighbors. (The sessions are scattered all over memory; needlessly touching them
+ * flushes the caches the packets need.)
+ *
+ * The sweep happens in a workqueue, in batches of at most EXPIRER_BATCH sessions, so a mass
+ * expiration doesn't hold the table's lock for long.
  */
 struct expire_timer {
-	/** The actual timer. */
+	/** Queues "work" whenever the oldest unswept slot might be due. */
 	struct timer_list timer;
-	/** The sessions this timer is supposed to delete. Sorted by expiration time. */
-	struct list_head sessions;
+	/** The sweeper. */
+	struct work_struct work;
+	/** The sessions this timer is supposed to delete. See get_slot(). */
+	struct expiry_slot slots[EXPIRER_SLOTS];
+	/** Length in jiffies of the period each slot stands for. See update_granularity(). */
+	unsigned long granularity;
+	/** Start of the oldest period whose slot hasn't been swept. */
+	unsigned long cursor;
 	/** All the sessions from the list above belong to this table (the reverse might not apply). */
 	struct session_table *table;
+	/** The slice of the database this timer belongs to. */
+	struct sessiondb_shard *shard;
 	/**
 	 * Offset from the "config" structure where the expiration time of this timer can be found.
 	 * Except if this timer is "timer_syn", since the timeout of that one is constant.
@@ -66,50 +241,585 @@ struct expire_timer {
 	char *name;
 };
 
-/** Killer of sessions whose expiration date was initialized using "config".ttl.udp. */
-static struct expire_timer expirer_udp;
-/** Killer of sessions whose expiration date was initialized using "config".ttl.tcp_est. */
-static struct expire_timer expirer_tcp_est;
-/** Killer of sessions whose expiration date was initialized using "config".ttl.tcp_trans. */
-static struct expire_timer expirer_tcp_trans;
-/** Killer of sessions whose expiration date was initialized using "config".ttl.icmp. */
-static struct expire_timer expirer_icmp;
-/** Killer of sessions whose expiration date was initialized using "TCP_INCOMING_SYN". */
-static struct expire_timer expirer_syn;
+/**
+ * A slice of the session database.
+ *
+ * Normally there's only one of these, but the user can ask for the database to be split, so CPUs
+ * handling unrelated traffic don't fight over the same locks and cache lines. Sessions are assigned
+ * to shards based on their remote IPv6 address (see get_shard()).
+ */
+struct sessiondb_shard {
+	/** The session table for UDP conversations. */
+	struct session_table udp;
+	/** The session table for TCP connections. */
+	struct session_table tcp;
+	/** The session table for ICMP conversations. */
+	struct session_table icmp;
+
+	/** Killer of sessions whose expiration date was initialized using "config".ttl.udp. */
+	struct expire_timer expirer_udp;
+	/** Killers of sessions whose expiration date was initialized using "config".udp_classes. */
+	struct expire_timer expirer_udp_classes[UDP_CLASSES];
+	/** Killer of sessions whose expiration date was initialized using "config".ttl.tcp_est. */
+	struct expire_timer expirer_tcp_est;
+	/** Killer of sessions whose expiration date was initialized using "config".ttl.tcp_trans. */
+	struct expire_timer expirer_tcp_trans;
+	/**
+	 * Killer of sessions whose expiration date was initialized using "config".ttl.tcp_closed.
+	 * See get_closed_expirer().
+	 */
+	struct expire_timer expirer_tcp_closed;
+	/** Killer of sessions whose expiration date was initialized using "config".ttl.icmp. */
+	struct expire_timer expirer_icmp;
+	/** Killer of sessions whose expiration date was initialized using "TCP_INCOMING_SYN". */
+	struct expire_timer expirer_syn;
+
+	/** NUMA node the shard's indexes and sessions are allocated on. See shard_node(). */
+	int node;
+};
+
+/** The database. An array of "shard_count" slices. */
+static struct sessiondb_shard *shards;
+/** Length of "shards". */
+static unsigned int shard_count;
+/** Number of slots the shards' indexes can grow up to. */
+static unsigned int hash_max_size;
+
+/** Grows the indexes hash_add() found too loaded. */
+static void grow_work_fn(struct work_struct *work);
+static DECLARE_WORK(grow_work, grow_work_fn);
+
+/**
+ * Number of slots in each of the flow caches' halves. Must be a power of two.
+ * With 16-byte slots, this makes a cache 32 KB per CPU, which is what most L1 and L2 caches can
+ * keep hot along with the packets themselves.
+ */
+#define FLOWCACHE_SLOTS 1024
+
+/** A memory of the last session a lookup hashed to this slot found. */
+struct flow_slot {
+	/** NULL if the slot is empty. */
+	struct session_entry *session;
+	/**
+	 * Full hash code (hash6_slot() or hash4_slot()) of "session"; a stamp which lets most
+	 * collisions be told apart without touching the session.
+	 */
+	u32 hash;
+};
+
+/**
+ * A direct-mapped front-end of the hash indexes, so repeated lookups of the same flows (elephants,
+ * mostly) don't have to walk the chains. Every CPU has one, and only ever fills its own.
+ *
+ * The slots never reference sessions that already left the hash indexes: remove() wipes the
+ * session from every CPU's cache, and whoever caches a session double-checks afterwards that it
+ * didn't race with its removal (see flowcache_store()). Since the sessions are freed through RCU,
+ * whatever a reader finds in its own cache is therefore safe to dereference until the reader
+ * leaves its read-side critical section.
+ */
+struct flow_cache {
+	/** Indexed by hash6_slot(). */
+	struct flow_slot slots6[FLOWCACHE_SLOTS];
+	/** Indexed by hash4_slot(). */
+	struct flow_slot slots4[FLOWCACHE_SLOTS];
+};
+
+static DEFINE_PER_CPU(struct flow_cache *, flow_caches);
+/** Whether the user wants the flow caches. See sessiondb_init(). */
+static bool flowcache_enabled;
+
+/**
+ * Traffic a session has seen; only exists if the user asked for it (see sessiondb_init()), in
+ * which case it's appended to every session entry (see session_counters()).
+ *
+ * Packets don't add themselves to these directly; they accumulate in their CPU's counter cache
+ * first, and the totals are only touched when the cache slot is claimed by another session, or
+ * when the session leaves the database.
+ */
+struct session_counters {
+	atomic64_t packets;
+	atomic64_t bytes;
+};
+
+/** Base 2 logarithm of the number of slots in each CPU's counter cache. */
+#define COUNTER_SLOT_BITS 8
+
+/** Traffic of "session" not yet added to its counters. NULL "session" means the slot is empty. */
+struct counter_slot {
+	struct session_entry *session;
+	u32 packets;
+	u32 bytes;
+};
+
+/**
+ * A CPU's traffic deltas, indexed by a hash of the session's address. Same invalidation rules as
+ * the flow caches: remove() takes the session out of every CPU's cache (see counters_forget()).
+ */
+struct counter_cache {
+	struct counter_slot slots[1 << COUNTER_SLOT_BITS];
+};
+
+static struct counter_cache __percpu *counter_caches;
+/** Whether the sessions carry counters. See sessiondb_init(). */
+static bool counters_enabled;
+/**
+ * Size of each session object, including its counters if counters_enabled, rounded up to a whole
+ * number of cache lines so the layout of struct session_entry holds for every object.
+ */
+static size_t entry_size;
 
 /** Current valid configuration for the Session DB module. */
 static struct sessiondb_config *config;
 
-static char* EXPIRER_NAMES[] = { "UDP", "ICMP", "TCP_EST", "TCP_TRANS", "TCP_SYN" };
+static char* EXPIRER_NAMES[] = { "UDP", "ICMP", "TCP_EST", "TCP_TRANS", "TCP_SYN",
+		"TCP_CLOSED" };
+static char* UDP_CLASS_NAMES[UDP_CLASSES] = { "UDP_CLASS0", "UDP_CLASS1", "UDP_CLASS2",
+		"UDP_CLASS3" };
 
 /** Cache for struct session_entrys, for efficient allocation. */
 static struct kmem_cache *entry_cache;
+/**
+ * Preallocated memory for the sessions, if the user asked for it (see sessiondb_init()).
+ * Unless its capacity is zero, sessions come from here instead of "entry_cache".
+ */
+static struct arena arena;
 
-static void session_release(struct kref *ref)
+static struct session_entry *entry_alloc(gfp_t flags, int node)
+{
+	struct session_entry *entry;
+
+	if (arena.capacity)
+		return arena_alloc(&arena);
+
+	entry = kmem_cache_alloc_node(entry_cache, flags, node);
+	if (entry)
+		jool_mem_add(JMEM_SESSION, entry_size);
+	return entry;
+}
+
+static void entry_free(struct session_entry *entry)
+{
+	if (arena.capacity) {
+		arena_free(&arena, entry);
+	} else {
+		kmem_cache_free(entry_cache, entry);
+		jool_mem_add(JMEM_SESSION, -(long) entry_size);
+	}
+}
+
+/**
+ * A stash of ready-to-use session entries.
+ *
+ * Each CPU has one, so the packet path can create sessions without locks and, more importantly,
+ * without GFP_ATOMIC allocations, which tend to fail exactly when many sessions are being created
+ * at once. The pools are refilled from process context, and freed entries are recycled into them.
+ *
+ * A pool is only ever touched by its own CPU, with bottom halves disabled.
+ */
+struct session_pool {
+	/** Number of valid elements in "entries". */
+	unsigned int count;
+	struct session_entry *entries[SESSION_POOL_SIZE];
+	/** Tops the pool up. See pool_refill(). */
+	struct work_struct refill;
+};
+
+/** The pools, one per CPU. */
+static struct session_pool __percpu *pools;
+
+/**
+ * Number of sessions charged to each remote IPv6 prefix (see admit()).
+ * Prefixes are hashed into the slots, so it's possible for two prefixes to share a budget, but
+ * with this many slots it should be rare for two busy ones to do so.
+ */
+static atomic_t *prefix_counters;
+
+/**
+ * Bits of fraction of the rate limiter's clock (jiffies), so it can space sessions less than a
+ * jiffy apart.
+ */
+#define RATE_SHIFT 16
+
+/**
+ * The session creation rate limiter's state, one per prefix counter slot (see get_prefix_slot()).
+ *
+ * Each one is the (fixed point) jiffy its prefix's next session is due, GCRA style: a prefix that
+ * creates sessions faster than allowed pushes it into the future, and is refused once it's more
+ * than a second away. Slots of prefixes which went quiet simply hold a time that already passed,
+ * so nothing ever needs to be expired or cleaned.
+ */
+static atomic64_t *rate_slots;
+/** Memory "prefix_counters" and "rate_slots" take up, together. */
+#define ADMISSION_BYTES (PREFIX_COUNTER_SLOTS * (sizeof(*prefix_counters) + sizeof(*rate_slots)))
+/**
+ * Number of prefix counters whose value is within each power of two. The last one also counts the
+ * larger ones. See prefix_charge().
+ */
+static atomic_t prefix_histogram[OCCUPANCY_PREFIX_BUCKETS];
+
+/**
+ * Number of sessions created during one minute; the minute is "epoch".
+ * See age_charge().
+ */
+struct age_slot {
+	atomic_t epoch;
+	atomic_t count;
+};
+
+/**
+ * Number of sessions born during each of the last AGE_SLOTS minutes, per protocol.
+ * The sessions which are older than that are counted by "age_ancient" instead.
+ */
+static struct age_slot age_slots[L4_PROTO_COUNT][AGE_SLOTS];
+static atomic_t age_ancient[L4_PROTO_COUNT];
+
+/** Admission control counters. See struct sessiondb_stats. */
+static atomic64_t rejected_table_full = ATOMIC64_INIT(0);
+static atomic64_t rejected_prefix_full = ATOMIC64_INIT(0);
+static atomic64_t rejected_prefix_rate = ATOMIC64_INIT(0);
+static atomic64_t early_drops = ATOMIC64_INIT(0);
+/** Sessions the kernel reclaimed through the shrinker. See sessiondb_init(). */
+static atomic64_t sessions_shrunk = ATOMIC64_INIT(0);
+
+enum purge_type {
+	PURGE_FLUSH,
+	PURGE_IPV4,
+	PURGE_IPV6_PREFIX,
+};
+
+/**
+ * A pending mass deletion (see sessiondb_flush(), sessiondb_delete_by_ipv4() and
+ * sessiondb_delete_by_ipv6_prefix()).
+ *
+ * Removing a pool4 address can take out millions of sessions, so it's not done while userspace
+ * waits with a table locked. Instead, the job is queued and purge_work_fn() removes the sessions a
+ * batch at a time, releasing the lock in between so the packet path can keep going.
+ *
+ * The sessions are considered dead as soon as the job is queued, though. See session_is_dying().
+ */
+struct purge_job {
+	enum purge_type type;
+	union {
+		struct in_addr addr4;
+		struct {
+			struct ipv6_prefix prefix6;
+			/*
+			 * Bitmaps of local6_prefixes. The sessions built with a prefix from
+			 * "local6_all" are all victims; the ones from "local6_some" need their
+			 * addresses compared. The rest are left alone. See purge_classify().
+			 */
+			u64 local6_all;
+			u64 local6_some;
+		};
+	};
+
+	/** Index of the shard the purger is currently working on. */
+	unsigned int shard;
+	/** Table of "shard" the purger is currently working on (0 = UDP, 1 = TCP, 2 = ICMP). */
+	unsigned int table;
+
+	/** Link to the other jobs in "purge_jobs". */
+	struct list_head list_hook;
+	struct rcu_head rcu_hook;
+};
+
+/**
+ * The purges which haven't finished yet, oldest first.
+ * The packet path reads this under RCU. Editions are protected by "purge_lock".
+ */
+static LIST_HEAD(purge_jobs);
+static DEFINE_SPINLOCK(purge_lock);
+/** Number of elements of "purge_jobs" which kill sessions on sight. See session_is_dying(). */
+static atomic_t dying_jobs = ATOMIC_INIT(0);
+/** Runs the jobs from "purge_jobs". */
+static void purge_work_fn(struct work_struct *work);
+static DECLARE_WORK(purge_work, purge_work_fn);
+static void purge_destroy(void);
+
+/** Purge progress counters. See struct sessiondb_stats. */
+static atomic64_t purges_pending = ATOMIC64_INIT(0);
+static atomic64_t sessions_purged = ATOMIC64_INIT(0);
+
+/**
+ * Packets the expirers want to send, waiting for probe_work_fn().
+ *
+ * When a large batch of TCP sessions expires at once, routing and sending all of their probes
+ * (and the ICMP errors of the V4 INIT sessions) in one go competes with the live traffic. So the
+ * expirers only queue copies of the sessions here, and a separate worker sends at most
+ * PROBE_BATCH packets every PROBE_INTERVAL. If the queue grows beyond PROBE_QUEUE_MAX, the excess
+ * is dropped; a missed probe only means the connection might time out.
+ *
+ * The copies are linked through their expire_list_hooks, since they don't belong to any expirer.
+ * Protected by "probe_lock".
+ */
+static LIST_HEAD(probe_queue);
+static unsigned int probe_queue_len;
+static DEFINE_SPINLOCK(probe_lock);
+/** Jiffy in which probe_work_fn() last ran. Protected by "probe_lock". */
+static unsigned long probe_last_run;
+static void probe_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(probe_work, probe_work_fn);
+
+/** Probe sender counters. See struct sessiondb_stats. */
+static atomic64_t probes_sent = ATOMIC64_INIT(0);
+static atomic64_t probes_dropped = ATOMIC64_INIT(0);
+
+/** Expirer cost counters. See struct sessiondb_stats. */
+static atomic64_t sessions_expired = ATOMIC64_INIT(0);
+static atomic64_t expire_nsecs = ATOMIC64_INIT(0);
+
+/**
+ * Random seed for the shard choice and the admission counters, initialized at startup.
+ */
+static u32 hash_rnd;
+/**
+ * Secret key of the hash indexes, initialized at startup. Prevents attackers from crafting traffic
+ * that piles up on a single chain (see keyed_hash.h).
+ */
+static struct keyed_hash_key hash_secret;
+
+/**
+ * Process context work which fills the pool it belongs to.
+ */
+static void pool_refill(struct work_struct *work)
+{
+	struct session_pool *pool = container_of(work, struct session_pool, refill);
+	struct session_entry *entry;
+
+	do {
+		entry = entry_alloc(GFP_KERNEL, NUMA_NO_NODE);
+		if (!entry)
+			return;
+
+		local_bh_disable();
+		/* The work might have been moved to another CPU (eg. hotplug), so make sure. */
+		if (pool != this_cpu_ptr(pools) || pool->count >= SESSION_POOL_SIZE) {
+			local_bh_enable();
+			entry_free(entry);
+			return;
+		}
+		pool->entries[pool->count++] = entry;
+		local_bh_enable();
+	} while (true);
+}
+
+/**
+ * Returns an uninitialized session entry allocated on NUMA node "node", preferably from the current
+ * CPU's pool.
+ *
+ * The pools only hold memory from their own CPU's node, so sessions meant for another node bypass
+ * them.
+ *
+ * Doesn't care about spinlocks.
+ */
+static struct session_entry *session_alloc(int node)
+{
+	struct session_pool *pool;
+	struct session_entry *entry = NULL;
+
+	local_bh_disable();
+	if (node != NUMA_NO_NODE && node != numa_node_id()) {
+		local_bh_enable();
+		return entry_alloc(GFP_ATOMIC, node);
+	}
+
+	pool = this_cpu_ptr(pools);
+	if (pool->count)
+		entry = pool->entries[--pool->count];
+	if (pool->count < SESSION_POOL_LOW)
+		schedule_work_on(smp_processor_id(), &pool->refill);
+	local_bh_enable();
+
+	return entry ? entry : entry_alloc(GFP_ATOMIC, NUMA_NO_NODE);
+}
+
+/**
+ * Returns "entry" to the current CPU's pool, or to the cache if the pool is full or "entry" lives
+ * on some other NUMA node.
+ *
+ * Doesn't care about spinlocks.
+ */
+static void session_free(struct session_entry *entry)
+{
+	struct session_pool *pool;
+
+	local_bh_disable();
+	pool = this_cpu_ptr(pools);
+	if (pool->count < SESSION_POOL_SIZE && page_to_nid(virt_to_page(entry)) == numa_node_id()) {
+		pool->entries[pool->count++] = entry;
+		entry = NULL;
+	}
+	local_bh_enable();
+
+	if (entry)
+		entry_free(entry);
+}
+
+/**
+ * RCU callback; actually frees "head"'s session once no lockless reader can be looking at it.
+ */
+static void session_free_rcu(struct rcu_head *head)
 {
 	struct session_entry *session;
-	session = container_of(ref, struct session_entry, refcounter);
+	session = container_of(head, struct session_entry, rcu_hook);
 
 	if (session->bib)
 		bib_return(session->bib);
-	kmem_cache_free(entry_cache, session);
+	session_free(session);
+}
+
+/**
+ * Sessions an expirer released during one of its batches. They are freed together, once no
+ * lockless reader can be looking at them, so their dying BIB entries can return their ports to
+ * pool4 in one go.
+ */
+struct session_reap {
+	/** The sessions, chained through their expire_list_hooks, which they no longer need. */
+	struct list_head sessions;
+	struct rcu_head rcu_hook;
+};
+
+/**
+ * The reap the running CPU's expirer is collecting, if any. Only set while the expirer holds its
+ * table's spinlock, so nothing else can run on the CPU in the meantime. See cleaner_work().
+ */
+static DEFINE_PER_CPU(struct session_reap *, current_reap);
+
+/**
+ * RCU callback; session_free_rcu() for every session from "head"'s reap.
+ */
+static void session_reap_rcu(struct rcu_head *head)
+{
+	struct session_reap *reap = container_of(head, struct session_reap, rcu_hook);
+	struct session_entry *session, *tmp;
+
+	pool4_defer_returns();
+	list_for_each_entry_safe(session, tmp, &reap->sessions, expire_list_hook) {
+		if (session->bib)
+			bib_return(session->bib);
+		session_free(session);
+	}
+	pool4_flush_returns();
+
+	kfree(reap);
+}
+
+static void prefix_refund(__u16 slot);
+static void age_refund(struct session_entry *session);
+
+static void session_release(struct kref *ref)
+{
+	struct session_entry *session;
+	struct session_reap *reap;
+
+	session = container_of(ref, struct session_entry, refcounter);
+
+	if (session->prefix_slot != PREFIX_SLOT_NONE) {
+		prefix_refund(session->prefix_slot);
+		age_refund(session);
+	}
+
+	/* Lockless lookups might still be walking through this node, so defer. */
+	reap = this_cpu_read(current_reap);
+	if (reap)
+		list_add_tail(&session->expire_list_hook, &reap->sessions);
+	else
+		call_rcu_bh(&session->rcu_hook, session_free_rcu);
 }
 
-static int session_init(void)
+static int session_init(unsigned int arena_size, bool counters)
 {
-	entry_cache = kmem_cache_create("jool_session_entries", sizeof(struct session_entry),
-			0, 0, NULL);
+	struct session_pool *pool;
+	int cpu;
+	int error;
+
+	BUILD_BUG_ON(offsetof(struct session_entry, update_time) + sizeof(unsigned long) > 64);
+	BUILD_BUG_ON(sizeof(struct session_entry) > SESSION_ENTRY_BUDGET);
+	BUILD_BUG_ON(sizeof(struct session_entry) % __alignof__(struct session_counters));
+
+	counters_enabled = counters;
+	entry_size = sizeof(struct session_entry);
+	if (counters) {
+		entry_size += sizeof(struct session_counters);
+		counter_caches = alloc_percpu(struct counter_cache);
+		if (!counter_caches) {
+			log_err("Could not allocate the session counter caches.");
+			return -ENOMEM;
+		}
+	}
+	entry_size = ALIGN(entry_size, SMP_CACHE_BYTES);
+
+	entry_cache = kmem_cache_create("jool_session_entries", entry_size, 0, SLAB_HWCACHE_ALIGN,
+			NULL);
 	if (!entry_cache) {
 		log_err("Could not allocate the Session entry cache.");
-		return -ENOMEM;
+		error = -ENOMEM;
+		goto cache_fail;
+	}
+
+	if (arena_size) {
+		error = arena_init(&arena, entry_size, SMP_CACHE_BYTES, arena_size);
+		if (error) {
+			log_err("Could not preallocate %u sessions.", arena_size);
+			goto arena_fail;
+		}
+		jool_mem_add(JMEM_SESSION, arena_footprint(&arena));
+	}
+
+	pools = alloc_percpu(struct session_pool);
+	if (!pools) {
+		log_err("Could not allocate the Session entry pools.");
+		error = -ENOMEM;
+		goto pools_fail;
+	}
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(pools, cpu);
+		INIT_WORK(&pool->refill, pool_refill);
+		/* Nobody's using the pools yet, so there's no need to be on the right CPU. */
+		for (pool->count = 0; pool->count < SESSION_POOL_SIZE; pool->count++) {
+			pool->entries[pool->count] = entry_alloc(GFP_KERNEL, cpu_to_node(cpu));
+			if (!pool->entries[pool->count])
+				break;
+		}
 	}
 
 	return 0;
+
+pools_fail:
+	jool_mem_add(JMEM_SESSION, -(long) arena_footprint(&arena));
+	arena_destroy(&arena);
+arena_fail:
+	kmem_cache_destroy(entry_cache);
+cache_fail:
+	free_percpu(counter_caches);
+	counter_caches = NULL;
+	counters_enabled = false;
+	return error;
 }
 
 static void session_destroy(void)
 {
+	struct session_pool *pool;
+	int cpu;
+
+	/* Wait for the pending session_free_rcu()s before we pull the cache from under them. */
+	rcu_barrier_bh();
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(pools, cpu);
+		cancel_work_sync(&pool->refill);
+		while (pool->count)
+			entry_free(pool->entries[--pool->count]);
+	}
+	free_percpu(pools);
+
+	jool_mem_add(JMEM_SESSION, -(long) arena_footprint(&arena));
+	arena_destroy(&arena);
 	kmem_cache_destroy(entry_cache);
+	free_percpu(counter_caches);
+	counter_caches = NULL;
+	counters_enabled = false;
 }
 
 int session_return(struct session_entry *session)
@@ -123,19 +833,50 @@ void session_get(struct session_entry *session)
 }
 
 /**
- * Creates a copy of "session".
+ * Same as session_get(), except it refuses to resurrect sessions which are already on their way to
+ * session_release(). Meant for lockless readers, who can find those.
+ */
+static bool session_get_unless_zero(struct session_entry *session)
+{
+	return kref_get_unless_zero(&session->refcounter);
+}
+
+/**
+ * Returns the slice of the database the sessions whose remote IPv6 address is "remote6" belong to.
+ *
+ * Doesn't care about spinlocks.
+ */
+static struct sessiondb_shard *get_shard(const struct ipv6_transport_addr *remote6)
+{
+	if (shard_count == 1)
+		return &shards[0];
+	return &shards[jhash_1word(ipv6_addr_hash(&remote6->l3), hash_rnd) % shard_count];
+}
+
+static struct session_counters *session_counters(struct session_entry *session)
+{
+	return (struct session_counters *) (session + 1);
+}
+
+/**
+ * Creates a copy of "session", on the NUMA node of the shard it belongs to.
  *
  * The copy will not be part of the database regardless of session's state.
  */
 static struct session_entry *session_clone(struct session_entry *session)
 {
-	struct session_entry *result = kmem_cache_alloc(entry_cache, GFP_ATOMIC);
+	struct session_entry *result = session_alloc(get_shard(&session->remote6)->node);
 	if (!result)
 		return NULL;
 
 	memcpy(result, session, sizeof(*session));
+	if (counters_enabled)
+		memset(session_counters(result), 0, sizeof(struct session_counters));
 	kref_init(&result->refcounter);
+	result->prefix_slot = PREFIX_SLOT_NONE;
 	INIT_LIST_HEAD(&result->expire_list_hook);
+	INIT_HLIST_NODE(&result->hash6_hook);
+	INIT_HLIST_NODE(&result->hash4_hook);
 	RB_CLEAR_NODE(&result->tree6_hook);
 	RB_CLEAR_NODE(&result->tree4_hook);
 
@@ -145,42 +886,143 @@ static struct session_entry *session_clone(struct session_entry *session)
 	return result;
 }
 
-struct session_entry *session_create(const struct ipv6_transport_addr *remote6,
-		const struct ipv6_transport_addr *local6,
-		const struct ipv4_transport_addr *local4,
-		const struct ipv4_transport_addr *remote4,
-		l4_protocol l4_proto, struct bib_entry *bib)
+/**
+ * The prefixes the sessions' local IPv6 addresses are built with. session_entry.local6_prefix
+ * indexes this, so the entries don't have to store the full address.
+ * The prefixes are appended while holding local6_lock, and they don't change or go away until the
+ * database does, so readers don't need any locking. (In practice, there are one or two of them.)
+ */
+static struct ipv6_prefix local6_prefixes[LOCAL6_PREFIXES];
+/** Number of entries in "local6_prefixes". Only grows. */
+static unsigned int local6_prefix_count;
+static DEFINE_SPINLOCK(local6_lock);
+
+void session_local6(const struct session_entry *session, struct ipv6_transport_addr *result)
 {
-	struct session_entry tmp = {
-			.remote6 = *remote6,
-			.local6 = *local6,
-			.local4 = *local4,
-			.remote4 = *remote4,
-			.update_time = jiffies,
-			.bib = bib,
-			.l4_proto = l4_proto,
-			.state = 0,
-			.expirer = NULL,
-	};
-	return session_clone(&tmp);
+	addr_4to6(&session->remote4.l3, &local6_prefixes[session->local6_prefix], &result->l3);
+	/* ICMP's "ports" are the identifiers, which the IPv6 side shares. */
+	result->l4 = (session->l4_proto != L4PROTO_ICMP)
+			? session->remote4.l4
+			: session->remote6.l4;
 }
 
 /**
- * One-liner to get the session table corresponding to the "l4_proto" protocol.
- *
- * Doesn't care about spinlocks.
+ * Remembers "prefix" in local6_prefixes, unless it's already there. Returns its index, or
+ * -ENOSPC if there's no room for it.
  */
-static int get_session_table(l4_protocol l4_proto, struct session_table **result)
+static int add_local6_prefix(struct ipv6_prefix *prefix)
 {
-	switch (l4_proto) {
-	case L4PROTO_UDP:
-		*result = &session_table_udp;
+	unsigned int i;
+
+	spin_lock_bh(&local6_lock);
+
+	for (i = 0; i < local6_prefix_count; i++)
+		if (ipv6_prefix_equals(&local6_prefixes[i], prefix))
+			goto end;
+
+	if (i == LOCAL6_PREFIXES) {
+		spin_unlock_bh(&local6_lock);
+		log_warn_once("The sessions use more than %u pool6 prefixes; can't track another.",
+				LOCAL6_PREFIXES);
+		return -ENOSPC;
+	}
+
+	local6_prefixes[i] = *prefix;
+	/* Pairs with the barrier in get_local6_prefix(). */
+	smp_wmb();
+	WRITE_ONCE(local6_prefix_count, i + 1);
+
+end:
+	spin_unlock_bh(&local6_lock);
+	return i;
+}
+
+/**
+ * Returns the index (in local6_prefixes) of the prefix "local6" was built from "remote4" with,
+ * or a negative error code if "local6" is not what session_local6() would rebuild out of the rest
+ * of the fields.
+ *
+ * The prefix is inferred from the addresses, rather than asked to pool6, because the prefix might
+ * have been removed from the pool by now (eg. sessions imported from another translator).
+ */
+static int get_local6_prefix(const struct ipv6_transport_addr *remote6,
+		const struct ipv6_transport_addr *local6,
+		const struct ipv4_transport_addr *remote4,
+		l4_protocol l4_proto)
+{
+	static const unsigned int lengths[] = { 96, 64, 56, 48, 40, 32 };
+	struct ipv6_prefix prefix;
+	struct in6_addr rebuilt;
+	unsigned int count;
+	unsigned int i;
+
+	if (local6->l4 != ((l4_proto != L4PROTO_ICMP) ? remote4->l4 : remote6->l4)) {
+		log_debug("Local6 port %u does not match its counterpart's.", local6->l4);
+		return -EINVAL;
+	}
+
+	/* Usually, it was built with a prefix we've already seen. */
+	count = READ_ONCE(local6_prefix_count);
+	smp_rmb();
+	for (i = 0; i < count; i++) {
+		addr_4to6(&remote4->l3, &local6_prefixes[i], &rebuilt);
+		if (ipv6_addr_equal(&rebuilt, &local6->l3))
+			return i;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		prefix.len = lengths[i];
+		ipv6_addr_prefix(&prefix.address, &local6->l3, prefix.len);
+		addr_4to6(&remote4->l3, &prefix, &rebuilt);
+		if (ipv6_addr_equal(&rebuilt, &local6->l3))
+			return add_local6_prefix(&prefix);
+	}
+
+	log_debug("%pI6c is not %pI4 behind a RFC 6052 prefix.", &local6->l3, &remote4->l3);
+	return -EINVAL;
+}
+
+struct session_entry *session_create(const struct ipv6_transport_addr *remote6,
+		const struct ipv6_transport_addr *local6,
+		const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4,
+		l4_protocol l4_proto, struct bib_entry *bib)
+{
+	int prefix = get_local6_prefix(remote6, local6, remote4, l4_proto);
+	struct session_entry tmp = {
+			.remote6 = *remote6,
+			.local4 = *local4,
+			.remote4 = *remote4,
+			.local6_prefix = prefix,
+			.update_time = jiffies,
+			.bib = bib,
+			.l4_proto = l4_proto,
+			.state = 0,
+			.expirer = NULL,
+	};
+
+	if (prefix < 0)
+		return NULL;
+	return session_clone(&tmp);
+}
+
+/**
+ * One-liner to get "shard"'s session table corresponding to the "l4_proto" protocol.
+ *
+ * Doesn't care about spinlocks.
+ */
+static int get_session_table(struct sessiondb_shard *shard, l4_protocol l4_proto,
+		struct session_table **result)
+{
+	switch (l4_proto) {
+	case L4PROTO_UDP:
+		*result = &shard->udp;
 		return 0;
 	case L4PROTO_TCP:
-		*result = &session_table_tcp;
+		*result = &shard->tcp;
 		return 0;
 	case L4PROTO_ICMP:
-		*result = &session_table_icmp;
+		*result = &shard->icmp;
 		return 0;
 	}
 
@@ -192,7 +1034,7 @@ static int compare_addr6(const struct ipv6_transport_addr *a1, const struct ipv6
 {
 	int gap;
 
-	gap = ipv6_addr_cmp(&a1->l3, &a2->l3);
+	gap = ipv6_addr_cmp_fast(&a1->l3, &a2->l3);
 	if (gap)
 		return gap;
 
@@ -202,9 +1044,12 @@ static int compare_addr6(const struct ipv6_transport_addr *a1, const struct ipv6
 
 static int compare_session6(const struct session_entry *s1, const struct session_entry *s2)
 {
+	struct ipv6_transport_addr local6_1, local6_2;
 	int gap;
 
-	gap = compare_addr6(&s1->local6, &s2->local6);
+	session_local6(s1, &local6_1);
+	session_local6(s2, &local6_2);
+	gap = compare_addr6(&local6_1, &local6_2);
 	if (gap)
 		return gap;
 
@@ -221,9 +1066,11 @@ static int compare_session6(const struct session_entry *s1, const struct session
  */
 static int compare_full6(const struct session_entry *session, const struct tuple *tuple6)
 {
+	struct ipv6_transport_addr local6;
 	int gap;
 
-	gap = compare_addr6(&session->local6, &tuple6->dst.addr6);
+	session_local6(session, &local6);
+	gap = compare_addr6(&local6, &tuple6->dst.addr6);
 	if (gap)
 		return gap;
 
@@ -243,15 +1090,19 @@ static int compare_addr4(const struct ipv4_transport_addr *a1, const struct ipv4
 	return gap;
 }
 
+/**
+ * The IPv4 index is sorted by local address first, so the sessions of each pool4 address (and
+ * port) are contiguous. The partial lookups further below rely on this.
+ */
 static int compare_session4(const struct session_entry *s1, const struct session_entry *s2)
 {
 	int gap;
 
-	gap = compare_addr4(&s1->remote4, &s2->remote4);
+	gap = compare_addr4(&s1->local4, &s2->local4);
 	if (gap)
 		return gap;
 
-	gap = compare_addr4(&s1->local4, &s2->local4);
+	gap = compare_addr4(&s1->remote4, &s2->remote4);
 	return gap;
 }
 
@@ -300,11 +1151,11 @@ static int compare_full4(const struct session_entry *session, const struct tuple
 {
 	int gap;
 
-	gap = compare_addr4(&session->remote4, &tuple4->src.addr4);
+	gap = compare_addr4(&session->local4, &tuple4->dst.addr4);
 	if (gap)
 		return gap;
 
-	gap = compare_addr4(&session->local4, &tuple4->dst.addr4);
+	gap = compare_addr4(&session->remote4, &tuple4->src.addr4);
 	return gap;
 }
 
@@ -321,20 +1172,478 @@ static int compare_local_addr4(const struct session_entry *session, const struct
 }
 
 /**
- * Sends a probe packet to "session"'s IPv6 endpoint, to trigger a confirmation ACK if the
- * connection is still alive.
+ * Returns true if "session" is one of the victims of "job".
+ *
+ * Doesn't care about spinlocks.
+ */
+static bool purge_matches(const struct purge_job *job, const struct session_entry *session)
+{
+	struct ipv6_transport_addr local6;
+	u64 slot;
+
+	switch (job->type) {
+	case PURGE_FLUSH:
+		return true;
+	case PURGE_IPV4:
+		return compare_local_addr4(session, &job->addr4) == 0;
+	case PURGE_IPV6_PREFIX:
+		slot = 1ULL << session->local6_prefix;
+		if (job->local6_all & slot)
+			return true;
+		if (!(job->local6_some & slot))
+			return false;
+		session_local6(session, &local6);
+		return ipv6_prefix_equal(&job->prefix6.address, &local6.l3, job->prefix6.len);
+	}
+
+	return false;
+}
+
+/**
+ * Returns true if a queued purge is going to remove "session", which means nobody should be using
+ * it anymore.
+ *
+ * Flushes don't count, because they don't leave anything behind them that could stop their
+ * sessions from being legitimately recreated; new traffic would simply kill every session on
+ * sight until the purger caught up. Deletions by address and prefix, on the other hand, come after
+ * the pool entry went away, so the dying sessions cannot come back.
+ *
+ * This is one atomic read while there are no purges in flight.
+ *
+ * Doesn't care about spinlocks.
+ */
+static bool session_is_dying(const struct session_entry *session)
+{
+	struct purge_job *job;
+	bool dying = false;
+
+	if (likely(!atomic_read(&dying_jobs)))
+		return false;
+
+	rcu_read_lock_bh();
+	list_for_each_entry_rcu(job, &purge_jobs, list_hook) {
+		if (job->type != PURGE_FLUSH && purge_matches(job, session)) {
+			dying = true;
+			break;
+		}
+	}
+	rcu_read_unlock_bh();
+
+	return dying;
+}
+
+/**
+ * Returns the hash code of sessions whose IPv6 identifiers are "local6" and "remote6".
+ * Mask it with the table's index's "mask" to get the hash6 slot.
+ */
+static unsigned int hash6_slot(const struct ipv6_transport_addr *local6,
+		const struct ipv6_transport_addr *remote6)
+{
+	u64 words[5];
+
+	memcpy(&words[0], &local6->l3, sizeof(local6->l3));
+	memcpy(&words[2], &remote6->l3, sizeof(remote6->l3));
+	words[4] = (local6->l4 << 16) | remote6->l4;
+	return keyed_hash(&hash_secret, words, ARRAY_SIZE(words));
+}
+
+/**
+ * Returns the hash code of sessions whose IPv4 identifiers are "remote4" and "local4".
+ * Mask it with the table's index's "mask" to get the hash4 slot.
+ */
+static unsigned int hash4_slot(const struct ipv4_transport_addr *remote4,
+		const struct ipv4_transport_addr *local4)
+{
+	u64 words[2];
+
+	words[0] = ((u64) (__force u32) remote4->l3.s_addr << 32) | (__force u32) local4->l3.s_addr;
+	words[1] = (remote4->l4 << 16) | local4->l4;
+	return keyed_hash(&hash_secret, words, ARRAY_SIZE(words));
+}
+
+/**
+ * Adds "session" to "table"'s hash indexes.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static void hash_add(struct session_entry *session, struct session_table *table)
+{
+	struct session_index *index;
+	struct ipv6_transport_addr local6;
+
+	index = rcu_dereference_protected(table->index, lockdep_is_held(&table->lock));
+	session_local6(session, &local6);
+	hlist_add_head_rcu(&session->hash6_hook,
+			&index->hash6[hash6_slot(&local6, &session->remote6) & index->mask]);
+	hlist_add_head_rcu(&session->hash4_hook, &index->hash4[hash4_slot(&session->remote4,
+			&session->local4) & index->mask]);
+
+	if (table->grow_at && table->count + 1 >= table->grow_at) {
+		table->grow_at = 0;
+		schedule_work(&grow_work);
+	}
+}
+
+/**
+ * Returns the session from "table" whose IPv6 identifiers are "tuple6"'s, or NULL.
+ * The hash code is already known.
+ *
+ * Needs either "table"'s spinlock or the RCU read-side lock.
+ */
+static struct session_entry *__hash_find6(struct session_table *table,
+		const struct tuple *tuple6, u32 hash)
+{
+	struct session_index *index = rcu_dereference_bh(table->index);
+	struct session_entry *session;
+
+	hlist_for_each_entry_rcu(session, &index->hash6[hash & index->mask], hash6_hook) {
+		if (compare_full6(session, tuple6) == 0)
+			return session;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the session from "table" whose IPv6 identifiers are "tuple6"'s, or NULL.
+ *
+ * Needs either "table"'s spinlock or the RCU read-side lock.
+ */
+static struct session_entry *hash_find6(struct session_table *table, const struct tuple *tuple6)
+{
+	return __hash_find6(table, tuple6, hash6_slot(&tuple6->dst.addr6, &tuple6->src.addr6));
+}
+
+/**
+ * Returns the session from "table" whose IPv4 identifiers are "tuple4"'s, or NULL.
+ * The hash code is already known.
+ *
+ * Needs either "table"'s spinlock or the RCU read-side lock.
+ */
+static struct session_entry *__hash_find4(struct session_table *table,
+		const struct tuple *tuple4, u32 hash)
+{
+	struct session_index *index = rcu_dereference_bh(table->index);
+	struct session_entry *session;
+
+	hlist_for_each_entry_rcu(session, &index->hash4[hash & index->mask], hash4_hook) {
+		if (compare_full4(session, tuple4) == 0)
+			return session;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the session from "table" whose IPv4 identifiers are "tuple4"'s, or NULL.
+ *
+ * Needs either "table"'s spinlock or the RCU read-side lock.
+ */
+static struct session_entry *hash_find4(struct session_table *table, const struct tuple *tuple4)
+{
+	return __hash_find4(table, tuple4, hash4_slot(&tuple4->src.addr4, &tuple4->dst.addr4));
+}
+
+/**
+ * Returns whether grow_work_fn() might have moved "table"'s chains since "rehashes" was read.
+ */
+static bool rehash_interrupted(struct session_table *table, unsigned int rehashes)
+{
+	smp_rmb();
+	return (rehashes & 1) || READ_ONCE(table->rehashes) != rehashes;
+}
+
+/**
+ * __hash_find6() for readers that don't hold "table"'s lock. If it misses while the index is
+ * being replaced, the lookup is repeated with the lock, which waits until the chains settle.
+ *
+ * Needs the RCU read-side lock.
+ */
+static struct session_entry *hash_find6_rcu(struct session_table *table,
+		const struct tuple *tuple6, u32 hash)
+{
+	struct session_entry *session;
+	unsigned int rehashes;
+
+	rehashes = READ_ONCE(table->rehashes);
+	smp_rmb();
+	session = __hash_find6(table, tuple6, hash);
+	if (session || !rehash_interrupted(table, rehashes))
+		return session;
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	session = __hash_find6(table, tuple6, hash);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	return session;
+}
+
+/**
+ * __hash_find4() for readers that don't hold "table"'s lock. See hash_find6_rcu().
+ *
+ * Needs the RCU read-side lock.
+ */
+static struct session_entry *hash_find4_rcu(struct session_table *table,
+		const struct tuple *tuple4, u32 hash)
+{
+	struct session_entry *session;
+	unsigned int rehashes;
+
+	rehashes = READ_ONCE(table->rehashes);
+	smp_rmb();
+	session = __hash_find4(table, tuple4, hash);
+	if (session || !rehash_interrupted(table, rehashes))
+		return session;
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	session = __hash_find4(table, tuple4, hash);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	return session;
+}
+
+static int flowcache_init(void)
+{
+	struct flow_cache *cache;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = kzalloc_node(sizeof(*cache), GFP_KERNEL, cpu_to_node(cpu));
+		if (!cache)
+			return -ENOMEM; /* flowcache_destroy() cleans up. */
+		per_cpu(flow_caches, cpu) = cache;
+		jool_mem_add(JMEM_SESSION, sizeof(*cache));
+	}
+
+	flowcache_enabled = true;
+	return 0;
+}
+
+static void flowcache_destroy(void)
+{
+	int cpu;
+
+	flowcache_enabled = false;
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(flow_caches, cpu))
+			jool_mem_add(JMEM_SESSION, -(long) sizeof(struct flow_cache));
+		kfree(per_cpu(flow_caches, cpu));
+		per_cpu(flow_caches, cpu) = NULL;
+	}
+}
+
+/**
+ * Returns the current CPU's flow cache slot the "hash" hash code (of the "ipv6" index) maps to.
+ *
+ * Needs the RCU read-side lock (which also keeps us on the CPU).
+ */
+static struct flow_slot *flowcache_slot(bool ipv6, u32 hash)
+{
+	struct flow_cache *cache = __this_cpu_read(flow_caches);
+	unsigned int index = hash & (FLOWCACHE_SLOTS - 1);
+
+	return ipv6 ? &cache->slots6[index] : &cache->slots4[index];
+}
+
+/**
+ * Returns the session "slot" remembers, if it's the one whose "l4_proto" identifiers are
+ * "tuple" and its hash code is "hash". Returns NULL otherwise.
+ *
+ * Needs the RCU read-side lock.
+ */
+static struct session_entry *flowcache_find(struct flow_slot *slot, const struct tuple *tuple,
+		u32 hash)
+{
+	struct session_entry *session;
+	int gap;
+
+	session = READ_ONCE(slot->session);
+	if (!session || slot->hash != hash || session->l4_proto != tuple->l4_proto)
+		return NULL;
+
+	gap = (tuple->l3_proto == L3PROTO_IPV6)
+			? compare_full6(session, tuple)
+			: compare_full4(session, tuple);
+	return gap ? NULL : session;
+}
+
+/**
+ * Makes "slot" remember "session", which a lookup whose hash code was "hash" just found.
+ *
+ * Needs the RCU read-side lock.
+ */
+static void flowcache_store(struct flow_slot *slot, struct session_entry *session, u32 hash)
+{
+	slot->hash = hash;
+	WRITE_ONCE(slot->session, session);
+
+	/*
+	 * remove() might have already unhashed the session and looked at this slot before we wrote
+	 * it. Pairs with the barrier in flowcache_forget(); one of us is bound to see the other.
+	 */
+	smp_mb();
+	if (hlist_unhashed(&session->hash6_hook))
+		cmpxchg(&slot->session, session, NULL);
+}
+
+/**
+ * Removes "session" from every CPU's flow cache. "session" must have already been removed from
+ * the hash indexes.
+ *
+ * "session"'s table's spinlock must be held.
+ */
+static void flowcache_forget(struct session_entry *session)
+{
+	struct flow_cache *cache;
+	struct ipv6_transport_addr local6;
+	unsigned int index6;
+	unsigned int index4;
+	int cpu;
+
+	if (!flowcache_enabled)
+		return;
+
+	session_local6(session, &local6);
+	index6 = hash6_slot(&local6, &session->remote6) & (FLOWCACHE_SLOTS - 1);
+	index4 = hash4_slot(&session->remote4, &session->local4) & (FLOWCACHE_SLOTS - 1);
+
+	/* Pairs with the barrier in flowcache_store(). */
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu(flow_caches, cpu);
+		/* Read first, so the other CPUs' slots are not dirtied for nothing. */
+		if (READ_ONCE(cache->slots6[index6].session) == session)
+			cmpxchg(&cache->slots6[index6].session, session, NULL);
+		if (READ_ONCE(cache->slots4[index4].session) == session)
+			cmpxchg(&cache->slots4[index4].session, session, NULL);
+	}
+}
+
+static void counters_add(struct session_entry *session, u32 packets, u32 bytes)
+{
+	struct session_counters *counters = session_counters(session);
+
+	atomic64_add(packets, &counters->packets);
+	atomic64_add(bytes, &counters->bytes);
+}
+
+void session_count(struct session_entry *session, unsigned int len)
+{
+	struct counter_slot *slot;
+	struct session_entry *old;
+
+	if (!counters_enabled)
+		return;
+
+	local_bh_disable();
+	slot = &this_cpu_ptr(counter_caches)->slots[hash_ptr(session, COUNTER_SLOT_BITS)];
+
+	if (READ_ONCE(slot->session) == session && slot->bytes <= U32_MAX - len) {
+		slot->packets++;
+		slot->bytes += len;
+		goto end;
+	}
+
+	/* Evict the current tenant. counters_forget() might be trying to do the same. */
+	old = xchg(&slot->session, NULL);
+	if (old)
+		counters_add(old, slot->packets, slot->bytes);
+
+	slot->packets = 1;
+	slot->bytes = len;
+	smp_wmb();
+	WRITE_ONCE(slot->session, session);
+
+	/* Same as flowcache_store(). */
+	smp_mb();
+	if (hlist_unhashed(&session->hash6_hook)
+			&& cmpxchg(&slot->session, session, NULL) == session)
+		counters_add(session, slot->packets, slot->bytes);
+	/* Fall through. */
+
+end:
+	local_bh_enable();
+}
+
+/**
+ * Adds whatever traffic of "session" the CPUs are still holding to its counters, and makes sure
+ * they won't hold more. "session" must have already been removed from the hash indexes.
+ *
+ * "session"'s table's spinlock must be held.
+ */
+static void counters_forget(struct session_entry *session)
+{
+	struct counter_slot *slot;
+	unsigned int index;
+	int cpu;
+
+	if (!counters_enabled)
+		return;
+
+	index = hash_ptr(session, COUNTER_SLOT_BITS);
+
+	/* Pairs with the barrier in session_count(). */
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		slot = &per_cpu_ptr(counter_caches, cpu)->slots[index];
+		if (READ_ONCE(slot->session) == session
+				&& cmpxchg(&slot->session, session, NULL) == session)
+			counters_add(session, slot->packets, slot->bytes);
+	}
+}
+
+void session_get_counters(struct session_entry *session, __u64 *packets, __u64 *bytes)
+{
+	struct counter_slot *slot;
+	unsigned int index;
+	int cpu;
+
+	if (!counters_enabled) {
+		*packets = 0;
+		*bytes = 0;
+		return;
+	}
+
+	*packets = atomic64_read(&session_counters(session)->packets);
+	*bytes = atomic64_read(&session_counters(session)->bytes);
+
+	/* Not atomic with the above, but it's a snapshot of moving numbers anyway. */
+	index = hash_ptr(session, COUNTER_SLOT_BITS);
+	for_each_possible_cpu(cpu) {
+		slot = &per_cpu_ptr(counter_caches, cpu)->slots[index];
+		if (READ_ONCE(slot->session) == session) {
+			*packets += READ_ONCE(slot->packets);
+			*bytes += READ_ONCE(slot->bytes);
+		}
+	}
+}
+
+/**
+ * The route used by the last probe, so the next one can skip the lookup if it's headed to the same
+ * place. Expiring sessions tend to come in bunches of the same subscriber and server.
+ */
+struct probe_route {
+	struct dst_entry *dst;
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+};
+
+/**
+ * Sends a TCP ACK towards "session"'s IPv6 node, to find out whether the connection is still alive.
+ * Tries to reuse "route", and leaves the route it used there.
  *
  * From RFC 6146 page 30.
  *
  * @param[in] session the established session that has been inactive for too long.
  *
- * Doesn't care about spinlocks, but "session" might.
+ * Doesn't care about spinlocks, but it's meant to be called from process context.
+ *
+ * @return whether the packet could be sent.
  */
-static void send_probe_packet(struct session_entry *session)
+static bool send_probe_packet(struct session_entry *session, struct probe_route *route)
 {
 	struct sk_buff* skb;
 	struct ipv6hdr *iph;
 	struct tcphdr *th;
+	struct ipv6_transport_addr local6;
 	int error;
 
 	unsigned int l3_hdr_len = sizeof(*iph);
@@ -361,11 +1670,12 @@ static void send_probe_packet(struct session_entry *session)
 	iph->payload_len = cpu_to_be16(l4_hdr_len);
 	iph->nexthdr = NEXTHDR_TCP;
 	iph->hop_limit = 255;
-	iph->saddr = session->local6.l3;
+	session_local6(session, &local6);
+	iph->saddr = local6.l3;
 	iph->daddr = session->remote6.l3;
 
 	th = tcp_hdr(skb);
-	th->source = cpu_to_be16(session->local6.l4);
+	th->source = cpu_to_be16(local6.l4);
 	th->dest = cpu_to_be16(session->remote6.l4);
 	th->seq = htonl(0);
 	th->ack_seq = htonl(0);
@@ -389,47 +1699,197 @@ static void send_probe_packet(struct session_entry *session)
 
 	skb_set_jcb(skb, L3PROTO_IPV6, L4PROTO_TCP, th + 1, NULL, NULL);
 
-	error = sendpkt_route6(skb);
-	if (error)
-		goto fail;
+	if (route->dst && ipv6_addr_equal(&route->saddr, &iph->saddr)
+			&& ipv6_addr_equal(&route->daddr, &iph->daddr)) {
+		skb_dst_set(skb, dst_clone(route->dst));
+		skb->dev = route->dst->dev;
+	} else {
+		error = sendpkt_route6(skb);
+		if (error)
+			goto fail;
+
+		dst_release(route->dst);
+		route->dst = dst_clone(skb_dst(skb));
+		route->saddr = iph->saddr;
+		route->daddr = iph->daddr;
+	}
 
 	skb_clear_cb(skb);
 	error = ip6_local_out(skb);
 	if (error) {
 		log_debug("The kernel's packet dispatch function returned errcode %d.", error);
+		skb = NULL; /* ip6_local_out() already consumed it. */
 		goto fail;
 	}
 
-	return;
+	return true;
 
 fail:
+	kfree_skb(skb);
 	log_debug("Looks like a TCP connection will break or remain idle forever somewhere...");
+	return false;
 }
 
 /**
- * Removes all of this database's references towards "session", and drops its refcount accordingly.
- *
- * The only thing it doesn't do is decrement count of "session"'s table! I do that outside because
- * I always want to add up and report that number.
- *
- * @return number of sessions removed from the database. This is always 1, because I have no way to
- *		know if the removal failed (and it shouldn't be possible anyway).
+ * Sends the packets from "probe_queue", rate-limited. See "probe_queue".
  *
- * "table"'s spinlock must already be held.
+ * The sessions whose state is V4_INIT are embryonic sessions which expired, so their stored
+ * packets get an ICMP error. The rest are established sessions which need a probe.
  */
-static int remove(struct session_entry *session, struct session_table *table)
+static void probe_work_fn(struct work_struct *work)
 {
-	if (!RB_EMPTY_NODE(&session->tree6_hook))
+	struct list_head batch;
+	struct session_entry *session, *tmp;
+	struct session_entry *embryos[PROBE_BATCH];
+	unsigned int embryo_count = 0;
+	struct probe_route route = { .dst = NULL };
+	unsigned int i;
+	bool more;
+
+	INIT_LIST_HEAD(&batch);
+
+	spin_lock_bh(&probe_lock);
+	for (i = 0; i < PROBE_BATCH && !list_empty(&probe_queue); i++)
+		list_move_tail(probe_queue.next, &batch);
+	probe_queue_len -= i;
+	more = !list_empty(&probe_queue);
+	probe_last_run = jiffies;
+	spin_unlock_bh(&probe_lock);
+
+	list_for_each_entry_safe(session, tmp, &batch, expire_list_hook) {
+		list_del(&session->expire_list_hook);
+		if (session->state == V4_INIT) {
+			/* Keep the reference; the packet queue still needs the session. */
+			embryos[embryo_count++] = session;
+			continue;
+		}
+		if (send_probe_packet(session, &route))
+			atomic64_inc(&probes_sent);
+		else
+			atomic64_inc(&probes_dropped);
+		session_return(session);
+	}
+
+	dst_release(route.dst);
+
+	pktqueue_send_batch(embryos, embryo_count);
+	for (i = 0; i < embryo_count; i++)
+		session_return(embryos[i]);
+
+	if (more)
+		schedule_delayed_work(&probe_work, PROBE_INTERVAL);
+}
+
+/**
+ * Hands the sessions from "list" over to the probe sender. See "probe_queue".
+ *
+ * Doesn't care about spinlocks; "list" must belong to the caller.
+ */
+static void probe_enqueue(struct list_head *list)
+{
+	struct session_entry *session, *tmp;
+	unsigned long delay;
+	bool queued = false;
+
+	if (list_empty(list))
+		return;
+
+	spin_lock_bh(&probe_lock);
+	list_for_each_entry_safe(session, tmp, list, expire_list_hook) {
+		list_del(&session->expire_list_hook);
+		if (probe_queue_len >= PROBE_QUEUE_MAX) {
+			if (session->state != V4_INIT)
+				atomic64_inc(&probes_dropped);
+			session_return(session);
+			continue;
+		}
+		list_add_tail(&session->expire_list_hook, &probe_queue);
+		probe_queue_len++;
+		queued = true;
+	}
+	delay = probe_last_run + PROBE_INTERVAL - jiffies;
+	if (delay > PROBE_INTERVAL)
+		delay = 0;
+	spin_unlock_bh(&probe_lock);
+
+	if (queued)
+		schedule_delayed_work(&probe_work, delay);
+}
+
+/**
+ * Cancels the pending probes. Only meant for the module's destruction, after the expirers died.
+ */
+static void probe_destroy(void)
+{
+	struct session_entry *session, *tmp;
+
+	cancel_delayed_work_sync(&probe_work);
+
+	list_for_each_entry_safe(session, tmp, &probe_queue, expire_list_hook) {
+		list_del(&session->expire_list_hook);
+		session_return(session);
+	}
+	probe_queue_len = 0;
+}
+
+/**
+ * Removes all of this database's references towards "session", and drops its refcount accordingly.
+ *
+ * The only thing it doesn't do is decrement count of "session"'s table! I do that outside because
+ * I always want to add up and report that number.
+ *
+ * @return number of sessions removed from the database. This is always 1, because I have no way to
+ *		know if the removal failed (and it shouldn't be possible anyway).
+ *
+ * "table"'s spinlock must already be held.
+ */
+static int remove(struct session_entry *session, struct session_table *table)
+{
+	if (!hlist_unhashed(&session->hash6_hook))
+		hlist_del_init_rcu(&session->hash6_hook);
+	if (!hlist_unhashed(&session->hash4_hook))
+		hlist_del_init_rcu(&session->hash4_hook);
+	flowcache_forget(session);
+	counters_forget(session);
+
+	if (!RB_EMPTY_NODE(&session->tree6_hook))
 		rb_erase(&session->tree6_hook, &table->tree6);
 	if (!RB_EMPTY_NODE(&session->tree4_hook))
 		rb_erase(&session->tree4_hook, &table->tree4);
 
-	list_del(&session->expire_list_hook);
+	if (session->expirer)
+		slot_del(session->slot_entry);
 	session->expirer = NULL;
+	trace_jool_session_remove(session);
+	dbevents_session(DBEVENT_SESSION_REMOVE, session);
 	session_return(session);
 	return 1;
 }
 
+/**
+ * Rounds "next_time" up to the next multiple of the configured timer slack.
+ *
+ * This is what makes the expirers of every shard wake up together, and what lets mod_timer() return
+ * early when a timer is reprogrammed to the date it already has.
+ *
+ * Doesn't care about spinlocks.
+ */
+static unsigned long coalesce_expiry(unsigned long next_time)
+{
+	unsigned long slack;
+
+	rcu_read_lock_bh();
+	slack = rcu_dereference_bh(config)->timer_slack;
+	rcu_read_unlock_bh();
+
+	if (slack <= 1)
+		return next_time;
+
+	/* This wraps along with jiffies, so the result is never before "next_time". */
+	next_time += slack - 1;
+	return next_time - (next_time % slack);
+}
+
 /**
  * Wrapper for mod_timer().
  *
@@ -442,7 +1902,7 @@ static void schedule_timer(struct timer_list *timer, unsigned long next_time, ch
 	if (time_before(next_time, min_next))
 		next_time = min_next;
 
-	mod_timer(timer, next_time);
+	mod_timer(timer, coalesce_expiry(next_time));
 	log_debug("%s timer will awake in %u msecs.", expirer_name,
 			jiffies_to_msecs(timer->expires - jiffies));
 }
@@ -456,11 +1916,14 @@ static unsigned long get_timeout(struct expire_timer *expirer)
 {
 	unsigned long timeout;
 
-	if (expirer == &expirer_syn)
+	if (expirer == &expirer->shard->expirer_syn)
 		return msecs_to_jiffies(1000 * TCP_INCOMING_SYN);
 
 	rcu_read_lock_bh();
 	timeout = *(expirer->timeout_offset + (__u64 *) rcu_dereference_bh(config));
+	/* If the user turned it off, the stragglers go back to the RFC's lifetime. */
+	if (!timeout && expirer == &expirer->shard->expirer_tcp_closed)
+		timeout = rcu_dereference_bh(config)->ttl.tcp_trans;
 	rcu_read_unlock_bh();
 
 	return timeout;
@@ -478,26 +1941,159 @@ int sessiondb_get_timeout(struct session_entry *session, unsigned long *result)
 }
 
 /**
- * Helper of the set_*_timer functions. Safely updates "session"->dying_time using "ttl" and moves
- * it from its original location to the end of "list".
+ * Returns the slot from "expirer"'s wheel where the sessions queued during jiffy "time" belong.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static struct expiry_slot *get_slot(struct expire_timer *expirer, unsigned long time)
+{
+	return &expirer->slots[(time / expirer->granularity) & (EXPIRER_SLOTS - 1)];
+}
+
+/**
+ * Stretches "expirer"'s slots so the wheel spans twice "timeout". Sessions are swept at most one
+ * slot late, so this is also the precision of the expiration.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static void update_granularity(struct expire_timer *expirer, unsigned long timeout)
+{
+	expirer->granularity = max_t(unsigned long, timeout / (EXPIRER_SLOTS / 2), MIN_TIMER_SLEEP);
+}
+
+/**
+ * Returns true if "expirer" has no sessions.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static bool expirer_is_empty(struct expire_timer *expirer)
+{
+	unsigned int i;
+
+	for (i = 0; i < EXPIRER_SLOTS; i++) {
+		if (expirer->slots[i].count)
+			return false;
+	}
+
+	return true;
+}
+
+static struct expiry_chunk *entry_chunk(struct session_entry **entry)
+{
+	return (struct expiry_chunk *) ((unsigned long) entry & PAGE_MASK);
+}
+
+static void chunk_free(struct expiry_chunk *chunk)
+{
+	list_del(&chunk->list_hook);
+	free_page((unsigned long) chunk);
+	jool_mem_add(JMEM_SESSION, -(long) PAGE_SIZE);
+}
+
+/**
+ * Appends "session" to "slot" (which belongs to "expirer").
+ * This does not take it out of wherever it was before.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static int slot_add(struct expire_timer *expirer, struct expiry_slot *slot,
+		struct session_entry *session)
+{
+	struct expiry_chunk *chunk = NULL;
+	struct page *page;
+
+	if (!list_empty(&slot->chunks))
+		chunk = list_entry(slot->chunks.prev, struct expiry_chunk, list_hook);
+
+	if (!chunk || chunk->len >= EXPIRY_CHUNK_LEN) {
+		page = alloc_pages_node(expirer->shard->node, GFP_ATOMIC | __GFP_NOWARN, 0);
+		if (!page)
+			return -ENOMEM;
+		jool_mem_add(JMEM_SESSION, PAGE_SIZE);
+
+		chunk = page_address(page);
+		chunk->slot = slot;
+		chunk->len = 0;
+		chunk->live = 0;
+		list_add_tail(&chunk->list_hook, &slot->chunks);
+	}
+
+	session->slot_entry = &chunk->sessions[chunk->len++];
+	*session->slot_entry = session;
+	chunk->live++;
+	slot->count++;
+	return 0;
+}
+
+/**
+ * Takes the session of "entry" out of its slot.
+ *
+ * The chunk is never freed here (the sweep does that), so whoever is walking through the slot
+ * doesn't have it disappear from under its feet. If it's the slot's last chunk and it has just
+ * been emptied, it's rewound instead.
+ *
+ * The table's spinlock must already be held.
+ */
+static void slot_del(struct session_entry **entry)
+{
+	struct expiry_chunk *chunk = entry_chunk(entry);
+	struct expiry_slot *slot = chunk->slot;
+
+	*entry = NULL;
+	slot->count--;
+	/* Short connections come and go in the current slot; reuse its last page. */
+	if (--chunk->live == 0 && chunk->list_hook.next == &slot->chunks)
+		chunk->len = 0;
+}
+
+/**
+ * Moves "session" to the slot of "expirer" its update_time belongs to. If there's no memory for
+ * that, "session" stays where it was and false is returned.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static bool requeue(struct session_entry *session, struct expire_timer *expirer)
+{
+	struct session_entry **old = session->slot_entry;
+
+	if (slot_add(expirer, get_slot(expirer, session->update_time), session)) {
+		log_debug("Out of memory for the %s expirer's slots.", expirer->name);
+		return false;
+	}
+
+	if (session->expirer)
+		slot_del(old);
+	session->expirer = expirer;
+	return true;
+}
+
+/**
+ * Helper of the set_*_timer functions. Safely updates "session"->update_time and, if it changed
+ * timers, queues it in "expirer"'s current slot.
+ *
+ * If the memory to queue it is not available, the session stays in its old expirer (which is no
+ * expirer if it's new; sessiondb_add() checks).
  */
 static struct expire_timer *set_timer(struct session_entry *session,
 		struct expire_timer *expirer)
 {
-	struct expire_timer *result;
-
 	session->update_time = jiffies;
-	list_del(&session->expire_list_hook);
-	list_add_tail(&session->expire_list_hook, &expirer->sessions);
-	session->expirer = expirer;
+
+	/*
+	 * Same timer; leave the session where it is.
+	 * The sweep will notice the new update_time once the old slot comes due.
+	 */
+	if (session->expirer == expirer)
+		return NULL;
+
+	if (!requeue(session, expirer))
+		return NULL;
 
 	/*
 	 * The new session is always going to expire last.
 	 * So if the timer is already set, there should be no reason to edit it.
 	 */
-	result = timer_pending(&expirer->timer) ? NULL : expirer;
-
-	return result;
+	return timer_pending(&expirer->timer) ? NULL : expirer;
 }
 
 static void commit_timer(struct expire_timer *expirer)
@@ -506,6 +2102,81 @@ static void commit_timer(struct expire_timer *expirer)
 		schedule_timer(&expirer->timer, jiffies + get_timeout(expirer), expirer->name);
 }
 
+/**
+ * Returns the configured refresh granularity. Zero means lazy refreshes are disabled.
+ *
+ * Doesn't care about spinlocks.
+ */
+static unsigned long get_refresh_granularity(void)
+{
+	unsigned long granularity;
+
+	rcu_read_lock_bh();
+	granularity = rcu_dereference_bh(config)->refresh_granularity;
+	rcu_read_unlock_bh();
+
+	return granularity;
+}
+
+/**
+ * Lockless version of set_timer(), for sessions which are already being handled by "expirer".
+ * "session"->update_time is only written if it's at least "granularity" jiffies old, so
+ * long-lived flows don't keep bouncing the cache line between CPUs either.
+ *
+ * The sweep re-reads update_time under the lock, so the worst that can happen if we race against
+ * it is that the session dies a packet early.
+ *
+ * @return false if "session" is not in "expirer" (so the caller needs the locked path).
+ *
+ * Doesn't care about spinlocks.
+ */
+static bool refresh_lazily(struct session_entry *session, struct expire_timer *expirer,
+		unsigned long granularity)
+{
+	unsigned long now = jiffies;
+
+	if (READ_ONCE(session->expirer) != expirer)
+		return false;
+
+	if (time_after_eq(now, READ_ONCE(session->update_time) + granularity))
+		WRITE_ONCE(session->update_time, now);
+
+	return true;
+}
+
+/**
+ * Shortcut of the get_or_create functions for the sessions which already exist and would stay
+ * in "expirer". Does the lookup and the refresh without "table"'s lock.
+ *
+ * @return the session (with its refcount already incremented), or NULL if the caller needs to
+ *		take the locked path.
+ */
+static struct session_entry *get_lazily(struct session_table *table, struct tuple *tuple,
+		struct expire_timer *expirer)
+{
+	struct session_entry *session;
+	unsigned long granularity;
+
+	granularity = get_refresh_granularity();
+	if (!granularity)
+		return NULL;
+
+	rcu_read_lock_bh();
+	session = (tuple->l3_proto == L3PROTO_IPV6)
+			? hash_find6(table, tuple)
+			: hash_find4(table, tuple);
+	if (session && (session_is_dying(session) || !session_get_unless_zero(session)))
+		session = NULL;
+	rcu_read_unlock_bh();
+
+	if (session && !refresh_lazily(session, expirer, granularity)) {
+		session_return(session);
+		session = NULL;
+	}
+
+	return session;
+}
+
 /**
  * Handles "session"'s expiration, assuming it's a TCP session.
  *
@@ -520,6 +2191,7 @@ static void commit_timer(struct expire_timer *expirer)
 static int session_tcp_expire(struct session_entry *session, struct list_head *tcp_timeouts,
 		struct list_head *probes)
 {
+	struct sessiondb_shard *shard = session->expirer->shard;
 	struct session_entry *clone;
 
 	switch (session->state) {
@@ -529,20 +2201,23 @@ static int session_tcp_expire(struct session_entry *session, struct list_head *t
 			list_add(&clone->expire_list_hook, tcp_timeouts);
 
 		session->state = CLOSED;
-		return remove(session, &session_table_tcp);
+		return remove(session, &shard->tcp);
 
 	case ESTABLISHED:
+		session->update_time = jiffies;
+		if (!requeue(session, &shard->expirer_tcp_trans)) {
+			/* It has been idle for hours; not worth fighting for memory over. */
+			session->state = CLOSED;
+			return remove(session, &shard->tcp);
+		}
+
 		clone = session_clone(session);
 		if (clone)
 			list_add(&clone->expire_list_hook, probes);
+		else
+			atomic64_inc(&probes_dropped);
 
 		session->state = TRANS;
-		session->update_time = jiffies;
-
-		list_del(&session->expire_list_hook);
-		list_add_tail(&session->expire_list_hook, &expirer_tcp_trans.sessions);
-		session->expirer = &expirer_tcp_trans;
-
 		return 0;
 
 	case V6_INIT:
@@ -551,16 +2226,77 @@ static int session_tcp_expire(struct session_entry *session, struct list_head *t
 	case V4_FIN_V6_FIN_RCV:
 	case TRANS:
 		session->state = CLOSED;
-		return remove(session, &session_table_tcp);
+		return remove(session, &shard->tcp);
 
 	case CLOSED:
 		/* Closed sessions are not supposed to be stored, so this is an error. */
 		WARN(true, "Closed state found; removing session entry.");
-		return remove(session, &session_table_tcp);
+		return remove(session, &shard->tcp);
 	}
 
 	WARN(true, "Unknown state found (%d); removing session entry.", session->state);
-	return remove(session, &session_table_tcp);
+	return remove(session, &shard->tcp);
+}
+
+/**
+ * Sweeps the slots of "expirer" whose periods are older than "timeout", killing the expired
+ * sessions. The sessions which were refreshed since they were queued are moved to the slot their
+ * new update_time belongs to.
+ *
+ * @return false if the batch limit was reached before the sweep could finish.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static bool sweep_slots(struct expire_timer *expirer, unsigned long timeout,
+		struct list_head *tcp_timeouts, struct list_head *probes, unsigned int *removed)
+{
+	struct expiry_slot *slot;
+	struct expiry_chunk *chunk, *tmp;
+	struct session_entry *session;
+	unsigned long limit = jiffies - timeout;
+	unsigned int budget = EXPIRER_BATCH;
+	unsigned int i;
+
+	update_granularity(expirer, timeout);
+	/* If we're more than a lap behind (eg. the timeout was reduced), older laps are redundant. */
+	if (time_before(expirer->cursor + EXPIRER_SLOTS * expirer->granularity, limit))
+		expirer->cursor = limit - EXPIRER_SLOTS * expirer->granularity;
+
+	while (time_before_eq(expirer->cursor + expirer->granularity, limit)) {
+		slot = get_slot(expirer, expirer->cursor);
+
+		list_for_each_entry_safe(chunk, tmp, &slot->chunks, list_hook) {
+			for (i = 0; i < chunk->len; i++) {
+				session = chunk->sessions[i];
+				if (!session)
+					continue;
+
+				if (time_before(limit, session->update_time)) {
+					/* If this fails, it'll be given another look next lap. */
+					if (get_slot(expirer, session->update_time) != slot)
+						requeue(session, expirer);
+					continue;
+				}
+
+				if (!budget)
+					return false;
+				budget--;
+
+				if (session->l4_proto != L4PROTO_TCP)
+					*removed += remove(session, expirer->table);
+				else
+					*removed += session_tcp_expire(session, tcp_timeouts,
+							probes);
+			}
+
+			if (!chunk->live)
+				chunk_free(chunk);
+		}
+
+		expirer->cursor += expirer->granularity;
+	}
+
+	return true;
 }
 
 /**
@@ -568,15 +2304,17 @@ static int session_tcp_expire(struct session_entry *session, struct list_head *t
  *
  * In that sense, it's a public function, so it requires spinlocks to NOT be held.
  */
-static void cleaner_timer(unsigned long param)
+static void cleaner_work(struct work_struct *work)
 {
-	struct expire_timer *expirer = (struct expire_timer *) param;
-	struct list_head *current_hook, *next_hook;
+	struct expire_timer *expirer = container_of(work, struct expire_timer, work);
+	struct expire_timer *tcp_trans = &expirer->shard->expirer_tcp_trans;
 	struct list_head probes, tcp_timeouts;
-	struct session_entry *session;
+	struct session_reap *reap = NULL;
+	ktime_t start;
 	unsigned long timeout;
-	unsigned long session_update_time = 0;
-	unsigned int s = 0;
+	unsigned long next_time = 0;
+	unsigned int s;
+	bool finished;
 	bool schedule_tcp_trans = false;
 
 	log_debug("===============================================");
@@ -584,145 +2322,636 @@ static void cleaner_timer(unsigned long param)
 	log_debug("Cleaner name: %s", expirer->name);
 
 	timeout = get_timeout(expirer);
-	INIT_LIST_HEAD(&probes);
-	INIT_LIST_HEAD(&tcp_timeouts);
 
-	spin_lock_bh(&expirer->table->lock);
+	do {
+		s = 0;
+		INIT_LIST_HEAD(&probes);
+		INIT_LIST_HEAD(&tcp_timeouts);
+		start = ktime_get();
+		/* If this fails, the sessions are simply released one by one. */
+		if (!reap) {
+			reap = kmalloc(sizeof(*reap), GFP_KERNEL);
+			if (reap)
+				INIT_LIST_HEAD(&reap->sessions);
+		}
 
-	list_for_each_safe(current_hook, next_hook, &expirer->sessions) {
-		session = list_entry(current_hook, struct session_entry, expire_list_hook);
+		jool_lock_bh(&expirer->table->lock, JLOCK_SESSION);
 
-		if (time_before(jiffies, session->update_time + timeout)) {
-			/* "list" is sorted by expiration date, so stop on the first unexpired session. */
-			session_update_time = session->update_time + timeout;
-			break;
-		}
+		__this_cpu_write(current_reap, reap);
+		finished = sweep_slots(expirer, timeout, &tcp_timeouts, &probes, &s);
+		__this_cpu_write(current_reap, NULL);
+		expirer->table->count -= s;
+		if (finished && !expirer_is_empty(expirer))
+			next_time = expirer->cursor + expirer->granularity + timeout;
+		schedule_tcp_trans = !timer_pending(&tcp_trans->timer) &&
+				!expirer_is_empty(tcp_trans) && (expirer != tcp_trans);
 
-		if (session->l4_proto != L4PROTO_TCP)
-			s += remove(session, expirer->table);
-		else
-			s += session_tcp_expire(session, &tcp_timeouts, &probes);
-	}
+		jool_unlock_bh(&expirer->table->lock, JLOCK_SESSION);
 
-	expirer->table->count -= s;
-	schedule_tcp_trans = !timer_pending(&expirer_tcp_trans.timer) &&
-			!list_empty(&expirer_tcp_trans.sessions) && (expirer != &expirer_tcp_trans);
-	spin_unlock_bh(&expirer->table->lock);
+		if (reap && !list_empty(&reap->sessions)) {
+			call_rcu_bh(&reap->rcu_hook, session_reap_rcu);
+			reap = NULL;
+		}
+		if (schedule_tcp_trans)
+			schedule_timer(&tcp_trans->timer, jiffies + get_timeout(tcp_trans), tcp_trans->name);
 
-	if (schedule_tcp_trans)
-		schedule_timer(&expirer_tcp_trans.timer, jiffies + get_timeout(&expirer_tcp_trans), expirer_tcp_trans.name);
+		probe_enqueue(&tcp_timeouts);
+		probe_enqueue(&probes);
 
-	if (session_update_time)
-		schedule_timer(&expirer->timer, session_update_time, expirer->name);
+		atomic64_add(s, &sessions_expired);
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &expire_nsecs);
+		log_debug("Deleted %u sessions.", s);
 
-	list_for_each_safe(current_hook, next_hook, &tcp_timeouts) {
-		session = list_entry(current_hook, struct session_entry, expire_list_hook);
-		pktqueue_send(session);
-		session_return(session);
-	}
+		if (!finished)
+			cond_resched();
+	} while (!finished);
 
-	list_for_each_safe(current_hook, next_hook, &probes) {
-		session = list_entry(current_hook, struct session_entry, expire_list_hook);
-		send_probe_packet(session);
-		session_return(session);
-	}
+	kfree(reap);
+	if (next_time)
+		schedule_timer(&expirer->timer, next_time, expirer->name);
+}
 
-	log_debug("Deleted %u sessions.", s);
+/**
+ * Defers the sweep to process context, since it might take a while.
+ */
+static void cleaner_timer(unsigned long param)
+{
+	struct expire_timer *expirer = (struct expire_timer *) param;
+	schedule_work(&expirer->work);
 }
 
 /**
- * Auxiliar for sessiondb_init(). Encapsulates initialization of an expire_timer structure.
+ * Kills up to "max" of the oldest sessions of "expirer", regardless of their expiration dates.
  *
- * Doesn't care about spinlocks (initialization code doesn't share threads).
+ * @return the number of sessions killed.
+ *
+ * "expirer"'s table's spinlock must already be held.
  */
-static void init_expire_timer(struct expire_timer *expirer, struct session_table *table,
-		size_t timeout_offset, char *expirer_name)
+static unsigned long shrink_expirer(struct expire_timer *expirer, unsigned long max)
 {
-	init_timer(&expirer->timer);
-	expirer->timer.function = cleaner_timer;
-	expirer->timer.expires = 0;
-	expirer->timer.data = (unsigned long) expirer;
+	struct session_entry *session;
+	struct expiry_slot *slot;
+	struct expiry_chunk *chunk;
+	unsigned long killed = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < EXPIRER_SLOTS && killed < max; i++) {
+		slot = get_slot(expirer, expirer->cursor + i * expirer->granularity);
+		list_for_each_entry(chunk, &slot->chunks, list_hook) {
+			for (j = 0; j < chunk->len && killed < max; j++) {
+				session = chunk->sessions[j];
+				if (!session)
+					continue;
+				if (session->l4_proto == L4PROTO_TCP) {
+					if (session->state == V4_INIT)
+						pktqueue_remove(session);
+					session->state = CLOSED;
+				}
+				killed += remove(session, expirer->table);
+			}
+			if (killed >= max)
+				break;
+		}
+	}
 
-	INIT_LIST_HEAD(&expirer->sessions);
-	expirer->table = table;
-	expirer->timeout_offset = timeout_offset / sizeof(__u64);
-	expirer->name = expirer_name;
+	expirer->table->count -= killed;
+	return killed;
 }
 
-int sessiondb_init(void)
+/** The shard the next shrink starts from, so they don't always hit the first one. */
+static unsigned int shrink_cursor;
+
+/**
+ * Gives the kernel up to "max" sessions back. The victims are the oldest UDP and ICMP sessions
+ * first, and then the oldest embryonic and transitory TCP ones. Established TCP sessions are
+ * never touched.
+ *
+ * Requires spinlocks to NOT be held.
+ *
+ * @return the number of sessions killed.
+ */
+static unsigned long shrink_sessions(unsigned long max)
 {
-	struct session_table *tables[] = { &session_table_udp, &session_table_tcp,
-			&session_table_icmp };
-	int i;
-	int error;
+	struct sessiondb_shard *shard;
+	unsigned long killed = 0;
+	unsigned int first = READ_ONCE(shrink_cursor);
+	unsigned int i, j;
 
-	error = session_init();
-	if (error)
-		return error;
+	WRITE_ONCE(shrink_cursor, first + 1);
 
-	config = kmalloc(sizeof(*config), GFP_ATOMIC);
-	if (!config) {
-		log_debug("Could not allocate memory to store the session DB config.");
-		return -ENOMEM;
-	}
+	for (i = 0; i < shard_count && killed < max; i++) {
+		shard = &shards[(first + i) % shard_count];
 
-	config->ttl.udp = msecs_to_jiffies(1000 * UDP_DEFAULT);
-	config->ttl.icmp = msecs_to_jiffies(1000 * ICMP_DEFAULT);
-	config->ttl.tcp_est = msecs_to_jiffies(1000 * TCP_EST);
-	config->ttl.tcp_trans = msecs_to_jiffies(1000 * TCP_TRANS);
+		jool_lock_bh(&shard->udp.lock, JLOCK_SESSION);
+		killed += shrink_expirer(&shard->expirer_udp, max - killed);
+		for (j = 0; j < UDP_CLASSES; j++)
+			killed += shrink_expirer(&shard->expirer_udp_classes[j], max - killed);
+		jool_unlock_bh(&shard->udp.lock, JLOCK_SESSION);
 
-	for (i = 0; i < ARRAY_SIZE(tables); i++) {
-		tables[i]->tree6 = RB_ROOT;
-		tables[i]->tree4 = RB_ROOT;
-		tables[i]->count = 0;
-		spin_lock_init(&tables[i]->lock);
+		jool_lock_bh(&shard->icmp.lock, JLOCK_SESSION);
+		killed += shrink_expirer(&shard->expirer_icmp, max - killed);
+		jool_unlock_bh(&shard->icmp.lock, JLOCK_SESSION);
 	}
 
-	init_expire_timer(&expirer_udp, &session_table_udp,
-			offsetof(struct sessiondb_config, ttl.udp), EXPIRER_NAMES[0]);
-	init_expire_timer(&expirer_icmp, &session_table_icmp,
-			offsetof(struct sessiondb_config, ttl.icmp), EXPIRER_NAMES[1]);
-	init_expire_timer(&expirer_tcp_est, &session_table_tcp,
-			offsetof(struct sessiondb_config, ttl.tcp_est), EXPIRER_NAMES[2]);
-	init_expire_timer(&expirer_tcp_trans, &session_table_tcp,
-			offsetof(struct sessiondb_config, ttl.tcp_trans), EXPIRER_NAMES[3]);
-	init_expire_timer(&expirer_syn, &session_table_tcp, 0, EXPIRER_NAMES[4]);
+	for (i = 0; i < shard_count && killed < max; i++) {
+		shard = &shards[(first + i) % shard_count];
 
-	return 0;
+		jool_lock_bh(&shard->tcp.lock, JLOCK_SESSION);
+		killed += shrink_expirer(&shard->expirer_tcp_closed, max - killed);
+		killed += shrink_expirer(&shard->expirer_syn, max - killed);
+		killed += shrink_expirer(&shard->expirer_tcp_trans, max - killed);
+		jool_unlock_bh(&shard->tcp.lock, JLOCK_SESSION);
+	}
+
+	atomic64_add(killed, &sessions_shrunk);
+	return killed;
 }
 
 /**
- * Auxiliar for sessiondb_destroy(). Wraps the destruction of a session, exposing an API the rbtree
- * module wants.
- *
- * Doesn't care about spinlocks (destructor code doesn't share threads).
+ * Returns how many sessions the shrinker could take. It's an overestimate, since the established
+ * TCP sessions are counted too; shrink_sessions() just comes back empty-handed when only those are
+ * left.
  */
-static void session_destroy_aux(struct rb_node *node)
+static unsigned long count_shrinkable(void)
 {
-	kmem_cache_free(entry_cache, rb_entry(node, struct session_entry, tree6_hook));
+	unsigned long result = 0;
+	unsigned int i;
+
+	for (i = 0; i < shard_count; i++) {
+		result += READ_ONCE(shards[i].udp.count);
+		result += READ_ONCE(shards[i].icmp.count);
+		result += READ_ONCE(shards[i].tcp.count);
+	}
+
+	return result;
 }
 
-void sessiondb_destroy(void)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+
+static unsigned long shrinker_count(struct shrinker *shrinker, struct shrink_control *sc)
 {
-	struct session_table *tables[] = { &session_table_udp, &session_table_tcp,
-			&session_table_icmp };
-	int i;
+	return count_shrinkable();
+}
 
-	del_timer_sync(&expirer_udp.timer);
-	del_timer_sync(&expirer_tcp_est.timer);
-	del_timer_sync(&expirer_tcp_trans.timer);
-	del_timer_sync(&expirer_syn.timer);
-	del_timer_sync(&expirer_icmp.timer);
+static unsigned long shrinker_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	unsigned long killed = shrink_sessions(sc->nr_to_scan);
+
+	return killed ? killed : SHRINK_STOP;
+}
+
+#else
+
+static int shrinker_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	if (sc->nr_to_scan)
+		shrink_sessions(sc->nr_to_scan);
+	return min_t(unsigned long, count_shrinkable(), INT_MAX);
+}
+
+#endif
+
+static struct shrinker session_shrinker = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+	.count_objects = shrinker_count,
+	.scan_objects = shrinker_scan,
+#else
+	.shrink = shrinker_shrink,
+#endif
+	.seeks = DEFAULT_SEEKS,
+};
+
+/** Whether session_shrinker is registered. See sessiondb_init(). */
+static bool shrinker_enabled;
+
+/**
+ * Auxiliar for sessiondb_init(). Encapsulates initialization of an expire_timer structure.
+ *
+ * Doesn't care about spinlocks (initialization code doesn't share threads).
+ */
+static void init_expire_timer(struct expire_timer *expirer, struct sessiondb_shard *shard,
+		struct session_table *table, size_t timeout_offset, char *expirer_name)
+{
+	unsigned int i;
+
+	/* The sweep can wait for a CPU that's awake anyway; the shrinker covers the emergencies. */
+	init_timer_deferrable(&expirer->timer);
+	expirer->timer.function = cleaner_timer;
+	expirer->timer.expires = 0;
+	expirer->timer.data = (unsigned long) expirer;
+	INIT_WORK(&expirer->work, cleaner_work);
+
+	for (i = 0; i < EXPIRER_SLOTS; i++) {
+		INIT_LIST_HEAD(&expirer->slots[i].chunks);
+		expirer->slots[i].count = 0;
+	}
+	expirer->table = table;
+	expirer->shard = shard;
+	expirer->timeout_offset = timeout_offset / sizeof(__u64);
+	expirer->name = expirer_name;
+
+	update_granularity(expirer, get_timeout(expirer));
+	expirer->cursor = jiffies;
+}
+
+/**
+ * Makes sure neither "expirer"'s timer nor its work are queued or running, and releases its
+ * slots. They schedule each other, so this keeps killing them until both stay dead.
+ *
+ * The sessions are not released; they still belong to the tables.
+ */
+static void stop_expirer(struct expire_timer *expirer)
+{
+	struct expiry_chunk *chunk, *tmp;
+	unsigned int i;
+
+	do {
+		del_timer_sync(&expirer->timer);
+	} while (cancel_work_sync(&expirer->work) || timer_pending(&expirer->timer));
+
+	for (i = 0; i < EXPIRER_SLOTS; i++) {
+		list_for_each_entry_safe(chunk, tmp, &expirer->slots[i].chunks, list_hook)
+			chunk_free(chunk);
+		expirer->slots[i].count = 0;
+	}
+}
+
+/**
+ * Allocates an empty index of "size" slots per side on "node".
+ */
+static struct session_index *index_alloc(unsigned int size, int node)
+{
+	struct session_index *index;
+	unsigned int i;
+
+	index = vmalloc_node(sizeof(*index) + 2 * size * sizeof(index->slots[0]), node);
+	if (!index)
+		return NULL;
+
+	index->mask = size - 1;
+	index->hash6 = index->slots;
+	index->hash4 = index->slots + size;
+	for (i = 0; i < 2 * size; i++)
+		INIT_HLIST_HEAD(&index->slots[i]);
+	jool_mem_add(JMEM_SESSION, 2 * size * sizeof(index->slots[0]));
+
+	return index;
+}
+
+static void index_free(struct session_index *index)
+{
+	jool_mem_add(JMEM_SESSION, -(long) (2 * (index->mask + 1) * sizeof(index->slots[0])));
+	vfree(index);
+}
+
+/**
+ * Moves "table"'s sessions to an index twice as big, if hash_add() asked for one.
+ *
+ * The sessions are moved in a single pass with the lock held. That's linear on the table's size,
+ * but it only happens once per doubling, in process context.
+ */
+static void grow_table(struct session_table *table, int node)
+{
+	struct session_index *old, *new;
+	struct hlist_head *head;
+	struct session_entry *session;
+	struct ipv6_transport_addr local6;
+	unsigned int size, slot, i;
+	bool pending;
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	old = rcu_dereference_protected(table->index, lockdep_is_held(&table->lock));
+	size = old->mask + 1;
+	pending = !table->grow_at && size < hash_max_size;
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	if (!pending)
+		return;
+
+	new = index_alloc(2 * size, node);
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	if (!new) {
+		/* The chains will only get longer. Try again once they've doubled. */
+		table->grow_at = max_t(u64, 2 * table->count, 1);
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		log_warn_once("Could not allocate a bigger session index.");
+		return;
+	}
+
+	table->rehashes++;
+	smp_wmb();
+
+	for (i = 0; i < size; i++) {
+		head = &old->hash6[i];
+		while (!hlist_empty(head)) {
+			session = hlist_entry(head->first, struct session_entry, hash6_hook);
+			session_local6(session, &local6);
+			slot = hash6_slot(&local6, &session->remote6) & new->mask;
+			hlist_del_rcu(&session->hash6_hook);
+			hlist_add_head_rcu(&session->hash6_hook, &new->hash6[slot]);
+		}
+		head = &old->hash4[i];
+		while (!hlist_empty(head)) {
+			session = hlist_entry(head->first, struct session_entry, hash4_hook);
+			slot = hash4_slot(&session->remote4, &session->local4) & new->mask;
+			hlist_del_rcu(&session->hash4_hook);
+			hlist_add_head_rcu(&session->hash4_hook, &new->hash4[slot]);
+		}
+	}
+	rcu_assign_pointer(table->index, new);
+
+	smp_wmb();
+	table->rehashes++;
+	table->grow_at = (2 * size < hash_max_size) ? (SESSION_HASH_LOAD * 2 * size) : 0;
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	/* Lockless readers might still be holding the old heads. */
+	synchronize_rcu_bh();
+	index_free(old);
+}
+
+static void grow_work_fn(struct work_struct *work)
+{
+	unsigned int i;
+
+	for (i = 0; i < shard_count; i++) {
+		grow_table(&shards[i].udp, shards[i].node);
+		grow_table(&shards[i].tcp, shards[i].node);
+		grow_table(&shards[i].icmp, shards[i].node);
+	}
+}
+
+/**
+ * Auxiliar for sessiondb_init(). Encapsulates initialization of a session_table structure.
+ *
+ * Doesn't care about spinlocks (initialization code doesn't share threads).
+ */
+static int init_table(struct session_table *table, unsigned int hash_size, int node)
+{
+	struct session_index *index;
+
+	index = index_alloc(hash_size, node);
+	if (!index)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(table->index, index);
+	table->grow_at = (hash_size < hash_max_size) ? (SESSION_HASH_LOAD * hash_size) : 0;
+	table->rehashes = 0;
+	table->tree6 = RB_ROOT;
+	table->tree4 = RB_ROOT;
+	table->count = 0;
+	spin_lock_init(&table->lock);
+
+	return 0;
+}
+
+/**
+ * Auxiliar for sessiondb_destroy() and the initialization rollback. Releases "table"'s indexes.
+ * The sessions themselves are not touched.
+ */
+static void destroy_table(struct session_table *table)
+{
+	index_free(rcu_dereference_protected(table->index, 1));
+}
+
+/**
+ * Auxiliar for sessiondb_init(). Encapsulates initialization of a sessiondb_shard structure.
+ *
+ * Doesn't care about spinlocks (initialization code doesn't share threads).
+ */
+static int init_shard(struct sessiondb_shard *shard, unsigned int hash_size, int node)
+{
+	unsigned int i;
+	int error;
+
+	shard->node = node;
+
+	error = init_table(&shard->udp, hash_size, node);
+	if (error)
+		return error;
+	error = init_table(&shard->tcp, hash_size, node);
+	if (error)
+		goto tcp_fail;
+	error = init_table(&shard->icmp, hash_size, node);
+	if (error)
+		goto icmp_fail;
+
+	init_expire_timer(&shard->expirer_udp, shard, &shard->udp,
+			offsetof(struct sessiondb_config, ttl.udp), EXPIRER_NAMES[0]);
+	init_expire_timer(&shard->expirer_icmp, shard, &shard->icmp,
+			offsetof(struct sessiondb_config, ttl.icmp), EXPIRER_NAMES[1]);
+	init_expire_timer(&shard->expirer_tcp_est, shard, &shard->tcp,
+			offsetof(struct sessiondb_config, ttl.tcp_est), EXPIRER_NAMES[2]);
+	init_expire_timer(&shard->expirer_tcp_trans, shard, &shard->tcp,
+			offsetof(struct sessiondb_config, ttl.tcp_trans), EXPIRER_NAMES[3]);
+	init_expire_timer(&shard->expirer_syn, shard, &shard->tcp, 0, EXPIRER_NAMES[4]);
+	init_expire_timer(&shard->expirer_tcp_closed, shard, &shard->tcp,
+			offsetof(struct sessiondb_config, ttl.tcp_closed), EXPIRER_NAMES[5]);
+	for (i = 0; i < UDP_CLASSES; i++)
+		init_expire_timer(&shard->expirer_udp_classes[i], shard, &shard->udp,
+				offsetof(struct sessiondb_config, udp_classes[0].ttl)
+				+ i * sizeof(config->udp_classes[0]),
+				UDP_CLASS_NAMES[i]);
+
+	return 0;
+
+icmp_fail:
+	destroy_table(&shard->tcp);
+tcp_fail:
+	destroy_table(&shard->udp);
+	return error;
+}
+
+int sessiondb_init(unsigned int shards_requested, unsigned int arena_size, bool flow_cache,
+		bool counters, bool shrink)
+{
+	unsigned int hash_size;
+	int i;
+	int error;
+
+	if (shards_requested == 0)
+		shards_requested = num_possible_cpus();
+	shard_count = min_t(unsigned int, shards_requested, SESSIONDB_MAX_SHARDS);
+	hash_size = rounddown_pow_of_two(SESSION_HASH_SIZE / shard_count);
+	hash_max_size = rounddown_pow_of_two(SESSION_HASH_MAX_SIZE / shard_count);
+	local6_prefix_count = 0;
+
+	error = session_init(arena_size, counters);
+	if (error)
+		return error;
+
+	config = config_alloc(sizeof(*config), GFP_ATOMIC);
+	if (!config) {
+		log_debug("Could not allocate memory to store the session DB config.");
+		error = -ENOMEM;
+		goto config_fail;
+	}
+
+	config->ttl.udp = msecs_to_jiffies(1000 * UDP_DEFAULT);
+	config->ttl.icmp = msecs_to_jiffies(1000 * ICMP_DEFAULT);
+	config->ttl.tcp_est = msecs_to_jiffies(1000 * TCP_EST);
+	config->ttl.tcp_trans = msecs_to_jiffies(1000 * TCP_TRANS);
+	config->ttl.tcp_closed = msecs_to_jiffies(1000 * TCP_CLOSED_DEF);
+	config->refresh_granularity = msecs_to_jiffies(REFRESH_GRANULARITY_DEF);
+	config->timer_slack = msecs_to_jiffies(TIMER_SLACK_DEF);
+	config->max_sessions.udp = MAX_SESSIONS_DEF;
+	config->max_sessions.tcp = MAX_SESSIONS_DEF;
+	config->max_sessions.icmp = MAX_SESSIONS_DEF;
+	config->max_sessions_per_prefix = MAX_SESSIONS_PER_PREFIX_DEF;
+	config->session_prefix_len = SESSION_PREFIX_LEN_DEF;
+	config->session_rate_per_prefix = SESSION_RATE_PER_PREFIX_DEF;
+	for (i = 0; i < UDP_CLASSES; i++) {
+		config->udp_classes[i].ttl = msecs_to_jiffies(1000 * UDP_DEFAULT);
+		config->udp_classes[i].port = 0;
+	}
+
+	get_random_bytes(&hash_rnd, sizeof(hash_rnd));
+	keyed_hash_init_key(&hash_secret);
+
+	memset(prefix_histogram, 0, sizeof(prefix_histogram));
+	memset(age_slots, 0, sizeof(age_slots));
+	memset(age_ancient, 0, sizeof(age_ancient));
+	prefix_counters = vzalloc(PREFIX_COUNTER_SLOTS * sizeof(*prefix_counters));
+	if (!prefix_counters) {
+		log_err("Could not allocate the session database's admission counters.");
+		error = -ENOMEM;
+		goto counters_fail;
+	}
+	rate_slots = vzalloc(PREFIX_COUNTER_SLOTS * sizeof(*rate_slots));
+	if (!rate_slots) {
+		log_err("Could not allocate the session database's rate limiter.");
+		error = -ENOMEM;
+		goto rate_fail;
+	}
+	jool_mem_add(JMEM_SESSION, ADMISSION_BYTES);
+
+	shards = kcalloc(shard_count, sizeof(*shards), GFP_KERNEL);
+	if (!shards) {
+		log_err("Could not allocate the session database.");
+		error = -ENOMEM;
+		goto shards_fail;
+	}
+
+	for (i = 0; i < shard_count; i++) {
+		error = init_shard(&shards[i], hash_size, shard_node(i));
+		if (error) {
+			log_err("Could not allocate the session database's indexes.");
+			goto shard_fail;
+		}
+	}
+
+	if (flow_cache) {
+		error = flowcache_init();
+		if (error) {
+			log_err("Could not allocate the session flow caches.");
+			goto flowcache_fail;
+		}
+	}
+
+	shrinker_enabled = false;
+	if (shrink && arena_size) {
+		log_info("The session arena never gives memory back, so it won't be shrunk.");
+	} else if (shrink) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+		error = register_shrinker(&session_shrinker);
+		if (error) {
+			log_err("Could not register the session shrinker.");
+			goto flowcache_fail;
+		}
+#else
+		register_shrinker(&session_shrinker);
+#endif
+		shrinker_enabled = true;
+	}
+
+	if (shard_count > 1)
+		log_info("The session database was split into %u shards.", shard_count);
+	return 0;
+
+flowcache_fail:
+	flowcache_destroy();
+	i = shard_count;
+	/* Fall through. */
+shard_fail:
+	for (i--; i >= 0; i--) {
+		destroy_table(&shards[i].udp);
+		destroy_table(&shards[i].tcp);
+		destroy_table(&shards[i].icmp);
+	}
+	kfree(shards);
+shards_fail:
+	jool_mem_add(JMEM_SESSION, -(long) ADMISSION_BYTES);
+	vfree(rate_slots);
+rate_fail:
+	vfree(prefix_counters);
+counters_fail:
+	config_free(config);
+config_fail:
+	session_destroy();
+	return error;
+}
+
+/**
+ * Auxiliar for sessiondb_destroy(). Wraps the destruction of a session, exposing an API the rbtree
+ * module wants.
+ *
+ * Doesn't care about spinlocks (destructor code doesn't share threads).
+ */
+static void session_destroy_aux(struct rb_node *node)
+{
+	entry_free(rb_entry(node, struct session_entry, tree6_hook));
+}
+
+void sessiondb_destroy(void)
+{
+	struct sessiondb_shard *shard;
+	int i, j;
+
+	/* Before anything else; it walks the tables. */
+	if (shrinker_enabled)
+		unregister_shrinker(&session_shrinker);
+	shrinker_enabled = false;
+	purge_destroy();
+	cancel_work_sync(&grow_work);
+
+	for (i = 0; i < shard_count; i++) {
+		shard = &shards[i];
+		stop_expirer(&shard->expirer_udp);
+		stop_expirer(&shard->expirer_tcp_est);
+		stop_expirer(&shard->expirer_tcp_trans);
+		stop_expirer(&shard->expirer_tcp_closed);
+		stop_expirer(&shard->expirer_syn);
+		stop_expirer(&shard->expirer_icmp);
+		for (j = 0; j < UDP_CLASSES; j++)
+			stop_expirer(&shard->expirer_udp_classes[j]);
+	}
+
+	probe_destroy();
 
 	log_debug("Emptying the session tables...");
-	/*
-	 * The values need to be released only in one of the trees
-	 * because both trees point to the same values.
-	 */
-	for (i = 0; i < ARRAY_SIZE(tables); i++)
-		rbtree_clear(&tables[i]->tree6, session_destroy_aux);
+	for (i = 0; i < shard_count; i++) {
+		shard = &shards[i];
+		/*
+		 * The values need to be released only in one of the trees
+		 * because both trees point to the same values.
+		 */
+		rbtree_clear(&shard->udp.tree6, session_destroy_aux);
+		rbtree_clear(&shard->tcp.tree6, session_destroy_aux);
+		rbtree_clear(&shard->icmp.tree6, session_destroy_aux);
 
+		destroy_table(&shard->udp);
+		destroy_table(&shard->tcp);
+		destroy_table(&shard->icmp);
+	}
+
+	kfree(shards);
+	flowcache_destroy();
+	rcu_barrier_bh(); /* Wait for the configurations retired by config_retire(). */
+	config_free(config);
 	session_destroy();
+	jool_mem_add(JMEM_SESSION, -(long) ADMISSION_BYTES);
+	vfree(prefix_counters);
+	vfree(rate_slots);
 }
 
 int sessiondb_clone_config(struct sessiondb_config *clone)
@@ -733,13 +2962,70 @@ int sessiondb_clone_config(struct sessiondb_config *clone)
 	return 0;
 }
 
+/**
+ * Helper of sessiondb_set_config(). Makes "ttl" the lifetime of "tmp_config"'s UDP sessions
+ * whose remote port is "port", or has them go back to "ttl.udp" if "ttl" is zero.
+ *
+ * RFC 4787 (REQ-5) only allows lifetimes below UDP_MIN on well-known ports.
+ *
+ * Returns the offset of the affected expirer within struct sessiondb_shard, zero on failure.
+ */
+static size_t set_udp_class(struct sessiondb_config *tmp_config, __u16 port, __u64 ttl)
+{
+	unsigned int i;
+	int free_class = -1;
+
+	if (port == 0) {
+		log_err("Port zero cannot have a UDP timeout of its own.");
+		return 0;
+	}
+	if (ttl != 0 && port >= 1024 && ttl < msecs_to_jiffies(1000 * UDP_MIN)) {
+		log_err("UDP timeouts of ports above 1023 must be at least %u seconds.", UDP_MIN);
+		return 0;
+	}
+
+	for (i = 0; i < UDP_CLASSES; i++) {
+		if (tmp_config->udp_classes[i].port == port)
+			break;
+		if (tmp_config->udp_classes[i].port == 0 && free_class == -1)
+			free_class = i;
+	}
+
+	if (i == UDP_CLASSES) {
+		if (ttl == 0) {
+			log_err("Port %u does not have a UDP timeout of its own.", port);
+			return 0;
+		}
+		if (free_class == -1) {
+			log_err("There can only be %u UDP timeouts by port. Remove one first.",
+					UDP_CLASSES);
+			return 0;
+		}
+		i = free_class;
+	}
+
+	/*
+	 * A removed class keeps its lifetime (until its slot is reused), so its sessions are not
+	 * cut short; they move to the regular UDP timer the next time they're refreshed.
+	 */
+	tmp_config->udp_classes[i].port = ttl ? port : 0;
+	if (ttl)
+		tmp_config->udp_classes[i].ttl = ttl;
+
+	return offsetof(struct sessiondb_shard, expirer_udp_classes)
+			+ i * sizeof(struct expire_timer);
+}
+
 int sessiondb_set_config(enum sessiondb_type type, size_t size, void *value)
 {
 	struct sessiondb_config *tmp_config;
 	struct sessiondb_config *old_config;
+	size_t expirer_offset;
 	struct expire_timer *expirer;
 	__u64 value64;
 	__u32 max_u32 = 0xFFFFFFFFL; /* Max value in milliseconds */
+	__u16 port = 0;
+	int i;
 
 	if (size != sizeof(__u64)) {
 		log_err("Expected an 8-byte integer, got %zu bytes.", size);
@@ -747,14 +3033,35 @@ int sessiondb_set_config(enum sessiondb_type type, size_t size, void *value)
 	}
 
 	value64 = *((__u64 *) value);
-	if (value64 > max_u32) {
-		log_err("Expected a timeout less than %u seconds", max_u32 / 1000);
-		return -EINVAL;
-	}
 
-	value64 = msecs_to_jiffies(value64);
+	switch (type) {
+	case UDP_TIMEOUT:
+	case ICMP_TIMEOUT:
+	case TCP_EST_TIMEOUT:
+	case TCP_TRANS_TIMEOUT:
+	case TCP_CLOSED_TIMEOUT:
+	case REFRESH_GRANULARITY:
+	case TIMER_SLACK:
+		if (value64 > max_u32) {
+			log_err("Expected a timeout less than %u seconds", max_u32 / 1000);
+			return -EINVAL;
+		}
+		value64 = msecs_to_jiffies(value64);
+		break;
+	case UDP_CLASS_TIMEOUT:
+		if ((value64 >> 32) > 0xFFFF) {
+			log_err("%llu is not a valid port.", value64 >> 32);
+			return -EINVAL;
+		}
+		port = value64 >> 32;
+		value64 = msecs_to_jiffies(value64 & max_u32);
+		break;
+	default:
+		/* Not a time value. */
+		break;
+	}
 
-	tmp_config = kmalloc(sizeof(*tmp_config), GFP_KERNEL);
+	tmp_config = config_alloc(sizeof(*tmp_config), GFP_KERNEL);
 	if (!tmp_config)
 		return -ENOMEM;
 
@@ -768,11 +3075,11 @@ int sessiondb_set_config(enum sessiondb_type type, size_t size, void *value)
 			goto fail;
 		}
 		tmp_config->ttl.udp = value64;
-		expirer = &expirer_udp;
+		expirer_offset = offsetof(struct sessiondb_shard, expirer_udp);
 		break;
 	case ICMP_TIMEOUT:
 		tmp_config->ttl.icmp = value64;
-		expirer = &expirer_icmp;
+		expirer_offset = offsetof(struct sessiondb_shard, expirer_icmp);
 		break;
 	case TCP_EST_TIMEOUT:
 		if (value64 < msecs_to_jiffies(1000 * TCP_EST)) {
@@ -780,7 +3087,7 @@ int sessiondb_set_config(enum sessiondb_type type, size_t size, void *value)
 			goto fail;
 		}
 		tmp_config->ttl.tcp_est = value64;
-		expirer = &expirer_tcp_est;
+		expirer_offset = offsetof(struct sessiondb_shard, expirer_tcp_est);
 		break;
 	case TCP_TRANS_TIMEOUT:
 		if (value64 < msecs_to_jiffies(1000 * TCP_TRANS)) {
@@ -788,137 +3095,698 @@ int sessiondb_set_config(enum sessiondb_type type, size_t size, void *value)
 			goto fail;
 		}
 		tmp_config->ttl.tcp_trans = value64;
-		expirer = &expirer_tcp_trans;
+		expirer_offset = offsetof(struct sessiondb_shard, expirer_tcp_trans);
+		break;
+	case TCP_CLOSED_TIMEOUT:
+		tmp_config->ttl.tcp_closed = value64;
+		expirer_offset = offsetof(struct sessiondb_shard, expirer_tcp_closed);
+		break;
+	case REFRESH_GRANULARITY:
+		tmp_config->refresh_granularity = value64;
+		expirer_offset = 0; /* No timer cares. */
+		break;
+	case TIMER_SLACK:
+		tmp_config->timer_slack = value64;
+		expirer_offset = 0; /* Applies from the next time each timer is programmed. */
+		break;
+	case MAX_SESSIONS_UDP:
+		tmp_config->max_sessions.udp = value64;
+		expirer_offset = 0;
+		break;
+	case MAX_SESSIONS_TCP:
+		tmp_config->max_sessions.tcp = value64;
+		expirer_offset = 0;
+		break;
+	case MAX_SESSIONS_ICMP:
+		tmp_config->max_sessions.icmp = value64;
+		expirer_offset = 0;
+		break;
+	case MAX_SESSIONS_PER_PREFIX:
+		tmp_config->max_sessions_per_prefix = value64;
+		expirer_offset = 0;
+		break;
+	case SESSION_PREFIX_LEN:
+		if (value64 > 128) {
+			log_err("Prefix lengths cannot exceed 128.");
+			goto fail;
+		}
+		tmp_config->session_prefix_len = value64;
+		expirer_offset = 0;
+		break;
+	case UDP_CLASS_TIMEOUT:
+		expirer_offset = set_udp_class(tmp_config, port, value64);
+		if (!expirer_offset)
+			goto fail;
+		break;
+	case SESSION_RATE_PER_PREFIX:
+		tmp_config->session_rate_per_prefix = value64;
+		expirer_offset = 0;
 		break;
 	default:
 		log_err("Unknown config type for the 'session database' module: %u", type);
 		goto fail;
 	}
 
-	rcu_assign_pointer(config, tmp_config);
-	synchronize_rcu_bh();
-	kfree(old_config);
-	schedule_timer(&expirer->timer, jiffies + get_timeout(expirer), expirer->name);
-	return 0;
+	rcu_assign_pointer(config, tmp_config);
+	config_retire(old_config);
+
+	for (i = 0; i < shard_count && expirer_offset; i++) {
+		expirer = (struct expire_timer *) (((char *) &shards[i]) + expirer_offset);
+		/* Let it adapt its wheel to the new timeout right away. */
+		schedule_work(&expirer->work);
+	}
+	return 0;
+
+fail:
+	config_free(tmp_config);
+	return -EINVAL;
+}
+
+void sessiondb_get_stats(struct sessiondb_stats *result)
+{
+	result->rejected_table_full = atomic64_read(&rejected_table_full);
+	result->rejected_prefix_full = atomic64_read(&rejected_prefix_full);
+	result->rejected_prefix_rate = atomic64_read(&rejected_prefix_rate);
+	result->early_drops = atomic64_read(&early_drops);
+	result->sessions_shrunk = atomic64_read(&sessions_shrunk);
+	result->purges_pending = atomic64_read(&purges_pending);
+	result->sessions_purged = atomic64_read(&sessions_purged);
+	result->probes_sent = atomic64_read(&probes_sent);
+	result->probes_dropped = atomic64_read(&probes_dropped);
+	result->sessions_expired = atomic64_read(&sessions_expired);
+	result->expire_nsecs = atomic64_read(&expire_nsecs);
+}
+
+/**
+ * Returns in "result" the session entry from the "l4_proto" table that corresponds to the "pair"
+ * IPv4 addresses. Doesn't touch its refcount.
+ *
+ * IPv4 packets don't tell us which shard their session belongs to, so all of them are queried.
+ *
+ * The caller must hold rcu_read_lock_bh().
+ */
+static int find_by_ipv4(struct tuple *tuple4, l4_protocol l4_proto, struct session_entry **result)
+{
+	struct session_table *table;
+	struct flow_slot *slot = NULL;
+	u32 hash;
+	unsigned int i;
+	int error;
+
+	*result = NULL;
+	hash = hash4_slot(&tuple4->src.addr4, &tuple4->dst.addr4);
+
+	if (flowcache_enabled) {
+		slot = flowcache_slot(false, hash);
+		*result = flowcache_find(slot, tuple4, hash);
+		if (*result && session_is_dying(*result))
+			*result = NULL;
+		if (*result)
+			return 0;
+	}
+
+	for (i = 0; i < shard_count && !(*result); i++) {
+		error = get_session_table(&shards[i], l4_proto, &table);
+		if (error)
+			return error;
+
+		*result = hash_find4_rcu(table, tuple4, hash);
+		if (*result && session_is_dying(*result))
+			*result = NULL;
+	}
+	if (*result && slot)
+		flowcache_store(slot, *result, hash);
+
+	return (*result) ? 0 : -ENOENT;
+}
+
+/**
+ * Returns in "result" the session entry from the "l4_proto" table that corresponds to the "pair"
+ * IPv6 addresses. Doesn't touch its refcount.
+ *
+ * The caller must hold rcu_read_lock_bh().
+ */
+static int find_by_ipv6(struct tuple *tuple6, l4_protocol l4_proto, struct session_entry **result)
+{
+	struct session_table *table;
+	struct flow_slot *slot = NULL;
+	u32 hash;
+	int error;
+
+	error = get_session_table(get_shard(&tuple6->src.addr6), l4_proto, &table);
+	if (error)
+		return error;
+	hash = hash6_slot(&tuple6->dst.addr6, &tuple6->src.addr6);
+
+	if (flowcache_enabled) {
+		slot = flowcache_slot(true, hash);
+		*result = flowcache_find(slot, tuple6, hash);
+		if (*result)
+			goto found;
+	}
+
+	*result = hash_find6_rcu(table, tuple6, hash);
+	if (*result && slot)
+		flowcache_store(slot, *result, hash);
+
+found:
+	if (*result && session_is_dying(*result))
+		*result = NULL;
+
+	return (*result) ? 0 : -ENOENT;
+}
+
+int sessiondb_find(struct tuple *tuple, struct session_entry **result)
+{
+	if (WARN(!tuple, "There's no session entry mapped to NULL."))
+		return -EINVAL;
+
+	switch (tuple->l3_proto) {
+	case L3PROTO_IPV6:
+		return find_by_ipv6(tuple, tuple->l4_proto, result);
+	case L3PROTO_IPV4:
+		return find_by_ipv4(tuple, tuple->l4_proto, result);
+	}
+
+	WARN(true, "Unsupported network protocol: %u.", tuple->l3_proto);
+	return -EINVAL;
+}
+
+int sessiondb_get(struct tuple *tuple, struct session_entry **result)
+{
+	int error;
+
+	rcu_read_lock_bh();
+	error = sessiondb_find(tuple, result);
+	/* Refuse the sessions whose last reference is already gone; they're about to be freed. */
+	if (!error && !session_get_unless_zero(*result))
+		error = -ENOENT;
+	rcu_read_unlock_bh();
+
+	return error;
+}
+
+bool sessiondb_allow(struct bib_entry *bib, struct tuple *tuple4)
+{
+	struct ipv6_transport_addr bib6;
+	struct session_table *table;
+	struct session_entry *session;
+	int error;
+
+	/* Sanity */
+	if (WARN(!bib || !tuple4, "Cannot extract addresses from NULL."))
+		return false;
+
+	/* The session, if any, belongs to the BIB, so it lives in the BIB's shard. */
+	bib_ipv6(bib, &bib6);
+	error = get_session_table(get_shard(&bib6), tuple4->l4_proto, &table);
+	if (error)
+		return false;
+
+	/*
+	 * The hash indexes can't be used, since they include the remote port.
+	 * The tree can't be walked without the lock.
+	 */
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	session = rbtree_find(tuple4, &table->tree4, compare_addrs4, struct session_entry,
+			tree4_hook);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	return session != NULL;
+}
+
+static bool is_set(const struct ipv6_transport_addr *addr)
+{
+	return addr->l3.s6_addr32[0]
+			|| addr->l3.s6_addr32[1]
+			|| addr->l3.s6_addr32[2]
+			|| addr->l3.s6_addr32[3]
+			|| addr->l4;
+}
+
+/**
+ * Returns the timer of "shard"'s UDP sessions whose remote IPv4 port is "port".
+ *
+ * Doesn't care about spinlocks.
+ */
+static struct expire_timer *get_udp_expirer(struct sessiondb_shard *shard, __u16 port)
+{
+	struct sessiondb_config *current_config;
+	unsigned int i;
+
+	rcu_read_lock_bh();
+	current_config = rcu_dereference_bh(config);
+	for (i = 0; i < UDP_CLASSES; i++) {
+		if (current_config->udp_classes[i].port == port && port != 0) {
+			rcu_read_unlock_bh();
+			return &shard->expirer_udp_classes[i];
+		}
+	}
+	rcu_read_unlock_bh();
+
+	return &shard->expirer_udp;
+}
+
+/**
+ * Returns "shard"'s expirer whose kind is "timer_type". "port" is the sessions' remote IPv4 port;
+ * only UDP cares.
+ *
+ * Doesn't care about spinlocks.
+ */
+static struct expire_timer *get_expirer(struct sessiondb_shard *shard,
+		enum session_timer_type timer_type, __u16 port)
+{
+	switch (timer_type) {
+	case SESSIONTIMER_TRANS:
+		return &shard->expirer_tcp_trans;
+	case SESSIONTIMER_EST:
+		return &shard->expirer_tcp_est;
+	case SESSIONTIMER_SYN:
+		return &shard->expirer_syn;
+	case SESSIONTIMER_UDP:
+		return get_udp_expirer(shard, port);
+	case SESSIONTIMER_ICMP:
+		return &shard->expirer_icmp;
+	}
+
+	return NULL;
+}
+
+/**
+ * Removes the Simultaneous Open dummy of "session" from "table", if there's one.
+ * (See sessiondb_add().)
+ *
+ * Dummies don't know their remote IPv6 address, so they always land in the shard of the unset
+ * address, which is not necessarily "session"'s.
+ *
+ * "table"'s spinlock must not be held.
+ */
+static void remove_so_dummy(struct session_table *table, struct session_entry *session)
+{
+	struct session_entry *other;
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	other = rbtree_find(session, &table->tree4, compare_session4, struct session_entry,
+			tree4_hook);
+	if (other && !is_set(&other->remote6)) {
+		pktqueue_remove(other); /* Not sure what to make out it if this fails. */
+		table->count -= remove(other, table);
+	}
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+}
+
+/**
+ * Returns the number of sessions the database currently holds in its "l4_proto" tables.
+ * The tables are not locked, so treat the result as an estimate.
+ *
+ * Doesn't care about spinlocks.
+ */
+static u64 count_sessions(l4_protocol l4_proto)
+{
+	struct session_table *table;
+	unsigned int i;
+	u64 result = 0;
+
+	for (i = 0; i < shard_count; i++) {
+		if (get_session_table(&shards[i], l4_proto, &table))
+			return 0;
+		result += READ_ONCE(table->count);
+	}
+
+	return result;
+}
+
+/**
+ * Kills the first session whose state is "state" among the oldest few of "expirer".
+ *
+ * @return true if a session was killed.
+ *
+ * "expirer"'s table's spinlock must already be held.
+ */
+static bool early_drop_from(struct expire_timer *expirer, u_int8_t state)
+{
+	struct session_entry *session;
+	struct expiry_chunk *chunk;
+	struct expiry_slot *slot;
+	unsigned int scanned = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < EXPIRER_SLOTS; i++) {
+		slot = get_slot(expirer, expirer->cursor + i * expirer->granularity);
+		list_for_each_entry(chunk, &slot->chunks, list_hook) {
+			for (j = 0; j < chunk->len; j++) {
+				session = chunk->sessions[j];
+				if (!session)
+					continue;
+				if (session->state == state) {
+					if (state == V4_INIT)
+						pktqueue_remove(session);
+					session->state = CLOSED;
+					expirer->table->count -= remove(session, expirer->table);
+					atomic64_inc(&early_drops);
+					return true;
+				}
+
+				scanned++;
+				if (scanned >= EARLY_DROP_SCAN)
+					return false;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Kills one embryonic TCP session from "shard", to make room for one which is more likely to be
+ * legitimate. The victims are the oldest V4_INIT sessions (which are holding a packet hostage) and
+ * then the oldest V6_INIT ones.
+ *
+ * "shard"'s TCP table's spinlock must already be held.
+ */
+static void early_drop(struct sessiondb_shard *shard)
+{
+	if (!early_drop_from(&shard->expirer_syn, V4_INIT))
+		early_drop_from(&shard->expirer_tcp_trans, V6_INIT);
+}
+
+/**
+ * Returns the admission counter the sessions whose remote IPv6 addresses are "remote6" are
+ * charged to.
+ */
+static __u16 get_prefix_slot(const struct ipv6_transport_addr *remote6, unsigned int prefix_len)
+{
+	struct in6_addr prefix;
+
+	ipv6_addr_prefix(&prefix, &remote6->l3, prefix_len);
+	return jhash2(prefix.s6_addr32, 4, hash_rnd) & (PREFIX_COUNTER_SLOTS - 1);
+}
+
+/**
+ * Returns the prefix_histogram bucket of a counter whose value is "count".
+ */
+static unsigned int prefix_bucket(int count)
+{
+	return min_t(unsigned int, fls(count), OCCUPANCY_PREFIX_BUCKETS - 1);
+}
+
+/**
+ * Charges one session to the "slot" prefix counter, and returns the counter's new value.
+ *
+ * The histogram is updated along, so querying it doesn't need to look at the counters. The
+ * counter's value is only moved between buckets when it crosses a power of two, so this usually
+ * costs a single atomic operation.
+ */
+static int prefix_charge(__u16 slot)
+{
+	int count;
+
+	count = atomic_inc_return(&prefix_counters[slot]);
+	if (prefix_bucket(count) != prefix_bucket(count - 1)) {
+		if (count > 1)
+			atomic_dec(&prefix_histogram[prefix_bucket(count - 1)]);
+		atomic_inc(&prefix_histogram[prefix_bucket(count)]);
+	}
+
+	return count;
+}
+
+/**
+ * Reverts prefix_charge().
+ */
+static void prefix_refund(__u16 slot)
+{
+	int count;
+
+	count = atomic_dec_return(&prefix_counters[slot]);
+	if (prefix_bucket(count) != prefix_bucket(count + 1)) {
+		atomic_dec(&prefix_histogram[prefix_bucket(count + 1)]);
+		if (count > 0)
+			atomic_inc(&prefix_histogram[prefix_bucket(count)]);
+	}
+}
+
+static __u32 current_minute(void)
+{
+	return jiffies / (60 * HZ);
+}
+
+/**
+ * Counts "session" as born in the current minute.
+ *
+ * When a minute's slot is reused, whatever sessions were still counted there AGE_SLOTS minutes
+ * ago join "age_ancient". A session that dies while its slot is being reused might be refunded to
+ * the wrong counter, but the error goes away the next time the slot is reused, and the total
+ * stays exact.
+ */
+static void age_charge(struct session_entry *session)
+{
+	struct age_slot *slot;
+	__u32 epoch = current_minute();
+	__u32 old;
+
+	slot = &age_slots[session->l4_proto][epoch & (AGE_SLOTS - 1)];
+	old = atomic_read(&slot->epoch);
+	if (old != epoch && atomic_cmpxchg(&slot->epoch, old, epoch) == old)
+		atomic_add(atomic_xchg(&slot->count, 0), &age_ancient[session->l4_proto]);
+
+	atomic_inc(&slot->count);
+	session->birth = epoch;
+}
+
+/**
+ * Reverts age_charge().
+ */
+static void age_refund(struct session_entry *session)
+{
+	struct age_slot *slot;
+
+	slot = &age_slots[session->l4_proto][session->birth & (AGE_SLOTS - 1)];
+	if (atomic_read(&slot->epoch) == session->birth)
+		atomic_dec(&slot->count);
+	else
+		atomic_dec(&age_ancient[session->l4_proto]);
+}
+
+/**
+ * Decides whether there's room for one more session whose remote IPv6 address is "remote6" in
+ * "shard"'s "l4_proto" table.
+ *
+ * If there is, the session is charged to its prefix's counter, and the counter is returned in
+ * "slot". Assign it to the session's prefix_slot (through charge()) so session_release() can
+ * refund it; if the session doesn't get created after all, refund it yourself using unadmit().
+ *
+ * The counters are charged even if there's no per-prefix limit, because the occupancy stats need
+ * them.
+ *
+ * @return 0 if the session can be created, -ENOSPC otherwise.
+ *
+ * "shard"'s "l4_proto" table's spinlock must already be held.
+ */
+static int admit(struct sessiondb_shard *shard, l4_protocol l4_proto,
+		const struct ipv6_transport_addr *remote6, __u16 *slot)
+{
+	struct sessiondb_config *cfg;
+	__u64 max_sessions = 0;
+	__u64 max_per_prefix;
+	unsigned int prefix_len;
+
+	rcu_read_lock_bh();
+	cfg = rcu_dereference_bh(config);
+	switch (l4_proto) {
+	case L4PROTO_UDP:
+		max_sessions = cfg->max_sessions.udp;
+		break;
+	case L4PROTO_TCP:
+		max_sessions = cfg->max_sessions.tcp;
+		break;
+	case L4PROTO_ICMP:
+		max_sessions = cfg->max_sessions.icmp;
+		break;
+	}
+	max_per_prefix = cfg->max_sessions_per_prefix;
+	prefix_len = cfg->session_prefix_len;
+	rcu_read_unlock_bh();
+
+	*slot = PREFIX_SLOT_NONE;
+
+	if (max_sessions) {
+		if (l4_proto == L4PROTO_TCP
+				&& count_sessions(l4_proto) * 16 >= max_sessions * EARLY_DROP_THRESHOLD)
+			early_drop(shard);
+
+		if (count_sessions(l4_proto) >= max_sessions) {
+			log_debug("The session table is full.");
+			atomic64_inc(&rejected_table_full);
+			return -ENOSPC;
+		}
+	}
+
+	*slot = get_prefix_slot(remote6, prefix_len);
+	if (prefix_charge(*slot) > max_per_prefix && max_per_prefix) {
+		prefix_refund(*slot);
+		*slot = PREFIX_SLOT_NONE;
+		log_debug("%pI6c's prefix owns too many sessions.", &remote6->l3);
+		atomic64_inc(&rejected_prefix_full);
+		return -ENOSPC;
+	}
 
-fail:
-	kfree(tmp_config);
-	return -EINVAL;
+	return 0;
 }
 
-/**
- * Returns in "result" the session entry from the "l4_proto" table that corresponds to the "pair"
- * IPv4 addresses.
- */
-static int get_by_ipv4(struct tuple *tuple4, l4_protocol l4_proto, struct session_entry **result)
+int sessiondb_admit_rate(const struct ipv6_transport_addr *remote6)
 {
-	struct session_table *table;
-	int error;
+	struct sessiondb_config *cfg;
+	atomic64_t *slot;
+	__u64 rate;
+	unsigned int prefix_len;
+	u64 now, interval, due, next;
 
-	error = get_session_table(l4_proto, &table);
-	if (error)
-		return error;
+	rcu_read_lock_bh();
+	cfg = rcu_dereference_bh(config);
+	rate = cfg->session_rate_per_prefix;
+	prefix_len = cfg->session_prefix_len;
+	rcu_read_unlock_bh();
 
-	spin_lock_bh(&table->lock);
-	*result = rbtree_find(tuple4, &table->tree4, compare_full4, struct session_entry, tree4_hook);
-	if (*result)
-		session_get(*result);
-	spin_unlock_bh(&table->lock);
+	if (!rate)
+		return 0;
 
-	return (*result) ? 0 : -ENOENT;
+	interval = max_t(u64, div64_u64((u64) HZ << RATE_SHIFT, rate), 1);
+	now = get_jiffies_64() << RATE_SHIFT;
+	slot = &rate_slots[get_prefix_slot(remote6, prefix_len)];
+
+	do {
+		due = atomic64_read(slot);
+		next = ((s64) (due - now) < 0) ? now : due;
+		if (next - now >= ((u64) HZ << RATE_SHIFT)) {
+			log_debug("%pI6c's prefix is creating sessions too fast.", &remote6->l3);
+			atomic64_inc(&rejected_prefix_rate);
+			return -ENOSPC;
+		}
+	} while (atomic64_cmpxchg(slot, due, next + interval) != due);
+
+	return 0;
 }
 
 /**
- * Returns in "result" the session entry from the "l4_proto" table that corresponds to the "pair"
- * IPv6 addresses.
+ * Reverts admit(), for sessions which were admitted but ended up not being created.
  */
-static int get_by_ipv6(struct tuple *tuple6, l4_protocol l4_proto, struct session_entry **result)
+static void unadmit(__u16 slot)
 {
-	struct session_table *table;
-	int error;
-
-	error = get_session_table(l4_proto, &table);
-	if (error)
-		return error;
-
-	spin_lock_bh(&table->lock);
-	*result = rbtree_find(tuple6, &table->tree6, compare_full6, struct session_entry, tree6_hook);
-	if (*result)
-		session_get(*result);
-	spin_unlock_bh(&table->lock);
-
-	return (*result) ? 0 : -ENOENT;
+	if (slot != PREFIX_SLOT_NONE)
+		prefix_refund(slot);
 }
 
-int sessiondb_get(struct tuple *tuple, struct session_entry **result)
+/**
+ * Assigns the "slot" counter admit() returned to "session", which is about to join the database.
+ * From now on, session_release() refunds it.
+ */
+static void charge(struct session_entry *session, __u16 slot)
 {
-	if (WARN(!tuple, "There's no session entry mapped to NULL."))
-		return -EINVAL;
-
-	switch (tuple->l3_proto) {
-	case L3PROTO_IPV6:
-		return get_by_ipv6(tuple, tuple->l4_proto, result);
-	case L3PROTO_IPV4:
-		return get_by_ipv4(tuple, tuple->l4_proto, result);
-	}
-
-	WARN(true, "Unsupported network protocol: %u.", tuple->l3_proto);
-	return -EINVAL;
+	session->prefix_slot = slot;
+	if (slot != PREFIX_SLOT_NONE)
+		age_charge(session);
 }
 
-bool sessiondb_allow(struct tuple *tuple4)
+/**
+ * Returns the OCCUPANCY_AGE_BUCKETS bucket of the sessions which are "age" minutes old.
+ */
+static unsigned int age_bucket(__u32 age)
 {
-	struct session_table *table;
-	struct session_entry *session;
-	int error;
-	bool result;
+	static const __u32 limits[] = OCCUPANCY_AGE_LIMITS;
+	unsigned int i;
 
-	/* Sanity */
-	if (WARN(!tuple4, "Cannot extract addresses from NULL."))
-		return false;
-	error = get_session_table(tuple4->l4_proto, &table);
-	if (error)
-		return error;
-
-	/* Action */
-	spin_lock_bh(&table->lock);
-	session = rbtree_find(tuple4, &table->tree4, compare_addrs4, struct session_entry, tree4_hook);
-	result = session ? true : false;
-	spin_unlock_bh(&table->lock);
-
-	return result;
+	for (i = 0; i < ARRAY_SIZE(limits); i++)
+		if (age < limits[i])
+			return i;
+	return ARRAY_SIZE(limits);
 }
 
-static bool is_set(const struct ipv6_transport_addr *addr)
+void sessiondb_get_occupancy(struct occupancy_usr *result)
 {
-	return addr->l3.s6_addr32[0]
-			|| addr->l3.s6_addr32[1]
-			|| addr->l3.s6_addr32[2]
-			|| addr->l3.s6_addr32[3]
-			|| addr->l4;
+	struct age_slot *slot;
+	__u32 now = current_minute();
+	__u32 age;
+	unsigned int proto, i;
+	int count;
+
+	BUILD_BUG_ON(ARRAY_SIZE(((struct occupancy_usr *) 0)->ages[0]) != OCCUPANCY_AGE_BUCKETS);
+
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		result->sessions[proto] = count_sessions(proto);
+
+		memset(result->ages[proto], 0, sizeof(result->ages[proto]));
+		for (i = 0; i < AGE_SLOTS; i++) {
+			slot = &age_slots[proto][i];
+			count = atomic_read(&slot->count);
+			if (count <= 0)
+				continue; /* Empty, or transiently off. See age_charge(). */
+			age = now - (__u32) atomic_read(&slot->epoch);
+			result->ages[proto][age_bucket(age)] += count;
+		}
+		count = atomic_read(&age_ancient[proto]);
+		if (count > 0)
+			result->ages[proto][OCCUPANCY_AGE_BUCKETS - 1] += count;
+	}
+
+	rcu_read_lock_bh();
+	result->prefix_len = rcu_dereference_bh(config)->session_prefix_len;
+	rcu_read_unlock_bh();
+
+	for (i = 0; i < OCCUPANCY_PREFIX_BUCKETS; i++) {
+		count = atomic_read(&prefix_histogram[i]);
+		result->prefixes[i] = (count > 0) ? count : 0;
+	}
 }
 
 int sessiondb_add(struct session_entry *session, enum session_timer_type timer_type)
 {
+	struct sessiondb_shard *shard;
 	struct session_table *table;
 	struct rb_node *parent, **node;
-	struct expire_timer *expirer = NULL;
+	struct expire_timer *expirer;
+	__u16 slot;
 	int error;
 
 	/* Sanity */
 	if (WARN(!session, "Cannot insert NULL to a session table."))
 		return -EINVAL;
-	error = get_session_table(session->l4_proto, &table);
+	shard = get_shard(&session->remote6);
+	error = get_session_table(shard, session->l4_proto, &table);
 	if (error)
 		return error;
 
+	if (session->l4_proto == L4PROTO_TCP && is_set(&session->remote6)) {
+		struct ipv6_transport_addr unset;
+		memset(&unset, 0, sizeof(unset));
+		if (get_shard(&unset) != shard)
+			remove_so_dummy(&get_shard(&unset)->tcp, session);
+	}
+
 	/* Action */
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+
+	error = admit(shard, session->l4_proto, &session->remote6, &slot);
+	if (error) {
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		return error;
+	}
+
+	/* First, since it's the only part which might run out of memory. */
+	expirer = set_timer(session, get_expirer(shard, timer_type, session->remote4.l4));
+	if (!session->expirer) {
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		unadmit(slot);
+		return -ENOMEM;
+	}
 
 	error = rbtree_add(session, session, &table->tree6, compare_session6, struct session_entry,
 			tree6_hook);
 	if (error) {
-		spin_unlock_bh(&table->lock);
+		slot_del(session->slot_entry);
+		session->expirer = NULL;
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		unadmit(slot);
 		return -EEXIST;
 	}
 
@@ -949,126 +3817,397 @@ int sessiondb_add(struct session_entry *session, enum session_timer_type timer_t
 		rb_insert_color(&session->tree4_hook, &table->tree4);
 	}
 
-	switch (timer_type) {
-	case SESSIONTIMER_TRANS:
-		expirer = &expirer_tcp_trans;
-		break;
-	case SESSIONTIMER_EST:
-		expirer = &expirer_tcp_est;
-		break;
-	case SESSIONTIMER_SYN:
-		expirer = &expirer_syn;
-		break;
-	case SESSIONTIMER_UDP:
-		expirer = &expirer_udp;
-		break;
-	case SESSIONTIMER_ICMP:
-		expirer = &expirer_icmp;
-		break;
-	}
-	expirer = set_timer(session, expirer);
+	hash_add(session, table);
+	charge(session, slot);
 
-	session_get(session); /* We have 3 indexes, but really they count as one. */
+	session_get(session); /* We have 5 indexes, but really they count as one. */
 	table->count++;
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
 
 	commit_timer(expirer);
+	if (session->bib)
+		bib_add_remote4(session->bib, &session->remote4.l3);
+	trace_jool_session_add(session);
+	dbevents_session(DBEVENT_SESSION_ADD, session);
 
 	return 0;
 
 index_trainwreck:
 	rb_erase(&session->tree6_hook, &table->tree6);
-	spin_unlock_bh(&table->lock);
+	slot_del(session->slot_entry);
+	session->expirer = NULL;
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	unadmit(slot);
 	return -EEXIST;
 }
 
-int sessiondb_for_each(l4_protocol l4_proto, int (*func)(struct session_entry *, void *), void *arg)
+int sessiondb_sync_state(struct session_entry *session, u_int8_t state,
+		enum session_timer_type timer_type)
+{
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+	struct session_table *table;
+	struct expire_timer *expirer = NULL;
+	int error;
+
+	error = get_session_table(shard, session->l4_proto, &table);
+	if (error)
+		return error;
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	if (!session->expirer) {
+		/* It died while the caller wasn't looking. */
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		return -ENOENT;
+	}
+	session->state = state;
+	expirer = set_timer(session, get_expirer(shard, timer_type, session->remote4.l4));
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	commit_timer(expirer);
+	return 0;
+}
+
+int sessiondb_delete(struct session_entry *session)
 {
 	struct session_table *table;
-	struct rb_node *node;
 	int error;
 
-	error = get_session_table(l4_proto, &table);
+	error = get_session_table(get_shard(&session->remote6), session->l4_proto, &table);
 	if (error)
 		return error;
 
-	spin_lock_bh(&table->lock);
-	for (node = rb_first(&table->tree4); node && !error; node = rb_next(node)) {
-		error = func(rb_entry(node, struct session_entry, tree4_hook), arg);
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	if (!session->expirer) {
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		return -ENOENT;
+	}
+	if (session->l4_proto == L4PROTO_TCP && session->state == V4_INIT)
+		pktqueue_remove(session);
+	table->count -= remove(session, table);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	return 0;
+}
+
+int sessiondb_for_each(l4_protocol l4_proto, int (*func)(struct session_entry *, void *), void *arg)
+{
+	struct session_table *table;
+	struct rb_node *node;
+	unsigned int i;
+	int error = 0;
+
+	for (i = 0; i < shard_count && !error; i++) {
+		error = get_session_table(&shards[i], l4_proto, &table);
+		if (error)
+			return error;
+
+		jool_lock_bh(&table->lock, JLOCK_SESSION);
+		for (node = rb_first(&table->tree4); node && !error; node = rb_next(node)) {
+			error = func(rb_entry(node, struct session_entry, tree4_hook), arg);
+		}
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
 	}
 
-	spin_unlock_bh(&table->lock);
 	return error;
 }
 
 /**
- * See the function of the same name from the BIB DB module for comments on this.
+ * Returns the first node from "table"'s IPv4 index whose session comes after the "local4"-"remote4"
+ * pair (or is that pair, if "inclusive" is true). Returns NULL if there's none.
  *
  * Requires "table"'s spinlock to already be held.
  */
-static struct rb_node *find_next_chunk(struct session_table *table,
-		struct ipv4_transport_addr *addr, bool starting)
+static struct rb_node *tree4_lower_bound(struct session_table *table,
+		const struct ipv4_transport_addr *local4, const struct ipv4_transport_addr *remote4,
+		bool inclusive)
+{
+	struct rb_node *node = table->tree4.rb_node;
+	struct rb_node *result = NULL;
+	struct session_entry *session;
+	int gap;
+
+	while (node) {
+		session = rb_entry(node, struct session_entry, tree4_hook);
+		gap = compare_addr4(&session->local4, local4);
+		if (!gap)
+			gap = compare_addr4(&session->remote4, remote4);
+
+		if (gap > 0 || (inclusive && !gap)) {
+			result = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Returns the node iteration should start from, in "table".
+ *
+ * If "filter" wants a specific pool4 address (and port range), every other session is skipped
+ * without being visited; they're not contiguous to the ones that can match.
+ *
+ * Requires "table"'s spinlock to already be held.
+ */
+static struct rb_node *find_next_chunk(struct session_table *table, struct session_filter *filter,
+		struct ipv4_transport_addr *local4, struct ipv4_transport_addr *remote4, bool starting)
+{
+	struct ipv4_transport_addr first4, zero4;
+	struct rb_node *resume;
+
+	resume = starting ? rb_first(&table->tree4) : tree4_lower_bound(table, local4, remote4, false);
+	if (!resume || !filter || !(filter->flags & SFILTER_ADDR4))
+		return resume;
+
+	first4.l3 = filter->addr4;
+	first4.l4 = (filter->flags & SFILTER_PORTS) ? filter->port_min : 0;
+	memset(&zero4, 0, sizeof(zero4));
+	if (compare_addr4(&rb_entry(resume, struct session_entry, tree4_hook)->local4, &first4) >= 0)
+		return resume;
+
+	return tree4_lower_bound(table, &first4, &zero4, true);
+}
+
+/**
+ * Returns whether the sessions that come after "session" in the IPv4 index can still match
+ * "filter".
+ */
+static bool filter_bound_passed(struct session_entry *session, struct session_filter *filter)
+{
+	int gap;
+
+	if (!filter || !(filter->flags & SFILTER_ADDR4))
+		return false;
+
+	gap = ipv4_addr_cmp(&session->local4.l3, &filter->addr4);
+	if (gap)
+		return gap > 0;
+	return (filter->flags & SFILTER_PORTS) && session->local4.l4 > filter->port_max;
+}
+
+/**
+ * Returns whether "session" matches every flagged field from "filter".
+ */
+static bool filter_matches(struct session_entry *session, struct session_filter *filter)
+{
+	if (!filter)
+		return true;
+
+	if ((filter->flags & SFILTER_PREFIX6) && !ipv6_prefix_equal(&filter->prefix6.address,
+			&session->remote6.l3, filter->prefix6.len))
+		return false;
+	if ((filter->flags & SFILTER_ADDR4) && filter->addr4.s_addr != session->local4.l3.s_addr)
+		return false;
+	if ((filter->flags & SFILTER_PORTS) && (session->local4.l4 < filter->port_min
+			|| session->local4.l4 > filter->port_max))
+		return false;
+	if ((filter->flags & SFILTER_STATE) && session->state != filter->state)
+		return false;
+	if ((filter->flags & SFILTER_IDLE) && time_before(jiffies,
+			session->update_time + msecs_to_jiffies(filter->min_idle)))
+		return false;
+
+	return true;
+}
+
+/**
+ * Returns the node that follows "node" (in the IPv4 index) and matches "filter", or NULL.
+ */
+static struct rb_node *next_match(struct rb_node *node, struct session_filter *filter)
+{
+	struct session_entry *session;
+
+	for (; node; node = rb_next(node)) {
+		session = rb_entry(node, struct session_entry, tree4_hook);
+		if (filter_bound_passed(session, filter))
+			return NULL;
+		if (filter_matches(session, filter))
+			return node;
+	}
+
+	return NULL;
+}
+
+/**
+ * Where sessiondb_iterate_by_ipv4() is standing in one of the shards: the IPv4 identifiers of the
+ * next session it has to visit there.
+ *
+ * These are keys rather than nodes because the shard is unlocked between visits; whatever the node
+ * was might be gone by the time the iteration comes back.
+ */
+struct shard_cursor {
+	struct ipv4_transport_addr local4;
+	struct ipv4_transport_addr remote4;
+	/** false if the shard has nothing left to visit. */
+	bool pending;
+};
+
+static void cursor_set(struct shard_cursor *cursor, struct rb_node *node)
 {
-	struct rb_node **node, *parent;
 	struct session_entry *session;
 
-	if (starting)
-		return rb_first(&table->tree4);
+	cursor->pending = (node != NULL);
+	if (node) {
+		session = rb_entry(node, struct session_entry, tree4_hook);
+		cursor->local4 = session->local4;
+		cursor->remote4 = session->remote4;
+	}
+}
+
+/**
+ * Same as compare_session4(), except the second session is only known by its cursor.
+ */
+static int compare_cursor(const struct session_entry *session, const struct shard_cursor *cursor)
+{
+	int gap;
+
+	gap = compare_addr4(&session->local4, &cursor->local4);
+	if (gap)
+		return gap;
+
+	return compare_addr4(&session->remote4, &cursor->remote4);
+}
+
+static int compare_cursors(const struct shard_cursor *c1, const struct shard_cursor *c2)
+{
+	int gap;
 
-	rbtree_find_node(addr, &table->tree4, compare_local4, struct session_entry, tree4_hook, parent,
-			node);
-	if (*node)
-		return rb_next(*node);
+	gap = compare_addr4(&c1->local4, &c2->local4);
+	if (gap)
+		return gap;
 
-	session = rb_entry(parent, struct session_entry, tree4_hook);
-	return (compare_local4(session, addr) < 0) ? parent : rb_next(parent);
+	return compare_addr4(&c1->remote4, &c2->remote4);
 }
 
-int sessiondb_iterate_by_ipv4(l4_protocol l4_proto, struct ipv4_transport_addr *addr, bool starting,
+int sessiondb_iterate_by_ipv4(l4_protocol l4_proto, struct session_filter *filter,
+		struct ipv4_transport_addr *local4, struct ipv4_transport_addr *remote4, bool starting,
 		int (*func)(struct session_entry *, void *), void *arg)
 {
+	struct shard_cursor *cursors, *min, *next;
+	struct session_table *tables[SESSIONDB_MAX_SHARDS];
 	struct session_table *table;
+	struct session_entry *session;
 	struct rb_node *node;
-	int error;
+	unsigned int i, visited;
+	int error = 0;
 
-	if (WARN(!addr, "The IPv4 address is NULL."))
+	if (WARN(!local4 || !remote4, "The IPv4 addresses are NULL."))
 		return -EINVAL;
-	error = get_session_table(l4_proto, &table);
-	if (error)
-		return error;
+	if (filter && !filter->flags)
+		filter = NULL;
+
+	cursors = kcalloc(shard_count, sizeof(*cursors), GFP_KERNEL);
+	if (!cursors)
+		return -ENOMEM;
+
+	for (i = 0; i < shard_count; i++) {
+		error = get_session_table(&shards[i], l4_proto, &tables[i]);
+		if (error)
+			goto end;
+
+		table = tables[i];
+		jool_lock_bh(&table->lock, JLOCK_SESSION);
+		node = find_next_chunk(table, filter, local4, remote4, starting);
+		cursor_set(&cursors[i], next_match(node, filter));
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	}
+
+	/*
+	 * Userspace resumes iteration from the last entry it received, so the shards have to be
+	 * merged in order or we'd skip sessions. Only one shard is locked at a time, and only for a
+	 * few sessions; the shard with the smallest cursor is visited until it reaches the second
+	 * smallest one ("next").
+	 */
+	while (!error) {
+		min = NULL;
+		next = NULL;
+		table = NULL;
+		for (i = 0; i < shard_count; i++) {
+			if (!cursors[i].pending)
+				continue;
+			if (!min || compare_cursors(&cursors[i], min) < 0) {
+				next = min;
+				min = &cursors[i];
+				table = tables[i];
+			} else if (!next || compare_cursors(&cursors[i], next) < 0) {
+				next = &cursors[i];
+			}
+		}
+
+		if (!min)
+			break;
 
-	spin_lock_bh(&table->lock);
-	for (node = find_next_chunk(table, addr, starting); node && !error; node = rb_next(node)) {
-		error = func(rb_entry(node, struct session_entry, tree4_hook), arg);
+		jool_lock_bh(&table->lock, JLOCK_SESSION);
+		/* The session might have died while the shard was unlocked; move on if it did. */
+		node = tree4_lower_bound(table, &min->local4, &min->remote4, true);
+		node = next_match(node, filter);
+		for (visited = 0; node && visited < ITERATE_BATCH; visited++) {
+			session = rb_entry(node, struct session_entry, tree4_hook);
+			if (next && compare_cursor(session, next) > 0)
+				break;
+			error = func(session, arg);
+			if (error)
+				break;
+			node = next_match(rb_next(node), filter);
+		}
+		cursor_set(min, node);
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
 	}
+	/* Fall through. */
 
-	spin_unlock_bh(&table->lock);
+end:
+	kfree(cursors);
 	return error;
 }
 
 int sessiondb_count(l4_protocol proto, __u64 *result)
 {
 	struct session_table *table;
+	unsigned int i;
 	int error;
 
-	error = get_session_table(proto, &table);
-	if (error)
-		return error;
+	*result = 0;
+	for (i = 0; i < shard_count; i++) {
+		error = get_session_table(&shards[i], proto, &table);
+		if (error)
+			return error;
+
+		jool_lock_bh(&table->lock, JLOCK_SESSION);
+		*result += table->count;
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	}
 
-	spin_lock_bh(&table->lock);
-	*result = table->count;
-	spin_unlock_bh(&table->lock);
 	return 0;
 }
 
+/**
+ * If "session" is waiting for a purge, removes it right away so its successor can take its place,
+ * and returns NULL. Otherwise returns "session".
+ *
+ * "table"'s spinlock must already be held.
+ */
+static struct session_entry *reap_if_dying(struct session_table *table,
+		struct session_entry *session)
+{
+	if (session && session_is_dying(session)) {
+		table->count -= remove(session, table);
+		return NULL;
+	}
+	return session;
+}
+
 int sessiondb_get_or_create_ipv6(struct tuple *tuple6, struct bib_entry *bib,
 		struct session_entry **session)
 {
 	struct ipv6_prefix prefix;
 	struct ipv4_transport_addr local4;
 	struct rb_node **node, *parent;
+	struct sessiondb_shard *shard;
 	struct session_table *table;
 	struct expire_timer *expirer = NULL;
+	__u16 slot;
 	int error;
 
 	if (WARN(!tuple6, "There's no session entry mapped to NULL."))
@@ -1077,12 +4216,24 @@ int sessiondb_get_or_create_ipv6(struct tuple *tuple6, struct bib_entry *bib,
 			"I'm a ICMP & UDP function, but I'm handling protocol %u.", tuple6->l4_proto))
 		return -EINVAL;
 
-	error = get_session_table(tuple6->l4_proto, &table);
+	shard = get_shard(&tuple6->src.addr6);
+	error = get_session_table(shard, tuple6->l4_proto, &table);
 	if (error)
 		return error;
+	expirer = get_expirer(shard, (tuple6->l4_proto == L4PROTO_UDP)
+			? SESSIONTIMER_UDP
+			: SESSIONTIMER_ICMP, tuple6->dst.addr6.l4);
+
+	*session = get_lazily(table, tuple6, expirer);
+	if (*session)
+		return 0;
 
 	/* Find it */
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	*session = reap_if_dying(table, hash_find6(table, tuple6));
+	if (*session)
+		goto success;
+
 	rbtree_find_node(tuple6, &table->tree6, compare_full6, struct session_entry, tree6_hook,
 			parent, node);
 	if (*node) {
@@ -1110,14 +4261,20 @@ int sessiondb_get_or_create_ipv6(struct tuple *tuple6, struct bib_entry *bib,
 	 * Fortunately, ICMP errors cannot reach this code because of the requirements in the header
 	 * of section 3.5, so we can use the tuple as shortcuts for the packet's fields.
 	 */
+	error = admit(shard, tuple6->l4_proto, &tuple6->src.addr6, &slot);
+	if (error)
+		goto fail;
+
 	local4.l4 = (tuple6->l4_proto != L4PROTO_ICMP) ? tuple6->dst.addr6.l4 : bib->ipv4.l4;
 	*session = session_create(&tuple6->src.addr6, &tuple6->dst.addr6, &bib->ipv4, &local4,
 			tuple6->l4_proto, bib); /* refcounter = 1*/
 	if (!(*session)) {
 		log_debug("Failed to allocate a session entry.");
+		unadmit(slot);
 		error = -ENOMEM;
 		goto fail;
 	}
+	charge(*session, slot);
 
 	/* Add it to the database. */
 	rb_link_node(&(*session)->tree6_hook, parent, node);
@@ -1130,34 +4287,23 @@ int sessiondb_get_or_create_ipv6(struct tuple *tuple6, struct bib_entry *bib,
 		session_return(*session);
 		goto fail;
 	}
+	hash_add(*session, table);
 
 	table->count++;
 	/* Fall through. */
 
 success:
-	switch (tuple6->l4_proto) {
-	case L4PROTO_UDP:
-		expirer = &expirer_udp;
-		break;
-	case L4PROTO_ICMP:
-		expirer = &expirer_icmp;
-		break;
-	case L4PROTO_TCP:
-		/* handled in a WARN above, not gonna happen. I'm just hushing the compiler. */
-		break;
-	}
-
 	expirer = set_timer(*session, expirer);
 	/* We gotta do this for our caller, because it has to be done before the unlock. */
 	session_get(*session);
 
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
 
 	commit_timer(expirer);
 	return 0;
 
 fail:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
 	return error;
 }
 
@@ -1165,11 +4311,13 @@ fail:
 int sessiondb_get_or_create_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 		struct session_entry **session)
 {
-	struct ipv6_prefix prefix;
+	struct ipv6_transport_addr bib6;
 	struct ipv6_transport_addr remote6;
 	struct rb_node **node, *parent;
+	struct sessiondb_shard *shard;
 	struct session_table *table;
 	struct expire_timer *expirer = NULL;
+	__u16 slot;
 	int error;
 
 	if (WARN(!tuple4, "There's no session entry mapped to NULL."))
@@ -1178,12 +4326,26 @@ int sessiondb_get_or_create_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 			"I'm a ICMP & UDP function, but I'm handling protocol %u.", tuple4->l4_proto))
 		return -EINVAL;
 
-	error = get_session_table(tuple4->l4_proto, &table);
+	/* The session's remote IPv6 address is going to be the BIB's. */
+	bib_ipv6(bib, &bib6);
+	shard = get_shard(&bib6);
+	error = get_session_table(shard, tuple4->l4_proto, &table);
 	if (error)
 		return error;
+	expirer = get_expirer(shard, (tuple4->l4_proto == L4PROTO_UDP)
+			? SESSIONTIMER_UDP
+			: SESSIONTIMER_ICMP, tuple4->src.addr4.l4);
+
+	*session = get_lazily(table, tuple4, expirer);
+	if (*session)
+		return 0;
 
 	/* Find it */
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	*session = reap_if_dying(table, hash_find4(table, tuple4));
+	if (*session)
+		goto success;
+
 	rbtree_find_node(tuple4, &table->tree4, compare_full4, struct session_entry, tree4_hook,
 			parent, node);
 	if (*node) {
@@ -1193,11 +4355,7 @@ int sessiondb_get_or_create_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 	/* The entry doesn't exist, so try to create it. */
 
 	/* Translate address from IPv4 to IPv6 */
-	error = pool6_peek(&prefix);
-	if (error)
-		goto fail;
-
-	error = addr_4to6(&tuple4->src.addr4.l3, &prefix, &remote6.l3);
+	error = pool6_4to6(&tuple4->src.addr4.l3, &remote6.l3);
 	if (error) {
 		log_debug("Error code %d while translating the packet's address.", error);
 		goto fail;
@@ -1209,14 +4367,20 @@ int sessiondb_get_or_create_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 	 * Fortunately, ICMP errors cannot reach this code because of the requirements in the header
 	 * of section 3.5, so we can use the tuple as shortcuts for the packet's fields.
 	 */
-	remote6.l4 = (tuple4->l4_proto != L4PROTO_ICMP) ? tuple4->src.addr4.l4 : bib->ipv6.l4;
-	*session = session_create(&bib->ipv6, &remote6, &tuple4->dst.addr4, &tuple4->src.addr4,
+	error = admit(shard, tuple4->l4_proto, &bib6, &slot);
+	if (error)
+		goto fail;
+
+	remote6.l4 = (tuple4->l4_proto != L4PROTO_ICMP) ? tuple4->src.addr4.l4 : bib6.l4;
+	*session = session_create(&bib6, &remote6, &tuple4->dst.addr4, &tuple4->src.addr4,
 			tuple4->l4_proto, bib); /* refcounter = 1 */
 	if (!(*session)) {
 		log_debug("Failed to allocate a session entry.");
+		unadmit(slot);
 		error = -ENOMEM;
 		goto fail;
 	}
+	charge(*session, slot);
 
 	/* Add it to the database. */
 	rb_link_node(&(*session)->tree4_hook, parent, node);
@@ -1229,39 +4393,71 @@ int sessiondb_get_or_create_ipv4(struct tuple *tuple4, struct bib_entry *bib,
 		session_return(*session);
 		goto fail;
 	}
+	hash_add(*session, table);
 
 	table->count++;
 	/* Fall through. */
 
 success:
-	switch (tuple4->l4_proto) {
-	case L4PROTO_UDP:
-		expirer = &expirer_udp;
-		break;
-	case L4PROTO_ICMP:
-		expirer = &expirer_icmp;
-		break;
-	case L4PROTO_TCP:
-		/* handled in a WARN above, not gonna happen. I'm just hushing the compiler. */
-		break;
-	}
-
 	expirer = set_timer(*session, expirer);
 	/* We gotta do this for our caller, because it has to be done before the unlock. */
 	session_get(*session);
 
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
 
 	commit_timer(expirer);
 	return 0;
 
 fail:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
 	return error;
 }
 
+int sessiondb_get_established(struct tuple *tuple, struct session_entry **result)
+{
+	struct sessiondb_shard *shard;
+	struct session_table *table;
+	struct expire_timer *expirer;
+	unsigned long granularity;
+	int error;
+
+	error = sessiondb_find(tuple, result);
+	if (error || tuple->l4_proto == L4PROTO_TCP)
+		return error;
+
+	shard = get_shard(&(*result)->remote6);
+	error = get_session_table(shard, tuple->l4_proto, &table);
+	if (error)
+		return error;
+	expirer = get_expirer(shard, (tuple->l4_proto == L4PROTO_UDP)
+			? SESSIONTIMER_UDP
+			: SESSIONTIMER_ICMP, (*result)->remote4.l4);
+
+	granularity = get_refresh_granularity();
+	if (granularity && refresh_lazily(*result, expirer, granularity))
+		return 0;
+
+	/* The session might have died since the lookup, so look again, now with the lock. */
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	*result = reap_if_dying(table, (tuple->l3_proto == L3PROTO_IPV6)
+			? hash_find6(table, tuple)
+			: hash_find4(table, tuple));
+	if (!(*result)) {
+		jool_unlock_bh(&table->lock, JLOCK_SESSION);
+		return -ENOENT;
+	}
+
+	expirer = set_timer(*result, expirer);
+
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	commit_timer(expirer);
+	return 0;
+}
+
 int sessiondb_delete_by_bib(struct bib_entry *bib)
 {
+	struct ipv6_transport_addr bib6;
 	struct session_table *table;
 	struct session_entry *root_session, *session;
 	struct rb_node *node;
@@ -1269,11 +4465,13 @@ int sessiondb_delete_by_bib(struct bib_entry *bib)
 	int s = 0;
 
 	/* Sanitize */
-	error = get_session_table(bib->l4_proto, &table);
+	/* All of the BIB's sessions share its IPv6 address, so they all live in the same shard. */
+	bib_ipv6(bib, &bib6);
+	error = get_session_table(get_shard(&bib6), bib->l4_proto, &table);
 	if (error)
 		return error;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
 
 	/* Find the top-most node in the tree whose IPv4 address is addr. */
 	root_session = rbtree_find(&bib->ipv4, &table->tree4, compare_local4, struct session_entry,
@@ -1308,79 +4506,43 @@ int sessiondb_delete_by_bib(struct bib_entry *bib)
 	/* Fall through. */
 
 success:
-	spin_unlock_bh(&table->lock);
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
 	log_debug("Deleted %d sessions.", s);
 	return 0;
 }
 
 /**
- * Deletes the sessions from the "table" table whose local IPv4 address is "addr".
- * This function is awfully similar to sessiondb_delete_by_bib(). See that for more comments.
+ * Returns the expirer of "shard" the TCP sessions the endpoints just closed (through a RST, or a
+ * FIN in each direction) should go to.
+ *
+ * RFC 6146 keeps these around for the transitory lifetime, in case the RST was bogus or the last
+ * ACK gets lost. If the user would rather have the memory and the pool4 ports back sooner, they
+ * get their own (shorter) lifetime instead.
+ *
+ * Doesn't care about spinlocks.
  */
-static int delete_sessions_by_ipv4(struct session_table *table, struct in_addr *addr)
-{
-	struct session_entry *root_session, *session;
-	struct rb_node *node;
-	int s = 0;
-
-	spin_lock_bh(&table->lock);
-
-	root_session = rbtree_find(addr, &table->tree4, compare_local_addr4, struct session_entry,
-			tree4_hook);
-	if (!root_session)
-		goto success;
-
-	node = rb_prev(&root_session->tree4_hook);
-	while (node) {
-		session = rb_entry(node, struct session_entry, tree4_hook);
-		if (compare_local_addr4(session, addr) != 0)
-			break;
-		s += remove(session, table);
-
-		node = rb_prev(&root_session->tree4_hook);
-	}
-
-	node = rb_next(&root_session->tree4_hook);
-	while (node) {
-		session = rb_entry(node, struct session_entry, tree4_hook);
-		if (compare_local_addr4(session, addr) != 0)
-			break;
-		s += remove(session, table);
-
-		node = rb_next(&root_session->tree4_hook);
-	}
-
-	s += remove(root_session, table);
-	table->count -= s;
-	/* Fall through. */
-
-success:
-	spin_unlock_bh(&table->lock);
-	log_debug("Deleted %d sessions.", s);
-	return 0;
-}
-
-int sessiondb_delete_by_ipv4(struct in_addr *addr4)
+static struct expire_timer *get_closed_expirer(struct sessiondb_shard *shard)
 {
-	if (WARN(!addr4, "The IPv4 address is NULL"))
-		return -EINVAL;
+	bool aggressive;
 
-	delete_sessions_by_ipv4(&session_table_tcp, addr4);
-	delete_sessions_by_ipv4(&session_table_icmp, addr4);
-	delete_sessions_by_ipv4(&session_table_udp, addr4);
+	rcu_read_lock_bh();
+	aggressive = rcu_dereference_bh(config)->ttl.tcp_closed != 0;
+	rcu_read_unlock_bh();
 
-	return 0;
+	return aggressive ? &shard->expirer_tcp_closed : &shard->expirer_tcp_trans;
 }
 
 /**
  * Filtering and updating done during the V4 INIT state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_v4_init_state_handle(struct sk_buff *skb, struct session_entry *session,
-		struct expire_timer **expirer)
+static int tcp_v4_init_state_handle(struct sk_buff *skb, l3_protocol l3_proto,
+		struct session_entry *session, struct expire_timer **expirer)
 {
-	if (skb_l3_proto(skb) == L3PROTO_IPV6 && tcp_hdr(skb)->syn) {
-		*expirer = set_timer(session, &expirer_tcp_est);
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+
+	if (l3_proto == L3PROTO_IPV6 && tcp_hdr(skb)->syn) {
+		*expirer = set_timer(session, &shard->expirer_tcp_est);
 		session->state = ESTABLISHED;
 	} /* else, the state remains unchanged. */
 
@@ -1391,17 +4553,19 @@ static int tcp_v4_init_state_handle(struct sk_buff *skb, struct session_entry *s
  * Filtering and updating done during the V6 INIT state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_v6_init_state_handle(struct sk_buff *skb, struct session_entry *session,
-		struct expire_timer **expirer)
+static int tcp_v6_init_state_handle(struct sk_buff *skb, l3_protocol l3_proto,
+		struct session_entry *session, struct expire_timer **expirer)
 {
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+
 	if (tcp_hdr(skb)->syn) {
-		switch (skb_l3_proto(skb)) {
+		switch (l3_proto) {
 		case L3PROTO_IPV4:
-			*expirer = set_timer(session, &expirer_tcp_est);
+			*expirer = set_timer(session, &shard->expirer_tcp_est);
 			session->state = ESTABLISHED;
 			break;
 		case L3PROTO_IPV6:
-			*expirer = set_timer(session, &expirer_tcp_trans);
+			*expirer = set_timer(session, &shard->expirer_tcp_trans);
 			break;
 		}
 	} /* else, the state remains unchanged */
@@ -1413,11 +4577,13 @@ static int tcp_v6_init_state_handle(struct sk_buff *skb, struct session_entry *s
  * Filtering and updating done during the ESTABLISHED state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_established_state_handle(struct sk_buff *skb, struct session_entry *session,
-		struct expire_timer **expirer)
+static int tcp_established_state_handle(struct sk_buff *skb, l3_protocol l3_proto,
+		struct session_entry *session, struct expire_timer **expirer)
 {
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+
 	if (tcp_hdr(skb)->fin) {
-		switch (skb_l3_proto(skb)) {
+		switch (l3_proto) {
 		case L3PROTO_IPV4:
 			session->state = V4_FIN_RCV;
 			break;
@@ -1427,10 +4593,10 @@ static int tcp_established_state_handle(struct sk_buff *skb, struct session_entr
 		}
 
 	} else if (tcp_hdr(skb)->rst) {
-		*expirer = set_timer(session, &expirer_tcp_trans);
+		*expirer = set_timer(session, get_closed_expirer(shard));
 		session->state = TRANS;
 	} else {
-		*expirer = set_timer(session, &expirer_tcp_est);
+		*expirer = set_timer(session, &shard->expirer_tcp_est);
 	}
 
 	return 0;
@@ -1440,14 +4606,16 @@ static int tcp_established_state_handle(struct sk_buff *skb, struct session_entr
  * Filtering and updating done during the V4 FIN RCV state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_v4_fin_rcv_state_handle(struct sk_buff *skb, struct session_entry *session,
-		struct expire_timer **expirer)
+static int tcp_v4_fin_rcv_state_handle(struct sk_buff *skb, l3_protocol l3_proto,
+		struct session_entry *session, struct expire_timer **expirer)
 {
-	if (skb_l3_proto(skb) == L3PROTO_IPV6 && tcp_hdr(skb)->fin) {
-		*expirer = set_timer(session, &expirer_tcp_trans);
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+
+	if (l3_proto == L3PROTO_IPV6 && tcp_hdr(skb)->fin) {
+		*expirer = set_timer(session, get_closed_expirer(shard));
 		session->state = V4_FIN_V6_FIN_RCV;
 	} else {
-		*expirer = set_timer(session, &expirer_tcp_est);
+		*expirer = set_timer(session, &shard->expirer_tcp_est);
 	}
 	return 0;
 }
@@ -1456,14 +4624,16 @@ static int tcp_v4_fin_rcv_state_handle(struct sk_buff *skb, struct session_entry
  * Filtering and updating done during the V6 FIN RCV state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_v6_fin_rcv_state_handle(struct sk_buff *skb, struct session_entry *session,
-		struct expire_timer **expirer)
+static int tcp_v6_fin_rcv_state_handle(struct sk_buff *skb, l3_protocol l3_proto,
+		struct session_entry *session, struct expire_timer **expirer)
 {
-	if (skb_l3_proto(skb) == L3PROTO_IPV4 && tcp_hdr(skb)->fin) {
-		*expirer = set_timer(session, &expirer_tcp_trans);
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+
+	if (l3_proto == L3PROTO_IPV4 && tcp_hdr(skb)->fin) {
+		*expirer = set_timer(session, get_closed_expirer(shard));
 		session->state = V4_FIN_V6_FIN_RCV;
 	} else {
-		*expirer = set_timer(session, &expirer_tcp_est);
+		*expirer = set_timer(session, &shard->expirer_tcp_est);
 	}
 	return 0;
 }
@@ -1485,36 +4655,112 @@ static int tcp_v4_fin_v6_fin_rcv_state_handle(struct sk_buff *skb,
 static int tcp_trans_state_handle(struct sk_buff *skb, struct session_entry *session,
 		struct expire_timer **expirer)
 {
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+
 	if (!tcp_hdr(skb)->rst) {
-		*expirer = set_timer(session, &expirer_tcp_est);
+		*expirer = set_timer(session, &shard->expirer_tcp_est);
 		session->state = ESTABLISHED;
 	}
 
 	return 0;
 }
 
-int sessiondb_tcp_state_machine(struct sk_buff *skb, struct session_entry *session)
+/**
+ * Returns true if "skb" (which arrived through "l3_proto"'s side) would leave a session in state
+ * "state" as it is. If so, "refresh" tells whether it should also refresh the session's lifetime
+ * (always in the established timer, since that's the only one such packets refresh).
+ *
+ * Mirrors the tcp_*_state_handle() functions; keep them in sync.
+ */
+static bool tcp_state_stays(struct sk_buff *skb, l3_protocol l3_proto, u_int8_t state,
+		bool *refresh)
+{
+	struct tcphdr *hdr = tcp_hdr(skb);
+
+	*refresh = false;
+
+	switch (state) {
+	case V4_INIT:
+		return !(l3_proto == L3PROTO_IPV6 && hdr->syn);
+	case V6_INIT:
+		return !hdr->syn;
+	case ESTABLISHED:
+		*refresh = true;
+		return !hdr->fin && !hdr->rst;
+	case V4_FIN_RCV:
+		*refresh = true;
+		return !(l3_proto == L3PROTO_IPV6 && hdr->fin);
+	case V6_FIN_RCV:
+		*refresh = true;
+		return !(l3_proto == L3PROTO_IPV4 && hdr->fin);
+	case V4_FIN_V6_FIN_RCV:
+		return true;
+	case TRANS:
+		return hdr->rst;
+	}
+
+	return false; /* Let the locked path complain. */
+}
+
+/**
+ * sessiondb_tcp_state_machine(), except "skb" is treated as if it had arrived through "l3_proto"'s
+ * side.
+ */
+static int tcp_state_machine(struct sk_buff *skb, l3_protocol l3_proto,
+		struct session_entry *session)
 {
+	struct sessiondb_shard *shard = get_shard(&session->remote6);
+	struct session_table *table = &shard->tcp;
 	struct expire_timer *expirer = NULL;
+	unsigned long granularity;
+	u_int8_t old_state;
+	bool refresh;
 	int error;
 
-	spin_lock(&session_table_tcp.lock);
+	/*
+	 * Most packets do not change the state; they either do nothing or only refresh the session.
+	 * Those don't need the lock. The state is only written with the lock held, so if it changes
+	 * while we look, the packet merely gets handled as if it had arrived a little earlier.
+	 */
+	old_state = READ_ONCE(session->state);
+	if (tcp_state_stays(skb, l3_proto, old_state, &refresh)) {
+		if (!refresh)
+			return 0;
+		/*
+		 * If the packet races against the sweep, the refresh might be lost. Established
+		 * sessions survive that (they just get probed), so they don't wait for the user to
+		 * accept the risk through the refresh granularity.
+		 */
+		granularity = get_refresh_granularity();
+		if ((granularity || old_state == ESTABLISHED)
+				&& refresh_lazily(session, &shard->expirer_tcp_est, granularity))
+			return 0;
+	}
+
+	jool_lock(&table->lock, JLOCK_SESSION);
+
+	if (!session->expirer) {
+		/* It died while the caller wasn't looking. */
+		jool_unlock(&table->lock, JLOCK_SESSION);
+		return -ENOENT;
+	}
 
+	old_state = session->state;
 	switch (session->state) {
 	case V4_INIT:
-		error = tcp_v4_init_state_handle(skb, session, &expirer);
+		error = tcp_v4_init_state_handle(skb, l3_proto, session, &expirer);
 		break;
 	case V6_INIT:
-		error = tcp_v6_init_state_handle(skb, session, &expirer);
+		error = tcp_v6_init_state_handle(skb, l3_proto, session, &expirer);
 		break;
 	case ESTABLISHED:
-		error = tcp_established_state_handle(skb, session, &expirer);
+		error = tcp_established_state_handle(skb, l3_proto, session, &expirer);
 		break;
 	case V4_FIN_RCV:
-		error = tcp_v4_fin_rcv_state_handle(skb, session, &expirer);
+		error = tcp_v4_fin_rcv_state_handle(skb, l3_proto, session, &expirer);
 		break;
 	case V6_FIN_RCV:
-		error = tcp_v6_fin_rcv_state_handle(skb, session, &expirer);
+		error = tcp_v6_fin_rcv_state_handle(skb, l3_proto, session, &expirer);
 		break;
 	case V4_FIN_V6_FIN_RCV:
 		error = tcp_v4_fin_v6_fin_rcv_state_handle(skb, session);
@@ -1531,77 +4777,171 @@ int sessiondb_tcp_state_machine(struct sk_buff *skb, struct session_entry *sessi
 		error = -EINVAL;
 	}
 
-	spin_unlock(&session_table_tcp.lock);
+	if (session->state != old_state && session->expirer)
+		dbevents_session(DBEVENT_SESSION_UPDATE, session);
+	jool_unlock(&table->lock, JLOCK_SESSION);
 
 	commit_timer(expirer);
 
 	return error;
 }
 
+int sessiondb_tcp_state_machine(struct sk_buff *skb, struct session_entry *session)
+{
+	return tcp_state_machine(skb, skb_l3_proto(skb), session);
+}
+
+int sessiondb_tcp_state_machine_hairpin(struct sk_buff *skb, struct session_entry *session)
+{
+	return tcp_state_machine(skb, L3PROTO_IPV4, session);
+}
+
 /**
- * Returns 1 if "session"->ipv6.local.address contains "prefix".
- * otherwise returns zero.
+ * Returns zero if "prefix" contains "session"'s local IPv6 address. Otherwise, returns > 0 if the
+ * address comes after the prefix, and < 0 if it comes before it.
+ *
+ * The IPv6 index is sorted by local address first, so the sessions of each pool6 prefix are
+ * contiguous. That's what lets the purges find them without walking the whole tree.
  *
  * Doesn't care about spinlocks.
  */
-static int sessiondb_ipv6_prefix_equal(struct session_entry *session, struct ipv6_prefix *prefix)
+static int compare_local_prefix6(struct session_entry *session, struct ipv6_prefix *prefix)
 {
-	return ipv6_prefix_equal(&prefix->address, &session->local6.l3, prefix->len);
+	struct ipv6_transport_addr local6;
+
+	session_local6(session, &local6);
+	if (ipv6_prefix_equal(&prefix->address, &local6.l3, prefix->len))
+		return 0;
+	return ipv6_addr_cmp_fast(&local6.l3, &prefix->address);
 }
 
 /**
- * Used in delete_sessions_by_ipv6_prefix when is searching in the Session tree6,
- * returns zero if "session"->ipv6.local.address is equals to "prefix" or contains the "prefix".
- * Otherwise return the gap of the comparison result.
+ * Fills in "job"'s local6_all and local6_some, so purge_matches() usually only needs to look at
+ * the sessions' local6_prefix.
  *
- * TODO this looks really different from the compares above. WTF?
+ * Prefixes which show up later are compared the slow way, just in case.
  */
-static int compare_local_prefix6(struct session_entry *session, struct ipv6_prefix *prefix) {
-	int gap;
+static void purge_classify(struct purge_job *job)
+{
+	struct ipv6_prefix *prefix6 = &job->prefix6;
+	struct ipv6_prefix *known;
+	unsigned int count;
+	unsigned int i;
+
+	BUILD_BUG_ON(LOCAL6_PREFIXES > 64);
+
+	job->local6_all = 0;
+	job->local6_some = ~0ULL;
+
+	count = READ_ONCE(local6_prefix_count);
+	smp_rmb();
+	for (i = 0; i < count; i++) {
+		known = &local6_prefixes[i];
+		job->local6_some &= ~(1ULL << i);
+
+		if (known->len >= prefix6->len && ipv6_prefix_equal(&prefix6->address,
+				&known->address, prefix6->len))
+			job->local6_all |= 1ULL << i; /* "known" is inside the victim. */
+		else if (ipv6_prefix_equal(&prefix6->address, &known->address, known->len))
+			job->local6_some |= 1ULL << i; /* The victim is inside "known". */
+	}
+}
 
-	gap = ipv6_addr_cmp(&prefix->address, &session->local6.l3);
-	if (gap == 0)
-		return 0;
+/**
+ * Returns true if no session built with one of the pool6 prefixes seen so far can be one of
+ * "job"'s victims, so there's no point in visiting the tables.
+ */
+static bool purge_is_moot(struct purge_job *job)
+{
+	u64 known;
+	unsigned int count;
 
-	if (sessiondb_ipv6_prefix_equal(session, prefix))
-		return 0;
+	if (job->type != PURGE_IPV6_PREFIX)
+		return false;
 
-	return gap;
+	count = READ_ONCE(local6_prefix_count);
+	known = (count < 64) ? ((1ULL << count) - 1) : ~0ULL;
+	return !job->local6_all && !(job->local6_some & known);
+}
+
+/**
+ * Returns the tree "job" finds its victims in.
+ */
+static struct rb_root *purge_tree(struct purge_job *job, struct session_table *table)
+{
+	return (job->type == PURGE_IPV6_PREFIX) ? &table->tree6 : &table->tree4;
+}
+
+/**
+ * Returns "node" as a session, assuming it belongs to the tree purge_tree() returns.
+ */
+static struct session_entry *purge_entry(struct purge_job *job, struct rb_node *node)
+{
+	return (job->type == PURGE_IPV6_PREFIX)
+			? rb_entry(node, struct session_entry, tree6_hook)
+			: rb_entry(node, struct session_entry, tree4_hook);
+}
+
+/**
+ * Returns any of "job"'s victims from "table", or NULL if there are none left.
+ *
+ * "table"'s spinlock must already be held.
+ */
+static struct session_entry *purge_root(struct purge_job *job, struct session_table *table)
+{
+	struct rb_node *node;
+
+	switch (job->type) {
+	case PURGE_FLUSH:
+		node = table->tree4.rb_node;
+		return node ? rb_entry(node, struct session_entry, tree4_hook) : NULL;
+	case PURGE_IPV4:
+		return rbtree_find(&job->addr4, &table->tree4, compare_local_addr4,
+				struct session_entry, tree4_hook);
+	case PURGE_IPV6_PREFIX:
+		return rbtree_find(&job->prefix6, &table->tree6, compare_local_prefix6,
+				struct session_entry, tree6_hook);
+	}
+
+	return NULL;
 }
 
 /**
- * Deletes the sessions from the "table" table whose local IPv6 address contains "prefix".
- * This function is awfully similar to sessiondb_delete_by_bib(). See that for more comments.
+ * Removes at most PURGE_BATCH of "job"'s victims from "table".
+ * The victims are contiguous in the tree, so this finds one and then spreads out in both directions.
+ *
+ * @return number of sessions removed. If it's less than PURGE_BATCH, "table" is clean.
  */
-static int delete_sessions_by_ipv6_prefix(struct session_table *table, struct ipv6_prefix *prefix)
+static int purge_chunk(struct purge_job *job, struct session_table *table)
 {
 	struct session_entry *root_session, *session;
 	struct rb_node *node;
 	int s = 0;
 
-	spin_lock_bh(&table->lock);
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
 
-	root_session = rbtree_find(prefix, &table->tree6, compare_local_prefix6, struct session_entry,
-			tree6_hook);
+	root_session = purge_root(job, table);
 	if (!root_session)
-		goto success;
-
-	node = rb_prev(&root_session->tree6_hook);
-	while (node) {
-		session = rb_entry(node, struct session_entry, tree6_hook);
-		node = rb_prev(&session->tree6_hook);
-
-		if (!sessiondb_ipv6_prefix_equal(session, prefix))
+		goto end;
+
+	node = rb_prev(job->type == PURGE_IPV6_PREFIX
+			? &root_session->tree6_hook
+			: &root_session->tree4_hook);
+	while (node && s < PURGE_BATCH - 1) {
+		session = purge_entry(job, node);
+		node = rb_prev(node);
+		if (!purge_matches(job, session))
 			break;
 		s += remove(session, table);
 	}
 
-	node = rb_next(&root_session->tree6_hook);
-	while (node) {
-		session = rb_entry(node, struct session_entry, tree6_hook);
-		node = rb_next(&session->tree6_hook);
-
-		if (!sessiondb_ipv6_prefix_equal(session, prefix))
+	node = rb_next(job->type == PURGE_IPV6_PREFIX
+			? &root_session->tree6_hook
+			: &root_session->tree4_hook);
+	while (node && s < PURGE_BATCH - 1) {
+		session = purge_entry(job, node);
+		node = rb_next(node);
+		if (!purge_matches(job, session))
 			break;
 		s += remove(session, table);
 	}
@@ -1610,70 +4950,193 @@ static int delete_sessions_by_ipv6_prefix(struct session_table *table, struct ip
 	table->count -= s;
 	/* Fall through. */
 
-success:
-	spin_unlock_bh(&table->lock);
-	log_debug("Deleted %d sessions.", s);
-	return 0;
+end:
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+	return s;
 }
 
-int sessiondb_delete_by_ipv6_prefix(struct ipv6_prefix *prefix)
+/**
+ * Returns the table "job" is currently working on.
+ */
+static struct session_table *purge_table(struct purge_job *job)
 {
-	if (WARN(!prefix, "The IPv6 prefix is NULL"))
-		return -EINVAL;
+	struct sessiondb_shard *shard = &shards[job->shard];
 
-	delete_sessions_by_ipv6_prefix(&session_table_tcp, prefix);
-	delete_sessions_by_ipv6_prefix(&session_table_icmp, prefix);
-	delete_sessions_by_ipv6_prefix(&session_table_udp, prefix);
+	switch (job->table) {
+	case 0:
+		return &shard->udp;
+	case 1:
+		return &shard->tcp;
+	}
+	return &shard->icmp;
+}
 
-	return 0;
+static void purge_job_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct purge_job, rcu_hook));
 }
 
-static int flush_aux(struct session_table *table)
+/**
+ * Runs PURGE_CHUNKS of "job"'s batches.
+ *
+ * @return true if "job" is done.
+ */
+static bool purge_run(struct purge_job *job)
 {
-	struct session_entry *root_session, *session;
-	struct rb_node *node;
-	int s = 0;
+	unsigned int chunks;
+	int s;
+
+	if (purge_is_moot(job))
+		return true;
+
+	for (chunks = 0; chunks < PURGE_CHUNKS; chunks++) {
+		s = purge_chunk(job, purge_table(job));
+		atomic64_add(s, &sessions_purged);
+
+		if (s < PURGE_BATCH) {
+			job->table++;
+			if (job->table > 2) {
+				job->table = 0;
+				job->shard++;
+				if (job->shard >= shard_count)
+					return true;
+			}
+		}
 
-	spin_lock_bh(&table->lock);
+		cond_resched();
+	}
 
-	node = (&table->tree4)->rb_node;
-	if (!node)
-		goto success;
+	return false;
+}
 
-	root_session = rb_entry(node, struct session_entry, tree4_hook);
-	if (!root_session)
-		goto success;
+/**
+ * Process context work which gradually clears "purge_jobs".
+ *
+ * It requeues itself rather than looping until everything is gone, so a massive purge doesn't
+ * starve the other users of the kernel's workqueue.
+ */
+static void purge_work_fn(struct work_struct *work)
+{
+	struct purge_job *job = NULL;
 
-	node = rb_prev(&root_session->tree4_hook);
-	while (node) {
-		session = rb_entry(node, struct session_entry, tree4_hook);
-		node = rb_prev(&session->tree4_hook);
-		s += remove(session, table);
+	spin_lock_bh(&purge_lock);
+	if (!list_empty(&purge_jobs))
+		job = list_entry(purge_jobs.next, struct purge_job, list_hook);
+	spin_unlock_bh(&purge_lock);
+
+	if (!job)
+		return;
+
+	if (!purge_run(job)) {
+		schedule_work(&purge_work);
+		return;
 	}
 
-	node = rb_next(&root_session->tree4_hook);
-	while (node) {
-		session = rb_entry(node, struct session_entry, tree4_hook);
-		node = rb_next(&session->tree4_hook);
-		s += remove(session, table);
+	log_debug("Session purge done.");
+	spin_lock_bh(&purge_lock);
+	list_del_rcu(&job->list_hook);
+	spin_unlock_bh(&purge_lock);
+	if (job->type != PURGE_FLUSH)
+		atomic_dec(&dying_jobs);
+	atomic64_dec(&purges_pending);
+	call_rcu_bh(&job->rcu_hook, purge_job_free);
+
+	schedule_work(&purge_work);
+}
+
+/**
+ * Allocates a purge job whose type is "type". The caller has to fill in the victims and hand it
+ * over to purge_enqueue().
+ */
+static struct purge_job *purge_create(enum purge_type type)
+{
+	struct purge_job *job;
+
+	job = kmalloc(sizeof(*job), GFP_ATOMIC);
+	if (!job) {
+		log_err("Could not allocate a session purge job.");
+		return NULL;
 	}
 
-	s += remove(root_session, table);
-	table->count -= s;
-	/* Fall through. */
+	job->type = type;
+	job->shard = 0;
+	job->table = 0;
+	return job;
+}
 
-success:
-	spin_unlock_bh(&table->lock);
-	log_debug("Deleted %d sessions.", s);
+static void purge_enqueue(struct purge_job *job)
+{
+	spin_lock_bh(&purge_lock);
+	list_add_tail_rcu(&job->list_hook, &purge_jobs);
+	if (job->type != PURGE_FLUSH)
+		atomic_inc(&dying_jobs);
+	atomic64_inc(&purges_pending);
+	spin_unlock_bh(&purge_lock);
+
+	schedule_work(&purge_work);
+}
+
+/**
+ * Cancels the purges. Only meant for the module's destruction.
+ */
+static void purge_destroy(void)
+{
+	struct purge_job *job, *tmp;
+
+	cancel_work_sync(&purge_work);
+
+	list_for_each_entry_safe(job, tmp, &purge_jobs, list_hook) {
+		list_del(&job->list_hook);
+		kfree(job);
+	}
+	atomic_set(&dying_jobs, 0);
+	atomic64_set(&purges_pending, 0);
+}
+
+int sessiondb_delete_by_ipv4(struct in_addr *addr4)
+{
+	struct purge_job *job;
+
+	if (WARN(!addr4, "The IPv4 address is NULL"))
+		return -EINVAL;
+
+	job = purge_create(PURGE_IPV4);
+	if (!job)
+		return -ENOMEM;
+	job->addr4 = *addr4;
+	purge_enqueue(job);
+
+	log_debug("Queued the deletion of %pI4's sessions.", addr4);
+	return 0;
+}
+
+int sessiondb_delete_by_ipv6_prefix(struct ipv6_prefix *prefix)
+{
+	struct purge_job *job;
+
+	if (WARN(!prefix, "The IPv6 prefix is NULL"))
+		return -EINVAL;
+
+	job = purge_create(PURGE_IPV6_PREFIX);
+	if (!job)
+		return -ENOMEM;
+	job->prefix6 = *prefix;
+	purge_classify(job);
+	purge_enqueue(job);
+
+	log_debug("Queued the deletion of %pI6c/%u's sessions.", &prefix->address, prefix->len);
 	return 0;
 }
 
 int sessiondb_flush(void)
 {
-	log_debug("Emptying the session tables...");
-	flush_aux(&session_table_udp);
-	flush_aux(&session_table_tcp);
-	flush_aux(&session_table_icmp);
+	struct purge_job *job;
+
+	job = purge_create(PURGE_FLUSH);
+	if (!job)
+		return -ENOMEM;
+	purge_enqueue(job);
 
+	log_debug("Queued the emptying of the session tables.");
 	return 0;
 }
@@ -0,0 +1,106 @@
+#include "nat64/mod/siit.h"
+#include "nat64/mod/eam.h"
+#include "nat64/mod/pool4.h"
+#include "nat64/mod/pool6.h"
+#include "nat64/mod/rfc6052.h"
+#include "nat64/mod/stats.h"
+
+JOOL_KEY_DEFINE(siit_key);
+
+int siit_init(bool enabled)
+{
+	if (!enabled)
+		return 0;
+
+	log_info("Translating statelessly (SIIT).");
+	jool_key_enable(siit_key);
+	return 0;
+}
+
+void siit_destroy(void)
+{
+	if (!siit_enabled())
+		return;
+
+	jool_key_disable(siit_key);
+}
+
+bool siit_owns4(__be32 addr)
+{
+	return eamt_contains4(addr) || pool4_contains(addr);
+}
+
+bool siit_owns6(struct in6_addr *addr)
+{
+	return eamt_contains6(addr) || pool6_contains(addr);
+}
+
+static int xlat_6to4(struct in6_addr *addr6, struct in_addr *result)
+{
+	struct ipv6_prefix prefix;
+	int error;
+
+	if (!eamt_xlat_6to4(addr6, result))
+		return 0;
+
+	error = pool6_get(addr6, &prefix);
+	if (error) {
+		log_debug("%pI6c belongs to neither the EAMT nor pool6.", addr6);
+		return error;
+	}
+
+	return addr_6to4(addr6, &prefix, result);
+}
+
+static int xlat_4to6(struct in_addr *addr4, struct in6_addr *result)
+{
+	int error;
+
+	if (!eamt_xlat_4to6(addr4, result))
+		return 0;
+
+	error = pool6_4to6(addr4, result);
+	if (error == -ENOENT)
+		log_debug("%pI4 is not in the EAMT, and pool6 is empty.", addr4);
+
+	return error;
+}
+
+verdict siit_compute_out_tuple(struct tuple *in, struct tuple *out, struct sk_buff *skb)
+{
+	int error = -EINVAL;
+
+	log_debug("Step 3: Computing the Outgoing Tuple (statelessly)");
+
+	out->l4_proto = in->l4_proto;
+
+	switch (in->l3_proto) {
+	case L3PROTO_IPV6:
+		out->l3_proto = L3PROTO_IPV4;
+		out->src.addr4.l4 = in->src.addr6.l4;
+		out->dst.addr4.l4 = in->dst.addr6.l4;
+		error = xlat_6to4(&in->src.addr6.l3, &out->src.addr4.l3);
+		if (!error)
+			error = xlat_6to4(&in->dst.addr6.l3, &out->dst.addr4.l3);
+		break;
+
+	case L3PROTO_IPV4:
+		out->l3_proto = L3PROTO_IPV6;
+		out->src.addr6.l4 = in->src.addr4.l4;
+		out->dst.addr6.l4 = in->dst.addr4.l4;
+		error = xlat_4to6(&in->src.addr4.l3, &out->src.addr6.l3);
+		if (!error)
+			error = xlat_4to6(&in->dst.addr4.l3, &out->dst.addr6.l3);
+		break;
+	}
+
+	if (error) {
+		inc_stats(skb, IPSTATS_MIB_INNOROUTES);
+		inc_jool_stats(JSTAT_SIIT_UNTRANSLATABLE);
+		return VER_DROP;
+	}
+
+	log_tuple(out);
+	log_debug("Done step 3.");
+	return VER_CONTINUE;
+}
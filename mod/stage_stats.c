@@ -0,0 +1,107 @@
+#include "nat64/mod/stage_stats.h"
+#include "nat64/mod/packet.h"
+#include "nat64/mod/types.h"
+
+#include <linux/percpu.h>
+
+JOOL_KEY_DEFINE(stage_timing_key);
+
+/** NULL while stage timing is disabled. */
+static struct pipeline_stats __percpu *stats;
+
+static int get_proto_index(struct sk_buff *skb)
+{
+	int l4_index;
+
+	switch (skb_l4_proto(skb)) {
+	case L4PROTO_TCP:
+		l4_index = 0;
+		break;
+	case L4PROTO_UDP:
+		l4_index = 1;
+		break;
+	case L4PROTO_ICMP:
+		l4_index = 2;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (skb_l3_proto(skb)) {
+	case L3PROTO_IPV6:
+		return l4_index;
+	case L3PROTO_IPV4:
+		return 3 + l4_index;
+	}
+
+	return -EINVAL;
+}
+
+void stagestats_begin(struct stage_timer *timer, struct sk_buff *skb)
+{
+	timer->proto = get_proto_index(skb);
+	timer->start = local_clock();
+}
+
+void stagestats_add(struct stage_timer *timer, enum pipeline_stage stage)
+{
+	u64 now = local_clock();
+
+	if (timer->proto >= 0) {
+		this_cpu_inc(stats->stages[timer->proto][stage].packets);
+		this_cpu_add(stats->stages[timer->proto][stage].nsecs, now - timer->start);
+	}
+
+	timer->start = now;
+}
+
+int stagestats_init(bool enabled)
+{
+	if (!enabled)
+		return 0;
+
+	stats = alloc_percpu(struct pipeline_stats);
+	if (!stats) {
+		log_err("Could not allocate the stage timing counters.");
+		return -ENOMEM;
+	}
+
+	jool_key_enable(stage_timing_key);
+	return 0;
+}
+
+/**
+ * Unhook first.
+ */
+void stagestats_destroy(void)
+{
+	if (!stats)
+		return;
+
+	jool_key_disable(stage_timing_key);
+	free_percpu(stats);
+	stats = NULL;
+}
+
+void stagestats_get(struct pipeline_stats *result)
+{
+	struct pipeline_stats *cpu_stats;
+	unsigned int proto, stage;
+	int cpu;
+
+	memset(result, 0, sizeof(*result));
+	if (!stats)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(stats, cpu);
+		for (proto = 0; proto < STAGE_PROTOS; proto++) {
+			for (stage = 0; stage < STAGE_COUNT; stage++) {
+				result->stages[proto][stage].packets
+						+= cpu_stats->stages[proto][stage].packets;
+				result->stages[proto][stage].nsecs
+						+= cpu_stats->stages[proto][stage].nsecs;
+			}
+		}
+	}
+}
@@ -54,6 +54,137 @@ bib_error:
 	return error;
 }
 
+/**
+ * Reverts the first "count" add_static_route()s from "requests".
+ */
+static void revert_static_routes(struct request_bib *requests, unsigned int count)
+{
+	struct request_bib revert;
+
+	while (count-- > 0) {
+		memset(&revert, 0, sizeof(revert));
+		revert.l4_proto = requests[count].l4_proto;
+		revert.remove.addr6_set = true;
+		revert.remove.addr6 = requests[count].add.addr6;
+		delete_static_route(&revert);
+	}
+}
+
+/**
+ * Bulk version of add_static_route(), for "count" requests of the same protocol.
+ * See add_static_routes().
+ */
+static int add_static_routes_bulk(struct request_bib *requests, unsigned int count)
+{
+	l4_protocol *protos;
+	struct ipv4_transport_addr *addrs;
+	int *results;
+	struct bib_entry **bibs;
+	unsigned int added;
+	unsigned int i;
+	int error = 0;
+
+	protos = kmalloc_array(count, sizeof(*protos), GFP_KERNEL);
+	addrs = kmalloc_array(count, sizeof(*addrs), GFP_KERNEL);
+	results = kmalloc_array(count, sizeof(*results), GFP_KERNEL);
+	bibs = kcalloc(count, sizeof(*bibs), GFP_KERNEL);
+	if (!protos || !addrs || !results || !bibs) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	for (i = 0; i < count; i++) {
+		protos[i] = requests[i].l4_proto;
+		addrs[i] = requests[i].add.addr4;
+	}
+	pool4_get_bulk(protos, addrs, results, count);
+
+	for (i = 0; i < count; i++) {
+		if (results[i]) {
+			log_err("%pI4#%u could not be reserved from the pool. Maybe the IPv4 "
+					"address you provided does not belong to the pool. Or maybe "
+					"they're being used by some other BIB entry?",
+					&addrs[i].l3, addrs[i].l4);
+			error = results[i];
+			goto return_ports;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		bibs[i] = bib_create(&requests[i].add.addr4, &requests[i].add.addr6, true,
+				requests[i].l4_proto);
+		if (!bibs[i]) {
+			log_err("Could not allocate the BIB entries.");
+			error = -ENOMEM;
+			goto free_bibs;
+		}
+	}
+
+	error = bibdb_add_bulk(bibs, count, &added);
+	if (error) {
+		log_err("The BIB entries could not be added to the database. Maybe an entry "
+				"with the same IPv4 and/or IPv6 transport address already exists?");
+		/* The ones that made it are reverted the usual way; removing the fake user. */
+		for (i = 0; i < added; i++) {
+			bibs[i]->is_static = false;
+			bib_return(bibs[i]);
+		}
+		for (; i < count; i++)
+			bib_kfree(bibs[i]);
+	}
+
+	/*
+	 * On success, we do not call bib_return() here, because we want the entries to hold a fake
+	 * user so the timer doesn't delete them.
+	 */
+	goto end;
+
+free_bibs:
+	/* bib_kfree() returns the entries' ports as well. */
+	for (i = 0; i < count && bibs[i]; i++)
+		bib_kfree(bibs[i]);
+	for (; i < count; i++)
+		pool4_return(requests[i].l4_proto, &requests[i].add.addr4);
+	goto end;
+
+return_ports:
+	for (i = 0; i < count; i++)
+		if (!results[i])
+			pool4_return(requests[i].l4_proto, &requests[i].add.addr4);
+	/* Fall through. */
+
+end:
+	kfree(bibs);
+	kfree(results);
+	kfree(addrs);
+	kfree(protos);
+	return error;
+}
+
+int add_static_routes(struct request_bib *requests, unsigned int count)
+{
+	unsigned int i;
+	int error;
+
+	for (i = 1; i < count; i++)
+		if (requests[i].l4_proto != requests[0].l4_proto)
+			goto one_by_one;
+	if (count > 1)
+		return add_static_routes_bulk(requests, count);
+	/* Fall through. */
+
+one_by_one:
+	for (i = 0; i < count; i++) {
+		error = add_static_route(&requests[i]);
+		if (error) {
+			revert_static_routes(requests, i);
+			return error;
+		}
+	}
+
+	return 0;
+}
+
 int delete_static_route(struct request_bib *req)
 {
 	struct bib_entry *bib;
@@ -4,8 +4,43 @@
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/addrconf.h>
+#include <net/net_namespace.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include "nat64/mod/packet.h"
 #include "nat64/mod/types.h"
+#include "nat64/mod/namespace.h"
+
+/** Jool's counters; an array of JSTAT_COUNT per CPU. */
+static u64 __percpu *counters;
+/**
+ * The memory charges; an array of JMEM_COUNT per CPU. A CPU's can be negative (if it freed what
+ * others allocated), but not their sum.
+ */
+static s64 __percpu *memory;
+
+/** Labels of the counters in /proc/net/jool. Indexed by enum jool_stat. */
+static const char *const counter_names[] = {
+	"Translated",
+	"Pool6Mismatch",
+	"Pool4Mismatch",
+	"HairpinLoop",
+	"ICMP6InfoFiltered",
+	"BIB6Failed",
+	"NoBIB",
+	"AddressFiltered",
+	"SessionFailed",
+	"TCPStateRejected",
+	"SYNsStored",
+	"SYNQueueFull",
+	"FragmentTimeout",
+	"FragmentStoreFailed",
+	"NoRoute",
+	"SendFailed",
+	"SIITUntranslatable",
+};
 
 
 static int inc_stats_validate(struct sk_buff *skb)
@@ -30,13 +65,12 @@ static void inc_stats_ipv6(struct sk_buff *skb, int field)
 		if (is_error(inc_stats_validate(skb)))
 			return;
 	}
-	idev = in6_dev_get(skb->dev);
-	if (!idev)
-		return;
-
-	IP6_INC_STATS_BH(dev_net(skb->dev), idev, field);
-
-	in6_dev_put(idev);
+	/* The RCU read-side section is much cheaper than in6_dev_get()'s refcount. */
+	rcu_read_lock();
+	idev = __in6_dev_get(skb->dev);
+	if (idev)
+		IP6_INC_STATS_BH(dev_net(skb->dev), idev, field);
+	rcu_read_unlock();
 }
 
 static void inc_stats_ipv4(struct sk_buff *skb, int field)
@@ -96,3 +130,100 @@ void inc_stats(struct sk_buff *skb, int field)
 		break;
 	}
 }
+
+void inc_jool_stats(enum jool_stat field)
+{
+	this_cpu_inc(counters[field]);
+}
+
+void jool_stats_get(struct jool_stats_usr *result)
+{
+	unsigned int i;
+	int cpu;
+
+	memset(result, 0, sizeof(*result));
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < JSTAT_COUNT; i++)
+			result->counters[i] += *per_cpu_ptr(&counters[i], cpu);
+	}
+}
+
+void jool_mem_add(enum jool_memory field, long bytes)
+{
+	this_cpu_add(memory[field], bytes);
+}
+
+void jool_mem_get(struct memory_usr *result)
+{
+	s64 sum;
+	unsigned int i;
+	int cpu;
+
+	for (i = 0; i < JMEM_COUNT; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += *per_cpu_ptr(&memory[i], cpu);
+		/* A refund might be summed before its charge. */
+		result->bytes[i] = (sum > 0) ? sum : 0;
+	}
+}
+
+static int stats_proc_show(struct seq_file *file, void *arg)
+{
+	struct jool_stats_usr *stats;
+	unsigned int i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	jool_stats_get(stats);
+	for (i = 0; i < JSTAT_COUNT; i++)
+		seq_printf(file, "%-20s%llu\n", counter_names[i], stats->counters[i]);
+
+	kfree(stats);
+	return 0;
+}
+
+static int stats_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_proc_show, NULL);
+}
+
+static const struct file_operations stats_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int stats_init(void)
+{
+	BUILD_BUG_ON(ARRAY_SIZE(counter_names) != JSTAT_COUNT);
+
+	counters = __alloc_percpu(JSTAT_COUNT * sizeof(*counters), __alignof__(*counters));
+	if (!counters)
+		return -ENOMEM;
+	memory = __alloc_percpu(JMEM_COUNT * sizeof(*memory), __alignof__(*memory));
+	if (!memory) {
+		free_percpu(counters);
+		return -ENOMEM;
+	}
+
+	if (!proc_create("jool", S_IRUGO, joolns_get()->proc_net, &stats_proc_fops)) {
+		log_err("Could not create /proc/net/jool.");
+		free_percpu(memory);
+		free_percpu(counters);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void stats_destroy(void)
+{
+	remove_proc_entry("jool", joolns_get()->proc_net);
+	free_percpu(memory);
+	free_percpu(counters);
+}
@@ -0,0 +1,294 @@
+#include "nat64/mod/sync.h"
+#include "nat64/mod/types.h"
+#include "nat64/mod/pool4.h"
+#include "nat64/mod/bib_db.h"
+#include "nat64/mod/session_db.h"
+
+#include <linux/slab.h>
+
+/** See struct dbevent_stats. */
+static atomic64_t events_imported = ATOMIC64_INIT(0);
+static atomic64_t events_rejected = ATOMIC64_INIT(0);
+
+static enum session_timer_type get_timer_type(struct dbevent_usr *event)
+{
+	switch (event->l4_proto) {
+	case L4PROTO_UDP:
+		return SESSIONTIMER_UDP;
+	case L4PROTO_ICMP:
+		return SESSIONTIMER_ICMP;
+	}
+
+	/*
+	 * The standby will not see the handshake, so it has no use for the SYN timer; half-open and
+	 * closing connections just get the transitory lifetime.
+	 */
+	return (event->state == ESTABLISHED) ? SESSIONTIMER_EST : SESSIONTIMER_TRANS;
+}
+
+static void event_to_tuple(struct dbevent_usr *event, struct tuple *tuple6)
+{
+	memset(tuple6, 0, sizeof(*tuple6));
+	tuple6->src.addr6 = event->remote6;
+	tuple6->dst.addr6 = event->local6;
+	tuple6->l3_proto = L3PROTO_IPV6;
+	tuple6->l4_proto = event->l4_proto;
+}
+
+/** Maximum number of session additions whose BIB entries are reserved from pool4 together. */
+#define IMPORT_BATCH 64
+
+/**
+ * Session additions waiting for their BIB entries.
+ */
+struct import_batch {
+	struct dbevent_usr *events[IMPORT_BATCH];
+	/** The BIB entry of each event's session, once known. We own a reference to each one. */
+	struct bib_entry *bibs[IMPORT_BATCH];
+	/**
+	 * Index of the event that creates the BIB entry of each event's session. -1 if the entry
+	 * already existed before the batch (so it's already in "bibs").
+	 */
+	int sources[IMPORT_BATCH];
+	unsigned int count;
+
+	/* pool4_get_bulk()'s arguments. */
+	l4_protocol protos[IMPORT_BATCH];
+	struct ipv4_transport_addr addrs[IMPORT_BATCH];
+	int results[IMPORT_BATCH];
+};
+
+static void account(int error)
+{
+	if (error)
+		atomic64_inc(&events_rejected);
+	else
+		atomic64_inc(&events_imported);
+}
+
+/**
+ * Returns "event"'s BIB entry, whose IPv4 transport address has already been reserved. The caller
+ * owns a reference to the result.
+ */
+static struct bib_entry *create_bib(struct dbevent_usr *event)
+{
+	struct bib_entry *bib;
+
+	bib = bib_create(&event->local4, &event->remote6, false, event->l4_proto);
+	if (!bib) {
+		pool4_return(event->l4_proto, &event->local4);
+		return NULL;
+	}
+
+	if (bibdb_add(bib)) {
+		bib_kfree(bib);
+		return NULL;
+	}
+
+	return bib;
+}
+
+static int create_session(struct dbevent_usr *event, struct bib_entry *bib)
+{
+	struct session_entry *session;
+	int error;
+
+	if (!bib)
+		return -EINVAL;
+
+	session = session_create(&event->remote6, &event->local6, &event->local4, &event->remote4,
+			event->l4_proto, bib);
+	if (!session)
+		return -ENOMEM;
+	session->state = event->state;
+
+	error = sessiondb_add(session, get_timer_type(event));
+	session_return(session);
+	return error;
+}
+
+/**
+ * Creates the BIB entries and sessions of the additions queued in "batch".
+ */
+static void flush_batch(struct import_batch *batch)
+{
+	struct dbevent_usr *event;
+	unsigned int reserved = 0;
+	unsigned int i;
+	int source;
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->sources[i] == (int) i) {
+			batch->protos[reserved] = batch->events[i]->l4_proto;
+			batch->addrs[reserved] = batch->events[i]->local4;
+			reserved++;
+		}
+	}
+	pool4_get_bulk(batch->protos, batch->addrs, batch->results, reserved);
+
+	reserved = 0;
+	for (i = 0; i < batch->count; i++) {
+		event = batch->events[i];
+		source = batch->sources[i];
+
+		if (source == (int) i) {
+			batch->bibs[i] = batch->results[reserved++] ? NULL : create_bib(event);
+		} else if (source != -1) {
+			batch->bibs[i] = batch->bibs[source];
+			if (batch->bibs[i])
+				bib_get(batch->bibs[i]);
+		}
+
+		account(create_session(event, batch->bibs[i]));
+	}
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->bibs[i])
+			bib_return(batch->bibs[i]);
+	batch->count = 0;
+}
+
+/**
+ * Returns the index of the event queued in "batch" which is going to create the BIB entry
+ * "event"'s session needs, or -1 if there's none.
+ */
+static int find_source(struct import_batch *batch, struct dbevent_usr *event)
+{
+	struct dbevent_usr *other;
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		other = batch->events[i];
+		if (batch->sources[i] == (int) i && other->l4_proto == event->l4_proto
+				&& ipv6_transport_addr_equals(&other->remote6, &event->remote6))
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Queues the addition of "event"'s session in "batch", unless it's already known or cannot be
+ * added anyway (in which case the event is dealt with right away).
+ */
+static void queue_session(struct import_batch *batch, struct dbevent_usr *event)
+{
+	struct tuple tuple6;
+	struct session_entry *session;
+	struct bib_entry *bib = NULL;
+	int source;
+	int error;
+
+	event_to_tuple(event, &tuple6);
+	error = sessiondb_get(&tuple6, &session);
+	if (!error) {
+		/* We already know it; this is an update or a repeat. Refresh it either way. */
+		account(sessiondb_sync_state(session, event->state, get_timer_type(event)));
+		session_return(session);
+		return;
+	}
+	if (error != -ENOENT) {
+		account(error);
+		return;
+	}
+
+	error = bibdb_get_by_ipv6(&event->remote6, event->l4_proto, &bib);
+	if (!error) {
+		source = -1;
+		if (!ipv4_transport_addr_equals(&bib->ipv4, &event->local4))
+			goto conflict;
+	} else if (error == -ENOENT) {
+		source = find_source(batch, event);
+		if (source == -1)
+			source = batch->count; /* This one creates it. */
+		else if (!ipv4_transport_addr_equals(&batch->events[source]->local4, &event->local4))
+			goto conflict;
+	} else {
+		account(error);
+		return;
+	}
+
+	batch->events[batch->count] = event;
+	batch->bibs[batch->count] = bib;
+	batch->sources[batch->count] = source;
+	batch->count++;
+
+	if (batch->count == IMPORT_BATCH)
+		flush_batch(batch);
+	return;
+
+conflict:
+	log_debug("The peer's BIB entry conflicts with a local one.");
+	if (bib)
+		bib_return(bib);
+	account(-EEXIST);
+}
+
+static int remove_session(struct dbevent_usr *event)
+{
+	struct tuple tuple6;
+	struct session_entry *session;
+	int error;
+
+	event_to_tuple(event, &tuple6);
+	error = sessiondb_get(&tuple6, &session);
+	if (error)
+		return (error == -ENOENT) ? 0 : error; /* Already gone; that's what the peer wanted. */
+
+	error = sessiondb_delete(session);
+	session_return(session);
+	return (error == -ENOENT) ? 0 : error;
+}
+
+void sync_import(struct dbevent_usr *events, unsigned int count)
+{
+	struct import_batch *batch;
+	struct dbevent_usr *event;
+	unsigned int i;
+
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch) {
+		atomic64_add(count, &events_rejected);
+		return;
+	}
+	batch->count = 0;
+
+	for (i = 0; i < count; i++) {
+		event = &events[i];
+
+		switch (event->type) {
+		case DBEVENT_BIB_ADD:
+		case DBEVENT_BIB_REMOVE:
+			account(0); /* See the header. */
+			continue;
+		case DBEVENT_SESSION_ADD:
+			queue_session(batch, event);
+			continue;
+		}
+
+		/* The rest might refer to the pending sessions, so those have to exist first. */
+		flush_batch(batch);
+
+		switch (event->type) {
+		case DBEVENT_SESSION_UPDATE:
+			/* Also creates it, in case we missed the addition. */
+			queue_session(batch, event);
+			break;
+		case DBEVENT_SESSION_REMOVE:
+			account(remove_session(event));
+			break;
+		default:
+			log_debug("Unknown event type: %u", event->type);
+			account(-EINVAL);
+		}
+	}
+
+	flush_batch(batch);
+	kfree(batch);
+}
+
+void sync_get_stats(struct dbevent_stats *result)
+{
+	result->events_imported = atomic64_read(&events_imported);
+	result->events_rejected = atomic64_read(&events_rejected);
+}
@@ -0,0 +1,3 @@
+/* Instantiates the tracepoints declared by trace.h. */
+#define CREATE_TRACE_POINTS
+#include "nat64/mod/trace.h"
@@ -17,6 +17,14 @@ static int has_frag_hdr(struct iphdr *in_hdr)
 			(is_more_fragments_set_ipv4(in_hdr) || get_fragment_offset_ipv4(in_hdr));
 }
 
+unsigned int ttp46_l3_hdr_len(struct iphdr *hdr4)
+{
+	unsigned int result = sizeof(struct ipv6hdr);
+	if (has_frag_hdr(hdr4))
+		result += sizeof(struct frag_hdr);
+	return result;
+}
+
 int ttp46_create_skb(struct pkt_parts *in, struct sk_buff **out)
 {
 	int l3_hdr_len;
@@ -38,9 +46,7 @@ int ttp46_create_skb(struct pkt_parts *in, struct sk_buff **out)
 	 * The sub-L4 header will never change in size.
 	 * The subpayload will never change in size (unless it gets truncated later, but I don't care).
 	 */
-	l3_hdr_len = sizeof(struct ipv6hdr);
-	if (has_frag_hdr(in->l3_hdr.ptr))
-		l3_hdr_len += sizeof(struct frag_hdr);
+	l3_hdr_len = ttp46_l3_hdr_len(in->l3_hdr.ptr);
 
 	total_len = l3_hdr_len + in->l4_hdr.len + in->payload.len;
 	if (is_first && in->l4_hdr.proto == L4PROTO_ICMP && is_icmp4_error(icmp_hdr(in->skb)->type)) {
@@ -49,13 +55,19 @@ int ttp46_create_skb(struct pkt_parts *in, struct sk_buff **out)
 			total_len += sizeof(struct frag_hdr);
 	}
 
-	new_skb = alloc_skb(LL_MAX_HEADER + total_len, GFP_ATOMIC);
+	/* Same as in ttp64_create_skb(). */
+	if (total_len - sizeof(struct ipv6hdr) > BIG_PACKET_THRESHOLD) {
+		log_debug("Packet is too big to be translated out of place (%d bytes).", total_len);
+		inc_stats(in->skb, IPSTATS_MIB_INDISCARDS);
+		return -EINVAL;
+	}
+
+	new_skb = ttpcomm_alloc_skb(total_len);
 	if (!new_skb) {
 		inc_stats(in->skb, IPSTATS_MIB_INDISCARDS);
 		return -ENOMEM;
 	}
 
-	skb_reserve(new_skb, LL_MAX_HEADER);
 	skb_put(new_skb, total_len);
 	skb_reset_mac_header(new_skb);
 	skb_reset_network_header(new_skb);
@@ -139,32 +151,27 @@ int ttp46_ipv6(struct tuple *tuple6, struct pkt_parts *in, struct pkt_parts *out
 	struct iphdr *ip4_hdr = in->l3_hdr.ptr;
 	struct ipv6hdr *ip6_hdr;
 	bool reset_traffic_class;
-
-	rcu_read_lock_bh();
-	reset_traffic_class = ttpconfig_get()->reset_traffic_class;
-	rcu_read_unlock_bh();
+	bool locked;
 
 	ip6_hdr = out->l3_hdr.ptr;
-	ip6_hdr->version = 6;
-	if (reset_traffic_class) {
-		ip6_hdr->priority = 0;
-		ip6_hdr->flow_lbl[0] = 0;
-	} else {
+
+	/* Version and the config-dictated fields; zero everywhere else (including the flow label). */
+	locked = config_read_lock();
+	*ip6_hdr = ttpconfig_get_templates()->hdr6;
+	reset_traffic_class = ttpconfig_get_templates()->reset_traffic_class;
+	config_read_unlock(locked);
+
+	if (!reset_traffic_class) {
 		ip6_hdr->priority = ip4_hdr->tos >> 4;
 		ip6_hdr->flow_lbl[0] = ip4_hdr->tos << 4;
 	}
-	ip6_hdr->flow_lbl[1] = 0;
-	ip6_hdr->flow_lbl[2] = 0;
 	ip6_hdr->nexthdr = (ip4_hdr->protocol == IPPROTO_ICMP) ? NEXTHDR_ICMP : ip4_hdr->protocol;
 
 	if (!is_inner_pkt(in)) {
-		ip6_hdr->payload_len = htons(out->l3_hdr.len - sizeof(*ip6_hdr) + out->l4_hdr.len
-				+ out->payload.len);
-		if (ip4_hdr->ttl <= 1) {
-			icmp64_send(in->skb, ICMPERR_HOP_LIMIT, 0);
-			inc_stats(in->skb, IPSTATS_MIB_INHDRERRORS);
-			return -EINVAL;
-		}
+		ip6_hdr->payload_len = build_payload_len_field(out->l3_hdr.len - sizeof(*ip6_hdr)
+				+ out->l4_hdr.len + out->payload.len);
+		if (unlikely(ip4_hdr->ttl <= 1))
+			return ttpcomm_reject(in->skb, ICMPERR_HOP_LIMIT, 0);
 		ip6_hdr->hop_limit = ip4_hdr->ttl - 1;
 	} else {
 		ip6_hdr->payload_len = htons(ntohs(ip4_hdr->tot_len) - (4 * ip4_hdr->ihl));
@@ -182,14 +189,12 @@ int ttp46_ipv6(struct tuple *tuple6, struct pkt_parts *in, struct pkt_parts *out
 		return -EINVAL;
 	*/
 
-	if (!is_inner_pkt(in) && has_unexpired_src_route(ip4_hdr)) {
+	if (unlikely(!is_inner_pkt(in) && has_unexpired_src_route(ip4_hdr))) {
 		log_debug("Packet has an unexpired source route.");
-		icmp64_send(in->skb, ICMPERR_SRC_ROUTE, 0);
-		inc_stats(in->skb, IPSTATS_MIB_INHDRERRORS);
-		return -EINVAL;
+		return ttpcomm_reject(in->skb, ICMPERR_SRC_ROUTE, 0);
 	}
 
-	if (has_frag_hdr(in->l3_hdr.ptr)) {
+	if (unlikely(has_frag_hdr(in->l3_hdr.ptr))) {
 		struct frag_hdr *frag_header = (struct frag_hdr *) (ip6_hdr + 1);
 
 		/* Override some fixed header fields... */
@@ -218,7 +223,13 @@ int ttp46_ipv6(struct tuple *tuple6, struct pkt_parts *in, struct pkt_parts *out
 static __be32 icmp6_minimum_mtu(__u16 packet_mtu, __u16 nexthop6_mtu, __u16 nexthop4_mtu,
 		__u16 tot_len_field)
 {
+	struct translate_config *config_safe;
 	__u32 result;
+	int plateau;
+
+	/* Both quirks come from the same configuration, so it's only dereferenced once. */
+	rcu_read_lock_bh();
+	config_safe = ttpconfig_get();
 
 	if (packet_mtu == 0) {
 		/*
@@ -226,20 +237,12 @@ static __be32 icmp6_minimum_mtu(__u16 packet_mtu, __u16 nexthop6_mtu, __u16 next
 		 * Got to determine a likely path MTU.
 		 * See RFC 1191 sections 5, 7 and 7.1 to understand the logic here.
 		 */
-		struct translate_config *config_safe;
-		int plateau;
-
-		rcu_read_lock_bh();
-		config_safe = ttpconfig_get();
-
 		for (plateau = 0; plateau < config_safe->mtu_plateau_count; plateau++) {
 			if (config_safe->mtu_plateaus[plateau] < tot_len_field) {
 				packet_mtu = config_safe->mtu_plateaus[plateau];
 				break;
 			}
 		}
-
-		rcu_read_unlock_bh();
 	}
 
 	packet_mtu += 20;
@@ -251,8 +254,7 @@ static __be32 icmp6_minimum_mtu(__u16 packet_mtu, __u16 nexthop6_mtu, __u16 next
 	else
 		result = (packet_mtu < nexthop4_mtu) ? packet_mtu : nexthop4_mtu;
 
-	rcu_read_lock_bh();
-	if (ttpconfig_get()->lower_mtu_fail && result < IPV6_MIN_MTU) {
+	if (config_safe->lower_mtu_fail && result < IPV6_MIN_MTU) {
 		/*
 		 * Probably some router does not implement RFC 4890, section 4.3.1.
 		 * Gotta override and hope for the best.
@@ -561,6 +563,55 @@ static int compute_icmp6_csum(struct pkt_parts *out)
 	return 0;
 }
 
+/**
+ * Use this when the ICMP header and the inner packet's headers changed, but the inner packet's
+ * payload did not. Cheaper than compute_icmp6_csum(), which would sum the whole payload.
+ *
+ * The result is only correct if "in_outer"'s checksum was (which is the case if the packet went
+ * through validate_icmp4_csum()) and the message is entirely contained in "in_outer"; see
+ * is_icmp6error_csum_updatable().
+ * The regions involved all start at even offsets, so the payload's contribution is the same in
+ * both messages.
+ */
+static int update_icmp6error_csum(struct pkt_parts *in_outer, struct pkt_parts *in_inner,
+		struct pkt_parts *out_outer)
+{
+	struct ipv6hdr *out_ip6 = out_outer->l3_hdr.ptr;
+	struct icmphdr *in_icmp = in_outer->l4_hdr.ptr;
+	struct icmp6hdr *out_icmp = out_outer->l4_hdr.ptr;
+	struct icmphdr copy_hdr;
+	unsigned int in_hdrs_len, out_hdrs_len;
+	__wsum csum;
+
+	in_hdrs_len = in_inner->l3_hdr.len + in_inner->l4_hdr.len;
+	out_hdrs_len = out_outer->payload.len - in_inner->payload.len;
+
+	csum = ~csum_unfold(in_icmp->checksum);
+
+	/* Remove the ICMPv4 header and the inner IPv4 headers. There's no ICMPv4 pseudo-header. */
+	memcpy(&copy_hdr, in_icmp, sizeof(*in_icmp));
+	copy_hdr.checksum = 0;
+	csum = csum_sub(csum, csum_partial(&copy_hdr, sizeof(copy_hdr), 0));
+	csum = csum_sub(csum, csum_partial(in_outer->payload.ptr, in_hdrs_len, 0));
+
+	/* Add the ICMPv6 header, the inner IPv6 headers and the ICMPv6 pseudo-header. */
+	out_icmp->icmp6_cksum = 0;
+	csum = csum_add(csum, csum_partial(out_icmp, sizeof(*out_icmp), 0));
+	csum = csum_add(csum, csum_partial(out_outer->payload.ptr, out_hdrs_len, 0));
+	out_icmp->icmp6_cksum = csum_ipv6_magic(&out_ip6->saddr, &out_ip6->daddr,
+			out_outer->l4_hdr.len + out_outer->payload.len, IPPROTO_ICMPV6, csum);
+
+	return 0;
+}
+
+/**
+ * Returns true if update_icmp6error_csum() can be trusted with "in"'s translation.
+ */
+static bool is_icmp6error_csum_updatable(struct pkt_parts *in)
+{
+	return !is_fragmented_ipv4(in->l3_hdr.ptr) && in->skb->ip_summed != CHECKSUM_PARTIAL;
+}
+
 static int post_icmp6info(struct pkt_parts *in, struct pkt_parts *out)
 {
 	memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
@@ -584,10 +635,12 @@ static int post_icmp6error(struct tuple *tuple6, struct pkt_parts *in_outer,
 	if (error)
 		return error;
 
-	if (is_csum6_computable(out_outer))
-		error = compute_icmp6_csum(out_outer);
+	if (!is_csum6_computable(out_outer))
+		return 0;
 
-	return error;
+	return is_icmp6error_csum_updatable(in_outer)
+			? update_icmp6error_csum(in_outer, &in_inner, out_outer)
+			: compute_icmp6_csum(out_outer);
 }
 
 /**
@@ -663,22 +716,25 @@ int ttp46_icmp(struct tuple* tuple6, struct pkt_parts *in, struct pkt_parts *out
 }
 
 static __sum16 update_csum_4to6(__sum16 csum16,
-		struct iphdr *in_ip4, void *in_l4_hdr, size_t in_l4_hdr_len,
-		struct ipv6hdr *out_ip6, void *out_l4_hdr, size_t out_l4_hdr_len)
+		struct iphdr *in_ip4, void *in_l4_hdr,
+		struct ipv6hdr *out_ip6, void *out_l4_hdr)
 {
-	__wsum csum, pseudohdr_csum;
+	__wsum csum;
+	int i;
 
 	/* See comments at update_csum_6to4(). */
 
 	csum = ~csum_unfold(csum16);
 
-	pseudohdr_csum = csum_tcpudp_nofold(in_ip4->saddr, in_ip4->daddr, 0, 0, 0);
-	csum = csum_sub(csum, pseudohdr_csum);
-	csum = csum_sub(csum, csum_partial(in_l4_hdr, in_l4_hdr_len, 0));
+	csum = csum_sub(csum, (__force __wsum) in_ip4->saddr);
+	csum = csum_sub(csum, (__force __wsum) in_ip4->daddr);
+	csum = csum_sub(csum, (__force __wsum) *((__be32 *) in_l4_hdr));
 
-	pseudohdr_csum = ~csum_unfold(csum_ipv6_magic(&out_ip6->saddr, &out_ip6->daddr, 0, 0, 0));
-	csum = csum_add(csum, pseudohdr_csum);
-	csum = csum_add(csum, csum_partial(out_l4_hdr, out_l4_hdr_len, 0));
+	for (i = 0; i < 4; i++) {
+		csum = csum_add(csum, (__force __wsum) out_ip6->saddr.s6_addr32[i]);
+		csum = csum_add(csum, (__force __wsum) out_ip6->daddr.s6_addr32[i]);
+	}
+	csum = csum_add(csum, (__force __wsum) *((__be32 *) out_l4_hdr));
 
 	return csum_fold(csum);
 }
@@ -744,7 +800,6 @@ int ttp46_tcp(struct tuple *tuple6, struct pkt_parts *in, struct pkt_parts *out)
 {
 	struct tcphdr *tcp_in = in->l4_hdr.ptr;
 	struct tcphdr *tcp_out = out->l4_hdr.ptr;
-	struct tcphdr tcp_copy;
 
 	/* Header */
 	memcpy(tcp_out, tcp_in, in->l4_hdr.len);
@@ -752,16 +807,14 @@ int ttp46_tcp(struct tuple *tuple6, struct pkt_parts *in, struct pkt_parts *out)
 	tcp_out->source = cpu_to_be16(tuple6->src.addr6.l4);
 	tcp_out->dest = cpu_to_be16(tuple6->dst.addr6.l4);
 
-	memcpy(&tcp_copy, tcp_in, sizeof(*tcp_in));
-	tcp_copy.check = 0;
+	tcp_out->check = update_csum_4to6(tcp_in->check, in->l3_hdr.ptr, tcp_in,
+			out->l3_hdr.ptr, tcp_out);
+	if (!is_inner_pkt(in))
+		ttpcomm_clamp_mss(tcp_out, in->l4_hdr.len, in->skb->ip_summed != CHECKSUM_PARTIAL);
 
-	tcp_out->check = 0;
-	tcp_out->check = update_csum_4to6(tcp_in->check,
-			in->l3_hdr.ptr, &tcp_copy, sizeof(tcp_copy),
-			out->l3_hdr.ptr, tcp_out, sizeof(*tcp_out));
-
-	/* Payload */
-	memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
+	/* Payload (unless "out" is "in" being translated in place). */
+	if (out->payload.ptr != in->payload.ptr)
+		memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
 
 	return 0;
 }
@@ -770,26 +823,21 @@ int ttp46_udp(struct tuple *tuple6, struct pkt_parts *in, struct pkt_parts *out)
 {
 	struct udphdr *udp_in = in->l4_hdr.ptr;
 	struct udphdr *udp_out = out->l4_hdr.ptr;
-	struct udphdr udp_copy;
 
 	/* Header */
 	udp_out->source = cpu_to_be16(tuple6->src.addr6.l4);
 	udp_out->dest = cpu_to_be16(tuple6->dst.addr6.l4);
 	udp_out->len = udp_in->len;
 	if (udp_in->check != 0) {
-		memcpy(&udp_copy, udp_in, sizeof(*udp_in));
-		udp_copy.check = 0;
-
-		udp_out->check = 0;
-		udp_out->check = update_csum_4to6(udp_in->check,
-				in->l3_hdr.ptr, &udp_copy, sizeof(udp_copy),
-				out->l3_hdr.ptr, udp_out, sizeof(*udp_out));
+		udp_out->check = update_csum_4to6(udp_in->check, in->l3_hdr.ptr, udp_in,
+				out->l3_hdr.ptr, udp_out);
 	} else {
 		handle_zero_csum(in, out);
 	}
 
-	/* Payload */
-	memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
+	/* Payload (unless "out" is "in" being translated in place). */
+	if (out->payload.ptr != in->payload.ptr)
+		memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
 
 	return 0;
 }
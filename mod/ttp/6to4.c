@@ -4,6 +4,8 @@
 #include <net/ipv6.h>
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 
 #include "nat64/mod/icmp_wrapper.h"
 #include "nat64/mod/ipv6_hdr_iterator.h"
@@ -46,13 +48,19 @@ int ttp64_create_skb(struct pkt_parts *in, struct sk_buff **out)
 		total_len += sizeof(struct iphdr) - (iterator.data - in->payload.ptr);
 	}
 
-	new_skb = alloc_skb(LL_MAX_HEADER + total_len, GFP_ATOMIC);
+	/* Only BIG TCP super-packets can be this big, and those lose their GSO-ness here. */
+	if (total_len > BIG_PACKET_THRESHOLD) {
+		log_debug("Packet is too big to be translated out of place (%d bytes).", total_len);
+		inc_stats(in->skb, IPSTATS_MIB_INDISCARDS);
+		return -EINVAL;
+	}
+
+	new_skb = ttpcomm_alloc_skb(total_len);
 	if (!new_skb) {
 		inc_stats(in->skb, IPSTATS_MIB_INDISCARDS);
 		return -ENOMEM;
 	}
 
-	skb_reserve(new_skb, LL_MAX_HEADER);
 	skb_put(new_skb, total_len);
 	skb_reset_mac_header(new_skb);
 	skb_reset_network_header(new_skb);
@@ -71,19 +79,39 @@ int ttp64_create_skb(struct pkt_parts *in, struct sk_buff **out)
 	return 0;
 }
 
+/**
+ * Number of counters the IPv4 identifications are drawn from. Has to be a power of two.
+ *
+ * Same scheme as the kernel's ip_idents: packets are spread among the counters by hashing their
+ * addresses with a secret, so each destination sees a sequence which starts at a random value, and
+ * which an outsider cannot correlate with the ones of other destinations. Unlike calling the
+ * CSPRNG for every packet, this costs a hash and an atomic increment.
+ */
+#define IDENTS_SIZE 2048
+static atomic_t idents[IDENTS_SIZE];
+static u32 idents_secret;
+
+void ttp64_init(void)
+{
+	get_random_bytes(&idents_secret, sizeof(idents_secret));
+	get_random_bytes(idents, sizeof(idents));
+}
+
 /**
  * One-liner for creating the IPv4 header's Identification field.
  * It assumes that the packet will not contain a fragment header.
  */
-static __be16 generate_ipv4_id_nofrag(struct ipv6hdr *ip6_header)
+static __be16 generate_ipv4_id_nofrag(struct tuple *tuple4, struct ipv6hdr *ip6_header)
 {
 	__u16 packet_len;
-	__be16 random;
+	u32 hash;
 
 	packet_len = sizeof(*ip6_header) + be16_to_cpu(ip6_header->payload_len);
 	if (88 < packet_len && packet_len <= 1280) {
-		get_random_bytes(&random, 2);
-		return random;
+		hash = jhash_3words((__force u32) tuple4->dst.addr4.l3.s_addr,
+				(__force u32) tuple4->src.addr4.l3.s_addr,
+				tuple4->l4_proto, idents_secret);
+		return cpu_to_be16(atomic_inc_return(&idents[hash & (IDENTS_SIZE - 1)]));
 	}
 
 	return 0; /* Because the DF flag will be set. */
@@ -121,20 +149,38 @@ static __u8 build_protocol_field(struct ipv6hdr *ip6_header)
 	return iterator.hdr_type;
 }
 
+/**
+ * Same as build_protocol_field(), except for packets whose control buffer has already been
+ * initialized (ie. not inner packets); the header chain was already walked by then.
+ */
+static __u8 build_protocol_field_skb(struct sk_buff *skb)
+{
+	switch (skb_l4_proto(skb)) {
+	case L4PROTO_TCP:
+		return IPPROTO_TCP;
+	case L4PROTO_UDP:
+		return IPPROTO_UDP;
+	case L4PROTO_ICMP:
+		return IPPROTO_ICMP;
+	}
+
+	return build_protocol_field(ipv6_hdr(skb));
+}
+
 /**
  * Returns "true" if ip6_hdr's first routing header contains a Segments Field which is not zero.
  *
  * @param ip6_hdr IPv6 header of the packet you want to test.
+ * @param rt_hdr ip6_hdr's first routing header (NULL if there is none).
  * @param field_location (out parameter) if the header contains a routing header, the offset of the
  *		segments left field (from the start of ip6_hdr) will be stored here.
  * @return whether ip6_hdr's first routing header contains a Segments Field which is not zero.
  */
-static bool has_nonzero_segments_left(struct ipv6hdr *ip6_hdr, __u32 *field_location)
+static bool has_nonzero_segments_left(struct ipv6hdr *ip6_hdr, struct ipv6_rt_hdr *rt_hdr,
+		__u32 *field_location)
 {
-	struct ipv6_rt_hdr *rt_hdr;
 	__u32 rt_hdr_offset, segments_left_offset;
 
-	rt_hdr = get_extension_header(ip6_hdr, NEXTHDR_ROUTING);
 	if (!rt_hdr)
 		return false;
 
@@ -167,62 +213,61 @@ int ttp64_ipv4(struct tuple *tuple4, struct pkt_parts *in, struct pkt_parts *out
 	struct ipv6hdr *ip6_hdr = in->l3_hdr.ptr;
 	struct frag_hdr *ip6_frag_hdr;
 	struct iphdr *ip4_hdr;
-	struct translate_config *config;
-
+	struct ttp_templates *tmpl;
 	bool reset_tos, build_ipv4_id, df_always_on;
-	__u8 dont_fragment, new_tos;
-
-	rcu_read_lock_bh();
-	config = ttpconfig_get();
-	reset_tos = config->reset_tos;
-	build_ipv4_id = config->build_ipv4_id;
-	df_always_on = config->df_always_on;
-	new_tos = config->new_tos;
-	rcu_read_unlock_bh();
+	bool locked;
 
 	ip4_hdr = out->l3_hdr.ptr;
-	ip4_hdr->version = 4;
-	ip4_hdr->ihl = 5;
-	ip4_hdr->tos = reset_tos ? new_tos : get_traffic_class(ip6_hdr);
-	ip4_hdr->id = build_ipv4_id ? generate_ipv4_id_nofrag(ip6_hdr) : 0;
-	dont_fragment = df_always_on ? 1 : generate_df_flag(ip6_hdr);
-	ip4_hdr->frag_off = build_ipv4_frag_off_field(dont_fragment, 0, 0);
+
+	/* Version, IHL, and the config-dictated fields; zero everywhere else. */
+	locked = config_read_lock();
+	tmpl = ttpconfig_get_templates();
+	*ip4_hdr = tmpl->hdr4;
+	reset_tos = tmpl->reset_tos;
+	build_ipv4_id = tmpl->build_ipv4_id;
+	df_always_on = tmpl->df_always_on;
+	config_read_unlock(locked);
+
+	if (!reset_tos)
+		ip4_hdr->tos = get_traffic_class(ip6_hdr);
+	if (build_ipv4_id)
+		ip4_hdr->id = generate_ipv4_id_nofrag(tuple4, ip6_hdr);
+	if (!df_always_on)
+		ip4_hdr->frag_off = build_ipv4_frag_off_field(generate_df_flag(ip6_hdr), 0, 0);
 	if (!is_inner_pkt(in)) {
-		ip4_hdr->tot_len = cpu_to_be16(out->l3_hdr.len + out->l4_hdr.len + out->payload.len);
-		if (ip6_hdr->hop_limit <= 1) {
-			icmp64_send(in->skb, ICMPERR_HOP_LIMIT, 0);
-			inc_stats(in->skb, IPSTATS_MIB_INHDRERRORS);
-			return -EINVAL;
-		}
+		ip4_hdr->tot_len = build_tot_len_field(out->l3_hdr.len + out->l4_hdr.len
+				+ out->payload.len);
+		if (unlikely(ip6_hdr->hop_limit <= 1))
+			return ttpcomm_reject(in->skb, ICMPERR_HOP_LIMIT, 0);
 		ip4_hdr->ttl = ip6_hdr->hop_limit - 1;
 	} else {
 		ip4_hdr->tot_len = cpu_to_be16(be16_to_cpu(ip6_hdr->payload_len)
 				- (in->l3_hdr.len - sizeof(*ip6_hdr)) + sizeof(*ip4_hdr));
 		ip4_hdr->ttl = ip6_hdr->hop_limit;
 	}
-	ip4_hdr->protocol = build_protocol_field(ip6_hdr);
+	ip4_hdr->protocol = is_inner_pkt(in)
+			? build_protocol_field(ip6_hdr)
+			: build_protocol_field_skb(in->skb);
 	/* ip4_hdr->check is set later; please scroll down. */
 	ip4_hdr->saddr = tuple4->src.addr4.l3.s_addr;
 	ip4_hdr->daddr = tuple4->dst.addr4.l3.s_addr;
 
 	if (!is_inner_pkt(in)) {
 		__u32 nonzero_location;
-		if (has_nonzero_segments_left(ip6_hdr, &nonzero_location)) {
+		if (unlikely(has_nonzero_segments_left(ip6_hdr, skb_rt_hdr(in->skb),
+				&nonzero_location))) {
 			log_debug("Packet's segments left field is nonzero.");
-			icmp64_send(in->skb, ICMPERR_HDR_FIELD, nonzero_location);
-			inc_stats(in->skb, IPSTATS_MIB_INHDRERRORS);
-			return -EINVAL;
+			return ttpcomm_reject(in->skb, ICMPERR_HDR_FIELD, nonzero_location);
 		}
 	}
 
-	ip6_frag_hdr = get_extension_header(ip6_hdr, NEXTHDR_FRAGMENT);
-	if (ip6_frag_hdr) {
+	ip6_frag_hdr = is_inner_pkt(in)
+			? get_extension_header(ip6_hdr, NEXTHDR_FRAGMENT)
+			: skb_frag_hdr(in->skb);
+	if (unlikely(ip6_frag_hdr)) {
 		__u16 ipv6_fragment_offset = get_fragment_offset_ipv6(ip6_frag_hdr);
 		__u16 ipv6_m = is_more_fragments_set_ipv6(ip6_frag_hdr);
 
-		struct hdr_iterator iterator = HDR_ITERATOR_INIT(ip6_hdr);
-		hdr_iterator_last(&iterator);
-
 		/* No need to override tot_len, because our way already takes the frag hdr into account. */
 		ip4_hdr->id = generate_ipv4_id_dofrag(ip6_frag_hdr);
 		ip4_hdr->frag_off = build_ipv4_frag_off_field(0, ipv6_m, ipv6_fragment_offset);
@@ -230,8 +275,15 @@ int ttp64_ipv4(struct tuple *tuple4, struct pkt_parts *in, struct pkt_parts *out
 		 * This kinda contradicts the RFC.
 		 * But following its logic, if the last extension header says ICMPv6 it wouldn't be switched
 		 * to ICMPv4.
+		 * (Outer packets' protocol was already computed that way, out of their control buffer.)
 		 */
-		ip4_hdr->protocol = (iterator.hdr_type == NEXTHDR_ICMP) ? IPPROTO_ICMP : iterator.hdr_type;
+		if (is_inner_pkt(in)) {
+			struct hdr_iterator iterator = HDR_ITERATOR_INIT(ip6_hdr);
+			hdr_iterator_last(&iterator);
+			ip4_hdr->protocol = (iterator.hdr_type == NEXTHDR_ICMP)
+					? IPPROTO_ICMP
+					: iterator.hdr_type;
+		}
 	}
 
 	ip4_hdr->check = 0;
@@ -584,6 +636,57 @@ static int compute_icmp4_csum(struct pkt_parts *out)
 	return 0;
 }
 
+/**
+ * Use this when the ICMP header and the inner packet's headers changed, but the inner packet's
+ * payload did not. Cheaper than compute_icmp4_csum(), which would sum the whole payload.
+ *
+ * The result is only correct if "in_outer"'s checksum was (which is the case if the packet went
+ * through validate_icmp6_csum()) and the message is entirely contained in "in_outer"; see
+ * is_icmp4error_csum_updatable().
+ * The regions involved all start at even offsets, so the payload's contribution is the same in
+ * both messages.
+ */
+static int update_icmp4error_csum(struct pkt_parts *in_outer, struct pkt_parts *in_inner,
+		struct pkt_parts *out_outer)
+{
+	struct ipv6hdr *in_ip6 = in_outer->l3_hdr.ptr;
+	struct icmp6hdr *in_icmp = in_outer->l4_hdr.ptr;
+	struct icmphdr *out_icmp = out_outer->l4_hdr.ptr;
+	struct icmp6hdr copy_hdr;
+	unsigned int in_hdrs_len, out_hdrs_len;
+	__wsum csum, tmp;
+
+	in_hdrs_len = in_inner->l3_hdr.len + in_inner->l4_hdr.len;
+	out_hdrs_len = out_outer->payload.len - in_inner->payload.len;
+
+	csum = ~csum_unfold(in_icmp->icmp6_cksum);
+
+	/* Remove the ICMPv6 pseudo-header, the ICMPv6 header and the inner IPv6 headers. */
+	tmp = ~csum_unfold(csum_ipv6_magic(&in_ip6->saddr, &in_ip6->daddr,
+			in_outer->l4_hdr.len + in_outer->payload.len, NEXTHDR_ICMP, 0));
+	csum = csum_sub(csum, tmp);
+	memcpy(&copy_hdr, in_icmp, sizeof(*in_icmp));
+	copy_hdr.icmp6_cksum = 0;
+	csum = csum_sub(csum, csum_partial(&copy_hdr, sizeof(copy_hdr), 0));
+	csum = csum_sub(csum, csum_partial(in_outer->payload.ptr, in_hdrs_len, 0));
+
+	/* Add the ICMPv4 header and the inner IPv4 headers. There's no ICMPv4 pseudo-header. */
+	out_icmp->checksum = 0;
+	csum = csum_add(csum, csum_partial(out_icmp, sizeof(*out_icmp), 0));
+	csum = csum_add(csum, csum_partial(out_outer->payload.ptr, out_hdrs_len, 0));
+
+	out_icmp->checksum = csum_fold(csum);
+	return 0;
+}
+
+/**
+ * Returns true if update_icmp4error_csum() can be trusted with "in"'s translation.
+ */
+static bool is_icmp4error_csum_updatable(struct pkt_parts *in)
+{
+	return !skb_frag_hdr(in->skb) && in->skb->ip_summed != CHECKSUM_PARTIAL;
+}
+
 static int post_icmp4info(struct pkt_parts *in, struct pkt_parts *out)
 {
 	memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
@@ -607,10 +710,12 @@ static int post_icmp4error(struct tuple *tuple4, struct pkt_parts *in_outer,
 	if (error)
 		return error;
 
-	if (is_csum4_computable(out_outer))
-		error = compute_icmp4_csum(out_outer);
+	if (!is_csum4_computable(out_outer))
+		return 0;
 
-	return error;
+	return is_icmp4error_csum_updatable(in_outer)
+			? update_icmp4error_csum(in_outer, &in_inner, out_outer)
+			: compute_icmp4_csum(out_outer);
 }
 
 /**
@@ -697,31 +802,34 @@ int ttp64_icmp(struct tuple* tuple4, struct pkt_parts *in, struct pkt_parts *out
 	return error;
 }
 
+/**
+ * Returns "csum16" (the checksum of the TCP or UDP header "in_l4_hdr") updated so it is correct
+ * for "out_l4_hdr" (RFC 1624).
+ *
+ * Only the addresses and the ports differ between both packets, so those are the only words this
+ * subtracts and adds. (The pseudoheaders' length and protocol do not change, and the data is the
+ * same.) The ports are the first 32 bits of both TCP and UDP headers.
+ */
 static __sum16 update_csum_6to4(__sum16 csum16,
-		struct ipv6hdr *in_ip6, void *in_l4_hdr, size_t in_l4_hdr_len,
-		struct iphdr *out_ip4, void *out_l4_hdr, size_t out_l4_hdr_len)
+		struct ipv6hdr *in_ip6, void *in_l4_hdr,
+		struct iphdr *out_ip4, void *out_l4_hdr)
 {
-	__wsum csum, pseudohdr_csum;
+	__wsum csum;
+	int i;
 
 	csum = ~csum_unfold(csum16);
 
-	/*
-	 * Regarding the pseudoheaders:
-	 * The length is pretty hard to obtain if there's fragmentation, and whatever it is,
-	 * it's not going to change. Therefore, instead of computing it only to cancel it out with
-	 * itself later, simply sum (and substract) zero.
-	 * Do the same with proto since we're feeling hackish.
-	 */
-
 	/* Remove the IPv6 crap. */
-	pseudohdr_csum = ~csum_unfold(csum_ipv6_magic(&in_ip6->saddr, &in_ip6->daddr, 0, 0, 0));
-	csum = csum_sub(csum, pseudohdr_csum);
-	csum = csum_sub(csum, csum_partial(in_l4_hdr, in_l4_hdr_len, 0));
+	for (i = 0; i < 4; i++) {
+		csum = csum_sub(csum, (__force __wsum) in_ip6->saddr.s6_addr32[i]);
+		csum = csum_sub(csum, (__force __wsum) in_ip6->daddr.s6_addr32[i]);
+	}
+	csum = csum_sub(csum, (__force __wsum) *((__be32 *) in_l4_hdr));
 
 	/* Add the IPv4 crap. */
-	pseudohdr_csum = csum_tcpudp_nofold(out_ip4->saddr, out_ip4->daddr, 0, 0, 0);
-	csum = csum_add(csum, pseudohdr_csum);
-	csum = csum_add(csum, csum_partial(out_l4_hdr, out_l4_hdr_len, 0));
+	csum = csum_add(csum, (__force __wsum) out_ip4->saddr);
+	csum = csum_add(csum, (__force __wsum) out_ip4->daddr);
+	csum = csum_add(csum, (__force __wsum) *((__be32 *) out_l4_hdr));
 
 	return csum_fold(csum);
 }
@@ -730,7 +838,6 @@ int ttp64_tcp(struct tuple *tuple4, struct pkt_parts *in, struct pkt_parts *out)
 {
 	struct tcphdr *tcp_in = in->l4_hdr.ptr;
 	struct tcphdr *tcp_out = out->l4_hdr.ptr;
-	struct tcphdr tcp_copy;
 
 	/* Header */
 	memcpy(tcp_out, tcp_in, in->l4_hdr.len);
@@ -738,17 +845,17 @@ int ttp64_tcp(struct tuple *tuple4, struct pkt_parts *in, struct pkt_parts *out)
 	tcp_out->dest = cpu_to_be16(tuple4->dst.addr4.l4);
 
 	if (is_csum4_computable(out)) {
-		memcpy(&tcp_copy, tcp_in, sizeof(*tcp_in));
-		tcp_copy.check = 0;
-
-		tcp_out->check = 0;
-		tcp_out->check = update_csum_6to4(tcp_in->check,
-				in->l3_hdr.ptr, &tcp_copy, sizeof(tcp_copy),
-				out->l3_hdr.ptr, tcp_out, sizeof(*tcp_out));
+		tcp_out->check = update_csum_6to4(tcp_in->check, in->l3_hdr.ptr, tcp_in,
+				out->l3_hdr.ptr, tcp_out);
+	}
+	if (!is_inner_pkt(in)) {
+		ttpcomm_clamp_mss(tcp_out, in->l4_hdr.len,
+				is_csum4_computable(out) && in->skb->ip_summed != CHECKSUM_PARTIAL);
 	}
 
-	/* Payload */
-	memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
+	/* Payload (unless "out" is "in" being translated in place). */
+	if (out->payload.ptr != in->payload.ptr)
+		memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
 
 	return 0;
 }
@@ -757,7 +864,6 @@ int ttp64_udp(struct tuple *tuple4, struct pkt_parts *in, struct pkt_parts *out)
 {
 	struct udphdr *udp_in = in->l4_hdr.ptr;
 	struct udphdr *udp_out = out->l4_hdr.ptr;
-	struct udphdr udp_copy;
 
 	/* Header */
 	udp_out->source = cpu_to_be16(tuple4->src.addr4.l4);
@@ -765,19 +871,15 @@ int ttp64_udp(struct tuple *tuple4, struct pkt_parts *in, struct pkt_parts *out)
 	udp_out->len = udp_in->len;
 
 	if (is_csum4_computable(out)) {
-		memcpy(&udp_copy, udp_in, sizeof(*udp_in));
-		udp_copy.check = 0;
-
-		udp_out->check = 0;
-		udp_out->check = update_csum_6to4(udp_in->check,
-				in->l3_hdr.ptr, &udp_copy, sizeof(udp_copy),
-				out->l3_hdr.ptr, udp_out, sizeof(*udp_out));
+		udp_out->check = update_csum_6to4(udp_in->check, in->l3_hdr.ptr, udp_in,
+				out->l3_hdr.ptr, udp_out);
 		if (udp_out->check == 0)
 			udp_out->check = CSUM_MANGLED_0;
 	}
 
-	/* Payload */
-	memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
+	/* Payload (unless "out" is "in" being translated in place). */
+	if (out->payload.ptr != in->payload.ptr)
+		memcpy(out->payload.ptr, in->payload.ptr, in->payload.len);
 
 	return 0;
 }
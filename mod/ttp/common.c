@@ -1,7 +1,14 @@
 #include "nat64/mod/ttp/common.h"
 #include "nat64/mod/ttp/4to6.h"
 #include "nat64/mod/ttp/6to4.h"
+#include "nat64/mod/ttp/config.h"
 #include "nat64/mod/send_packet.h"
+#include "nat64/mod/stats.h"
+
+#include <linux/netdevice.h>
+#include <linux/swab.h>
+#include <net/checksum.h>
+#include <net/tcp.h>
 
 static struct translation_steps steps[L3_PROTO_COUNT][L4_PROTO_COUNT];
 
@@ -40,8 +47,108 @@ int ttpcomm_translate_inner_packet(struct tuple *out_tuple, struct pkt_parts *in
 	return 0;
 }
 
+int ttpcomm_reject(struct sk_buff *skb, icmp_error_code error, __u32 info)
+{
+	icmp64_send(skb, error, info);
+	inc_stats(skb, IPSTATS_MIB_INHDRERRORS);
+	return -EINVAL;
+}
+
+/** Returns whether the user wants the MSS of translated TCP SYNs clamped. */
+static bool clamp_mss_enabled(void)
+{
+	bool result;
+	bool locked;
+
+	locked = config_read_lock();
+	result = ttpconfig_get_templates()->clamp_mss;
+	config_read_unlock(locked);
+
+	return result;
+}
+
+/**
+ * Returns the MSS option of the "hdr" TCP header ("hdr_len" bytes long, options included), or
+ * NULL if it doesn't have a (well-formed) one.
+ */
+static __u8 *find_mss(struct tcphdr *hdr, unsigned int hdr_len)
+{
+	__u8 *opt = (__u8 *) (hdr + 1);
+	__u8 *end = ((__u8 *) hdr) + hdr_len;
+
+	while (opt < end) {
+		switch (opt[0]) {
+		case TCPOPT_EOL:
+			return NULL;
+		case TCPOPT_NOP:
+			opt++;
+			continue;
+		}
+
+		if (end - opt < 2 || opt[1] < 2 || end - opt < opt[1])
+			return NULL;
+		if (opt[0] == TCPOPT_MSS && opt[1] == TCPOLEN_MSS)
+			return opt;
+		opt += opt[1];
+	}
+
+	return NULL;
+}
+
+void ttpcomm_clamp_mss(struct tcphdr *hdr, unsigned int hdr_len, bool update_csum)
+{
+	__u8 *opt;
+	__u16 mss, max_mss;
+	__be16 old_field, new_field;
+
+	if (!hdr->syn || !clamp_mss_enabled())
+		return;
+	opt = find_mss(hdr, hdr_len);
+	if (!opt)
+		return;
+
+	mss = (opt[2] << 8) | opt[3];
+	max_mss = sendpkt_ipv6_mtu(NULL) - sizeof(struct ipv6hdr) - sizeof(struct tcphdr);
+	if (mss <= max_mss)
+		return;
+
+	log_debug("Clamping MSS %u to %u.", mss, max_mss);
+	opt[2] = max_mss >> 8;
+	opt[3] = max_mss & 0xFF;
+
+	if (!update_csum)
+		return;
+
+	old_field = cpu_to_be16(mss);
+	new_field = cpu_to_be16(max_mss);
+	/* If the field straddles two of the checksum's 16-bit words, its bytes count swapped. */
+	if ((opt + 2 - (__u8 *) hdr) & 1) {
+		old_field = (__force __be16) swab16((__force __u16) old_field);
+		new_field = (__force __be16) swab16((__force __u16) new_field);
+	}
+	csum_replace2(&hdr->check, old_field, new_field);
+}
+
+struct sk_buff *ttpcomm_alloc_skb(unsigned int len)
+{
+	struct sk_buff *skb;
+
+	/*
+	 * Unlike alloc_skb(), this takes buffers up to a page long from a per-CPU cache of page
+	 * fragments. Small packets (which are the ones that come at high rates) therefore rarely
+	 * need the slab allocator for their data.
+	 */
+	skb = __netdev_alloc_skb(NULL, LL_MAX_HEADER + len, GFP_ATOMIC);
+	if (skb)
+		skb_reserve(skb, LL_MAX_HEADER);
+
+	return skb;
+}
+
 int ttpcomm_init(void)
 {
+	ttp64_init();
+
 	steps[L3PROTO_IPV6][L4PROTO_TCP].skb_create_fn = ttp64_create_skb;
 	steps[L3PROTO_IPV6][L4PROTO_TCP].l3_hdr_fn = ttp64_ipv4;
 	steps[L3PROTO_IPV6][L4PROTO_TCP].l3_payload_fn = ttp64_tcp;
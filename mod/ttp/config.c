@@ -6,18 +6,40 @@
 #include <linux/sort.h>
 
 #include "nat64/comm/constants.h"
+#include "nat64/mod/packet.h"
 #include "nat64/mod/send_packet.h"
 #include "nat64/mod/types.h"
 #include "nat64/mod/ttp/6to4.h"
 #include "nat64/mod/ttp/4to6.h"
 
 static struct translate_config *config;
+/** Always in sync with "config". */
+static struct ttp_templates *templates;
+
+static void build_templates(struct translate_config *config, struct ttp_templates *tmpl)
+{
+	memset(tmpl, 0, sizeof(*tmpl));
+
+	tmpl->hdr4.version = 4;
+	tmpl->hdr4.ihl = 5;
+	if (config->reset_tos)
+		tmpl->hdr4.tos = config->new_tos;
+	if (config->df_always_on)
+		tmpl->hdr4.frag_off = build_ipv4_frag_off_field(1, 0, 0);
+	tmpl->reset_tos = config->reset_tos;
+	tmpl->df_always_on = config->df_always_on;
+	tmpl->build_ipv4_id = config->build_ipv4_id;
+	tmpl->clamp_mss = config->clamp_mss;
+
+	tmpl->hdr6.version = 6;
+	tmpl->reset_traffic_class = config->reset_traffic_class;
+}
 
 int ttpconfig_init(void)
 {
 	__u16 default_plateaus[] = TRAN_DEF_MTU_PLATEAUS;
 
-	config = kmalloc(sizeof(*config), GFP_ATOMIC);
+	config = config_alloc(sizeof(*config), GFP_ATOMIC);
 	if (!config)
 		return -ENOMEM;
 
@@ -27,22 +49,33 @@ int ttpconfig_init(void)
 	config->df_always_on = TRAN_DEF_DF_ALWAYS_ON;
 	config->build_ipv4_id = TRAN_DEF_BUILD_IPV4_ID;
 	config->lower_mtu_fail = TRAN_DEF_LOWER_MTU_FAIL;
+	config->clamp_mss = TRAN_DEF_CLAMP_MSS;
 	config->mtu_plateau_count = ARRAY_SIZE(default_plateaus);
-	config->mtu_plateaus = kmalloc(sizeof(default_plateaus), GFP_ATOMIC);
+	config->mtu_plateaus = config_alloc(sizeof(default_plateaus), GFP_ATOMIC);
 	if (!config->mtu_plateaus) {
 		log_err("Could not allocate memory to store the MTU plateaus.");
-		kfree(config);
+		config_free(config);
 		return -ENOMEM;
 	}
 	memcpy(config->mtu_plateaus, &default_plateaus, sizeof(default_plateaus));
 
+	templates = config_alloc(sizeof(*templates), GFP_ATOMIC);
+	if (!templates) {
+		config_free(config->mtu_plateaus);
+		config_free(config);
+		return -ENOMEM;
+	}
+	build_templates(config, templates);
+
 	return 0;
 }
 
 void ttpconfig_destroy(void)
 {
-	kfree(config->mtu_plateaus);
-	kfree(config);
+	rcu_barrier_bh(); /* Wait for the configurations retired by config_retire(). */
+	config_free(templates);
+	config_free(config->mtu_plateaus);
+	config_free(config);
 }
 
 int ttpconfig_clone(struct translate_config *clone)
@@ -127,7 +160,7 @@ static int update_plateaus(struct translate_config *config, size_t size, void *v
 	size = count * sizeof(*list);
 
 	/* Update. */
-	config->mtu_plateaus = kmalloc(size, GFP_KERNEL);
+	config->mtu_plateaus = config_alloc(size, GFP_KERNEL);
 	if (!config->mtu_plateaus) {
 		log_err("Could not allocate the kernel's MTU plateaus list.");
 		return -ENOMEM;
@@ -142,11 +175,18 @@ int ttpconfig_update(enum translate_type type, size_t size, void *value)
 {
 	struct translate_config *tmp_config;
 	struct translate_config *old_config;
+	struct ttp_templates *tmp_templates;
+	struct ttp_templates *old_templates;
 	int error = -EINVAL;
 
-	tmp_config = kmalloc(sizeof(*tmp_config), GFP_KERNEL);
+	tmp_config = config_alloc(sizeof(*tmp_config), GFP_KERNEL);
 	if (!tmp_config)
 		return -ENOMEM;
+	tmp_templates = config_alloc(sizeof(*tmp_templates), GFP_KERNEL);
+	if (!tmp_templates) {
+		config_free(tmp_config);
+		return -ENOMEM;
+	}
 
 	old_config = config;
 	*tmp_config = *old_config;
@@ -182,6 +222,11 @@ int ttpconfig_update(enum translate_type type, size_t size, void *value)
 			goto fail;
 		tmp_config->lower_mtu_fail = *((__u8 *) value);
 		break;
+	case CLAMP_MSS:
+		if (!expect_u8(size))
+			goto fail;
+		tmp_config->clamp_mss = *((__u8 *) value);
+		break;
 	case MTU_PLATEAUS:
 		error = update_plateaus(tmp_config, size, value);
 		if (error)
@@ -192,17 +237,22 @@ int ttpconfig_update(enum translate_type type, size_t size, void *value)
 		goto fail;
 	}
 
+	build_templates(tmp_config, tmp_templates);
+	old_templates = templates;
+
 	rcu_assign_pointer(config, tmp_config);
-	synchronize_rcu_bh();
+	rcu_assign_pointer(templates, tmp_templates);
 
 	if (old_config->mtu_plateaus != tmp_config->mtu_plateaus)
-		kfree(old_config->mtu_plateaus);
-	kfree(old_config);
+		config_retire(old_config->mtu_plateaus);
+	config_retire(old_config);
+	config_retire(old_templates);
 
 	return 0;
 
 fail:
-	kfree(tmp_config);
+	config_free(tmp_templates);
+	config_free(tmp_config);
 	return error;
 }
 
@@ -210,3 +260,8 @@ struct translate_config *ttpconfig_get(void)
 {
 	return rcu_dereference_bh(config);
 }
+
+struct ttp_templates *ttpconfig_get_templates(void)
+{
+	return rcu_dereference_bh(templates);
+}
@@ -3,9 +3,16 @@
 #include "nat64/mod/ttp/core.h"
 #include "nat64/mod/ttp/common.h"
 #include "nat64/mod/ttp/config.h"
+#include "nat64/mod/ttp/4to6.h"
+#include "nat64/mod/ttp/6to4.h"
 #include "nat64/mod/icmp_wrapper.h"
+#include "nat64/mod/send_packet.h"
 #include "nat64/mod/stats.h"
 
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <net/ip6_checksum.h>
+
 int translate_packet_init(void)
 {
 	int error;
@@ -58,6 +65,68 @@ static int copy_payload(struct pkt_parts *in, struct pkt_parts *out)
 	return 0;
 }
 
+/*
+ * The following four wrap "steps"' functions, calling them directly for the combinations which
+ * carry the bulk of the traffic (IPv4 or IPv6, TCP or UDP). Indirect calls are retpolines on the
+ * kernels which need them, and a few of them per packet add up. ICMP, being rare and having to
+ * also translate inner packets, keeps going through the table.
+ */
+
+static int create_skb(struct translation_steps *steps, struct pkt_parts *in,
+		struct sk_buff **out)
+{
+	switch (in->l3_hdr.proto) {
+	case L3PROTO_IPV6:
+		return ttp64_create_skb(in, out);
+	case L3PROTO_IPV4:
+		return ttp46_create_skb(in, out);
+	}
+
+	return steps->skb_create_fn(in, out);
+}
+
+static int translate_l3_hdr(struct translation_steps *steps, struct tuple *tuple,
+		struct pkt_parts *in, struct pkt_parts *out)
+{
+	switch (in->l3_hdr.proto) {
+	case L3PROTO_IPV6:
+		return ttp64_ipv4(tuple, in, out);
+	case L3PROTO_IPV4:
+		return ttp46_ipv6(tuple, in, out);
+	}
+
+	return steps->l3_hdr_fn(tuple, in, out);
+}
+
+static int translate_l3_payload(struct translation_steps *steps, struct tuple *tuple,
+		struct pkt_parts *in, struct pkt_parts *out)
+{
+	switch (in->l4_hdr.proto) {
+	case L4PROTO_TCP:
+		return (in->l3_hdr.proto == L3PROTO_IPV6)
+				? ttp64_tcp(tuple, in, out)
+				: ttp46_tcp(tuple, in, out);
+	case L4PROTO_UDP:
+		return (in->l3_hdr.proto == L3PROTO_IPV6)
+				? ttp64_udp(tuple, in, out)
+				: ttp46_udp(tuple, in, out);
+	default:
+		return steps->l3_payload_fn(tuple, in, out);
+	}
+}
+
+static int route(struct translation_steps *steps, struct sk_buff *skb)
+{
+	switch (skb_l3_proto(skb)) {
+	case L3PROTO_IPV4:
+		return sendpkt_route4(skb);
+	case L3PROTO_IPV6:
+		return sendpkt_route6(skb);
+	}
+
+	return steps->route_fn(skb);
+}
+
 static verdict translate_fragment(struct tuple *tuple, struct sk_buff *in_skb,
 		struct sk_buff **out_skb, struct dst_entry *dst)
 {
@@ -69,14 +138,14 @@ static verdict translate_fragment(struct tuple *tuple, struct sk_buff *in_skb,
 
 	if (is_error(skb_to_parts(in_skb, &in)))
 		goto fail;
-	if (is_error(steps->skb_create_fn(&in, out_skb)))
+	if (is_error(create_skb(steps, &in, out_skb)))
 		goto fail;
 	if (is_error(skb_to_parts(*out_skb, &out)))
 		goto fail;
-	if (is_error(steps->l3_hdr_fn(tuple, &in, &out)))
+	if (is_error(translate_l3_hdr(steps, tuple, &in, &out)))
 		goto fail;
 	if (skb_has_l4_hdr(in_skb)) {
-		if (is_error(steps->l3_payload_fn(tuple, &in, &out)))
+		if (is_error(translate_l3_payload(steps, tuple, &in, &out)))
 			goto fail;
 	} else {
 		if (is_error(copy_payload(&in, &out)))
@@ -86,7 +155,7 @@ static verdict translate_fragment(struct tuple *tuple, struct sk_buff *in_skb,
 		skb_dst_set(out.skb, dst_clone(dst));
 		out.skb->dev = dst->dev;
 	} else {
-		if (is_error(steps->route_fn(out.skb)))
+		if (is_error(route(steps, out.skb)))
 			goto fail;
 	}
 
@@ -140,3 +209,343 @@ fail:
 	*out_skb = NULL;
 	return VER_DROP;
 }
+
+/**
+ * Largest layer-4 header translating_the_packet_in_place() will handle (a TCP header full of
+ * options).
+ */
+#define MAX_L4_HDR_LEN 60
+
+/**
+ * GSO flags translating_the_packet_in_place() knows how to carry over to the other protocol.
+ */
+#define TRANSLATABLE_GSO_TYPES (SKB_GSO_TCPV4 | SKB_GSO_TCPV6 | SKB_GSO_TCP_ECN | SKB_GSO_DODGY)
+
+/**
+ * Returns true if "skb" is a TCP super-packet (eg. aggregated by GRO) whose segmentation can be
+ * left to the egress device once it's been translated.
+ */
+static bool can_translate_gso(struct sk_buff *skb)
+{
+	if (skb_l4_proto(skb) != L4PROTO_TCP || skb_l4hdr_len(skb) > MAX_L4_HDR_LEN)
+		return false;
+	return !(skb_shinfo(skb)->gso_type & ~TRANSLATABLE_GSO_TYPES);
+}
+
+/**
+ * Returns the offset of the checksum field within the "l4_proto" header.
+ */
+static unsigned int csum_offset(l4_protocol l4_proto)
+{
+	return (l4_proto == L4PROTO_TCP)
+			? offsetof(struct tcphdr, check)
+			: offsetof(struct udphdr, check);
+}
+
+/**
+ * Returns true if "skb"'s checksum is offloaded (CHECKSUM_PARTIAL) in a way which can survive the
+ * translation; ie. it's the TCP or UDP checksum, and covers the whole layer-4 datagram.
+ */
+static bool can_translate_partial_csum(struct sk_buff *skb)
+{
+	if (!skb_has_l4_hdr(skb) || skb_checksum_start_offset(skb) != skb_transport_offset(skb))
+		return false;
+
+	switch (skb_l4_proto(skb)) {
+	case L4PROTO_TCP:
+	case L4PROTO_UDP:
+		return skb->csum_offset == csum_offset(skb_l4_proto(skb));
+	case L4PROTO_ICMP:
+		return false;
+	}
+
+	return false;
+}
+
+static bool can_translate_in_place(struct sk_buff *skb)
+{
+	if (skb->next || skb_shared(skb))
+		return false;
+	if (skb_is_gso(skb))
+		return can_translate_gso(skb);
+	if (skb->ip_summed == CHECKSUM_PARTIAL && !can_translate_partial_csum(skb))
+		return false;
+	if (!skb_has_l4_hdr(skb))
+		return true;
+
+	switch (skb_l4_proto(skb)) {
+	case L4PROTO_TCP:
+	case L4PROTO_UDP:
+		return skb_l4hdr_len(skb) <= MAX_L4_HDR_LEN;
+	case L4PROTO_ICMP:
+		/* ICMP errors change the size of their payload, and infos are not worth the trouble. */
+		return false;
+	}
+
+	return false;
+}
+
+/**
+ * Leaves the pseudo-header checksum in "out"'s TCP or UDP header, so the NIC or the segmentation
+ * code can finish it (see CHECKSUM_PARTIAL).
+ */
+static void set_partial_csum(struct pkt_parts *out)
+{
+	__sum16 *check = out->l4_hdr.ptr + csum_offset(out->l4_hdr.proto);
+	unsigned int len = out->l4_hdr.len + out->payload.len;
+	__u8 proto = (out->l4_hdr.proto == L4PROTO_TCP) ? IPPROTO_TCP : IPPROTO_UDP;
+	struct ipv6hdr *hdr6;
+	struct iphdr *hdr4;
+
+	switch (out->l3_hdr.proto) {
+	case L3PROTO_IPV6:
+		hdr6 = out->l3_hdr.ptr;
+		*check = ~csum_ipv6_magic(&hdr6->saddr, &hdr6->daddr, len, proto, 0);
+		break;
+	case L3PROTO_IPV4:
+		hdr4 = out->l3_hdr.ptr;
+		*check = ~csum_tcpudp_magic(hdr4->saddr, hdr4->daddr, len, proto, 0);
+		break;
+	}
+}
+
+/**
+ * Updates "skb"'s GSO metadata so it describes the "out" version of the packet, whose segments
+ * should carry "gso_size" bytes of payload each.
+ */
+static void translate_gso(struct sk_buff *skb, struct pkt_parts *out, unsigned int gso_size)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	switch (out->l3_hdr.proto) {
+	case L3PROTO_IPV6:
+		shinfo->gso_type = (shinfo->gso_type & ~SKB_GSO_TCPV4) | SKB_GSO_TCPV6;
+		break;
+	case L3PROTO_IPV4:
+		shinfo->gso_type = (shinfo->gso_type & ~SKB_GSO_TCPV6) | SKB_GSO_TCPV4;
+		break;
+	}
+	shinfo->gso_size = gso_size;
+	shinfo->gso_segs = DIV_ROUND_UP(out->payload.len, gso_size);
+}
+
+static unsigned int reserved_space(struct dst_entry *dst)
+{
+#ifndef UNIT_TESTING
+	return LL_RESERVED_SPACE(dst->dev);
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Translates "skb" into "out_tuple"'s protocol in place.
+ * If "tuple4" is not NULL, "skb" is a hairpinned IPv6 packet; it is first translated into IPv4
+ * using "tuple4" on the stack, and that is what gets translated back using "out_tuple".
+ */
+static int translate_in_place(struct tuple *tuple4, struct tuple *out_tuple, struct sk_buff *skb,
+		struct sendpkt_route_cache *cache)
+{
+	struct pkt_parts in;
+	struct pkt_parts mid;
+	struct pkt_parts out;
+	/* What "out" is translated from; "in", unless hairpinning. */
+	struct pkt_parts *prev = &in;
+	struct translation_steps *steps;
+	union {
+		struct iphdr hdr4;
+		__u8 hdr6[sizeof(struct ipv6hdr) + sizeof(struct frag_hdr)];
+	} l3_hdr;
+	__u8 l4_hdr[MAX_L4_HDR_LEN];
+	struct iphdr mid_hdr4;
+	__u8 mid_l4_hdr[MAX_L4_HDR_LEN];
+	struct dst_entry *dst;
+	/* Length of the packet(s) that will actually hit the wire (ie. the segments, on GSO). */
+	unsigned int pkt_len;
+	unsigned int gso_size = 0;
+	bool partial_csum;
+	unsigned int headroom;
+	int offset;
+	int error;
+
+	if (!can_translate_in_place(skb))
+		return -EAGAIN;
+
+	log_debug("Step 4: Translating the Packet (in place)");
+
+	skb_to_parts(skb, &in);
+
+	if (tuple4) {
+		if (in.l3_hdr.proto != L3PROTO_IPV6 || !skb_has_l4_hdr(skb))
+			return -EAGAIN;
+
+		/* The IPv4 version of the packet only ever exists here. */
+		mid = in;
+		mid.l3_hdr.proto = L3PROTO_IPV4;
+		mid.l3_hdr.len = sizeof(mid_hdr4);
+		mid.l3_hdr.ptr = &mid_hdr4;
+		mid.l4_hdr.ptr = mid_l4_hdr;
+
+		steps = ttpcomm_get_steps(L3PROTO_IPV6, in.l4_hdr.proto);
+		error = translate_l3_hdr(steps, tuple4, &in, &mid);
+		if (error)
+			return error;
+		error = translate_l3_payload(steps, tuple4, &in, &mid);
+		if (error)
+			return error;
+
+		prev = &mid;
+	}
+
+	steps = ttpcomm_get_steps(prev->l3_hdr.proto, prev->l4_hdr.proto);
+
+	/* Build the new headers on the stack; the skb stays untouched until we know it's a go. */
+	out = *prev;
+	out.l3_hdr.ptr = &l3_hdr;
+	out.l4_hdr.ptr = l4_hdr;
+
+	switch (prev->l3_hdr.proto) {
+	case L3PROTO_IPV6:
+		out.l3_hdr.proto = L3PROTO_IPV4;
+		out.l3_hdr.len = sizeof(struct iphdr);
+		break;
+	case L3PROTO_IPV4:
+		out.l3_hdr.proto = L3PROTO_IPV6;
+		out.l3_hdr.len = ttp46_l3_hdr_len(prev->l3_hdr.ptr);
+		break;
+	}
+
+	if (skb_is_gso(skb)) {
+		/* Segments which need a fragment header cannot be left to the device. */
+		if (out.l3_hdr.proto == L3PROTO_IPV6 && out.l3_hdr.len != sizeof(struct ipv6hdr))
+			return -EAGAIN;
+		/* The segments must not grow, so they get to carry less payload if the header does. */
+		gso_size = skb_shinfo(skb)->gso_size;
+		if (out.l3_hdr.len > in.l3_hdr.len) {
+			if (gso_size <= out.l3_hdr.len - in.l3_hdr.len)
+				return -EAGAIN;
+			gso_size -= out.l3_hdr.len - in.l3_hdr.len;
+		}
+		pkt_len = out.l3_hdr.len + out.l4_hdr.len + gso_size;
+	} else {
+		pkt_len = out.l3_hdr.len + out.l4_hdr.len + out.payload.len;
+	}
+
+	error = translate_l3_hdr(steps, out_tuple, prev, &out);
+	if (error)
+		return error;
+	if (skb_has_l4_hdr(skb)) {
+		error = translate_l3_payload(steps, out_tuple, prev, &out);
+		if (error)
+			return error;
+	}
+	/*
+	 * Super-packets' checksums are meaningless, and offloaded ones are yet to be computed. Either
+	 * way, somebody down the road will finish them, so translate the pseudo-header's only.
+	 */
+	partial_csum = skb_is_gso(skb) || skb->ip_summed == CHECKSUM_PARTIAL;
+	if (partial_csum)
+		set_partial_csum(&out);
+
+	switch (out.l3_hdr.proto) {
+	case L3PROTO_IPV4:
+		error = sendpkt_route4_cached(skb, &l3_hdr.hdr4, l4_hdr, cache, &dst);
+		if (error)
+			return error;
+#ifndef UNIT_TESTING
+		/* The copy path knows how to answer these with ICMP errors. */
+		if (is_dont_fragment_set(&l3_hdr.hdr4) && pkt_len > dst->dev->mtu) {
+			dst_release(dst);
+			return -EAGAIN;
+		}
+#endif
+		break;
+	case L3PROTO_IPV6:
+		error = sendpkt_route6_cached(skb, (struct ipv6hdr *) &l3_hdr, l4_hdr, cache, &dst);
+		if (error)
+			return error;
+		/*
+		 * sendpkt_send() fragments packets which are too big for the IPv6 side by sharing their
+		 * pages, so those can stay here. The ones which are not allowed to be fragmented (or
+		 * whose checksum is yet to be computed) get the traditional treatment, which knows how
+		 * to answer them.
+		 */
+		if (pkt_len > sendpkt_ipv6_mtu(dst)
+				&& (out.l3_hdr.len == sizeof(struct ipv6hdr)
+				|| is_dont_fragment_set(prev->l3_hdr.ptr)
+				|| partial_csum)) {
+			dst_release(dst);
+			return -EAGAIN;
+		}
+		break;
+	}
+
+	/* Point of no return; rewrite the skb. */
+	headroom = reserved_space(dst);
+	if (out.l3_hdr.len > in.l3_hdr.len)
+		headroom += out.l3_hdr.len - in.l3_hdr.len;
+	/* GSO metadata lives in the shared info, which clones share. */
+	if ((skb_is_gso(skb) && skb_cloned(skb) && pskb_expand_head(skb, 0, 0, GFP_ATOMIC))
+			|| skb_cow_head(skb, headroom)) {
+		dst_release(dst);
+		inc_stats(skb, IPSTATS_MIB_INDISCARDS);
+		return -ENOMEM;
+	}
+
+	/* skb_cow_head() might have moved the data around, so only trust offsets from here on. */
+	offset = skb_transport_offset(skb) - (int) out.l3_hdr.len;
+	if (offset >= 0)
+		__skb_pull(skb, offset);
+	else
+		__skb_push(skb, -offset);
+	skb_reset_network_header(skb);
+	skb_reset_mac_header(skb);
+
+	memcpy(skb_network_header(skb), &l3_hdr, out.l3_hdr.len);
+	memcpy(skb_transport_header(skb), l4_hdr, out.l4_hdr.len);
+
+	skb_dst_drop(skb);
+	skb_dst_set(skb, dst);
+	if (dst)
+		skb->dev = dst->dev;
+	nf_reset(skb);
+	if (skb_is_gso(skb))
+		translate_gso(skb, &out, gso_size);
+	if (partial_csum) {
+		skb->ip_summed = CHECKSUM_PARTIAL;
+		skb->csum_start = skb_transport_header(skb) - skb->head;
+		skb->csum_offset = csum_offset(out.l4_hdr.proto);
+	} else {
+		skb->ip_summed = CHECKSUM_NONE;
+	}
+
+	if (out.l3_hdr.proto == L3PROTO_IPV6) {
+		skb->protocol = htons(ETH_P_IPV6);
+		skb_set_jcb(skb, L3PROTO_IPV6, out.l4_hdr.proto,
+				skb_transport_header(skb) + out.l4_hdr.len,
+				(out.l3_hdr.len > sizeof(struct ipv6hdr))
+						? ((struct frag_hdr *) (ipv6_hdr(skb) + 1))
+						: NULL,
+				skb_original_skb(skb));
+	} else {
+		skb->protocol = htons(ETH_P_IP);
+		skb_set_jcb(skb, L3PROTO_IPV4, out.l4_hdr.proto,
+				skb_transport_header(skb) + out.l4_hdr.len, NULL,
+				skb_original_skb(skb));
+	}
+
+	log_debug("Done step 4.");
+	return 0;
+}
+
+int translating_the_packet_in_place(struct tuple *out_tuple, struct sk_buff *skb,
+		struct sendpkt_route_cache *cache)
+{
+	return translate_in_place(NULL, out_tuple, skb, cache);
+}
+
+int translating_the_hairpin_in_place(struct tuple *tuple4, struct tuple *tuple6,
+		struct sk_buff *skb, struct sendpkt_route_cache *cache)
+{
+	return translate_in_place(tuple4, tuple6, skb, cache);
+}
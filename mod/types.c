@@ -4,6 +4,9 @@
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 #include <net/ipv6.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
 
 
 bool ipv4_addr_equals(const struct in_addr *expected, const struct in_addr *actual)
@@ -74,6 +77,20 @@ bool ipv6_prefix_equals(const struct ipv6_prefix *expected, const struct ipv6_pr
 	return true;
 }
 
+bool ipv4_prefix_equals(const struct ipv4_prefix *expected, const struct ipv4_prefix *actual)
+{
+	if (expected == actual)
+		return true;
+	if (expected == NULL || actual == NULL)
+		return false;
+	if (expected->address.s_addr != actual->address.s_addr)
+		return false;
+	if (expected->len != actual->len)
+		return false;
+
+	return true;
+}
+
 bool is_icmp6_info(__u8 type)
 {
 	return (type == ICMPV6_ECHO_REQUEST) || (type == ICMPV6_ECHO_REPLY);
@@ -124,3 +141,75 @@ void log_tuple(struct tuple *tuple)
 		break;
 	}
 }
+
+/**
+ * Prepended to every configuration config_alloc() hands out, so retiring one never has to allocate
+ * (and therefore never has to fall back to waiting for the grace period).
+ */
+struct config_header {
+	struct rcu_head rcu;
+} __aligned(ARCH_KMALLOC_MINALIGN);
+
+static struct config_header *config_to_header(void *ptr)
+{
+	return ((struct config_header *) ptr) - 1;
+}
+
+void *config_alloc(size_t size, gfp_t flags)
+{
+	struct config_header *header;
+
+	header = kmalloc(sizeof(*header) + size, flags);
+	return header ? (header + 1) : NULL;
+}
+
+void config_free(void *ptr)
+{
+	if (ptr)
+		kfree(config_to_header(ptr));
+}
+
+static void free_retired_config(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct config_header, rcu));
+}
+
+void config_retire(void *ptr)
+{
+	if (ptr)
+		call_rcu_bh(&config_to_header(ptr)->rcu, free_retired_config);
+}
+
+static int nodes[SHARD_NODES_MAX];
+static unsigned int node_count;
+
+int shard_nodes_init(int *nodes_requested, unsigned int count)
+{
+	unsigned int i;
+
+	if (count > SHARD_NODES_MAX) {
+		log_err("The shard-to-node map can't have more than %u entries.", SHARD_NODES_MAX);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (nodes_requested[i] < 0 || nodes_requested[i] >= MAX_NUMNODES
+				|| !node_online(nodes_requested[i])) {
+			log_err("NUMA node %d does not exist or is offline.", nodes_requested[i]);
+			return -EINVAL;
+		}
+		nodes[i] = nodes_requested[i];
+	}
+	node_count = count;
+
+	return 0;
+}
+
+int shard_node(unsigned int index)
+{
+	if (node_count)
+		return nodes[index % node_count];
+	if (index < nr_cpu_ids && cpu_possible(index))
+		return cpu_to_node(index);
+	return NUMA_NO_NODE;
+}
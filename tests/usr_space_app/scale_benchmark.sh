@@ -0,0 +1,151 @@
+#!/bin/bash
+
+# Times the userspace app against large tables:
+#
+#	- loading POOL4_ADDRS pool4 addresses and BIB_COUNT static BIB entries (--file),
+#	- loading SESSION_COUNT sessions (--sync --add, the way a peer would install them),
+#	- dumping and counting the BIB and the sessions,
+#	- removing POOL4_REMOVALS pool4 addresses one by one (each one purges its BIB entries and
+#	  sessions), and flushing the rest.
+#
+# The module is inserted with lock_timing, so every operation also reports the longest the BIB,
+# session and pool4 locks have been held so far; that is how long the operation might have stalled
+# the packets. (They are running maximums; an operation which did not raise them stalled the
+# packets for less than whatever raised them first.)
+#
+# Results are printed, and saved to $LOGS_DIR, as CSV: one line per operation.
+#
+# Every size can be overridden from the environment. Eg.
+#	$ SESSION_COUNT=100000 ./scale_benchmark.sh
+
+# Load environment configuration
+source environment.sh
+
+JOOL=${JOOL:-"$WORK_DIR/src/jool"}
+POOL4_ADDRS=${POOL4_ADDRS:-10000}
+BIB_COUNT=${BIB_COUNT:-100000}
+SESSION_COUNT=${SESSION_COUNT:-1000000}
+POOL4_REMOVALS=${POOL4_REMOVALS:-100}
+
+POOL6="64:ff9b::/96"
+# Pool4 address $i is 198.18.0.0/15 (the benchmarking block) + 1 + $i.
+# Static BIB entry $i is 2001:db8:b::$i#1000, masked as address $i % POOL4_ADDRS, ports 1024+.
+# Session $i is 2001:db8:5::$i#2000 -> 203.0.113.1#80, masked as address $i % POOL4_ADDRS,
+# ports 4096+.
+
+POSTFIX=`date +%F_%T`
+mkdir -p "$LOGS_DIR"
+OUTPUT="$LOGS_DIR/`basename $0 .sh`_$POSTFIX.csv"
+TMP_DIR=`mktemp -d`
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+if [ $POOL4_ADDRS -lt 1 ] || [ $POOL4_ADDRS -gt 131070 ]; then
+	echo "POOL4_ADDRS must be between 1 and 131070." >&2
+	exit 1
+fi
+if [ $((BIB_COUNT / POOL4_ADDRS)) -ge 3072 ] || [ $((SESSION_COUNT / POOL4_ADDRS)) -ge 61440 ]; then
+	echo "Not enough pool4 addresses for that many BIB entries or sessions." >&2
+	exit 1
+fi
+
+function pool4_addr() {
+	set -- $(($1 + 1))
+	echo "198.$((18 + $1 / 65536)).$(($1 / 256 % 256)).$(($1 % 256))"
+}
+
+function lock_hold_max() {
+	# The rows of the lock table are the only ones with six columns.
+	"$JOOL" --stats | awk -v lock="$1" '$1 == lock && NF == 6 { print $6 }'
+}
+
+###
+# Runs the rest of the arguments as a command (stdin included, stdout discarded), timing it.
+# $1 is the name of the operation, $2 the number of entries it handles.
+#
+function measure() {
+	local name="$1"
+	local entries="$2"
+	local start end status
+	shift 2
+
+	start=`date +%s%N`
+	"$@" > /dev/null
+	status=$?
+	end=`date +%s%N`
+
+	echo "$name,$entries,$(($end - $start)),$status,`lock_hold_max BIB`,`lock_hold_max Session`,`lock_hold_max Pool4`" \
+			| tee -a "$OUTPUT"
+}
+
+function generate_pool4_file() {
+	for i in `seq 0 $(($POOL4_ADDRS - 1))`; do
+		echo "pool4 `pool4_addr $i`"
+	done > "$TMP_DIR/pool4.txt"
+}
+
+function generate_bib_file() {
+	awk -v count=$BIB_COUNT -v addrs=$POOL4_ADDRS 'BEGIN {
+		for (i = 0; i < count; i++) {
+			a = i % addrs + 1;
+			printf "bib udp 2001:db8:b::%x:%x#1000 198.%d.%d.%d#%d\n", int(i / 65536), i % 65536,
+					18 + int(a / 65536), int(a / 256) % 256, a % 256, 1024 + int(i / addrs);
+		}
+	}' > "$TMP_DIR/bib.txt"
+}
+
+# struct dbevent_usr, as x86_64 lays it out (80 bytes, ports in host byte order):
+# type, l4_proto, state, remote6, local6, local4, remote4, packets, bytes.
+function generate_session_stream() {
+	perl -e '
+		my ($count, $addrs) = @ARGV;
+		my $local6 = pack("n6 C4", 0x64, 0xff9b, 0, 0, 0, 0, 203, 0, 113, 1);
+		my $remote4 = pack("C4", 203, 0, 113, 1);
+		for (my $i = 0; $i < $count; $i++) {
+			my $a = $i % $addrs + 1;
+			print pack("C C C x a16 S x2 a16 S x2 a4 S x2 a4 S x2 x4 Q Q",
+					3, 1, 0,
+					pack("n6 N", 0x2001, 0xdb8, 5, 0, 0, 0, $i), 2000,
+					$local6, 80,
+					pack("C4", 198, 18 + int($a / 65536), int($a / 256) % 256,
+							$a % 256), 4096 + int($i / $addrs),
+					$remote4, 80,
+					0, 0);
+		}
+	' $SESSION_COUNT $POOL4_ADDRS > "$TMP_DIR/sessions.bin"
+}
+
+function remove_pool4_addrs() {
+	for i in `seq 0 $(($POOL4_REMOVALS - 1))`; do
+		"$JOOL" --pool4 --remove --address `pool4_addr $i` || return 1
+	done
+}
+
+echo "Generating the tables..."
+generate_pool4_file
+generate_bib_file
+generate_session_stream
+
+echo "Inserting the module..."
+[ "`lsmod | grep '^jool '`" ] && sudo rmmod jool
+sudo insmod "$MOD_DIR/jool.ko" lock_timing=1 || exit 1
+"$JOOL" --pool6 --add --prefix $POOL6 > /dev/null || exit 1
+
+echo "operation,entries,nanoseconds,status,bib_lock_hold_max_ns,session_lock_hold_max_ns,pool4_lock_hold_max_ns" \
+		| tee "$OUTPUT"
+
+measure pool4_load $POOL4_ADDRS "$JOOL" --file "$TMP_DIR/pool4.txt"
+measure bib_load $BIB_COUNT "$JOOL" --file "$TMP_DIR/bib.txt"
+measure session_load $SESSION_COUNT "$JOOL" --sync --add < "$TMP_DIR/sessions.bin"
+
+measure pool4_display $POOL4_ADDRS "$JOOL" --pool4 --display
+measure bib_display $(($BIB_COUNT + $SESSION_COUNT)) "$JOOL" --bib --display --udp --numeric
+measure session_display $SESSION_COUNT "$JOOL" --session --display --udp --numeric
+measure pool4_count $POOL4_ADDRS "$JOOL" --pool4 --count
+measure bib_count $(($BIB_COUNT + $SESSION_COUNT)) "$JOOL" --bib --count --udp
+measure session_count $SESSION_COUNT "$JOOL" --session --count --udp
+
+measure pool4_remove $POOL4_REMOVALS remove_pool4_addrs
+measure pool4_flush $(($POOL4_ADDRS - $POOL4_REMOVALS)) "$JOOL" --pool4 --flush
+
+sudo rmmod jool
+echo "Results saved to $OUTPUT."
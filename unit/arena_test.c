@@ -0,0 +1,135 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "nat64/unit/unit_test.h"
+#include "arena.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Arena module test");
+
+
+/* Large enough to need several chunks. */
+#define CAPACITY 100000
+#define SIZE 192
+
+static bool test_exhaustion(void)
+{
+	struct arena arena;
+	void **objs;
+	void *obj;
+	u32 i;
+	bool success = true;
+
+	objs = vmalloc(CAPACITY * sizeof(*objs));
+	if (!objs)
+		return false;
+	if (is_error(arena_init(&arena, SIZE, 1, CAPACITY))) {
+		vfree(objs);
+		return false;
+	}
+
+	for (i = 0; i < CAPACITY; i++) {
+		objs[i] = arena_alloc(&arena);
+		if (!objs[i]) {
+			success &= assert_not_null(objs[i], "Allocation within capacity");
+			goto end;
+		}
+		/* Make sure every object really is SIZE bytes long. */
+		memset(objs[i], 0x55, SIZE);
+	}
+	success &= assert_null(arena_alloc(&arena), "Allocation beyond capacity");
+	success &= assert_equals_u32(0, arena.available, "Available after exhaustion");
+
+	arena_free(&arena, objs[CAPACITY / 2]);
+	obj = arena_alloc(&arena);
+	success &= assert_equals_ptr(objs[CAPACITY / 2], obj, "The returned object is reused");
+	success &= assert_null(arena_alloc(&arena), "Exhausted again");
+
+	for (i = 0; i < CAPACITY; i++)
+		arena_free(&arena, objs[i]);
+	success &= assert_equals_u32(CAPACITY, arena.available, "Available after returning all");
+
+	/* Index/address translation, through every chunk. */
+	for (i = 0; i < CAPACITY; i += 997)
+		success &= assert_equals_u32(i, obj_to_index(&arena, index_to_obj(&arena, i)),
+				"Index round trip");
+	success &= assert_equals_u32(ARENA_NONE, obj_to_index(&arena, objs), "Foreign pointer");
+	success &= assert_equals_u32(ARENA_NONE, obj_to_index(&arena, objs[0] + 1),
+			"Misaligned pointer");
+
+end:
+	arena_destroy(&arena);
+	vfree(objs);
+	return success;
+}
+
+static bool test_small(void)
+{
+	struct arena arena;
+	void *obj1, *obj2;
+	bool success = true;
+
+	success &= assert_equals_int(-EINVAL, arena_init(&arena, SIZE, 1, 0), "Zero capacity");
+
+	if (is_error(arena_init(&arena, SIZE, 1, 1)))
+		return false;
+	success &= assert_equals_u32(1, arena.chunk_count, "One object needs one chunk");
+	success &= assert_equals_u32(0, arena.chunks[0].order, "... of one page");
+
+	obj1 = arena_alloc(&arena);
+	obj2 = arena_alloc(&arena);
+	success &= assert_not_null(obj1, "First allocation");
+	success &= assert_null(obj2, "Second allocation");
+
+	arena_free(&arena, obj1);
+	arena_destroy(&arena);
+	return success;
+}
+
+static bool test_alignment(void)
+{
+	struct arena arena;
+	void *obj;
+	u32 i;
+	bool success = true;
+
+	success &= assert_equals_int(-EINVAL, arena_init(&arena, 184, 48, 16), "Odd alignment");
+
+	/* Spans a few chunks, so every chunk's start is covered too. */
+	if (is_error(arena_init(&arena, 184, 64, CAPACITY)))
+		return false;
+	success &= assert_equals_u64(192, arena.size, "Size rounded up to the alignment");
+
+	for (i = 0; i < CAPACITY; i++) {
+		obj = arena_alloc(&arena);
+		if (!obj) {
+			success &= assert_not_null(obj, "Allocation within capacity");
+			break;
+		}
+		if (((unsigned long) obj) % 64) {
+			success &= assert_equals_u64(0, ((unsigned long) obj) % 64, "Alignment");
+			break;
+		}
+	}
+
+	arena_destroy(&arena);
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("Arena");
+
+	CALL_TEST(test_exhaustion(), "Exhaustion and reuse");
+	CALL_TEST(test_small(), "Tiny arenas");
+	CALL_TEST(test_alignment(), "Aligned objects");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,107 @@
+#!/bin/bash
+
+# Compares the "Benchmark: result" lines (see bench_report()) of two runs, and reports every metric
+# which got worse than the threshold allows.
+#
+# Usage: ./compare.sh [-t <threshold>] <baseline> <current>
+#
+# <baseline> and <current> are whatever the -run targets printed, saved to files. Eg.
+#	$ sudo dmesg -C; make db-run ARGS="entries=1000000" > baseline.txt
+#	(apply the change, rebuild)
+#	$ sudo dmesg -C; make db-run ARGS="entries=1000000" > current.txt
+#	$ ./compare.sh -t 10 baseline.txt current.txt
+#
+# Records are paired by name, so both runs need the same module arguments. If a name appears more
+# than once in a file, the last one wins.
+#
+# <threshold> is a percentage (default 5). ops_per_s regresses when it drops by more than that; the
+# rest of the metrics (nanoseconds and bytes) regress when they grow by more than that. max_ns is
+# printed but never counts as a regression; a single preemption is enough to move it.
+#
+# Exits 1 if anything regressed, 2 on bad usage.
+
+THRESHOLD=5
+
+while getopts "t:" OPT; do
+	case $OPT in
+	t)
+		THRESHOLD=$OPTARG
+		;;
+	*)
+		exit 2
+		;;
+	esac
+done
+shift $(($OPTIND - 1))
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 [-t <threshold>] <baseline> <current>" >&2
+	exit 2
+fi
+
+awk -v threshold="$THRESHOLD" '
+	function parse(file_index,    name, fields, i, pair) {
+		if (!match($0, /name="[^"]*"/))
+			return;
+		name = substr($0, RSTART + 6, RLENGTH - 7);
+		if (file_index == 2 && !(name in order_seen)) {
+			order_seen[name] = 1;
+			order[++order_count] = name;
+		}
+
+		split(substr($0, RSTART + RLENGTH), fields, " ");
+		for (i in fields) {
+			split(fields[i], pair, "=");
+			if (pair[2] != "")
+				values[file_index, name, pair[1]] = pair[2];
+		}
+	}
+
+	FNR == 1 { file_index++ }
+	/Benchmark: result / { parse(file_index) }
+
+	END {
+		metric_count = split("ns_per_op ops_per_s p50_ns p99_ns p999_ns max_ns bytes",
+				metrics, " ");
+
+		for (n = 1; n <= order_count; n++) {
+			name = order[n];
+			for (m = 1; m <= metric_count; m++) {
+				metric = metrics[m];
+				if (!((2, name, metric) in values))
+					continue;
+				current = values[2, name, metric];
+				if (!((1, name, metric) in values)) {
+					printf "%s: %s: %s (no baseline)\n", name, metric, current;
+					continue;
+				}
+				baseline = values[1, name, metric];
+
+				change = 0;
+				if (baseline != 0)
+					change = (current - baseline) * 100 / baseline;
+				worse = (metric == "ops_per_s") ? -change : change;
+				verdict = "";
+				if (metric != "max_ns" && worse > threshold) {
+					verdict = "  REGRESSION";
+					regressions++;
+				}
+				printf "%s: %s: %s -> %s (%+.1f%%)%s\n", name, metric,
+						baseline, current, change, verdict;
+			}
+		}
+
+		for (key in values) {
+			split(key, parts, SUBSEP);
+			if (parts[1] == 1 && !(parts[2] in order_seen) &&
+					!(parts[2] in missing)) {
+				missing[parts[2]] = 1;
+				printf "%s: missing from the current run.\n", parts[2];
+			}
+		}
+
+		printf "%u record(s) compared, %u regression(s) beyond %s%%.\n", order_count,
+				regressions, threshold;
+		exit regressions ? 1 : 0;
+	}
+' "$1" "$2"
@@ -0,0 +1,524 @@
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/benchmark.h"
+
+#include "nat64/comm/constants.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/mod/pool6.h"
+#include "nat64/mod/pool4.h"
+#include "nat64/mod/pkt_queue.h"
+#include "nat64/mod/bib_db.h"
+#include "nat64/mod/session_db.h"
+
+/**
+ * @file
+ * Fills the BIB and the session database with "entries" UDP entries, and times:
+ *
+ * - BIB entry creation through bibdb_get_or_create_ipv6() (ie. allocate_transport_address() and
+ *   the insertion),
+ * - sessiondb_add(),
+ * - bibdb_get_by_ipv4() and sessiondb_get(), in rounds of 1, 2, 4... threads up to "threads",
+ * - and, if "expire" is set, the expirers' sweep (this takes a little over UDP_MIN seconds).
+ *
+ * The insertions run on "threads" threads at once, each one adding its own share of the entries.
+ * The memory footprint of the entries is printed too.
+ */
+
+static unsigned int entries = 100000;
+module_param(entries, uint, 0);
+MODULE_PARM_DESC(entries, "Number of BIB entries (and sessions) in the database.");
+
+static unsigned int threads = 0;
+module_param(threads, uint, 0);
+MODULE_PARM_DESC(threads, "Threads of the insertions and the last lookup round. "
+		"Zero means one per online CPU.");
+
+static unsigned int lookups = 1000000;
+module_param(lookups, uint, 0);
+MODULE_PARM_DESC(lookups, "Number of lookups in every lookup round.");
+
+static bool expire = false;
+module_param(expire, bool, 0);
+MODULE_PARM_DESC(expire, "Also wait for the sessions to expire and time the expirers.");
+
+#define NAT64_POOL6 "64:ff9b::"
+/** The pool4 addresses are taken from the benchmarking range, starting here. */
+#define POOL4_FIRST "198.18.0.1"
+/** Ports per pool4 address the benchmark counts on; leaves room for parity and range quirks. */
+#define PORTS_PER_ADDR 16384
+#define CLIENT_ADDR "2001:db8::"
+#define CLIENT_PORT 2000
+#define SERVER_ADDR4 "203.0.113.1"
+#define SERVER_PORT 80
+#define ENTRIES_MAX 10000000
+
+/** Lookups visit the entries in this stride, so consecutive lookups don't share cache lines. */
+#define LOOKUP_STRIDE 1000003ULL
+/** Workloads yield the CPU every this many operations, so they don't trip the watchdogs. */
+#define RESCHED_INTERVAL 256
+
+/** The BIB entries, in creation order. Each one holds a reference. */
+static struct bib_entry **bibs;
+static struct ipv6_transport_addr local6;
+static struct ipv4_transport_addr remote4;
+
+/**
+ * Per-thread failure counters; any nonzero value means the benchmark measured the wrong thing.
+ */
+static struct thread_errors {
+	unsigned int count;
+} ____cacheline_aligned_in_smp *errors;
+
+/**
+ * Leaves in "first" and "last" the range of entries the "index"th of "count" threads handles.
+ */
+static void get_share(unsigned int index, unsigned int count, unsigned int *first,
+		unsigned int *last)
+{
+	*first = (u64) entries * index / count;
+	*last = (u64) entries * (index + 1) / count;
+}
+
+static unsigned int lookup_index(unsigned int thread, unsigned int i)
+{
+	u32 result;
+	div_u64_rem((u64) (thread + i) * LOOKUP_STRIDE, entries, &result);
+	return result;
+}
+
+static void init_remote6(unsigned int index, struct ipv6_transport_addr *remote6)
+{
+	str_to_addr6(CLIENT_ADDR, &remote6->l3);
+	remote6->l3.s6_addr32[3] = cpu_to_be32(index + 1);
+	remote6->l4 = CLIENT_PORT;
+}
+
+static void errors_reset(void)
+{
+	memset(errors, 0, num_online_cpus() * sizeof(*errors));
+}
+
+static unsigned int errors_count(void)
+{
+	unsigned int result = 0;
+	unsigned int i;
+
+	for (i = 0; i < num_online_cpus(); i++)
+		result += errors[i].count;
+	return result;
+}
+
+static void bib_create_fn(unsigned int index, void *arg)
+{
+	unsigned int count = *((unsigned int *) arg);
+	struct tuple tuple6;
+	unsigned int first, last, i;
+
+	get_share(index, count, &first, &last);
+
+	memset(&tuple6, 0, sizeof(tuple6));
+	tuple6.dst.addr6 = local6;
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = L4PROTO_UDP;
+
+	for (i = first; i < last; i++) {
+		init_remote6(i, &tuple6.src.addr6);
+		if (bibdb_get_or_create_ipv6(NULL, &tuple6, &bibs[i]) != 0) {
+			bibs[i] = NULL;
+			errors[index].count++;
+		}
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+static void session_add_fn(unsigned int index, void *arg)
+{
+	unsigned int count = *((unsigned int *) arg);
+	struct session_entry *session;
+	struct ipv6_transport_addr remote6;
+	unsigned int first, last, i;
+
+	get_share(index, count, &first, &last);
+
+	for (i = first; i < last; i++) {
+		if (!bibs[i])
+			continue;
+
+		bib_ipv6(bibs[i], &remote6);
+		session = session_create(&remote6, &local6, &bibs[i]->ipv4, &remote4,
+				L4PROTO_UDP, bibs[i]);
+		if (!session || sessiondb_add(session, SESSIONTIMER_UDP) != 0)
+			errors[index].count++;
+		if (session)
+			session_return(session);
+
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+static void bib_lookup_fn(unsigned int index, void *arg)
+{
+	unsigned int count = *((unsigned int *) arg);
+	unsigned int ops = lookups / count;
+	struct bib_entry *bib, *expected;
+	unsigned int i;
+
+	for (i = 0; i < ops; i++) {
+		expected = bibs[lookup_index(index, i)];
+		if (!expected)
+			continue;
+
+		if (bibdb_get_by_ipv4(&expected->ipv4, L4PROTO_UDP, &bib) == 0)
+			bib_return(bib);
+		else
+			errors[index].count++;
+
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+static void session_lookup_fn(unsigned int index, void *arg)
+{
+	unsigned int count = *((unsigned int *) arg);
+	unsigned int ops = lookups / count;
+	struct session_entry *session;
+	struct tuple tuple6;
+	unsigned int i;
+
+	memset(&tuple6, 0, sizeof(tuple6));
+	tuple6.dst.addr6 = local6;
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = L4PROTO_UDP;
+
+	for (i = 0; i < ops; i++) {
+		init_remote6(lookup_index(index, i), &tuple6.src.addr6);
+
+		if (sessiondb_get(&tuple6, &session) == 0)
+			session_return(session);
+		else
+			errors[index].count++;
+
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+/**
+ * Runs "fn" on "count" threads and prints the result. "ops" is the total number of operations the
+ * threads perform.
+ */
+static int measure(char *name, bench_fn fn, unsigned int count, unsigned int ops,
+		u64 *mops)
+{
+	struct bench_result result;
+	struct bench_record record;
+	char record_name[64];
+	unsigned int failed;
+	int error;
+
+	errors_reset();
+	error = bench_run(count, fn, &count, &result);
+	if (error)
+		return error;
+
+	*mops = bench_mops(ops, result.wall_ns);
+	log_info("Benchmark: %s, %u thread(s): %u ops in %llu ns; %llu.%02llu Mops/s, %llu ns/op.",
+			name, count, ops, result.wall_ns, BENCH_HUNDREDTHS(*mops),
+			div64_u64(result.busy_ns, ops ? ops : 1));
+
+	failed = errors_count();
+	if (failed)
+		log_info("Benchmark: Warning: %u operations failed.", failed);
+
+	snprintf(record_name, sizeof(record_name), "db %s, %u thread(s)", name, count);
+	memset(&record, 0, sizeof(record));
+	record.name = record_name;
+	record.ops = ops;
+	record.wall_ns = result.wall_ns;
+	record.busy_ns = result.busy_ns;
+	bench_report(&record);
+
+	return 0;
+}
+
+static int measure_lookups(char *name, bench_fn fn, unsigned int max_threads)
+{
+	unsigned int count;
+	u64 mops, base_mops = 0;
+	int error;
+
+	for (count = 1; count <= max_threads; count = bench_next_round(count, max_threads)) {
+		error = measure(name, fn, count, lookups / count * count, &mops);
+		if (error)
+			return error;
+
+		if (count == 1)
+			base_mops = mops;
+		else if (base_mops)
+			log_info("Benchmark: %s, scaling with %u threads: x%llu.%02llu.", name, count,
+					BENCH_HUNDREDTHS(div64_u64(mops * 100, base_mops)));
+	}
+
+	return 0;
+}
+
+static void report_footprint(char *name, size_t bytes)
+{
+	struct bench_record record;
+
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.bytes = bytes;
+	bench_report(&record);
+}
+
+static void print_footprint(void)
+{
+	struct session_entry *session;
+	struct ipv6_transport_addr remote6;
+
+	if (!bibs[0])
+		return;
+	log_info("Benchmark: BIB entry: %zu bytes (%zu allocated).",
+			sizeof(struct bib_entry), ksize(bibs[0]));
+	report_footprint("db BIB entry", ksize(bibs[0]));
+
+	bib_ipv6(bibs[0], &remote6);
+	session = session_create(&remote6, &local6, &bibs[0]->ipv4, &remote4,
+			L4PROTO_UDP, NULL);
+	if (!session)
+		return;
+	log_info("Benchmark: Session entry: %zu bytes (%zu allocated).",
+			sizeof(struct session_entry), ksize(session));
+	report_footprint("db session entry", ksize(session));
+	session_return(session);
+}
+
+/**
+ * Waits for the expirers to kill every session, and prints how long they spent doing it.
+ */
+static int measure_expiration(void)
+{
+	struct sessiondb_stats before, after;
+	struct bench_record record;
+	unsigned long deadline;
+	__u64 count;
+	__u64 expired;
+	int error;
+
+	sessiondb_get_stats(&before);
+	log_info("Benchmark: Waiting for the sessions to expire...");
+
+	deadline = jiffies + msecs_to_jiffies(3 * 1000 * UDP_MIN);
+	do {
+		msleep(500);
+		error = sessiondb_count(L4PROTO_UDP, &count);
+		if (error)
+			return error;
+	} while (count && time_before(jiffies, deadline));
+
+	sessiondb_get_stats(&after);
+	expired = after.sessions_expired - before.sessions_expired;
+	log_info("Benchmark: Expirers: %llu sessions in %llu ns; %llu ns/session.", expired,
+			after.expire_nsecs - before.expire_nsecs,
+			div64_u64(after.expire_nsecs - before.expire_nsecs, expired ? expired : 1));
+	if (count)
+		log_info("Benchmark: Warning: %llu sessions did not expire in time.", count);
+
+	memset(&record, 0, sizeof(record));
+	record.name = "db expiration";
+	record.ops = expired;
+	record.busy_ns = after.expire_nsecs - before.expire_nsecs;
+	bench_report(&record);
+
+	return 0;
+}
+
+static int configure_sessiondb(void)
+{
+	__u64 value;
+	int error;
+
+	/* No admission control; the benchmark wants every session. */
+	value = 0;
+	error = sessiondb_set_config(MAX_SESSIONS_UDP, sizeof(value), &value);
+	if (error)
+		return error;
+	error = sessiondb_set_config(MAX_SESSIONS_PER_PREFIX, sizeof(value), &value);
+	if (error)
+		return error;
+
+	if (!expire)
+		return 0;
+	value = 1000 * UDP_MIN;
+	return sessiondb_set_config(UDP_TIMEOUT, sizeof(value), &value);
+}
+
+static int register_pool4(void)
+{
+	struct in_addr addr;
+	unsigned int count = entries / PORTS_PER_ADDR + 1;
+	unsigned int i;
+	int error;
+
+	error = str_to_addr4(POOL4_FIRST, &addr);
+	if (error)
+		return error;
+
+	/* pool4_init() already registered the first one. */
+	for (i = 1; i < count; i++) {
+		addr.s_addr = cpu_to_be32(be32_to_cpu(addr.s_addr) + 1);
+		error = pool4_register(&addr);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+static void deinit(void)
+{
+	sessiondb_destroy();
+	bibdb_destroy();
+	pktqueue_destroy();
+	pool4_destroy();
+	pool6_destroy();
+}
+
+static int init(void)
+{
+	char *pool6[] = { NAT64_POOL6 "/96" };
+	char *pool4[] = { POOL4_FIRST };
+	int error;
+
+	error = str_to_addr6(NAT64_POOL6 SERVER_ADDR4, &local6.l3);
+	if (error)
+		return error;
+	local6.l4 = SERVER_PORT;
+	error = str_to_addr4(SERVER_ADDR4, &remote4.l3);
+	if (error)
+		return error;
+	remote4.l4 = SERVER_PORT;
+
+	error = pool6_init(pool6, ARRAY_SIZE(pool6));
+	if (error)
+		goto pool6_failure;
+	error = pool4_init(pool4, ARRAY_SIZE(pool4), 0, false, false);
+	if (error)
+		goto pool4_failure;
+	error = register_pool4();
+	if (error)
+		goto pktqueue_failure;
+	error = pktqueue_init();
+	if (error)
+		goto pktqueue_failure;
+	error = bibdb_init(0);
+	if (error)
+		goto bib_failure;
+	error = sessiondb_init(0, 0, false, false, false);
+	if (error)
+		goto session_failure;
+	error = configure_sessiondb();
+	if (error) {
+		deinit();
+		return error;
+	}
+
+	return 0;
+
+session_failure:
+	bibdb_destroy();
+bib_failure:
+	pktqueue_destroy();
+pktqueue_failure:
+	pool4_destroy();
+pool4_failure:
+	pool6_destroy();
+pool6_failure:
+	return error;
+}
+
+static int run(unsigned int max_threads)
+{
+	u64 mops;
+	int error;
+
+	error = measure("BIB creation", bib_create_fn, max_threads, entries, &mops);
+	if (error)
+		return error;
+	error = measure("sessiondb_add()", session_add_fn, max_threads, entries, &mops);
+	if (error)
+		return error;
+	print_footprint();
+
+	error = measure_lookups("bibdb_get_by_ipv4()", bib_lookup_fn, max_threads);
+	if (error)
+		return error;
+	error = measure_lookups("sessiondb_get()", session_lookup_fn, max_threads);
+	if (error)
+		return error;
+
+	return expire ? measure_expiration() : 0;
+}
+
+static int init_benchmark_module(void)
+{
+	unsigned int max_threads = threads ? threads : num_online_cpus();
+	unsigned int i;
+	int error;
+
+	if (!entries || entries > ENTRIES_MAX) {
+		log_err("The number of entries must be between 1 and %u.", ENTRIES_MAX);
+		return -EINVAL;
+	}
+	if (max_threads > num_online_cpus()) {
+		log_err("There are only %u online CPUs.", num_online_cpus());
+		return -EINVAL;
+	}
+
+	bibs = vzalloc(entries * sizeof(*bibs));
+	if (!bibs)
+		return -ENOMEM;
+	errors = kcalloc(num_online_cpus(), sizeof(*errors), GFP_KERNEL);
+	if (!errors) {
+		error = -ENOMEM;
+		goto errors_failure;
+	}
+
+	error = init();
+	if (error)
+		goto init_failure;
+
+	log_info("Benchmark: %u entries.", entries);
+	error = run(max_threads);
+
+	for (i = 0; i < entries; i++)
+		if (bibs[i])
+			bib_return(bibs[i]);
+	deinit();
+	log_info("Benchmark: Finished.");
+	/* Fall through. */
+
+init_failure:
+	kfree(errors);
+errors_failure:
+	vfree(bibs);
+	return error;
+}
+
+static void cleanup_benchmark_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("BIB and session database benchmark.");
+module_init(init_benchmark_module);
+module_exit(cleanup_benchmark_module);
@@ -0,0 +1,579 @@
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/benchmark.h"
+#include "nat64/unit/skb_generator.h"
+#include "nat64/unit/types.h"
+#include "nat64/mod/random.h"
+
+/* The benchmark peeks at the shards, the caches and the cleaner. */
+#define GENERATE_FOR_EACH true
+#include "fragment_db.c"
+
+/**
+ * @file
+ * Feeds randomly generated fragment streams to fragdb_handle6() or fragdb_handle4() from several
+ * kthreads at once, and prints:
+ *
+ * - the throughput,
+ * - the memory left in buffer_cache and hole_cache (and "bytes_queued") once the stream is over,
+ * - and the cost of clean_expired_buffers() sweeping away whatever never completed.
+ *
+ * Every datagram is cut into 2 to MAX_FRAGS fragments of random sizes. Then "shuffle"% of them
+ * arrive out of order, "overlap"% get an extra fragment which overlaps two of the others, and
+ * "incomplete"% lose a fragment, so they never complete. Fragments from "window" datagrams are
+ * interleaved at random.
+ *
+ * Like the pipeline benchmark, it runs rounds of 1, 2, 4... threads up to "threads", and every
+ * round gets "fragments" fresh packets, split among its threads. The streams are generated before
+ * the round starts. Every round waits for the fragment timeout, so expect a couple of seconds
+ * each.
+ */
+
+static unsigned int fragments = 200000;
+module_param(fragments, uint, 0);
+MODULE_PARM_DESC(fragments, "Number of fragments fed in every round.");
+
+static unsigned int threads = 0;
+module_param(threads, uint, 0);
+MODULE_PARM_DESC(threads, "Threads of the last round. Zero means one per online CPU.");
+
+/* Not "shards"; fragment_db.c already has one. */
+static unsigned int slices = 0;
+module_param(slices, uint, 0);
+MODULE_PARM_DESC(slices, "Slices of the fragment database. Zero means one per CPU.");
+
+static bool ipv4 = false;
+module_param(ipv4, bool, 0);
+MODULE_PARM_DESC(ipv4, "Feed IPv4 fragments (fragdb_handle4()) instead of IPv6 ones.");
+
+static unsigned int window = 16;
+module_param(window, uint, 0);
+MODULE_PARM_DESC(window, "Number of datagrams whose fragments are interleaved.");
+
+static unsigned int shuffle = 50;
+module_param(shuffle, uint, 0);
+MODULE_PARM_DESC(shuffle, "Percentage of datagrams whose fragments arrive out of order.");
+
+static unsigned int overlap = 10;
+module_param(overlap, uint, 0);
+MODULE_PARM_DESC(overlap, "Percentage of datagrams carrying an overlapping fragment.");
+
+static unsigned int incomplete = 10;
+module_param(incomplete, uint, 0);
+MODULE_PARM_DESC(incomplete, "Percentage of datagrams which lose a fragment.");
+
+static int memcap = -1;
+module_param(memcap, int, 0);
+MODULE_PARM_DESC(memcap, "high_thresh in KiB (low_thresh is 3/4 of it). "
+		"Zero disables eviction, -1 keeps the default.");
+
+#define CLIENT_ADDR6 "2001:db8::"
+#define SERVER_ADDR6 "64:ff9b::cb00:7101"
+#define CLIENT_ADDR4 "10.0.0.0"
+#define SERVER_ADDR4 "203.0.113.1"
+#define CLIENT_PORT 2000
+#define SERVER_PORT 80
+
+/** Maximum number of fragments a datagram is cut into, not counting the overlapping one. */
+#define MAX_FRAGS 8
+/** Fragment payloads are 8 to MAX_FRAG_BLOCKS * 8 bytes long. */
+#define MAX_FRAG_BLOCKS 16
+/* IPv4 threads have 18 bits of source address to tell their datagrams apart, 6 for themselves. */
+#define DATAGRAMS_MAX4 (1 << 18)
+#define THREADS_MAX4 (1 << 6)
+
+/** Rounds yield the CPU every this many fragments, so the benchmark doesn't trip the watchdogs. */
+#define RESCHED_INTERVAL 256
+
+/**
+ * One of the fragments of a datagram, before it becomes a packet.
+ */
+struct frag_desc {
+	u16 offset;
+	u16 len;
+	bool mf;
+};
+
+/**
+ * A datagram whose fragments are being interleaved with its window neighbours'.
+ */
+struct datagram {
+	unsigned int id;
+	u16 l4_len;
+	struct frag_desc frags[MAX_FRAGS + 1];
+	unsigned int count;
+	/** Index of the next fragment to be emitted. */
+	unsigned int next;
+};
+
+/**
+ * The fragments of one of a round's threads, and what became of them.
+ */
+struct round_thread {
+	struct sk_buff **skbs;
+	unsigned int count;
+
+	unsigned int completed;
+	unsigned int stolen;
+	unsigned int dropped;
+} ____cacheline_aligned_in_smp;
+
+struct round {
+	struct round_thread *threads;
+	unsigned int count;
+};
+
+static bool chance(unsigned int percentage)
+{
+	return (get_random_u32() % 100) < percentage;
+}
+
+static void swap_frags(struct frag_desc *a, struct frag_desc *b)
+{
+	struct frag_desc tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/**
+ * Cuts a new datagram into fragments, according to the module parameters.
+ */
+static void datagram_init(struct datagram *dgram, unsigned int id)
+{
+	unsigned int count = 2 + get_random_u32() % (MAX_FRAGS - 1);
+	unsigned int offset = 0;
+	unsigned int i;
+
+	dgram->id = id;
+	dgram->next = 0;
+
+	for (i = 0; i < count; i++) {
+		dgram->frags[i].offset = offset;
+		dgram->frags[i].len = 8 * (1 + get_random_u32() % MAX_FRAG_BLOCKS);
+		dgram->frags[i].mf = true;
+		offset += dgram->frags[i].len;
+	}
+	dgram->frags[count - 1].mf = false;
+	dgram->l4_len = offset;
+
+	/* Spans from the middle of a fragment to the middle of the next one. */
+	if (count >= 3 && chance(overlap)) {
+		i = 1 + get_random_u32() % (count - 2);
+		dgram->frags[count].offset = dgram->frags[i].offset + 8;
+		dgram->frags[count].len = dgram->frags[i].len;
+		dgram->frags[count].mf = true;
+		count++;
+	}
+
+	if (chance(incomplete)) {
+		i = get_random_u32() % count;
+		dgram->frags[i] = dgram->frags[count - 1];
+		count--;
+	}
+
+	if (chance(shuffle)) {
+		for (i = count - 1; i > 0; i--)
+			swap_frags(&dgram->frags[i], &dgram->frags[get_random_u32() % (i + 1)]);
+	}
+
+	dgram->count = count;
+}
+
+/**
+ * Tells the thread and datagram "tuple"'s packets belong to apart through the source address.
+ */
+static int init_tuple(unsigned int thread, unsigned int id, struct tuple *tuple)
+{
+	int error;
+
+	if (ipv4) {
+		error = init_ipv4_tuple(tuple, CLIENT_ADDR4, CLIENT_PORT, SERVER_ADDR4, SERVER_PORT,
+				L4PROTO_UDP);
+		if (error)
+			return error;
+		tuple->src.addr4.l3.s_addr = cpu_to_be32(be32_to_cpu(tuple->src.addr4.l3.s_addr)
+				| (thread << 18) | id);
+		return 0;
+	}
+
+	error = init_ipv6_tuple(tuple, CLIENT_ADDR6, CLIENT_PORT, SERVER_ADDR6, SERVER_PORT,
+			L4PROTO_UDP);
+	if (error)
+		return error;
+	tuple->src.addr6.l3.s6_addr32[2] = cpu_to_be32(thread);
+	tuple->src.addr6.l3.s6_addr32[3] = cpu_to_be32(id);
+	return 0;
+}
+
+static int create_fragment(unsigned int thread, struct datagram *dgram, struct frag_desc *frag,
+		struct sk_buff **result)
+{
+	struct tuple tuple;
+	/* The first fragment's payload length does not include the UDP header. */
+	u16 payload_len = frag->offset ? frag->len : (frag->len - sizeof(struct udphdr));
+	int error;
+
+	error = init_tuple(thread, dgram->id, &tuple);
+	if (error)
+		return error;
+
+	return ipv4
+			? create_skb4_udp_frag(&tuple, result, payload_len, dgram->l4_len, false, frag->mf,
+					frag->offset, 32)
+			: create_skb6_udp_frag(&tuple, result, payload_len, dgram->l4_len, true, frag->mf,
+					frag->offset, 32);
+}
+
+/**
+ * Fills "thread->skbs" with "thread->count" fragments, interleaving "window" datagrams at a time.
+ */
+static int generate_skbs(unsigned int index, struct round_thread *thread)
+{
+	struct datagram *dgrams;
+	struct datagram *dgram;
+	unsigned int next_id = 0;
+	unsigned int i;
+	int error = 0;
+
+	dgrams = kcalloc(window, sizeof(*dgrams), GFP_KERNEL);
+	if (!dgrams)
+		return -ENOMEM;
+	for (i = 0; i < window; i++)
+		datagram_init(&dgrams[i], next_id++);
+
+	for (i = 0; i < thread->count; i++) {
+		dgram = &dgrams[get_random_u32() % window];
+		/* Datagrams that lost their only other fragment might be empty. */
+		while (dgram->next >= dgram->count)
+			datagram_init(dgram, next_id++);
+
+		error = create_fragment(index, dgram, &dgram->frags[dgram->next], &thread->skbs[i]);
+		if (error)
+			break;
+		dgram->next++;
+
+		if (ipv4 && next_id >= DATAGRAMS_MAX4) {
+			log_err("Too many datagrams per thread; IPv4 can't tell them apart.");
+			error = -EINVAL;
+			break;
+		}
+	}
+
+	kfree(dgrams);
+	return error;
+}
+
+static void round_destroy(struct round *round)
+{
+	struct round_thread *thread;
+	unsigned int t, i;
+
+	for (t = 0; t < round->count; t++) {
+		thread = &round->threads[t];
+		if (!thread->skbs)
+			continue;
+		for (i = 0; i < thread->count; i++)
+			if (thread->skbs[i])
+				kfree_skb(thread->skbs[i]);
+		vfree(thread->skbs);
+	}
+
+	kfree(round->threads);
+}
+
+static int round_init(struct round *round, unsigned int count)
+{
+	struct round_thread *thread;
+	unsigned int t;
+	int error;
+
+	round->threads = kcalloc(count, sizeof(*round->threads), GFP_KERNEL);
+	if (!round->threads)
+		return -ENOMEM;
+	round->count = count;
+
+	for (t = 0; t < count; t++) {
+		thread = &round->threads[t];
+		thread->count = fragments / count + ((t < fragments % count) ? 1 : 0);
+		thread->skbs = vzalloc(thread->count * sizeof(*thread->skbs));
+		if (!thread->skbs) {
+			error = -ENOMEM;
+			goto fail;
+		}
+		error = generate_skbs(t, thread);
+		if (error)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	round_destroy(round);
+	return error;
+}
+
+static void feed_fn(unsigned int index, void *arg)
+{
+	struct round_thread *thread = &((struct round *) arg)->threads[index];
+	struct sk_buff *skb, *skb_out;
+	unsigned int i;
+	verdict result;
+
+	for (i = 0; i < thread->count; i++) {
+		skb = thread->skbs[i];
+		thread->skbs[i] = NULL;
+
+		/* Hooks run in softirq context. */
+		local_bh_disable();
+		result = ipv4
+				? fragdb_handle4(skb, &skb_out, NULL)
+				: fragdb_handle6(skb, &skb_out, NULL);
+		local_bh_enable();
+
+		switch (result) {
+		case VER_CONTINUE:
+			thread->completed++;
+			kfree_skb_queued(skb_out);
+			break;
+		case VER_STOLEN:
+			thread->stolen++;
+			break;
+		default:
+			thread->dropped++;
+			kfree_skb(skb);
+		}
+
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+struct footprint {
+	unsigned int buffers;
+	unsigned int holes;
+};
+
+static int count_buffer(struct reassembly_buffer *buffer, void *arg)
+{
+	struct footprint *footprint = arg;
+	struct list_head *node;
+
+	footprint->buffers++;
+	list_for_each(node, &buffer->holes)
+		footprint->holes++;
+
+	return 0;
+}
+
+static void get_footprint(struct footprint *footprint)
+{
+	unsigned int s;
+
+	memset(footprint, 0, sizeof(*footprint));
+	for (s = 0; s < shard_count; s++) {
+		spin_lock_bh(&shards[s].lock);
+		fragdb_table_for_each(&shards[s].table, count_buffer, footprint);
+		spin_unlock_bh(&shards[s].lock);
+	}
+}
+
+/**
+ * Prints what the round left in the database. Returns the bytes it takes.
+ */
+static u64 print_footprint(void)
+{
+	struct footprint footprint;
+	struct fragmentation_stats stats;
+
+	get_footprint(&footprint);
+	fragdb_get_stats(&stats);
+
+	log_info("Benchmark: Left behind: %u buffers (%u bytes in buffer_cache), "
+			"%u holes (%u bytes in hole_cache).",
+			footprint.buffers, footprint.buffers * kmem_cache_size(buffer_cache),
+			footprint.holes, footprint.holes * kmem_cache_size(hole_cache));
+	log_info("Benchmark: bytes_queued: %llu. Evictions: %llu.",
+			stats.bytes_queued, stats.evictions);
+
+	return (u64) footprint.buffers * kmem_cache_size(buffer_cache)
+			+ (u64) footprint.holes * kmem_cache_size(hole_cache)
+			+ stats.bytes_queued;
+}
+
+/**
+ * Waits for the leftover buffers of the "count"-thread round to time out, and then sweeps every
+ * shard the way cleaner_timer() would, timing it.
+ */
+static void measure_expiration(unsigned int count)
+{
+	struct footprint before, after;
+	struct bench_record record;
+	char name[40];
+	s64 start, ns, total_ns = 0, worst_ns = 0;
+	unsigned int s;
+
+	/* The timers would do it while we sleep otherwise. */
+	for (s = 0; s < shard_count; s++)
+		del_timer_sync(&shards[s].expire_timer);
+
+	get_footprint(&before);
+	if (!before.buffers)
+		return;
+
+	msleep(jiffies_to_msecs(get_fragment_timeout()) + 100);
+
+	for (s = 0; s < shard_count; s++) {
+		start = ktime_to_ns(ktime_get());
+		clean_expired_buffers(&shards[s]);
+		ns = ktime_to_ns(ktime_get()) - start;
+
+		total_ns += ns;
+		worst_ns = max(worst_ns, ns);
+	}
+
+	get_footprint(&after);
+	log_info("Benchmark: Expiration: %u buffers in %lld ns (%lld ns/buffer); "
+			"slowest shard took %lld ns.",
+			before.buffers - after.buffers, total_ns,
+			div_s64(total_ns, before.buffers), worst_ns);
+
+	snprintf(name, sizeof(name), "fragment %s expiration, %u thread(s)",
+			ipv4 ? "IPv4" : "IPv6", count);
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.ops = before.buffers - after.buffers;
+	record.busy_ns = total_ns;
+	bench_report(&record);
+}
+
+static int configure_fragdb(void)
+{
+	__u64 high, low;
+	int error;
+
+	if (memcap < 0)
+		return 0;
+
+	high = 1024ULL * memcap;
+	low = high * 3 / 4;
+	/* Lower first; low can't exceed high. */
+	error = fragdb_set_config(FRAGMENT_LOW_THRESH, sizeof(low), &low);
+	if (error)
+		return error;
+	return fragdb_set_config(FRAGMENT_HIGH_THRESH, sizeof(high), &high);
+}
+
+/**
+ * Runs one round on "count" threads, against a fresh database.
+ */
+static int run_round(unsigned int count)
+{
+	struct round round;
+	struct bench_result result;
+	struct bench_record record;
+	unsigned int completed = 0, stolen = 0, dropped = 0;
+	unsigned int t;
+	char name[32];
+	int error;
+
+	error = round_init(&round, count);
+	if (error)
+		return error;
+
+	error = fragdb_init(slices);
+	if (error)
+		goto fragdb_failure;
+	error = configure_fragdb();
+	if (error)
+		goto end;
+
+	error = bench_run(count, feed_fn, &round, &result);
+	if (error)
+		goto end;
+
+	for (t = 0; t < count; t++) {
+		completed += round.threads[t].completed;
+		stolen += round.threads[t].stolen;
+		dropped += round.threads[t].dropped;
+	}
+
+	log_info("Benchmark: %u thread(s): %u fragments in %llu ns; %llu.%02llu Mpps, %llu ns/fragment.",
+			count, fragments, result.wall_ns,
+			BENCH_HUNDREDTHS(bench_mops(fragments, result.wall_ns)),
+			div64_u64(result.busy_ns, fragments));
+	log_info("Benchmark: %u datagrams completed, %u fragments queued, %u dropped.",
+			completed, stolen, dropped);
+
+	snprintf(name, sizeof(name), "fragment %s, %u thread(s)", ipv4 ? "IPv4" : "IPv6", count);
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.ops = fragments;
+	record.wall_ns = result.wall_ns;
+	record.busy_ns = result.busy_ns;
+	record.bytes = print_footprint();
+	bench_report(&record);
+
+	measure_expiration(count);
+	/* Fall through. */
+
+end:
+	fragdb_destroy();
+fragdb_failure:
+	round_destroy(&round);
+	return error;
+}
+
+static int init_benchmark_module(void)
+{
+	unsigned int max_threads = threads ? threads : num_online_cpus();
+	unsigned int count;
+	int error = 0;
+
+	if (!fragments) {
+		log_err("The number of fragments cannot be zero.");
+		return -EINVAL;
+	}
+	if (!window) {
+		log_err("The window cannot be zero.");
+		return -EINVAL;
+	}
+	if (shuffle > 100 || overlap > 100 || incomplete > 100) {
+		log_err("shuffle, overlap and incomplete are percentages.");
+		return -EINVAL;
+	}
+	if (max_threads > num_online_cpus()) {
+		log_err("There are only %u online CPUs.", num_online_cpus());
+		return -EINVAL;
+	}
+	if (ipv4 && max_threads > THREADS_MAX4) {
+		log_err("IPv4 rounds can't have more than %u threads.", THREADS_MAX4);
+		return -EINVAL;
+	}
+
+	log_info("Benchmark: %s, window %u, %u%% shuffled, %u%% overlapping, %u%% incomplete.",
+			ipv4 ? "IPv4" : "IPv6", window, shuffle, overlap, incomplete);
+
+	for (count = 1; count <= max_threads; count = bench_next_round(count, max_threads)) {
+		error = run_round(count);
+		if (error)
+			break;
+	}
+
+	log_info("Benchmark: Finished.");
+	return error;
+}
+
+static void cleanup_benchmark_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("Fragment database benchmark.");
+module_init(init_benchmark_module);
+module_exit(cleanup_benchmark_module);
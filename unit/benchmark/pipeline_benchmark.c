@@ -0,0 +1,406 @@
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/netfilter.h>
+
+#include "nat64/unit/benchmark.h"
+#include "nat64/unit/skb_generator.h"
+#include "nat64/unit/bib.h"
+#include "nat64/unit/types.h"
+
+#include "nat64/comm/str_utils.h"
+
+#include "nat64/mod/pool6.h"
+#include "nat64/mod/pool4.h"
+#include "nat64/mod/pkt_queue.h"
+#include "nat64/mod/fragment_db.h"
+#include "nat64/mod/bib_db.h"
+#include "nat64/mod/session_db.h"
+#include "nat64/mod/filtering_and_updating.h"
+#include "nat64/mod/ttp/core.h"
+#include "nat64/mod/core.h"
+
+/**
+ * @file
+ * Pushes pre-generated packets through core_6to4() or core_4to6() from several kthreads at once,
+ * and prints how fast the pipeline went. The translated packets are thrown away (see
+ * impersonator/send_packet_sink.c), so nothing but Jool is measured.
+ *
+ * The packets are UDP and belong to "flows" flows, each of which has a static BIB entry. Every
+ * flow's first packet creates its session, so the rest measure the established path.
+ *
+ * It runs several rounds: one thread, two threads, four... up to "threads". Every round gets
+ * "packets" fresh packets, split evenly among its threads. Mind the memory; each packet is a
+ * separate skb of roughly a kilobyte, and they are all created before the round starts.
+ */
+
+static unsigned int packets = 1000000;
+module_param(packets, uint, 0);
+MODULE_PARM_DESC(packets, "Number of packets translated in every round.");
+
+static unsigned int flows = 1024;
+module_param(flows, uint, 0);
+MODULE_PARM_DESC(flows, "Number of distinct flows the packets belong to.");
+
+static unsigned int threads = 0;
+module_param(threads, uint, 0);
+MODULE_PARM_DESC(threads, "Threads of the last round. Zero means one per online CPU.");
+
+static bool ipv4 = false;
+module_param(ipv4, bool, 0);
+MODULE_PARM_DESC(ipv4, "Translate IPv4 packets (core_4to6()) instead of IPv6 ones.");
+
+static unsigned int payload = 64;
+module_param(payload, uint, 0);
+MODULE_PARM_DESC(payload, "UDP payload length of every packet.");
+
+#define NAT64_POOL6 "64:ff9b::"
+#define NAT64_POOL4 "192.0.2.2"
+#define CLIENT_ADDR "2001:db8::"
+#define CLIENT_PORT 2000
+#define SERVER_ADDR4 "203.0.113.1"
+#define SERVER_ADDR6 (NAT64_POOL6 SERVER_ADDR4)
+#define SERVER_PORT 80
+/** Flow "i" is masked as NAT64_POOL4#(BIB_PORT_MIN + i). */
+#define BIB_PORT_MIN 1024
+#define FLOWS_MAX (65536 - BIB_PORT_MIN)
+
+/** Rounds yield the CPU every this many packets, so the benchmark doesn't trip the watchdogs. */
+#define RESCHED_INTERVAL 256
+
+/**
+ * The packets of one of a round's threads.
+ */
+struct round_thread {
+	struct sk_buff **skbs;
+	unsigned int count;
+	/** Packets the pipeline did not steal (ie. did not translate). */
+	unsigned int rejected;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * A round's packets.
+ */
+struct round {
+	struct round_thread *threads;
+	unsigned int count;
+};
+
+static unsigned int flow_port(unsigned int flow)
+{
+	return BIB_PORT_MIN + flow;
+}
+
+/**
+ * Leaves in "tuple" the "flow"th flow's tuple, as it looks on the side the packets come from.
+ */
+static int init_flow_tuple(unsigned int flow, struct tuple *tuple)
+{
+	int error;
+
+	if (ipv4)
+		return init_ipv4_tuple(tuple, SERVER_ADDR4, SERVER_PORT,
+				NAT64_POOL4, flow_port(flow), L4PROTO_UDP);
+
+	error = init_ipv6_tuple(tuple, CLIENT_ADDR, CLIENT_PORT,
+			SERVER_ADDR6, SERVER_PORT, L4PROTO_UDP);
+	if (error)
+		return error;
+	tuple->src.addr6.l3.s6_addr32[3] = cpu_to_be32(flow + 1);
+	return 0;
+}
+
+static int inject_bibs(void)
+{
+	struct tuple tuple6;
+	struct in_addr addr4;
+	unsigned int i;
+	int error;
+
+	error = str_to_addr4(NAT64_POOL4, &addr4);
+	if (error)
+		return error;
+
+	for (i = 0; i < flows; i++) {
+		error = init_ipv6_tuple(&tuple6, CLIENT_ADDR, CLIENT_PORT,
+				SERVER_ADDR6, SERVER_PORT, L4PROTO_UDP);
+		if (error)
+			return error;
+		tuple6.src.addr6.l3.s6_addr32[3] = cpu_to_be32(i + 1);
+
+		if (!bib_inject(&tuple6.src.addr6.l3, CLIENT_PORT, &addr4, flow_port(i), L4PROTO_UDP))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Fills "thread->skbs" with "thread->count" packets. "first" is the index of the first one within
+ * the round, so the threads' packets are spread over the flows in the same round-robin order.
+ */
+static int generate_skbs(struct round_thread *thread, unsigned int first, unsigned int stride)
+{
+	struct tuple tuple;
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < thread->count; i++) {
+		error = init_flow_tuple((first + i * stride) % flows, &tuple);
+		if (error)
+			return error;
+
+		error = ipv4
+				? create_skb4_udp(&tuple, &thread->skbs[i], payload, 32)
+				: create_skb6_udp(&tuple, &thread->skbs[i], payload, 32);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+static void round_destroy(struct round *round)
+{
+	struct round_thread *thread;
+	unsigned int t, i;
+
+	for (t = 0; t < round->count; t++) {
+		thread = &round->threads[t];
+		if (!thread->skbs)
+			continue;
+		for (i = 0; i < thread->count; i++)
+			kfree_skb(thread->skbs[i]);
+		vfree(thread->skbs);
+	}
+
+	kfree(round->threads);
+}
+
+/**
+ * Generates the packets of a "count"-thread round.
+ */
+static int round_init(struct round *round, unsigned int count)
+{
+	struct round_thread *thread;
+	unsigned int t;
+	int error;
+
+	round->threads = kcalloc(count, sizeof(*round->threads), GFP_KERNEL);
+	if (!round->threads)
+		return -ENOMEM;
+	round->count = count;
+
+	for (t = 0; t < count; t++) {
+		thread = &round->threads[t];
+		thread->count = packets / count + ((t < packets % count) ? 1 : 0);
+		thread->skbs = vzalloc(thread->count * sizeof(*thread->skbs));
+		if (!thread->skbs) {
+			error = -ENOMEM;
+			goto fail;
+		}
+		error = generate_skbs(thread, t, count);
+		if (error)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	round_destroy(round);
+	return error;
+}
+
+static void translate_fn(unsigned int index, void *arg)
+{
+	struct round_thread *thread = &((struct round *) arg)->threads[index];
+	struct sk_buff *skb;
+	unsigned int i;
+	unsigned int result;
+
+	for (i = 0; i < thread->count; i++) {
+		skb = thread->skbs[i];
+		thread->skbs[i] = NULL;
+
+		/* Hooks run in softirq context. */
+		local_bh_disable();
+		result = ipv4 ? core_4to6(skb) : core_6to4(skb);
+		local_bh_enable();
+
+		if (result != NF_STOLEN) {
+			thread->rejected++;
+			kfree_skb(skb);
+		}
+
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+/**
+ * Runs one round on "count" threads. Returns the round's throughput in hundredths of Mpps through
+ * "mpps".
+ */
+static int run_round(unsigned int count, u64 *mpps)
+{
+	struct round round;
+	struct bench_result result;
+	struct bench_record record;
+	unsigned int rejected = 0;
+	unsigned int t;
+	char name[32];
+	int error;
+
+	error = round_init(&round, count);
+	if (error)
+		return error;
+
+	error = bench_run(count, translate_fn, &round, &result);
+	if (error)
+		goto end;
+
+	for (t = 0; t < count; t++)
+		rejected += round.threads[t].rejected;
+
+	*mpps = bench_mops(packets, result.wall_ns);
+	log_info("Benchmark: %u thread(s): %u packets in %llu ns; %llu.%02llu Mpps, %llu ns/packet.",
+			count, packets, result.wall_ns, BENCH_HUNDREDTHS(*mpps),
+			div64_u64(result.busy_ns, packets));
+	if (rejected)
+		log_info("Benchmark: Warning: %u packets were not translated.", rejected);
+
+	snprintf(name, sizeof(name), "pipeline %s, %u thread(s)", ipv4 ? "4->6" : "6->4", count);
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.ops = packets;
+	record.wall_ns = result.wall_ns;
+	record.busy_ns = result.busy_ns;
+	bench_report(&record);
+
+end:
+	round_destroy(&round);
+	return error;
+}
+
+static void deinit(void)
+{
+	translate_packet_destroy();
+	filtering_destroy();
+	sessiondb_destroy();
+	bibdb_destroy();
+	pktqueue_destroy();
+	pool4_destroy();
+	pool6_destroy();
+	fragdb_destroy();
+}
+
+static int init(void)
+{
+	char *pool6[] = { NAT64_POOL6 "/96" };
+	char *pool4[] = { NAT64_POOL4 };
+	int error;
+
+	error = fragdb_init(0);
+	if (error)
+		goto fragdb_failure;
+	error = pool6_init(pool6, ARRAY_SIZE(pool6));
+	if (error)
+		goto pool6_failure;
+	error = pool4_init(pool4, ARRAY_SIZE(pool4), 0, true, false);
+	if (error)
+		goto pool4_failure;
+	error = pktqueue_init();
+	if (error)
+		goto pktqueue_failure;
+	error = bibdb_init(0);
+	if (error)
+		goto bib_failure;
+	error = sessiondb_init(0, 0, false, false, false);
+	if (error)
+		goto session_failure;
+	error = filtering_init();
+	if (error)
+		goto filtering_failure;
+	error = translate_packet_init();
+	if (error)
+		goto translate_failure;
+
+	error = inject_bibs();
+	if (error) {
+		deinit();
+		return error;
+	}
+
+	return 0;
+
+translate_failure:
+	filtering_destroy();
+filtering_failure:
+	sessiondb_destroy();
+session_failure:
+	bibdb_destroy();
+bib_failure:
+	pktqueue_destroy();
+pktqueue_failure:
+	pool4_destroy();
+pool4_failure:
+	pool6_destroy();
+pool6_failure:
+	fragdb_destroy();
+fragdb_failure:
+	return error;
+}
+
+static int init_benchmark_module(void)
+{
+	unsigned int max_threads = threads ? threads : num_online_cpus();
+	unsigned int count;
+	u64 mpps, base_mpps = 0;
+	int error;
+
+	if (!packets) {
+		log_err("The number of packets cannot be zero.");
+		return -EINVAL;
+	}
+	if (!flows || flows > FLOWS_MAX) {
+		log_err("The number of flows must be between 1 and %u.", FLOWS_MAX);
+		return -EINVAL;
+	}
+	if (max_threads > num_online_cpus()) {
+		log_err("There are only %u online CPUs.", num_online_cpus());
+		return -EINVAL;
+	}
+
+	error = init();
+	if (error)
+		return error;
+
+	log_info("Benchmark: %s, %u flows, %u-byte payloads.",
+			ipv4 ? "4->6" : "6->4", flows, payload);
+
+	for (count = 1; count <= max_threads; count = bench_next_round(count, max_threads)) {
+		error = run_round(count, &mpps);
+		if (error)
+			break;
+
+		if (count == 1)
+			base_mpps = mpps;
+		else if (base_mpps)
+			log_info("Benchmark: Scaling with %u threads: x%llu.%02llu.", count,
+					BENCH_HUNDREDTHS(div64_u64(mpps * 100, base_mpps)));
+	}
+
+	deinit();
+	log_info("Benchmark: Finished.");
+	return error;
+}
+
+static void cleanup_benchmark_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("Translation pipeline benchmark.");
+module_init(init_benchmark_module);
+module_exit(cleanup_benchmark_module);
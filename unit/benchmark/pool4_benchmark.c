@@ -0,0 +1,459 @@
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/benchmark.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/mod/random.h"
+
+/* The lock hold phase needs get_any_addr() and pool_lock. */
+#include "pool4.c"
+
+/**
+ * @file
+ * Fills pool4's UDP ports up to each of the "occupancy" levels, then churns them the way a carrier
+ * grade NAT's subscribers would: a random subscriber closes its oldest flow and opens a new one,
+ * whose source port is the next one of the subscriber's own sequence. Each allocation is timed,
+ * and the latency distribution is printed for:
+ *
+ * - the fill,
+ * - pool4_get_any_addr() (ie. the port caches, then the fallback), in rounds of 1, 2, 4...
+ *   threads up to "threads",
+ * - and get_any_addr() alone, with the caches drained. It runs on a single thread, so what it
+ *   measures is the time pool_lock is held for (and the cost of taking it), which is what the
+ *   other CPUs wait for when the caches run dry.
+ *
+ * The occupancy is relative to all of the UDP ports of the "addrs" addresses, so the high levels
+ * exhaust the high ports and exercise the fallback to the other classes.
+ *
+ * Every sample includes the cost of two ktime_get()s. For the exact lock statistics, run a kernel
+ * with CONFIG_LOCK_STAT and read /proc/lock_stat.
+ */
+
+static unsigned int addrs = 4;
+module_param(addrs, uint, 0);
+MODULE_PARM_DESC(addrs, "Number of addresses in pool4.");
+
+static unsigned int occupancy[8] = { 50, 90, 95, 99, 100 };
+static unsigned int occupancy_count = 5;
+module_param_array(occupancy, uint, &occupancy_count, 0);
+MODULE_PARM_DESC(occupancy, "Percentages of the UDP ports to fill pool4 to, one run for each.");
+
+static unsigned int ops = 1000000;
+module_param(ops, uint, 0);
+MODULE_PARM_DESC(ops, "Number of reallocations in every churn round.");
+
+static unsigned int subscribers = 1024;
+module_param(subscribers, uint, 0);
+MODULE_PARM_DESC(subscribers, "Number of subscribers the ports are split among.");
+
+static unsigned int threads = 0;
+module_param(threads, uint, 0);
+MODULE_PARM_DESC(threads, "Threads of the last churn round. Zero means one per online CPU.");
+
+/** The pool4 addresses are taken from the benchmarking range, starting here. */
+#define POOL4_FIRST "198.18.0.1"
+#define ADDRS_MAX 256
+#define PORTS_PER_ADDR 65536
+/** Subscribers pick their source ports from here on, like Linux's ephemeral ports. */
+#define SUBSCRIBER_PORT_MIN 32768
+#define SUBSCRIBER_PORT_COUNT 28232
+
+/** Workloads yield the CPU every this many operations, so they don't trip the watchdogs. */
+#define RESCHED_INTERVAL 256
+
+/**
+ * A port lent to one of the subscribers. A failed reallocation leaves the slot empty.
+ */
+struct slot {
+	struct ipv4_transport_addr addr;
+	bool valid;
+};
+
+/**
+ * The subscriber's flows are slots[first] through slots[first + count - 1], which are used as a
+ * ring; "oldest" is the one to be closed next.
+ */
+struct subscriber {
+	unsigned int first;
+	unsigned int count;
+	unsigned int oldest;
+	/** Offset of the next source port from SUBSCRIBER_PORT_MIN. */
+	unsigned int next_port;
+};
+
+/**
+ * The state of one of a churn round's threads. It only ever touches the subscribers whose index
+ * is congruent to its own modulo the round's thread count.
+ */
+struct churn_thread {
+	struct bench_hist hist;
+	unsigned int failures;
+} ____cacheline_aligned_in_smp;
+
+struct churn_round {
+	struct churn_thread *threads;
+	unsigned int count;
+};
+
+static struct slot *slots;
+static struct subscriber *subs;
+
+static __u16 next_hint(struct subscriber *sub)
+{
+	__u16 result = SUBSCRIBER_PORT_MIN + sub->next_port;
+	sub->next_port = (sub->next_port + 1) % SUBSCRIBER_PORT_COUNT;
+	return result;
+}
+
+static u64 now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static int alloc_port(l4_protocol proto, __u16 hint, struct ipv4_transport_addr *result)
+{
+	return pool4_get_any_addr(proto, hint, result);
+}
+
+static int alloc_port_locked(l4_protocol proto, __u16 hint, struct ipv4_transport_addr *result)
+{
+	return get_any_addr(proto, hint, result);
+}
+
+static void return_port(struct ipv4_transport_addr *addr)
+{
+	pool4_return(L4PROTO_UDP, addr);
+}
+
+static void return_port_locked(struct ipv4_transport_addr *addr)
+{
+	spin_lock_bh(&pool_lock);
+	return_locked(L4PROTO_UDP, addr);
+	spin_unlock_bh(&pool_lock);
+}
+
+/**
+ * Closes "sub"'s oldest flow and opens a new one, timing the allocation into "hist".
+ * Returns false if pool4 could not lend a port.
+ */
+static bool churn(struct subscriber *sub, bool locked, struct bench_hist *hist)
+{
+	struct slot *slot = &slots[sub->first + sub->oldest];
+	__u16 hint = next_hint(sub);
+	u64 start;
+	int error;
+
+	sub->oldest = (sub->oldest + 1) % sub->count;
+
+	if (slot->valid)
+		locked ? return_port_locked(&slot->addr) : return_port(&slot->addr);
+
+	start = now();
+	error = locked
+			? alloc_port_locked(L4PROTO_UDP, hint, &slot->addr)
+			: alloc_port(L4PROTO_UDP, hint, &slot->addr);
+	bench_hist_add(hist, now() - start);
+
+	slot->valid = !error;
+	return !error;
+}
+
+/**
+ * Picks a random subscriber among the ones the "index"th of "count" threads owns.
+ */
+static struct subscriber *random_subscriber(unsigned int index, unsigned int count)
+{
+	unsigned int owned = (subscribers - index + count - 1) / count;
+	return &subs[index + (get_random_u32() % owned) * count];
+}
+
+static void churn_fn(unsigned int index, void *arg)
+{
+	struct churn_round *round = arg;
+	struct churn_thread *thread = &round->threads[index];
+	unsigned int total = ops / round->count + ((index < ops % round->count) ? 1 : 0);
+	unsigned int i;
+
+	for (i = 0; i < total; i++) {
+		if (!churn(random_subscriber(index, round->count), false, &thread->hist))
+			thread->failures++;
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+}
+
+/**
+ * Splits "used" slots ("level"% of pool4's) among the subscribers, and lends a port to each one.
+ */
+static int fill(unsigned int level, unsigned int used)
+{
+	struct bench_record record;
+	struct bench_hist *hist;
+	char name[32];
+	struct subscriber *sub;
+	unsigned int s, i, failures = 0;
+
+	hist = kzalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	for (s = 0; s < subscribers; s++) {
+		sub = &subs[s];
+		sub->first = (u64) used * s / subscribers;
+		sub->count = (u64) used * (s + 1) / subscribers - sub->first;
+		sub->oldest = 0;
+		sub->next_port = get_random_u32() % SUBSCRIBER_PORT_COUNT;
+
+		for (i = 0; i < sub->count; i++) {
+			if (!churn(sub, false, hist))
+				failures++;
+			if ((i % RESCHED_INTERVAL) == 0)
+				cond_resched();
+		}
+	}
+
+	bench_hist_print("Fill", hist);
+	if (failures)
+		log_info("Benchmark: Warning: %u ports could not be lent during the fill.", failures);
+
+	snprintf(name, sizeof(name), "pool4 %u%% fill", level);
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.hist = hist;
+	bench_report(&record);
+
+	kfree(hist);
+	return 0;
+}
+
+/**
+ * Runs one churn round, on "count" threads.
+ */
+static int run_churn_round(unsigned int level, unsigned int count)
+{
+	struct churn_round round;
+	struct bench_result result;
+	struct bench_record record;
+	char record_name[40];
+	struct bench_hist *total;
+	unsigned int failures = 0;
+	unsigned int t;
+	char name[32];
+	int error;
+
+	round.threads = vzalloc(count * sizeof(*round.threads));
+	if (!round.threads)
+		return -ENOMEM;
+	round.count = count;
+	total = kzalloc(sizeof(*total), GFP_KERNEL);
+	if (!total) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	error = bench_run(count, churn_fn, &round, &result);
+	if (error)
+		goto end;
+
+	for (t = 0; t < count; t++) {
+		bench_hist_merge(total, &round.threads[t].hist);
+		failures += round.threads[t].failures;
+	}
+
+	snprintf(name, sizeof(name), "Churn, %u thread(s)", count);
+	bench_hist_print(name, total);
+	log_info("Benchmark: %s: %llu.%02llu M reallocations/s; %u failures.", name,
+			BENCH_HUNDREDTHS(bench_mops(ops, result.wall_ns)), failures);
+
+	snprintf(record_name, sizeof(record_name), "pool4 %u%% churn, %u thread(s)", level, count);
+	memset(&record, 0, sizeof(record));
+	record.name = record_name;
+	record.ops = ops;
+	record.wall_ns = result.wall_ns;
+	record.busy_ns = result.busy_ns;
+	record.hist = total;
+	bench_report(&record);
+
+end:
+	kfree(total);
+	vfree(round.threads);
+	return error;
+}
+
+/**
+ * Churns through get_any_addr() and return_locked() directly, so every sample is a pool_lock
+ * critical section.
+ */
+static int run_lock_round(unsigned int level)
+{
+	struct bench_record record;
+	struct bench_hist *hist;
+	char name[40];
+	unsigned int i, failures = 0;
+
+	hist = kzalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	/* Otherwise the ports hoarded by the caches would count as used. */
+	drain_all_caches();
+
+	for (i = 0; i < ops; i++) {
+		if (!churn(&subs[get_random_u32() % subscribers], true, hist))
+			failures++;
+		if ((i % RESCHED_INTERVAL) == 0)
+			cond_resched();
+	}
+
+	bench_hist_print("pool_lock held", hist);
+	if (failures)
+		log_info("Benchmark: pool_lock held: %u failures.", failures);
+
+	snprintf(name, sizeof(name), "pool4 %u%% pool_lock held", level);
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.hist = hist;
+	bench_report(&record);
+
+	kfree(hist);
+	return 0;
+}
+
+static int init_pool4(void)
+{
+	char *pool4[] = { POOL4_FIRST };
+	struct in_addr addr;
+	unsigned int i;
+	int error;
+
+	error = str_to_addr4(POOL4_FIRST, &addr);
+	if (error)
+		return error;
+	error = pool4_init(pool4, ARRAY_SIZE(pool4), 0, true, false);
+	if (error)
+		return error;
+
+	/* pool4_init() already registered the first one. */
+	for (i = 1; i < addrs; i++) {
+		addr.s_addr = cpu_to_be32(be32_to_cpu(addr.s_addr) + 1);
+		error = pool4_register(&addr);
+		if (error) {
+			pool4_destroy();
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the whole benchmark with pool4 "level"% full. pool4 starts from scratch, so the levels do
+ * not inherit each other's fragmentation.
+ */
+static int run_level(unsigned int level, unsigned int max_threads)
+{
+	unsigned int used = (u64) addrs * PORTS_PER_ADDR * level / 100;
+	unsigned int count;
+	int error;
+
+	if (used < subscribers) {
+		log_info("Benchmark: Skipping %u%%; there would be less ports than subscribers.",
+				level);
+		return 0;
+	}
+
+	error = init_pool4();
+	if (error)
+		return error;
+
+	log_info("Benchmark: Occupancy %u%% (%u of %u ports).", level, used,
+			addrs * PORTS_PER_ADDR);
+
+	memset(slots, 0, used * sizeof(*slots));
+	error = fill(level, used);
+	if (error)
+		goto end;
+
+	for (count = 1; count <= max_threads; count = bench_next_round(count, max_threads)) {
+		error = run_churn_round(level, count);
+		if (error)
+			goto end;
+	}
+
+	error = run_lock_round(level);
+	/* Fall through. */
+
+end:
+	pool4_destroy();
+	return error;
+}
+
+static int init_benchmark_module(void)
+{
+	unsigned int max_threads = threads ? threads : num_online_cpus();
+	unsigned int i;
+	int error = 0;
+
+	if (!addrs || addrs > ADDRS_MAX) {
+		log_err("The number of addresses must be between 1 and %u.", ADDRS_MAX);
+		return -EINVAL;
+	}
+	if (!ops) {
+		log_err("The number of operations cannot be zero.");
+		return -EINVAL;
+	}
+	if (!subscribers) {
+		log_err("The number of subscribers cannot be zero.");
+		return -EINVAL;
+	}
+	for (i = 0; i < occupancy_count; i++) {
+		if (occupancy[i] > 100) {
+			log_err("Occupancy levels are percentages; %u is too much.", occupancy[i]);
+			return -EINVAL;
+		}
+	}
+	if (max_threads > num_online_cpus()) {
+		log_err("There are only %u online CPUs.", num_online_cpus());
+		return -EINVAL;
+	}
+	if (max_threads > subscribers) {
+		log_err("There cannot be more threads than subscribers.");
+		return -EINVAL;
+	}
+
+	slots = vzalloc(addrs * PORTS_PER_ADDR * sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	subs = vzalloc(subscribers * sizeof(*subs));
+	if (!subs) {
+		vfree(slots);
+		return -ENOMEM;
+	}
+
+	log_info("Benchmark: %u pool4 addresses, %u subscribers, %u reallocations per round.",
+			addrs, subscribers, ops);
+
+	for (i = 0; i < occupancy_count; i++) {
+		error = run_level(occupancy[i], max_threads);
+		if (error)
+			break;
+	}
+
+	vfree(subs);
+	vfree(slots);
+	log_info("Benchmark: Finished.");
+	return error;
+}
+
+static void cleanup_benchmark_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("pool4 allocation benchmark.");
+module_init(init_benchmark_module);
+module_exit(cleanup_benchmark_module);
@@ -0,0 +1,248 @@
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+
+#include "nat64/unit/benchmark.h"
+#include "nat64/unit/skb_generator.h"
+#include "nat64/unit/types.h"
+
+#include "nat64/mod/packet.h"
+#include "nat64/mod/ttp/core.h"
+
+/**
+ * @file
+ * Translates pre-generated packets of every (layer 3, layer 4) combination, plus ICMP errors and
+ * fragmented datagrams, and prints how long every packet took and how many skbs it needed.
+ *
+ * Only the translation is measured; the packets are generated before, and the translated ones are
+ * released after, every variant's clock. Routing is impersonated (see impersonator/send_packet.c).
+ *
+ * With "in_place", translating_the_packet_in_place() is tried first, and translating_the_packet()
+ * only gets the packets the former refuses, the same way the pipeline does it. A packet translated
+ * in place needs no skbs.
+ */
+
+static unsigned int packets = 20000;
+module_param(packets, uint, 0);
+MODULE_PARM_DESC(packets, "Number of packets translated by every variant.");
+
+static unsigned int payload = 100;
+module_param(payload, uint, 0);
+MODULE_PARM_DESC(payload, "Layer-4 payload length of every packet.");
+
+static bool in_place = false;
+module_param(in_place, bool, 0);
+MODULE_PARM_DESC(in_place, "Try the in-place translation before the one which copies.");
+
+/** Variants yield the CPU every this many packets, so the benchmark doesn't trip the watchdogs. */
+#define RESCHED_INTERVAL 256
+
+typedef int (*create_skb_fn)(struct tuple *, struct sk_buff **, u16, u8);
+
+/**
+ * One of the kinds of packets the benchmark translates.
+ */
+struct variant {
+	char *name;
+	/** Whether the packets are IPv4 (and are therefore translated into IPv6). */
+	bool ipv4;
+	/** Protocol of the tuples. (The inner packet's, if the packets are ICMP errors.) */
+	l4_protocol l4_proto;
+	create_skb_fn create_fn;
+};
+
+static const struct variant variants[] = {
+	{ "4->6 UDP", true, L4PROTO_UDP, create_skb4_udp },
+	{ "4->6 TCP", true, L4PROTO_TCP, create_skb4_tcp },
+	{ "4->6 ICMP info", true, L4PROTO_ICMP, create_skb4_icmp_info },
+	{ "4->6 ICMP error", true, L4PROTO_TCP, create_skb4_icmp_error },
+	{ "4->6 UDP fragments", true, L4PROTO_UDP, create_skb4frags_udp },
+	{ "4->6 TCP fragments", true, L4PROTO_TCP, create_skb4frags_tcp },
+	{ "4->6 ICMP fragments", true, L4PROTO_ICMP, create_skb4frags_icmp },
+	{ "6->4 UDP", false, L4PROTO_UDP, create_skb6_udp },
+	{ "6->4 TCP", false, L4PROTO_TCP, create_skb6_tcp },
+	{ "6->4 ICMP info", false, L4PROTO_ICMP, create_skb6_icmp_info },
+	{ "6->4 ICMP error", false, L4PROTO_TCP, create_skb6_icmp_error },
+	{ "6->4 UDP fragments", false, L4PROTO_UDP, create_skb6frags_udp },
+	{ "6->4 TCP fragments", false, L4PROTO_TCP, create_skb6frags_tcp },
+	{ "6->4 ICMP fragments", false, L4PROTO_ICMP, create_skb6frags_icmp },
+};
+
+/**
+ * Same addresses and ports as translate_packet_test.c.
+ */
+static int init_tuples(const struct variant *variant, struct tuple *in, struct tuple *out)
+{
+	l4_protocol proto = variant->l4_proto;
+
+	if (variant->ipv4) {
+		return init_ipv4_tuple(in, "192.0.2.5", 1234, "192.0.2.2", 80, proto)
+				|| init_ipv6_tuple(out, "64::192.0.2.5", 51234, "1::1", 50080, proto);
+	}
+
+	return init_ipv6_tuple(in, "1::1", 50080, "64::192.0.2.5", 51234, proto)
+			|| init_ipv4_tuple(out, "192.0.2.2", 80, "192.0.2.5", 1234, proto);
+}
+
+static unsigned int count_skbs(struct sk_buff *skb)
+{
+	unsigned int result = 0;
+
+	for (; skb; skb = skb->next)
+		result++;
+
+	return result;
+}
+
+static void free_skbs(struct sk_buff **skbs)
+{
+	unsigned int i;
+
+	for (i = 0; i < packets; i++)
+		kfree_skb_queued(skbs[i]);
+}
+
+/**
+ * Translates every packet of "in" into "out". (Packets translated in place are moved from "in" to
+ * "out".) Returns the number of in-place translations that fell back through "fallbacks", and the
+ * number of packets which could not be translated at all through "dropped".
+ */
+static void translate_all(struct tuple *tuple, struct sk_buff **in, struct sk_buff **out,
+		unsigned int *fallbacks, unsigned int *dropped)
+{
+	unsigned int i;
+	int error;
+
+	local_bh_disable();
+	for (i = 0; i < packets; i++) {
+		if (in_place) {
+			error = translating_the_packet_in_place(tuple, in[i], NULL);
+			if (!error) {
+				out[i] = in[i];
+				in[i] = NULL;
+				goto next;
+			}
+			if (error != -EAGAIN) {
+				(*dropped)++;
+				goto next;
+			}
+			(*fallbacks)++;
+		}
+
+		if (translating_the_packet(tuple, in[i], &out[i]) != VER_CONTINUE)
+			(*dropped)++;
+
+next:
+		if ((i % RESCHED_INTERVAL) == RESCHED_INTERVAL - 1) {
+			local_bh_enable();
+			cond_resched();
+			local_bh_disable();
+		}
+	}
+	local_bh_enable();
+}
+
+static int run_variant(const struct variant *variant, struct sk_buff **in, struct sk_buff **out)
+{
+	struct tuple tuple_in, tuple_out;
+	struct bench_record record;
+	char name[48];
+	unsigned int fallbacks = 0, dropped = 0;
+	unsigned int skbs = 0;
+	unsigned int i;
+	u64 start, ns;
+	u64 skbs_per_packet;
+	int error;
+
+	memset(in, 0, packets * sizeof(*in));
+	memset(out, 0, packets * sizeof(*out));
+
+	if (init_tuples(variant, &tuple_in, &tuple_out))
+		return -EINVAL;
+	for (i = 0; i < packets; i++) {
+		error = variant->create_fn(&tuple_in, &in[i], payload, 32);
+		if (error)
+			goto end;
+	}
+
+	start = ktime_to_ns(ktime_get());
+	translate_all(&tuple_out, in, out, &fallbacks, &dropped);
+	ns = ktime_to_ns(ktime_get()) - start;
+
+	/* The in-place translations reused theirs; the rest needed fresh ones. */
+	for (i = 0; i < packets; i++)
+		if (!in_place || in[i])
+			skbs += count_skbs(out[i]);
+
+	skbs_per_packet = div64_u64(100 * (u64) skbs, packets);
+	log_info("Benchmark: %s: %llu ns/packet, %llu.%02llu skbs/packet.", variant->name,
+			div64_u64(ns, packets), BENCH_HUNDREDTHS(skbs_per_packet));
+	if (fallbacks)
+		log_info("Benchmark: %s: %u packets could not be translated in place.",
+				variant->name, fallbacks);
+	if (dropped)
+		log_info("Benchmark: Warning: %u %s packets were not translated.", dropped,
+				variant->name);
+
+	snprintf(name, sizeof(name), "translate %s", variant->name);
+	memset(&record, 0, sizeof(record));
+	record.name = name;
+	record.ops = packets;
+	record.wall_ns = ns;
+	bench_report(&record);
+	error = 0;
+	/* Fall through. */
+
+end:
+	free_skbs(in);
+	free_skbs(out);
+	return error;
+}
+
+static int init_benchmark_module(void)
+{
+	struct sk_buff **in, **out;
+	unsigned int v;
+	int error = 0;
+
+	if (!packets) {
+		log_err("The number of packets cannot be zero.");
+		return -EINVAL;
+	}
+
+	in = vmalloc(packets * sizeof(*in));
+	out = vmalloc(packets * sizeof(*out));
+	if (!in || !out) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	error = translate_packet_init();
+	if (error)
+		goto end;
+
+	log_info("Benchmark: %u packets per variant, %u-byte payloads%s.", packets, payload,
+			in_place ? ", in place when possible" : "");
+	for (v = 0; v < ARRAY_SIZE(variants) && !error; v++)
+		error = run_variant(&variants[v], in, out);
+
+	translate_packet_destroy();
+	log_info("Benchmark: Finished.");
+	/* Fall through. */
+
+end:
+	vfree(in);
+	vfree(out);
+	return error;
+}
+
+static void cleanup_benchmark_module(void)
+{
+	/* No code. */
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
+MODULE_DESCRIPTION("Packet translation benchmark.");
+module_init(init_benchmark_module);
+module_exit(cleanup_benchmark_module);
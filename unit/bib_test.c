@@ -12,7 +12,7 @@ MODULE_AUTHOR("Alberto Leiva Popper <aleiva@nic.mx>");
 MODULE_DESCRIPTION("BIB module test.");
 
 #define BIB_PRINT_KEY "BIB [%pI4#%u, %pI6c#%u]"
-#define PRINT_BIB(bib) &bib->ipv4.l3, bib->ipv4.l4, &bib->ipv6.l3, bib->ipv6.l4
+#define PRINT_BIB(bib) &bib->ipv4.l3, bib->ipv4.l4, &bib->host->addr, bib->port6
 
 static const char* IPV4_ADDRS[] = { "1.1.1.1", "2.2.2.2" };
 static const __u16 IPV4_PORTS[] = { 456, 9556 };
@@ -40,7 +40,8 @@ static bool assert_bib_entry_equals(struct bib_entry* expected, struct bib_entry
 	}
 
 	if (!ipv4_transport_addr_equals(&expected->ipv4, &actual->ipv4)
-			|| !ipv6_transport_addr_equals(&expected->ipv6, &actual->ipv6)) {
+			|| !ipv6_addr_equals(&expected->host->addr, &actual->host->addr)
+			|| expected->port6 != actual->port6) {
 		log_err("Test '%s' failed: Expected " BIB_PRINT_KEY " got " BIB_PRINT_KEY ".",
 				test_name, PRINT_BIB(expected), PRINT_BIB(actual));
 		return false;
@@ -63,8 +64,10 @@ static bool assert_bib(char* test_name, struct bib_entry* bib,
 {
 	l4_protocol l4_protos[] = { L4PROTO_UDP, L4PROTO_TCP, L4PROTO_ICMP };
 	bool table_has_it[3];
+	struct ipv6_transport_addr bib6;
 	int i;
 
+	bib_ipv6(bib, &bib6);
 	table_has_it[0] = udp_table_has_it;
 	table_has_it[1] = tcp_table_has_it;
 	table_has_it[2] = icmp_table_has_it;
@@ -80,7 +83,7 @@ static bool assert_bib(char* test_name, struct bib_entry* bib,
 		success &= assert_bib_entry_equals(expected_bib, retrieved_bib, test_name);
 
 		success &= assert_equals_int(table_has_it[i] ? 0 : -ENOENT,
-				bibdb_get_by_ipv6(&bib->ipv6, l4_protos[i], &retrieved_bib),
+				bibdb_get_by_ipv6(&bib6, l4_protos[i], &retrieved_bib),
 				test_name);
 		success &= assert_bib_entry_equals(expected_bib, retrieved_bib, test_name);
 
@@ -130,24 +133,24 @@ static int foreach6_func(struct bib_entry *entry, void *arg)
 {
 	struct foreach6_summary *summary = arg;
 
-	log_debug("Iterating through node %pI6c#%u.", &entry->ipv6.l3, entry->ipv6.l4);
+	log_debug("Iterating through node %pI6c#%u.", &entry->host->addr, entry->port6);
 
-	if (!ipv6_addr_equals(&addr6[1].l3, &entry->ipv6.l3)) {
+	if (!ipv6_addr_equals(&addr6[1].l3, &entry->host->addr)) {
 		log_err("The address was not the one requested.");
 		return -EINVAL;
 	}
 
-	if (entry->ipv6.l4 < 6 || 12 < entry->ipv6.l4) {
+	if (entry->port6 < 6 || 12 < entry->port6) {
 		log_err("We didn't insert a BIB with this port to the table.");
 		return -EINVAL;
 	}
 
-	if (summary->visited[entry->ipv6.l4 - 6]) {
+	if (summary->visited[entry->port6 - 6]) {
 		log_err("This is not the first time we've visited this node.");
 		return -EINVAL;
 	}
 
-	summary->visited[entry->ipv6.l4 - 6] = true;
+	summary->visited[entry->port6 - 6] = true;
 	return 0;
 }
 
@@ -443,6 +446,95 @@ fail:
 	return false;
 }
 
+static bool test_host_index(void)
+{
+	struct bib_entry *bib1, *bib2, *bib3;
+	struct bib_host *host;
+	bool success = true;
+
+	bib1 = bib_inject_str("1::1", 10, "1.1.1.1", 10, L4PROTO_UDP);
+	bib2 = bib_inject_str("1::1", 11, "1.1.1.1", 11, L4PROTO_UDP);
+	bib3 = bib_inject_str("1::1", 12, "2.2.2.2", 12, L4PROTO_UDP);
+	if (!bib1 || !bib2 || !bib3)
+		return false;
+
+	host = host_find(&bib_udp, &bib1->host->addr);
+	if (!assert_not_null(host, "host record"))
+		return false;
+	success &= assert_equals_u32(0, host->overflow, "overflow");
+	success &= assert_equals_u32(3, host->addrs[0].bibs + host->addrs[1].bibs
+			+ host->addrs[2].bibs + host->addrs[3].bibs, "accounted entries");
+
+	success &= assert_equals_ptr(bib1->host, bib2->host, "IPv6 node is shared 1");
+	success &= assert_equals_ptr(bib1->host, bib3->host, "IPv6 node is shared 2");
+	success &= assert_equals_u32(3, bib1->host->bibs, "IPv6 node's entries");
+	success &= assert_equals_u64(1, bibdb_count_hosts(), "IPv6 node count");
+
+	success &= assert_equals_int(0, bibdb_remove(bib1, false), "remove 1");
+	success &= assert_equals_int(0, bibdb_remove(bib2, false), "remove 2");
+	success &= assert_not_null(host_find(&bib_udp, &bib1->host->addr), "record survives");
+	success &= assert_equals_int(0, bibdb_remove(bib3, false), "remove 3");
+	success &= assert_null(host_find(&bib_udp, &bib1->host->addr), "record dies");
+
+	bib_kfree(bib1);
+	bib_kfree(bib2);
+	bib_kfree(bib3);
+	return success;
+}
+
+static bool test_port_blocks(void)
+{
+	struct tuple tuple1, tuple2;
+	struct ipv4_transport_addr result1, result2;
+	struct bib_host *host;
+	unsigned int block;
+	bool success = true;
+
+	if (is_error(init_ipv6_tuple(&tuple1, "1::1", 5000, "64:ff9b::1", 5000, L4PROTO_UDP)))
+		return false;
+	if (is_error(init_ipv6_tuple(&tuple2, "1::1", 6000, "64:ff9b::1", 6000, L4PROTO_UDP)))
+		return false;
+
+	if (!assert_equals_int(0, allocate_transport_address(&bib_udp, &tuple1, &result1), "get 1"))
+		return false;
+	if (!assert_equals_int(0, allocate_transport_address(&bib_udp, &tuple2, &result2), "get 2"))
+		return false;
+
+	/* Both ports should come from the same 1024-port block. */
+	block = (result1.l4 - 1024) / 1024;
+	success &= assert_true(ipv4_addr_equals(&result1.l3, &result2.l3), "same address");
+	success &= assert_equals_u32(block, (result2.l4 - 1024) / 1024, "same block");
+
+	host = host_find(&bib_udp, &tuple1.src.addr6.l3);
+	if (!assert_not_null(host, "host record"))
+		return false;
+	success &= assert_not_null(host->blocks[0].ports, "first block");
+	success &= assert_null(host->blocks[1].ports, "no second block");
+	success &= assert_equals_u32(2, host->blocks[0].used, "ports used");
+
+	release_transport_address(&bib_udp, &tuple1, &result1, true);
+	success &= assert_not_null(host_find(&bib_udp, &tuple1.src.addr6.l3), "block survives");
+	release_transport_address(&bib_udp, &tuple2, &result2, true);
+	success &= assert_null(host_find(&bib_udp, &tuple1.src.addr6.l3), "block dies");
+
+	return success;
+}
+
+static bool init_blocks(void)
+{
+	char *pool4_addrs[] = { "1.1.1.1" };
+
+	if (is_error(pool4_init(pool4_addrs, ARRAY_SIZE(pool4_addrs), 1024, true, false)))
+		return false;
+
+	if (is_error(bibdb_init(0))) {
+		pool4_destroy();
+		return false;
+	}
+
+	return true;
+}
+
 static bool test_compare_addr6(void)
 {
 	struct bib_entry *bib;
@@ -534,6 +626,194 @@ fail:
 	return false;
 }
 
+static bool test_remote4_filter(void)
+{
+	struct bib_entry *bib;
+	struct in_addr known, other;
+	bool success = true;
+
+	bib = bib_create_str("1::1", 1111, "1.1.1.1", 1111, L4PROTO_UDP);
+	if (!bib)
+		return false;
+	if (str_to_addr4("2.2.2.2", &known) != 0 || str_to_addr4("3.3.3.3", &other) != 0)
+		goto fail;
+
+	success &= assert_false(bib_may_know_remote4(bib, &known), "Empty filter");
+	success &= assert_false(bib_may_know_remote4(bib, &other), "Empty filter, other");
+
+	bib_add_remote4(bib, &known);
+	success &= assert_true(bib_may_know_remote4(bib, &known), "Added address");
+	bib_add_remote4(bib, &other);
+	success &= assert_true(bib_may_know_remote4(bib, &known), "First address after second");
+	success &= assert_true(bib_may_know_remote4(bib, &other), "Second address");
+
+	bib_kfree(bib);
+	return success;
+
+fail:
+	bib_kfree(bib);
+	return false;
+}
+
+static bool test_add_bulk(void)
+{
+	struct bib_entry *bibs[ARRAY_SIZE(IPV6_ADDRS)];
+	struct bib_entry *repeated[2];
+	struct bib_entry *extra;
+	struct ipv4_transport_addr addr;
+	unsigned int added;
+	unsigned int i;
+	bool success = true;
+
+	for (i = 0; i < ARRAY_SIZE(bibs); i++) {
+		addr.l3 = addr4[0].l3;
+		if (is_error(pool4_get_any_port(L4PROTO_UDP, &addr.l3, &addr.l4)))
+			return false;
+		bibs[i] = bib_create(&addr, &addr6[ARRAY_SIZE(bibs) - i - 1], true, L4PROTO_UDP);
+		if (!assert_not_null(bibs[i], "Allocation of test BIB entry"))
+			return false;
+	}
+
+	/* A batch which contains the same IPv6 address twice is rejected whole. */
+	addr.l3 = addr4[1].l3;
+	if (is_error(pool4_get_any_port(L4PROTO_UDP, &addr.l3, &addr.l4)))
+		return false;
+	extra = bib_create(&addr, &addr6[0], true, L4PROTO_UDP);
+	if (!assert_not_null(extra, "Allocation of repeated entry"))
+		return false;
+	repeated[0] = extra;
+	repeated[1] = bibs[ARRAY_SIZE(bibs) - 1];
+
+	success &= assert_equals_int(-EEXIST, bibdb_add_bulk(repeated, 2, &added), "Repeated call");
+	success &= assert_equals_int(0, added, "Repeated count");
+	success &= assert_bib("Repeated state", bibs[ARRAY_SIZE(bibs) - 1], false, false, false);
+	success &= assert_bib("Repeated state 2", extra, false, false, false);
+	bib_kfree(extra);
+
+	success &= assert_equals_int(0, bibdb_add_bulk(bibs, ARRAY_SIZE(bibs), &added),
+			"Bulk call");
+	success &= assert_equals_int(ARRAY_SIZE(bibs), added, "Bulk count");
+	for (i = 0; i < ARRAY_SIZE(bibs); i++)
+		success &= assert_bib("Bulk state", bibs[i], true, false, false);
+
+	/* Colliding with the table is just as bad. */
+	extra = bib_create(&addr4[1], &addr6[1], true, L4PROTO_UDP);
+	if (!assert_not_null(extra, "Allocation of colliding entry"))
+		return false;
+	success &= assert_equals_int(-EEXIST, bibdb_add_bulk(&extra, 1, &added), "Collision");
+	success &= assert_equals_int(0, added, "Collision count");
+	entry_free(extra); /* Its port was never reserved. */
+
+	return success;
+}
+
+/** Number of entries test_pool_arena() preallocates beyond the pools' share. */
+#define EXTRA_ENTRIES 8
+
+/** Entries the pool tests take out of the database's allocators. */
+static struct bib_entry *taken[BIB_POOL_SIZE + EXTRA_ENTRIES];
+
+/** Was "bib" handed back to one of the pools? */
+static bool is_pooled(struct bib_entry *bib)
+{
+	struct bib_pool *pool;
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(pools, cpu);
+		for (i = 0; i < pool->count; i++)
+			if (pool->entries[i] == bib)
+				return true;
+	}
+
+	return false;
+}
+
+static bool test_pool_refill(void)
+{
+	struct bib_pool *pool;
+	struct bib_entry *bib;
+	unsigned int i, n;
+	bool success = true;
+
+	/* Keep the pool's CPU (and its refill work) still while it's drained. */
+	local_bh_disable();
+	pool = this_cpu_ptr(pools);
+	success &= assert_equals_int(BIB_POOL_SIZE, pool->count, "Pool starts full");
+	n = BIB_POOL_SIZE - BIB_POOL_LOW + 1;
+	for (i = 0; i < n; i++)
+		taken[i] = bib_alloc();
+	success &= assert_equals_int(BIB_POOL_LOW - 1, pool->count, "Drained pool");
+	local_bh_enable();
+
+	flush_work(&pool->refill);
+	success &= assert_equals_int(BIB_POOL_SIZE, pool->count, "Refilled pool");
+
+	for (i = 0; i < n; i++)
+		if (taken[i])
+			entry_free(taken[i]);
+
+	/*
+	 * A dead entry should wait out its grace period, then go back to a pool. The callback runs
+	 * on the CPU that queued it, whose pool has room since the entry came from it.
+	 */
+	local_bh_disable();
+	bib = bib_create(&addr4[0], &addr6[0], true, L4PROTO_UDP);
+	if (bib) {
+		success &= assert_false(is_pooled(bib), "The live entry is not pooled");
+		call_rcu_bh(&bib->rcu_hook, bib_free_rcu);
+	}
+	local_bh_enable();
+	if (!assert_not_null(bib, "Allocation of test BIB entry"))
+		return false;
+	rcu_barrier_bh();
+	success &= assert_true(is_pooled(bib), "The dead entry was recycled");
+	success &= assert_equals_u64(0, hosts6_count, "The entry's IPv6 node was returned");
+
+	return success;
+}
+
+static bool test_pool_arena(void)
+{
+	struct bib_pool *pool;
+	unsigned int i, n;
+	int cpu;
+	bool success = true;
+
+	/* The pools are filled from the arena, leaving only the extra entries in it. */
+	for_each_possible_cpu(cpu)
+		success &= assert_equals_int(BIB_POOL_SIZE, per_cpu_ptr(pools, cpu)->count,
+				"Pool filled from the arena");
+	success &= assert_equals_int(EXTRA_ENTRIES, arena.available, "Arena after the pools");
+
+	/* Once both the pool and the arena run dry, allocation fails instead of using the slab. */
+	local_bh_disable();
+	pool = this_cpu_ptr(pools);
+	for (n = 0; n < ARRAY_SIZE(taken); n++) {
+		taken[n] = bib_alloc();
+		if (!taken[n])
+			break;
+	}
+	success &= assert_equals_int(ARRAY_SIZE(taken), n, "Pool and arena entries");
+	success &= assert_null(bib_alloc(), "Exhausted arena");
+	success &= assert_equals_int(0, arena.available, "Exhausted arena's count");
+
+	/*
+	 * The entries return to the arena, and the refill moves them back to the pool. (They're
+	 * returned before the refill gets a chance to run and find the arena empty.)
+	 */
+	for (i = 0; i < n; i++)
+		entry_free(taken[i]);
+	local_bh_enable();
+
+	flush_work(&pool->refill);
+	success &= assert_equals_int(BIB_POOL_SIZE, pool->count, "Pool refilled from the arena");
+	success &= assert_equals_int(EXTRA_ENTRIES, arena.available, "Arena after the refill");
+
+	return success;
+}
+
 static bool init(void)
 {
 	char *pool4_addrs[] = { "1.1.1.1", "2.2.2.2" };
@@ -551,10 +831,25 @@ static bool init(void)
 		addr6[i].l4 = IPV6_PORTS[i];
 	}
 
-	if (is_error(pool4_init(pool4_addrs, ARRAY_SIZE(pool4_addrs))))
+	if (is_error(pool4_init(pool4_addrs, ARRAY_SIZE(pool4_addrs), 0, true, false)))
+		return false;
+
+	if (is_error(bibdb_init(0))) {
+		pool4_destroy();
+		return false;
+	}
+
+	return true;
+}
+
+static bool init_arena(void)
+{
+	char *pool4_addrs[] = { "1.1.1.1" };
+
+	if (is_error(pool4_init(pool4_addrs, ARRAY_SIZE(pool4_addrs), 0, true, false)))
 		return false;
 
-	if (is_error(bibdb_init())) {
+	if (is_error(bibdb_init(num_possible_cpus() * BIB_POOL_SIZE + EXTRA_ENTRIES))) {
 		pool4_destroy();
 		return false;
 	}
@@ -575,9 +870,15 @@ int init_module(void)
 	INIT_CALL_END(init(), simple_bib(), end(), "Single BIB");
 	INIT_CALL_END(init(), test_for_each_ipv6(), end(), "for-each-IPv6 function.");
 	INIT_CALL_END(init(), test_allocate_ipv4_transport_address(), end(), "Allocate function.");
+	INIT_CALL_END(init(), test_host_index(), end(), "Host index");
+	INIT_CALL_END(init_blocks(), test_port_blocks(), end(), "Port blocks");
 	INIT_CALL_END(init(), test_compare_addr6(), end(), "compare_addr6");
 	INIT_CALL_END(init(), test_compare_full6(), end(), "compare_full6");
 	INIT_CALL_END(init(), test_compare_addr4(), end(), "compare_addr4");
+	INIT_CALL_END(init(), test_remote4_filter(), end(), "Remote IPv4 filter");
+	INIT_CALL_END(init(), test_add_bulk(), end(), "Bulk add");
+	INIT_CALL_END(init(), test_pool_refill(), end(), "Entry pool refill and recycling");
+	INIT_CALL_END(init_arena(), test_pool_arena(), end(), "Entry pools over the arena");
 
 	END_TESTS;
 }
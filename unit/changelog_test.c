@@ -0,0 +1,129 @@
+#include <linux/module.h>
+
+#include "nat64/unit/unit_test.h"
+#include "changelog.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Change log module test");
+
+
+#define CAPACITY 8
+
+struct collection {
+	u64 generations[CAPACITY];
+	unsigned int count;
+	/** Stop once this many records have been collected. Zero means never. */
+	unsigned int limit;
+};
+
+static int collect(struct changelog_record *record, void *arg)
+{
+	struct collection *collection = arg;
+
+	collection->generations[collection->count++] = record->generation;
+	return (collection->count == collection->limit) ? 1 : 0;
+}
+
+static void write_events(unsigned int count)
+{
+	struct dbevent_usr event;
+	unsigned int i;
+
+	memset(&event, 0, sizeof(event));
+	event.type = DBEVENT_BIB_ADD;
+	for (i = 0; i < count; i++)
+		changelog_write(&event);
+}
+
+/**
+ * Asserts that the changes since "since" are "since + 1" through "until".
+ */
+static bool assert_changes(u64 since, u64 until, char *test_name)
+{
+	struct collection collection;
+	unsigned int i;
+	bool success = true;
+
+	memset(&collection, 0, sizeof(collection));
+	success &= assert_equals_int(0, changelog_foreach(since, until, collect, &collection),
+			test_name);
+	success &= assert_equals_u32(until - since, collection.count, test_name);
+	for (i = 0; i < collection.count; i++)
+		success &= assert_equals_u64(since + 1 + i, collection.generations[i], test_name);
+
+	return success;
+}
+
+static bool test_ring(void)
+{
+	struct collection collection;
+	bool success = true;
+
+	if (is_error(changelog_init(CAPACITY)))
+		return false;
+
+	success &= assert_equals_u64(0, changelog_generation(), "Empty generation");
+	success &= assert_changes(0, 0, "Nothing happened yet");
+
+	write_events(5);
+	success &= assert_equals_u64(5, changelog_generation(), "Generation");
+	success &= assert_changes(0, 5, "Everything");
+	success &= assert_changes(3, 5, "The latest two");
+	success &= assert_changes(5, 5, "Up to date");
+	success &= assert_changes(1, 3, "Bounded");
+	success &= assert_equals_int(-ESTALE, changelog_foreach(6, 6, collect, &collection),
+			"From the future");
+
+	/* Wrap around. Generations 1 through 4 are forgotten. */
+	write_events(7);
+	success &= assert_changes(4, 12, "Whole ring");
+	success &= assert_changes(10, 12, "Across the wrap");
+	success &= assert_equals_int(-ESTALE, changelog_foreach(3, 12, collect, &collection),
+			"Forgotten");
+	success &= assert_equals_int(-ESTALE, changelog_foreach(0, 12, collect, &collection),
+			"Forgotten from scratch");
+
+	memset(&collection, 0, sizeof(collection));
+	collection.limit = 3;
+	success &= assert_equals_int(1, changelog_foreach(4, 12, collect, &collection),
+			"Interrupted");
+	success &= assert_equals_u32(3, collection.count, "Interrupted count");
+	success &= assert_equals_u64(7, collection.generations[2], "Interrupted last");
+
+	changelog_destroy();
+	return success;
+}
+
+static bool test_disabled(void)
+{
+	struct collection collection;
+	bool success = true;
+
+	if (is_error(changelog_init(0)))
+		return false;
+
+	success &= assert_false(changelog_is_enabled(), "Disabled");
+	write_events(3);
+	success &= assert_equals_int(-EINVAL, changelog_foreach(0, 0, collect, &collection),
+			"Disabled iteration");
+
+	changelog_destroy();
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("Change log");
+
+	CALL_TEST(test_ring(), "Ring");
+	CALL_TEST(test_disabled(), "Disabled log");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
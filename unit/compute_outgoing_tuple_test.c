@@ -28,7 +28,7 @@ static unsigned char *remote4 = "192.168.0.2";
  */
 static bool init(void)
 {
-	if (is_error(sessiondb_init()))
+	if (is_error(sessiondb_init(1, 0, false, false, false)))
 		return false;
 
 	if (!session_inject_str(remote6, 1234, local6, 80, local4, 5678, remote4, 80,
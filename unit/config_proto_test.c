@@ -52,6 +52,10 @@ static bool compare_pktqueue_config(struct pktqueue_config *expected,
 
 	success &= assert_equals_u64(expected->max_pkts, actual->max_pkts,
 			"pkt_queue->max_pkts equals test");
+	success &= assert_equals_u64(expected->max_pkts_per_src, actual->max_pkts_per_src,
+			"pkt_queue->max_pkts_per_src equals test");
+	success &= assert_equals_u64(expected->max_pkts_per_pool4, actual->max_pkts_per_pool4,
+			"pkt_queue->max_pkts_per_pool4 equals test");
 
 	return success;
 }
@@ -65,7 +69,21 @@ static bool compare_session_config(struct sessiondb_config *expected,
 	success &= assert_equals_u64(expected->ttl.tcp_est, actual->ttl.tcp_est, "ttl.tcp_est equals");
 	success &= assert_equals_u64(expected->ttl.tcp_trans, actual->ttl.tcp_trans,
 			"ttl.tcp_trans equals");
+	success &= assert_equals_u64(expected->ttl.tcp_closed, actual->ttl.tcp_closed,
+			"ttl.tcp_closed equals");
 	success &= assert_equals_u64(expected->ttl.udp, actual->ttl.udp, "ttl.udp equals");
+	success &= assert_equals_u64(expected->refresh_granularity, actual->refresh_granularity,
+			"refresh_granularity equals");
+	success &= assert_equals_u64(expected->timer_slack, actual->timer_slack,
+			"timer_slack equals");
+	success &= assert_equals_u64(expected->max_sessions.tcp, actual->max_sessions.tcp,
+			"max_sessions.tcp equals");
+	success &= assert_equals_u64(expected->max_sessions_per_prefix,
+			actual->max_sessions_per_prefix, "max_sessions_per_prefix equals");
+	success &= assert_equals_u64(expected->session_prefix_len, actual->session_prefix_len,
+			"session_prefix_len equals");
+	success &= assert_equals_u64(expected->session_rate_per_prefix,
+			actual->session_rate_per_prefix, "session_rate_per_prefix equals");
 
 	return success;
 }
@@ -102,6 +120,7 @@ static bool compare_translate_config(struct translate_config *expected,
 			"translate: build_ipv4_id");
 	success &= assert_equals_u8(expected->lower_mtu_fail, actual->lower_mtu_fail,
 			"translate: lower_mtu_fail");
+	success &= assert_equals_u8(expected->clamp_mss, actual->clamp_mss, "translate: clamp_mss");
 	success &= assert_equals_u16(expected->mtu_plateau_count, actual->mtu_plateau_count,
 			"translate: mtu_plateau_count");
 	if (success) {
@@ -117,8 +136,14 @@ static bool compare_translate_config(struct translate_config *expected,
 static bool compare_sendpkt_config(struct sendpkt_config *expected,
 		struct sendpkt_config *actual)
 {
-	return assert_equals_u16(expected->min_ipv6_mtu, actual->min_ipv6_mtu,
+	bool success = true;
+
+	success &= assert_equals_u16(expected->min_ipv6_mtu, actual->min_ipv6_mtu,
 			"send_pkt: min_ipv6_mtu");
+	success &= assert_equals_u8(expected->direct_xmit, actual->direct_xmit,
+			"send_pkt: direct_xmit");
+
+	return success;
 }
 
 static bool compare_general_configs(struct response_general *expected_config,
@@ -221,10 +246,10 @@ static bool init(void)
 	error = pktqueue_init();
 	if (error)
 		goto fail;
-	error = sessiondb_init();
+	error = sessiondb_init(1, 0, false, false, false);
 	if (error)
 		goto fail;
-	error = fragdb_init();
+	error = fragdb_init(1);
 	if (error)
 		goto fail;
 	error = filtering_init();
@@ -0,0 +1,242 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/comm/str_utils.h"
+#include "eam.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("EAMT module test");
+
+
+static int init_entry(char *addr6_str, __u8 len6, char *addr4_str, __u8 len4,
+		struct eam_entry *entry)
+{
+	if (str_to_addr6(addr6_str, &entry->prefix6.address) != 0
+			|| str_to_addr4(addr4_str, &entry->prefix4.address) != 0) {
+		log_err("Cannot parse '%s' or '%s'.", addr6_str, addr4_str);
+		return -EINVAL;
+	}
+	entry->prefix6.len = len6;
+	entry->prefix4.len = len4;
+
+	return 0;
+}
+
+static int add_entry(char *addr6_str, __u8 len6, char *addr4_str, __u8 len4)
+{
+	struct eam_entry entry;
+	int error;
+
+	error = init_entry(addr6_str, len6, addr4_str, len4, &entry);
+	return error ? error : eamt_add(&entry, 1);
+}
+
+static bool assert_xlat(char *addr6_str, char *addr4_str, char *test_name)
+{
+	struct in6_addr addr6, result6;
+	struct in_addr addr4, result4;
+	bool success = true;
+
+	if (str_to_addr6(addr6_str, &addr6) != 0 || str_to_addr4(addr4_str, &addr4) != 0) {
+		log_err("Cannot parse the test's addresses.");
+		return false;
+	}
+
+	success &= assert_equals_int(0, eamt_xlat_6to4(&addr6, &result4), test_name);
+	success &= assert_equals_ipv4(&addr4, &result4, test_name);
+	success &= assert_equals_int(0, eamt_xlat_4to6(&addr4, &result6), test_name);
+	success &= assert_equals_ipv6(&addr6, &result6, test_name);
+	success &= assert_true(eamt_contains6(&addr6), test_name);
+	success &= assert_true(eamt_contains4(addr4.s_addr), test_name);
+
+	return success;
+}
+
+static bool assert_not_xlat(char *addr6_str, char *addr4_str, char *test_name)
+{
+	struct in6_addr addr6, result6;
+	struct in_addr addr4, result4;
+	bool success = true;
+
+	if (str_to_addr6(addr6_str, &addr6) != 0 || str_to_addr4(addr4_str, &addr4) != 0) {
+		log_err("Cannot parse the test's addresses.");
+		return false;
+	}
+
+	success &= assert_equals_int(-ENOENT, eamt_xlat_6to4(&addr6, &result4), test_name);
+	success &= assert_equals_int(-ENOENT, eamt_xlat_4to6(&addr4, &result6), test_name);
+	success &= assert_false(eamt_contains6(&addr6), test_name);
+	success &= assert_false(eamt_contains4(addr4.s_addr), test_name);
+
+	return success;
+}
+
+static bool test_xlat(void)
+{
+	bool success = true;
+
+	if (add_entry("2001:db8:aaaa::", 120, "192.0.2.0", 24) != 0
+			|| add_entry("2001:db8:bbbb::1", 128, "198.51.100.7", 32) != 0
+			|| add_entry("2001:db8:cccc::", 96, "0.0.0.0", 0) != 0)
+		return false;
+
+	success &= assert_xlat("2001:db8:aaaa::", "192.0.2.0", "/24, first address");
+	success &= assert_xlat("2001:db8:aaaa::2a", "192.0.2.42", "/24, suffix copied");
+	success &= assert_xlat("2001:db8:aaaa::ff", "192.0.2.255", "/24, last address");
+	success &= assert_xlat("2001:db8:bbbb::1", "198.51.100.7", "/32");
+	success &= assert_xlat("2001:db8:cccc::cb00:7101", "203.0.113.1", "/0");
+
+	return success;
+}
+
+static bool test_longest_match(void)
+{
+	bool success = true;
+
+	if (add_entry("2001:db8:aaaa::", 120, "192.0.2.0", 24) != 0
+			|| add_entry("2001:db8:bbbb::", 124, "192.0.2.16", 28) != 0)
+		return false;
+
+	/* The /28 lies within the /24; it wins, but only inside itself. */
+	success &= assert_xlat("2001:db8:bbbb::3", "192.0.2.19", "Longest IPv4 prefix");
+	success &= assert_xlat("2001:db8:aaaa::20", "192.0.2.32", "Outside the /28");
+	success &= assert_not_xlat("2001:db8:dddd::1", "203.0.113.1", "Outside everything");
+
+	return success;
+}
+
+static bool test_validation(void)
+{
+	bool success = true;
+
+	success &= assert_equals_int(-EINVAL, add_entry("2001:db8::", 120, "192.0.2.0", 16),
+			"Suffixes of different lengths");
+	success &= assert_equals_int(-EINVAL, add_entry("2001:db8::1", 120, "192.0.2.0", 24),
+			"IPv6 prefix with a suffix");
+	success &= assert_equals_int(-EINVAL, add_entry("2001:db8::", 120, "192.0.2.1", 24),
+			"IPv4 prefix with a suffix");
+	success &= assert_equals_int(-EINVAL, add_entry("2001:db8::", 130, "192.0.2.0", 34),
+			"Lengths out of range");
+
+	success &= assert_equals_int(0, add_entry("2001:db8::", 120, "192.0.2.0", 24), "Valid");
+	success &= assert_equals_int(-EEXIST, add_entry("2001:db8::", 120, "198.51.100.0", 24),
+			"Repeated IPv6 prefix");
+	success &= assert_equals_int(-EEXIST, add_entry("2001:db8:1::", 120, "192.0.2.0", 24),
+			"Repeated IPv4 prefix");
+
+	return success;
+}
+
+static bool test_remove_and_flush(void)
+{
+	struct eam_entry entry;
+	__u64 count;
+	bool success = true;
+
+	if (add_entry("2001:db8:aaaa::", 120, "192.0.2.0", 24) != 0
+			|| add_entry("2001:db8:bbbb::", 120, "198.51.100.0", 24) != 0)
+		return false;
+	if (init_entry("2001:db8:aaaa::", 120, "192.0.2.0", 24, &entry) != 0)
+		return false;
+
+	success &= assert_equals_int(0, eamt_remove(&entry), "Remove");
+	success &= assert_equals_int(-ENOENT, eamt_remove(&entry), "Remove again");
+	success &= assert_not_xlat("2001:db8:aaaa::1", "192.0.2.1", "Removed entry");
+	success &= assert_xlat("2001:db8:bbbb::1", "198.51.100.1", "Remaining entry");
+	success &= assert_equals_int(0, eamt_count(&count), "Count");
+	success &= assert_equals_u64(1, count, "Count after remove");
+
+	success &= assert_equals_int(0, eamt_flush(), "Flush");
+	success &= assert_not_xlat("2001:db8:bbbb::1", "198.51.100.1", "Flushed table");
+	success &= assert_equals_int(0, eamt_count(&count), "Count");
+	success &= assert_equals_u64(0, count, "Count after flush");
+
+	return success;
+}
+
+#define BULK_COUNT 4096
+
+static bool test_bulk(void)
+{
+	struct eam_entry *entries;
+	struct eam_entry repeated[2];
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	__u64 count;
+	unsigned int i;
+	bool success = true;
+
+	entries = kmalloc(BULK_COUNT * sizeof(*entries), GFP_KERNEL);
+	if (!entries)
+		return false;
+
+	/* 2001:db8::<i>00/120 <-> 10.<i>.0/24. */
+	for (i = 0; i < BULK_COUNT; i++) {
+		memset(&entries[i].prefix6.address, 0, sizeof(entries[i].prefix6.address));
+		entries[i].prefix6.address.s6_addr32[0] = cpu_to_be32(0x20010db8);
+		entries[i].prefix6.address.s6_addr32[3] = cpu_to_be32(i << 8);
+		entries[i].prefix6.len = 120;
+		entries[i].prefix4.address.s_addr = cpu_to_be32(0x0a000000 | (i << 8));
+		entries[i].prefix4.len = 24;
+	}
+
+	success &= assert_equals_int(0, eamt_add(entries, BULK_COUNT), "Bulk add");
+	success &= assert_equals_int(0, eamt_count(&count), "Count");
+	success &= assert_equals_u64(BULK_COUNT, count, "Count after bulk add");
+
+	for (i = 0; i < BULK_COUNT; i += 97) {
+		addr6 = entries[i].prefix6.address;
+		addr6.s6_addr[15] = 0x2a;
+		success &= assert_equals_int(0, eamt_xlat_6to4(&addr6, &addr4), "6to4");
+		success &= assert_equals_be32(entries[i].prefix4.address.s_addr | cpu_to_be32(0x2a),
+				addr4.s_addr, "6to4 result");
+		success &= assert_equals_int(0, eamt_xlat_4to6(&addr4, &addr6), "4to6");
+		success &= assert_equals_be32(entries[i].prefix6.address.s6_addr32[3]
+				| cpu_to_be32(0x2a), addr6.s6_addr32[3], "4to6 result");
+	}
+
+	/* A batch is all or nothing. */
+	if (init_entry("2001:db8:1::", 120, "192.0.2.0", 24, &repeated[0]) != 0) {
+		kfree(entries);
+		return false;
+	}
+	repeated[1] = entries[BULK_COUNT / 2];
+	success &= assert_equals_int(-EEXIST, eamt_add(repeated, 2), "Batch with a repeated entry");
+	success &= assert_equals_int(0, eamt_count(&count), "Count");
+	success &= assert_equals_u64(BULK_COUNT, count, "Count after failed batch");
+	success &= assert_not_xlat("2001:db8:1::1", "192.0.2.1", "The batch was reverted");
+
+	kfree(entries);
+	return success;
+}
+
+static bool init(void)
+{
+	return !is_error(eamt_init());
+}
+
+static void destroy(void)
+{
+	eamt_destroy();
+}
+
+int init_module(void)
+{
+	START_TESTS("EAMT");
+
+	INIT_CALL_END(init(), test_xlat(), destroy(), "Translation");
+	INIT_CALL_END(init(), test_longest_match(), destroy(), "Longest prefix match");
+	INIT_CALL_END(init(), test_validation(), destroy(), "Validation");
+	INIT_CALL_END(init(), test_remove_and_flush(), destroy(), "Remove and flush");
+	INIT_CALL_END(init(), test_bulk(), destroy(), "Bulk load");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
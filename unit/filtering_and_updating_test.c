@@ -51,8 +51,8 @@ static bool assert_bib_exists(unsigned char *addr6, u16 port6, unsigned char *ad
 	if (!success)
 		return false;
 
-	success &= assert_equals_ipv6_str(addr6, &bib->ipv6.l3, "IPv6 address");
-	success &= assert_equals_u16(port6, bib->ipv6.l4, "IPv6 port");
+	success &= assert_equals_ipv6_str(addr6, &bib->host->addr, "IPv6 address");
+	success &= assert_equals_u16(port6, bib->port6, "IPv6 port");
 	success &= assert_equals_ipv4_str(addr4, &bib->ipv4.l3, "IPv4 address");
 	success &= assert_equals_u16(port4, bib->ipv4.l4, "IPv4 port");
 	success &= assert_false(bib->is_static, "BIB is dynamic");
@@ -88,6 +88,7 @@ static bool assert_session_exists(unsigned char *remote_addr6, u16 remote_port6,
 		l4_protocol proto, u_int8_t state)
 {
 	struct session_entry *session;
+	struct ipv6_transport_addr local6;
 	struct tuple tuple6;
 	int error;
 	bool success = true;
@@ -102,8 +103,9 @@ static bool assert_session_exists(unsigned char *remote_addr6, u16 remote_port6,
 
 	success &= assert_equals_ipv6_str(remote_addr6, &session->remote6.l3, "remote addr6");
 	success &= assert_equals_u16(remote_port6, session->remote6.l4, "remote port6");
-	success &= assert_equals_ipv6_str(local_addr6, &session->local6.l3, "local addr6");
-	success &= assert_equals_u16(local_port6, session->local6.l4, "local port6");
+	session_local6(session, &local6);
+	success &= assert_equals_ipv6_str(local_addr6, &local6.l3, "local addr6");
+	success &= assert_equals_u16(local_port6, local6.l4, "local port6");
 	success &= assert_equals_ipv4_str(local_addr4, &session->local4.l3, "local addr4");
 	success &= assert_equals_u16(local_port4, session->local4.l4, "local port4");
 	success &= assert_equals_ipv4_str(remote_addr4, &session->remote4.l3, "remote addr4");
@@ -124,6 +126,7 @@ static bool test_filtering_and_updating(void)
 {
 	struct sk_buff *skb;
 	struct tuple tuple;
+	struct session_entry *session;
 	bool success = true;
 
 	/* ICMP errors should pass happily, but not affect the tables. */
@@ -132,7 +135,8 @@ static bool test_filtering_and_updating(void)
 	if (is_error(create_skb4_icmp_error(&tuple, &skb, 100, 32)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, filtering_and_updating(skb, &tuple), "ICMP error");
+	success &= assert_equals_int(VER_CONTINUE, filtering_and_updating(skb, &tuple, NULL),
+			"ICMP error");
 	success &= assert_bib_count(0, L4PROTO_ICMP);
 	success &= assert_session_count(0, L4PROTO_ICMP);
 
@@ -146,7 +150,8 @@ static bool test_filtering_and_updating(void)
 	if (is_error(create_skb6_udp(&tuple, &skb, 100, 32)))
 		return false;
 
-	success &= assert_equals_int(VER_DROP, filtering_and_updating(skb, &tuple), "Hairpinning");
+	success &= assert_equals_int(VER_DROP, filtering_and_updating(skb, &tuple, NULL),
+			"Hairpinning");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -161,7 +166,8 @@ static bool test_filtering_and_updating(void)
 	if (is_error(create_skb6_udp(&tuple, &skb, 100, 32)))
 		return false;
 
-	success &= assert_equals_int(VER_DROP, filtering_and_updating(skb, &tuple), "Not pool6 packet");
+	success &= assert_equals_int(VER_DROP, filtering_and_updating(skb, &tuple, NULL),
+			"Not pool6 packet");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -176,7 +182,8 @@ static bool test_filtering_and_updating(void)
 	if (is_error(create_skb4_udp(&tuple, &skb, 100, 32)))
 		return false;
 
-	success &= assert_equals_int(VER_DROP, filtering_and_updating(skb, &tuple), "Not pool4 packet");
+	success &= assert_equals_int(VER_DROP, filtering_and_updating(skb, &tuple, NULL),
+			"Not pool4 packet");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -190,7 +197,16 @@ static bool test_filtering_and_updating(void)
 	if (is_error(create_skb6_udp(&tuple, &skb, 100, 32)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, filtering_and_updating(skb, &tuple), "IPv6 success");
+	rcu_read_lock_bh();
+	success &= assert_equals_int(VER_CONTINUE, filtering_and_updating(skb, &tuple, &session),
+			"IPv6 success");
+	/* Step 3 should get the session for free. */
+	if (assert_not_null(session, "IPv6 success session"))
+		success &= assert_equals_ipv6(&tuple.src.addr6.l3, &session->remote6.l3,
+				"IPv6 success session remote6");
+	else
+		success = false;
+	rcu_read_unlock_bh();
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_session_count(1, L4PROTO_UDP);
 
@@ -204,7 +220,8 @@ static bool test_filtering_and_updating(void)
 	if (is_error(create_skb4_udp(&tuple, &skb, 100, 32)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, filtering_and_updating(skb, &tuple), "IPv4 success");
+	success &= assert_equals_int(VER_CONTINUE, filtering_and_updating(skb, &tuple, NULL),
+			"IPv4 success");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_session_count(1, L4PROTO_UDP);
 
@@ -232,12 +249,12 @@ static bool test_udp(void)
 		return false;
 
 	/* A IPv4 packet attempts to be translated without state */
-	success &= assert_equals_int(VER_DROP, ipv4_simple(skb4, &tuple4), "result 1");
+	success &= assert_equals_int(VER_DROP, ipv4_simple(skb4, &tuple4, NULL), "result 1");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
 	/* IPv6 packet gets translated correctly. */
-	success &= assert_equals_int(VER_CONTINUE, ipv6_simple(skb6, &tuple6), "result 2");
+	success &= assert_equals_int(VER_CONTINUE, ipv6_simple(skb6, &tuple6, NULL), "result 2");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_UDP, 1);
 	success &= assert_session_count(1, L4PROTO_UDP);
@@ -246,7 +263,7 @@ static bool test_udp(void)
 			L4PROTO_UDP, 0);
 
 	/* Now that there's state, the IPv4 packet manages to traverse. */
-	success &= assert_equals_int(VER_CONTINUE, ipv4_simple(skb4, &tuple4), "result 3");
+	success &= assert_equals_int(VER_CONTINUE, ipv4_simple(skb4, &tuple4, NULL), "result 3");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_UDP, 1);
 	success &= assert_session_count(1, L4PROTO_UDP);
@@ -260,6 +277,67 @@ static bool test_udp(void)
 	return success;
 }
 
+static bool test_established(void)
+{
+	struct sk_buff *skb6, *skb4;
+	struct tuple tuple6, tuple4;
+	struct session_entry *session, *session6;
+	bool success = true;
+
+	if (is_error(init_ipv6_tuple(&tuple6, "1::2", 1212, "3::4", 3434, L4PROTO_UDP)))
+		return false;
+	if (is_error(create_skb6_udp(&tuple6, &skb6, 16, 32)))
+		return false;
+	if (is_error(init_ipv4_tuple(&tuple4, "0.0.0.4", 3434, "192.168.2.1", 1024, L4PROTO_UDP)))
+		return false;
+	if (is_error(create_skb4_udp(&tuple4, &skb4, 16, 32)))
+		return false;
+
+	/* The sessions come without references, so they're only ours during this. */
+	rcu_read_lock_bh();
+
+	/* No state yet, so both packets need the slow path. */
+	success &= assert_equals_int(VER_CONTINUE, filtering_established(skb6, &tuple6, &session),
+			"6 miss result");
+	success &= assert_null(session, "6 miss session");
+	success &= assert_equals_int(VER_CONTINUE, filtering_established(skb4, &tuple4, &session),
+			"4 miss result");
+	success &= assert_null(session, "4 miss session");
+	success &= assert_session_count(0, L4PROTO_UDP);
+
+	success &= assert_equals_int(VER_CONTINUE, ipv6_simple(skb6, &tuple6, NULL), "slow path");
+
+	/* Now both of them find it. */
+	success &= assert_equals_int(VER_CONTINUE, filtering_established(skb6, &tuple6, &session),
+			"6 hit result");
+	if (!assert_not_null(session, "6 hit session"))
+		goto fail;
+	success &= assert_equals_ipv4_str("192.168.2.1", &session->local4.l3, "6 hit local4");
+	session6 = session;
+
+	success &= assert_equals_int(VER_CONTINUE, filtering_established(skb4, &tuple4, &session),
+			"4 hit result");
+	if (!assert_not_null(session, "4 hit session"))
+		goto fail;
+	success &= assert_equals_ipv6_str("1::2", &session->remote6.l3, "4 hit remote6");
+	success &= assert_equals_ptr(session6, session, "Both directions, same session");
+
+	rcu_read_unlock_bh();
+
+	success &= assert_bib_count(1, L4PROTO_UDP);
+	success &= assert_session_count(1, L4PROTO_UDP);
+
+	kfree_skb(skb6);
+	kfree_skb(skb4);
+	return success;
+
+fail:
+	rcu_read_unlock_bh();
+	kfree_skb(skb6);
+	kfree_skb(skb4);
+	return false;
+}
+
 static bool test_icmp(void)
 {
 	struct sk_buff *skb6, *skb4;
@@ -279,12 +357,12 @@ static bool test_icmp(void)
 		return false;
 
 	/* A IPv4 packet attempts to be translated without state */
-	success &= assert_equals_int(VER_DROP, ipv4_simple(skb4, &tuple4), "result");
+	success &= assert_equals_int(VER_DROP, ipv4_simple(skb4, &tuple4, NULL), "result");
 	success &= assert_bib_count(0, L4PROTO_ICMP);
 	success &= assert_session_count(0, L4PROTO_ICMP);
 
 	/* IPv6 packet and gets translated correctly. */
-	success &= assert_equals_int(VER_CONTINUE, ipv6_simple(skb6, &tuple6), "result");
+	success &= assert_equals_int(VER_CONTINUE, ipv6_simple(skb6, &tuple6, NULL), "result");
 	success &= assert_bib_count(1, L4PROTO_ICMP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_ICMP, 1);
 	success &= assert_session_count(1, L4PROTO_ICMP);
@@ -293,7 +371,7 @@ static bool test_icmp(void)
 			L4PROTO_ICMP, 0);
 
 	/* Now that there's state, the IPv4 packet manages to traverse. */
-	success &= assert_equals_int(VER_CONTINUE, ipv4_simple(skb4, &tuple4), "result");
+	success &= assert_equals_int(VER_CONTINUE, ipv4_simple(skb4, &tuple4, NULL), "result");
 	success &= assert_bib_count(1, L4PROTO_ICMP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_ICMP, 1);
 	success &= assert_session_count(1, L4PROTO_ICMP);
@@ -385,7 +463,7 @@ static bool test_tcp_closed_state_handle_6(void)
 		return false;
 
 	/* Evaluate */
-	success &= assert_equals_int(VER_CONTINUE, tcp_closed_state_handle(skb, &tuple6),
+	success &= assert_equals_int(VER_CONTINUE, tcp_closed_state_handle(skb, &tuple6, NULL),
 			"V6 syn-result");
 
 	/* Validate */
@@ -409,8 +487,8 @@ static bool test_tcp_closed_state_handle_4(void)
 	if (is_error(init_ipv4_tuple(&tuple4, "5.6.7.8", 5678, "192.168.2.1", 8765, L4PROTO_TCP)))
 		return false;
 	/* The session entry that is supposed to be created in "tcp_close_state_handle". */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "192.168.2.1", 8765, "5.6.7.8", 5678,
-			V4_INIT);
+	session = session_create_str_tcp("1::2", 1212, "3::506:708", 5678, "192.168.2.1", 8765,
+			"5.6.7.8", 5678, V4_INIT);
 	if (!session)
 		return false;
 
@@ -425,7 +503,8 @@ static bool test_tcp_closed_state_handle_4(void)
 	hdr_tcp->fin = false;
 
 	/* Evaluate */
-	success &= assert_equals_int(VER_STOLEN, tcp_closed_state_handle(skb, &tuple4), "V4 syn-result");
+	success &= assert_equals_int(VER_STOLEN, tcp_closed_state_handle(skb, &tuple4, NULL),
+			"V4 syn-result");
 
 	/* Validate */
 	success &= assert_equals_int(0, sessiondb_get(&tuple4, &copy_ptr), "V4 syn-session.");
@@ -441,6 +520,20 @@ static bool test_tcp_closed_state_handle_4(void)
 	return success;
 }
 
+/**
+ * tcp() borrows the sessions it finds, so it needs the RCU lock the packet path would be holding.
+ */
+static verdict tcp_rcu(struct sk_buff *skb, struct tuple *tuple)
+{
+	verdict result;
+
+	rcu_read_lock_bh();
+	result = tcp(skb, tuple, NULL);
+	rcu_read_unlock_bh();
+
+	return result;
+}
+
 /**
  * We'll just chain a handful of packets, since testing every combination would take forever and
  * the inner functions are tested in session db anyway.
@@ -461,7 +554,7 @@ static bool test_tcp(void)
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, true, false, false)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, tcp(skb, &tuple6), "Closed-result");
+	success &= assert_equals_int(VER_CONTINUE, tcp_rcu(skb, &tuple6), "Closed-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -475,7 +568,7 @@ static bool test_tcp(void)
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, true, false, false)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, tcp(skb, &tuple4), "V6 init-result");
+	success &= assert_equals_int(VER_CONTINUE, tcp_rcu(skb, &tuple4), "V6 init-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -489,7 +582,7 @@ static bool test_tcp(void)
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, true, false)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, tcp(skb, &tuple6), "Established-result");
+	success &= assert_equals_int(VER_CONTINUE, tcp_rcu(skb, &tuple6), "Established-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -503,7 +596,7 @@ static bool test_tcp(void)
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, true, false, false)))
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, tcp(skb, &tuple6), "Trans-result");
+	success &= assert_equals_int(VER_CONTINUE, tcp_rcu(skb, &tuple6), "Trans-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.168.2.1", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -524,16 +617,16 @@ static bool init_full(void)
 	error = pool6_init(prefixes, ARRAY_SIZE(prefixes));
 	if (error)
 		goto fail;
-	error = pool4_init(NULL, 0);
+	error = pool4_init(NULL, 0, 0, true, false);
 	if (error)
 		goto fail;
 	error = pktqueue_init();
 	if (error)
 		goto fail;
-	error = bibdb_init();
+	error = bibdb_init(0);
 	if (error)
 		goto fail;
-	error = sessiondb_init();
+	error = sessiondb_init(1, 0, false, false, false);
 	if (error)
 		goto fail;
 	error = filtering_init();
@@ -566,6 +659,7 @@ static int filtering_test_init(void)
 
 	/* UDP */
 	INIT_CALL_END(init_full(), test_udp(), end_full(), "UDP");
+	INIT_CALL_END(init_full(), test_established(), end_full(), "Established sessions");
 
 	/* ICMP */
 	INIT_CALL_END(init_full(), test_icmp(), end_full(), "ICMP");
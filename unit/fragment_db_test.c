@@ -1,10 +1,12 @@
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/inet.h>
 
 #include "nat64/unit/unit_test.h"
 #include "nat64/unit/skb_generator.h"
 #include "nat64/unit/validator.h"
 #include "nat64/unit/types.h"
+#include "nat64/comm/str_utils.h"
 
 #define GENERATE_FOR_EACH true
 #include "fragment_db.c"
@@ -69,14 +71,14 @@ static bool validate_database(int expected_count)
 	bool success = true;
 
 	/* list */
-	list_for_each(node, &expire_list) {
+	list_for_each(node, &shards[0].expire_list) {
 		p++;
 	}
 	success &= assert_equals_int(expected_count, p, "Packets in the list");
 
 	/* table */
 	p = 0;
-	fragdb_table_for_each(&table, fragdb_counter, &p);
+	fragdb_table_for_each(&shards[0].table, fragdb_counter, &p);
 	success &= assert_equals_int(expected_count, p, "Packets in the hash table");
 
 	return success;
@@ -101,7 +103,7 @@ static bool test_no_fragments_6(void)
 	if (error)
 		return false;
 
-	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb, &full_skb), "Verdict");
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb, &full_skb, NULL), "Verdict");
 	success &= validate_packet(full_skb, 1);
 	success &= validate_fragment(full_skb, true, false, 10);
 	success &= validate_database(0);
@@ -130,7 +132,7 @@ static bool test_no_fragments_4(void)
 		return false;
 
 	/* Test */
-	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb, &full_skb), "Verdict");
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb, &full_skb, NULL), "Verdict");
 	if (!success)
 		return false;
 
@@ -164,21 +166,21 @@ static bool test_ordered_fragments_4(void)
 			32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb1, &full_skb), "1st verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb1, &full_skb, NULL), "1st verdict");
 	success &= validate_database(1);
 
 	/* Second fragment arrives. */
 	error = create_skb4_udp_frag(&tuple4, &skb2, 128, 384, false, true, 64, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb2, &full_skb), "2nd verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb2, &full_skb, NULL), "2nd verdict");
 	success &= validate_database(1);
 
 	/* Third and final fragment arrives. */
 	error = create_skb4_udp_frag(&tuple4, &skb3, 192, 384, false, false, 192, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb3, &full_skb), "3rd verdict");
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb3, &full_skb, NULL), "3rd verdict");
 	success &= validate_database(0);
 
 	/* Validate the packet. */
@@ -221,14 +223,14 @@ static bool test_ordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb1, 64 - sizeof(struct udphdr), 384, true, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb1, &full_skb), "1st verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb1, &full_skb, NULL), "1st verdict");
 	success &= validate_database(1);
 
 	/* Second fragment arrives. */
 	error = create_skb6_udp_frag(&tuple6, &skb2, 128, 384, true, true, 64, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb2, &full_skb), "2nd verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb2, &full_skb, NULL), "2nd verdict");
 	success &= validate_database(1);
 
 	/* Third and final fragment arrives. */
@@ -236,7 +238,7 @@ static bool test_ordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb3, 192, 384, true, false, 192, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb3, &full_skb), "3rd verdict");
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb3, &full_skb, NULL), "3rd verdict");
 	success &= validate_database(0);
 
 	/* Validate the packet. */
@@ -269,7 +271,7 @@ static bool test_disordered_fragments_4(void)
 	struct sk_buff *skb1, *skb2, *skb3, *skb4, *skb5;
 	struct tuple tuple4;
 	struct reassembly_buffer *buffer;
-	struct hole_descriptor *hole;
+	struct hole_range *hole;
 	int error;
 	int success = true;
 
@@ -281,18 +283,18 @@ static bool test_disordered_fragments_4(void)
 	error = create_skb4_udp_frag(&tuple4, &skb3, 8, 56, false, true, 24, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb3, &full_skb), "verdict 1");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb3, &full_skb, NULL), "verdict 1");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 1");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 1");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(0, hole->first, "1.1.first");
 	success &= assert_equals_u16(2, hole->last, "1.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(4, hole->first, "1.2.first");
 	success &= assert_equals_u16(INFINITY, hole->last, "1.2.last");
 
@@ -300,18 +302,18 @@ static bool test_disordered_fragments_4(void)
 	error = create_skb4_udp_frag(&tuple4, &skb1, 8, 56, false, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb1, &full_skb), "verdict 2");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb1, &full_skb, NULL), "verdict 2");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 2");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 2");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(2, hole->first, "2.1.first");
 	success &= assert_equals_u16(2, hole->last, "2.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(4, hole->first, "2.2.first");
 	success &= assert_equals_u16(INFINITY, hole->last, "2.2.last");
 
@@ -319,18 +321,18 @@ static bool test_disordered_fragments_4(void)
 	error = create_skb4_udp_frag(&tuple4, &skb5, 8, 56, false, false, 48, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb5, &full_skb), "verdict 3");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb5, &full_skb, NULL), "verdict 3");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 3");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 3");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(2, hole->first, "3.1.first");
 	success &= assert_equals_u16(2, hole->last, "3.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(4, hole->first, "3.2.first");
 	success &= assert_equals_u16(5, hole->last, "3.2.last");
 
@@ -338,15 +340,15 @@ static bool test_disordered_fragments_4(void)
 	error = create_skb4_udp_frag(&tuple4, &skb2, 8, 56, false, true, 16, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb2, &full_skb), "verdict 4");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb2, &full_skb, NULL), "verdict 4");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(1, &buffer->holes, "Hole count 4");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(1, buffer->hole_count, "Hole count 4");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(4, hole->first, "4.1.first");
 	success &= assert_equals_u16(5, hole->last, "4.1.last");
 
@@ -354,7 +356,7 @@ static bool test_disordered_fragments_4(void)
 	error = create_skb4_udp_frag(&tuple4, &skb4, 16, 56, false, true, 32, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb4, &full_skb), "verdict 5");
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb4, &full_skb, NULL), "verdict 5");
 	success &= validate_database(0);
 	if (!success)
 		return false;
@@ -395,7 +397,7 @@ static bool test_disordered_fragments_6(void)
 	struct sk_buff *skb1, *skb2, *skb3, *skb4, *skb5, *skb6;
 	struct tuple tuple6;
 	struct reassembly_buffer *buffer;
-	struct hole_descriptor *hole;
+	struct hole_range *hole;
 	int error;
 	int success = true;
 
@@ -407,18 +409,18 @@ static bool test_disordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb1, 24, 72, true, true, 24, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb1, &full_skb), "verdict 1");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb1, &full_skb, NULL), "verdict 1");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 1");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 1");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(0, hole->first, "1.1.first");
 	success &= assert_equals_u16(2, hole->last, "1.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(6, hole->first, "1.2.first");
 	success &= assert_equals_u16(INFINITY, hole->last, "1.2.last");
 
@@ -426,18 +428,18 @@ static bool test_disordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb2, 16, 72, true, true, 16, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb2, &full_skb), "verdict 2");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb2, &full_skb, NULL), "verdict 2");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 2");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 2");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(0, hole->first, "2.1.first");
 	success &= assert_equals_u16(1, hole->last, "2.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(6, hole->first, "2.2.first");
 	success &= assert_equals_u16(INFINITY, hole->last, "2.2.last");
 
@@ -445,18 +447,18 @@ static bool test_disordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb3, 16, 72, true, true, 40, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb3, &full_skb), "verdict 3");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb3, &full_skb, NULL), "verdict 3");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 3");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 3");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(0, hole->first, "3.1.first");
 	success &= assert_equals_u16(1, hole->last, "3.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(7, hole->first, "3.2.first");
 	success &= assert_equals_u16(INFINITY, hole->last, "3.2.last");
 
@@ -464,18 +466,18 @@ static bool test_disordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb4, 56, 72, true, true, 8, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb4, &full_skb), "verdict 4");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb4, &full_skb, NULL), "verdict 4");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(2, &buffer->holes, "Hole count 4");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(2, buffer->hole_count, "Hole count 4");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(0, hole->first, "4.1.first");
 	success &= assert_equals_u16(0, hole->last, "4.1.last");
-	hole = list_entry(hole->list_hook.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[1];
 	success &= assert_equals_u16(8, hole->first, "4.2.first");
 	success &= assert_equals_u16(INFINITY, hole->last, "4.2.last");
 
@@ -483,15 +485,15 @@ static bool test_disordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb5, 8, 72, true, false, 64, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb5, &full_skb), "verdict 5");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb5, &full_skb, NULL), "verdict 5");
 	success &= validate_database(1);
 
-	buffer = list_entry(expire_list.prev, struct reassembly_buffer, list_hook);
-	success &= assert_list_count(1, &buffer->holes, "Hole count 5");
+	buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer, list_hook);
+	success &= assert_equals_u32(1, buffer->hole_count, "Hole count 5");
 	if (!success)
 		return false;
 
-	hole = list_entry(buffer->holes.next, struct hole_descriptor, list_hook);
+	hole = &buffer->hole_arr[0];
 	success &= assert_equals_u16(0, hole->first, "5.1.first");
 	success &= assert_equals_u16(0, hole->last, "5.1.last");
 
@@ -499,7 +501,7 @@ static bool test_disordered_fragments_6(void)
 	error = create_skb6_udp_frag(&tuple6, &skb6, 0, 72, true, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb6, &full_skb), "verdict 6");
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb6, &full_skb, NULL), "verdict 6");
 	success &= validate_database(0);
 
 	/* Validate the packet. */
@@ -528,6 +530,67 @@ static bool test_disordered_fragments_6(void)
 	return success;
 }
 
+/**
+ * Sends the even fragments first, so the buffer runs out of inline holes and has to fall back to
+ * the hole descriptor list.
+ */
+static bool test_many_holes(void)
+{
+	/* Byte offsets divided by 8, in arrival order. */
+	const u16 order[] = { 2, 4, 6, 8, 9, 1, 3, 5, 7, 0 };
+	struct sk_buff *full_skb = NULL;
+	struct sk_buff *skb;
+	struct tuple tuple6;
+	struct reassembly_buffer *buffer;
+	unsigned int i;
+	int error;
+	bool success = true;
+
+	error = init_ipv6_tuple(&tuple6, "1::2", 1212, "3::4", 3434, L4PROTO_UDP);
+	if (error)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(order); i++) {
+		error = create_skb6_udp_frag(&tuple6, &skb, order[i] ? 8 : 0, 80, true,
+				order[i] != 9, 8 * order[i], 32);
+		if (error)
+			return false;
+		if (i == ARRAY_SIZE(order) - 1)
+			break;
+
+		success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb, &full_skb, NULL),
+				"Stolen verdict");
+		success &= validate_database(1);
+		if (!success)
+			return false;
+
+		buffer = list_entry(shards[0].expire_list.prev, struct reassembly_buffer,
+				list_hook);
+		switch (i) {
+		case 2:
+			success &= assert_equals_u32(4, buffer->hole_count, "Inline full");
+			success &= assert_list_count(0, &buffer->holes, "Nothing spilled yet");
+			break;
+		case 3:
+			success &= assert_equals_u32(0, buffer->hole_count, "Inline dropped");
+			success &= assert_list_count(5, &buffer->holes, "Holes spilled");
+			break;
+		case 4:
+			success &= assert_list_count(4, &buffer->holes, "The list keeps working");
+			break;
+		}
+	}
+
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle6(skb, &full_skb, NULL), "Verdict");
+	success &= validate_database(0);
+	if (full_skb) {
+		success &= validate_packet(full_skb, ARRAY_SIZE(order));
+		kfree_skb_queued(full_skb);
+	}
+
+	return success;
+}
+
 static bool validate_list(struct reassembly_buffer_key *expected, int expected_count)
 {
 	struct reassembly_buffer *current_buffer;
@@ -537,7 +600,7 @@ static bool validate_list(struct reassembly_buffer_key *expected, int expected_c
 	bool success = true;
 	int c = 0;
 
-	list_for_each_entry(current_buffer, &expire_list, list_hook) {
+	list_for_each_entry(current_buffer, &shards[0].expire_list, list_hook) {
 		if (!assert_true(c < expected_count, "List count"))
 			return false;
 
@@ -630,12 +693,12 @@ static bool test_timer(void)
 	error = create_skb4_udp_frag(&tuple13, &skb1, 100, 1000, false, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb1, &full_skb), "1st verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb1, &full_skb, NULL), "1st verdict");
 
 	success &= validate_database(1);
 	success &= validate_list(&expected_keys[0], 1);
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 1"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(1);
 	success &= validate_list(&expected_keys[0], 1);
 
@@ -643,12 +706,12 @@ static bool test_timer(void)
 	error = create_skb4_udp_frag(&tuple2, &skb2, 100, 1000, false, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb2, &full_skb), "2nd verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb2, &full_skb, NULL), "2nd verdict");
 
 	success &= validate_database(2);
 	success &= validate_list(&expected_keys[0], 2);
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 2"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(2);
 	success &= validate_list(&expected_keys[0], 2);
 
@@ -656,12 +719,12 @@ static bool test_timer(void)
 	error = create_skb4_udp_frag(&tuple13, &skb3, 100, 1000, false, true, 108, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb3, &full_skb), "3rd verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb3, &full_skb, NULL), "3rd verdict");
 
 	success &= validate_database(2);
 	success &= validate_list(&expected_keys[0], 2);
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 2"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(2);
 	success &= validate_list(&expected_keys[0], 2);
 
@@ -669,12 +732,12 @@ static bool test_timer(void)
 	error = create_skb6_udp_frag(&tuple46, &skb4, 100, 1000, true, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb4, &full_skb), "4th verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb4, &full_skb, NULL), "4th verdict");
 
 	success &= validate_database(3);
 	success &= validate_list(&expected_keys[0], 3);
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 4"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(3);
 	success &= validate_list(&expected_keys[0], 3);
 
@@ -682,12 +745,12 @@ static bool test_timer(void)
 	error = create_skb6_udp_frag(&tuple5, &skb5, 100, 1000, true, true, 0, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb5, &full_skb), "5th verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb5, &full_skb, NULL), "5th verdict");
 
 	success &= validate_database(4);
 	success &= validate_list(&expected_keys[0], 4);
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 5"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(4);
 	success &= validate_list(&expected_keys[0], 4);
 
@@ -695,23 +758,23 @@ static bool test_timer(void)
 	error = create_skb6_udp_frag(&tuple46, &skb6, 100, 1000, true, true, 108, 32);
 	if (error)
 		return false;
-	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb6, &full_skb), "6th verdict");
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle6(skb6, &full_skb, NULL), "6th verdict");
 
 	success &= validate_database(4);
 	success &= validate_list(&expected_keys[0], 4);
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 6"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(4);
 	success &= validate_list(&expected_keys[0], 4);
 
 	/* After 2 seconds, packet 1 should die. */
-	dummy_buffer = container_of(expire_list.next, struct reassembly_buffer, list_hook);
+	dummy_buffer = container_of(shards[0].expire_list.next, struct reassembly_buffer, list_hook);
 	dummy_buffer->dying_time = jiffies - 1;
 	dummy_buffer = container_of(dummy_buffer->list_hook.next, struct reassembly_buffer, list_hook);
 	dummy_buffer->dying_time = jiffies + msecs_to_jiffies(4000);
 
 	/* success &= assert_range(3900, 4100, clean_expired_fragments(), "Timer 3"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(3);
 	success &= validate_list(&expected_keys[1], 3);
 
@@ -719,18 +782,18 @@ static bool test_timer(void)
 	dummy_buffer->dying_time = jiffies - 1;
 
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 4"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(2);
 	success &= validate_list(&expected_keys[2], 2);
 
 	/* After 2 seconds, the third packet should die. */
-	dummy_buffer = container_of(expire_list.next, struct reassembly_buffer, list_hook);
+	dummy_buffer = container_of(shards[0].expire_list.next, struct reassembly_buffer, list_hook);
 	dummy_buffer->dying_time = jiffies - 1;
 	dummy_buffer = container_of(dummy_buffer->list_hook.next, struct reassembly_buffer, list_hook);
 	dummy_buffer->dying_time = jiffies + msecs_to_jiffies(4000);
 
 	/* success &= assert_range(3900, 4100, clean_expired_fragments(), "Timer 5"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(1);
 	success &= validate_list(&expected_keys[3], 1);
 
@@ -738,17 +801,202 @@ static bool test_timer(void)
 	dummy_buffer->dying_time = jiffies - 1;
 
 	/* success &= assert_range(1900, 2100, clean_expired_fragments(), "Timer 6"); */
-	clean_expired_buffers();
+	clean_expired_buffers(&shards[0]);
 	success &= validate_database(0);
 
 	return success;
 }
 
+/**
+ * Asserts TCP/UDP fragments are released as soon as they can be translated when "forward_early" is
+ * on.
+ */
+static bool test_forward_early(void)
+{
+	struct sk_buff *skb1, *skb2, *skb3, *out_skb;
+	struct tuple tuple4, tuple_out, tuple_aux;
+	__u8 enabled;
+	int error;
+	bool success = true;
+
+	enabled = true;
+	if (!assert_equals_int(0, fragdb_set_config(FRAGMENT_FORWARD_EARLY, sizeof(enabled),
+			&enabled), "enable"))
+		return false;
+
+	error = init_ipv4_tuple(&tuple4, "8.7.6.5", 8765, "5.6.7.8", 5678, L4PROTO_UDP);
+	if (error)
+		return false;
+	/* Pretend this is the result of the first three steps. */
+	error = init_ipv6_tuple(&tuple_out, "1::2", 1212, "3::4", 3434, L4PROTO_UDP);
+	if (error)
+		return false;
+
+	/* The last fragment arrives first; it has to wait. */
+	error = create_skb4_udp_frag(&tuple4, &skb3, 192, 384, false, false, 192, 32);
+	if (error)
+		return false;
+	success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb3, &out_skb, &tuple_aux),
+			"3rd verdict");
+	success &= validate_database(1);
+
+	/* The first fragment is released right away, carrying its older sibling. */
+	error = create_skb4_udp_frag(&tuple4, &skb1, 64 - sizeof(struct udphdr), 384, false, true, 0,
+			32);
+	if (error)
+		return false;
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb1, &out_skb, &tuple_aux),
+			"1st verdict");
+	success &= assert_true(out_skb == skb1, "1st is the head");
+	success &= assert_true(skb1->next == skb3, "3rd rides along");
+	success &= assert_null(skb3->next, "Nothing else");
+	success &= validate_database(1);
+	if (!success)
+		return false;
+
+	fragdb_remember_tuple(skb1, &tuple_out);
+	kfree_skb_queued(skb1);
+
+	/* The middle fragment is released on its own, along with the tuple. */
+	error = create_skb4_udp_frag(&tuple4, &skb2, 128, 384, false, true, 64, 32);
+	if (error)
+		return false;
+	success &= assert_equals_int(VER_CONTINUE, fragdb_handle4(skb2, &out_skb, &tuple_aux),
+			"2nd verdict");
+	success &= assert_true(out_skb == skb2, "2nd is alone");
+	success &= assert_false(skb_has_l4_hdr(skb2), "2nd lacks l4 header");
+	success &= assert_equals_u16(tuple_out.src.addr6.l4, tuple_aux.src.addr6.l4, "Tuple src");
+	success &= assert_equals_u16(tuple_out.dst.addr6.l4, tuple_aux.dst.addr6.l4, "Tuple dst");
+	/* No holes are left, so the buffer is gone. */
+	success &= validate_database(0);
+	kfree_skb_queued(skb2);
+
+	enabled = false;
+	success &= assert_equals_int(0, fragdb_set_config(FRAGMENT_FORWARD_EARLY, sizeof(enabled),
+			&enabled), "disable");
+
+	return success;
+}
+
+/**
+ * Sets both memory watermarks, in whichever order keeps low below high in the meantime.
+ */
+static bool set_thresholds(__u64 high, __u64 low)
+{
+	bool success = true;
+
+	if (low < config->low_thresh) {
+		success &= assert_equals_int(0, fragdb_set_config(FRAGMENT_LOW_THRESH, sizeof(low), &low),
+				"set low");
+		success &= assert_equals_int(0, fragdb_set_config(FRAGMENT_HIGH_THRESH, sizeof(high),
+				&high), "set high");
+	} else {
+		success &= assert_equals_int(0, fragdb_set_config(FRAGMENT_HIGH_THRESH, sizeof(high),
+				&high), "set high");
+		success &= assert_equals_int(0, fragdb_set_config(FRAGMENT_LOW_THRESH, sizeof(low), &low),
+				"set low");
+	}
+	return success;
+}
+
+static bool send_first_fragment(char *src_str)
+{
+	struct sk_buff *skb, *full_skb;
+	struct tuple tuple4;
+
+	if (init_ipv4_tuple(&tuple4, src_str, 8765, "5.6.7.8", 5678, L4PROTO_UDP))
+		return false;
+	if (create_skb4_udp_frag(&tuple4, &skb, 8, 56, false, true, 0, 32))
+		return false;
+	return assert_equals_int(VER_STOLEN, fragdb_handle4(skb, &full_skb, NULL), "verdict");
+}
+
+/**
+ * Asserts the oldest buffers are evicted once the high threshold is crossed, and only until the
+ * low threshold is reached.
+ */
+static bool test_eviction(void)
+{
+	struct reassembly_buffer *buffer;
+	struct fragmentation_stats stats;
+	__u64 per_buffer;
+	__u64 evictions_before = atomic64_read(&evictions);
+	struct in_addr expected;
+	bool success = true;
+
+	if (!send_first_fragment("8.7.6.1"))
+		return false;
+	per_buffer = atomic64_read(&bytes_queued);
+
+	success &= set_thresholds(3 * per_buffer, 2 * per_buffer);
+	success &= send_first_fragment("8.7.6.2");
+	success &= send_first_fragment("8.7.6.3");
+	success &= validate_database(3);
+	success &= send_first_fragment("8.7.6.4");
+	success &= validate_database(2);
+
+	fragdb_get_stats(&stats);
+	success &= assert_equals_u64(evictions_before + 2, stats.evictions, "Eviction count");
+	success &= assert_equals_u64(2 * per_buffer, stats.bytes_queued, "Bytes queued");
+
+	buffer = list_entry(shards[0].expire_list.next, struct reassembly_buffer, list_hook);
+	success &= assert_equals_int(0, str_to_addr4("8.7.6.3", &expected), "addr");
+	success &= assert_equals_ipv4(&expected, (struct in_addr *) &ip_hdr(buffer->skb)->saddr,
+			"The oldest survivor");
+
+	/* Clean up. */
+	success &= set_thresholds(1, 0);
+	evict_buffers();
+	success &= validate_database(0);
+	success &= assert_equals_u64(0, atomic64_read(&bytes_queued), "Bytes queued after cleanup");
+	success &= set_thresholds(FRAGMENT_HIGH_THRESH_DEF, FRAGMENT_LOW_THRESH_DEF);
+
+	return success;
+}
+
+/**
+ * Asserts buffers from unrelated packets spread over the shards, and each one lands in the shard
+ * get_shard() says it belongs to.
+ */
+static bool test_shards(void)
+{
+	struct sk_buff *skb, *full_skb;
+	struct tuple tuple4;
+	struct reassembly_buffer_key key;
+	struct reassembly_buffer *buffer;
+	char src_str[INET_ADDRSTRLEN];
+	unsigned int s, total = 0;
+	int i, error;
+	bool success = true;
+
+	for (i = 1; i <= 16; i++) {
+		snprintf(src_str, sizeof(src_str), "8.7.6.%d", i);
+		error = init_ipv4_tuple(&tuple4, src_str, 8765, "5.6.7.8", 5678, L4PROTO_UDP);
+		if (error)
+			return false;
+		error = create_skb4_udp_frag(&tuple4, &skb, 8, 56, false, true, 0, 32);
+		if (error)
+			return false;
+		success &= assert_equals_int(VER_STOLEN, fragdb_handle4(skb, &full_skb, NULL), "verdict");
+	}
+
+	for (s = 0; s < shard_count; s++) {
+		list_for_each_entry(buffer, &shards[s].expire_list, list_hook) {
+			success &= assert_equals_int(0, skb_to_key(buffer->skb, &key), "key");
+			success &= assert_true(get_shard(&key) == &shards[s], "shard");
+			total++;
+		}
+	}
+	success &= assert_equals_int(16, total, "Buffer count");
+
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("Fragment database");
 
-	if (is_error(fragdb_init()))
+	if (is_error(fragdb_init(1)))
 		return -EINVAL;
 
 	CALL_TEST(test_no_fragments_4(), "Unfragmented IPv4 packet arrives");
@@ -757,7 +1005,16 @@ int init_module(void)
 	CALL_TEST(test_ordered_fragments_6(), "3 ordered IPv6 fragments");
 	CALL_TEST(test_disordered_fragments_4(), "3 disordered IPv4 fragments");
 	CALL_TEST(test_disordered_fragments_6(), "3 disordered IPv6 fragments");
+	CALL_TEST(test_many_holes(), "More holes than fit in the buffer");
 	CALL_TEST(test_timer(), "Timer test.");
+	CALL_TEST(test_eviction(), "Eviction");
+	CALL_TEST(test_forward_early(), "Early forwarding");
+
+	fragdb_destroy();
+	if (is_error(fragdb_init(4)))
+		return -EINVAL;
+
+	CALL_TEST(test_shards(), "Sharded database");
 
 	fragdb_destroy();
 
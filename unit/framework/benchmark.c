@@ -0,0 +1,222 @@
+#include "nat64/unit/benchmark.h"
+#include "nat64/mod/types.h"
+
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+
+
+/**
+ * State of one of bench_run()'s kthreads.
+ */
+struct bench_thread {
+	unsigned int index;
+	bench_fn fn;
+	void *arg;
+
+	/* Results, in nanoseconds. */
+	s64 start;
+	s64 end;
+
+	struct completion *go;
+	struct completion done;
+} ____cacheline_aligned_in_smp;
+
+static int thread_fn(void *arg)
+{
+	struct bench_thread *thread = arg;
+
+	wait_for_completion(thread->go);
+	thread->start = ktime_to_ns(ktime_get());
+	thread->fn(thread->index, thread->arg);
+	thread->end = ktime_to_ns(ktime_get());
+
+	complete(&thread->done);
+	return 0;
+}
+
+int bench_run(unsigned int threads, bench_fn fn, void *arg, struct bench_result *result)
+{
+	struct bench_thread *pool;
+	struct task_struct *task;
+	DECLARE_COMPLETION_ONSTACK(go);
+	s64 start, end;
+	unsigned int started;
+	unsigned int i, cpu;
+	int error = 0;
+
+	if (!threads || threads > num_online_cpus()) {
+		log_err("The thread count must be between 1 and %u (the online CPUs).",
+				num_online_cpus());
+		return -EINVAL;
+	}
+
+	pool = kcalloc(threads, sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (started = 0; started < threads; started++) {
+		pool[started].index = started;
+		pool[started].fn = fn;
+		pool[started].arg = arg;
+		pool[started].go = &go;
+		init_completion(&pool[started].done);
+
+		task = kthread_create(thread_fn, &pool[started], "jool_bench/%u", cpu);
+		if (IS_ERR(task)) {
+			/* The threads already started are waiting for "go"; let them finish. */
+			error = PTR_ERR(task);
+			break;
+		}
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+	}
+
+	complete_all(&go);
+	for (i = 0; i < started; i++)
+		wait_for_completion(&pool[i].done);
+	if (error)
+		goto end;
+
+	start = pool[0].start;
+	end = pool[0].end;
+	result->busy_ns = 0;
+	for (i = 0; i < threads; i++) {
+		start = min(start, pool[i].start);
+		end = max(end, pool[i].end);
+		result->busy_ns += pool[i].end - pool[i].start;
+	}
+	result->wall_ns = end - start;
+	if (!result->wall_ns)
+		result->wall_ns = 1;
+
+end:
+	kfree(pool);
+	return error;
+}
+
+unsigned int bench_next_round(unsigned int threads, unsigned int max_threads)
+{
+	if (threads < max_threads && threads * 2 > max_threads)
+		return max_threads;
+	return threads * 2;
+}
+
+u64 bench_mops(u64 ops, u64 ns)
+{
+	return ns ? div64_u64(ops * 100000, ns) : 0;
+}
+
+static unsigned int hist_bucket(u64 ns)
+{
+	unsigned int msb;
+
+	if (ns < (1 << BENCH_HIST_SUB_BITS))
+		return ns;
+
+	msb = fls64(ns) - 1;
+	return ((msb - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS)
+			| ((ns >> (msb - BENCH_HIST_SUB_BITS)) & ((1 << BENCH_HIST_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the largest value that lands in the "bucket"th bucket.
+ */
+static u64 hist_bucket_max(unsigned int bucket)
+{
+	unsigned int shift;
+	u64 min;
+
+	if (bucket < (1 << BENCH_HIST_SUB_BITS))
+		return bucket;
+
+	shift = (bucket >> BENCH_HIST_SUB_BITS) - 1;
+	min = ((u64) ((1 << BENCH_HIST_SUB_BITS) | (bucket & ((1 << BENCH_HIST_SUB_BITS) - 1))))
+			<< shift;
+	return min + (1ULL << shift) - 1;
+}
+
+void bench_hist_add(struct bench_hist *hist, u64 ns)
+{
+	hist->counts[hist_bucket(ns)]++;
+	hist->total++;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->max = max(dst->max, src->max);
+}
+
+u64 bench_hist_percentile(const struct bench_hist *hist, unsigned int permille)
+{
+	u64 threshold;
+	u64 seen = 0;
+	unsigned int i;
+
+	if (!hist->total)
+		return 0;
+
+	threshold = div64_u64(hist->total * permille + 999, 1000);
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= threshold)
+			return min(hist_bucket_max(i), hist->max);
+	}
+
+	return hist->max;
+}
+
+void bench_hist_print(char *name, const struct bench_hist *hist)
+{
+	log_info("Benchmark: %s: %llu samples; p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns.",
+			name, hist->total,
+			bench_hist_percentile(hist, 500),
+			bench_hist_percentile(hist, 990),
+			bench_hist_percentile(hist, 999),
+			hist->max);
+}
+
+void bench_report(const struct bench_record *record)
+{
+	char line[256];
+	size_t len;
+	u64 busy_ns;
+
+	len = scnprintf(line, sizeof(line), "name=\"%s\"", record->name);
+
+	if (record->ops) {
+		busy_ns = record->busy_ns ? record->busy_ns : record->wall_ns;
+		len += scnprintf(line + len, sizeof(line) - len, " ops=%llu", record->ops);
+		if (busy_ns)
+			len += scnprintf(line + len, sizeof(line) - len, " ns_per_op=%llu",
+					div64_u64(busy_ns, record->ops));
+		if (record->wall_ns)
+			len += scnprintf(line + len, sizeof(line) - len, " ops_per_s=%llu",
+					div64_u64(record->ops * NSEC_PER_SEC, record->wall_ns));
+	}
+
+	if (record->hist && record->hist->total)
+		len += scnprintf(line + len, sizeof(line) - len,
+				" p50_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu",
+				bench_hist_percentile(record->hist, 500),
+				bench_hist_percentile(record->hist, 990),
+				bench_hist_percentile(record->hist, 999),
+				record->hist->max);
+
+	if (record->bytes)
+		len += scnprintf(line + len, sizeof(line) - len, " bytes=%llu", record->bytes);
+
+	log_info("Benchmark: result %s", line);
+}
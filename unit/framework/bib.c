@@ -21,12 +21,14 @@ bool bib_assert(l4_protocol l4_proto, struct bib_entry **expected_bibs)
 	while (expected_bibs && expected_bibs[expected_count]) {
 		struct bib_entry *expected = expected_bibs[expected_count];
 		struct bib_entry *actual;
+		struct ipv6_transport_addr expected6;
 		int error;
 
-		error = bibdb_get_by_ipv6(&expected->ipv6, l4_proto, &actual);
+		bib_ipv6(expected, &expected6);
+		error = bibdb_get_by_ipv6(&expected6, l4_proto, &actual);
 		if (error) {
 			log_err("Error %d while trying to find BIB entry [%pI6c#%u, %pI4#%u] in the DB.",
-					error, &expected->ipv6.l3, expected->ipv6.l4,
+					error, &expected6.l3, expected6.l4,
 					&expected->ipv4.l3, expected->ipv4.l4);
 			return false;
 		}
@@ -47,7 +49,7 @@ static int bib_print_aux(struct bib_entry *bib, void *arg)
 {
 	log_debug("  [%s][%pI6c#%u, %pI4#%u]",
 			bib->is_static ? "Static" : "Dynamic",
-			&bib->ipv6.l3, bib->ipv6.l4,
+			&bib->host->addr, bib->port6,
 			&bib->ipv4.l3, bib->ipv4.l4);
 	return 0;
 }
@@ -24,7 +24,7 @@ bool session_assert(l4_protocol l4_proto, struct session_entry **expected_sessio
 		struct session_entry *actual;
 		struct tuple tuple6;
 
-		tuple6.dst.addr6 = expected->local6;
+		session_local6(expected, &tuple6.dst.addr6);
 		tuple6.src.addr6 = expected->remote6;
 		tuple6.l3_proto = L3PROTO_IPV6;
 		tuple6.l4_proto = expected->l4_proto;
@@ -34,7 +34,7 @@ bool session_assert(l4_protocol l4_proto, struct session_entry **expected_sessio
 			log_err("Error %d while trying to find session entry %d [%pI6c#%u, %pI6c#%u, "
 					"%pI4#%u, %pI4#%u] in the DB.", error, expected_count,
 					&expected->remote6.l3, expected->remote6.l4,
-					&expected->local6.l3, expected->local6.l4,
+					&tuple6.dst.addr6.l3, tuple6.dst.addr6.l4,
 					&expected->local4.l3, expected->local4.l4,
 					&expected->remote4.l3, expected->remote4.l4);
 			return false;
@@ -54,10 +54,13 @@ bool session_assert(l4_protocol l4_proto, struct session_entry **expected_sessio
 
 static int session_print_aux(struct session_entry *session, void *arg)
 {
+	struct ipv6_transport_addr local6;
+
+	session_local6(session, &local6);
 	log_debug("  [%s][%pI6c#%u, %pI6c#%u, %pI4#%u, %pI4#%u]",
 			session->bib->is_static ? "Static" : "Dynamic",
 			&session->remote6.l3, session->remote6.l4,
-			&session->local6.l3, session->local6.l4,
+			&local6.l3, local6.l4,
 			&session->local4.l3, session->local4.l4,
 			&session->remote4.l3, session->remote4.l4);
 	return 0;
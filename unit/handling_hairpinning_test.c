@@ -260,22 +260,22 @@ static int init(void)
 	char *pool4[] = { NAT64_POOL4 };
 	int error;
 
-	error = fragdb_init();
+	error = fragdb_init(1);
 	if (error)
 		goto failure;
 	error = pool6_init(pool6, ARRAY_SIZE(pool6));
 	if (error)
 		goto failure;
-	error = pool4_init(pool4, ARRAY_SIZE(pool4));
+	error = pool4_init(pool4, ARRAY_SIZE(pool4), 0, true, false);
 	if (error)
 		goto failure;
 	error = pktqueue_init();
 	if (error)
 		goto failure;
-	error = bibdb_init();
+	error = bibdb_init(0);
 	if (error)
 		goto failure;
-	error = sessiondb_init();
+	error = sessiondb_init(1, 0, false, false, false);
 	if (error)
 		goto failure;
 	error = filtering_init();
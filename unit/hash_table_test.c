@@ -1,6 +1,8 @@
 #include <linux/module.h>
 #include <linux/printk.h>
 #include <linux/inet.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
 
 #include "nat64/unit/unit_test.h"
 
@@ -17,11 +19,33 @@ struct table_value {
 #define HTABLE_NAME test_table
 #define KEY_TYPE struct table_key
 #define VALUE_TYPE struct table_value
-#define HASH_TABLE_SIZE (10)
+#define HASH_TABLE_MIN_SIZE 2
+#define HASH_TABLE_MAX_SIZE 64
 #define GENERATE_PRINT
 #define GENERATE_FOR_EACH
 #include "hash_table.c"
 
+#define HTABLE_NAME oa_table
+#define KEY_TYPE struct table_key
+#define VALUE_TYPE struct table_value
+#define HASH_TABLE_MIN_SIZE 8
+#define HASH_TABLE_MAX_SIZE 1024
+#define GENERATE_FOR_EACH
+#define HTABLE_OPEN_ADDRESSING
+#include "hash_table.c"
+
+/* The benchmark's contestants. Same sizes, different collision strategies. */
+#define HTABLE_NAME bench_chained
+#define KEY_TYPE struct table_key
+#define VALUE_TYPE struct table_value
+#include "hash_table.c"
+
+#define HTABLE_NAME bench_oa
+#define KEY_TYPE struct table_key
+#define VALUE_TYPE struct table_value
+#define HTABLE_OPEN_ADDRESSING
+#include "hash_table.c"
+
 /* These are also kind of part of the table. */
 static bool equals_function(const struct table_key *key1, const struct table_key *key2)
 {
@@ -148,11 +172,11 @@ static bool test(void)
 	if (!assert_table_content(&table, keys, values, "Needless extra test"))
 		goto failure;
 
-	test_table_empty(&table, NULL);
+	test_table_destroy(&table, NULL);
 	return true;
 
 failure:
-	test_table_empty(&table, NULL);
+	test_table_destroy(&table, NULL);
 	return false;
 }
 
@@ -194,7 +218,7 @@ static bool test_for_each_function(void)
 	for (i = 0; i < ARRAY_SIZE(values); i++) {
 		if (test_table_put(&table, &keys[i], &values[i]) != 0) {
 			log_err("Put operation failed on value %d.", i);
-			test_table_empty(&table, NULL);
+			test_table_destroy(&table, NULL);
 			return false;
 		}
 	}
@@ -207,16 +231,263 @@ static bool test_for_each_function(void)
 				|| summary.values[2] == values[i].value, "");
 	}
 
-	test_table_empty(&table, NULL);
+	test_table_destroy(&table, NULL);
 	return true;
 }
 
+#define RESIZE_VALUES 300
+
+static bool test_resize(void)
+{
+	struct test_table table;
+	struct table_key key;
+	struct table_value *values;
+	unsigned int i;
+	bool success = true;
+
+	values = kmalloc(RESIZE_VALUES * sizeof(*values), GFP_KERNEL);
+	if (!values) {
+		log_err("Could not allocate the test values.");
+		return false;
+	}
+
+	if (test_table_init(&table, &equals_function, &hash_code_function) < 0) {
+		log_err("The init function failed.");
+		kfree(values);
+		return false;
+	}
+	success &= assert_equals_u32(2, table.slots, "Initial size");
+
+	/* Grow. */
+	for (i = 0; i < RESIZE_VALUES; i++) {
+		key.key = i;
+		values[i].value = i;
+		if (test_table_put(&table, &key, &values[i]) != 0) {
+			log_err("Put operation failed on value %u.", i);
+			success = false;
+			goto end;
+		}
+	}
+	success &= assert_equals_u32(64, table.slots, "Size after growing");
+
+	for (i = 0; i < RESIZE_VALUES; i++) {
+		key.key = i;
+		success &= assert_true(test_table_get(&table, &key) == &values[i], "Get after growing");
+	}
+
+	/* Shrink. */
+	for (i = 0; i < RESIZE_VALUES - 1; i++) {
+		key.key = i;
+		success &= assert_true(test_table_remove(&table, &key, NULL), "Remove");
+	}
+	success &= assert_equals_u32(2, table.slots, "Size after shrinking");
+
+	key.key = 0;
+	success &= assert_null(test_table_get(&table, &key), "Get removed after shrinking");
+	key.key = RESIZE_VALUES - 1;
+	success &= assert_true(test_table_get(&table, &key) == &values[RESIZE_VALUES - 1],
+			"Get survivor after shrinking");
+
+	/* Fall through. */
+end:
+	test_table_destroy(&table, NULL);
+	kfree(values);
+	return success;
+}
+
+static bool test_open_addressing(void)
+{
+	struct oa_table table;
+	struct table_key key;
+	/* 1, 9 and 17 share home slot 1. 2 has to wait until 17 is done with its slot. */
+	struct table_key keys[] = { { 1 }, { 9 }, { 17 }, { 2 } };
+	struct table_value values[RESIZE_VALUES];
+	unsigned int i;
+	bool success = true;
+
+	if (oa_table_init(&table, &equals_function, &hash_code_function) < 0) {
+		log_err("The init function failed.");
+		return false;
+	}
+
+	/* Collisions. */
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		if (oa_table_put(&table, &keys[i], &values[i]) != 0) {
+			log_err("Put operation failed on value %u.", i);
+			success = false;
+			goto end;
+		}
+	}
+	success &= assert_equals_u32(8, table.slots, "No resize yet");
+	for (i = 0; i < ARRAY_SIZE(keys); i++)
+		success &= assert_true(oa_table_get(&table, &keys[i]) == &values[i], "Colliding get");
+	key.key = 25;
+	success &= assert_null(oa_table_get(&table, &key), "Colliding miss");
+
+	/* Removing from the middle of the cluster has to leave the rest reachable. */
+	success &= assert_true(oa_table_remove(&table, &keys[1], NULL), "Cluster remove");
+	success &= assert_null(oa_table_get(&table, &keys[1]), "Removed get");
+	success &= assert_true(oa_table_get(&table, &keys[0]) == &values[0], "Cluster head get");
+	success &= assert_true(oa_table_get(&table, &keys[2]) == &values[2], "Cluster tail get");
+	success &= assert_true(oa_table_get(&table, &keys[3]) == &values[3], "Displaced get");
+
+	oa_table_empty(&table, NULL);
+	success &= assert_equals_u32(0, table.node_count, "Empty");
+
+	/* Resize. */
+	for (i = 0; i < RESIZE_VALUES; i++) {
+		key.key = i;
+		if (oa_table_put(&table, &key, &values[i]) != 0) {
+			log_err("Put operation failed on value %u.", i);
+			success = false;
+			goto end;
+		}
+	}
+	success &= assert_equals_u32(512, table.slots, "Size after growing");
+	for (i = 0; i < RESIZE_VALUES; i++) {
+		key.key = i;
+		success &= assert_true(oa_table_get(&table, &key) == &values[i], "Get after growing");
+	}
+
+	for (i = 0; i < RESIZE_VALUES - 1; i++) {
+		key.key = i;
+		success &= assert_true(oa_table_remove(&table, &key, NULL), "Remove");
+	}
+	success &= assert_equals_u32(8, table.slots, "Size after shrinking");
+	key.key = RESIZE_VALUES - 1;
+	success &= assert_true(oa_table_get(&table, &key) == &values[RESIZE_VALUES - 1],
+			"Get survivor after shrinking");
+
+	/* Fall through. */
+end:
+	oa_table_destroy(&table, NULL);
+	return success;
+}
+
+#define BENCHMARK_VALUES 4096
+#define BENCHMARK_ROUNDS 100
+
+static unsigned int bench_hash_function(const struct table_key *key)
+{
+	return jhash_1word(key->key, 0);
+}
+
+static bool test_atomic_cap(void)
+{
+	struct bench_chained table;
+	struct table_key key;
+	struct table_value value;
+	unsigned int cap = HTABLE_ATOMIC_MAX_BYTES / sizeof(struct hlist_head);
+	unsigned int i;
+	bool success = true;
+
+	if (bench_chained_init(&table, &equals_function, &bench_hash_function) < 0)
+		return false;
+
+	/* Enough to ask for twice the cap. */
+	for (i = 0; i < 2 * HTABLE_GROW_LOAD * cap + 1; i++) {
+		key.key = i;
+		if (bench_chained_put(&table, &key, &value) != 0) {
+			log_err("Put operation failed on value %u.", i);
+			success = false;
+			goto end;
+		}
+	}
+
+	success &= assert_equals_u32(cap, table.slots, "Stopped at the atomic cap");
+	success &= assert_equals_u32(0, table.resize_failures, "Resize failures");
+
+	/* Fall through. */
+end:
+	bench_chained_destroy(&table, NULL);
+	return success;
+}
+
+static bool benchmark(void)
+{
+	struct bench_chained chained;
+	struct bench_oa oa;
+	struct table_key key;
+	struct table_value *values;
+	ktime_t start;
+	s64 chained_put, chained_get, oa_put, oa_get;
+	unsigned int i, r;
+	bool success = true;
+
+	values = kmalloc(BENCHMARK_VALUES * sizeof(*values), GFP_KERNEL);
+	if (!values) {
+		log_err("Could not allocate the benchmark values.");
+		return false;
+	}
+	if (bench_chained_init(&chained, &equals_function, &bench_hash_function) < 0) {
+		kfree(values);
+		return false;
+	}
+	if (bench_oa_init(&oa, &equals_function, &bench_hash_function) < 0) {
+		bench_chained_destroy(&chained, NULL);
+		kfree(values);
+		return false;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < BENCHMARK_VALUES; i++) {
+		key.key = i;
+		success &= assert_equals_int(0, bench_chained_put(&chained, &key, &values[i]), "put");
+	}
+	chained_put = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (r = 0; r < BENCHMARK_ROUNDS; r++) {
+		for (i = 0; i < 2 * BENCHMARK_VALUES; i++) { /* Half of them miss. */
+			key.key = i;
+			bench_chained_get(&chained, &key);
+		}
+	}
+	chained_get = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < BENCHMARK_VALUES; i++) {
+		key.key = i;
+		success &= assert_equals_int(0, bench_oa_put(&oa, &key, &values[i]), "put");
+	}
+	oa_put = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (r = 0; r < BENCHMARK_ROUNDS; r++) {
+		for (i = 0; i < 2 * BENCHMARK_VALUES; i++) {
+			key.key = i;
+			bench_oa_get(&oa, &key);
+		}
+	}
+	oa_get = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	for (i = 0; i < BENCHMARK_VALUES; i++) {
+		key.key = i;
+		success &= assert_true(bench_chained_get(&chained, &key) == &values[i], "chained get");
+		success &= assert_true(bench_oa_get(&oa, &key) == &values[i], "oa get");
+	}
+
+	log_info("%u entries, %u lookups. Chained: put %lld ns, get %lld ns. "
+			"Open addressing: put %lld ns, get %lld ns.",
+			BENCHMARK_VALUES, 2 * BENCHMARK_VALUES * BENCHMARK_ROUNDS,
+			chained_put, chained_get, oa_put, oa_get);
+
+	bench_oa_destroy(&oa, NULL);
+	bench_chained_destroy(&chained, NULL);
+	kfree(values);
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("Hash table");
 
 	CALL_TEST(test(), "Everything, except for_each");
 	CALL_TEST(test_for_each_function(), "for_each function");
+	CALL_TEST(test_resize(), "Resize");
+	CALL_TEST(test_open_addressing(), "Open addressing");
+	CALL_TEST(test_atomic_cap(), "Atomic allocation cap");
+	CALL_TEST(benchmark(), "Chained vs open addressing benchmark");
 
 	END_TESTS;
 }
@@ -0,0 +1,89 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#include "nat64/unit/unit_test.h"
+#include "icmp_wrapper.c"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("ICMP wrapper test");
+
+static bool test_bucket(void)
+{
+	struct icmp_bucket bucket;
+	unsigned long now = jiffies;
+	unsigned int i;
+	bool success = true;
+
+	rate = 10;
+	burst = 5;
+	bucket.tokens = burst;
+	bucket.stamp = now;
+
+	/* The burst goes through, the rest doesn't. */
+	for (i = 0; i < 5; i++)
+		success &= assert_true(bucket_take(&bucket, now), "Burst");
+	success &= assert_false(bucket_take(&bucket, now), "Burst exhausted");
+
+	/* A tenth of a second buys one error. */
+	now += HZ / 10;
+	success &= assert_true(bucket_take(&bucket, now), "Refilled one");
+	success &= assert_false(bucket_take(&bucket, now), "Refilled only one");
+
+	/* A long silence refills up to the burst, and no more. */
+	now += 100 * HZ;
+	for (i = 0; i < 5; i++)
+		success &= assert_true(bucket_take(&bucket, now), "Refilled burst");
+	success &= assert_false(bucket_take(&bucket, now), "Burst is the cap");
+
+	return success;
+}
+
+static bool test_unused_bucket(void)
+{
+	struct icmp_limiter *limiter;
+	struct sk_buff *skb;
+	struct icmp_bucket *bucket;
+	bool success = true;
+
+	limiter = kzalloc(sizeof(*limiter), GFP_KERNEL);
+	skb = alloc_skb(sizeof(struct ipv6hdr), GFP_KERNEL);
+	if (!limiter || !skb) {
+		log_err("Could not allocate the test's objects.");
+		kfree(limiter);
+		kfree_skb(skb);
+		return false;
+	}
+
+	/* An IPv6 node at :: looks just like a zeroed slot, but it must not inherit its tokens. */
+	skb_reset_network_header(skb);
+	memset(skb_put(skb, sizeof(struct ipv6hdr)), 0, sizeof(struct ipv6hdr));
+	skb->protocol = htons(ETH_P_IPV6);
+	burst = 5;
+
+	bucket = get_bucket(limiter, skb, jiffies);
+	success &= assert_not_null(bucket, "Bucket");
+	if (bucket) {
+		success &= assert_true(bucket->used, "Claimed");
+		success &= assert_equals_u32(burst, bucket->tokens, "Starts full");
+	}
+
+	kfree_skb(skb);
+	kfree(limiter);
+	return success;
+}
+
+int init_module(void)
+{
+	START_TESTS("ICMP wrapper");
+
+	CALL_TEST(test_bucket(), "Token bucket");
+	CALL_TEST(test_unused_bucket(), "Unused bucket");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -0,0 +1,11 @@
+#include "nat64/mod/db_events.h"
+
+void dbevents_bib(enum dbevent_type type, struct bib_entry *bib)
+{
+	/* No code. */
+}
+
+void dbevents_session(enum dbevent_type type, struct session_entry *session)
+{
+	/* No code. */
+}
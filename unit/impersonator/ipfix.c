@@ -0,0 +1,6 @@
+#include "nat64/mod/ipfix.h"
+
+void ipfix_pool4_exhausted(l4_protocol proto)
+{
+	/* No code. */
+}
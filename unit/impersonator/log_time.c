@@ -0,0 +1,9 @@
+#include "nat64/mod/log_time.h"
+
+JOOL_KEY_DEFINE(logtime_key);
+
+int logtime(struct timespec *start_time, struct timespec *end_time, l3_protocol l3_proto,
+		l4_protocol l4_proto)
+{
+	return 0;
+}
@@ -0,0 +1,15 @@
+#include "nat64/mod/namespace.h"
+
+/*
+ * The tests' packets are not attached to any device, so they are always Jool's.
+ */
+
+struct net *joolns_get(void)
+{
+	return &init_net;
+}
+
+bool joolns_owns(struct sk_buff *skb)
+{
+	return true;
+}
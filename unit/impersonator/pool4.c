@@ -9,7 +9,8 @@ static u32 pool_current_udp_port;
 static u32 pool_current_tcp_port;
 static u32 pool_current_icmp_id;
 
-int pool4_init(char *addr_strs[], int addr_count)
+int pool4_init(char *addr_strs[], int addr_count, unsigned int block_size, bool randomize,
+		bool per_cpu_ports)
 {
 	char *defaults[] = POOL4_DEF;
 
@@ -38,11 +39,33 @@ int pool4_register(struct in_addr *address)
 	return 0;
 }
 
+int pool4_register_det(struct in_addr *addr, __u8 addr_len, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len)
+{
+	return 0;
+}
+
+int pool4_register_range(struct in_addr *addr, __u8 addr_len, __u16 port_min, __u16 port_max)
+{
+	return 0;
+}
+
+int pool4_register_psid(struct in_addr *addr, __u8 addr_len, __u16 psid, __u8 psid_len,
+		__u8 psid_offset)
+{
+	return 0;
+}
+
 int pool4_remove(struct in_addr *address)
 {
 	return 0;
 }
 
+int pool4_remove_range(struct in_addr *addr, __u8 addr_len)
+{
+	return 0;
+}
+
 static int get_next_port(l4_protocol proto, __u16 *result)
 {
 	u32 *port_counter;
@@ -91,6 +114,34 @@ int pool4_get_any_addr(l4_protocol proto, __u16 l4_id, struct ipv4_transport_add
 	return get_next_port(proto, &result->l4);
 }
 
+int pool4_get_affine(l4_protocol proto, __u16 l4_id, const struct in6_addr *addr6,
+		struct ipv4_transport_addr *result)
+{
+	return pool4_get_any_addr(proto, l4_id, result);
+}
+
+int pool4_get_det(const struct in6_addr *addr6, struct ipv4_transport_addr *first,
+		unsigned int *count)
+{
+	return -ENOENT;
+}
+
+unsigned int pool4_get_block_size(void)
+{
+	return 0;
+}
+
+int pool4_port_cpu(__u16 port)
+{
+	return -1;
+}
+
+int pool4_get_block(l4_protocol proto, const struct in_addr *hint, const struct in6_addr *addr6,
+		struct ipv4_transport_addr *result)
+{
+	return -EINVAL;
+}
+
 int pool4_return(l4_protocol l4_proto, const struct ipv4_transport_addr *address)
 {
 	/* Meh, whatever. */
@@ -98,6 +149,16 @@ int pool4_return(l4_protocol l4_proto, const struct ipv4_transport_addr *address
 	return 0;
 }
 
+void pool4_defer_returns(void)
+{
+	/* No code. */
+}
+
+void pool4_flush_returns(void)
+{
+	/* No code. */
+}
+
 bool pool4_contains(__be32 address)
 {
 	if (!address) {
@@ -108,9 +169,20 @@ bool pool4_contains(__be32 address)
 	return pool_address.s_addr == address;
 }
 
+bool pool4_is_available(l4_protocol proto, const struct ipv4_transport_addr *addr)
+{
+	return false;
+}
+
 int pool4_for_each(int (*func)(struct pool4_node *, void *), void * arg)
 {
 	/* Meh, whatever. */
 	log_debug("Somebody asked me to iterate through the pool.");
 	return -EINVAL;
 }
+
+int pool4_for_each_addr(int (*func)(struct in_addr *, void *), void *arg)
+{
+	log_debug("Somebody asked me to iterate through the pool's addresses.");
+	return -EINVAL;
+}
@@ -1,9 +1,53 @@
 #include "nat64/unit/send_packet.h"
+#include "nat64/comm/constants.h"
 
 
 static struct sk_buff *sent_skb = NULL;
 
 
+unsigned int sendpkt_ipv6_mtu(struct dst_entry *dst)
+{
+	return TRAN_DEF_MIN_IPV6_MTU;
+}
+
+int __sendpkt_route4(struct sk_buff *skb, struct iphdr *hdr_ip, void *l4_hdr,
+		struct dst_entry **result)
+{
+	*result = NULL;
+	return 0;
+}
+
+int __sendpkt_route6(struct sk_buff *skb, struct ipv6hdr *hdr_ip, void *l4_hdr,
+		struct dst_entry **result)
+{
+	*result = NULL;
+	return 0;
+}
+
+void sendpkt_route_cache_init(struct sendpkt_route_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+}
+
+void sendpkt_route_cache_flush(struct sendpkt_route_cache *cache)
+{
+	/* No-op. */
+}
+
+int sendpkt_route4_cached(struct sk_buff *skb, struct iphdr *hdr_ip, void *l4_hdr,
+		struct sendpkt_route_cache *cache, struct dst_entry **result)
+{
+	*result = NULL;
+	return 0;
+}
+
+int sendpkt_route6_cached(struct sk_buff *skb, struct ipv6hdr *hdr_ip, void *l4_hdr,
+		struct sendpkt_route_cache *cache, struct dst_entry **result)
+{
+	*result = NULL;
+	return 0;
+}
+
 int sendpkt_route4(struct sk_buff *skb)
 {
 	return 0;
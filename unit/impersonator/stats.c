@@ -4,3 +4,13 @@ void inc_stats(struct sk_buff *skb, int field)
 {
 	/* No code. */
 }
+
+void inc_jool_stats(enum jool_stat field)
+{
+	/* No code. */
+}
+
+void jool_mem_add(enum jool_memory field, long bytes)
+{
+	/* No code. */
+}
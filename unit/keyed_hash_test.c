@@ -0,0 +1,68 @@
+#include <linux/module.h>
+
+#include "nat64/unit/unit_test.h"
+#include "keyed_hash.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Keyed hash module test");
+
+
+/**
+ * The SipHash paper's test vectors: key 00 01 .. 0f, message 00 01 .. (length - 1).
+ * The words are built little endian, so this is only the standard algorithm on such machines.
+ */
+static bool test_vectors(void)
+{
+	struct keyed_hash_key key = {
+		.k0 = 0x0706050403020100ULL,
+		.k1 = 0x0f0e0d0c0b0a0908ULL,
+	};
+	u64 words[5];
+	unsigned int i;
+	bool success = true;
+
+	if (cpu_to_le64(1) != 1) {
+		log_info("Big endian machine; skipping the test vectors.");
+		return true;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(words); i++)
+		words[i] = 0x0706050403020100ULL + i * 0x0808080808080808ULL;
+
+	success &= assert_equals_u64(0x726fdb47dd0e0e31ULL, keyed_hash(&key, words, 0), "0 bytes");
+	success &= assert_equals_u64(0x93f5f5799a932462ULL, keyed_hash(&key, words, 1), "8 bytes");
+	success &= assert_equals_u64(0x3f2acc7f57c29bdbULL, keyed_hash(&key, words, 2), "16 bytes");
+	success &= assert_equals_u64(0x0e3ea96b5304a7d0ULL, keyed_hash(&key, words, 5), "40 bytes");
+
+	return success;
+}
+
+static bool test_key(void)
+{
+	struct keyed_hash_key key1, key2;
+	u64 word = 1234;
+
+	keyed_hash_init_key(&key1);
+	keyed_hash_init_key(&key2);
+
+	/* Could fail legitimately, with probability 2^-64. */
+	return assert_true(keyed_hash(&key1, &word, 1) != keyed_hash(&key2, &word, 1),
+			"Different keys yield different hashes");
+}
+
+int init_module(void)
+{
+	START_TESTS("Keyed hash");
+
+	CALL_TEST(test_vectors(), "SipHash-2-4 test vectors");
+	CALL_TEST(test_key(), "Random keys");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -23,16 +23,8 @@ MODULE_ALIAS("nat64_test_log_time");
 
 static bool init(void)
 {
-	int error;
-
-	error = logtime_init();
-	if (error)
-		goto fail;
-
-	return true;
-
-fail:
-	return false;
+	__u8 on = true;
+	return !logtime_set_config(LOGTIME_ENABLED, sizeof(on), &on);
 }
 
 static void end(void)
@@ -42,25 +34,124 @@ static void end(void)
 
 static bool simple_substraction(void)
 {
-	bool result = true;
 	struct timespec start;
 	struct timespec end;
-	struct log_node *node;
-
-	logtime_create_node(&node);
-	if (!node)
-		return false;
+	bool result = true;
 
 	start.tv_sec = 1L;
 	start.tv_nsec = 999999999L;
 	end.tv_sec = 2L;
 	end.tv_nsec = 0L;
+	result &= assert_equals_u64(1, subtract_timespec(&start, &end), "1 ns");
+
+	/* The clock went backwards. */
+	result &= assert_equals_u64(0, subtract_timespec(&end, &start), "negative");
 
-	subtract_timespec(&start, &end, node);
-	result &= assert_equals_u64(0, node->time.tv_sec, "node tv_sec");
-	result &= assert_equals_u64(1, node->time.tv_nsec, "node tv_nsec");
+	return result;
+}
+
+static bool test_buckets(void)
+{
+	u64 nsecs;
+	unsigned int bucket, prev_bucket = 0;
+	bool result = true;
+
+	for (nsecs = 0; nsecs < 2 * LOGTIME_SUB_BUCKETS; nsecs++)
+		result &= assert_equals_u64(nsecs, get_bucket(nsecs), "exact buckets");
+
+	result &= assert_equals_u64(2 * LOGTIME_SUB_BUCKETS, get_bucket(2 * LOGTIME_SUB_BUCKETS),
+			"first wide bucket");
+	result &= assert_equals_u64(2 * LOGTIME_SUB_BUCKETS, get_bucket(2 * LOGTIME_SUB_BUCKETS + 1),
+			"first wide bucket, upper half");
+
+	/* Longer durations never land in earlier buckets. */
+	for (nsecs = 1; nsecs < (1ULL << LOGTIME_MAX_BITS); nsecs = nsecs * 9 / 8 + 1) {
+		bucket = get_bucket(nsecs);
+		result &= assert_true(bucket >= prev_bucket, "monotonic");
+		prev_bucket = bucket;
+	}
+
+	result &= assert_equals_u64(LOGTIME_BUCKETS - 1,
+			get_bucket((1ULL << LOGTIME_MAX_BITS) - 1), "last bucket");
+	result &= assert_equals_u64(LOGTIME_BUCKETS - 1,
+			get_bucket(1ULL << LOGTIME_MAX_BITS), "overflow bucket");
+	result &= assert_equals_u64(LOGTIME_BUCKETS - 1, get_bucket(~0ULL), "max");
+
+	return result;
+}
+
+static bool test_histogram(void)
+{
+	struct timespec start = { .tv_sec = 10, .tv_nsec = 0 };
+	struct timespec end = { .tv_sec = 10, .tv_nsec = 5 };
+	struct logtime_usr *histogram;
+	bool result = true;
+
+	histogram = kmalloc(sizeof(*histogram), GFP_KERNEL);
+	if (!histogram)
+		return false;
+
+	result &= assert_equals_int(0, logtime(&start, &end, L3PROTO_IPV6, L4PROTO_UDP), "log 1");
+	result &= assert_equals_int(0, logtime(&start, &end, L3PROTO_IPV6, L4PROTO_UDP), "log 2");
+	result &= assert_equals_int(-EINVAL, logtime(&start, &end, L3PROTO_IPV6, 100), "bad proto");
+
+	result &= assert_equals_int(0, logtime_get(L3PROTO_IPV6, L4PROTO_UDP, histogram), "get");
+	result &= assert_equals_u64(2, histogram->counts[5], "5 ns count");
+	result &= assert_equals_u64(0, histogram->counts[4], "4 ns count");
+
+	/* Reading does not reset. */
+	result &= assert_equals_int(0, logtime_get(L3PROTO_IPV6, L4PROTO_UDP, histogram), "get 2");
+	result &= assert_equals_u64(2, histogram->counts[5], "5 ns count, again");
+
+	/* Other pairs are not affected. */
+	result &= assert_equals_int(0, logtime_get(L3PROTO_IPV4, L4PROTO_UDP, histogram), "get 4");
+	result &= assert_equals_u64(0, histogram->counts[5], "other pair");
+
+	kfree(histogram);
+	return result;
+}
+
+static bool test_toggle(void)
+{
+	struct timespec start = { .tv_sec = 10, .tv_nsec = 0 };
+	struct timespec end = { .tv_sec = 10, .tv_nsec = 5 };
+	struct logtime_config config;
+	struct logtime_usr *histogram;
+	__u8 value;
+	bool result = true;
+
+	histogram = kmalloc(sizeof(*histogram), GFP_KERNEL);
+	if (!histogram)
+		return false;
 
-	logtime_delete_node(node);
+	/* Nothing is allocated until the module is enabled. */
+	result &= assert_null(dbs, "lazy allocation");
+	result &= assert_false(logtime_enabled(), "starts disabled");
+	result &= assert_equals_int(0, logtime_get(L3PROTO_IPV6, L4PROTO_TCP, histogram), "get 1");
+	result &= assert_equals_u64(0, histogram->counts[5], "empty while disabled");
+
+	value = true;
+	result &= assert_equals_int(0, logtime_set_config(LOGTIME_ENABLED, sizeof(value), &value),
+			"enable");
+	result &= assert_true(logtime_enabled(), "enabled");
+	result &= assert_not_null(dbs, "allocated");
+	result &= assert_equals_int(0, logtime(&start, &end, L3PROTO_IPV6, L4PROTO_TCP), "log");
+
+	value = false;
+	result &= assert_equals_int(0, logtime_set_config(LOGTIME_ENABLED, sizeof(value), &value),
+			"disable");
+	result &= assert_false(logtime_enabled(), "disabled");
+	result &= assert_equals_int(0, logtime_clone_config(&config), "clone");
+	result &= assert_equals_u8(false, config.enabled, "clone says disabled");
+
+	/* The counts survive. */
+	result &= assert_equals_int(0, logtime_get(L3PROTO_IPV6, L4PROTO_TCP, histogram), "get 2");
+	result &= assert_equals_u64(1, histogram->counts[5], "kept while disabled");
+
+	result &= assert_equals_int(-EINVAL, logtime_set_config(LOGTIME_ENABLED, 4, &value),
+			"bad size");
+
+	kfree(histogram);
 	return result;
 }
 
@@ -69,6 +160,10 @@ static int logtime_test_init(void)
 	START_TESTS("Log time test");
 
 	INIT_CALL_END(init(), simple_substraction(), end(), "test_log_time substraction 1");
+	INIT_CALL_END(init(), test_buckets(), end(), "Histogram buckets");
+	INIT_CALL_END(init(), test_histogram(), end(), "Histogram");
+	CALL_TEST(test_toggle(), "Enable and disable");
+	end();
 
 	END_TESTS;
 }
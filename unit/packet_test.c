@@ -97,6 +97,37 @@ static bool test_function_build_ipv4_frag_off_field(void)
 	return success;
 }
 
+static bool test_big_packet_lengths(void)
+{
+	struct iphdr hdr4;
+	struct ipv6hdr hdr6;
+	int field = 0;
+	bool success = true;
+
+	success &= assert_equals_u16(65535, be16_to_cpu(build_tot_len_field(65535)),
+			"Largest tot_len");
+	success &= assert_equals_u16(0, be16_to_cpu(build_tot_len_field(65536)), "BIG tot_len");
+	success &= assert_equals_u16(0, be16_to_cpu(build_payload_len_field(100000)),
+			"BIG payload_len");
+
+	memset(&hdr6, 0, sizeof(hdr6));
+	success &= assert_equals_u32(100000, get_tot_len_ipv6(&hdr6, 100000), "BIG IPv6 length");
+	success &= assert_equals_u32(40, get_tot_len_ipv6(&hdr6, 1000), "Small zero IPv6 length");
+	hdr6.payload_len = cpu_to_be16(960);
+	success &= assert_equals_u32(1000, get_tot_len_ipv6(&hdr6, 100000), "Nonzero IPv6 length");
+
+	memset(&hdr4, 0, sizeof(hdr4));
+	hdr4.version = 4;
+	hdr4.ihl = 5;
+	ip_send_check(&hdr4);
+	success &= assert_equals_int(0, validate_ipv4_integrity(&hdr4, 100000, false, &field),
+			"BIG IPv4 packet");
+	success &= assert_equals_int(-EINVAL, validate_ipv4_integrity(&hdr4, 1000, false, &field),
+			"Zero tot_len on a small packet");
+
+	return success;
+}
+
 static bool test_inner_packet_validation4(void)
 {
 	struct sk_buff *skb = NULL;
@@ -145,6 +176,59 @@ static bool test_inner_packet_validation6(void)
 	return result;
 }
 
+static bool test_simple_ipv6(void)
+{
+	struct sk_buff *skb;
+	bool result = true;
+
+	skb = create_skb6(100, create_skb6_udp);
+	if (!assert_not_equals_ptr(NULL, skb, "UDP packet creation"))
+		return false;
+	result &= assert_equals_int(L4PROTO_UDP, skb_l4_proto(skb), "UDP l4 proto");
+	result &= assert_null(skb_frag_hdr(skb), "UDP frag hdr");
+	result &= assert_equals_int(sizeof(struct ipv6hdr), skb_l3hdr_len(skb), "UDP l3 hdr len");
+	result &= assert_equals_int(100, skb_payload_len(skb), "UDP payload len");
+
+	/* The shortcut must not skip the length validations. */
+	ipv6_hdr(skb)->payload_len = cpu_to_be16(sizeof(struct udphdr) + 99);
+	result &= assert_equals_int(-EINVAL, skb_init_cb_ipv6(skb), "Bogus payload length");
+	kfree_skb(skb);
+
+	skb = create_skb6(100, create_skb6_tcp);
+	if (!assert_not_equals_ptr(NULL, skb, "TCP packet creation"))
+		return false;
+	result &= assert_equals_int(L4PROTO_TCP, skb_l4_proto(skb), "TCP l4 proto");
+	result &= assert_null(skb_frag_hdr(skb), "TCP frag hdr");
+	result &= assert_equals_int(100, skb_payload_len(skb), "TCP payload len");
+	kfree_skb(skb);
+
+	return result;
+}
+
+static bool test_ext_hdr_recording(void)
+{
+	struct sk_buff *skb;
+	struct tuple tuple6;
+	bool result = true;
+
+	tuple6.src.addr6.l3 = dummies6[0];
+	tuple6.src.addr6.l4 = 5644;
+	tuple6.dst.addr6.l3 = dummies6[1];
+	tuple6.dst.addr6.l4 = 6721;
+
+	if (is_error(create_skb6_udp_frag(&tuple6, &skb, 100, 100, false, true, 0, 32)))
+		return false;
+
+	result &= assert_equals_ptr(ipv6_hdr(skb) + 1, skb_frag_hdr(skb), "Fragment header");
+	result &= assert_null(skb_rt_hdr(skb), "Routing header");
+	result &= assert_equals_int(L4PROTO_UDP, skb_l4_proto(skb), "Layer 4 protocol");
+	result &= assert_equals_int(sizeof(struct ipv6hdr) + sizeof(struct frag_hdr),
+			skb_l3hdr_len(skb), "Layer 3 header length");
+
+	kfree_skb(skb);
+	return result;
+}
+
 int init_module(void)
 {
 	START_TESTS("Packet");
@@ -160,9 +244,12 @@ int init_module(void)
 	CALL_TEST(test_function_is_dont_fragment_set(), "Dont fragment getter");
 	CALL_TEST(test_function_is_more_fragments_set(), "More fragments getter");
 	CALL_TEST(test_function_build_ipv4_frag_off_field(), "Generate frag offset + flags function");
+	CALL_TEST(test_big_packet_lengths(), "BIG TCP length fields");
 
 	CALL_TEST(test_inner_packet_validation4(), "Inner packet IPv4 Validation");
 	CALL_TEST(test_inner_packet_validation6(), "Inner packet IPv6 Validation");
+	CALL_TEST(test_simple_ipv6(), "IPv6 TCP/UDP without extension headers");
+	CALL_TEST(test_ext_hdr_recording(), "IPv6 extension headers recorded on entry");
 
 	END_TESTS;
 }
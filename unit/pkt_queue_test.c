@@ -24,7 +24,7 @@ static bool init(void)
 	error = pktqueue_init();
 	if (error)
 		goto fail;
-	error = sessiondb_init();
+	error = sessiondb_init(1, 0, false, false, false);
 	if (error)
 		goto fail;
 
@@ -54,8 +54,9 @@ static bool test_pkt_queue_asr(void)
 	/* Prepare */
 	if (is_error(init_ipv4_tuple(&tuple4, "5.6.7.8", 5678, "192.168.2.1", 8765, L4PROTO_TCP)))
 		return false;
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "192.168.2.1", 8765, "5.6.7.8", 5678,
-			V4_INIT); /* The session entry that is supposed to be created in "tcp_close_state_handle". */
+	/* The session entry that is supposed to be created in "tcp_close_state_handle". */
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::5.6.7.8", 5678,
+			"192.168.2.1", 8765, "5.6.7.8", 5678, V4_INIT);
 	if (!session)
 		return false;
 
@@ -94,8 +95,9 @@ static bool test_pkt_queue_ars(void)
 	/* Prepare */
 	if (is_error(init_ipv4_tuple(&tuple4, "5.6.7.8", 5678, "192.168.2.1", 8765, L4PROTO_TCP)))
 		return false;
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "192.168.2.1", 8765, "5.6.7.8", 5678,
-			V4_INIT); /* The session entry that is supposed to be created in "tcp_close_state_handle". */
+	/* The session entry that is supposed to be created in "tcp_close_state_handle". */
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::5.6.7.8", 5678,
+			"192.168.2.1", 8765, "5.6.7.8", 5678, V4_INIT);
 	if (!session)
 		return false;
 
@@ -119,12 +121,115 @@ static bool test_pkt_queue_ars(void)
 	return success;
 }
 
+/**
+ * Creates a V4_INIT session from "remote4"#"remote_port" to "local4"#"local_port", and asserts
+ * pktqueue_add() returns "expected" when asked to store its SYN.
+ */
+static bool add_syn(char *remote4, u16 remote_port, char *local4, u16 local_port, int expected,
+		struct session_entry **session)
+{
+	struct sk_buff *skb;
+	struct tuple tuple4;
+	char local6[INET6_ADDRSTRLEN];
+	int error;
+
+	if (is_error(init_ipv4_tuple(&tuple4, remote4, remote_port, local4, local_port, L4PROTO_TCP)))
+		return false;
+	snprintf(local6, sizeof(local6), "64:ff9b::%s", remote4);
+	*session = session_create_str_tcp("1::2", remote_port, local6, remote_port,
+			local4, local_port, remote4, remote_port, V4_INIT);
+	if (!*session)
+		return false;
+	if (is_error(create_skb4_tcp(&tuple4, &skb, 100, 32))) {
+		session_return(*session);
+		*session = NULL;
+		return false;
+	}
+	tcp_hdr(skb)->syn = true;
+
+	error = pktqueue_add(*session, skb);
+	if (error)
+		kfree_skb(skb);
+	return assert_equals_int(expected, error, "pktqueue_add result");
+}
+
+/**
+ * Returns true if the addresses in "addrs" are charged to different quota counters.
+ */
+static bool counters_differ(char *addrs[], unsigned int count)
+{
+	unsigned int counters[4];
+	struct in_addr addr;
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++) {
+		if (str_to_addr4(addrs[i], &addr))
+			return false;
+		counters[i] = get_counter(&addr);
+		for (j = 0; j < i; j++)
+			if (counters[i] == counters[j])
+				return false;
+	}
+
+	return true;
+}
+
+static bool test_quotas(void)
+{
+	struct session_entry *sessions[6] = { NULL };
+	char *srcs[] = { "5.6.7.8", "5.6.7.9", "5.6.7.10" };
+	char *pool4s[] = { "192.168.2.1", "192.168.2.2" };
+	__u64 max_pkts = 100, per_src = 2, per_pool4 = 3;
+	unsigned int i;
+	bool success = true;
+
+	/* The counters are hashed; make sure the addresses don't share budgets by chance. */
+	for (hash_rnd = 0; !counters_differ(srcs, ARRAY_SIZE(srcs))
+			|| !counters_differ(pool4s, ARRAY_SIZE(pool4s)); hash_rnd++)
+		/* Nothing. */;
+
+	success &= assert_equals_int(0, pktqueue_set_config(MAX_PKTS, sizeof(max_pkts), &max_pkts),
+			"max_pkts");
+	success &= assert_equals_int(0, pktqueue_set_config(MAX_PKTS_PER_SRC, sizeof(per_src),
+			&per_src), "max_pkts_per_src");
+	success &= assert_equals_int(0, pktqueue_set_config(MAX_PKTS_PER_POOL4, sizeof(per_pool4),
+			&per_pool4), "max_pkts_per_pool4");
+	if (!success)
+		return false;
+
+	/* A scanner cannot take more than its share... */
+	success &= add_syn("5.6.7.8", 1000, "192.168.2.1", 80, 0, &sessions[0]);
+	success &= add_syn("5.6.7.8", 1001, "192.168.2.1", 81, 0, &sessions[1]);
+	success &= add_syn("5.6.7.8", 1002, "192.168.2.1", 82, -E2BIG, &sessions[2]);
+	/* ...so other nodes can still open connections. */
+	success &= add_syn("5.6.7.9", 1000, "192.168.2.1", 80, 0, &sessions[3]);
+	/* The pool4 address is exhausted, but the other ones aren't. */
+	success &= add_syn("5.6.7.10", 1000, "192.168.2.1", 80, -E2BIG, &sessions[4]);
+	success &= add_syn("5.6.7.10", 1000, "192.168.2.2", 80, 0, &sessions[5]);
+
+	/* Expire everything at once. The sessions without packets are ignored. */
+	pktqueue_send_batch(sessions, ARRAY_SIZE(sessions));
+	success &= assert_equals_int(4, icmp64_pop(), "Batch sent the ICMP errors");
+	success &= assert_equals_int(0, packet_count, "Queue is empty");
+	for (i = 0; i < PKTQUEUE_COUNTER_SLOTS; i++) {
+		success &= assert_equals_u32(0, src_counters[i], "Source quotas were refunded");
+		success &= assert_equals_u32(0, pool4_counters[i], "Pool4 quotas were refunded");
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sessions); i++)
+		if (sessions[i])
+			session_return(sessions[i]);
+
+	return success;
+}
+
 static int pktqueue_test_init(void)
 {
 	START_TESTS("Packet queue");
 
 	INIT_CALL_END(init(), test_pkt_queue_asr(), end(), "test_pkt_queue 1");
 	INIT_CALL_END(init(), test_pkt_queue_ars(), end(), "test_pkt_queue 2");
+	INIT_CALL_END(init(), test_quotas(), end(), "Quotas and batches");
 
 	END_TESTS;
 }
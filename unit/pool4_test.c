@@ -322,6 +322,346 @@ static bool test_return_function(void)
 	return success;
 }
 
+/**
+ * Addresses leaving the pool must not be lent again, even if some CPU cached their ports.
+ */
+static bool test_remove_cached(void)
+{
+	struct ipv4_transport_addr result;
+	int i;
+	bool success = true;
+
+	/* Make this CPU cache a bunch of ports from both addresses. */
+	success &= assert_equals_int(0, pool4_get_any_addr(L4PROTO_TCP, 2000, &result), "borrow");
+	success &= assert_equals_int(0, pool4_return(L4PROTO_TCP, &result), "return");
+	success &= assert_equals_int(-EINVAL, pool4_return(L4PROTO_TCP, &result), "return twice");
+
+	success &= assert_equals_int(0, pool4_remove(&expected_ips[0]), "remove");
+	success &= assert_false(pool4_contains(expected_ips[0].s_addr), "not contained");
+	success &= assert_true(pool4_contains(expected_ips[1].s_addr), "still contained");
+
+	for (i = 0; i < 2 * MAG_SIZE; i++) {
+		success &= assert_equals_int(0, pool4_get_any_addr(L4PROTO_TCP, 2000, &result),
+				"borrow after remove");
+		success &= assert_equals_ipv4(&expected_ips[1], &result.l3, "remaining address");
+		if (!success)
+			return false;
+	}
+
+	/* The removed address had nothing borrowed, so it should be gone entirely. */
+	success &= assert_null(pool4_table_get(&pool, &expected_ips[0]), "node is dead");
+
+	return success;
+}
+
+/**
+ * Addresses that have lent more ports should give way to the others.
+ */
+static bool test_least_loaded(void)
+{
+	struct ipv4_transport_addr addr;
+	int i;
+	bool success = true;
+
+	addr.l3 = expected_ips[0];
+	for (i = 0; i < 100; i++) {
+		addr.l4 = i;
+		success &= assert_equals_int(0, pool4_get(L4PROTO_ICMP, &addr), "specific borrow");
+	}
+
+	for (i = 0; i < 50; i++) {
+		success &= assert_equals_int(0, pool4_get_any_addr(L4PROTO_ICMP, 1000, &addr),
+				"any borrow");
+		success &= assert_equals_ipv4(&expected_ips[1], &addr.l3, "less loaded address");
+		if (!success)
+			return false;
+	}
+
+	return success;
+}
+
+/**
+ * A subscriber's ports should come from the same address, until that address runs out.
+ */
+static bool test_affinity(void)
+{
+	struct in6_addr addr6;
+	struct ipv4_transport_addr first, addr;
+	int i, id;
+	bool success = true;
+
+	if (str_to_addr6("2001:db8::1", &addr6))
+		return false;
+
+	success &= assert_equals_int(0, pool4_get_affine(L4PROTO_ICMP, 1000, &addr6, &first),
+			"first borrow");
+	for (i = 0; i < 20; i++) {
+		success &= assert_equals_int(0, pool4_get_affine(L4PROTO_ICMP, 1000, &addr6, &addr),
+				"affine borrow");
+		success &= assert_equals_ipv4(&first.l3, &addr.l3, "same address");
+		if (!success)
+			return false;
+	}
+
+	/* Exhaust the subscriber's address; the other one should take over. */
+	addr.l3 = first.l3;
+	for (id = 0; id < ID_COUNT; id++) {
+		addr.l4 = id;
+		pool4_get(L4PROTO_ICMP, &addr);
+	}
+	success &= assert_equals_int(0, pool4_get_affine(L4PROTO_ICMP, 1000, &addr6, &addr),
+			"fallback borrow");
+	success &= assert_true(!ipv4_addr_equals(&first.l3, &addr.l3), "fallback address");
+
+	return success;
+}
+
+static bool test_contains(void)
+{
+	char *others_str[] = { "192.168.2.0", "192.168.2.3", "192.168.1.1", "192.168.3.1" };
+	struct in_addr others[ARRAY_SIZE(others_str)];
+	struct in_addr addr;
+	int i;
+	bool success = true;
+
+	for (i = 0; i < ARRAY_SIZE(others_str); i++)
+		if (str_to_addr4(others_str[i], &others[i]))
+			return false;
+
+	success &= assert_true(pool4_contains(expected_ips[0].s_addr), "first");
+	success &= assert_true(pool4_contains(expected_ips[1].s_addr), "second");
+	for (i = 0; i < ARRAY_SIZE(others); i++)
+		success &= assert_false(pool4_contains(others[i].s_addr), others_str[i]);
+
+	/* A second /24. */
+	if (str_to_addr4("192.168.3.1", &addr))
+		return false;
+	success &= assert_equals_int(0, pool4_register(&addr), "register");
+	success &= assert_true(pool4_contains(addr.s_addr), "registered");
+	success &= assert_true(pool4_contains(expected_ips[1].s_addr), "second after register");
+
+	success &= assert_equals_int(0, pool4_remove(&expected_ips[0]), "remove");
+	success &= assert_false(pool4_contains(expected_ips[0].s_addr), "removed");
+	success &= assert_true(pool4_contains(expected_ips[1].s_addr), "neighbor survives");
+
+	success &= assert_equals_int(0, pool4_flush(), "flush");
+	success &= assert_false(pool4_contains(expected_ips[1].s_addr), "flushed");
+	success &= assert_false(pool4_contains(addr.s_addr), "flushed 2");
+
+	return success;
+}
+
+static bool test_is_available(void)
+{
+	struct ipv4_transport_addr addr;
+	bool success = true;
+
+	addr.l3 = expected_ips[0];
+	addr.l4 = 6000;
+	success &= assert_true(pool4_is_available(L4PROTO_UDP, &addr), "fresh port");
+	success &= assert_equals_int(0, pool4_get(L4PROTO_UDP, &addr), "borrow");
+	success &= assert_false(pool4_is_available(L4PROTO_UDP, &addr), "borrowed port");
+	success &= assert_true(pool4_is_available(L4PROTO_TCP, &addr), "other protocol");
+	success &= assert_equals_int(0, pool4_return(L4PROTO_UDP, &addr), "return");
+	success &= assert_true(pool4_is_available(L4PROTO_UDP, &addr), "returned port");
+
+	addr.l3.s_addr = cpu_to_be32(0xc0a80203); /* 192.168.2.3 */
+	success &= assert_false(pool4_is_available(L4PROTO_UDP, &addr), "foreign address");
+
+	return success;
+}
+
+static bool test_range(void)
+{
+	struct in_addr range, addr;
+	struct ipv4_transport_addr result;
+	__u64 count;
+	__u16 port;
+	unsigned int nodes;
+	int i;
+	bool success = true;
+
+	if (str_to_addr4("192.168.4.0", &range) || str_to_addr4("192.168.4.1", &addr))
+		return false;
+
+	nodes = pool.node_count;
+	if (!assert_equals_int(0, pool4_register_range(&range, 30, 2000, 2003), "register"))
+		return false;
+	success &= assert_equals_int(-EEXIST, pool4_register_range(&addr, 32, 0, 65535), "overlap");
+	success &= assert_equals_int(-EINVAL, pool4_register(&addr), "register inside");
+	success &= assert_equals_u32(nodes, pool.node_count, "no nodes yet");
+
+	success &= assert_equals_int(0, pool4_count(&count), "count");
+	success &= assert_equals_u64(ARRAY_SIZE(expected_ips) + 4, count, "count result");
+	success &= assert_true(pool4_contains(addr.s_addr), "contains");
+	success &= assert_false(pool4_contains(cpu_to_be32(be32_to_cpu(range.s_addr) + 4)),
+			"outside");
+
+	/* Only the port range is lent. */
+	result.l3 = addr;
+	result.l4 = 2000;
+	success &= assert_equals_int(0, pool4_get_match(L4PROTO_TCP, &result, &port), "match");
+	success &= assert_true(port >= 2000 && port <= 2003, "match port");
+	success &= assert_equals_u32(nodes + 1, pool.node_count, "one node");
+	flush_work(&snapshot_work);
+	rcu_read_lock_bh();
+	success &= assert_not_null(snapshot_find(rcu_dereference_bh(snapshot), &addr),
+			"the snapshot catches up");
+	rcu_read_unlock_bh();
+	result.l4 = 10;
+	success &= assert_equals_int(-ESRCH, pool4_get_match(L4PROTO_TCP, &result, &port),
+			"low ports");
+
+	success &= assert_equals_int(-EINVAL, pool4_remove(&addr), "remove address");
+
+	/* The existing addresses run out first, then the range wakes up. */
+	success &= assert_equals_int(0, pool4_remove(&expected_ips[0]), "remove 0");
+	success &= assert_equals_int(0, pool4_remove(&expected_ips[1]), "remove 1");
+	for (i = 0; i < 4 * 4 - 1; i++) {
+		success &= assert_equals_int(0, pool4_get_any_addr(L4PROTO_TCP, 5000, &result),
+				"any addr");
+		success &= assert_true(result.l4 >= 2000 && result.l4 <= 2003, "any addr port");
+		if (!success)
+			return false;
+	}
+	success &= assert_equals_int(-ESRCH, pool4_get_any_addr(L4PROTO_TCP, 5000, &result),
+			"exhausted");
+
+	success &= assert_equals_int(0, pool4_remove_range(&range, 30), "remove range");
+	success &= assert_false(pool4_contains(addr.s_addr), "removed");
+
+	return success;
+}
+
+static bool test_deterministic(void)
+{
+	struct in_addr range, expected;
+	struct ipv6_prefix prefix6;
+	struct in6_addr addr6;
+	struct ipv4_transport_addr first;
+	unsigned int count;
+	bool success = true;
+
+	if (str_to_addr4("192.168.3.0", &range) || str_to_addr4("192.168.3.1", &expected))
+		return false;
+	if (str_to_addr6("2001:db8::", &prefix6.address))
+		return false;
+	prefix6.len = 60;
+
+	/* 16 subscribers, 4 addresses; 4 subscribers per address. */
+	if (!assert_equals_int(0, pool4_register_det(&range, 30, &prefix6, 64), "register"))
+		return false;
+	success &= assert_equals_int(-EEXIST, pool4_register_det(&range, 30, &prefix6, 64),
+			"register again");
+	success &= assert_true(pool4_contains(expected.s_addr), "contains");
+
+	if (str_to_addr6("2001:db8:0:7::1", &addr6))
+		return false;
+	success &= assert_equals_int(0, pool4_get_det(&addr6, &first, &count), "get 7");
+	success &= assert_equals_ipv4(&expected, &first.l3, "7's address");
+	success &= assert_equals_u16(1024 + 3 * 16128, first.l4, "7's first port");
+	success &= assert_equals_u32(16128, count, "7's port count");
+
+	first.l3 = expected;
+	first.l4 = 2000;
+	success &= assert_equals_int(-EINVAL, pool4_get(L4PROTO_UDP, &first), "not on demand");
+
+	if (str_to_addr6("2001:db9::1", &addr6))
+		return false;
+	success &= assert_equals_int(-ENOENT, pool4_get_det(&addr6, &first, &count), "unmapped");
+
+	success &= assert_equals_int(0, pool4_remove(&expected), "remove");
+	if (str_to_addr6("2001:db8:0:5::", &addr6))
+		return false;
+	success &= assert_equals_int(-ESRCH, pool4_get_det(&addr6, &first, &count), "removed");
+
+	return success;
+}
+
+static bool test_psid(void)
+{
+	struct in_addr addr;
+	struct ipv4_transport_addr result;
+	__u16 port;
+	int i;
+	bool success = true;
+
+	if (str_to_addr4("192.168.5.0", &addr))
+		return false;
+
+	success &= assert_equals_int(-EINVAL, pool4_register_psid(&addr, 32, 0, 0, 6), "no PSID");
+	success &= assert_equals_int(-EINVAL, pool4_register_psid(&addr, 32, 0, 2, 2), "short");
+	success &= assert_equals_int(-EINVAL, pool4_register_psid(&addr, 32, 64, 6, 6), "too big");
+
+	/* Offset 6, PSID 0x34/8: 63 runs of 4 ports; 0x04d0-0x04d3, 0x08d0-0x08d3, ... */
+	if (!assert_equals_int(0, pool4_register_psid(&addr, 32, 0x34, 8, 6), "register"))
+		return false;
+	success &= assert_true(pool4_contains(addr.s_addr), "contains");
+
+	result.l3 = addr;
+	result.l4 = 0x08d2;
+	success &= assert_equals_int(0, pool4_get(L4PROTO_TCP, &result), "get in set");
+	result.l4 = 0x08d4;
+	success &= assert_equals_int(-ESRCH, pool4_get(L4PROTO_TCP, &result), "get outside set");
+	result.l4 = 0x00d0;
+	success &= assert_equals_int(-ESRCH, pool4_get(L4PROTO_TCP, &result), "well-known port");
+
+	/* Parity is preserved within the set. */
+	result.l4 = 5001;
+	success &= assert_equals_int(0, pool4_get_match(L4PROTO_UDP, &result, &port), "match");
+	success &= assert_equals_u16(0x00d0, port & 0x03fc, "match in set");
+	success &= assert_equals_u16(1, port & 1, "match parity");
+	result.l4 = port;
+	success &= assert_equals_int(0, pool4_return(L4PROTO_UDP, &result), "return");
+
+	for (i = 0; i < 63 * 4 - 1; i++) {
+		success &= assert_equals_int(0, pool4_get_any_port(L4PROTO_TCP, &addr, &port),
+				"any port");
+		success &= assert_equals_u16(0x00d0, port & 0x03fc, "any port in set");
+		success &= assert_true(port >= 1024, "any port is not well-known");
+		if (!success)
+			return false;
+	}
+	success &= assert_equals_int(-ESRCH, pool4_get_any_port(L4PROTO_TCP, &addr, &port),
+			"exhausted");
+
+	success &= assert_equals_int(0, pool4_remove_range(&addr, 32), "remove");
+	success &= assert_false(pool4_contains(addr.s_addr), "removed");
+
+	return success;
+}
+
+/**
+ * Deferred returns skip the magazines, and reach the pool only when they're flushed.
+ */
+static bool test_deferred_returns(void)
+{
+	struct ipv4_transport_addr addrs[6];
+	int i;
+	bool success = true;
+
+	/* Interleave the addresses, so the flush has to group them. */
+	for (i = 0; i < ARRAY_SIZE(addrs); i++) {
+		addrs[i].l3 = expected_ips[i & 1];
+		success &= assert_equals_int(0, pool4_get_any_port(L4PROTO_UDP, &addrs[i].l3,
+				&addrs[i].l4), "borrow");
+	}
+	if (!success)
+		return false;
+
+	pool4_defer_returns();
+	for (i = 0; i < ARRAY_SIZE(addrs); i++)
+		success &= assert_equals_int(0, pool4_return(L4PROTO_UDP, &addrs[i]), "return");
+	for (i = 0; i < ARRAY_SIZE(addrs); i++)
+		success &= assert_false(pool4_is_available(L4PROTO_UDP, &addrs[i]), "held back");
+	pool4_flush_returns();
+
+	for (i = 0; i < ARRAY_SIZE(addrs); i++)
+		success &= assert_true(pool4_is_available(L4PROTO_UDP, &addrs[i]), "flushed");
+
+	return success;
+}
+
 static bool init(void)
 {
 	int addr_ctr, port_ctr;
@@ -333,7 +673,7 @@ static bool init(void)
 		}
 	}
 
-	if (pool4_init(expected_ips_as_str, ARRAY_SIZE(expected_ips_as_str)) != 0) {
+	if (pool4_init(expected_ips_as_str, ARRAY_SIZE(expected_ips_as_str), 0, true, false) != 0) {
 		log_err("Could not init the pool. Failing...");
 		return false;
 	}
@@ -364,6 +704,15 @@ int init_module(void)
 	INIT_CALL_END(init(), test_get_any_addr_function_tcp(), destroy(), "Get any addr-TCP");
 	INIT_CALL_END(init(), test_get_any_addr_function_icmp(), destroy(), "Get any addr-ICMP");
 	INIT_CALL_END(init(), test_return_function(), destroy(), "Return function");
+	INIT_CALL_END(init(), test_least_loaded(), destroy(), "Least loaded address");
+	INIT_CALL_END(init(), test_affinity(), destroy(), "Subscriber affinity");
+	INIT_CALL_END(init(), test_contains(), destroy(), "Contains");
+	INIT_CALL_END(init(), test_is_available(), destroy(), "Availability without the lock");
+	INIT_CALL_END(init(), test_deterministic(), destroy(), "Deterministic ranges");
+	INIT_CALL_END(init(), test_range(), destroy(), "Lazy ranges");
+	INIT_CALL_END(init(), test_psid(), destroy(), "PSID ranges");
+	INIT_CALL_END(init(), test_remove_cached(), destroy(), "Remove cached addresses");
+	INIT_CALL_END(init(), test_deferred_returns(), destroy(), "Deferred returns");
 
 	END_TESTS;
 }
@@ -0,0 +1,164 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/comm/str_utils.h"
+#include "pool6.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("IPv6 pool module test");
+
+
+static bool add_prefix(char *addr_str, __u8 len)
+{
+	struct ipv6_prefix prefix;
+
+	if (str_to_addr6(addr_str, &prefix.address) != 0) {
+		log_err("Cannot parse '%s'.", addr_str);
+		return false;
+	}
+	prefix.len = len;
+
+	return assert_equals_int(0, pool6_add(&prefix), "Add prefix");
+}
+
+static bool assert_get(char *addr_str, char *expected_str, __u8 expected_len, char *test_name)
+{
+	struct in6_addr addr, expected;
+	struct ipv6_prefix result;
+	bool success = true;
+
+	if (str_to_addr6(addr_str, &addr) != 0 || str_to_addr6(expected_str, &expected) != 0) {
+		log_err("Cannot parse the test's addresses.");
+		return false;
+	}
+
+	success &= assert_equals_int(0, pool6_get(&addr, &result), test_name);
+	success &= assert_equals_ipv6(&expected, &result.address, test_name);
+	success &= assert_equals_u8(expected_len, result.len, test_name);
+	success &= assert_true(pool6_contains(&addr), test_name);
+
+	return success;
+}
+
+static bool assert_not_get(char *addr_str, char *test_name)
+{
+	struct in6_addr addr;
+	struct ipv6_prefix result;
+	bool success = true;
+
+	if (str_to_addr6(addr_str, &addr) != 0) {
+		log_err("Cannot parse '%s'.", addr_str);
+		return false;
+	}
+
+	success &= assert_equals_int(-ENOENT, pool6_get(&addr, &result), test_name);
+	success &= assert_false(pool6_contains(&addr), test_name);
+
+	return success;
+}
+
+static bool test_longest_match(void)
+{
+	bool success = true;
+
+	if (!add_prefix("64:ff9b::", 32) || !add_prefix("2001:db8::", 64)
+			|| !add_prefix("2001:db8:0:1::", 64) || !add_prefix("64:ff9b::", 96))
+		return false;
+
+	rcu_read_lock_bh();
+	success &= assert_equals_u32(2, rcu_dereference_bh(snapshot)->head_count,
+			"Prefixes that share their first 32 bits share their head");
+	rcu_read_unlock_bh();
+
+	success &= assert_get("64:ff9b::192.0.2.1", "64:ff9b::", 96, "/96 beats /32");
+	success &= assert_get("64:ff9b:1::192.0.2.1", "64:ff9b::", 32, "Only the /32");
+	success &= assert_get("2001:db8::c000:201", "2001:db8::", 64, "First /64");
+	success &= assert_get("2001:db8:0:1::c000:201", "2001:db8:0:1::", 64, "Second /64");
+	success &= assert_not_get("2001:db8:0:2::c000:201", "Between the /64s");
+	success &= assert_not_get("64:ff9a::192.0.2.1", "Outside everything");
+
+	return success;
+}
+
+static bool test_remove_and_flush(void)
+{
+	struct ipv6_prefix prefix;
+	bool success = true;
+
+	if (!add_prefix("64:ff9b::", 32) || !add_prefix("64:ff9b::", 96))
+		return false;
+
+	success &= assert_equals_int(0, pool6_peek(&prefix), "Peek");
+	success &= assert_equals_u8(32, prefix.len, "Peek returns the oldest prefix");
+
+	prefix.len = 96;
+	success &= assert_equals_int(0, pool6_remove(&prefix), "Remove the /96");
+	success &= assert_get("64:ff9b::192.0.2.1", "64:ff9b::", 32, "The /32 takes over");
+
+	success &= assert_equals_int(0, pool6_flush(), "Flush");
+	success &= assert_not_get("64:ff9b::192.0.2.1", "Flushed pool");
+	success &= assert_equals_int(-ENOENT, pool6_peek(&prefix), "Peek on empty pool");
+
+	return success;
+}
+
+static bool test_4to6(void)
+{
+	struct in_addr addr4;
+	struct in6_addr addr6, expected;
+	bool success = true;
+
+	if (is_error(str_to_addr4("192.0.2.1", &addr4)))
+		return false;
+	success &= assert_equals_int(-ENOENT, pool6_4to6(&addr4, &addr6), "Empty pool");
+
+	if (!add_prefix("2001:db8::", 32) || !add_prefix("64:ff9a::", 96))
+		return false;
+
+	/* The oldest prefix wins, same as pool6_peek(). */
+	if (is_error(str_to_addr6("2001:db8:c000:201::", &expected)))
+		return false;
+	success &= assert_equals_int(0, pool6_4to6(&addr4, &addr6), "/32 result");
+	success &= assert_equals_ipv6(&expected, &addr6, "/32 address");
+
+	if (is_error(pool6_flush()) || !add_prefix("64:ff9b::", 96))
+		return false;
+	if (is_error(str_to_addr6("64:ff9b::192.0.2.1", &expected)))
+		return false;
+	success &= assert_equals_int(0, pool6_4to6(&addr4, &addr6), "/96 result");
+	success &= assert_equals_ipv6(&expected, &addr6, "/96 address");
+
+	return success;
+}
+
+static bool init(void)
+{
+	if (is_error(pool6_init(NULL, 0)))
+		return false;
+	/* Get rid of the default prefix. */
+	return !is_error(pool6_flush());
+}
+
+static void destroy(void)
+{
+	pool6_destroy();
+}
+
+int init_module(void)
+{
+	START_TESTS("IPv6 Pool");
+
+	INIT_CALL_END(init(), test_longest_match(), destroy(), "Longest prefix match");
+	INIT_CALL_END(init(), test_remove_and_flush(), destroy(), "Remove and flush");
+	INIT_CALL_END(init(), test_4to6(), destroy(), "Address building");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
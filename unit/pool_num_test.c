@@ -4,59 +4,47 @@
 #include "nat64/unit/unit_test.h"
 #include "poolnum.c"
 
-static bool find(u16 *arr, u16 arr_len, u16 value)
-{
-	u16 i;
-
-	for (i = 0; i < arr_len; i++)
-		if (arr[i] == value)
-			return true;
-
-	return false;
-}
-
 static bool test_poolnum_init_function(void)
 {
 	bool success = true;
 	struct poolnum pool;
 
-	success &= assert_equals_int(0, poolnum_init(&pool, 7, 13, 2), "Return value 1");
+	success &= assert_equals_int(0, poolnum_init(&pool, 7, 13, 2, true), "Return value 1");
 	if (!success)
 		return success;
 
-	success &= assert_equals_u16(4, pool.count, "Pool's array count 1");
-	success &= assert_equals_u16(0, pool.next, "Next gettable value's index 1");
-	success &= assert_equals_u16(0, pool.returned, "Index of value just returned 1");
-
-	success &= assert_false(find(pool.array, 4, 5), "5 should not belong to the pool");
-	success &= assert_false(find(pool.array, 4, 6), "6 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 7), "7 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 8), "8 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 9), "9 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 10), "10 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 11), "11 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 12), "12 should not belong to the pool");
-	success &= assert_true(find(pool.array, 4, 13), "13 should belong to the pool");
-	success &= assert_false(find(pool.array, 4, 14), "14 should not belong to the pool");
-	success &= assert_false(find(pool.array, 4, 15), "15 should not belong to the pool");
+	success &= assert_equals_u32(4, pool.count, "Pool's count 1");
+	success &= assert_equals_u32(4, pool.available, "Pool's available count 1");
+
+	success &= assert_false(poolnum_is_available(&pool, 5), "5 should not belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 6), "6 should not belong to the pool");
+	success &= assert_true(poolnum_is_available(&pool, 7), "7 should belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 8), "8 should not belong to the pool");
+	success &= assert_true(poolnum_is_available(&pool, 9), "9 should belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 10), "10 should not belong to the pool");
+	success &= assert_true(poolnum_is_available(&pool, 11), "11 should belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 12), "12 should not belong to the pool");
+	success &= assert_true(poolnum_is_available(&pool, 13), "13 should belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 14), "14 should not belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 15), "15 should not belong to the pool");
 
 	poolnum_destroy(&pool);
 
-	success &= assert_equals_int(0, poolnum_init(&pool, 0, 5, 3), "Return value 2");
+	success &= assert_equals_int(0, poolnum_init(&pool, 0, 5, 3, true), "Return value 2");
 	if (!success)
 		return success;
 
-	success &= assert_equals_u16(2, pool.count, "Pool's array count 2");
-	success &= assert_equals_u16(0, pool.next, "Next gettable value's index 2");
-	success &= assert_equals_u16(0, pool.returned, "Index of value just returned 2");
+	success &= assert_equals_u32(2, pool.count, "Pool's count 2");
+	success &= assert_equals_u32(2, pool.available, "Pool's available count 2");
 
-	success &= assert_true(find(pool.array, 2, 0), "0 should belong to the pool");
-	success &= assert_false(find(pool.array, 2, 1), "1 should not belong to the pool");
-	success &= assert_false(find(pool.array, 2, 2), "2 should not belong to the pool");
-	success &= assert_true(find(pool.array, 2, 3), "3 should belong to the pool");
-	success &= assert_false(find(pool.array, 2, 4), "4 should not belong to the pool");
-	success &= assert_false(find(pool.array, 2, 5), "5 should not belong to the pool 2");
+	success &= assert_true(poolnum_is_available(&pool, 0), "0 should belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 1), "1 should not belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 2), "2 should not belong to the pool");
+	success &= assert_true(poolnum_is_available(&pool, 3), "3 should belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 4), "4 should not belong to the pool");
+	success &= assert_false(poolnum_is_available(&pool, 5), "5 should not belong to the pool 2");
 
+	poolnum_destroy(&pool);
 	return success;
 }
 
@@ -66,7 +54,7 @@ static bool test_poolnum_empty_full(void)
 	struct poolnum pool;
 	u16 trash;
 
-	if (is_error(poolnum_init(&pool, 1, 3, 1)))
+	if (is_error(poolnum_init(&pool, 1, 3, 1, true)))
 		return false;
 	success &= assert_false(poolnum_is_empty(&pool), "init'd pool is far from empty");
 	success &= assert_true(poolnum_is_full(&pool), "init'd pool is full.");
@@ -101,6 +89,7 @@ static bool test_poolnum_empty_full(void)
 	success &= assert_false(poolnum_is_empty(&pool), "all returns, pool is far from empty.");
 	success &= assert_true(poolnum_is_full(&pool), "all returns, pool is full again");
 
+	poolnum_destroy(&pool);
 	return success;
 }
 
@@ -110,26 +99,21 @@ static bool test_poolnum_get_any_function(void)
 	struct poolnum pool;
 	u16 first_get = 456, second_get = 123, third_get = 789, fourth_get;
 
-	if (is_error(poolnum_init(&pool, 1, 3, 1)))
+	if (is_error(poolnum_init(&pool, 1, 3, 1, true)))
 		return false;
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &first_get), "Result 1");
-	success &= assert_equals_u16(pool.count, 3, "Count remains unchanged 1");
-	success &= assert_equals_u16(pool.next, 1, "Next should point to the second value");
-	success &= assert_equals_u16(pool.returned, 0, "Returned remains unchanged 1");
+	success &= assert_true(1 <= first_get && first_get <= 3, "The number belongs to the pool 1");
+	success &= assert_equals_u32(2, pool.available, "Available count 1");
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &second_get), "Result 2");
 	success &= assert_true(first_get != second_get, "The number is not already taken 1");
-	success &= assert_equals_u16(pool.count, 3, "Count remains unchanged 2");
-	success &= assert_equals_u16(pool.next, 2, "Next should point to the third value");
-	success &= assert_equals_u16(pool.returned, 0, "Returned remains unchanged 2");
+	success &= assert_equals_u32(1, pool.available, "Available count 2");
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &third_get), "Result 3");
 	success &= assert_true(first_get != third_get && second_get != third_get,
 			"The number is not already taken 2");
-	success &= assert_equals_u16(pool.count, 3, "Count remains unchanged 3");
-	success &= assert_equals_u16(pool.next, 0, "Next should point to the first value");
-	success &= assert_equals_u16(pool.returned, 0, "Returned remains unchanged 3");
+	success &= assert_equals_u32(0, pool.available, "Available count 3");
 
 	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &fourth_get),
 			"Pool is exhausted; get should fail 1");
@@ -140,14 +124,29 @@ static bool test_poolnum_get_any_function(void)
 	return success;
 }
 
-static bool assert_pool_simple(struct poolnum *pool, u32 expected_next, u32 expected_returned)
+static bool test_poolnum_sequential(void)
 {
 	bool success = true;
+	struct poolnum pool;
+	u16 next_get = 0;
 
-	success &= assert_equals_u32(3, pool->count, "pool.count");
-	success &= assert_equals_u32(expected_next, pool->next, "pool.next");
-	success &= assert_equals_u32(expected_returned, pool->returned, "pool.returned");
+	if (is_error(poolnum_init(&pool, 1, 3, 1, false)))
+		return false;
+
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "1st get_any-result");
+	success &= assert_equals_u16(1, next_get, "1st get_any-value");
+	success &= assert_equals_int(0, poolnum_return(&pool, 1), "1st return");
 
+	/* Recently returned numbers should rest for a while. */
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "2nd get_any-result");
+	success &= assert_equals_u16(2, next_get, "2nd get_any-value");
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "3rd get_any-result");
+	success &= assert_equals_u16(3, next_get, "3rd get_any-value");
+	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "4th get_any-result");
+	success &= assert_equals_u16(1, next_get, "4th get_any-value (wrap around)");
+	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &next_get), "borrow on empty pool");
+
+	poolnum_destroy(&pool);
 	return success;
 }
 
@@ -157,137 +156,165 @@ static bool test_poolnum_return_function(void)
 	struct poolnum pool;
 	u16 next_get = 0;
 
-	if (is_error(poolnum_init(&pool, 1, 3, 1)))
+	if (is_error(poolnum_init(&pool, 1, 3, 1, false)))
 		return false;
-	pool.array[0] = 1;
-	pool.array[1] = 2;
-	pool.array[2] = 3;
 
-	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "borrowless return");
-	success &= assert_pool_simple(&pool, 0, 0);
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "out of range return");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 1), "borrowless return");
+	success &= assert_equals_u32(3, pool.available, "nothing changed");
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "lone get_any-result");
 	success &= assert_equals_u16(1, next_get, "lone get_any-value");
-	success &= assert_pool_simple(&pool, 1, 0);
-
-	success &= assert_equals_int(0, poolnum_return(&pool, 10), "1st return");
-	success &= assert_pool_simple(&pool, 1, 1);
-
-	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "borrowless after return");
-	success &= assert_pool_simple(&pool, 1, 1);
+	success &= assert_equals_int(0, poolnum_return(&pool, 1), "1st return");
+	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 1), "double return");
+	success &= assert_true(poolnum_is_full(&pool), "pool is full again");
 
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "1st get_any-result");
-	success &= assert_equals_u16(2, next_get, "1st get_any-value");
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "2nd get_any-result");
-	success &= assert_equals_u16(3, next_get, "2nd get_any-value");
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "3rd get_any-result");
-	success &= assert_equals_u16(10, next_get, "3rd get_any-result");
 	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &next_get), "borrow on empty pool");
-	success &= assert_pool_simple(&pool, 1, 1);
 
 	success &= assert_equals_int(0, poolnum_return(&pool, 2), "return 2nd borrowed value");
 	success &= assert_equals_int(0, poolnum_return(&pool, 3), "return 3rd borrowed value");
 	success &= assert_equals_int(0, poolnum_return(&pool, 1), "return 1st borrowed value");
 	success &= assert_equals_int(-EINVAL, poolnum_return(&pool, 4), "too many returns");
-
-	success &= assert_equals_int(0, poolnum_get_any(&pool, &next_get), "pool still stable-result");
-	success &= assert_equals_u16(2, next_get, "pool still stable-value");
+	success &= assert_true(poolnum_is_full(&pool), "pool is full at the end");
 
 	poolnum_destroy(&pool);
 	return success;
 }
 
-static bool assert_pool_full(struct poolnum *pool, u16 val1, u16 val2, u16 val3, u16 val4,
-		u32 next, u32 returned, bool next_is_ahead)
-{
-	bool success = true;
-
-	success &= assert_equals_u16(val1, pool->array[0], "1st value");
-	success &= assert_equals_u16(val2, pool->array[1], "2nd value");
-	success &= assert_equals_u16(val3, pool->array[2], "3rd value");
-	success &= assert_equals_u16(val4, pool->array[3], "4th value");
-	success &= assert_equals_u32(4, pool->count, "count");
-	success &= assert_equals_u32(next, pool->next, "next");
-	success &= assert_equals_u32(returned, pool->returned, "returned");
-	success &= assert_equals_u32(next_is_ahead, pool->next_is_ahead, "next_is_ahead");
-
-	return success;
-}
-
 static bool test_poolnum_get_function(void) {
 	bool success = true;
 	struct poolnum pool;
 	u16 get_any_result = 0;
 
-	if (is_error(poolnum_init(&pool, 0, 3, 1)))
+	if (is_error(poolnum_init(&pool, 0, 3, 1, true)))
 		return false;
-	pool.array[0] = 0;
-	pool.array[1] = 1;
-	pool.array[2] = 2;
-	pool.array[3] = 3;
 
 	/* Request values that do not belong to the pool. */
 	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, -1), "requested -1");
-	success &= assert_pool_full(&pool, 0, 1, 2, 3,	0, 0, false);
 	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, -4), "requested -4");
-	success &= assert_pool_full(&pool, 0, 1, 2, 3,	0, 0, false);
+	success &= assert_true(poolnum_is_full(&pool), "pool should be untouched");
 
 	if (!success)
 		return success;
 
 	/* Tests featuring get_anys. */
 	success &= assert_equals_int(0, poolnum_get(&pool, 2), "getting value 2");
-	success &= assert_pool_full(&pool, 0, 1, 0, 3,	1, 0, true);
+	success &= assert_false(poolnum_is_available(&pool, 2), "2 is borrowed");
 	success &= assert_equals_int(0, poolnum_get(&pool, 1), "getting value 1");
-	success &= assert_pool_full(&pool, 0, 1, 0, 3,	2, 0, true);
+	success &= assert_false(poolnum_is_available(&pool, 1), "1 is borrowed");
 	success &= assert_equals_int(0, poolnum_get_any(&pool, &get_any_result), "get_any-result");
-	success &= assert_equals_u16(0, get_any_result, "get_any-value");
-	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 0), "getting already borrowed 0");
+	success &= assert_true(get_any_result == 0 || get_any_result == 3, "get_any-value");
+	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, get_any_result),
+			"getting already borrowed get_any value");
 	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 1), "getting already borrowed 1");
 	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 2), "getting already borrowed 2");
-	success &= assert_equals_int(0, poolnum_get(&pool, 3), "getting final value");
-	success &= assert_pool_full(&pool, 0, 1, 0, 3,	0, 0, true);
-	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 3), "getting already borrowed 3");
+	success &= assert_equals_int(0, poolnum_get(&pool, 3 - get_any_result), "getting final value");
+	success &= assert_true(poolnum_is_empty(&pool), "pool is empty");
 	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &get_any_result),
 			"get on empty pool");
 
 	if (!success)
 		return success;
 
-	/* Reset. */
-	pool.array[0] = 0;
-	pool.array[1] = 1;
-	pool.array[2] = 2;
-	pool.array[3] = 3;
-	pool.next = 0;
-	pool.returned = 0;
-	pool.next_is_ahead = false;
-
 	/* Tests featuring returns. */
-	success &= assert_equals_int(0, poolnum_get(&pool, 0), "getting 0");
-	success &= assert_pool_full(&pool, 0, 1, 2, 3,	1, 0, true);
-	success &= assert_equals_int(0, poolnum_get(&pool, 3), "getting 3");
-	success &= assert_pool_full(&pool, 0, 1, 2, 1,	2, 0, true);
 	success &= assert_equals_int(0, poolnum_return(&pool, 3), "returning 3");
-	success &= assert_pool_full(&pool, 3, 1, 2, 1,	2, 1, true);
 	success &= assert_equals_int(0, poolnum_return(&pool, 0), "returning 0");
-	success &= assert_pool_full(&pool, 3, 0, 2, 1,	2, 2, false);
-
-	success &= assert_equals_int(0, poolnum_get(&pool, 3), "getting everything 3");
-	success &= assert_pool_full(&pool, 2, 0, 2, 1,	3, 2, true);
-	success &= assert_equals_int(0, poolnum_get(&pool, 1), "getting everything 1");
-	success &= assert_pool_full(&pool, 2, 0, 2, 1,	0, 2, true);
-	success &= assert_equals_int(0, poolnum_get(&pool, 0), "getting everything 0");
-	success &= assert_pool_full(&pool, 2, 2, 2, 1,	1, 2, true);
-	success &= assert_equals_int(0, poolnum_get(&pool, 2), "getting everything 2");
-	success &= assert_pool_full(&pool, 2, 2, 2, 1,	2, 2, true);
-
-	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 0), "returning everything 0");
-	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 1), "returning everything 1");
-	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 2), "returning everything 2");
-	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 3), "returning everything 3");
-	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &get_any_result),
-			"returning too much");
+	success &= assert_equals_int(0, poolnum_get(&pool, 3), "getting 3 again");
+	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 3), "getting 3 twice");
+	success &= assert_equals_int(0, poolnum_get(&pool, 0), "getting 0 again");
+	success &= assert_true(poolnum_is_empty(&pool), "pool is empty again");
+
+	poolnum_destroy(&pool);
+	return success;
+}
+
+static bool test_runs(void)
+{
+	struct poolnum pool;
+	u16 expected[] = { 8, 9, 24, 25, 40, 41 };
+	u16 port;
+	int i;
+	bool success = true;
+
+	if (is_error(poolnum_init_runs(&pool, 8, 1, 2, 16, 3, false)))
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(expected); i++) {
+		success &= assert_equals_int(0, poolnum_get_any(&pool, &port), "get_any result");
+		success &= assert_equals_u16(expected[i], port, "get_any value");
+	}
+	success &= assert_true(poolnum_is_empty(&pool), "pool is empty");
+
+	success &= assert_equals_int(0, poolnum_return(&pool, 25), "returning 25");
+	success &= assert_false(poolnum_is_available(&pool, 10), "10 is between runs");
+	success &= assert_false(poolnum_is_available(&pool, 56), "56 is after the last run");
+	success &= assert_equals_int(-ESRCH, poolnum_get(&pool, 23), "23 is before a run");
+	success &= assert_equals_int(0, poolnum_get(&pool, 25), "getting 25");
+
+	poolnum_destroy(&pool);
+	return success;
+}
+
+static bool test_slices(void)
+{
+	struct poolnum pool;
+	u16 port;
+	int i;
+	bool success = true;
+
+	/* Chunks of 16; slice 1 of 4 owns 16-31, 80-95, 144-159 and 208-223. */
+	if (is_error(poolnum_init(&pool, 10, 255, 1, true)))
+		return false;
+
+	for (i = 0; i < 64; i++) {
+		success &= assert_equals_int(0, poolnum_get_slice(&pool, 4, 4, 1, &port),
+				"get_slice result");
+		success &= assert_equals_u16(1, (port >> 4) % 4, "get_slice chunk");
+	}
+	success &= assert_equals_int(-ESRCH, poolnum_get_slice(&pool, 4, 4, 1, &port),
+			"slice is exhausted");
+	success &= assert_equals_u32(246 - 64, pool.available, "only the slice was taken");
+	success &= assert_equals_int(0, poolnum_get_slice(&pool, 4, 4, 0, &port),
+			"another slice");
+	success &= assert_equals_u16(0, (port >> 4) % 4, "other slice's chunk");
+	poolnum_destroy(&pool);
+
+	if (is_error(poolnum_init_runs(&pool, 8, 1, 2, 16, 3, false)))
+		return false;
+	success &= assert_equals_int(-ESRCH, poolnum_get_slice(&pool, 4, 4, 0, &port),
+			"runs are not sliced");
+	poolnum_destroy(&pool);
+
+	return success;
+}
+
+static bool test_lazy_bits(void)
+{
+	struct poolnum pool;
+	u16 port;
+	int i;
+	bool success = true;
+
+	/* 70 numbers; the second word is partial. */
+	if (is_error(poolnum_init(&pool, 100, 169, 1, false)))
+		return false;
+	success &= assert_null(pool.bits, "No bitmap on init");
+	success &= assert_true(poolnum_is_available(&pool, 169), "Available without a bitmap");
+	success &= assert_false(poolnum_is_available(&pool, 170), "Outsider without a bitmap");
+
+	success &= assert_equals_int(0, poolnum_get(&pool, 150), "Specific get");
+	success &= assert_not_null(pool.bits, "The get allocated the bitmap");
+	success &= assert_false(poolnum_is_available(&pool, 150), "The number was taken");
+
+	for (i = 0; i < 69; i++) {
+		success &= assert_equals_int(0, poolnum_get_any(&pool, &port), "get_any result");
+		success &= assert_true(100 <= port && port <= 169 && port != 150, "get_any range");
+	}
+	success &= assert_equals_int(-ESRCH, poolnum_get_any(&pool, &port),
+			"The filler did not leave stray bits");
 
 	poolnum_destroy(&pool);
 	return success;
@@ -314,15 +341,11 @@ static bool test_boundaries(void)
 		results[i] = false;
 
 	/* Init the pool. */
-	if (is_error(poolnum_init(&pool, PORT_MIN, PORT_MAX, 1))) {
+	if (is_error(poolnum_init(&pool, PORT_MIN, PORT_MAX, 1, true))) {
 		kfree(results);
 		return false;
 	}
 
-	/* Fakely advance both pointers, in order to test the wrapping as well. */
-	pool.next = 10;
-	pool.returned = 10;
-
 	/* Test. */
 	for (i = 0; i < PORT_COUNT; i++) {
 		success &= assert_equals_int(0, poolnum_get_any(&pool, &port), "Function result");
@@ -349,12 +372,16 @@ int init_module(void)
 {
 	START_TESTS("Number pool");
 
-	/* BTW, neither of these functions test the randomness of the number order. */
+	/* BTW, none of these functions test the randomness of the number order. */
 	CALL_TEST(test_poolnum_init_function(), "poolnum_init function.");
 	CALL_TEST(test_poolnum_empty_full(), "poolnum_is_empty and poolnum_is_full functions.");
 	CALL_TEST(test_poolnum_get_any_function(), "poolnum_get_any function.");
+	CALL_TEST(test_poolnum_sequential(), "poolnum_get_any function, sequential.");
+	CALL_TEST(test_runs(), "Runs of numbers.");
+	CALL_TEST(test_slices(), "Slices of numbers.");
 	CALL_TEST(test_poolnum_return_function(), "poolnum_return function.");
 	CALL_TEST(test_poolnum_get_function(), "poolnum_get function.");
+	CALL_TEST(test_lazy_bits(), "Bitmap allocated on demand.");
 	CALL_TEST(test_boundaries(), "boundaries test.");
 
 	END_TESTS;
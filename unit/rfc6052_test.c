@@ -1,6 +1,7 @@
 #include <linux/module.h>
 #include <linux/printk.h>
 #include <linux/inet.h>
+#include <linux/ktime.h>
 
 #include "nat64/unit/unit_test.h"
 #include "nat64/comm/types.h"
@@ -72,6 +73,43 @@ static bool test_addr_4to6(struct in_addr *src, struct ipv6_prefix *prefix, stru
 	return success;
 }
 
+#define BENCHMARK_ROUNDS 10000000
+
+/**
+ * Not really a test; it prints how long the /96 fast path and the generic path take to translate
+ * BENCHMARK_ROUNDS addresses back and forth. Only fails if the results differ.
+ */
+static bool benchmark_96(void)
+{
+	struct ipv6_prefix *prefix = &prefixes[5];
+	struct in6_addr addr6;
+	struct in_addr addr4 = ipv4_addr;
+	ktime_t start;
+	s64 fast, generic;
+	int i;
+	bool success = true;
+
+	start = ktime_get();
+	for (i = 0; i < BENCHMARK_ROUNDS; i++) {
+		addr_4to6(&addr4, prefix, &addr6);
+		addr_6to4(&addr6, prefix, &addr4);
+	}
+	fast = ktime_to_ns(ktime_sub(ktime_get(), start));
+	success &= assert_equals_ipv4(&ipv4_addr, &addr4, "Fast path result");
+
+	start = ktime_get();
+	for (i = 0; i < BENCHMARK_ROUNDS; i++) {
+		__addr_4to6(&addr4, prefix, &addr6);
+		__addr_6to4(&addr6, prefix, &addr4);
+	}
+	generic = ktime_to_ns(ktime_sub(ktime_get(), start));
+	success &= assert_equals_ipv4(&ipv4_addr, &addr4, "Generic path result");
+
+	log_info("/96 round trips: %d. Fast path: %lld ns. Generic path: %lld ns.",
+			BENCHMARK_ROUNDS, fast, generic);
+	return success;
+}
+
 static bool init(void)
 {
 	int i;
@@ -119,6 +157,8 @@ int init_module(void)
 				&ipv6_addr[i]);
 	}
 
+	CALL_TEST(benchmark_96(), "/96 benchmark");
+
 	END_TESTS;
 }
 
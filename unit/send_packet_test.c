@@ -204,6 +204,145 @@ static bool divide_skb6_tcp(void)
 	return divide_skb_test(L4PROTO_TCP, create_skb6_tcp_frag);
 }
 
+/**
+ * Returns a copy of "skb" whose first "headlen" bytes are linear and the rest live in a page.
+ */
+static struct sk_buff *create_paged_copy(struct sk_buff *skb, unsigned int headlen)
+{
+	struct sk_buff *paged;
+	struct page *page;
+	unsigned int pagelen = skb->len - headlen;
+
+	if (pagelen > PAGE_SIZE)
+		return NULL;
+
+	paged = alloc_skb(LL_MAX_HEADER + headlen, GFP_ATOMIC);
+	if (!paged)
+		return NULL;
+	page = alloc_page(GFP_ATOMIC);
+	if (!page) {
+		kfree_skb(paged);
+		return NULL;
+	}
+
+	skb_reserve(paged, LL_MAX_HEADER);
+	memcpy(skb_put(paged, headlen), skb->data, headlen);
+	if (skb_copy_bits(skb, headlen, page_address(page), pagelen)) {
+		__free_page(page);
+		kfree_skb(paged);
+		return NULL;
+	}
+	skb_fill_page_desc(paged, 0, page, 0, pagelen);
+	paged->len += pagelen;
+	paged->data_len += pagelen;
+	paged->truesize += PAGE_SIZE;
+
+	skb_reset_network_header(paged);
+	skb_set_transport_header(paged, skb_transport_offset(skb));
+	paged->protocol = skb->protocol;
+	skb_set_jcb(paged, skb_l3_proto(skb), skb_l4_proto(skb),
+			paged->data + ((unsigned char *) skb_payload(skb) - skb->data),
+			(struct frag_hdr *) (ipv6_hdr(paged) + 1), paged);
+
+	return paged;
+}
+
+static bool divide_paged_skb(void)
+{
+	struct sk_buff *linear, *paged;
+	struct sk_buff *skb_l, *skb_p;
+	struct tuple tuple6;
+	bool success = true;
+
+	if (init_ipv6_tuple(&tuple6, "1::1", 6000, "64:ff9b::192.0.2.7", 4000, L4PROTO_UDP) != 0)
+		return false;
+	if (create_skb6_udp_frag(&tuple6, &linear, 3000, sizeof(struct udphdr) + 3000, false, false,
+			0, 32) != 0)
+		return false;
+	linear->next = linear->prev = NULL;
+
+	paged = create_paged_copy(linear, 100);
+	if (!paged) {
+		kfree_skb(linear);
+		return false;
+	}
+
+	if (divide(linear, 1280) != 0 || divide(paged, 1280) != 0) {
+		kfree_skb_queued(linear);
+		kfree_skb_queued(paged);
+		return false;
+	}
+
+	/* The fragments must be the same, except the paged ones must not have copied the payload. */
+	skb_l = linear;
+	skb_p = paged;
+	while (skb_l && skb_p) {
+		success &= assert_equals_int(skb_l->len, skb_p->len, "Fragment length");
+		if (skb_p != paged)
+			success &= assert_true(skb_shinfo(skb_p)->nr_frags > 0, "Payload is shared");
+		if (!assert_equals_int(0, skb_linearize(skb_p), "Linearization"))
+			break;
+		success &= assert_equals_int(0, memcmp(skb_l->data, skb_p->data, skb_l->len),
+				"Fragment contents");
+
+		skb_l = skb_l->next;
+		skb_p = skb_p->next;
+	}
+	success &= assert_null(skb_l, "Linear fragment count");
+	success &= assert_null(skb_p, "Paged fragment count");
+
+	kfree_skb_queued(linear);
+	kfree_skb_queued(paged);
+	return success;
+}
+
+static bool test_route_cache_keys(void)
+{
+	struct dst_entry dst;
+	struct sendpkt_route_cache cache;
+	struct sk_buff *skb;
+	struct iphdr *hdr;
+	struct tuple tuple;
+	bool success = true;
+
+	if (is_error(init_ipv4_tuple(&tuple, "192.0.2.1", 1000, "192.0.2.2", 2000, L4PROTO_UDP)))
+		return false;
+	if (is_error(create_skb4_udp(&tuple, &skb, 100, 32)))
+		return false;
+	hdr = ip_hdr(skb);
+
+	memset(&dst, 0, sizeof(dst));
+	atomic_set(&dst.__refcnt, 1);
+	sendpkt_route_cache_init(&cache);
+
+	success &= assert_false(route_cache_match4(&cache, skb, hdr), "Empty cache");
+
+	route_cache_store4(&cache, skb, hdr, dst_clone(&dst));
+	success &= assert_true(route_cache_match4(&cache, skb, hdr), "Same packet");
+
+	/* Ports are not part of the key; Linux doesn't route based on them. */
+	udp_hdr(skb)->dest = cpu_to_be16(3000);
+	success &= assert_true(route_cache_match4(&cache, skb, hdr), "Other port");
+
+	hdr->tos = 0x10;
+	success &= assert_false(route_cache_match4(&cache, skb, hdr), "Other TOS");
+	hdr->tos = 0;
+
+	skb->mark = 1;
+	success &= assert_false(route_cache_match4(&cache, skb, hdr), "Other mark");
+	skb->mark = 0;
+
+	hdr->daddr = cpu_to_be32(0xc0000203);
+	success &= assert_false(route_cache_match4(&cache, skb, hdr), "Other destination");
+
+	sendpkt_route_cache_flush(&cache);
+	success &= assert_null(cache.dst, "Flushed");
+	success &= assert_equals_int(1, atomic_read(&dst.__refcnt), "Reference returned");
+
+	kfree_skb(skb);
+	return success;
+}
+
 static int send_packet_test_init(void)
 {
 	START_TESTS("Send Packet test");
@@ -211,6 +350,8 @@ static int send_packet_test_init(void)
 	INIT_CALL_END(init(), divide_skb6_udp(), end(), "test_send_packet IPv6 UDP fragmentation");
 	INIT_CALL_END(init(), divide_skb6_icmp(), end(), "test_send_packet IPv6 ICMP fragmentation");
 	INIT_CALL_END(init(), divide_skb6_tcp(), end(), "test_send_packet IPv6 TCP fragmentation");
+	INIT_CALL_END(init(), divide_paged_skb(), end(), "test_send_packet IPv6 paged fragmentation");
+	INIT_CALL_END(init(), test_route_cache_keys(), end(), "Route cache keys");
 
 	END_TESTS;
 }
@@ -1,4 +1,5 @@
 #include <linux/module.h>
+#include <linux/delay.h>
 #include <linux/printk.h>
 
 #include "nat64/unit/session.h"
@@ -15,11 +16,11 @@ MODULE_DESCRIPTION("Session module test.");
 #define TCPTRANS_TIMEOUT msecs_to_jiffies(1000 * TCP_TRANS)
 #define TCPEST_TIMEOUT msecs_to_jiffies(1000 * TCP_EST)
 
-#define SESSION_PRINT_KEY "session [%pI4#%u, %pI4#%u, %pI6c#%u, %pI6c#%u]"
+/* local6 is just remote4 behind the prefix, so it's left out. */
+#define SESSION_PRINT_KEY "session [%pI4#%u, %pI4#%u, %pI6c#%u]"
 #define PRINT_SESSION(session) \
 	&session->remote4.l3, session->remote4.l4, \
 	&session->local4.l3, session->local4.l4, \
-	&session->local6.l3, session->local6.l4, \
 	&session->remote6.l3, session->remote6.l4
 
 static const char* IPV4_ADDRS[] = { "0.0.0.0", "1.1.1.1", "2.2.2.2" };
@@ -29,12 +30,21 @@ static const __u16 IPV6_PORTS[] = { 334, 0, 9556 };
 
 static struct ipv4_transport_addr addr4[ARRAY_SIZE(IPV4_ADDRS)];
 static struct ipv6_transport_addr addr6[ARRAY_SIZE(IPV6_ADDRS)];
+static struct ipv6_prefix pool6_prefix;
 
+/**
+ * The sessions' local6 is not arbitrary; it has to be remote4 behind a pool6 prefix.
+ */
 static struct session_entry *create_session_entry(int remote_id_4, int local_id_4,
-		int local_id_6, int remote_id_6,
-		l4_protocol l4_proto)
+		int remote_id_6, l4_protocol l4_proto)
 {
-	struct session_entry* entry = session_create(&addr6[remote_id_6], &addr6[local_id_6],
+	struct ipv6_transport_addr local6;
+	struct session_entry *entry;
+
+	addr_4to6(&addr4[remote_id_4].l3, &pool6_prefix, &local6.l3);
+	local6.l4 = (l4_proto != L4PROTO_ICMP) ? addr4[remote_id_4].l4 : addr6[remote_id_6].l4;
+
+	entry = session_create(&addr6[remote_id_6], &local6,
 			&addr4[local_id_4], &addr4[remote_id_4],
 			l4_proto, NULL);
 	if (!entry)
@@ -45,13 +55,13 @@ static struct session_entry *create_session_entry(int remote_id_4, int local_id_
 	return entry;
 }
 
-static struct session_entry *create_and_insert_session(int remote4_id, int local4_id, int local6_id,
+static struct session_entry *create_and_insert_session(int remote4_id, int local4_id,
 		int remote6_id)
 {
 	struct session_entry *result;
 	int error;
 
-	result = create_session_entry(remote4_id, local4_id, local6_id, remote6_id, L4PROTO_UDP);
+	result = create_session_entry(remote4_id, local4_id, remote6_id, L4PROTO_UDP);
 	if (!result) {
 		log_err("Could not allocate a session entry.");
 		return NULL;
@@ -69,6 +79,8 @@ static struct session_entry *create_and_insert_session(int remote4_id, int local
 static bool assert_session_entry_equals(struct session_entry* expected,
 		struct session_entry* actual, char* test_name)
 {
+	struct ipv6_transport_addr expected6, actual6;
+
 	if (expected == actual)
 		return true;
 
@@ -83,9 +95,11 @@ static bool assert_session_entry_equals(struct session_entry* expected,
 		return false;
 	}
 
+	session_local6(expected, &expected6);
+	session_local6(actual, &actual6);
 	if (expected->l4_proto != actual->l4_proto
 			|| !ipv6_transport_addr_equals(&expected->remote6, &actual->remote6)
-			|| !ipv6_transport_addr_equals(&expected->local6, &actual->local6)
+			|| !ipv6_transport_addr_equals(&expected6, &actual6)
 			|| !ipv4_transport_addr_equals(&expected->local4, &actual->local4)
 			|| !ipv4_transport_addr_equals(&expected->remote4, &actual->remote4)) {
 		log_err("Test '%s' failed: Expected " SESSION_PRINT_KEY ", got " SESSION_PRINT_KEY ".",
@@ -119,7 +133,7 @@ static bool assert_session(char* test_name, struct session_entry* session,
 		tuple4.l3_proto = L3PROTO_IPV4;
 		tuple4.l4_proto = l4_protos[i];
 
-		tuple6.dst.addr6 = session->local6;
+		session_local6(session, &tuple6.dst.addr6);
 		tuple6.src.addr6 = session->remote6;
 		tuple6.l3_proto = L3PROTO_IPV6;
 		tuple6.l4_proto = l4_protos[i];
@@ -149,9 +163,11 @@ static bool simple_session(void)
 	struct session_entry *session;
 	bool success = true;
 
-	session = create_session_entry(1, 0, 1, 0, L4PROTO_TCP);
+	session = create_session_entry(1, 0, 0, L4PROTO_TCP);
 	if (!assert_not_null(session, "Allocation of test session entry"))
 		return false;
+	success &= assert_equals_u64(0, ((unsigned long) session) % SMP_CACHE_BYTES,
+			"The entry starts a cache line");
 
 	success &= assert_equals_int(0, sessiondb_add(session, SESSIONTIMER_EST),
 			"Session insertion call");
@@ -165,6 +181,9 @@ static bool simple_session(void)
 static bool test_address_filtering_aux(int src_addr_id, int src_port_id, int dst_addr_id,
 		int dst_port_id)
 {
+	/* The session's BIB entry; sessiondb_allow() only needs its IPv6 address. */
+	struct ipv6_host host = { .addr = addr6[0].l3 };
+	struct bib_entry bib = { .host = &host, .port6 = addr6[0].l4, .l4_proto = L4PROTO_UDP };
 	struct tuple tuple4;
 
 	tuple4.src.addr4.l3 = addr4[src_addr_id].l3;
@@ -175,7 +194,7 @@ static bool test_address_filtering_aux(int src_addr_id, int src_port_id, int dst
 	tuple4.l3_proto = L3PROTO_IPV4;
 
 	log_tuple(&tuple4);
-	return sessiondb_allow(&tuple4);
+	return sessiondb_allow(&bib, &tuple4);
 }
 
 static bool test_address_filtering(void)
@@ -184,7 +203,7 @@ static bool test_address_filtering(void)
 	bool success = true;
 
 	/* Init. */
-	session = create_and_insert_session(0, 0, 0, 0);
+	session = create_and_insert_session(0, 0, 0);
 	if (!session)
 		return false;
 
@@ -200,7 +219,7 @@ static bool test_address_filtering(void)
 	success &= assert_false(test_address_filtering_aux(1, 0, 0, 0), "lol6");
 
 	/* Now we erase the session entry */
-	remove(session, &session_table_udp);
+	remove(session, &shards[0].udp);
 	session_return(session);
 	session = NULL;
 
@@ -223,11 +242,721 @@ static bool test_sessiondb_timeouts(void)
 {
 	bool success = true;
 
-	success &= test_sessiondb_timeouts_aux(&expirer_udp, UDP_DEFAULT ,"UDP_timeout");
-	success &= test_sessiondb_timeouts_aux(&expirer_icmp, ICMP_DEFAULT, "ICMP_timeout");
-	success &= test_sessiondb_timeouts_aux(&expirer_tcp_est, TCP_EST, "TCP_EST_timeout");
-	success &= test_sessiondb_timeouts_aux(&expirer_tcp_trans, TCP_TRANS,"TCP_TRANS_timeout");
-	success &= test_sessiondb_timeouts_aux(&expirer_syn, TCP_INCOMING_SYN, "TCP_SYN_timeout");
+	success &= test_sessiondb_timeouts_aux(&shards[0].expirer_udp, UDP_DEFAULT ,"UDP_timeout");
+	success &= test_sessiondb_timeouts_aux(&shards[0].expirer_icmp, ICMP_DEFAULT, "ICMP_timeout");
+	success &= test_sessiondb_timeouts_aux(&shards[0].expirer_tcp_est, TCP_EST, "TCP_EST_timeout");
+	success &= test_sessiondb_timeouts_aux(&shards[0].expirer_tcp_trans, TCP_TRANS,"TCP_TRANS_timeout");
+	success &= test_sessiondb_timeouts_aux(&shards[0].expirer_syn, TCP_INCOMING_SYN, "TCP_SYN_timeout");
+
+	return success;
+}
+
+static int set_udp_class_timeout(__u16 port, unsigned int seconds)
+{
+	__u64 value = ((__u64) port << 32) | (1000 * seconds);
+	return sessiondb_set_config(UDP_CLASS_TIMEOUT, sizeof(value), &value);
+}
+
+static bool test_udp_classes(void)
+{
+	struct session_entry *session;
+	struct expire_timer *class_expirer;
+	bool success = true;
+
+	/* IPV4_PORTS[1] is well-known, IPV4_PORTS[2] is not. */
+	success &= assert_equals_int(0, set_udp_class_timeout(IPV4_PORTS[1], 10), "well-known");
+	success &= assert_equals_int(-EINVAL, set_udp_class_timeout(IPV4_PORTS[2], 10),
+			"too short for a non well-known port");
+	success &= assert_equals_int(0, set_udp_class_timeout(IPV4_PORTS[2], 2 * UDP_MIN),
+			"long enough");
+	success &= assert_equals_int(-EINVAL, set_udp_class_timeout(0, 10), "port zero");
+
+	session = create_and_insert_session(1, 0, 0);
+	if (!session)
+		return false;
+	class_expirer = &get_shard(&session->remote6)->expirer_udp_classes[0];
+	success &= assert_equals_ptr(class_expirer, session->expirer, "first class' session");
+	success &= test_sessiondb_timeouts_aux(class_expirer, 10, "first class' timeout");
+	session_return(session);
+
+	session = create_and_insert_session(2, 1, 1);
+	if (!session)
+		return false;
+	success &= assert_equals_ptr(&get_shard(&session->remote6)->expirer_udp_classes[1],
+			session->expirer, "second class' session");
+	session_return(session);
+
+	/* Removal. The class' lifetime stays for the benefit of the sessions it already has. */
+	success &= assert_equals_int(0, set_udp_class_timeout(IPV4_PORTS[1], 0), "removal");
+	success &= assert_equals_int(-EINVAL, set_udp_class_timeout(IPV4_PORTS[1], 0),
+			"double removal");
+	success &= test_sessiondb_timeouts_aux(class_expirer, 10, "removed class' timeout");
+
+	session = create_and_insert_session(1, 2, 2);
+	if (!session)
+		return false;
+	success &= assert_equals_ptr(&get_shard(&session->remote6)->expirer_udp, session->expirer,
+			"removed class' new session");
+	session_return(session);
+
+	return success;
+}
+
+static int set_tcp_closed_timeout(unsigned int seconds)
+{
+	__u64 value = 1000 * seconds;
+	return sessiondb_set_config(TCP_CLOSED_TIMEOUT, sizeof(value), &value);
+}
+
+static bool test_tcp_closed(void)
+{
+	struct session_entry *session;
+	struct sessiondb_shard *shard;
+	struct expire_timer *expirer;
+	struct sk_buff *skb;
+	bool success = true;
+
+	/* The session has to be in the database, so it can change timers. */
+	session = session_inject_str("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, L4PROTO_TCP, SESSIONTIMER_EST);
+	if (!session)
+		return false;
+	session->state = ESTABLISHED;
+	shard = get_shard(&session->remote6);
+	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, false, true, false)))
+		return false;
+
+	/* Off by default; RST'd sessions are transitory, like RFC 6146 wants. */
+	success &= test_sessiondb_timeouts_aux(&shard->expirer_tcp_closed, TCP_TRANS,
+			"default closed timeout");
+	success &= assert_equals_int(0, tcp_established_state_handle(skb, L3PROTO_IPV4, session,
+			&expirer), "RST result");
+	success &= assert_equals_ptr(&shard->expirer_tcp_trans, session->expirer, "RST, off");
+
+	success &= assert_equals_int(0, set_tcp_closed_timeout(10), "turn on");
+	success &= test_sessiondb_timeouts_aux(&shard->expirer_tcp_closed, 10, "closed timeout");
+
+	session->state = ESTABLISHED;
+	success &= assert_equals_int(0, tcp_established_state_handle(skb, L3PROTO_IPV4, session,
+			&expirer), "RST result, on");
+	success &= assert_equals_u8(TRANS, session->state, "RST state");
+	success &= assert_equals_ptr(&shard->expirer_tcp_closed, session->expirer, "RST, on");
+	kfree_skb(skb);
+
+	session->state = V4_FIN_RCV;
+	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, false, true)))
+		return false;
+	success &= assert_equals_int(0, tcp_v4_fin_rcv_state_handle(skb, L3PROTO_IPV6, session,
+			&expirer), "FIN result");
+	success &= assert_equals_u8(V4_FIN_V6_FIN_RCV, session->state, "FIN state");
+	success &= assert_equals_ptr(&shard->expirer_tcp_closed, session->expirer, "both FINs");
+	kfree_skb(skb);
+
+	/* The sessions which were already closed fall back to the transitory lifetime. */
+	success &= assert_equals_int(0, set_tcp_closed_timeout(0), "turn off");
+	success &= test_sessiondb_timeouts_aux(&shard->expirer_tcp_closed, TCP_TRANS,
+			"closed timeout, off");
+
+	session_return(session);
+	return success;
+}
+
+static bool test_admission_aux(struct session_entry *session, int expected, char *test_name)
+{
+	int error;
+
+	if (!session)
+		return false;
+
+	error = sessiondb_add(session, SESSIONTIMER_UDP);
+	session_return(session);
+	return assert_equals_int(expected, error, test_name);
+}
+
+static bool test_admission(void)
+{
+	struct sessiondb_stats stats;
+	__u64 before, value;
+	bool success = true;
+
+	/* Table limit. */
+	sessiondb_get_stats(&stats);
+	before = stats.rejected_table_full;
+
+	value = 1;
+	if (is_error(sessiondb_set_config(MAX_SESSIONS_UDP, sizeof(value), &value)))
+		return false;
+
+	success &= test_admission_aux(create_session_entry(0, 0, 0, L4PROTO_UDP), 0, "first");
+	success &= test_admission_aux(create_session_entry(1, 1, 1, L4PROTO_UDP), -ENOSPC,
+			"table full");
+	sessiondb_get_stats(&stats);
+	success &= assert_equals_u64(before + 1, stats.rejected_table_full, "table full counter");
+
+	/* Prefix limit. ::1 and ::2 share their /64. */
+	value = 0;
+	if (is_error(sessiondb_set_config(MAX_SESSIONS_UDP, sizeof(value), &value)))
+		return false;
+	value = 1;
+	if (is_error(sessiondb_set_config(MAX_SESSIONS_PER_PREFIX, sizeof(value), &value)))
+		return false;
+
+	success &= test_admission_aux(create_session_entry(1, 1, 1, L4PROTO_UDP), 0,
+			"prefix's first");
+	success &= test_admission_aux(create_session_entry(2, 2, 0, L4PROTO_UDP), -ENOSPC,
+			"prefix full");
+
+	return success;
+}
+
+static bool test_admission_rate(void)
+{
+	struct ipv6_transport_addr addr6;
+	struct sessiondb_stats stats;
+	__u64 before, value;
+	unsigned int i;
+	bool success = true;
+
+	if (is_error(str_to_addr6("2001:db8::1", &addr6.l3)))
+		return false;
+	addr6.l4 = 1234;
+
+	success &= assert_equals_int(0, sessiondb_admit_rate(&addr6), "unlimited");
+
+	sessiondb_get_stats(&stats);
+	before = stats.rejected_prefix_rate;
+
+	/* A second's worth of sessions goes through in one burst, the next one doesn't. */
+	value = 10;
+	if (is_error(sessiondb_set_config(SESSION_RATE_PER_PREFIX, sizeof(value), &value)))
+		return false;
+
+	for (i = 0; i < 10; i++)
+		success &= assert_equals_int(0, sessiondb_admit_rate(&addr6), "burst");
+	success &= assert_equals_int(-ENOSPC, sessiondb_admit_rate(&addr6), "too fast");
+
+	/* Same /64. */
+	addr6.l3.s6_addr32[3] = cpu_to_be32(2);
+	success &= assert_equals_int(-ENOSPC, sessiondb_admit_rate(&addr6), "neighbor");
+
+	sessiondb_get_stats(&stats);
+	success &= assert_equals_u64(before + 2, stats.rejected_prefix_rate, "rate counter");
+
+	/* The allowance is replenished over time. */
+	msleep(200);
+	success &= assert_equals_int(0, sessiondb_admit_rate(&addr6), "replenished");
+
+	return success;
+}
+
+/**
+ * Waits until the purger has gone through every queued job.
+ */
+static void wait_for_purges(void)
+{
+	do {
+		flush_work(&purge_work);
+	} while (!list_empty(&purge_jobs));
+}
+
+static bool test_purge(void)
+{
+	struct session_entry *s1, *s2, *s3;
+	struct sessiondb_stats stats;
+	__u64 before, count;
+	bool success = true;
+
+	sessiondb_get_stats(&stats);
+	before = stats.sessions_purged;
+
+	s1 = create_and_insert_session(0, 1, 0);
+	s2 = create_and_insert_session(1, 1, 1);
+	s3 = create_and_insert_session(2, 2, 2);
+	if (!s1 || !s2 || !s3)
+		return false;
+
+	success &= assert_equals_int(0, sessiondb_delete_by_ipv4(&addr4[1].l3), "delete result");
+	wait_for_purges();
+
+	success &= assert_equals_int(0, sessiondb_count(L4PROTO_UDP, &count), "count 1 result");
+	success &= assert_equals_u64(1, count, "count after delete");
+	success &= assert_true(!session_is_dying(s3), "survivor is alive");
+
+	success &= assert_equals_int(0, sessiondb_flush(), "flush result");
+	wait_for_purges();
+
+	success &= assert_equals_int(0, sessiondb_count(L4PROTO_UDP, &count), "count 2 result");
+	success &= assert_equals_u64(0, count, "count after flush");
+
+	sessiondb_get_stats(&stats);
+	success &= assert_equals_u64(0, stats.purges_pending, "pending purges");
+	success &= assert_equals_u64(before + 3, stats.sessions_purged, "purged sessions");
+
+	session_return(s1);
+	session_return(s2);
+	session_return(s3);
+	return success;
+}
+
+static bool assert_purge_prefix(char *prefix_str, __u8 len, __u64 expected, char *test_name)
+{
+	struct ipv6_prefix prefix;
+	__u64 count;
+	bool success = true;
+
+	if (is_error(str_to_addr6(prefix_str, &prefix.address)))
+		return false;
+	prefix.len = len;
+
+	success &= assert_equals_int(0, sessiondb_delete_by_ipv6_prefix(&prefix), test_name);
+	wait_for_purges();
+	success &= assert_equals_int(0, sessiondb_count(L4PROTO_UDP, &count), test_name);
+	success &= assert_equals_u64(expected, count, test_name);
+
+	return success;
+}
+
+static bool test_purge_prefix(void)
+{
+	static const char *prefixes[] = { "64:ff9b::", "2001:db8::", "2001:db8:1::" };
+	struct session_entry *sessions[3][3];
+	unsigned int p, r;
+	bool success = true;
+
+	/* Three sessions per pool6 prefix; the ones in the middle of the tree go first. */
+	for (p = 0; p < 3; p++) {
+		if (is_error(str_to_addr6(prefixes[p], &pool6_prefix.address)))
+			return false;
+		for (r = 0; r < 3; r++) {
+			sessions[p][r] = create_and_insert_session(r, p, r);
+			if (!sessions[p][r])
+				return false;
+		}
+	}
+	if (is_error(str_to_addr6(prefixes[0], &pool6_prefix.address)))
+		return false;
+
+	/* The /64 contains the second /96, but not the third one. */
+	success &= assert_purge_prefix("2001:db8::", 64, 6, "containing prefix");
+	for (r = 0; r < 3; r++) {
+		success &= assert_null(sessions[1][r]->expirer, "victim is removed");
+		success &= assert_not_null(sessions[2][r]->expirer, "neighbor survives");
+	}
+
+	/* Contained by the first /96, so the addresses have to be compared. */
+	success &= assert_purge_prefix("64:ff9b::101:100", 120, 5, "contained prefix");
+	success &= assert_null(sessions[0][1]->expirer, "1.1.1.1 is removed");
+	success &= assert_not_null(sessions[0][2]->expirer, "2.2.2.2 survives");
+
+	/* Nothing was ever built with this one. */
+	success &= assert_purge_prefix("2001:db8:2::", 96, 5, "unrelated prefix");
+
+	success &= assert_equals_int(0, sessiondb_flush(), "flush result");
+	wait_for_purges();
+	for (p = 0; p < 3; p++)
+		for (r = 0; r < 3; r++)
+			session_return(sessions[p][r]);
+	return success;
+}
+
+static bool flow_cache_has(bool ipv6, struct session_entry *session)
+{
+	struct flow_slot *slot;
+	struct ipv6_transport_addr local6;
+	bool result;
+
+	session_local6(session, &local6);
+	rcu_read_lock_bh();
+	slot = ipv6
+			? flowcache_slot(true, hash6_slot(&local6, &session->remote6))
+			: flowcache_slot(false, hash4_slot(&session->remote4, &session->local4));
+	result = (READ_ONCE(slot->session) == session);
+	rcu_read_unlock_bh();
+
+	return result;
+}
+
+static bool assert_cached_get(struct tuple *tuple, struct session_entry *expected, char *test_name)
+{
+	struct session_entry *session = NULL;
+	bool success = true;
+
+	success &= assert_equals_int(expected ? 0 : -ENOENT, sessiondb_get(tuple, &session),
+			test_name);
+	success &= assert_session_entry_equals(expected, session, test_name);
+	if (session)
+		session_return(session);
+
+	return success;
+}
+
+static bool test_flow_cache(void)
+{
+	struct session_entry *session;
+	struct tuple tuple6, tuple4;
+	bool success = true;
+
+	session = create_and_insert_session(0, 0, 0);
+	if (!session)
+		return false;
+
+	tuple6.src.addr6 = session->remote6;
+	session_local6(session, &tuple6.dst.addr6);
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = L4PROTO_UDP;
+	tuple4.src.addr4 = session->remote4;
+	tuple4.dst.addr4 = session->local4;
+	tuple4.l3_proto = L3PROTO_IPV4;
+	tuple4.l4_proto = L4PROTO_UDP;
+
+	/* The first lookups populate the caches, the second ones are served by them. */
+	success &= assert_cached_get(&tuple6, session, "IPv6 miss");
+	success &= assert_true(flow_cache_has(true, session), "IPv6 slot filled");
+	success &= assert_cached_get(&tuple6, session, "IPv6 hit");
+	success &= assert_cached_get(&tuple4, session, "IPv4 miss");
+	success &= assert_true(flow_cache_has(false, session), "IPv4 slot filled");
+	success &= assert_cached_get(&tuple4, session, "IPv4 hit");
+
+	/* Same addresses, other table. */
+	tuple6.l4_proto = L4PROTO_TCP;
+	tuple4.l4_proto = L4PROTO_TCP;
+	success &= assert_cached_get(&tuple6, NULL, "IPv6 wrong protocol");
+	success &= assert_cached_get(&tuple4, NULL, "IPv4 wrong protocol");
+	tuple6.l4_proto = L4PROTO_UDP;
+	tuple4.l4_proto = L4PROTO_UDP;
+
+	/* Removing the session has to invalidate the slots. */
+	success &= assert_equals_int(0, sessiondb_flush(), "flush result");
+	wait_for_purges();
+	success &= assert_false(flow_cache_has(true, session), "IPv6 slot emptied");
+	success &= assert_false(flow_cache_has(false, session), "IPv4 slot emptied");
+	success &= assert_cached_get(&tuple6, NULL, "IPv6 after removal");
+	success &= assert_cached_get(&tuple4, NULL, "IPv4 after removal");
+
+	session_return(session);
+	return success;
+}
+
+static bool test_grow(void)
+{
+	struct session_table *table = &shards[0].udp;
+	struct session_entry *session;
+	struct tuple tuple6, tuple4;
+	unsigned int size;
+	bool success = true;
+
+	session = create_and_insert_session(0, 0, 0);
+	if (!session)
+		return false;
+
+	tuple6.src.addr6 = session->remote6;
+	session_local6(session, &tuple6.dst.addr6);
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = L4PROTO_UDP;
+	tuple4.src.addr4 = session->remote4;
+	tuple4.dst.addr4 = session->local4;
+	tuple4.l3_proto = L3PROTO_IPV4;
+	tuple4.l4_proto = L4PROTO_UDP;
+
+	/* Pretend hash_add() found the table too loaded. */
+	size = rcu_dereference_protected(table->index, 1)->mask + 1;
+	table->grow_at = 0;
+	grow_table(table, shards[0].node);
+
+	success &= assert_equals_u32(2 * size, rcu_dereference_protected(table->index, 1)->mask + 1,
+			"Index doubled");
+	success &= assert_equals_u32(2, table->rehashes, "Rehash finished");
+	success &= assert_true(table->grow_at != 0, "Next growth scheduled");
+	success &= assert_cached_get(&tuple6, session, "IPv6 lookup after growth");
+	success &= assert_cached_get(&tuple4, session, "IPv4 lookup after growth");
+
+	session_return(session);
+	return success;
+}
+
+static bool assert_counters(struct session_entry *session, __u64 packets, __u64 bytes,
+		char *test_name)
+{
+	__u64 actual_packets, actual_bytes;
+	bool success = true;
+
+	session_get_counters(session, &actual_packets, &actual_bytes);
+	success &= assert_equals_u64(packets, actual_packets, test_name);
+	success &= assert_equals_u64(bytes, actual_bytes, test_name);
+	return success;
+}
+
+static bool test_counters(void)
+{
+	struct session_entry *s1, *s2;
+	bool success = true;
+
+	s1 = create_and_insert_session(0, 0, 0);
+	s2 = create_and_insert_session(1, 1, 1);
+	if (!s1 || !s2)
+		return false;
+
+	success &= assert_counters(s1, 0, 0, "fresh");
+
+	session_count(s1, 100);
+	session_count(s1, 200);
+	session_count(s2, 1000);
+	success &= assert_counters(s1, 2, 300, "pending");
+	success &= assert_counters(s2, 1, 1000, "other session");
+
+	/* Overflowing the slot's byte counter forces a flush; nothing should be lost. */
+	session_count(s1, U32_MAX - 250);
+	success &= assert_counters(s1, 3, 300ULL + U32_MAX - 250, "flushed");
+
+	/* Removal flushes the remaining deltas and forgets the session. */
+	success &= assert_equals_int(0, sessiondb_flush(), "flush result");
+	wait_for_purges();
+	success &= assert_counters(s1, 3, 300ULL + U32_MAX - 250, "removed");
+	success &= assert_equals_u64(3, atomic64_read(&session_counters(s1)->packets),
+			"totals after removal");
+	session_count(s1, 1);
+	success &= assert_counters(s1, 4, 301ULL + U32_MAX - 250, "counted after removal");
+	success &= assert_equals_u64(4, atomic64_read(&session_counters(s1)->packets),
+			"removed sessions are not cached");
+
+	session_return(s1);
+	session_return(s2);
+	return success;
+}
+
+static bool test_occupancy(void)
+{
+	struct session_entry *s1, *s2, *s3;
+	struct occupancy_usr occupancy;
+	unsigned int i;
+	bool success = true;
+
+	/* The three remote IPv6 addresses belong to the same /64. */
+	s1 = create_and_insert_session(0, 1, 0);
+	s2 = create_and_insert_session(1, 1, 1);
+	s3 = create_and_insert_session(2, 2, 2);
+	if (!s1 || !s2 || !s3)
+		return false;
+
+	sessiondb_get_occupancy(&occupancy);
+	success &= assert_equals_u64(3, occupancy.sessions[L4PROTO_UDP], "session count");
+	success &= assert_equals_u64(0, occupancy.sessions[L4PROTO_TCP], "TCP session count");
+	success &= assert_equals_int(64, occupancy.prefix_len, "prefix length");
+	success &= assert_equals_u64(0, occupancy.prefixes[1], "prefixes with 1 session");
+	success &= assert_equals_u64(1, occupancy.prefixes[2], "prefixes with 2-3 sessions");
+	success &= assert_equals_u64(3, occupancy.ages[L4PROTO_UDP][0], "young sessions");
+	success &= assert_equals_u64(0, occupancy.ages[L4PROTO_UDP][1], "older sessions");
+
+	success &= assert_equals_int(0, sessiondb_flush(), "flush result");
+	wait_for_purges();
+	session_return(s1);
+	session_return(s2);
+	session_return(s3);
+	rcu_barrier_bh(); /* The counters are refunded when the sessions are freed. */
+
+	sessiondb_get_occupancy(&occupancy);
+	success &= assert_equals_u64(0, occupancy.sessions[L4PROTO_UDP], "count after flush");
+	for (i = 0; i < OCCUPANCY_PREFIX_BUCKETS; i++)
+		success &= assert_equals_u64(0, occupancy.prefixes[i], "prefixes after flush");
+	success &= assert_equals_u64(0, occupancy.ages[L4PROTO_UDP][0], "ages after flush");
+
+	return success;
+}
+
+static struct session_entry *create_and_insert_tcp(int id, u_int8_t state,
+		enum session_timer_type timer)
+{
+	struct session_entry *session;
+
+	session = create_session_entry(id, 1, id, L4PROTO_TCP);
+	if (!session)
+		return NULL;
+	session->state = state;
+	if (is_error(sessiondb_add(session, timer))) {
+		session_return(session);
+		return NULL;
+	}
+
+	return session;
+}
+
+static bool test_shrink(void)
+{
+	struct session_entry *udp1, *udp2, *est, *trans;
+	bool success = true;
+
+	udp1 = create_and_insert_session(0, 1, 0);
+	udp2 = create_and_insert_session(1, 1, 1);
+	est = create_and_insert_tcp(0, ESTABLISHED, SESSIONTIMER_EST);
+	trans = create_and_insert_tcp(1, TRANS, SESSIONTIMER_TRANS);
+	if (!udp1 || !udp2 || !est || !trans)
+		return false;
+
+	success &= assert_equals_u64(4, count_shrinkable(), "shrinkable count");
+
+	/* UDP goes first. */
+	success &= assert_equals_u64(1, shrink_sessions(1), "first shrink");
+	success &= assert_equals_u64(1, count_sessions(L4PROTO_UDP), "UDP after the first shrink");
+	success &= assert_equals_u64(2, count_sessions(L4PROTO_TCP), "TCP after the first shrink");
+	success &= assert_equals_u64(2, shrink_sessions(2), "second shrink");
+	success &= assert_equals_u64(0, count_sessions(L4PROTO_UDP), "UDP after the second shrink");
+	success &= assert_equals_u64(1, count_sessions(L4PROTO_TCP), "TCP after the second shrink");
+	success &= assert_equals_u8(CLOSED, trans->state, "the victim is the transitory session");
+
+	/* Established sessions stay. */
+	success &= assert_equals_u64(0, shrink_sessions(16), "third shrink");
+	success &= assert_equals_u64(1, count_sessions(L4PROTO_TCP), "TCP after the third shrink");
+	success &= assert_equals_u64(3, atomic64_read(&sessions_shrunk), "shrunk counter");
+
+	session_return(udp1);
+	session_return(udp2);
+	session_return(est);
+	session_return(trans);
+	return success;
+}
+
+static struct session_entry *create_and_insert_icmp(int remote4_id, int remote6_id)
+{
+	struct session_entry *result;
+
+	result = create_session_entry(remote4_id, 1, remote6_id, L4PROTO_ICMP);
+	if (!result)
+		return NULL;
+	if (sessiondb_add(result, SESSIONTIMER_ICMP)) {
+		session_return(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static bool test_slots(void)
+{
+	struct session_entry *idle, *busy, *gone;
+	struct session_entry **entry;
+	struct expiry_slot *slot, *busy_slot;
+	struct session_table *table;
+	__u64 ttl = jiffies_to_msecs(MIN_TIMER_SLEEP);
+	unsigned int i;
+	bool success = true;
+
+	/* Short enough for the test to wait it out, and for the wheel to use its finest slots. */
+	if (is_error(sessiondb_set_config(ICMP_TIMEOUT, sizeof(ttl), &ttl)))
+		return false;
+
+	idle = create_and_insert_icmp(0, 0);
+	busy = create_and_insert_icmp(1, 1);
+	gone = create_and_insert_icmp(2, 2);
+	if (!idle || !busy || !gone)
+		return false;
+	table = &get_shard(&gone->remote6)->icmp;
+
+	success &= assert_equals_ptr(idle, *idle->slot_entry, "the slot entry points back");
+	busy_slot = entry_chunk(busy->slot_entry)->slot;
+
+	/* Leaving only punches a hole in the slot. */
+	entry = gone->slot_entry;
+	slot = entry_chunk(entry)->slot;
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	i = slot->count;
+	table->count -= remove(gone, table);
+	success &= assert_null(*entry, "hole");
+	success &= assert_equals_u32(i - 1, slot->count, "slot count after the removal");
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	/*
+	 * Let the real sweep loose; "busy" keeps getting refreshed the way the packet path does it
+	 * (without touching its slot), "idle" doesn't.
+	 */
+	for (i = 0; i < 24; i++) {
+		WRITE_ONCE(busy->update_time, jiffies);
+		msleep(jiffies_to_msecs(MIN_TIMER_SLEEP / 4));
+	}
+
+	jool_lock_bh(&table->lock, JLOCK_SESSION);
+	success &= assert_null(idle->expirer, "the idle session expired");
+	success &= assert_not_null(busy->expirer, "the busy session survived");
+	if (busy->expirer) {
+		success &= assert_equals_ptr(busy, *busy->slot_entry, "the busy one is queued");
+		success &= assert_true(entry_chunk(busy->slot_entry)->slot != busy_slot,
+				"in a later slot");
+	}
+	jool_unlock_bh(&table->lock, JLOCK_SESSION);
+
+	session_return(idle);
+	session_return(busy);
+	session_return(gone);
+	return success;
+}
+
+static bool test_timer_slack(void)
+{
+	__u64 slack_ms = 100;
+	unsigned long slack = msecs_to_jiffies(slack_ms);
+	unsigned long now = jiffies;
+	unsigned long coalesced;
+	unsigned int i;
+	bool success = true;
+
+	if (is_error(sessiondb_set_config(TIMER_SLACK, sizeof(slack_ms), &slack_ms)))
+		return false;
+
+	for (i = 0; i < 3 * slack; i += 7) {
+		coalesced = coalesce_expiry(now + i);
+		success &= assert_equals_ulong(0, coalesced % slack, "aligned");
+		success &= assert_true(time_after_eq(coalesced, now + i), "not early");
+		success &= assert_true(time_before(coalesced, now + i + slack), "within the slack");
+	}
+	now = coalesce_expiry(now);
+	success &= assert_equals_ulong(now + slack, coalesce_expiry(now + 1), "next tick");
+	success &= assert_equals_ulong(now + slack, coalesce_expiry(now + slack - 1),
+			"shared wakeup");
+	coalesced = coalesce_expiry(ULONG_MAX - 1);
+	success &= assert_true(time_after_eq(coalesced, ULONG_MAX - 1), "jiffies wraparound");
+
+	slack_ms = 0;
+	if (is_error(sessiondb_set_config(TIMER_SLACK, sizeof(slack_ms), &slack_ms)))
+		return false;
+	success &= assert_equals_ulong(now + 3, coalesce_expiry(now + 3), "no slack");
+
+	return success;
+}
+
+static bool test_local6(void)
+{
+	struct session_entry *s96, *s64;
+	struct ipv6_transport_addr local6;
+	bool success = true;
+
+	s96 = session_create_str("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, L4PROTO_UDP);
+	/* The u octet (bits 64-71) is skipped. */
+	s64 = session_create_str("1::2", 1212, "2001:db8::8:706:500:0", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, L4PROTO_UDP);
+	if (!s96 || !s64)
+		return false;
+
+	session_local6(s96, &local6);
+	success &= assert_equals_ipv6_str("64:ff9b::807:605", &local6.l3, "/96 address");
+	success &= assert_equals_u16(8765, local6.l4, "/96 port");
+	session_local6(s64, &local6);
+	success &= assert_equals_ipv6_str("2001:db8::8:706:500:0", &local6.l3, "/64 address");
+	success &= assert_equals_u16(8765, local6.l4, "/64 port");
+	success &= assert_equals_u32(2, local6_prefix_count, "prefix count");
+	session_return(s96);
+	session_return(s64);
+
+	s96 = session_create_str("1::3", 1313, "64:ff9b::102:304", 80, "5.6.7.8", 5679,
+			"1.2.3.4", 80, L4PROTO_TCP);
+	if (!s96)
+		return false;
+	success &= assert_equals_u32(2, local6_prefix_count, "known prefix is reused");
+	session_return(s96);
+
+	success &= assert_null(session_create_str("1::2", 1212, "2001:db8::1", 8765,
+			"5.6.7.8", 5678, "8.7.6.5", 8765, L4PROTO_UDP), "not an embedded address");
+	success &= assert_null(session_create_str("1::2", 1212, "64:ff9b::807:605", 80,
+			"5.6.7.8", 5678, "8.7.6.5", 8765, L4PROTO_UDP), "port mismatch");
 
 	return success;
 }
@@ -300,6 +1029,89 @@ static bool test_compare_session4(void)
 	return success;
 }
 
+struct iterate_args {
+	struct session_entry *sessions[4];
+	unsigned int count;
+};
+
+static int collect_session(struct session_entry *session, void *arg)
+{
+	struct iterate_args *args = arg;
+
+	if (args->count < ARRAY_SIZE(args->sessions))
+		args->sessions[args->count] = session;
+	args->count++;
+	return 0;
+}
+
+static bool assert_iteration(struct session_filter *filter, struct ipv4_transport_addr *local4,
+		struct ipv4_transport_addr *remote4, struct session_entry *expected0,
+		struct session_entry *expected1, unsigned int expected_count, char *test_name)
+{
+	struct iterate_args args = { .count = 0 };
+	struct ipv4_transport_addr zero4;
+	bool starting = !local4;
+	bool success = true;
+
+	if (starting) {
+		/* Iterate from the beginning; the addresses are ignored. */
+		memset(&zero4, 0, sizeof(zero4));
+		local4 = &zero4;
+		remote4 = &zero4;
+	}
+
+	success &= assert_equals_int(0, sessiondb_iterate_by_ipv4(L4PROTO_UDP, filter, local4,
+			remote4, starting, collect_session, &args), test_name);
+	success &= assert_equals_int(expected_count, args.count, test_name);
+	if (expected_count > 0)
+		success &= assert_equals_ptr(expected0, args.sessions[0], test_name);
+	if (expected_count > 1)
+		success &= assert_equals_ptr(expected1, args.sessions[1], test_name);
+
+	return success;
+}
+
+static bool test_filtered_iteration(void)
+{
+	struct session_entry *s1, *s2, *s3;
+	struct session_filter filter;
+	bool success = true;
+
+	s1 = create_and_insert_session(0, 1, 0);
+	s2 = create_and_insert_session(2, 1, 1);
+	s3 = create_and_insert_session(1, 2, 2);
+	if (!s1 || !s2 || !s3)
+		return false;
+
+	memset(&filter, 0, sizeof(filter));
+	success &= assert_iteration(&filter, NULL, NULL, s1, s2, 3, "no filter");
+	success &= assert_iteration(NULL, &addr4[1], &addr4[0], s2, s3, 2, "resume");
+
+	filter.flags = SFILTER_ADDR4;
+	filter.addr4 = addr4[1].l3;
+	success &= assert_iteration(&filter, NULL, NULL, s1, s2, 2, "address");
+	success &= assert_iteration(&filter, &addr4[1], &addr4[0], s2, NULL, 1, "address resume");
+
+	filter.flags |= SFILTER_PORTS;
+	filter.port_min = addr4[1].l4 + 1;
+	filter.port_max = 65535;
+	success &= assert_iteration(&filter, NULL, NULL, NULL, NULL, 0, "ports");
+
+	filter.flags = SFILTER_PREFIX6;
+	filter.prefix6.address = addr6[1].l3;
+	filter.prefix6.len = 128;
+	success &= assert_iteration(&filter, NULL, NULL, s2, NULL, 1, "prefix");
+
+	filter.flags = SFILTER_IDLE;
+	filter.min_idle = 60 * 60 * 1000;
+	success &= assert_iteration(&filter, NULL, NULL, NULL, NULL, 0, "idle");
+
+	session_return(s1);
+	session_return(s2);
+	session_return(s3);
+	return success;
+}
+
 /*
  * A V6 SYN packet arrives.
  */
@@ -312,8 +1124,8 @@ static bool test_tcp_v4_init_state_handle_v6syn(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V4_INIT);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V4_INIT);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, true, false, false))) {
@@ -344,8 +1156,8 @@ static bool test_tcp_v4_init_state_handle_else(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V4_INIT);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V4_INIT);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, true, false)))
@@ -371,8 +1183,8 @@ static bool test_tcp_v6_init_state_handle_v4syn(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V6_INIT);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V6_INIT);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, true, false, false)))
@@ -400,8 +1212,8 @@ static bool test_tcp_v6_init_state_handle_v6syn(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V6_INIT);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V6_INIT);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, true, false, false)))
@@ -428,8 +1240,8 @@ static bool test_tcp_v6_init_state_handle_else(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V6_INIT);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V6_INIT);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, true, false)))
@@ -454,8 +1266,8 @@ static bool test_tcp_established_state_handle_v4fin(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			ESTABLISHED);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, ESTABLISHED);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, false, false, true)))
@@ -481,8 +1293,8 @@ static bool test_tcp_established_state_handle_v6fin(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			ESTABLISHED);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, ESTABLISHED);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, false, true)))
@@ -509,8 +1321,8 @@ static bool test_tcp_established_state_handle_v4rst(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			ESTABLISHED);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, ESTABLISHED);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, true, false)))
@@ -538,8 +1350,8 @@ static bool test_tcp_established_state_handle_v6rst(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			ESTABLISHED);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, ESTABLISHED);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, true, false)))
@@ -567,8 +1379,8 @@ static bool test_tcp_established_state_handle_else(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			ESTABLISHED);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, ESTABLISHED);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, true, false, false)))
@@ -596,8 +1408,8 @@ static bool test_tcp_v4_fin_rcv_state_handle_v6fin(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V4_FIN_RCV);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V4_FIN_RCV);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, false, true)))
@@ -625,8 +1437,8 @@ static bool test_tcp_v4_fin_rcv_state_handle_else(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V4_FIN_RCV);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V4_FIN_RCV);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, true, false, false)))
@@ -654,8 +1466,8 @@ static bool test_tcp_v6_fin_rcv_state_handle_v4fin(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V6_FIN_RCV);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V6_FIN_RCV);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, false, false, true)))
@@ -683,8 +1495,8 @@ static bool test_tcp_v6_fin_rcv_state_handle_else(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			V6_FIN_RCV);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, V6_FIN_RCV);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, true, false, false)))
@@ -711,8 +1523,8 @@ static bool test_tcp_trans_state_handle_v4rst(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			TRANS);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, TRANS);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, false, true, false)))
@@ -738,8 +1550,8 @@ static bool test_tcp_trans_state_handle_v6rst(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			TRANS);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, TRANS);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV6, false, true, false)))
@@ -766,8 +1578,8 @@ static bool test_tcp_trans_state_handle_else(void)
 	bool success = true;
 
 	/* Prepare */
-	session = session_create_str_tcp("1::2", 1212, "3::4", 3434, "5.6.7.8", 5678, "8.7.6.5", 8765,
-			TRANS);
+	session = session_create_str_tcp("1::2", 1212, "64:ff9b::807:605", 8765, "5.6.7.8", 5678,
+			"8.7.6.5", 8765, TRANS);
 	if (!session)
 		return false;
 	if (is_error(create_tcp_packet(&skb, L3PROTO_IPV4, true, false, false)))
@@ -783,7 +1595,66 @@ static bool test_tcp_trans_state_handle_else(void)
 	return success;
 }
 
-static bool init(void)
+static bool test_tcp_state_stays_aux(l3_protocol l3_proto, bool syn, bool rst, bool fin,
+		u_int8_t state, bool expected, bool expected_refresh, char *test_name)
+{
+	struct sk_buff *skb;
+	bool refresh;
+	bool success = true;
+
+	if (is_error(create_tcp_packet(&skb, l3_proto, syn, rst, fin)))
+		return false;
+
+	success &= assert_equals_int(expected, tcp_state_stays(skb, l3_proto, state, &refresh),
+			test_name);
+	if (expected)
+		success &= assert_equals_int(expected_refresh, refresh, test_name);
+
+	kfree_skb(skb);
+	return success;
+}
+
+/*
+ * tcp_state_stays() has to agree with the tcp_*_state_handle() functions, or the lockless path
+ * will skip transitions.
+ */
+static bool test_tcp_state_stays(void)
+{
+	bool success = true;
+
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV6, true, false, false, V4_INIT, false, false,
+			"V4 INIT, V6 SYN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, true, false, false, V4_INIT, true, false,
+			"V4 INIT, V4 SYN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV6, true, false, false, V6_INIT, false, false,
+			"V6 INIT, V6 SYN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, false, false, V6_INIT, true, false,
+			"V6 INIT, V4 else");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, false, false, ESTABLISHED, true,
+			true, "EST, V4 else");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV6, false, false, true, ESTABLISHED, false,
+			false, "EST, V6 FIN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, true, false, ESTABLISHED, false,
+			false, "EST, V4 RST");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, false, true, V4_FIN_RCV, true,
+			true, "V4 FIN RCV, V4 FIN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV6, false, false, true, V4_FIN_RCV, false,
+			false, "V4 FIN RCV, V6 FIN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, false, true, V6_FIN_RCV, false,
+			false, "V6 FIN RCV, V4 FIN");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV6, false, true, false, V4_FIN_V6_FIN_RCV,
+			true, false, "V4 FIN V6 FIN RCV, V6 RST");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, true, false, TRANS, true, false,
+			"TRANS, V4 RST");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, false, false, TRANS, false, false,
+			"TRANS, V4 else");
+	success &= test_tcp_state_stays_aux(L3PROTO_IPV4, false, false, false, CLOSED, false, false,
+			"CLOSED");
+
+	return success;
+}
+
+static bool init_aux(bool flow_cache, bool counters)
 {
 	int i;
 
@@ -799,7 +1670,11 @@ static bool init(void)
 		addr6[i].l4 = IPV6_PORTS[i];
 	}
 
-	if (is_error(sessiondb_init()))
+	if (is_error(str_to_addr6("64:ff9b::", &pool6_prefix.address)))
+		return false;
+	pool6_prefix.len = 96;
+
+	if (is_error(sessiondb_init(1, 0, flow_cache, counters, false)))
 		return false;
 	if (is_error(pktqueue_init()))
 		return false;
@@ -807,6 +1682,21 @@ static bool init(void)
 	return true;
 }
 
+static bool init(void)
+{
+	return init_aux(false, false);
+}
+
+static bool init_flow_cache(void)
+{
+	return init_aux(true, false);
+}
+
+static bool init_counters(void)
+{
+	return init_aux(false, true);
+}
+
 static void end(void)
 {
 	sessiondb_destroy();
@@ -820,7 +1710,22 @@ int init_module(void)
 	INIT_CALL_END(init(), simple_session(), end(), "Single Session");
 	INIT_CALL_END(init(), test_address_filtering(), end(), "Address-dependent filtering.");
 	INIT_CALL_END(init(), test_sessiondb_timeouts(), end(), "Session config timeouts");
+	INIT_CALL_END(init(), test_udp_classes(), end(), "UDP timeouts by port");
+	INIT_CALL_END(init(), test_tcp_closed(), end(), "Closed TCP timeout");
 	INIT_CALL_END(init(), test_compare_session4(), end(), "compare_session4()");
+	INIT_CALL_END(init(), test_admission(), end(), "Admission control");
+	INIT_CALL_END(init(), test_admission_rate(), end(), "Admission rate");
+	INIT_CALL_END(init(), test_purge(), end(), "Purges");
+	INIT_CALL_END(init(), test_purge_prefix(), end(), "Purges by IPv6 prefix");
+	INIT_CALL_END(init(), test_filtered_iteration(), end(), "Filtered iteration");
+	INIT_CALL_END(init(), test_occupancy(), end(), "Occupancy counters");
+	INIT_CALL_END(init(), test_shrink(), end(), "Shrinker");
+	INIT_CALL_END(init(), test_slots(), end(), "Expiry slots");
+	INIT_CALL_END(init(), test_timer_slack(), end(), "Timer slack");
+	INIT_CALL_END(init(), test_local6(), end(), "Derived local6");
+	INIT_CALL_END(init_flow_cache(), test_flow_cache(), end(), "Flow cache");
+	INIT_CALL_END(init_counters(), test_counters(), end(), "Traffic counters");
+	INIT_CALL_END(init(), test_grow(), end(), "Index growth");
 
 	INIT_CALL_END(init(), test_tcp_v4_init_state_handle_v6syn(), end(), "TCP-V4 INIT-V6 syn");
 	INIT_CALL_END(init(), test_tcp_v4_init_state_handle_else(), end(), "TCP-V4 INIT-else");
@@ -839,6 +1744,7 @@ int init_module(void)
 	INIT_CALL_END(init(), test_tcp_trans_state_handle_v6rst(), end(), "TCP-TRANS-V6 rst");
 	INIT_CALL_END(init(), test_tcp_trans_state_handle_v4rst(), end(), "TCP-TRANS-V4 rst");
 	INIT_CALL_END(init(), test_tcp_trans_state_handle_else(), end(), "TCP-TRANS-else");
+	INIT_CALL_END(init(), test_tcp_state_stays(), end(), "TCP lockless path");
 
 	END_TESTS;
 }
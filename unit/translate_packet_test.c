@@ -1,5 +1,7 @@
 #include <linux/module.h>
 #include <linux/printk.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
 
 #include "nat64/unit/unit_test.h"
 #include "nat64/comm/str_utils.h"
@@ -224,19 +226,26 @@ static bool test_function_icmp4_to_icmp6_param_prob(void)
 static bool test_function_generate_ipv4_id_nofrag(void)
 {
 	struct ipv6hdr hdr;
+	struct tuple tuple4;
 	__be16 attempt_1, attempt_2, attempt_3;
 	bool success = true;
 
+	memset(&tuple4, 0, sizeof(tuple4));
+	tuple4.l3_proto = L3PROTO_IPV4;
+	tuple4.l4_proto = L4PROTO_UDP;
+
 	hdr.payload_len = cpu_to_be16(4); /* packet length is 44. */
-	success &= assert_equals_be16(0, generate_ipv4_id_nofrag(&hdr), "Length < 88 bytes");
+	success &= assert_equals_be16(0, generate_ipv4_id_nofrag(&tuple4, &hdr),
+			"Length < 88 bytes");
 
 	hdr.payload_len = cpu_to_be16(48); /* packet length is 88. */
-	success &= assert_equals_be16(0, generate_ipv4_id_nofrag(&hdr), "Length = 88 bytes");
+	success &= assert_equals_be16(0, generate_ipv4_id_nofrag(&tuple4, &hdr),
+			"Length = 88 bytes");
 
 	hdr.payload_len = cpu_to_be16(500); /* packet length is 540. */
-	attempt_1 = generate_ipv4_id_nofrag(&hdr);
-	attempt_2 = generate_ipv4_id_nofrag(&hdr);
-	attempt_3 = generate_ipv4_id_nofrag(&hdr);
+	attempt_1 = generate_ipv4_id_nofrag(&tuple4, &hdr);
+	attempt_2 = generate_ipv4_id_nofrag(&tuple4, &hdr);
+	attempt_3 = generate_ipv4_id_nofrag(&tuple4, &hdr);
 	/*
 	 * At least one of the attempts should be nonzero,
 	 * otherwise the random would be sucking major ****.
@@ -244,13 +253,15 @@ static bool test_function_generate_ipv4_id_nofrag(void)
 	success &= assert_not_equals_be16(0, (attempt_1 | attempt_2 | attempt_3), "88 < Len < 1280");
 
 	hdr.payload_len = cpu_to_be16(1240); /* packet length is 1280. */
-	attempt_1 = generate_ipv4_id_nofrag(&hdr);
-	attempt_2 = generate_ipv4_id_nofrag(&hdr);
-	attempt_3 = generate_ipv4_id_nofrag(&hdr);
+	attempt_1 = generate_ipv4_id_nofrag(&tuple4, &hdr);
+	attempt_2 = generate_ipv4_id_nofrag(&tuple4, &hdr);
+	attempt_3 = generate_ipv4_id_nofrag(&tuple4, &hdr);
 	success &= assert_not_equals_be16(0, (attempt_1 | attempt_2 | attempt_3), "Len = 1280");
+	/* Same destination, so they come from the same counter. */
+	success &= assert_not_equals_be16(attempt_1, attempt_2, "IDs are not repeated");
 
 	hdr.payload_len = cpu_to_be16(4000); /* packet length is 4040. */
-	success &= assert_equals_be16(0, generate_ipv4_id_nofrag(&hdr), "Len > 1280");
+	success &= assert_equals_be16(0, generate_ipv4_id_nofrag(&tuple4, &hdr), "Len > 1280");
 
 	return success;
 }
@@ -336,6 +347,8 @@ failure:
 	return false;
 }
 
+#define has_nonzero_segments_left(hdr, offset) \
+	has_nonzero_segments_left(hdr, get_extension_header(hdr, NEXTHDR_ROUTING), offset)
 static bool test_function_has_nonzero_segments_left(void)
 {
 	struct ipv6hdr *ip6_hdr;
@@ -433,6 +446,252 @@ static int count_frags(struct sk_buff *skb)
 	return i;
 }
 
+/*
+ * The layer-4 checksum updaters as they used to be (summing the whole pseudoheaders and headers
+ * in and out). The incremental ones have to yield the exact same result.
+ */
+static __sum16 reference_csum_6to4(__sum16 csum16,
+		struct ipv6hdr *in_ip6, void *in_l4_hdr, size_t in_l4_hdr_len,
+		struct iphdr *out_ip4, void *out_l4_hdr, size_t out_l4_hdr_len)
+{
+	__wsum csum, pseudohdr_csum;
+
+	csum = ~csum_unfold(csum16);
+
+	pseudohdr_csum = ~csum_unfold(csum_ipv6_magic(&in_ip6->saddr, &in_ip6->daddr, 0, 0, 0));
+	csum = csum_sub(csum, pseudohdr_csum);
+	csum = csum_sub(csum, csum_partial(in_l4_hdr, in_l4_hdr_len, 0));
+
+	pseudohdr_csum = csum_tcpudp_nofold(out_ip4->saddr, out_ip4->daddr, 0, 0, 0);
+	csum = csum_add(csum, pseudohdr_csum);
+	csum = csum_add(csum, csum_partial(out_l4_hdr, out_l4_hdr_len, 0));
+
+	return csum_fold(csum);
+}
+
+static __sum16 reference_csum_4to6(__sum16 csum16,
+		struct iphdr *in_ip4, void *in_l4_hdr, size_t in_l4_hdr_len,
+		struct ipv6hdr *out_ip6, void *out_l4_hdr, size_t out_l4_hdr_len)
+{
+	__wsum csum, pseudohdr_csum;
+
+	csum = ~csum_unfold(csum16);
+
+	pseudohdr_csum = csum_tcpudp_nofold(in_ip4->saddr, in_ip4->daddr, 0, 0, 0);
+	csum = csum_sub(csum, pseudohdr_csum);
+	csum = csum_sub(csum, csum_partial(in_l4_hdr, in_l4_hdr_len, 0));
+
+	pseudohdr_csum = ~csum_unfold(csum_ipv6_magic(&out_ip6->saddr, &out_ip6->daddr, 0, 0, 0));
+	csum = csum_add(csum, pseudohdr_csum);
+	csum = csum_add(csum, csum_partial(out_l4_hdr, out_l4_hdr_len, 0));
+
+	return csum_fold(csum);
+}
+
+#define CSUM_ROUNDS 10000
+
+/**
+ * Feeds random headers to both versions of the checksum updaters, and asserts the incremental ones
+ * agree with the reference ones bit for bit. Then times both.
+ */
+static bool test_templates(void)
+{
+	struct ttp_templates *tmpl;
+	__u8 tos = 0x2c;
+	bool true_variable = true;
+	bool false_variable = false;
+	bool success = true;
+
+	if (is_error(ttpconfig_update(NEW_TOS, sizeof(__u8), &tos)))
+		return false;
+	if (is_error(ttpconfig_update(RESET_TOS, sizeof(__u8), &true_variable)))
+		return false;
+	if (is_error(ttpconfig_update(DF_ALWAYS_ON, sizeof(__u8), &true_variable)))
+		return false;
+
+	rcu_read_lock_bh();
+	tmpl = ttpconfig_get_templates();
+	success &= assert_equals_u8(4, tmpl->hdr4.version, "IPv4 version");
+	success &= assert_equals_u8(5, tmpl->hdr4.ihl, "IPv4 IHL");
+	success &= assert_equals_u8(tos, tmpl->hdr4.tos, "Reset TOS");
+	success &= assert_true(is_dont_fragment_set(&tmpl->hdr4), "DF always on");
+	success &= assert_equals_u8(6, tmpl->hdr6.version, "IPv6 version");
+	rcu_read_unlock_bh();
+
+	if (is_error(ttpconfig_update(RESET_TOS, sizeof(__u8), &false_variable)))
+		return false;
+	if (is_error(ttpconfig_update(DF_ALWAYS_ON, sizeof(__u8), &false_variable)))
+		return false;
+
+	rcu_read_lock_bh();
+	tmpl = ttpconfig_get_templates();
+	success &= assert_false(tmpl->reset_tos, "Reset TOS flag");
+	success &= assert_equals_u8(0, tmpl->hdr4.tos, "Unset TOS");
+	success &= assert_false(is_dont_fragment_set(&tmpl->hdr4), "DF not always on");
+	rcu_read_unlock_bh();
+
+	/* Leave the defaults behind; the full translation tests expect them. */
+	tos = TRAN_DEF_NEW_TOS;
+	if (is_error(ttpconfig_update(NEW_TOS, sizeof(__u8), &tos)))
+		return false;
+	true_variable = TRAN_DEF_DF_ALWAYS_ON;
+	if (is_error(ttpconfig_update(DF_ALWAYS_ON, sizeof(__u8), &true_variable)))
+		return false;
+
+	return success;
+}
+
+static bool test_csum_update(void)
+{
+	struct ipv6hdr hdr6;
+	struct iphdr hdr4;
+	struct tcphdr tcp_in, tcp_out;
+	__sum16 csum;
+	__u16 sink = 0;
+	ktime_t start;
+	s64 reference_time, incremental_time;
+	unsigned int i;
+	bool success = true;
+
+	for (i = 0; i < CSUM_ROUNDS && success; i++) {
+		get_random_bytes(&hdr6, sizeof(hdr6));
+		get_random_bytes(&hdr4, sizeof(hdr4));
+		get_random_bytes(&tcp_in, sizeof(tcp_in));
+		get_random_bytes(&csum, sizeof(csum));
+		/* The reference functions expect the headers' checksum fields to be zero. */
+		tcp_in.check = 0;
+		tcp_out = tcp_in;
+		get_random_bytes(&tcp_out.source, sizeof(tcp_out.source));
+		get_random_bytes(&tcp_out.dest, sizeof(tcp_out.dest));
+
+		success &= assert_equals_u16(
+				(__force __u16) reference_csum_6to4(csum, &hdr6, &tcp_in, sizeof(tcp_in),
+						&hdr4, &tcp_out, sizeof(tcp_out)),
+				(__force __u16) update_csum_6to4(csum, &hdr6, &tcp_in, &hdr4, &tcp_out),
+				"6to4 checksum");
+		success &= assert_equals_u16(
+				(__force __u16) reference_csum_4to6(csum, &hdr4, &tcp_in, sizeof(tcp_in),
+						&hdr6, &tcp_out, sizeof(tcp_out)),
+				(__force __u16) update_csum_4to6(csum, &hdr4, &tcp_in, &hdr6, &tcp_out),
+				"4to6 checksum");
+	}
+
+	start = ktime_get();
+	for (i = 0; i < CSUM_ROUNDS; i++) {
+		tcp_out.source = (__force __be16) i;
+		sink ^= (__force __u16) reference_csum_6to4(csum, &hdr6, &tcp_in, sizeof(tcp_in),
+				&hdr4, &tcp_out, sizeof(tcp_out));
+		sink ^= (__force __u16) reference_csum_4to6(csum, &hdr4, &tcp_in, sizeof(tcp_in),
+				&hdr6, &tcp_out, sizeof(tcp_out));
+	}
+	reference_time = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < CSUM_ROUNDS; i++) {
+		tcp_out.source = (__force __be16) i;
+		sink ^= (__force __u16) update_csum_6to4(csum, &hdr6, &tcp_in, &hdr4, &tcp_out);
+		sink ^= (__force __u16) update_csum_4to6(csum, &hdr4, &tcp_in, &hdr6, &tcp_out);
+	}
+	incremental_time = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	log_info("Checksum updates (x2): %d. Reference: %lld ns. Incremental: %lld ns. (%x)",
+			CSUM_ROUNDS, reference_time, incremental_time, sink);
+	return success;
+}
+
+static __sum16 tcp_csum(struct tcphdr *hdr, unsigned int len)
+{
+	__sum16 old = hdr->check;
+	__sum16 result;
+
+	hdr->check = 0;
+	result = csum_tcpudp_magic(cpu_to_be32(0xc0000201), cpu_to_be32(0xc0000202), len,
+			IPPROTO_TCP, csum_partial(hdr, len, 0));
+	hdr->check = old;
+
+	return result;
+}
+
+/**
+ * Clamps a MSS option that sits where it normally does, and one whose value straddles two of the
+ * checksum's words. The checksum updates must agree with the full recomputations.
+ */
+static bool test_clamp_mss(void)
+{
+	__u8 buffer[sizeof(struct tcphdr) + 8];
+	struct tcphdr *hdr = (struct tcphdr *) buffer;
+	__u8 *opts = (__u8 *) (hdr + 1);
+	/* sendpkt_ipv6_mtu() minus the IPv6 and TCP headers. */
+	__u16 max_mss = TRAN_DEF_MIN_IPV6_MTU - 60;
+	__sum16 check;
+	bool true_variable = true;
+	bool false_variable = false;
+	bool success = true;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->source = cpu_to_be16(1234);
+	hdr->dest = cpu_to_be16(80);
+	hdr->doff = sizeof(buffer) / 4;
+	hdr->syn = 1;
+
+	/* Disabled. */
+	opts[0] = TCPOPT_MSS;
+	opts[1] = TCPOLEN_MSS;
+	opts[2] = 1460 >> 8;
+	opts[3] = 1460 & 0xFF;
+	hdr->check = tcp_csum(hdr, sizeof(buffer));
+	ttpcomm_clamp_mss(hdr, sizeof(buffer), true);
+	success &= assert_equals_u16(1460, (opts[2] << 8) | opts[3], "Disabled");
+
+	if (is_error(ttpconfig_update(CLAMP_MSS, sizeof(__u8), &true_variable)))
+		return false;
+
+	/* Aligned. */
+	ttpcomm_clamp_mss(hdr, sizeof(buffer), true);
+	success &= assert_equals_u16(max_mss, (opts[2] << 8) | opts[3], "Aligned MSS");
+	success &= assert_equals_u16((__force __u16) tcp_csum(hdr, sizeof(buffer)),
+			(__force __u16) hdr->check, "Aligned checksum");
+
+	/* Small enough already. */
+	ttpcomm_clamp_mss(hdr, sizeof(buffer), true);
+	success &= assert_equals_u16(max_mss, (opts[2] << 8) | opts[3], "Untouched MSS");
+
+	/* Straddling. */
+	opts[0] = TCPOPT_NOP;
+	opts[1] = TCPOPT_MSS;
+	opts[2] = TCPOLEN_MSS;
+	opts[3] = 9000 >> 8;
+	opts[4] = 9000 & 0xFF;
+	opts[5] = TCPOPT_EOL;
+	hdr->check = tcp_csum(hdr, sizeof(buffer));
+	ttpcomm_clamp_mss(hdr, sizeof(buffer), true);
+	success &= assert_equals_u16(max_mss, (opts[3] << 8) | opts[4], "Straddling MSS");
+	success &= assert_equals_u16((__force __u16) tcp_csum(hdr, sizeof(buffer)),
+			(__force __u16) hdr->check, "Straddling checksum");
+
+	/* Not a SYN. */
+	opts[3] = 9000 >> 8;
+	opts[4] = 9000 & 0xFF;
+	hdr->syn = 0;
+	ttpcomm_clamp_mss(hdr, sizeof(buffer), true);
+	success &= assert_equals_u16(9000, (opts[3] << 8) | opts[4], "Not a SYN");
+
+	/* Option cut short by the end of the header. */
+	hdr->syn = 1;
+	memset(opts, TCPOPT_NOP, 6);
+	opts[6] = TCPOPT_MSS;
+	opts[7] = TCPOLEN_MSS;
+	check = hdr->check;
+	ttpcomm_clamp_mss(hdr, sizeof(buffer), true);
+	success &= assert_equals_u16((__force __u16) check, (__force __u16) hdr->check,
+			"Truncated option");
+
+	if (is_error(ttpconfig_update(CLAMP_MSS, sizeof(__u8), &false_variable)))
+		return false;
+
+	return success;
+}
+
 static bool compare_skbs(struct sk_buff *expected, struct sk_buff *actual)
 {
 	unsigned char *expected_ptr, *actual_ptr;
@@ -595,6 +854,151 @@ static bool test_6to4frag_icmp(void)
 	return test_6to4(L4PROTO_ICMP, create_skb6frags_icmp, create_skb4frags_icmp, 100);
 }
 
+/**
+ * Translates the "create_skb_in_fn" packet in place, and compares the result to the
+ * "create_skb_out_fn" packet. Packets that are expected to be rejected by the in-place translation
+ * ("expected_error" -EAGAIN) must be left intact.
+ */
+static bool test_in_place(struct tuple *tuple_in, struct tuple *tuple_out,
+		int (*create_skb_in_fn)(struct tuple *, struct sk_buff **, u16, u8),
+		int (*create_skb_out_fn)(struct tuple *, struct sk_buff **, u16, u8),
+		int expected_error)
+{
+	struct sk_buff *skb = NULL, *skb_copy = NULL, *skb_expected = NULL;
+	bool result = false;
+
+	if (create_skb_in_fn(tuple_in, &skb, 100, 32) != 0
+			|| create_skb_in_fn(tuple_in, &skb_copy, 100, 32) != 0
+			|| create_skb_out_fn(tuple_out, &skb_expected, 100, 31) != 0)
+		goto end;
+
+	result = assert_equals_int(expected_error,
+			translating_the_packet_in_place(tuple_out, skb, NULL),
+			"Result code");
+	result &= compare_skbs(expected_error ? skb_copy : skb_expected, skb);
+	/* Fall through. */
+
+end:
+	kfree_skb_queued(skb);
+	kfree_skb_queued(skb_copy);
+	kfree_skb_queued(skb_expected);
+	return result;
+}
+
+static bool test_in_place_4to6(l4_protocol l4_proto,
+		int (*create_skb4_fn)(struct tuple *, struct sk_buff **, u16, u8),
+		int (*create_skb6_fn)(struct tuple *, struct sk_buff **, u16, u8),
+		int expected_error)
+{
+	struct tuple tuple4, tuple6;
+
+	if (init_ipv4_tuple(&tuple4, "192.0.2.5", 1234, "192.0.2.2", 80, l4_proto) != 0
+			|| init_ipv6_tuple(&tuple6, "64::192.0.2.5", 51234, "1::1", 50080, l4_proto) != 0)
+		return false;
+
+	return test_in_place(&tuple4, &tuple6, create_skb4_fn, create_skb6_fn, expected_error);
+}
+
+static bool test_in_place_6to4(l4_protocol l4_proto,
+		int (*create_skb6_fn)(struct tuple *, struct sk_buff **, u16, u8),
+		int (*create_skb4_fn)(struct tuple *, struct sk_buff **, u16, u8),
+		int expected_error)
+{
+	struct tuple tuple6, tuple4;
+
+	if (init_ipv6_tuple(&tuple6, "1::1", 50080, "64::192.0.2.5", 51234, l4_proto) != 0
+			|| init_ipv4_tuple(&tuple4, "192.0.2.2", 80, "192.0.2.5", 1234, l4_proto) != 0)
+		return false;
+
+	return test_in_place(&tuple6, &tuple4, create_skb6_fn, create_skb4_fn, expected_error);
+}
+
+static bool test_in_place_translation(void)
+{
+	bool success = true;
+
+	success &= test_in_place_4to6(L4PROTO_UDP, create_skb4_udp, create_skb6_udp, 0);
+	success &= test_in_place_4to6(L4PROTO_TCP, create_skb4_tcp, create_skb6_tcp, 0);
+	success &= test_in_place_4to6(L4PROTO_ICMP, create_skb4_icmp_info, create_skb6_icmp_info,
+			-EAGAIN);
+	success &= test_in_place_4to6(L4PROTO_TCP, create_skb4frags_tcp, create_skb6frags_tcp,
+			-EAGAIN);
+
+	success &= test_in_place_6to4(L4PROTO_UDP, create_skb6_udp, create_skb4_udp, 0);
+	success &= test_in_place_6to4(L4PROTO_TCP, create_skb6_tcp, create_skb4_tcp, 0);
+	success &= test_in_place_6to4(L4PROTO_ICMP, create_skb6_icmp_info, create_skb4_icmp_info,
+			-EAGAIN);
+	success &= test_in_place_6to4(L4PROTO_TCP, create_skb6frags_tcp, create_skb4frags_tcp,
+			-EAGAIN);
+
+	return success;
+}
+
+static bool test_in_place_gso(void)
+{
+	struct sk_buff *skb = NULL;
+	struct tuple tuple4, tuple6;
+	bool success = true;
+
+	if (init_ipv4_tuple(&tuple4, "192.0.2.5", 1234, "192.0.2.2", 80, L4PROTO_TCP) != 0
+			|| init_ipv6_tuple(&tuple6, "64::192.0.2.5", 51234, "1::1", 50080, L4PROTO_TCP) != 0
+			|| create_skb4_tcp(&tuple4, &skb, 100, 32) != 0)
+		return false;
+
+	/* Pretend GRO merged two 50-byte segments. */
+	skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+	skb_shinfo(skb)->gso_size = 50;
+	skb_shinfo(skb)->gso_segs = 2;
+
+	success &= assert_equals_int(0, translating_the_packet_in_place(&tuple6, skb, NULL), "Result");
+	success &= assert_equals_int(L3PROTO_IPV6, skb_l3_proto(skb), "Protocol");
+	success &= assert_equals_u32(SKB_GSO_TCPV6, skb_shinfo(skb)->gso_type, "GSO type");
+	/* The IPv6 header is 20 bytes bigger, so the segments must carry 20 bytes less. */
+	success &= assert_equals_u32(30, skb_shinfo(skb)->gso_size, "GSO size");
+	success &= assert_equals_u32(4, skb_shinfo(skb)->gso_segs, "GSO segments");
+	success &= assert_equals_int(CHECKSUM_PARTIAL, skb->ip_summed, "Checksum status");
+	success &= assert_equals_u32(skb_transport_offset(skb) + skb_headroom(skb), skb->csum_start,
+			"Checksum start");
+
+	kfree_skb(skb);
+	return success;
+}
+
+static bool test_in_place_partial_csum(void)
+{
+	struct sk_buff *skb = NULL;
+	struct tuple tuple6, tuple4;
+	struct iphdr *hdr4;
+	__sum16 expected;
+	bool success = true;
+
+	if (init_ipv6_tuple(&tuple6, "1::1", 50080, "64::192.0.2.5", 51234, L4PROTO_UDP) != 0
+			|| init_ipv4_tuple(&tuple4, "192.0.2.2", 80, "192.0.2.5", 1234, L4PROTO_UDP) != 0
+			|| create_skb6_udp(&tuple6, &skb, 100, 32) != 0)
+		return false;
+
+	/* Pretend the checksum is yet to be computed by the NIC. */
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct udphdr, check);
+
+	success &= assert_equals_int(0, translating_the_packet_in_place(&tuple4, skb, NULL), "Result");
+	success &= assert_equals_int(CHECKSUM_PARTIAL, skb->ip_summed, "Checksum status");
+	success &= assert_equals_u32(skb_transport_offset(skb) + skb_headroom(skb), skb->csum_start,
+			"Checksum start");
+	success &= assert_equals_u32(offsetof(struct udphdr, check), skb->csum_offset,
+			"Checksum offset");
+
+	hdr4 = ip_hdr(skb);
+	expected = ~csum_tcpudp_magic(hdr4->saddr, hdr4->daddr, sizeof(struct udphdr) + 100,
+			IPPROTO_UDP, 0);
+	success &= assert_equals_u16((__force __u16) expected, (__force __u16) udp_hdr(skb)->check,
+			"Pseudo-header checksum");
+
+	kfree_skb(skb);
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("Translating the Packet");
@@ -614,6 +1018,9 @@ int init_module(void)
 	CALL_TEST(test_function_has_nonzero_segments_left(), "Segments left indicator function");
 	CALL_TEST(test_function_generate_ipv4_id_dofrag(), "Generate id function (frag)");
 	CALL_TEST(test_function_icmp4_minimum_mtu(), "ICMP4 Minimum MTU function");
+	CALL_TEST(test_csum_update(), "Incremental layer-4 checksum update");
+	CALL_TEST(test_templates(), "Header templates");
+	CALL_TEST(test_clamp_mss(), "MSS clamping");
 
 	/* Full packet translation tests */
 	CALL_TEST(test_4to6_udp(), "Full translation, 4->6 UDP");
@@ -632,6 +1039,10 @@ int init_module(void)
 	CALL_TEST(test_6to4frag_udp(), "Full Fragments, 6->4 UDP");
 	CALL_TEST(test_6to4frag_icmp(), "Full Fragments, 6->4 ICMP");
 
+	CALL_TEST(test_in_place_translation(), "In-place translation");
+	CALL_TEST(test_in_place_gso(), "In-place translation, GSO");
+	CALL_TEST(test_in_place_partial_csum(), "In-place translation, offloaded checksum");
+
 	/* TODO (test) still need to test zero IPv4-UDP checksums. I think that's all. */
 
 	translate_packet_destroy();
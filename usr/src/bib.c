@@ -13,7 +13,7 @@
 
 struct display_params {
 	bool numeric_hostname;
-	bool csv_format;
+	enum display_format format;
 	int row_count;
 	struct request_bib *req_payload;
 };
@@ -29,7 +29,21 @@ static int bib_display_response(struct nl_msg *msg, void *arg)
 	entries = nlmsg_data(hdr);
 	entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
 
-	if (params->csv_format) {
+	if (params->format != FORMAT_JSON && !params->numeric_hostname) {
+		for (i = 0; i < entry_count; i++)
+			dns_queue6(&entries[i].addr6.l3);
+		dns_resolve_queued();
+	}
+
+	if (params->format == FORMAT_JSON) {
+		for (i = 0; i < entry_count; i++) {
+			printf("{\"proto\":\"%s\",", l4proto_to_string(params->req_payload->l4_proto));
+			print_addr6_json("addr6", &entries[i].addr6);
+			printf(",");
+			print_addr4_json("addr4", &entries[i].addr4);
+			printf(",\"static\":%s}\n", entries[i].is_static ? "true" : "false");
+		}
+	} else if (params->format == FORMAT_CSV) {
 		for (i = 0; i < entry_count; i++) {
 			printf("%s,", l4proto_to_string(params->req_payload->l4_proto));
 			print_addr6(&entries[i].addr6, params->numeric_hostname, ",",
@@ -61,7 +75,8 @@ static int bib_display_response(struct nl_msg *msg, void *arg)
 	return 0;
 }
 
-static bool display_single_table(l4_protocol l4_proto, bool numeric_hostname, bool csv_format)
+static bool display_single_table(l4_protocol l4_proto, bool numeric_hostname,
+		enum display_format format)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *) request;
@@ -69,7 +84,7 @@ static bool display_single_table(l4_protocol l4_proto, bool numeric_hostname, bo
 	struct display_params params;
 	bool error;
 
-	if (!csv_format)
+	if (format == FORMAT_FRIENDLY)
 		printf("%s:\n", l4proto_to_string(l4_proto));
 
 	hdr->length = sizeof(request);
@@ -80,7 +95,7 @@ static bool display_single_table(l4_protocol l4_proto, bool numeric_hostname, bo
 	memset(&payload->display.addr4, 0, sizeof(payload->display.addr4));
 
 	params.numeric_hostname = numeric_hostname;
-	params.csv_format = csv_format;
+	params.format = format;
 	params.row_count = 0;
 	params.req_payload = payload;
 
@@ -90,7 +105,7 @@ static bool display_single_table(l4_protocol l4_proto, bool numeric_hostname, bo
 			break;
 	} while (params.req_payload->display.iterate);
 
-	if (!csv_format && !error) {
+	if (format == FORMAT_FRIENDLY && !error) {
 		if (params.row_count > 0)
 			printf("  (Fetched %u entries.)\n", params.row_count);
 		else
@@ -100,21 +115,22 @@ static bool display_single_table(l4_protocol l4_proto, bool numeric_hostname, bo
 	return error;
 }
 
-int bib_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_hostname, bool csv_format)
+int bib_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_hostname,
+		enum display_format format)
 {
 	int tcp_error = 0;
 	int udp_error = 0;
 	int icmp_error = 0;
 
-	if (csv_format)
+	if (format == FORMAT_CSV)
 		printf("Protocol,IPv6 Address,IPv6 L4-ID,IPv4 Address,IPv4 L4-ID,Static?\n");
 
 	if (use_tcp)
-		tcp_error = display_single_table(L4PROTO_TCP, numeric_hostname, csv_format);
+		tcp_error = display_single_table(L4PROTO_TCP, numeric_hostname, format);
 	if (use_udp)
-		udp_error = display_single_table(L4PROTO_UDP, numeric_hostname, csv_format);
+		udp_error = display_single_table(L4PROTO_UDP, numeric_hostname, format);
 	if (use_icmp)
-		icmp_error = display_single_table(L4PROTO_ICMP, numeric_hostname, csv_format);
+		icmp_error = display_single_table(L4PROTO_ICMP, numeric_hostname, format);
 
 	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
 }
@@ -130,7 +146,7 @@ static bool display_single_count(char *count_name, u_int8_t l4_proto)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *) request;
-	struct request_session *payload = (struct request_session *) (request + HDR_LEN);
+	struct request_bib *payload = (struct request_bib *) (request + HDR_LEN);
 
 	printf("%s: ", count_name);
 
@@ -0,0 +1,150 @@
+#include "nat64/usr/changes.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include "nat64/usr/dns.h"
+#include "nat64/usr/session.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+struct display_params {
+	struct request_changes *request;
+	/** Latest generation the kernel reported. */
+	__u64 generation;
+	bool stale;
+	bool iterate;
+};
+
+static char *event_to_string(__u8 type)
+{
+	switch (type) {
+	case DBEVENT_BIB_ADD:
+		return "bib-add";
+	case DBEVENT_BIB_REMOVE:
+		return "bib-remove";
+	case DBEVENT_SESSION_ADD:
+		return "session-add";
+	case DBEVENT_SESSION_REMOVE:
+		return "session-remove";
+	case DBEVENT_SESSION_UPDATE:
+		return "session-update";
+	}
+
+	return "unknown";
+}
+
+static void print_record(struct changelog_record *record)
+{
+	struct dbevent_usr *event = &record->event;
+
+	printf("{\"generation\":%llu,\"event\":\"%s\",\"proto\":\"%s\",", record->generation,
+			event_to_string(event->type), l4proto_to_string(event->l4_proto));
+
+	if (event->type == DBEVENT_BIB_ADD || event->type == DBEVENT_BIB_REMOVE) {
+		print_addr6_json("addr6", &event->remote6);
+		printf(",");
+		print_addr4_json("addr4", &event->local4);
+		printf("}\n");
+		return;
+	}
+
+	print_addr6_json("remote6", &event->remote6);
+	printf(",");
+	print_addr6_json("local6", &event->local6);
+	printf(",");
+	print_addr4_json("local4", &event->local4);
+	printf(",");
+	print_addr4_json("remote4", &event->remote4);
+	if (event->l4_proto == L4PROTO_TCP)
+		printf(",\"state\":\"%s\"", tcp_state_to_string(event->state));
+	if (event->type == DBEVENT_SESSION_REMOVE && event->packets)
+		printf(",\"packets\":%llu,\"bytes\":%llu", event->packets, event->bytes);
+	printf("}\n");
+}
+
+static int changes_display_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct display_params *params = arg;
+	struct changes_response *response = nlmsg_data(hdr);
+	struct changelog_record *records = (struct changelog_record *) (response + 1);
+	int len = nlmsg_datalen(hdr);
+	unsigned int count;
+	unsigned int i;
+
+	if (len < sizeof(*response) || (len - sizeof(*response)) % sizeof(*records)) {
+		log_err("The kernel sent a change list of unexpected size (%d bytes).", len);
+		return -EINVAL;
+	}
+	count = (len - sizeof(*response)) / sizeof(*records);
+
+	params->generation = response->generation;
+	params->stale = response->stale;
+
+	for (i = 0; i < count; i++)
+		print_record(&records[i]);
+
+	if (hdr->nlmsg_flags == NLM_F_MULTI && count > 0) {
+		params->iterate = true;
+		params->request->since = records[count - 1].generation;
+	} else {
+		params->iterate = false;
+	}
+
+	return 0;
+}
+
+int changes_display(__u64 since)
+{
+	unsigned char request[sizeof(struct request_hdr) + sizeof(struct request_changes)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_changes *payload = (struct request_changes *) (hdr + 1);
+	struct display_params params;
+	int error;
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_CHANGES;
+	hdr->operation = OP_DISPLAY;
+	payload->since = since;
+
+	params.request = payload;
+	params.generation = since;
+	params.stale = false;
+
+	do {
+		error = netlink_request(request, hdr->length, changes_display_response, &params);
+		if (error)
+			return error;
+	} while (params.iterate);
+
+	if (params.stale) {
+		log_err("The changes since generation %llu are no longer logged. Dump the tables, "
+				"then ask for the changes since generation %llu.", since,
+				params.generation);
+		return -ESTALE;
+	}
+
+	printf("{\"generation\":%llu}\n", params.generation);
+	return 0;
+}
+
+static int changes_count_response(struct nl_msg *msg, void *arg)
+{
+	__u64 *generation = nlmsg_data(nlmsg_hdr(msg));
+	printf("%llu\n", *generation);
+	return 0;
+}
+
+int changes_count(void)
+{
+	struct request_hdr request = {
+			.length = sizeof(request),
+			.mode = MODE_CHANGES,
+			.operation = OP_COUNT,
+	};
+
+	return netlink_request(&request, request.length, changes_count_response, NULL);
+}
@@ -0,0 +1,198 @@
+#include "nat64/usr/daemon.h"
+#include "nat64/usr/file.h"
+#include "nat64/usr/netlink.h"
+#include "nat64/usr/types.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+/** Maximum length of a command line. */
+#define LINE_MAX_LEN 1024
+/** Maximum number of arguments of a command, including the program name. */
+#define ARGS_MAX 64
+#define DELIMITERS " \t\r\n"
+
+/** Clients which connect while another one is being served wait in here. */
+#define BACKLOG 16
+
+static int open_socket(char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int sk;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_err("'%s' is too long to be a socket path.", path);
+		return -EINVAL;
+	}
+
+	sk = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sk < 0) {
+		log_err("Could not create the socket: %s", strerror(errno));
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* A previous instance might have left it behind. */
+	unlink(path);
+	/* Anyone who can write to the socket can reconfigure Jool, so only we can. */
+	mask = umask(0077);
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		umask(mask);
+		log_err("Could not bind the socket to '%s': %s", path, strerror(errno));
+		goto fail;
+	}
+	umask(mask);
+
+	if (listen(sk, BACKLOG) < 0) {
+		log_err("Could not listen on '%s': %s", path, strerror(errno));
+		goto fail;
+	}
+
+	return sk;
+
+fail:
+	close(sk);
+	return -errno;
+}
+
+static void print_status(int error)
+{
+	printf("STATUS %d\n", (error < 0) ? -error : error);
+	fflush(stdout);
+}
+
+static int run_command(char *line, int (*run)(int argc, char **argv))
+{
+	char *argv[ARGS_MAX + 1];
+	int argc = 0;
+	char *token;
+	char *save;
+
+	argv[argc++] = "jool";
+	token = strtok_r(line, DELIMITERS, &save);
+	for (; token; token = strtok_r(NULL, DELIMITERS, &save)) {
+		if (argc == ARGS_MAX) {
+			log_err("Too many arguments; the maximum is %d.", ARGS_MAX - 1);
+			return -E2BIG;
+		}
+		argv[argc++] = token;
+	}
+	argv[argc] = NULL;
+
+	return run(argc, argv);
+}
+
+/**
+ * Catches the first error of the entries queued since the last commit, so the client can be told
+ * about it when it commits.
+ */
+static void remember(int *first_error, int error)
+{
+	if (!*first_error)
+		*first_error = error;
+}
+
+static void serve(FILE *client, int (*run)(int argc, char **argv))
+{
+	char line[LINE_MAX_LEN];
+	struct file_batch batch;
+	char *start;
+	int batch_error = 0;
+
+	memset(&batch, 0, sizeof(batch));
+
+	while (fgets(line, sizeof(line), client)) {
+		start = line + strspn(line, " \t");
+		if (start[0] == '\0' || start[0] == '\n' || start[0] == '#')
+			continue;
+
+		if (start[0] == '-') {
+			remember(&batch_error, file_flush(&batch));
+			print_status(run_command(start, run));
+		} else if (strncmp(start, "commit", strlen("commit")) == 0) {
+			remember(&batch_error, file_flush(&batch));
+			print_status(batch_error);
+			batch_error = 0;
+		} else {
+			remember(&batch_error, file_parse_line(&batch, start));
+		}
+		fflush(stdout);
+	}
+
+	/* Nobody's left to hear the answer, but the entries are the client's will. */
+	file_flush(&batch);
+	fflush(stdout);
+}
+
+int daemon_run(char *path, int (*run)(int argc, char **argv))
+{
+	int sk;
+	int client;
+	FILE *input;
+	int out, err;
+	int error;
+
+	sk = open_socket(path);
+	if (sk < 0)
+		return sk;
+
+	error = netlink_open();
+	if (error)
+		goto end;
+
+	/* A client that hangs up before reading its answers must not take us down. */
+	signal(SIGPIPE, SIG_IGN);
+
+	out = dup(STDOUT_FILENO);
+	err = dup(STDERR_FILENO);
+	if (out < 0 || err < 0) {
+		error = -errno;
+		log_err("Could not duplicate the standard streams: %s", strerror(errno));
+		goto end;
+	}
+
+	log_info("Listening on '%s'.", path);
+	fflush(stdout);
+
+	while (true) {
+		client = accept(sk, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			error = -errno;
+			log_err("Could not accept a client: %s", strerror(errno));
+			break;
+		}
+
+		input = fdopen(client, "r");
+		if (!input) {
+			close(client);
+			continue;
+		}
+
+		/* Everything the commands print goes to the client. */
+		dup2(client, STDOUT_FILENO);
+		dup2(client, STDERR_FILENO);
+		serve(input, run);
+		fclose(input);
+		dup2(out, STDOUT_FILENO);
+		dup2(err, STDERR_FILENO);
+	}
+
+end:
+	netlink_close();
+	close(sk);
+	unlink(path);
+	return error;
+}
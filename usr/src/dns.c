@@ -1,40 +1,338 @@
 #include "nat64/usr/dns.h"
 #include "nat64/usr/types.h"
+#include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-void print_addr6(struct ipv6_transport_addr *addr6, bool numeric_hostname, char *separator,
-		__u8 l4_proto)
+/**
+ * @file
+ * Address printing, optionally through reverse DNS.
+ *
+ * Hostnames (and service names) are cached, because the tables tend to list the same remote nodes
+ * over and over, and a reverse lookup usually costs a network round trip. The displays also
+ * dns_queue*() the addresses of an entire batch of entries before they print any of them, so those
+ * round trips happen DNS_THREADS at a time rather than one by one.
+ */
+
+/** Maximum number of reverse lookups that are in flight at once. */
+#define DNS_THREADS 16
+/** Initial number of slots of the cache. Has to be a power of two. */
+#define CACHE_MIN_SLOTS 1024
+
+struct dns_entry {
+	int family;
+	union {
+		struct in_addr addr4;
+		struct in6_addr addr6;
+	} addr;
+	/** The hostname; NULL if it hasn't been resolved, or could not be. */
+	char *name;
+	/** getnameinfo()'s result, if it has been called. */
+	int error;
+};
+
+/** Open addressing hash table of struct dns_entry pointers. */
+static struct dns_entry **cache;
+static unsigned int cache_slots;
+static unsigned int cache_count;
+
+/** The dns_queue*()d entries that dns_resolve_queued() hasn't resolved yet. */
+static struct dns_entry **queue;
+static unsigned int queue_count;
+static unsigned int queue_capacity;
+/** Index of the next entry from "queue" a worker thread should resolve. */
+static unsigned int queue_next;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Service names, indexed by port. Lazily filled. */
+static char *services[65536];
+
+static unsigned int hash(int family, const void *addr)
 {
-	char hostname[NI_MAXHOST], service[NI_MAXSERV];
-	char hostaddr[INET6_ADDRSTRLEN];
+	const unsigned char *bytes = addr;
+	size_t len = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+	unsigned int result = 2166136261u;
+	size_t i;
+
+	/* FNV-1a. */
+	for (i = 0; i < len; i++)
+		result = (result ^ bytes[i]) * 16777619u;
+	return result;
+}
+
+static bool entry_matches(struct dns_entry *entry, int family, const void *addr)
+{
+	if (entry->family != family)
+		return false;
+	return (family == AF_INET)
+			? (memcmp(&entry->addr.addr4, addr, sizeof(entry->addr.addr4)) == 0)
+			: (memcmp(&entry->addr.addr6, addr, sizeof(entry->addr.addr6)) == 0);
+}
+
+/**
+ * Returns the slot of "cache" where "addr" is, or where it should be inserted.
+ */
+static unsigned int find_slot(struct dns_entry **table, unsigned int slots, int family,
+		const void *addr)
+{
+	unsigned int slot = hash(family, addr) & (slots - 1);
+
+	while (table[slot] && !entry_matches(table[slot], family, addr))
+		slot = (slot + 1) & (slots - 1);
+	return slot;
+}
+
+static int cache_grow(void)
+{
+	struct dns_entry **table;
+	unsigned int slots, i;
+	struct dns_entry *entry;
+
+	slots = cache_slots ? (2 * cache_slots) : CACHE_MIN_SLOTS;
+	table = calloc(slots, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < cache_slots; i++) {
+		entry = cache[i];
+		if (entry)
+			table[find_slot(table, slots, entry->family, &entry->addr)] = entry;
+	}
+
+	free(cache);
+	cache = table;
+	cache_slots = slots;
+	return 0;
+}
+
+/**
+ * Returns the cache's entry for "addr", creating a blank one if there's none yet.
+ * Returns NULL on memory allocation failure.
+ */
+static struct dns_entry *cache_get(int family, const void *addr, bool *created)
+{
+	struct dns_entry *entry;
+	unsigned int slot;
+
+	*created = false;
+
+	/* Keep the load factor below one half. */
+	if (2 * (cache_count + 1) > cache_slots && cache_grow())
+		return NULL;
+
+	slot = find_slot(cache, cache_slots, family, addr);
+	if (cache[slot])
+		return cache[slot];
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->family = family;
+	if (family == AF_INET)
+		entry->addr.addr4 = *((struct in_addr *) addr);
+	else
+		entry->addr.addr6 = *((struct in6_addr *) addr);
+
+	cache[slot] = entry;
+	cache_count++;
+	*created = true;
+	return entry;
+}
+
+/**
+ * Fills "entry"'s name. Can be called from any thread, as long as no other one touches "entry".
+ */
+static void resolve(struct dns_entry *entry)
+{
+	char hostname[NI_MAXHOST];
+	struct sockaddr_in sa4;
 	struct sockaddr_in6 sa6;
-	int err;
+	struct sockaddr *sa;
+	socklen_t sa_len;
+
+	if (entry->family == AF_INET) {
+		memset(&sa4, 0, sizeof(sa4));
+		sa4.sin_family = AF_INET;
+		sa4.sin_addr = entry->addr.addr4;
+		sa = (struct sockaddr *) &sa4;
+		sa_len = sizeof(sa4);
+	} else {
+		memset(&sa6, 0, sizeof(sa6));
+		sa6.sin6_family = AF_INET6;
+		sa6.sin6_addr = entry->addr.addr6;
+		sa = (struct sockaddr *) &sa6;
+		sa_len = sizeof(sa6);
+	}
+
+	entry->error = getnameinfo(sa, sa_len, hostname, sizeof(hostname), NULL, 0, 0);
+	if (!entry->error)
+		entry->name = strdup(hostname);
+}
+
+static void queue_entry(int family, const void *addr)
+{
+	struct dns_entry *entry, **tmp;
+	unsigned int capacity;
+	bool created;
+
+	entry = cache_get(family, addr, &created);
+	if (!entry || !created)
+		return; /* Out of memory (printing will resolve it later), or already known. */
+
+	if (queue_count == queue_capacity) {
+		capacity = queue_capacity ? (2 * queue_capacity) : 256;
+		tmp = realloc(queue, capacity * sizeof(*queue));
+		if (!tmp) {
+			resolve(entry);
+			return;
+		}
+		queue = tmp;
+		queue_capacity = capacity;
+	}
+
+	queue[queue_count++] = entry;
+}
+
+void dns_queue6(struct in6_addr *addr)
+{
+	queue_entry(AF_INET6, addr);
+}
+
+void dns_queue4(struct in_addr *addr)
+{
+	queue_entry(AF_INET, addr);
+}
+
+static void *resolve_worker(void *arg)
+{
+	unsigned int index;
+
+	do {
+		pthread_mutex_lock(&queue_lock);
+		index = queue_next++;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (index < queue_count)
+			resolve(queue[index]);
+	} while (index < queue_count);
+
+	return NULL;
+}
+
+void dns_resolve_queued(void)
+{
+	pthread_t threads[DNS_THREADS];
+	unsigned int thread_count, i;
+
+	if (!queue_count)
+		return;
+
+	queue_next = 0;
+	thread_count = (queue_count < DNS_THREADS) ? queue_count : DNS_THREADS;
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_create(&threads[i], NULL, resolve_worker, NULL))
+			break;
+	}
+	thread_count = i;
+
+	if (!thread_count)
+		resolve_worker(NULL); /* Couldn't spawn anything; do it ourselves. */
+	for (i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
 
-	if (numeric_hostname)
-		goto print_numeric;
+	queue_count = 0;
+}
+
+/**
+ * Returns "addr"'s hostname, resolving it now if it wasn't queued. Returns NULL if it couldn't be
+ * resolved.
+ */
+static char *get_hostname(int family, const void *addr)
+{
+	struct dns_entry *entry;
+	bool created;
 
-	memset(&sa6, 0, sizeof(struct sockaddr_in6));
-	sa6.sin6_family = AF_INET6;
-	sa6.sin6_port = htons(addr6->l4);
-	sa6.sin6_addr = addr6->l3;
+	entry = cache_get(family, addr, &created);
+	if (!entry)
+		return NULL;
+	if (created)
+		resolve(entry);
 
-	err = getnameinfo((const struct sockaddr*) &sa6, sizeof(sa6),
-			hostname, sizeof(hostname), service, sizeof(service), 0);
-	if (err != 0) {
-		log_err("getnameinfo failed: %s", gai_strerror(err));
-		goto print_numeric;
+	if (entry->error) {
+		log_err("getnameinfo failed: %s", gai_strerror(entry->error));
+		entry->error = 0; /* Only complain once per address. */
 	}
+	return entry->name;
+}
+
+/**
+ * Returns the name of the "port" service, or NULL if it couldn't be computed.
+ */
+static char *get_service(__u16 port)
+{
+	char service[NI_MAXSERV];
+	struct sockaddr_in sa;
+
+	if (services[port])
+		return services[port];
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (getnameinfo((const struct sockaddr *) &sa, sizeof(sa), NULL, 0,
+			service, sizeof(service), NI_NUMERICHOST))
+		return NULL;
+
+	services[port] = strdup(service);
+	return services[port];
+}
+
+/**
+ * Prints "hostname", then "separator", then "l4_id" (translated into a service if it's a port).
+ */
+static void print_name(char *hostname, char *separator, __u16 l4_id, __u8 l4_proto)
+{
+	char *service;
 
 	/* Verification because ICMP doesn't use numeric ports, so it makes no sense to have a
 	 * translation of the "ICMP id". */
-	if (l4_proto != L4PROTO_ICMP)
+	service = (l4_proto != L4PROTO_ICMP) ? get_service(l4_id) : NULL;
+	if (service)
 		printf("%s%s%s", hostname, separator, service);
 	else
-		printf("%s%s%u", hostname, separator, addr6->l4);
-	return;
+		printf("%s%s%u", hostname, separator, l4_id);
+}
+
+void print_addr6_json(char *key, struct ipv6_transport_addr *addr6)
+{
+	char hostaddr[INET6_ADDRSTRLEN];
+
+	inet_ntop(AF_INET6, &addr6->l3, hostaddr, sizeof(hostaddr));
+	printf("\"%s\":\"%s\",\"%s_id\":%u", key, hostaddr, key, addr6->l4);
+}
+
+void print_addr4_json(char *key, struct ipv4_transport_addr *addr4)
+{
+	printf("\"%s\":\"%s\",\"%s_id\":%u", key, inet_ntoa(addr4->l3), key, addr4->l4);
+}
+
+void print_addr6(struct ipv6_transport_addr *addr6, bool numeric_hostname, char *separator,
+		__u8 l4_proto)
+{
+	char hostaddr[INET6_ADDRSTRLEN];
+	char *hostname;
+
+	if (!numeric_hostname) {
+		hostname = get_hostname(AF_INET6, &addr6->l3);
+		if (hostname) {
+			print_name(hostname, separator, addr6->l4, l4_proto);
+			return;
+		}
+	}
 
-print_numeric:
 	inet_ntop(AF_INET6, &addr6->l3, hostaddr, sizeof(hostaddr));
 	printf("%s%s%u", hostaddr, separator, addr6->l4);
 }
@@ -42,35 +340,15 @@ print_numeric:
 void print_addr4(struct ipv4_transport_addr *addr4, bool numeric_hostname, char *separator,
 		__u8 l4_proto)
 {
-	char hostname[NI_MAXHOST], service[NI_MAXSERV];
-	char *hostaddr;
-	struct sockaddr_in sa;
-	int err;
-
-	if (numeric_hostname)
-		goto print_numeric;
+	char *hostname;
 
-	memset(&sa, 0, sizeof(struct sockaddr_in));
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(addr4->l4);
-	sa.sin_addr = addr4->l3;
-
-	err = getnameinfo((const struct sockaddr*) &sa, sizeof(sa),
-			hostname, sizeof(hostname), service, sizeof(service), 0);
-	if (err != 0) {
-		log_err("getnameinfo failed: %s", gai_strerror(err));
-		goto print_numeric;
+	if (!numeric_hostname) {
+		hostname = get_hostname(AF_INET, &addr4->l3);
+		if (hostname) {
+			print_name(hostname, separator, addr4->l4, l4_proto);
+			return;
+		}
 	}
 
-	/* Verification because ICMP doesn't use numeric ports, so it makes no sense to have a
-	 * translation of the "ICMP id". */
-	if (l4_proto != L4PROTO_ICMP)
-		printf("%s%s%s", hostname, separator, service);
-	else
-		printf("%s%s%u", hostname, separator, addr4->l4);
-	return;
-
-print_numeric:
-	hostaddr = inet_ntoa(addr4->l3);
-	printf("%s%s%u", hostaddr, separator, addr4->l4);
+	printf("%s%s%u", inet_ntoa(addr4->l3), separator, addr4->l4);
 }
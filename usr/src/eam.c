@@ -0,0 +1,132 @@
+#include "nat64/usr/eam.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+
+
+#define HDR_LEN sizeof(struct request_hdr)
+#define PAYLOAD_LEN sizeof(union request_eamt)
+
+
+static int eam_display_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr;
+	struct eam_entry *entries;
+	int entry_count, i;
+	char addr6_str[INET6_ADDRSTRLEN];
+	char addr4_str[INET_ADDRSTRLEN];
+
+	hdr = nlmsg_hdr(msg);
+	entries = nlmsg_data(hdr);
+	entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
+
+	for (i = 0; i < entry_count; i++) {
+		inet_ntop(AF_INET6, &entries[i].prefix6.address, addr6_str, INET6_ADDRSTRLEN);
+		inet_ntop(AF_INET, &entries[i].prefix4.address, addr4_str, INET_ADDRSTRLEN);
+		printf("%s/%u - %s/%u\n", addr6_str, entries[i].prefix6.len,
+				addr4_str, entries[i].prefix4.len);
+	}
+
+	*((int *) arg) += entry_count;
+	return 0;
+}
+
+int eam_display(void)
+{
+	struct request_hdr request = {
+			.length = sizeof(request),
+			.mode = MODE_EAMT,
+			.operation = OP_DISPLAY,
+	};
+	int row_count = 0;
+	int error;
+
+	error = netlink_request(&request, request.length, eam_display_response, &row_count);
+	if (!error) {
+		if (row_count > 0)
+			log_info("  (Fetched %u entries.)", row_count);
+		else
+			log_info("  (empty)");
+	}
+
+	return error;
+}
+
+static int eam_count_response(struct nl_msg *msg, void *arg)
+{
+	__u64 *conf = nlmsg_data(nlmsg_hdr(msg));
+	printf("%llu\n", *conf);
+	return 0;
+}
+
+int eam_count(void)
+{
+	struct request_hdr request = {
+			.length = sizeof(request),
+			.mode = MODE_EAMT,
+			.operation = OP_COUNT,
+	};
+	return netlink_request(&request, request.length, eam_count_response, NULL);
+}
+
+static int eam_add_response(struct nl_msg *msg, void *arg)
+{
+	log_info("The entry was added successfully.");
+	return 0;
+}
+
+int eam_add(struct ipv6_prefix *prefix6, struct ipv4_prefix *prefix4)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_eamt *payload = (union request_eamt *) (request + HDR_LEN);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_EAMT;
+	hdr->operation = OP_ADD;
+	payload->add.entry.prefix6 = *prefix6;
+	payload->add.entry.prefix4 = *prefix4;
+
+	return netlink_request(request, hdr->length, eam_add_response, NULL);
+}
+
+static int eam_remove_response(struct nl_msg *msg, void *arg)
+{
+	log_info("The entry was removed successfully.");
+	return 0;
+}
+
+int eam_remove(struct ipv6_prefix *prefix6, struct ipv4_prefix *prefix4)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_eamt *payload = (union request_eamt *) (request + HDR_LEN);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_EAMT;
+	hdr->operation = OP_REMOVE;
+	payload->remove.entry.prefix6 = *prefix6;
+	payload->remove.entry.prefix4 = *prefix4;
+
+	return netlink_request(request, hdr->length, eam_remove_response, NULL);
+}
+
+static int eam_flush_response(struct nl_msg *msg, void *arg)
+{
+	log_info("The EAMT was flushed successfully.");
+	return 0;
+}
+
+int eam_flush(void)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_EAMT;
+	hdr->operation = OP_FLUSH;
+
+	return netlink_request(request, hdr->length, eam_flush_response, NULL);
+}
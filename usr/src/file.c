@@ -0,0 +1,212 @@
+#include "nat64/usr/file.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/comm/str_utils.h"
+#include "nat64/usr/str_utils.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/** Maximum length of a configuration file line. */
+#define LINE_MAX_LEN 256
+
+static struct request_hdr *get_hdr(struct file_batch *batch)
+{
+	return (struct request_hdr *) batch->buffer;
+}
+
+static void *get_entry(struct file_batch *batch, unsigned int index)
+{
+	return batch->buffer + sizeof(struct request_hdr) + index * batch->entry_size;
+}
+
+static int batch_response(struct nl_msg *msg, void *arg)
+{
+	return 0;
+}
+
+int file_flush(struct file_batch *batch)
+{
+	struct request_hdr *hdr = get_hdr(batch);
+	int error;
+
+	if (!batch->count)
+		return 0;
+
+	hdr->length = sizeof(*hdr) + batch->count * batch->entry_size;
+	hdr->mode = batch->mode;
+	hdr->operation = OP_ADD;
+
+	error = netlink_request(hdr, hdr->length, batch_response, NULL);
+	if (!error)
+		batch->total += batch->count;
+	batch->count = 0;
+	return error;
+}
+
+/**
+ * Returns an empty slot of "batch" fit for a "mode"/"l4_proto" entry, sending the pending entries
+ * first if they are of a different kind or there's no room left.
+ */
+static void *next_entry(struct file_batch *batch, __u16 mode, __u8 l4_proto, size_t entry_size,
+		int *error)
+{
+	void *entry;
+
+	if (batch->mode != mode || batch->l4_proto != l4_proto
+			|| sizeof(struct request_hdr) + (batch->count + 1) * entry_size > BATCH_MAX_LEN) {
+		*error = file_flush(batch);
+		if (*error)
+			return NULL;
+		batch->mode = mode;
+		batch->l4_proto = l4_proto;
+		batch->entry_size = entry_size;
+	}
+
+	entry = get_entry(batch, batch->count);
+	memset(entry, 0, entry_size);
+	batch->count++;
+	*error = 0;
+	return entry;
+}
+
+static int parse_pool6(struct file_batch *batch, char *prefix)
+{
+	union request_pool6 *entry;
+	int error;
+
+	entry = next_entry(batch, MODE_POOL6, 0, sizeof(*entry), &error);
+	if (!entry)
+		return error;
+
+	error = str_to_prefix(prefix, &entry->add.prefix);
+	if (error)
+		batch->count--;
+	return error;
+}
+
+static int parse_pool4(struct file_batch *batch, char *addr)
+{
+	union request_pool4 *entry;
+	int error;
+
+	entry = next_entry(batch, MODE_POOL4, 0, sizeof(*entry), &error);
+	if (!entry)
+		return error;
+
+	error = str_to_addr4(addr, &entry->add.addr);
+	if (error) {
+		batch->count--;
+		return error;
+	}
+	entry->add.addr_len = 32;
+	entry->add.port_min = 0;
+	entry->add.port_max = 65535;
+	return 0;
+}
+
+static int parse_eamt(struct file_batch *batch, char *prefix6, char *prefix4)
+{
+	union request_eamt *entry;
+	int error;
+
+	entry = next_entry(batch, MODE_EAMT, 0, sizeof(*entry), &error);
+	if (!entry)
+		return error;
+
+	error = str_to_eam_prefix6(prefix6, &entry->add.entry.prefix6);
+	if (!error)
+		error = str_to_prefix4(prefix4, &entry->add.entry.prefix4);
+	if (error)
+		batch->count--;
+	return error;
+}
+
+static int parse_bib(struct file_batch *batch, char *proto, char *addr6, char *addr4)
+{
+	struct request_bib *entry;
+	l4_protocol l4_proto;
+	int error;
+
+	if (strcmp(proto, "tcp") == 0) {
+		l4_proto = L4PROTO_TCP;
+	} else if (strcmp(proto, "udp") == 0) {
+		l4_proto = L4PROTO_UDP;
+	} else if (strcmp(proto, "icmp") == 0) {
+		l4_proto = L4PROTO_ICMP;
+	} else {
+		log_err("'%s' is not a protocol (expected tcp, udp or icmp).", proto);
+		return -EINVAL;
+	}
+
+	entry = next_entry(batch, MODE_BIB, l4_proto, sizeof(*entry), &error);
+	if (!entry)
+		return error;
+
+	entry->l4_proto = l4_proto;
+	error = str_to_addr6_port(addr6, &entry->add.addr6);
+	if (!error)
+		error = str_to_addr4_port(addr4, &entry->add.addr4);
+	if (error)
+		batch->count--;
+	return error;
+}
+
+int file_parse_line(struct file_batch *batch, char *line)
+{
+	char kind[16], arg1[64], arg2[64], arg3[64];
+	int args;
+
+	args = sscanf(line, "%15s %63s %63s %63s", kind, arg1, arg2, arg3);
+	if (args <= 0 || kind[0] == '#')
+		return 0;
+
+	if (strcmp(kind, "pool6") == 0 && args == 2)
+		return parse_pool6(batch, arg1);
+	if (strcmp(kind, "pool4") == 0 && args == 2)
+		return parse_pool4(batch, arg1);
+	if (strcmp(kind, "eamt") == 0 && args == 3)
+		return parse_eamt(batch, arg1, arg2);
+	if (strcmp(kind, "bib") == 0 && args == 4)
+		return parse_bib(batch, arg1, arg2, arg3);
+
+	log_err("Expected 'pool6 <prefix>', 'pool4 <address>', 'eamt <IPv6 prefix> <IPv4 prefix>' or "
+			"'bib <protocol> <IPv6 address>#<port> <IPv4 address>#<port>'.");
+	return -EINVAL;
+}
+
+int file_load(char *file_name)
+{
+	FILE *file;
+	char line[LINE_MAX_LEN];
+	struct file_batch batch;
+	unsigned int line_number = 0;
+	int error = 0;
+
+	file = fopen(file_name, "r");
+	if (!file) {
+		log_err("Could not open '%s'.", file_name);
+		return -errno;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		error = file_parse_line(&batch, line);
+		if (error) {
+			log_err("(Line %u of '%s'.)", line_number, file_name);
+			goto end;
+		}
+	}
+
+	error = file_flush(&batch);
+	/* Fall through. */
+
+end:
+	fclose(file);
+	log_info("%u entries were added.", batch.total);
+	return error;
+}
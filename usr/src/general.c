@@ -5,6 +5,26 @@
 #include <errno.h>
 
 
+static void print_pipeline_stats(struct pipeline_stats *stats)
+{
+	static const char *protos[] = { "IPv6 TCP", "IPv6 UDP", "IPv6 ICMP",
+			"IPv4 TCP", "IPv4 UDP", "IPv4 ICMP" };
+	static const char *stages[] = { "incoming tuple", "filtering", "outgoing tuple",
+			"translation", "sending" };
+	struct stage_stats *stage;
+	unsigned int p, s;
+
+	for (p = 0; p < STAGE_PROTOS; p++) {
+		for (s = 0; s < STAGE_COUNT; s++) {
+			stage = &stats->stages[p][s];
+			if (!stage->packets)
+				continue;
+			printf("%s packets, %s stage: %llu packets, %llu ns average\n", protos[p],
+					stages[s], stage->packets, stage->nsecs / stage->packets);
+		}
+	}
+}
+
 static int handle_display_response(struct nl_msg *msg, void *arg)
 {
 	struct response_general *conf = nlmsg_data(nlmsg_hdr(msg));
@@ -24,11 +44,55 @@ static int handle_display_response(struct nl_msg *msg, void *arg)
 	print_time_friendly(conf->sessiondb.ttl.tcp_est);
 	printf("TCP transitory session lifetime (--%s): ", TCP_TRANS_TIMEOUT_OPT);
 	print_time_friendly(conf->sessiondb.ttl.tcp_trans);
+	printf("TCP closed session lifetime (--%s): ", TCP_CLOSED_TIMEOUT_OPT);
+	if (conf->sessiondb.ttl.tcp_closed)
+		print_time_friendly(conf->sessiondb.ttl.tcp_closed);
+	else
+		printf("OFF (--%s applies)\n", TCP_TRANS_TIMEOUT_OPT);
+	for (i = 0; i < UDP_CLASSES; i++) {
+		if (!conf->sessiondb.udp_classes[i].port)
+			continue;
+		printf("UDP session lifetime, port %u (--%s): ",
+				conf->sessiondb.udp_classes[i].port, UDP_CLASS_TIMEOUT_OPT);
+		print_time_friendly(conf->sessiondb.udp_classes[i].ttl);
+	}
 	printf("ICMP session lifetime (--%s): ", ICMP_TIMEOUT_OPT);
 	print_time_friendly(conf->sessiondb.ttl.icmp);
+	printf("Session refresh granularity (--%s): %llu milliseconds\n", REFRESH_GRANULARITY_OPT,
+			conf->sessiondb.refresh_granularity);
+	printf("Session timer slack (--%s): %llu milliseconds\n", TIMER_SLACK_OPT,
+			conf->sessiondb.timer_slack);
+	printf("Maximum UDP sessions (--%s): %llu\n", MAX_SESSIONS_UDP_OPT,
+			conf->sessiondb.max_sessions.udp);
+	printf("Maximum TCP sessions (--%s): %llu\n", MAX_SESSIONS_TCP_OPT,
+			conf->sessiondb.max_sessions.tcp);
+	printf("Maximum ICMP sessions (--%s): %llu\n", MAX_SESSIONS_ICMP_OPT,
+			conf->sessiondb.max_sessions.icmp);
+	printf("Maximum sessions per IPv6 /%llu (--%s, --%s): %llu\n",
+			conf->sessiondb.session_prefix_len, SESSION_PREFIX_LEN_OPT, MAX_SESSIONS_PREFIX_OPT,
+			conf->sessiondb.max_sessions_per_prefix);
+	printf("Maximum new sessions per second per IPv6 /%llu (--%s): %llu\n",
+			conf->sessiondb.session_prefix_len, SESSION_RATE_PREFIX_OPT,
+			conf->sessiondb.session_rate_per_prefix);
+	printf("Sessions refused (table full): %llu\n", conf->sessiondb_stats.rejected_table_full);
+	printf("Sessions refused (prefix full): %llu\n", conf->sessiondb_stats.rejected_prefix_full);
+	printf("Sessions refused (prefix too fast): %llu\n",
+			conf->sessiondb_stats.rejected_prefix_rate);
+	printf("Embryonic TCP sessions dropped early: %llu\n", conf->sessiondb_stats.early_drops);
+	printf("Sessions reclaimed by the kernel: %llu\n", conf->sessiondb_stats.sessions_shrunk);
+	printf("Session purges in progress: %llu\n", conf->sessiondb_stats.purges_pending);
+	printf("Sessions purged: %llu\n", conf->sessiondb_stats.sessions_purged);
+	printf("TCP probes sent: %llu\n", conf->sessiondb_stats.probes_sent);
+	printf("TCP probes dropped: %llu\n", conf->sessiondb_stats.probes_dropped);
+	printf("Sessions expired: %llu\n", conf->sessiondb_stats.sessions_expired);
+	printf("Time spent expiring sessions: %llu ns\n", conf->sessiondb_stats.expire_nsecs);
 
 	printf("Maximum number of stored packets (--%s): %llu\n", STORED_PKTS_OPT,
 			conf->pktqueue.max_pkts);
+	printf("Maximum number of stored packets per source (--%s): %llu\n", STORED_PKTS_SRC_OPT,
+			conf->pktqueue.max_pkts_per_src);
+	printf("Maximum number of stored packets per pool4 address (--%s): %llu\n",
+			STORED_PKTS_POOL4_OPT, conf->pktqueue.max_pkts_per_pool4);
 
 	printf("Override IPv6 traffic class (--%s): %s\n", RESET_TCLASS_OPT,
 			conf->translate.reset_traffic_class ? "ON" : "OFF");
@@ -53,8 +117,33 @@ static int handle_display_response(struct nl_msg *msg, void *arg)
 	}
 
 	printf("Minimum IPv6 MTU (--%s): %u\n", MIN_IPV6_MTU_OPT, conf->sendpkt.min_ipv6_mtu);
+	printf("Clamp TCP MSS (--%s): %s\n", CLAMP_MSS_OPT,
+			conf->translate.clamp_mss ? "ON" : "OFF");
+	printf("Transmit directly to the neighbour (--%s): %s\n", DIRECT_XMIT_OPT,
+			conf->sendpkt.direct_xmit ? "ON" : "OFF");
 	printf("Fragments arrival time slot (--%s): ", FRAG_TIMEOUT_OPT);
 	print_time_friendly(conf->fragmentation.fragment_timeout);
+	printf("Fragment memory high threshold (--%s): %llu bytes\n", FRAG_HIGH_THRESH_OPT,
+			conf->fragmentation.high_thresh);
+	printf("Fragment memory low threshold (--%s): %llu bytes\n", FRAG_LOW_THRESH_OPT,
+			conf->fragmentation.low_thresh);
+	printf("Forward fragments early (--%s): %s\n", FRAG_FORWARD_EARLY_OPT,
+			conf->fragmentation.forward_early ? "ON" : "OFF");
+	printf("Bytes of fragments queued: %llu\n", conf->fragmentation_stats.bytes_queued);
+	printf("Incomplete packets evicted: %llu\n", conf->fragmentation_stats.evictions);
+	printf("ICMP errors sent: %llu\n", conf->icmp_stats.errors_sent);
+	printf("ICMP errors suppressed: %llu\n", conf->icmp_stats.errors_suppressed);
+	printf("BIB/session events sent: %llu\n", conf->dbevent_stats.events_sent);
+	printf("BIB/session events dropped: %llu\n", conf->dbevent_stats.events_dropped);
+	printf("Mapping log records written: %llu\n", conf->dbevent_stats.records_logged);
+	printf("Mapping log records dropped: %llu\n", conf->dbevent_stats.records_dropped);
+	printf("IPFIX records sent: %llu\n", conf->dbevent_stats.ipfix_records_sent);
+	printf("IPFIX records dropped: %llu\n", conf->dbevent_stats.ipfix_records_dropped);
+	printf("BIB/session events imported: %llu\n", conf->dbevent_stats.events_imported);
+	printf("BIB/session events rejected: %llu\n", conf->dbevent_stats.events_rejected);
+	print_pipeline_stats(&conf->pipeline_stats);
+	printf("Measure translation times (--%s): %s\n", LOGTIME_ENABLED_OPT,
+			conf->logtime.enabled ? "ON" : "OFF");
 
 	return 0;
 }
@@ -75,29 +164,28 @@ static int handle_update_response(struct nl_msg *msg, void *arg)
 	return 0;
 }
 
-int general_update(enum general_module module, __u8 type, size_t size, void *data)
+int general_update(void *records, size_t len, __u16 count)
 {
 	struct request_hdr *main_hdr;
 	union request_general *general_hdr;
 	void *payload;
-	size_t len;
+	size_t total_len;
 	int result;
 
-	len = sizeof(*main_hdr) + sizeof(*general_hdr) + size;
-	main_hdr = malloc(len);
+	total_len = sizeof(*main_hdr) + sizeof(*general_hdr) + len;
+	main_hdr = malloc(total_len);
 	if (!main_hdr)
 		return -ENOMEM;
 	general_hdr = (union request_general *) (main_hdr + 1);
 	payload = general_hdr + 1;
 
-	main_hdr->length = len;
+	main_hdr->length = total_len;
 	main_hdr->mode = MODE_GENERAL;
 	main_hdr->operation = OP_UPDATE;
-	general_hdr->update.module = module;
-	general_hdr->update.type = type;
-	memcpy(payload, data, size);
+	general_hdr->update.count = count;
+	memcpy(payload, records, len);
 
-	result = netlink_request(main_hdr, len, handle_update_response, NULL);
+	result = netlink_request(main_hdr, total_len, handle_update_response, NULL);
 	free(main_hdr);
 	return result;
 }
@@ -20,12 +20,17 @@
 #include "nat64/usr/types.h"
 #include "nat64/usr/pool6.h"
 #include "nat64/usr/pool4.h"
+#include "nat64/usr/eam.h"
 #include "nat64/usr/bib.h"
 #include "nat64/usr/session.h"
 #include "nat64/usr/general.h"
-#ifdef BENCHMARK
+#include "nat64/usr/file.h"
 #include "nat64/usr/log_time.h"
-#endif
+#include "nat64/usr/stats.h"
+#include "nat64/usr/sync.h"
+#include "nat64/usr/replay.h"
+#include "nat64/usr/changes.h"
+#include "nat64/usr/daemon.h"
 
 
 const char *argp_program_version = "3.2.2";
@@ -38,6 +43,11 @@ struct arguments {
 	enum config_mode mode;
 	enum config_operation op;
 
+	/** If not NULL, the user wants to add the contents of this file, and nothing else. */
+	char *file;
+	/** If not NULL, the user wants to serve the commands sent to this UNIX socket. */
+	char *listen;
+
 	struct {
 		/* This is actually only common to the pools; the tables don't use it. */
 		bool quick;
@@ -50,12 +60,37 @@ struct arguments {
 		struct {
 			struct in_addr addr;
 			bool addr_set;
+
+			/* Deterministic ranges. */
+			struct ipv6_prefix det_prefix;
+			bool det_prefix_set;
+			__u8 range_len;
+			bool range_len_set;
+			__u8 subscriber_len;
+			bool subscriber_len_set;
+
+			/* Lazy ranges. */
+			__u16 port_min;
+			__u16 port_max;
+			bool ports_set;
+			__u16 psid;
+			__u8 psid_len;
+			bool psid_set;
+			__u8 psid_offset;
+			bool psid_offset_set;
 		} pool4;
 
+		struct {
+			struct ipv6_prefix prefix6;
+			bool prefix6_set;
+			struct ipv4_prefix prefix4;
+			bool prefix4_set;
+		} eamt;
+
 		struct {
 			bool tcp, udp, icmp;
 			bool numeric_hostname;
-			bool csv_format;
+			enum display_format format;
 
 			struct {
 				struct ipv6_transport_addr addr6;
@@ -63,15 +98,41 @@ struct arguments {
 				struct ipv4_transport_addr addr4;
 				bool addr4_set;
 			} bib;
+
+			/** Session display filter; its flags tell which fields were set. */
+			struct session_filter filter;
 		} tables;
 
 	} db;
 
 	struct {
-		enum general_module module;
-		__u8 type;
-		size_t size;
-		void *data;
+		/** Dump the current sessions and exit, instead of following the events? */
+		bool snapshot;
+	} sync;
+
+	struct {
+		/** Print how full the tables are, instead of the packet counters? */
+		bool occupancy;
+		/** Print how much memory the subsystems use, instead of the packet counters? */
+		bool memory;
+	} stats;
+
+	struct {
+		/** Number of times the capture is pushed through the translator. */
+		unsigned int repeat;
+		bool repeat_set;
+	} replay;
+
+	struct {
+		/** Only print the changes that came after this generation. */
+		__u64 since;
+	} changes;
+
+	struct {
+		/** The struct general_record list that will be sent to the kernel. */
+		void *records;
+		size_t len;
+		__u16 count;
 	} general;
 };
 
@@ -84,10 +145,13 @@ enum argp_flags {
 	ARGP_POOL4 = '4',
 	ARGP_BIB = 'b',
 	ARGP_SESSION = 's',
-#ifdef BENCHMARK
 	ARGP_LOGTIME = 'l',
-#endif
 	ARGP_GENERAL = 'g',
+	ARGP_STATS = 'S',
+	ARGP_SYNC = 5010,
+	ARGP_REPLAY = 5011,
+	ARGP_CHANGES = 5012,
+	ARGP_EAMT = 'e',
 
 	/* Operations */
 	ARGP_DISPLAY = 'd',
@@ -96,10 +160,20 @@ enum argp_flags {
 	ARGP_UPDATE = 5000,
 	ARGP_REMOVE = 'r',
 	ARGP_FLUSH = 'f',
+	ARGP_FILE = 5001,
+	ARGP_LISTEN = 5002,
 
 	/* Pools */
 	ARGP_PREFIX = 1000,
 	ARGP_ADDRESS = 1001,
+	ARGP_DET_PREFIX = 1002,
+	ARGP_RANGE_LEN = 1003,
+	ARGP_SUBSCRIBER_LEN = 1004,
+	ARGP_PORTS = 1005,
+	ARGP_EAM6 = 1006,
+	ARGP_EAM4 = 1007,
+	ARGP_PSID = 1008,
+	ARGP_PSID_OFFSET = 1009,
 	ARGP_QUICK = 'q',
 
 	/* BIB, session */
@@ -108,8 +182,27 @@ enum argp_flags {
 	ARGP_ICMP = 'i',
 	ARGP_NUMERIC_HOSTNAME = 'n',
 	ARGP_CSV = 2022,
+	ARGP_JSON = 2023,
 	ARGP_BIB_IPV6 = 2020,
 	ARGP_BIB_IPV4 = 2021,
+	ARGP_FILTER6 = 2024,
+	ARGP_FILTER4 = 2025,
+	ARGP_FILTER_PORTS = 2026,
+	ARGP_FILTER_STATE = 2027,
+	ARGP_FILTER_IDLE = 2028,
+
+	/* Sync */
+	ARGP_SNAPSHOT = 2030,
+
+	/* Stats */
+	ARGP_OCCUPANCY = 2040,
+	ARGP_MEMORY = 2041,
+
+	/* Replay */
+	ARGP_REPEAT = 2050,
+
+	/* Changes */
+	ARGP_SINCE = 2060,
 
 	/* General */
 	ARGP_DROP_ADDR = 3000,
@@ -120,6 +213,18 @@ enum argp_flags {
 	ARGP_TCP_TO = 3012,
 	ARGP_TCP_TRANS_TO = 3013,
 	ARGP_STORED_PKTS = 3014,
+	ARGP_REFRESH_GRANULARITY = 3015,
+	ARGP_MAX_SESSIONS_UDP = 3016,
+	ARGP_MAX_SESSIONS_TCP = 3017,
+	ARGP_MAX_SESSIONS_ICMP = 3018,
+	ARGP_MAX_SESSIONS_PREFIX = 3019,
+	ARGP_SESSION_PREFIX_LEN = 3020,
+	ARGP_STORED_PKTS_SRC = 3021,
+	ARGP_STORED_PKTS_POOL4 = 3022,
+	ARGP_UDP_CLASS_TO = 3023,
+	ARGP_SESSION_RATE_PREFIX = 3024,
+	ARGP_TCP_CLOSED_TO = 3025,
+	ARGP_TIMER_SLACK = 3026,
 	ARGP_RESET_TCLASS = 4002,
 	ARGP_RESET_TOS = 4003,
 	ARGP_NEW_TOS = 4004,
@@ -129,15 +234,28 @@ enum argp_flags {
 	ARGP_PLATEAUS = 4010,
 	ARGP_MIN_IPV6_MTU = 4011,
 	ARGP_FRAG_TO = 4012,
+	ARGP_FRAG_HIGH_THRESH = 4013,
+	ARGP_FRAG_LOW_THRESH = 4014,
+	ARGP_FRAG_FORWARD_EARLY = 4015,
+	ARGP_DIRECT_XMIT = 4016,
+	ARGP_LOGTIME_ENABLED = 4017,
+	ARGP_CLAMP_MSS = 4018,
 };
 
 #define NUM_FORMAT "NUM"
 #define PREFIX_FORMAT "ADDR6/NUM"
+#define PREFIX4_FORMAT "ADDR4/NUM"
 #define IPV6_TRANSPORT_FORMAT "ADDR6#NUM"
 #define IPV4_TRANSPORT_FORMAT "ADDR4#NUM"
 #define IPV4_ADDR_FORMAT "ADDR4"
 #define BOOL_FORMAT "BOOL"
 #define NUM_ARR_FORMAT "NUM[,NUM]*"
+#define PORT_RANGE_FORMAT "NUM-NUM"
+#define PSID_FORMAT "NUM/NUM"
+#define PORT_TIMEOUT_FORMAT "NUM=NUM"
+#define FILE_FORMAT "FILE"
+#define SOCKET_FORMAT "SOCKET"
+#define STATE_FORMAT "STATE"
 
 
 /*
@@ -151,11 +269,18 @@ static struct argp_option options[] =
 	{ "pool4", ARGP_POOL4, NULL, 0, "The command will operate on the IPv4 pool." },
 	{ "bib", ARGP_BIB, NULL, 0, "The command will operate on the BIBs." },
 	{ "session", ARGP_SESSION, NULL, 0, "The command will operate on the session tables." },
-#ifdef BENCHMARK
 	{ "logTime", ARGP_LOGTIME, NULL, 0, "The command will operate on the logs times database."},
-#endif
 	{ "general", ARGP_GENERAL, NULL, 0, "The command will operate on miscellaneous configuration "
 			"values (default)." },
+	{ "stats", ARGP_STATS, NULL, 0, "The command will operate on Jool's packet counters." },
+	{ "sync", ARGP_SYNC, NULL, 0, "The command will stream Jool's BIB and session events to "
+			"standard output (display), or install a peer's from standard input (add)." },
+	{ "eamt", ARGP_EAMT, NULL, 0, "The command will operate on the Explicit Address Mapping "
+			"Table (SIIT mode only)." },
+	{ "replay", ARGP_REPLAY, NULL, 0, "The command will push the packets of the pcap capture "
+			"read from standard input through the translator, as fast as it can." },
+	{ "changes", ARGP_CHANGES, NULL, 0, "The command will operate on the log of the latest BIB "
+			"and session changes." },
 
 	{ NULL, 0, NULL, 0, "Operations:", 2 },
 	{ "display", ARGP_DISPLAY, NULL, 0, "Print the target (default)." },
@@ -164,6 +289,10 @@ static struct argp_option options[] =
 	{ "update", ARGP_UPDATE, NULL, 0, "Change something in the target." },
 	{ "remove", ARGP_REMOVE, NULL, 0, "Remove an element from the target." },
 	{ "flush", ARGP_FLUSH, NULL, 0, "Clear the target." },
+	{ "file", ARGP_FILE, FILE_FORMAT, 0, "Add the pool6 prefixes, pool4 addresses, EAMT entries "
+			"and static BIB entries listed in FILE, in batches." },
+	{ "listen", ARGP_LISTEN, SOCKET_FORMAT, 0, "Keep running, and execute the commands written "
+			"to the UNIX socket SOCKET, over a single connection to the kernel." },
 
 	{ NULL, 0, NULL, 0, "IPv4 and IPv6 Pool options:", 3 },
 	{ "quick", ARGP_QUICK, NULL, 0, "Do not clean the BIB and/or session tables after removing. "
@@ -176,6 +305,29 @@ static struct argp_option options[] =
 	{ NULL, 0, NULL, 0, "IPv4 Pool-only options:", 5 },
 	{ "address", ARGP_ADDRESS, IPV4_ADDR_FORMAT, 0, "Address to be added or removed. "
 			"Available on add and remove operations only." },
+	{ "deterministic", ARGP_DET_PREFIX, PREFIX_FORMAT, 0, "Map the added addresses' ports "
+			"arithmetically to the nodes of this IPv6 prefix, instead of lending them on demand. "
+			"Available on add operation only." },
+	{ "range-len", ARGP_RANGE_LEN, NUM_FORMAT, 0, "Add or remove --address/NUM instead of just "
+			"--address. Available on add and remove operations only. Default: 32." },
+	{ "subscriber-len", ARGP_SUBSCRIBER_LEN, NUM_FORMAT, 0, "Length of the prefix that "
+			"identifies one --deterministic node. "
+			"Available on deterministic add operation only. Default: 128." },
+	{ "ports", ARGP_PORTS, PORT_RANGE_FORMAT, 0, "Only lend the added addresses' ports (and ICMP "
+			"IDs) from this range. Available on non-deterministic add operation only. "
+			"Default: 0-65535." },
+	{ "psid", ARGP_PSID, PSID_FORMAT, 0, "Only lend the added addresses' ports (and ICMP IDs) "
+			"from this MAP Port Set Identifier (value/length). Available on non-deterministic "
+			"add operation only, and cannot be combined with --ports." },
+	{ "psid-offset", ARGP_PSID_OFFSET, NUM_FORMAT, 0, "Number of bits that precede the --psid "
+			"in the port. Available on PSID add operation only. Default: 6." },
+
+	{ NULL, 0, NULL, 0, "EAMT-only options:", 5 },
+	{ "eam6", ARGP_EAM6, PREFIX_FORMAT, 0, "The IPv6 side of the entry to be added or removed. "
+			"Available on add and remove operations only." },
+	{ "eam4", ARGP_EAM4, PREFIX4_FORMAT, 0, "The IPv4 side of the entry to be added or removed. "
+			"Its suffix must be as long as --eam6's. "
+			"Available on add and remove operations only." },
 
 	{ NULL, 0, NULL, 0, "BIB & Session options:", 6 },
 	{ "icmp", ARGP_ICMP, NULL, 0, "Operate on the ICMP table." },
@@ -185,6 +337,8 @@ static struct argp_option options[] =
 			"Available on display operation only." },
 	{ "csv", ARGP_CSV, NULL, 0, "Print in CSV format. "
 			"Available on display operation only."},
+	{ "json", ARGP_JSON, NULL, 0, "Print one JSON object per entry and line. Addresses are not "
+			"resolved. Available on display operation only."},
 
 	{ NULL, 0, NULL, 0, "BIB-only options:", 7 },
 	{ "bib6", ARGP_BIB_IPV6, IPV6_TRANSPORT_FORMAT, 0,
@@ -194,7 +348,39 @@ static struct argp_option options[] =
 			"This is the local IPv4 addres#port of the entry to be added or removed. "
 			"Available on add and remove operations only." },
 
-	{ NULL, 0, NULL, 0, "'General' options:", 8 },
+	{ NULL, 0, NULL, 0, "Session-only options:", 8 },
+	{ "filter6", ARGP_FILTER6, PREFIX_FORMAT, 0, "Only display the sessions whose remote IPv6 "
+			"address belongs to this prefix. Available on display operation only." },
+	{ "filter4", ARGP_FILTER4, IPV4_ADDR_FORMAT, 0, "Only display the sessions whose local IPv4 "
+			"address is this one. Available on display operation only." },
+	{ "filter-ports", ARGP_FILTER_PORTS, PORT_RANGE_FORMAT, 0, "Only display the sessions whose "
+			"local IPv4 port (or ICMP ID) belongs to this range. "
+			"Available on display operation only." },
+	{ "filter-state", ARGP_FILTER_STATE, STATE_FORMAT, 0, "Only display the TCP sessions that "
+			"are in this state (eg. ESTABLISHED). Available on display operation only." },
+	{ "filter-idle", ARGP_FILTER_IDLE, NUM_FORMAT, 0, "Only display the sessions which have not "
+			"seen traffic in at least this many milliseconds. "
+			"Available on display operation only." },
+
+	{ NULL, 0, NULL, 0, "Sync-only options:", 9 },
+	{ "snapshot", ARGP_SNAPSHOT, NULL, 0, "Write the current sessions to standard output and "
+			"exit, instead of following the events. Available on display operation only." },
+
+	{ NULL, 0, NULL, 0, "Stats-only options:", 10 },
+	{ "occupancy", ARGP_OCCUPANCY, NULL, 0, "Print how full the BIB, session and pool4 tables "
+			"are, instead of the packet counters. Available on display operation only." },
+	{ "memory", ARGP_MEMORY, NULL, 0, "Print how many bytes each subsystem is using, instead "
+			"of the packet counters. Available on display operation only." },
+
+	{ NULL, 0, NULL, 0, "Replay-only options:", 12 },
+	{ "repeat", ARGP_REPEAT, NUM_FORMAT, 0, "Push the capture through this many times "
+			"(default: 1)." },
+
+	{ NULL, 0, NULL, 0, "Changes-only options:", 13 },
+	{ "since", ARGP_SINCE, NUM_FORMAT, 0, "Only print the changes that came after this "
+			"generation (default: 0). Available on display operation only." },
+
+	{ NULL, 0, NULL, 0, "'General' options:", 11 },
 	{ DROP_BY_ADDR_OPT, ARGP_DROP_ADDR, BOOL_FORMAT, 0,
 			"Use Address-Dependent Filtering?" },
 	{ DROP_ICMP6_INFO_OPT, ARGP_DROP_INFO, BOOL_FORMAT, 0,
@@ -203,15 +389,47 @@ static struct argp_option options[] =
 			"Drop externally initiated TCP connections?" },
 	{ UDP_TIMEOUT_OPT, ARGP_UDP_TO, NUM_FORMAT, 0,
 			"Set the timeout for UDP sessions." },
+	{ UDP_CLASS_TIMEOUT_OPT, ARGP_UDP_CLASS_TO, PORT_TIMEOUT_FORMAT, 0,
+			"Set the timeout for UDP sessions whose remote IPv4 port is the first "
+			"number. Zero seconds reverts the port to --" UDP_TIMEOUT_OPT "." },
 	{ ICMP_TIMEOUT_OPT, ARGP_ICMP_TO, NUM_FORMAT, 0,
 			"Set the timeout for ICMP sessions." },
 	{ TCP_EST_TIMEOUT_OPT, ARGP_TCP_TO, NUM_FORMAT, 0,
 			"Set the established connection idle-timeout for TCP sessions." },
 	{ TCP_TRANS_TIMEOUT_OPT, ARGP_TCP_TRANS_TO, NUM_FORMAT, 0,
 			"Set the transitory connection idle-timeout for TCP sessions." },
+	{ TCP_CLOSED_TIMEOUT_OPT, ARGP_TCP_CLOSED_TO, NUM_FORMAT, 0,
+			"Set the timeout for TCP sessions closed by a RST or by both FINs. "
+			"Zero leaves them to --" TCP_TRANS_TIMEOUT_OPT "." },
+	{ REFRESH_GRANULARITY_OPT, ARGP_REFRESH_GRANULARITY, NUM_FORMAT, 0,
+			"Set the minimum interval (in milliseconds) between refreshes of a session's "
+			"lifetime. Zero refreshes on every packet." },
+	{ TIMER_SLACK_OPT, ARGP_TIMER_SLACK, NUM_FORMAT, 0,
+			"Set the interval (in milliseconds) the session timers are aligned to. "
+			"Zero programs them to the jiffy." },
+	{ MAX_SESSIONS_UDP_OPT, ARGP_MAX_SESSIONS_UDP, NUM_FORMAT, 0,
+			"Set the maximum number of UDP sessions. Zero means unlimited." },
+	{ MAX_SESSIONS_TCP_OPT, ARGP_MAX_SESSIONS_TCP, NUM_FORMAT, 0,
+			"Set the maximum number of TCP sessions. Zero means unlimited." },
+	{ MAX_SESSIONS_ICMP_OPT, ARGP_MAX_SESSIONS_ICMP, NUM_FORMAT, 0,
+			"Set the maximum number of ICMP sessions. Zero means unlimited." },
+	{ MAX_SESSIONS_PREFIX_OPT, ARGP_MAX_SESSIONS_PREFIX, NUM_FORMAT, 0,
+			"Set the maximum number of sessions a remote IPv6 prefix can own. "
+			"Zero means unlimited." },
+	{ SESSION_PREFIX_LEN_OPT, ARGP_SESSION_PREFIX_LEN, NUM_FORMAT, 0,
+			"Set the length of the prefixes --" MAX_SESSIONS_PREFIX_OPT " is enforced on." },
+	{ SESSION_RATE_PREFIX_OPT, ARGP_SESSION_RATE_PREFIX, NUM_FORMAT, 0,
+			"Set the maximum number of sessions per second a remote IPv6 prefix can "
+			"start. Zero means unlimited." },
 	{ STORED_PKTS_OPT, ARGP_STORED_PKTS, NUM_FORMAT, 0,
 			"Set the maximum number of packets Jool should bother to remember while awaiting "
 			"simultaneous open of TCP connections." },
+	{ STORED_PKTS_SRC_OPT, ARGP_STORED_PKTS_SRC, NUM_FORMAT, 0,
+			"Set the maximum number of stored packets a single IPv4 node can own. "
+			"Zero means unlimited." },
+	{ STORED_PKTS_POOL4_OPT, ARGP_STORED_PKTS_POOL4, NUM_FORMAT, 0,
+			"Set the maximum number of stored packets a single pool4 address can own. "
+			"Zero means unlimited." },
 	{ RESET_TCLASS_OPT, ARGP_RESET_TCLASS, BOOL_FORMAT, 0,
 			"Override IPv6 Traffic class?" },
 	{ RESET_TOS_OPT, ARGP_RESET_TOS, BOOL_FORMAT, 0,
@@ -228,8 +446,23 @@ static struct argp_option options[] =
 			"Set the MTU plateaus." },
 	{ MIN_IPV6_MTU_OPT, ARGP_MIN_IPV6_MTU, NUM_FORMAT, 0,
 			"Set the Minimum IPv6 MTU." },
+	{ CLAMP_MSS_OPT, ARGP_CLAMP_MSS, BOOL_FORMAT, 0,
+			"Lower the MSS of TCP SYNs so the segments fit in the Minimum IPv6 MTU?" },
+	{ DIRECT_XMIT_OPT, ARGP_DIRECT_XMIT, BOOL_FORMAT, 0,
+			"Send translated packets straight to the next hop, skipping Netfilter's LOCAL_OUT "
+			"and POST_ROUTING hooks (and conntrack)?" },
 	{ FRAG_TIMEOUT_OPT, ARGP_FRAG_TO, NUM_FORMAT, 0,
 			"Set the timeout for arrival of fragments." },
+	{ FRAG_HIGH_THRESH_OPT, ARGP_FRAG_HIGH_THRESH, NUM_FORMAT, 0,
+			"Set the number of bytes queued fragments can take up before the oldest ones are "
+			"evicted. Zero means unlimited." },
+	{ FRAG_LOW_THRESH_OPT, ARGP_FRAG_LOW_THRESH, NUM_FORMAT, 0,
+			"Set the number of bytes eviction shrinks the queued fragments back to." },
+	{ FRAG_FORWARD_EARLY_OPT, ARGP_FRAG_FORWARD_EARLY, BOOL_FORMAT, 0,
+			"Translate TCP and UDP fragments as they arrive, instead of waiting for the whole "
+			"packet?" },
+	{ LOGTIME_ENABLED_OPT, ARGP_LOGTIME_ENABLED, BOOL_FORMAT, 0,
+			"Measure how long every packet takes to be translated? (See --logTime.)" },
 
 	{ NULL },
 };
@@ -260,23 +493,34 @@ fail:
 static int set_general_arg(struct arguments *args, enum general_module module, __u8 type,
 		size_t size, void *value)
 {
+	struct general_record *record;
+	size_t record_len;
+	void *records;
 	int error = update_state(args, MODE_GENERAL, OP_UPDATE);
 	if (error)
 		return error;
 
-	if (args->general.data) {
-		log_err("You can only edit one configuration value at a time.");
+	if (size > MAX_U16) {
+		log_err("The value is too big.");
 		return -EINVAL;
 	}
 
-	args->general.module = module;
-	args->general.type = type;
-	args->general.size = size;
-	args->general.data = malloc(size);
-	if (!args->general.data)
+	/* Several values can be edited at once; they are all sent in the same request. */
+	record_len = GENERAL_RECORD_LEN(size);
+	records = realloc(args->general.records, args->general.len + record_len);
+	if (!records)
 		return -ENOMEM;
-	memcpy(args->general.data, value, size);
+	args->general.records = records;
+
+	record = (struct general_record *) ((char *) records + args->general.len);
+	memset(record, 0, record_len);
+	record->module = module;
+	record->type = type;
+	record->size = size;
+	memcpy(record + 1, value, size);
 
+	args->general.len += record_len;
+	args->general.count++;
 	return 0;
 }
 
@@ -333,6 +577,21 @@ static int set_general_u64(struct arguments *args, enum general_module module, _
 	return set_general_arg(args, module, type, sizeof(tmp), &tmp);
 }
 
+static int set_general_udp_class(struct arguments *args, char *value)
+{
+	__u16 port;
+	__u64 seconds;
+	__u64 tmp;
+	int error;
+
+	error = str_to_port_timeout(value, &port, &seconds);
+	if (error)
+		return error;
+	tmp = ((__u64) port << 32) | (seconds * 1000);
+
+	return set_general_arg(args, SESSIONDB, UDP_CLASS_TIMEOUT, sizeof(tmp), &tmp);
+}
+
 static int set_general_u16_array(struct arguments *args, enum general_module module, int type,
 		char *value)
 {
@@ -355,6 +614,7 @@ static int set_general_u16_array(struct arguments *args, enum general_module mod
 static int parse_opt(int key, char *str, struct argp_state *state)
 {
 	struct arguments *args = state->input;
+	__u64 tmp;
 	int error = 0;
 
 	switch (key) {
@@ -370,14 +630,27 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_SESSION:
 		error = update_state(args, MODE_SESSION, SESSION_OPS);
 		break;
-#ifdef BENCHMARK
 	case ARGP_LOGTIME:
 		error = update_state(args, MODE_LOGTIME, LOGTIME_OPS);
 		break;
-#endif
 	case ARGP_GENERAL:
 		error = update_state(args, MODE_GENERAL, GENERAL_OPS);
 		break;
+	case ARGP_STATS:
+		error = update_state(args, MODE_STATS, STATS_OPS);
+		break;
+	case ARGP_SYNC:
+		error = update_state(args, MODE_SYNC, SYNC_OPS);
+		break;
+	case ARGP_EAMT:
+		error = update_state(args, MODE_EAMT, EAMT_OPS);
+		break;
+	case ARGP_REPLAY:
+		error = update_state(args, MODE_REPLAY, REPLAY_OPS);
+		break;
+	case ARGP_CHANGES:
+		error = update_state(args, MODE_CHANGES, CHANGES_OPS);
+		break;
 
 	case ARGP_DISPLAY:
 		error = update_state(args, DISPLAY_MODES, OP_DISPLAY);
@@ -397,6 +670,12 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_FLUSH:
 		error = update_state(args, FLUSH_MODES, OP_FLUSH);
 		break;
+	case ARGP_FILE:
+		args->file = str;
+		break;
+	case ARGP_LISTEN:
+		args->listen = str;
+		break;
 
 	case ARGP_UDP:
 		error = update_state(args, MODE_BIB | MODE_SESSION, BIB_OPS | SESSION_OPS);
@@ -416,7 +695,48 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		break;
 	case ARGP_CSV:
 		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
-		args->db.tables.csv_format = true;
+		args->db.tables.format = FORMAT_CSV;
+		break;
+	case ARGP_JSON:
+		error = update_state(args, MODE_BIB | MODE_SESSION, OP_DISPLAY);
+		args->db.tables.format = FORMAT_JSON;
+		break;
+	case ARGP_FILTER6:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (error)
+			return error;
+		error = str_to_prefix(str, &args->db.tables.filter.prefix6);
+		args->db.tables.filter.flags |= SFILTER_PREFIX6;
+		break;
+	case ARGP_FILTER4:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (error)
+			return error;
+		error = str_to_addr4(str, &args->db.tables.filter.addr4);
+		args->db.tables.filter.flags |= SFILTER_ADDR4;
+		break;
+	case ARGP_FILTER_PORTS:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (error)
+			return error;
+		error = str_to_port_range(str, &args->db.tables.filter.port_min,
+				&args->db.tables.filter.port_max);
+		args->db.tables.filter.flags |= SFILTER_PORTS;
+		break;
+	case ARGP_FILTER_STATE:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (error)
+			return error;
+		error = str_to_tcp_state(str, &args->db.tables.filter.state);
+		args->db.tables.filter.flags |= SFILTER_STATE;
+		break;
+	case ARGP_FILTER_IDLE:
+		error = update_state(args, MODE_SESSION, OP_DISPLAY);
+		if (error)
+			return error;
+		error = str_to_u64(str, &tmp, 0, MAX_U32);
+		args->db.tables.filter.min_idle = tmp;
+		args->db.tables.filter.flags |= SFILTER_IDLE;
 		break;
 
 	case ARGP_ADDRESS:
@@ -426,6 +746,48 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		error = str_to_addr4(str, &args->db.pool4.addr);
 		args->db.pool4.addr_set = true;
 		break;
+	case ARGP_DET_PREFIX:
+		error = update_state(args, MODE_POOL4, OP_ADD);
+		if (error)
+			return error;
+		error = str_to_prefix(str, &args->db.pool4.det_prefix);
+		args->db.pool4.det_prefix_set = true;
+		break;
+	case ARGP_RANGE_LEN:
+		error = update_state(args, MODE_POOL4, OP_ADD | OP_REMOVE);
+		if (error)
+			return error;
+		error = str_to_u8(str, &args->db.pool4.range_len, 0, 32);
+		args->db.pool4.range_len_set = true;
+		break;
+	case ARGP_SUBSCRIBER_LEN:
+		error = update_state(args, MODE_POOL4, OP_ADD);
+		if (error)
+			return error;
+		error = str_to_u8(str, &args->db.pool4.subscriber_len, 0, 128);
+		args->db.pool4.subscriber_len_set = true;
+		break;
+	case ARGP_PORTS:
+		error = update_state(args, MODE_POOL4, OP_ADD);
+		if (error)
+			return error;
+		error = str_to_port_range(str, &args->db.pool4.port_min, &args->db.pool4.port_max);
+		args->db.pool4.ports_set = true;
+		break;
+	case ARGP_PSID:
+		error = update_state(args, MODE_POOL4, OP_ADD);
+		if (error)
+			return error;
+		error = str_to_psid(str, &args->db.pool4.psid, &args->db.pool4.psid_len);
+		args->db.pool4.psid_set = true;
+		break;
+	case ARGP_PSID_OFFSET:
+		error = update_state(args, MODE_POOL4, OP_ADD);
+		if (error)
+			return error;
+		error = str_to_u8(str, &args->db.pool4.psid_offset, 0, 15);
+		args->db.pool4.psid_offset_set = true;
+		break;
 	case ARGP_PREFIX:
 		error = update_state(args, MODE_POOL6, OP_ADD | OP_REMOVE);
 		if (error)
@@ -433,6 +795,20 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		error = str_to_prefix(str, &args->db.pool6.prefix);
 		args->db.pool6.prefix_set = true;
 		break;
+	case ARGP_EAM6:
+		error = update_state(args, MODE_EAMT, OP_ADD | OP_REMOVE);
+		if (error)
+			return error;
+		error = str_to_eam_prefix6(str, &args->db.eamt.prefix6);
+		args->db.eamt.prefix6_set = true;
+		break;
+	case ARGP_EAM4:
+		error = update_state(args, MODE_EAMT, OP_ADD | OP_REMOVE);
+		if (error)
+			return error;
+		error = str_to_prefix4(str, &args->db.eamt.prefix4);
+		args->db.eamt.prefix4_set = true;
+		break;
 	case ARGP_QUICK:
 		error = update_state(args, MODE_POOL6 | MODE_POOL4, OP_REMOVE | OP_FLUSH);
 		args->db.quick = true;
@@ -453,6 +829,36 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		args->db.tables.bib.addr4_set = true;
 		break;
 
+	case ARGP_SNAPSHOT:
+		error = update_state(args, MODE_SYNC, OP_DISPLAY);
+		args->sync.snapshot = true;
+		break;
+
+	case ARGP_OCCUPANCY:
+		error = update_state(args, MODE_STATS, OP_DISPLAY);
+		args->stats.occupancy = true;
+		break;
+	case ARGP_MEMORY:
+		error = update_state(args, MODE_STATS, OP_DISPLAY);
+		args->stats.memory = true;
+		break;
+
+	case ARGP_REPEAT:
+		error = update_state(args, MODE_REPLAY, REPLAY_OPS);
+		if (error)
+			return error;
+		error = str_to_u64(str, &tmp, 1, MAX_U32);
+		args->replay.repeat = tmp;
+		args->replay.repeat_set = true;
+		break;
+
+	case ARGP_SINCE:
+		error = update_state(args, MODE_CHANGES, OP_DISPLAY);
+		if (error)
+			return error;
+		error = str_to_u64(str, &args->changes.since, 0, MAX_U64);
+		break;
+
 	case ARGP_DROP_ADDR:
 		error = set_general_bool(args, FILTERING, DROP_BY_ADDR, str);
 		break;
@@ -465,6 +871,9 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_UDP_TO:
 		error = set_general_u64(args, SESSIONDB, UDP_TIMEOUT, str, UDP_MIN, MAX_U32/1000, 1000);
 		break;
+	case ARGP_UDP_CLASS_TO:
+		error = set_general_udp_class(args, str);
+		break;
 	case ARGP_ICMP_TO:
 		error = set_general_u64(args, SESSIONDB, ICMP_TIMEOUT, str, 0, MAX_U32/1000, 1000);
 		break;
@@ -474,9 +883,44 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_TCP_TRANS_TO:
 		error = set_general_u64(args, SESSIONDB, TCP_TRANS_TIMEOUT, str, TCP_TRANS, MAX_U32/1000, 1000);
 		break;
+	case ARGP_TCP_CLOSED_TO:
+		error = set_general_u64(args, SESSIONDB, TCP_CLOSED_TIMEOUT, str,
+				0, MAX_U32/1000, 1000);
+		break;
+	case ARGP_REFRESH_GRANULARITY:
+		error = set_general_u64(args, SESSIONDB, REFRESH_GRANULARITY, str, 0, MAX_U32, 1);
+		break;
+	case ARGP_TIMER_SLACK:
+		error = set_general_u64(args, SESSIONDB, TIMER_SLACK, str, 0, MAX_U32, 1);
+		break;
+	case ARGP_MAX_SESSIONS_UDP:
+		error = set_general_u64(args, SESSIONDB, MAX_SESSIONS_UDP, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_MAX_SESSIONS_TCP:
+		error = set_general_u64(args, SESSIONDB, MAX_SESSIONS_TCP, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_MAX_SESSIONS_ICMP:
+		error = set_general_u64(args, SESSIONDB, MAX_SESSIONS_ICMP, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_MAX_SESSIONS_PREFIX:
+		error = set_general_u64(args, SESSIONDB, MAX_SESSIONS_PER_PREFIX, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_SESSION_PREFIX_LEN:
+		error = set_general_u64(args, SESSIONDB, SESSION_PREFIX_LEN, str, 0, 128, 1);
+		break;
+	case ARGP_SESSION_RATE_PREFIX:
+		error = set_general_u64(args, SESSIONDB, SESSION_RATE_PER_PREFIX, str,
+				0, MAX_U32, 1);
+		break;
 	case ARGP_STORED_PKTS:
 		error = set_general_u64(args, PKTQUEUE, MAX_PKTS, str, 0, MAX_U64, 1);
 		break;
+	case ARGP_STORED_PKTS_SRC:
+		error = set_general_u64(args, PKTQUEUE, MAX_PKTS_PER_SRC, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_STORED_PKTS_POOL4:
+		error = set_general_u64(args, PKTQUEUE, MAX_PKTS_PER_POOL4, str, 0, MAX_U64, 1);
+		break;
 
 	case ARGP_RESET_TCLASS:
 		error = set_general_bool(args, TRANSLATE, RESET_TCLASS, str);
@@ -502,10 +946,28 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_MIN_IPV6_MTU:
 		error = set_general_u16(args, SENDPKT, MIN_IPV6_MTU, str, 1280, MAX_U16);
 		break;
+	case ARGP_CLAMP_MSS:
+		error = set_general_bool(args, TRANSLATE, CLAMP_MSS, str);
+		break;
+	case ARGP_DIRECT_XMIT:
+		error = set_general_bool(args, SENDPKT, DIRECT_XMIT, str);
+		break;
 
 	case ARGP_FRAG_TO:
 		error = set_general_u64(args, FRAGMENT, FRAGMENT_TIMEOUT, str, FRAGMENT_MIN, MAX_U32/1000, 1000);
 		break;
+	case ARGP_FRAG_HIGH_THRESH:
+		error = set_general_u64(args, FRAGMENT, FRAGMENT_HIGH_THRESH, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_FRAG_LOW_THRESH:
+		error = set_general_u64(args, FRAGMENT, FRAGMENT_LOW_THRESH, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_FRAG_FORWARD_EARLY:
+		error = set_general_bool(args, FRAGMENT, FRAGMENT_FORWARD_EARLY, str);
+		break;
+	case ARGP_LOGTIME_ENABLED:
+		error = set_general_bool(args, LOGTIME, LOGTIME_ENABLED, str);
+		break;
 
 	default:
 		error = ARGP_ERR_UNKNOWN;
@@ -529,9 +991,9 @@ static char doc[] = "jool -- The Jool kernel module's configuration interface.\v
 /**
  * Zeroizes all of "num"'s bits, except the last one. Returns the result.
  */
-static unsigned int zeroize_upper_bits(__u8 num)
+static unsigned int zeroize_upper_bits(unsigned int num)
 {
-	__u8 mask = 0x01;
+	unsigned int mask = 0x01;
 
 	do {
 		if ((num & mask) != 0)
@@ -542,6 +1004,9 @@ static unsigned int zeroize_upper_bits(__u8 num)
 	return num;
 }
 
+/** Are we serving the commands of a --listen socket? */
+static bool listening;
+
 /**
  * Uses argp.h to read the parameters from the user, validates them, and returns the result as a
  * structure.
@@ -552,10 +1017,11 @@ static int parse_args(int argc, char **argv, struct arguments *result)
 	struct argp argp = { options, parse_opt, args_doc, doc };
 
 	memset(result, 0, sizeof(*result));
-	result->mode = 0xFF;
+	result->mode = 0xFFFF;
 	result->op = 0xFF;
 
-	error = argp_parse(&argp, argc, argv, 0, NULL, result);
+	/* --listen clients must not be able to make us quit. */
+	error = argp_parse(&argp, argc, argv, listening ? ARGP_NO_EXIT : 0, NULL, result);
 	if (error)
 		return error;
 
@@ -583,6 +1049,17 @@ static int main_wrapped(int argc, char **argv)
 	if (error)
 		return error;
 
+	if (args.listen) {
+		if (listening) {
+			log_err("I'm already listening.");
+			return -EINVAL;
+		}
+		listening = true;
+		return daemon_run(args.listen, main_wrapped);
+	}
+	if (args.file)
+		return file_load(args.file);
+
 	switch (args.mode) {
 	case MODE_POOL6:
 		switch (args.op) {
@@ -621,13 +1098,50 @@ static int main_wrapped(int argc, char **argv)
 				log_err("Please enter the address to be added (--address).");
 				return -EINVAL;
 			}
+			if (args.db.pool4.det_prefix_set) {
+				if (args.db.pool4.ports_set || args.db.pool4.psid_set) {
+					log_err("--ports and --psid cannot be combined with --deterministic.");
+					return -EINVAL;
+				}
+				return pool4_add_det(&args.db.pool4.addr,
+						args.db.pool4.range_len_set ? args.db.pool4.range_len : 32,
+						&args.db.pool4.det_prefix,
+						args.db.pool4.subscriber_len_set
+								? args.db.pool4.subscriber_len : 128);
+			}
+			if (args.db.pool4.subscriber_len_set) {
+				log_err("--subscriber-len requires --deterministic.");
+				return -EINVAL;
+			}
+			if (args.db.pool4.psid_set) {
+				if (args.db.pool4.ports_set) {
+					log_err("--ports cannot be combined with --psid.");
+					return -EINVAL;
+				}
+				return pool4_add_psid(&args.db.pool4.addr,
+						args.db.pool4.range_len_set ? args.db.pool4.range_len : 32,
+						args.db.pool4.psid, args.db.pool4.psid_len,
+						args.db.pool4.psid_offset_set ? args.db.pool4.psid_offset : 6);
+			}
+			if (args.db.pool4.psid_offset_set) {
+				log_err("--psid-offset requires --psid.");
+				return -EINVAL;
+			}
+			if (args.db.pool4.range_len_set || args.db.pool4.ports_set) {
+				return pool4_add_range(&args.db.pool4.addr,
+						args.db.pool4.range_len_set ? args.db.pool4.range_len : 32,
+						args.db.pool4.ports_set ? args.db.pool4.port_min : 0,
+						args.db.pool4.ports_set ? args.db.pool4.port_max : 65535);
+			}
 			return pool4_add(&args.db.pool4.addr);
 		case OP_REMOVE:
 			if (!args.db.pool4.addr_set) {
 				log_err("Please enter the address to be removed (--address).");
 				return -EINVAL;
 			}
-			return pool4_remove(&args.db.pool4.addr, args.db.quick);
+			return pool4_remove(&args.db.pool4.addr,
+					args.db.pool4.range_len_set ? args.db.pool4.range_len : 32,
+					args.db.quick);
 		case OP_FLUSH:
 			return pool4_flush(args.db.quick);
 		default:
@@ -636,11 +1150,42 @@ static int main_wrapped(int argc, char **argv)
 		}
 		break;
 
+	case MODE_EAMT:
+		switch (args.op) {
+		case OP_DISPLAY:
+			return eam_display();
+		case OP_COUNT:
+			return eam_count();
+		case OP_ADD:
+		case OP_REMOVE:
+			error = 0;
+			if (!args.db.eamt.prefix6_set) {
+				log_err("Missing the IPv6 prefix (--eam6).");
+				error = -EINVAL;
+			}
+			if (!args.db.eamt.prefix4_set) {
+				log_err("Missing the IPv4 prefix (--eam4).");
+				error = -EINVAL;
+			}
+			if (error)
+				return error;
+
+			return (args.op == OP_ADD)
+					? eam_add(&args.db.eamt.prefix6, &args.db.eamt.prefix4)
+					: eam_remove(&args.db.eamt.prefix6, &args.db.eamt.prefix4);
+		case OP_FLUSH:
+			return eam_flush();
+		default:
+			log_err("Unknown operation for EAMT mode: %u.", args.op);
+			return -EINVAL;
+		}
+		break;
+
 	case MODE_BIB:
 		switch (args.op) {
 		case OP_DISPLAY:
 			return bib_display(args.db.tables.tcp, args.db.tables.udp, args.db.tables.icmp,
-					args.db.tables.numeric_hostname, args.db.tables.csv_format);
+					args.db.tables.numeric_hostname, args.db.tables.format);
 		case OP_COUNT:
 			return bib_count(args.db.tables.tcp, args.db.tables.udp, args.db.tables.icmp);
 
@@ -680,7 +1225,8 @@ static int main_wrapped(int argc, char **argv)
 		switch (args.op) {
 		case OP_DISPLAY:
 			return session_display(args.db.tables.tcp, args.db.tables.udp, args.db.tables.icmp,
-					args.db.tables.numeric_hostname, args.db.tables.csv_format);
+					args.db.tables.numeric_hostname, args.db.tables.format,
+					&args.db.tables.filter);
 		case OP_COUNT:
 			return session_count(args.db.tables.tcp, args.db.tables.udp, args.db.tables.icmp);
 		default:
@@ -688,7 +1234,6 @@ static int main_wrapped(int argc, char **argv)
 			return -EINVAL;
 		}
 		break;
-#ifdef BENCHMARK
 	case MODE_LOGTIME:
 		switch (args.op) {
 		case OP_DISPLAY:
@@ -699,21 +1244,55 @@ static int main_wrapped(int argc, char **argv)
 			break;
 		}
 		break;
-#endif
 
 	case MODE_GENERAL:
 		switch (args.op) {
 		case OP_DISPLAY:
 			return general_display();
 		case OP_UPDATE:
-			error = general_update(args.general.module, args.general.type, args.general.size,
-					args.general.data);
-			free(args.general.data);
+			error = general_update(args.general.records, args.general.len, args.general.count);
+			free(args.general.records);
 			return error;
 		default:
 			log_err("Unknown operation for general mode: %u.", args.op);
 			return -EINVAL;
 		}
+
+	case MODE_STATS:
+		switch (args.op) {
+		case OP_DISPLAY:
+			if (args.stats.memory)
+				return stats_display_memory();
+			return args.stats.occupancy ? stats_display_occupancy() : stats_display();
+		default:
+			log_err("Unknown operation for stats mode: %u.", args.op);
+			return -EINVAL;
+		}
+
+	case MODE_SYNC:
+		switch (args.op) {
+		case OP_DISPLAY:
+			return args.sync.snapshot ? sync_snapshot() : sync_display();
+		case OP_ADD:
+			return sync_add();
+		default:
+			log_err("Unknown operation for sync mode: %u.", args.op);
+			return -EINVAL;
+		}
+
+	case MODE_REPLAY:
+		return replay_run(args.replay.repeat_set ? args.replay.repeat : 1);
+
+	case MODE_CHANGES:
+		switch (args.op) {
+		case OP_DISPLAY:
+			return changes_display(args.changes.since);
+		case OP_COUNT:
+			return changes_count();
+		default:
+			log_err("Unknown operation for changes mode: %u.", args.op);
+			return -EINVAL;
+		}
 	}
 
 	log_err("Unknown configuration mode: %u", args.mode);
@@ -15,81 +15,95 @@
 #define HDR_LEN sizeof(struct request_hdr)
 #define PAYLOAD_LEN sizeof(struct request_logtime)
 
-struct display_params {
-	struct request_logtime *req_payload;
-	int row_count;
-};
+/**
+ * Returns the biggest duration (in nanoseconds) counted by the "index"th histogram bucket.
+ * See LOGTIME_BUCKETS.
+ */
+static __u64 bucket_max(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < LOGTIME_SUB_BUCKETS)
+		return index;
+
+	shift = index / LOGTIME_SUB_BUCKETS - 1;
+	return (((__u64) (LOGTIME_SUB_BUCKETS + index % LOGTIME_SUB_BUCKETS + 1)) << shift) - 1;
+}
+
+/**
+ * Returns the duration "percentile" percent of the samples in "histogram" do not exceed.
+ */
+static __u64 get_percentile(struct logtime_usr *histogram, __u64 total, double percentile)
+{
+	__u64 goal = (__u64) (total * percentile / 100.0);
+	__u64 seen = 0;
+	unsigned int i;
+
+	if (goal == 0)
+		goal = 1;
+
+	for (i = 0; i < LOGTIME_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= goal)
+			return bucket_max(i);
+	}
+
+	return bucket_max(LOGTIME_BUCKETS - 1);
+}
 
 static int logtime_display_response(struct nl_msg *msg, void *arg)
 {
 	struct nlmsghdr *hdr;
-	struct logtime_entry_usr *entries;
-	struct display_params *params = arg;
+	struct logtime_usr *histogram;
+	struct request_logtime *request = arg;
 	const char *l3_proto_out, *l4_proto;
 	char *l3_proto_in;
-	__u16 entry_count, i;
+	__u64 total = 0;
+	unsigned int i;
 
 	hdr = nlmsg_hdr(msg);
-	entries = nlmsg_data(hdr);
-	entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
+	if (nlmsg_datalen(hdr) != sizeof(*histogram)) {
+		log_err("The kernel's response has an unexpected size (%d bytes).", nlmsg_datalen(hdr));
+		return -EINVAL;
+	}
+	histogram = nlmsg_data(hdr);
 
-	if (params->req_payload->l3_proto == L3PROTO_IPV4) {
+	if (request->l3_proto == L3PROTO_IPV4) {
 		l3_proto_in = "IPv6";
 	} else {
 		l3_proto_in = "IPv4";
 	}
-	l3_proto_out = l3proto_to_string(params->req_payload->l3_proto);
-	l4_proto = l4proto_to_string(params->req_payload->l4_proto);
-
-	for (i = 0; i < entry_count; i++) {
-		printf ("%s->%s,", l3_proto_in, l3_proto_out);
-		printf ("%s,", l4_proto);
-		printf ("%ld,%ld\n", entries[i].time.tv_sec, entries[i].time.tv_nsec);
-	}
+	l3_proto_out = l3proto_to_string(request->l3_proto);
+	l4_proto = l4proto_to_string(request->l4_proto);
 
-	params->row_count += entry_count;
+	for (i = 0; i < LOGTIME_BUCKETS; i++)
+		total += histogram->counts[i];
 
-	if (hdr->nlmsg_flags & NLM_F_MULTI) {
-		params->req_payload->display.iterate = true;
-	} else {
-		params->req_payload->display.iterate = false;
+	printf("%s->%s,%s,%llu,", l3_proto_in, l3_proto_out, l4_proto, (unsigned long long) total);
+	if (total == 0) {
+		printf("-,-,-\n");
+		return 0;
 	}
+
+	printf("%llu,", (unsigned long long) get_percentile(histogram, total, 50.0));
+	printf("%llu,", (unsigned long long) get_percentile(histogram, total, 99.0));
+	printf("%llu\n", (unsigned long long) get_percentile(histogram, total, 99.9));
 	return 0;
 }
 
-
-static bool display_single_db(l3_protocol l3_proto, l4_protocol l4_proto)
+static int display_single_db(l3_protocol l3_proto, l4_protocol l4_proto)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *) request;
 	struct request_logtime *payload = (struct request_logtime *) (request + HDR_LEN);
-	struct display_params params;
-	bool error;
 
 	hdr->length = sizeof(request);
 	hdr->mode = MODE_LOGTIME;
 	hdr->operation = OP_DISPLAY;
 	payload->l3_proto = (__u8) l3_proto;
 	payload->l4_proto = (__u8) l4_proto;
-	payload->display.iterate = false;
-
-	params.row_count = 0;
-	params.req_payload = payload;
-
-	do {
-		error = netlink_request(request, hdr->length, logtime_display_response, &params);
-		if (error)
-			break;
-	} while (params.req_payload->display.iterate);
-
-	if (!error) {
-		if (params.row_count > 0)
-			printf("  (Fetched %u entries.)\n", params.row_count);
-		else
-			printf("  (empty)\n");
-	}
 
-	return error;
+	return netlink_request(request, hdr->length, logtime_display_response, payload);
 }
 
 int logtime_display()
@@ -101,7 +115,7 @@ int logtime_display()
 	int udp_ip4_error = 0;
 	int icmp_ip4_error = 0;
 
-	printf("L3 protocol,L4 Protocol,seconds,nanoseconds\n");
+	printf("L3 protocol,L4 Protocol,packets,p50 (ns),p99 (ns),p99.9 (ns)\n");
 	tcp_ip6_error = display_single_db(L3PROTO_IPV6, L4PROTO_TCP);
 	udp_ip6_error = display_single_db(L3PROTO_IPV6, L4PROTO_UDP);
 	icmp_ip6_error = display_single_db(L3PROTO_IPV6, L4PROTO_ICMP);
@@ -4,59 +4,128 @@
 #include <errno.h>
 #include <unistd.h>
 
-int netlink_request(void *request, __u16 request_len, int (*cb)(struct nl_msg *, void *),
-		void *cb_arg)
+
+/** Socket netlink_open() left connected, or NULL if every request opens its own. */
+static struct nl_sock *persistent;
+
+static struct nl_sock *create_socket(void)
 {
 	struct nl_sock *sk;
-	enum nl_cb_type callbacks[] = { NL_CB_VALID, NL_CB_FINISH, NL_CB_ACK };
-	int i;
 	int error;
 
 	sk = nl_socket_alloc();
 	if (!sk) {
 		log_err("Could not allocate a socket; cannot speak to the NAT64.");
-		return -ENOMEM;
+		return NULL;
+	}
+
+	/* The BIB and session dumps do not fit in libnl's default, page-sized buffer. */
+	error = nl_socket_set_msg_buf_size(sk, DUMP_MSG_MAX_SIZE + getpagesize());
+	if (error < 0) {
+		log_err("Could not grow the socket's receive buffer.\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		goto fail;
+	}
+
+	error = nl_connect(sk, NETLINK_USERSOCK);
+	if (error < 0) {
+		log_err("Could not bind the socket to the NAT64.\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		goto fail;
 	}
 
+	return sk;
+
+fail:
+	nl_socket_free(sk);
+	return NULL;
+}
+
+static void destroy_socket(struct nl_sock *sk)
+{
+	nl_close(sk);
+	nl_socket_free(sk);
+}
+
+/**
+ * Makes the following requests share a single socket, instead of opening one each.
+ * Meant for processes which issue lots of requests, such as --listen.
+ */
+int netlink_open(void)
+{
+	if (persistent)
+		return 0;
+	persistent = create_socket();
+	return persistent ? 0 : -EINVAL;
+}
+
+/**
+ * Reverts netlink_open().
+ */
+void netlink_close(void)
+{
+	if (!persistent)
+		return;
+	destroy_socket(persistent);
+	persistent = NULL;
+}
+
+static int send_request(struct nl_sock *sk, void *request, __u16 request_len,
+		int (*cb)(struct nl_msg *, void *), void *cb_arg)
+{
+	enum nl_cb_type callbacks[] = { NL_CB_VALID, NL_CB_FINISH, NL_CB_ACK };
+	int i;
+	int error;
+
 	for (i = 0; i < (sizeof(callbacks) / sizeof(callbacks[0])); i++) {
 		error = nl_socket_modify_cb(sk, callbacks[i], NL_CB_CUSTOM, cb, cb_arg);
 		if (error < 0) {
 			log_err("Could not register response handler. "
 					"I won't be able to parse the NAT64's response, so I won't send the request.\n"
 					"Netlink error message: %s (Code %d)", nl_geterror(error), error);
-			goto fail_free;
+			return -EINVAL;
 		}
 	}
 
-	error = nl_connect(sk, NETLINK_USERSOCK);
-	if (error < 0) {
-		log_err("Could not bind the socket to the NAT64.\n"
-				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
-		goto fail_free;
-	}
-
 	error = nl_send_simple(sk, MSG_TYPE_JOOL, 0, request, request_len);
 	if (error < 0) {
 		log_err("Could not send the request to the NAT64 (is it really up?).\n"
 				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
-		goto fail_close;
+		return -EINVAL;
 	}
 
 	error = nl_recvmsgs_default(sk);
 	if (error < 0) {
 		log_err("%s (System error %d)", nl_geterror(error), error);
-		goto fail_close;
+		return -EINVAL;
 	}
 
-	nl_close(sk);
-	nl_socket_free(sk);
 	return 0;
+}
 
-fail_close:
-	nl_close(sk);
-	/* Fall through. */
+int netlink_request(void *request, __u16 request_len, int (*cb)(struct nl_msg *, void *),
+		void *cb_arg)
+{
+	struct nl_sock *sk;
+	int error;
 
-fail_free:
-	nl_socket_free(sk);
-	return -EINVAL;
+	if (persistent) {
+		error = send_request(persistent, request, request_len, cb, cb_arg);
+		if (error) {
+			/*
+			 * Whatever the kernel didn't get to say is still queued in the socket, and
+			 * would be mistaken for the response of the next request. Start over.
+			 */
+			netlink_close();
+			netlink_open();
+		}
+		return error;
+	}
+
+	sk = create_socket();
+	if (!sk)
+		return -EINVAL;
+	error = send_request(sk, request, request_len, cb, cb_arg);
+	destroy_socket(sk);
+	return error;
 }
@@ -81,17 +81,94 @@ int pool4_add(struct in_addr *addr)
 	hdr->mode = MODE_POOL4;
 	hdr->operation = OP_ADD;
 	payload->add.addr = *addr;
+	payload->add.deterministic = false;
+	payload->add.addr_len = 32;
+	payload->add.port_min = 0;
+	payload->add.port_max = 65535;
+	payload->add.psid_len = 0;
 
 	return netlink_request(request, hdr->length, pool4_add_response, NULL);
 }
 
+static int pool4_add_range_response(struct nl_msg *msg, void *arg)
+{
+	log_info("The range was added successfully.");
+	return 0;
+}
+
+int pool4_add_range(struct in_addr *addr, __u8 addr_len, __u16 port_min, __u16 port_max)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_pool4 *payload = (union request_pool4 *) (request + HDR_LEN);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_POOL4;
+	hdr->operation = OP_ADD;
+	payload->add.addr = *addr;
+	payload->add.deterministic = false;
+	payload->add.addr_len = addr_len;
+	payload->add.port_min = port_min;
+	payload->add.port_max = port_max;
+	payload->add.psid_len = 0;
+
+	return netlink_request(request, hdr->length, pool4_add_range_response, NULL);
+}
+
+int pool4_add_psid(struct in_addr *addr, __u8 addr_len, __u16 psid, __u8 psid_len,
+		__u8 psid_offset)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_pool4 *payload = (union request_pool4 *) (request + HDR_LEN);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_POOL4;
+	hdr->operation = OP_ADD;
+	payload->add.addr = *addr;
+	payload->add.deterministic = false;
+	payload->add.addr_len = addr_len;
+	payload->add.port_min = 0;
+	payload->add.port_max = 65535;
+	payload->add.psid = psid;
+	payload->add.psid_len = psid_len;
+	payload->add.psid_offset = psid_offset;
+
+	return netlink_request(request, hdr->length, pool4_add_range_response, NULL);
+}
+
+static int pool4_add_det_response(struct nl_msg *msg, void *arg)
+{
+	log_info("The range was added successfully.");
+	return 0;
+}
+
+int pool4_add_det(struct in_addr *addr, __u8 addr_len, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_pool4 *payload = (union request_pool4 *) (request + HDR_LEN);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_POOL4;
+	hdr->operation = OP_ADD;
+	payload->add.addr = *addr;
+	payload->add.deterministic = true;
+	payload->add.addr_len = addr_len;
+	payload->add.prefix6 = *prefix6;
+	payload->add.subscriber_len = subscriber_len;
+
+	return netlink_request(request, hdr->length, pool4_add_det_response, NULL);
+}
+
 static int pool4_remove_response(struct nl_msg *msg, void *arg)
 {
 	log_info("The address was removed successfully.");
 	return 0;
 }
 
-int pool4_remove(struct in_addr *addr, bool quick)
+int pool4_remove(struct in_addr *addr, __u8 addr_len, bool quick)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *) request;
@@ -101,6 +178,7 @@ int pool4_remove(struct in_addr *addr, bool quick)
 	hdr->mode = MODE_POOL4;
 	hdr->operation = OP_REMOVE;
 	payload->remove.addr = *addr;
+	payload->remove.addr_len = addr_len;
 	payload->remove.quick = quick;
 
 	return netlink_request(request, hdr->length, pool4_remove_response, NULL);
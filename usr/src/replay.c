@@ -0,0 +1,480 @@
+#include "nat64/usr/replay.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Bytes of packets per request to the kernel. Large, so the round trips don't dominate; the
+ * socket's message buffer is grown accordingly.
+ */
+#define REQUEST_PAYLOAD (60 * 1024)
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+/** The link types the capture can have. */
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+
+struct pcap_file_hdr {
+	__u32 magic;
+	__u16 version_major;
+	__u16 version_minor;
+	__s32 thiszone;
+	__u32 sigfigs;
+	__u32 snaplen;
+	__u32 linktype;
+};
+
+struct pcap_record_hdr {
+	__u32 ts_sec;
+	__u32 ts_frac;
+	__u32 incl_len;
+	__u32 orig_len;
+};
+
+/**
+ * One request's worth of packets, already in the format the kernel wants.
+ */
+struct replay_request {
+	unsigned char *buffer;
+	size_t len;
+	unsigned int packets;
+	struct replay_request *next;
+};
+
+/** What happened to the packets, so far. */
+struct replay_totals {
+	unsigned long long packets;
+	unsigned long long bytes;
+	struct replay_result_usr result;
+};
+
+/** What the capture contained, besides the packets that are going to be replayed. */
+struct capture_summary {
+	unsigned long long truncated;
+	unsigned long long not_ip;
+};
+
+static __u32 swap32(__u32 value)
+{
+	return ((value & 0xff) << 24) | ((value & 0xff00) << 8)
+			| ((value >> 8) & 0xff00) | (value >> 24);
+}
+
+static __u16 get_be16(unsigned char *bytes)
+{
+	return (bytes[0] << 8) | bytes[1];
+}
+
+/**
+ * Returns the offset of the IP header within "frame", or -1 if "frame" is not an IP packet.
+ */
+static int get_ip_offset(unsigned char *frame, __u32 len, __u32 linktype)
+{
+	unsigned int offset;
+	__u16 ethertype;
+
+	switch (linktype) {
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		return 0;
+
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		ethertype = get_be16(frame + 14);
+		offset = 16;
+		break;
+
+	default: /* LINKTYPE_ETHERNET */
+		if (len < 14)
+			return -1;
+		ethertype = get_be16(frame + 12);
+		offset = 14;
+		while (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) {
+			if (len < offset + 4)
+				return -1;
+			ethertype = get_be16(frame + offset + 2);
+			offset += 4;
+		}
+		break;
+	}
+
+	return (ethertype == ETHERTYPE_IPV4 || ethertype == ETHERTYPE_IPV6) ? offset : -1;
+}
+
+static struct replay_request *new_request(void)
+{
+	struct replay_request *request;
+	struct request_hdr *hdr;
+
+	request = malloc(sizeof(*request));
+	if (!request)
+		return NULL;
+	request->buffer = malloc(sizeof(*hdr) + REQUEST_PAYLOAD);
+	if (!request->buffer) {
+		free(request);
+		return NULL;
+	}
+
+	hdr = (struct request_hdr *) request->buffer;
+	hdr->mode = MODE_REPLAY;
+	hdr->operation = OP_ADD;
+	request->len = sizeof(*hdr);
+	request->packets = 0;
+	request->next = NULL;
+	return request;
+}
+
+static void free_requests(struct replay_request *request)
+{
+	struct replay_request *next;
+
+	while (request) {
+		next = request->next;
+		free(request->buffer);
+		free(request);
+		request = next;
+	}
+}
+
+/**
+ * Reads the capture from standard input, and packs its IP packets into requests.
+ */
+static int load_capture(struct replay_request **result, struct capture_summary *summary)
+{
+	struct pcap_file_hdr file_hdr;
+	struct pcap_record_hdr record;
+	struct replay_request *first, *last;
+	struct replay_pkt_usr *pkt_hdr;
+	unsigned char *frame;
+	bool swapped;
+	int offset;
+	__u32 len;
+	size_t needed;
+
+	memset(summary, 0, sizeof(*summary));
+
+	if (fread(&file_hdr, sizeof(file_hdr), 1, stdin) != 1) {
+		log_err("Could not read the capture's header from standard input.");
+		return -EINVAL;
+	}
+	swapped = (file_hdr.magic == swap32(PCAP_MAGIC_USEC)
+			|| file_hdr.magic == swap32(PCAP_MAGIC_NSEC));
+	if (!swapped && file_hdr.magic != PCAP_MAGIC_USEC && file_hdr.magic != PCAP_MAGIC_NSEC) {
+		log_err("Standard input is not a pcap capture. (pcapng is not supported.)");
+		return -EINVAL;
+	}
+	if (swapped)
+		file_hdr.linktype = swap32(file_hdr.linktype);
+
+	switch (file_hdr.linktype) {
+	case LINKTYPE_ETHERNET:
+	case LINKTYPE_RAW:
+	case LINKTYPE_LINUX_SLL:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		break;
+	default:
+		log_err("Unsupported link type: %u.", file_hdr.linktype);
+		return -EINVAL;
+	}
+
+	frame = malloc(0xFFFF);
+	first = last = new_request();
+	if (!frame || !first) {
+		log_err("Out of memory.");
+		goto fail;
+	}
+
+	while (fread(&record, sizeof(record), 1, stdin) == 1) {
+		if (swapped) {
+			record.incl_len = swap32(record.incl_len);
+			record.orig_len = swap32(record.orig_len);
+		}
+		if (record.incl_len > 0xFFFF) {
+			log_err("The capture contains a %u-byte frame; it's probably corrupted.",
+					record.incl_len);
+			goto fail;
+		}
+		if (fread(frame, 1, record.incl_len, stdin) != record.incl_len) {
+			log_err("The capture ends in the middle of a packet.");
+			goto fail;
+		}
+
+		if (record.incl_len < record.orig_len) {
+			summary->truncated++;
+			continue;
+		}
+		offset = get_ip_offset(frame, record.incl_len, file_hdr.linktype);
+		if (offset < 0) {
+			summary->not_ip++;
+			continue;
+		}
+		len = record.incl_len - offset;
+
+		needed = sizeof(*pkt_hdr) + ((len + REPLAY_ALIGN - 1) & ~(REPLAY_ALIGN - 1));
+		if (needed > REQUEST_PAYLOAD) {
+			summary->truncated++;
+			continue;
+		}
+		if (last->len + needed > sizeof(struct request_hdr) + REQUEST_PAYLOAD) {
+			last->next = new_request();
+			if (!last->next) {
+				log_err("Out of memory.");
+				goto fail;
+			}
+			last = last->next;
+		}
+
+		pkt_hdr = (struct replay_pkt_usr *) (last->buffer + last->len);
+		pkt_hdr->len = len;
+		pkt_hdr->reserved = 0;
+		memcpy(pkt_hdr + 1, frame + offset, len);
+		memset(((unsigned char *) (pkt_hdr + 1)) + len, 0, needed - sizeof(*pkt_hdr) - len);
+		last->len += needed;
+		last->packets++;
+	}
+
+	if (ferror(stdin)) {
+		log_err("Could not read the capture from standard input: %s", strerror(errno));
+		goto fail;
+	}
+
+	free(frame);
+	*result = first;
+	return 0;
+
+fail:
+	free(frame);
+	free_requests(first);
+	return -EINVAL;
+}
+
+static int replay_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct replay_result_usr *result = arg;
+
+	if (nlmsg_datalen(hdr) != sizeof(*result)) {
+		log_err("The kernel's response has an unexpected size (%d bytes).",
+				nlmsg_datalen(hdr));
+		return NL_STOP;
+	}
+
+	memcpy(result, nlmsg_data(hdr), sizeof(*result));
+	return NL_OK;
+}
+
+static int occupancy_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct occupancy_usr *occupancy = nlmsg_data(hdr);
+	struct pool4_usage_usr *usage = (struct pool4_usage_usr *) (occupancy + 1);
+	unsigned long long bibs = 0, sessions = 0, borrowed = 0, total = 0;
+	unsigned int count, i, proto;
+	int len = nlmsg_datalen(hdr);
+
+	if (len < (int) sizeof(*occupancy)
+			|| (len - sizeof(*occupancy)) % sizeof(*usage) != 0) {
+		log_err("The kernel's response has an unexpected size (%d bytes).", len);
+		return -EINVAL;
+	}
+	count = (len - sizeof(*occupancy)) / sizeof(*usage);
+
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		bibs += occupancy->bibs[proto];
+		sessions += occupancy->sessions[proto];
+		for (i = 0; i < count; i++) {
+			borrowed += usage[i].borrowed[proto];
+			total += usage[i].total[proto];
+		}
+	}
+
+	printf("%-14llu%-14llu", bibs, sessions);
+	if (total)
+		printf("%.2f%%\n", 100.0 * borrowed / total);
+	else
+		printf("-\n");
+	return 0;
+}
+
+static void print_header(void)
+{
+	printf("%-10s%-14s%-14s%-12s%-12s%-12s%-14s%-14s%s\n", "Seconds", "Packets/s", "Mbit/s",
+			"Taken", "Dropped", "Ignored", "BIB entries", "Sessions", "Pool4 used");
+}
+
+/**
+ * Prints how fast the last lap went, and how full the tables are now.
+ */
+static void print_lap(double elapsed, double lap, struct replay_totals *now,
+		struct replay_totals *before)
+{
+	unsigned char request[sizeof(struct request_hdr) + sizeof(struct request_stats)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_stats *payload = (struct request_stats *) (hdr + 1);
+
+	printf("%-10.1f%-14.0f%-14.1f%-12u%-12u%-12u", elapsed,
+			(now->packets - before->packets) / lap,
+			8 * (now->bytes - before->bytes) / lap / 1000000,
+			now->result.stolen, now->result.dropped, now->result.ignored);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_STATS;
+	hdr->operation = OP_DISPLAY;
+	payload->type = STATS_OCCUPANCY;
+	if (netlink_request(request, hdr->length, occupancy_response, NULL))
+		printf("?\n");
+	fflush(stdout);
+}
+
+static double seconds_between(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void add_result(struct replay_totals *totals, struct replay_request *request,
+		struct replay_result_usr *result)
+{
+	totals->packets += request->packets;
+	totals->bytes += request->len - sizeof(struct request_hdr)
+			- request->packets * sizeof(struct replay_pkt_usr);
+	totals->result.stolen += result->stolen;
+	totals->result.dropped += result->dropped;
+	totals->result.ignored += result->ignored;
+	totals->result.malformed += result->malformed;
+}
+
+static int replay_requests(struct nl_sock *sk, struct replay_request *requests,
+		unsigned int repeat)
+{
+	struct replay_request *request;
+	struct replay_result_usr result;
+	struct replay_totals totals, last_lap;
+	struct timespec start, lap_start, now;
+	double elapsed, lap;
+	unsigned int i;
+	int error;
+
+	error = nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, replay_response, &result);
+	if (error < 0) {
+		log_err("Could not register the response handler.\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		return error;
+	}
+
+	memset(&totals, 0, sizeof(totals));
+	last_lap = totals;
+	print_header();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	lap_start = start;
+
+	for (i = 0; i < repeat; i++) {
+		for (request = requests; request; request = request->next) {
+			if (!request->packets)
+				continue;
+
+			((struct request_hdr *) request->buffer)->length = request->len;
+			error = nl_send_simple(sk, MSG_TYPE_JOOL, 0, request->buffer, request->len);
+			if (error < 0) {
+				log_err("Could not send the packets to the NAT64.\n"
+						"Netlink error message: %s (Code %d)",
+						nl_geterror(error), error);
+				return error;
+			}
+
+			memset(&result, 0, sizeof(result));
+			error = nl_recvmsgs_default(sk);
+			if (error < 0) {
+				log_err("%s (System error %d)", nl_geterror(error), error);
+				return error;
+			}
+			add_result(&totals, request, &result);
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			lap = seconds_between(&lap_start, &now);
+			if (lap >= 1) {
+				print_lap(seconds_between(&start, &now), lap, &totals, &last_lap);
+				last_lap = totals;
+				lap_start = now;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = seconds_between(&start, &now);
+	lap = seconds_between(&lap_start, &now);
+	if (totals.packets != last_lap.packets && lap > 0)
+		print_lap(elapsed, lap, &totals, &last_lap);
+
+	printf("\n%llu packets in %.2f seconds", totals.packets, elapsed);
+	if (elapsed > 0)
+		printf(" (%.0f packets/s)", totals.packets / elapsed);
+	printf(".\n");
+	if (totals.result.malformed)
+		printf("The kernel could not make sense of %u of them.\n", totals.result.malformed);
+	return 0;
+}
+
+int replay_run(unsigned int repeat)
+{
+	struct replay_request *requests;
+	struct capture_summary summary;
+	struct nl_sock *sk;
+	int error;
+
+	error = load_capture(&requests, &summary);
+	if (error)
+		return error;
+	if (summary.truncated)
+		log_info("Skipped %llu truncated (or too large) packets.", summary.truncated);
+	if (summary.not_ip)
+		log_info("Skipped %llu frames that are not IPv4 or IPv6.", summary.not_ip);
+
+	sk = nl_socket_alloc();
+	if (!sk) {
+		log_err("Could not allocate a socket; cannot speak to the NAT64.");
+		error = -ENOMEM;
+		goto end;
+	}
+
+	/* The requests don't fit in libnl's default, page-sized buffer. */
+	nlmsg_set_default_size(sizeof(struct request_hdr) + REQUEST_PAYLOAD + getpagesize());
+
+	error = nl_connect(sk, NETLINK_USERSOCK);
+	if (error < 0) {
+		log_err("Could not bind the socket to the NAT64.\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		goto end_free;
+	}
+
+	error = replay_requests(sk, requests, repeat);
+	nl_close(sk);
+	/* Fall through. */
+
+end_free:
+	nl_socket_free(sk);
+	/* Fall through. */
+
+end:
+	free_requests(requests);
+	return error;
+}
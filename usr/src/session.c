@@ -15,7 +15,7 @@
 
 struct display_params {
 	bool numeric_hostname;
-	bool csv_format;
+	enum display_format format;
 	int row_count;
 	struct request_session *req_payload;
 };
@@ -44,6 +44,21 @@ char *tcp_state_to_string(enum tcp_state state)
 	return "UNKNOWN";
 }
 
+int str_to_tcp_state(const char *str, __u8 *out)
+{
+	__u8 state;
+
+	for (state = CLOSED; state <= TRANS; state++) {
+		if (strcasecmp(str, tcp_state_to_string(state)) == 0) {
+			*out = state;
+			return 0;
+		}
+	}
+
+	log_err("'%s' is not a TCP state. (eg. ESTABLISHED, V4_INIT, TRANS)", str);
+	return -EINVAL;
+}
+
 static int session_display_response(struct nl_msg *msg, void *arg)
 {
 	struct nlmsghdr *hdr;
@@ -55,7 +70,33 @@ static int session_display_response(struct nl_msg *msg, void *arg)
 	entries = nlmsg_data(hdr);
 	entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
 
-	if (params->csv_format) {
+	if (params->format != FORMAT_JSON && !params->numeric_hostname) {
+		for (i = 0; i < entry_count; i++) {
+			dns_queue6(&entries[i].remote6.l3);
+			dns_queue4(&entries[i].remote4.l3);
+		}
+		dns_resolve_queued();
+	}
+
+	if (params->format == FORMAT_JSON) {
+		for (i = 0; i < entry_count; i++) {
+			struct session_entry_usr *entry = &entries[i];
+
+			printf("{\"proto\":\"%s\",", l4proto_to_string(params->req_payload->l4_proto));
+			print_addr6_json("remote6", &entry->remote6);
+			printf(",");
+			print_addr6_json("local6", &entry->local6);
+			printf(",");
+			print_addr4_json("local4", &entry->local4);
+			printf(",");
+			print_addr4_json("remote4", &entry->remote4);
+			printf(",\"expires_ms\":%llu", entry->dying_time);
+			printf(",\"packets\":%llu,\"bytes\":%llu", entry->packets, entry->bytes);
+			if (params->req_payload->l4_proto == L4PROTO_TCP)
+				printf(",\"state\":\"%s\"", tcp_state_to_string(entry->state));
+			printf("}\n");
+		}
+	} else if (params->format == FORMAT_CSV) {
 		for (i = 0; i < entry_count; i++) {
 			struct session_entry_usr *entry = &entries[i];
 
@@ -101,6 +142,11 @@ static int session_display_response(struct nl_msg *msg, void *arg)
 			print_addr6(&entry->local6, true, "#", params->req_payload->l4_proto);
 			printf("\n");
 
+			/* Zero most likely means the counters are disabled. */
+			if (entry->packets)
+				printf("Traffic: %llu packets, %llu bytes\n", entry->packets,
+						entry->bytes);
+
 			printf("---------------------------------\n");
 		}
 	}
@@ -109,7 +155,8 @@ static int session_display_response(struct nl_msg *msg, void *arg)
 
 	if (hdr->nlmsg_flags == NLM_F_MULTI) {
 		params->req_payload->display.iterate = true;
-		params->req_payload->display.addr4 = *(&entries[entry_count - 1].local4);
+		params->req_payload->display.addr4 = entries[entry_count - 1].local4;
+		params->req_payload->display.remote4 = entries[entry_count - 1].remote4;
 	} else {
 		params->req_payload->display.iterate = false;
 	}
@@ -117,7 +164,8 @@ static int session_display_response(struct nl_msg *msg, void *arg)
 	return 0;
 }
 
-static bool display_single_table(u_int8_t l4_proto, bool numeric_hostname, bool csv_format)
+static bool display_single_table(u_int8_t l4_proto, bool numeric_hostname,
+		enum display_format format, struct session_filter *filter)
 {
 	unsigned char request[HDR_LEN + PAYLOAD_LEN];
 	struct request_hdr *hdr = (struct request_hdr *) request;
@@ -125,7 +173,7 @@ static bool display_single_table(u_int8_t l4_proto, bool numeric_hostname, bool
 	struct display_params params;
 	bool error;
 
-	if (!csv_format) {
+	if (format == FORMAT_FRIENDLY) {
 		printf("%s:\n", l4proto_to_string(l4_proto));
 		printf("---------------------------------\n");
 	}
@@ -136,9 +184,11 @@ static bool display_single_table(u_int8_t l4_proto, bool numeric_hostname, bool
 	payload->l4_proto = l4_proto;
 	payload->display.iterate = false;
 	memset(&payload->display.addr4, 0, sizeof(payload->display.addr4));
+	memset(&payload->display.remote4, 0, sizeof(payload->display.remote4));
+	payload->display.filter = *filter;
 
 	params.numeric_hostname = numeric_hostname;
-	params.csv_format = csv_format;
+	params.format = format;
 	params.row_count = 0;
 	params.req_payload = payload;
 
@@ -148,7 +198,7 @@ static bool display_single_table(u_int8_t l4_proto, bool numeric_hostname, bool
 			break;
 	} while (params.req_payload->display.iterate);
 
-	if (!csv_format && !error) {
+	if (format == FORMAT_FRIENDLY && !error) {
 		if (params.row_count > 0)
 			log_info("  (Fetched %u entries.)\n", params.row_count);
 		else
@@ -159,13 +209,13 @@ static bool display_single_table(u_int8_t l4_proto, bool numeric_hostname, bool
 }
 
 int session_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_hostname,
-		bool csv_format)
+		enum display_format format, struct session_filter *filter)
 {
 	int tcp_error = 0;
 	int udp_error = 0;
 	int icmp_error = 0;
 
-	if (csv_format) {
+	if (format == FORMAT_CSV) {
 		printf("Protocol,");
 		printf("IPv6 Remote Address,IPv6 Remote L4-ID,IPv6 Local Address,IPv6 Local L4-ID,");
 		printf("IPv4 Local Address,IPv4 Local L4-ID,IPv4 Remote Address,IPv4 Remote L4-ID,");
@@ -174,11 +224,14 @@ int session_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_host
 	}
 
 	if (use_tcp)
-		tcp_error = display_single_table(L4PROTO_TCP, numeric_hostname, csv_format);
+		tcp_error = display_single_table(L4PROTO_TCP, numeric_hostname, format,
+				filter);
 	if (use_udp)
-		udp_error = display_single_table(L4PROTO_UDP, numeric_hostname, csv_format);
+		udp_error = display_single_table(L4PROTO_UDP, numeric_hostname, format,
+				filter);
 	if (use_icmp)
-		icmp_error = display_single_table(L4PROTO_ICMP, numeric_hostname, csv_format);
+		icmp_error = display_single_table(L4PROTO_ICMP, numeric_hostname, format,
+				filter);
 
 	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
 }
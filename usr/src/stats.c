@@ -0,0 +1,265 @@
+#include "nat64/usr/stats.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+/** Labels of the counters, in enum jool_stat order. These match the kernel's /proc/net/jool. */
+static const char *const counter_names[] = {
+	"Translated",
+	"Pool6Mismatch",
+	"Pool4Mismatch",
+	"HairpinLoop",
+	"ICMP6InfoFiltered",
+	"BIB6Failed",
+	"NoBIB",
+	"AddressFiltered",
+	"SessionFailed",
+	"TCPStateRejected",
+	"SYNsStored",
+	"SYNQueueFull",
+	"FragmentTimeout",
+	"FragmentStoreFailed",
+	"NoRoute",
+	"SendFailed",
+	"SIITUntranslatable",
+};
+
+/** Labels of the locks, in enum jool_lock order. */
+static const char *const lock_names[] = {
+	"BIB",
+	"Session",
+	"Pool4",
+	"Fragment",
+	"PacketQueue",
+};
+
+static void print_lock_stats(struct lock_stats *locks)
+{
+	struct lock_stats *lock;
+	unsigned int i;
+
+	printf("\n%-20s%-16s%-16s%-16s%-16s%s\n", "Lock", "Acquisitions", "Contended",
+			"Wait avg (ns)", "Hold avg (ns)", "Hold max (ns)");
+	for (i = 0; i < JLOCK_COUNT; i++) {
+		lock = &locks[i];
+		printf("%-20s%-16llu%-16llu%-16llu%-16llu%llu\n", lock_names[i],
+				(unsigned long long) lock->acquisitions,
+				(unsigned long long) lock->contended,
+				(unsigned long long) (lock->contended
+						? (lock->wait_nsecs / lock->contended) : 0),
+				(unsigned long long) (lock->acquisitions
+						? (lock->hold_nsecs / lock->acquisitions) : 0),
+				(unsigned long long) lock->hold_max_nsecs);
+	}
+}
+
+static int stats_display_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr;
+	struct jool_stats_usr *stats;
+	unsigned int i;
+
+	hdr = nlmsg_hdr(msg);
+	if (nlmsg_datalen(hdr) != sizeof(*stats)) {
+		log_err("The kernel's response has an unexpected size (%d bytes).", nlmsg_datalen(hdr));
+		return -EINVAL;
+	}
+	stats = nlmsg_data(hdr);
+
+	for (i = 0; i < JSTAT_COUNT; i++)
+		printf("%-20s%llu\n", counter_names[i], (unsigned long long) stats->counters[i]);
+
+	/* All zero means the module was inserted without lock_timing. */
+	for (i = 0; i < JLOCK_COUNT; i++) {
+		if (stats->locks[i].acquisitions) {
+			print_lock_stats(stats->locks);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int stats_display(void)
+{
+	unsigned char request[sizeof(struct request_hdr) + sizeof(struct request_stats)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_stats *payload = (struct request_stats *) (hdr + 1);
+
+	if (sizeof(counter_names) / sizeof(counter_names[0]) != JSTAT_COUNT) {
+		log_err("Bug: The counter labels are out of sync with enum jool_stat.");
+		return -EINVAL;
+	}
+	if (sizeof(lock_names) / sizeof(lock_names[0]) != JLOCK_COUNT) {
+		log_err("Bug: The lock labels are out of sync with enum jool_lock.");
+		return -EINVAL;
+	}
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_STATS;
+	hdr->operation = OP_DISPLAY;
+	payload->type = STATS_COUNTERS;
+
+	return netlink_request(request, hdr->length, stats_display_response, NULL);
+}
+
+static const char *const proto_names[] = { "TCP", "UDP", "ICMP" };
+
+static void print_age_header(void)
+{
+	static const unsigned int limits[] = OCCUPANCY_AGE_LIMITS;
+	char label[16];
+	unsigned int i;
+
+	printf("%-8s", "Age");
+	for (i = 0; i < OCCUPANCY_AGE_BUCKETS - 1; i++) {
+		snprintf(label, sizeof(label), "<%um", limits[i]);
+		printf("%-12s", label);
+	}
+	snprintf(label, sizeof(label), ">=%um", limits[i - 1]);
+	printf("%s\n", label);
+}
+
+static int occupancy_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr;
+	struct occupancy_usr *occupancy;
+	struct pool4_usage_usr *usage;
+	unsigned int count, i, proto;
+	char label[24];
+	int len;
+
+	hdr = nlmsg_hdr(msg);
+	len = nlmsg_datalen(hdr);
+	if (len < (int) sizeof(*occupancy)
+			|| (len - sizeof(*occupancy)) % sizeof(*usage) != 0) {
+		log_err("The kernel's response has an unexpected size (%d bytes).", len);
+		return -EINVAL;
+	}
+	occupancy = nlmsg_data(hdr);
+	usage = (struct pool4_usage_usr *) (occupancy + 1);
+	count = (len - sizeof(*occupancy)) / sizeof(*usage);
+
+	printf("%-8s%-16s%s\n", "Table", "BIB entries", "Sessions");
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		printf("%-8s%-16llu%llu\n", proto_names[proto],
+				(unsigned long long) occupancy->bibs[proto],
+				(unsigned long long) occupancy->sessions[proto]);
+	}
+	printf("IPv6 nodes with BIB entries: %llu\n", (unsigned long long) occupancy->hosts);
+
+	printf("\n");
+	print_age_header();
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		printf("%-8s", proto_names[proto]);
+		for (i = 0; i < OCCUPANCY_AGE_BUCKETS - 1; i++)
+			printf("%-12llu", (unsigned long long) occupancy->ages[proto][i]);
+		printf("%llu\n", (unsigned long long) occupancy->ages[proto][i]);
+	}
+
+	printf("\n%-20sIPv6 /%u prefixes\n", "Sessions", occupancy->prefix_len);
+	for (i = 1; i < OCCUPANCY_PREFIX_BUCKETS; i++) {
+		if (!occupancy->prefixes[i])
+			continue;
+		if (i == 1)
+			snprintf(label, sizeof(label), "1");
+		else if (i == OCCUPANCY_PREFIX_BUCKETS - 1)
+			snprintf(label, sizeof(label), "%u+", 1u << (i - 1));
+		else
+			snprintf(label, sizeof(label), "%u-%u", 1u << (i - 1), (1u << i) - 1);
+		printf("%-20s%llu\n", label, (unsigned long long) occupancy->prefixes[i]);
+	}
+
+	if (!count)
+		return 0;
+
+	printf("\n%-18s%-18s%-18s%s\n", "Pool4 address", "TCP ports", "UDP ports", "ICMP ids");
+	for (i = 0; i < count; i++) {
+		printf("%-18s", inet_ntoa(usage[i].addr));
+		for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+			snprintf(label, sizeof(label), "%u/%u", usage[i].borrowed[proto],
+					usage[i].total[proto]);
+			printf("%-18s", label);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
+
+int stats_display_occupancy(void)
+{
+	unsigned char request[sizeof(struct request_hdr) + sizeof(struct request_stats)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_stats *payload = (struct request_stats *) (hdr + 1);
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_STATS;
+	hdr->operation = OP_DISPLAY;
+	payload->type = STATS_OCCUPANCY;
+
+	return netlink_request(request, hdr->length, occupancy_response, NULL);
+}
+
+/** Labels of the subsystems, in enum jool_memory order. */
+static const char *const memory_names[] = {
+	"Sessions",
+	"BIB",
+	"Pool4",
+	"Pool6",
+	"EAMT",
+	"FragmentBuffers",
+	"Fragments",
+	"PktQueue",
+	"QueuedPackets",
+	"TimeLogs",
+	"ChangeLog",
+};
+
+static int memory_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr;
+	struct memory_usr *memory;
+	__u64 total = 0;
+	unsigned int i;
+
+	hdr = nlmsg_hdr(msg);
+	if (nlmsg_datalen(hdr) != sizeof(*memory)) {
+		log_err("The kernel's response has an unexpected size (%d bytes).",
+				nlmsg_datalen(hdr));
+		return -EINVAL;
+	}
+	memory = nlmsg_data(hdr);
+
+	printf("%-20s%s\n", "Subsystem", "Bytes");
+	for (i = 0; i < JMEM_COUNT; i++) {
+		printf("%-20s%llu\n", memory_names[i], (unsigned long long) memory->bytes[i]);
+		total += memory->bytes[i];
+	}
+	printf("%-20s%llu\n", "Total", (unsigned long long) total);
+
+	return 0;
+}
+
+int stats_display_memory(void)
+{
+	unsigned char request[sizeof(struct request_hdr) + sizeof(struct request_stats)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_stats *payload = (struct request_stats *) (hdr + 1);
+
+	if (sizeof(memory_names) / sizeof(memory_names[0]) != JMEM_COUNT) {
+		log_err("Bug: The subsystem labels are out of sync with enum jool_memory.");
+		return -EINVAL;
+	}
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_STATS;
+	hdr->operation = OP_DISPLAY;
+	payload->type = STATS_MEMORY;
+
+	return netlink_request(request, hdr->length, memory_response, NULL);
+}
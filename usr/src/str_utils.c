@@ -255,15 +255,14 @@ int str_to_addr6_port(const char *str, struct ipv6_transport_addr *addr_out)
 
 #undef STR_MAX_LEN
 #define STR_MAX_LEN (INET6_ADDRSTRLEN + 1 + 3) /* [addr + null chara] + / + pref len */
-int str_to_prefix(const char *str, struct ipv6_prefix *prefix_out)
+/**
+ * Parses "str" as a IPv6 prefix of any length.
+ */
+static int parse_prefix6(const char *str, struct ipv6_prefix *prefix_out, const char *FORMAT)
 {
-	const char *FORMAT = "<IPv6 address>/<length> (eg. 64:ff9b::/96)";
 	/* strtok corrupts the string, so we'll be using this copy instead. */
 	char str_copy[STR_MAX_LEN];
 	char *token;
-	__u8 valid_lengths[] = POOL6_PREFIX_LENGTHS;
-	int valid_lengths_size = sizeof(valid_lengths) / sizeof(valid_lengths[0]);
-	int i;
 	int error;
 
 	if (strlen(str) + 1 > STR_MAX_LEN) {
@@ -287,9 +286,19 @@ int str_to_prefix(const char *str, struct ipv6_prefix *prefix_out)
 		log_err("'%s' does not seem to contain a mask (format: %s).", str, FORMAT);
 		return -EINVAL;
 	}
-	error = str_to_u8(token, &prefix_out->len, 0, 0xFF);
+	return str_to_u8(token, &prefix_out->len, 0, 128); /* Error msg already printed. */
+}
+
+int str_to_prefix(const char *str, struct ipv6_prefix *prefix_out)
+{
+	__u8 valid_lengths[] = POOL6_PREFIX_LENGTHS;
+	int valid_lengths_size = sizeof(valid_lengths) / sizeof(valid_lengths[0]);
+	int i;
+	int error;
+
+	error = parse_prefix6(str, prefix_out, "<IPv6 address>/<length> (eg. 64:ff9b::/96)");
 	if (error)
-		return error; /* Error msg already printed. */
+		return error;
 
 	for (i = 0; i < valid_lengths_size; i++)
 		if (prefix_out->len == valid_lengths[i])
@@ -299,6 +308,147 @@ int str_to_prefix(const char *str, struct ipv6_prefix *prefix_out)
 	return -EINVAL;
 }
 
+int str_to_eam_prefix6(const char *str, struct ipv6_prefix *prefix_out)
+{
+	return parse_prefix6(str, prefix_out, "<IPv6 address>/<length> (eg. 2001:db8::/120)");
+}
+
+#undef STR_MAX_LEN
+#define STR_MAX_LEN (INET_ADDRSTRLEN + 1 + 2) /* [addr + null chara] + / + pref len */
+int str_to_prefix4(const char *str, struct ipv4_prefix *prefix_out)
+{
+	const char *FORMAT = "<IPv4 address>/<length> (eg. 192.0.2.0/24)";
+	/* strtok corrupts the string, so we'll be using this copy instead. */
+	char str_copy[STR_MAX_LEN];
+	char *token;
+	int error;
+
+	if (strlen(str) + 1 > STR_MAX_LEN) {
+		log_err("'%s' is too long for this poor, limited parser...", str);
+		return -EINVAL;
+	}
+	strcpy(str_copy, str);
+
+	token = strtok(str_copy, "/");
+	if (!token) {
+		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+		return -EINVAL;
+	}
+
+	error = str_to_addr4(token, &prefix_out->address);
+	if (error)
+		return error;
+
+	token = strtok(NULL, "/");
+	if (!token) {
+		log_err("'%s' does not seem to contain a mask (format: %s).", str, FORMAT);
+		return -EINVAL;
+	}
+	return str_to_u8(token, &prefix_out->len, 0, 32); /* Error msg already printed. */
+}
+
+#undef STR_MAX_LEN
+#define STR_MAX_LEN (5 + 1 + 5 + 1) /* port + - + port + null chara */
+int str_to_port_range(const char *str, __u16 *min, __u16 *max)
+{
+	const char *FORMAT = "<min port>-<max port> (eg. 1024-65535)";
+	/* strtok corrupts the string, so we'll be using this copy instead. */
+	char str_copy[STR_MAX_LEN];
+	char *token;
+	int error;
+
+	if (strlen(str) + 1 > STR_MAX_LEN) {
+		log_err("'%s' is too long for this poor, limited parser...", str);
+		return -EINVAL;
+	}
+	strcpy(str_copy, str);
+
+	token = strtok(str_copy, "-");
+	if (!token) {
+		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+		return -EINVAL;
+	}
+	error = str_to_u16(token, min, 0, MAX_PORT);
+	if (error)
+		return error; /* Error msg already printed. */
+
+	token = strtok(NULL, "-");
+	if (!token) {
+		log_err("'%s' does not seem to contain a maximum (format: %s).", str, FORMAT);
+		return -EINVAL;
+	}
+	error = str_to_u16(token, max, *min, MAX_PORT);
+	if (error)
+		return error; /* Error msg already printed. */
+
+	return 0;
+}
+
+#undef STR_MAX_LEN
+#define STR_MAX_LEN (5 + 1 + 2 + 1) /* PSID + / + length + null chara */
+int str_to_psid(const char *str, __u16 *psid, __u8 *len)
+{
+	const char *FORMAT = "<PSID>/<length> (eg. 52/8)";
+	/* strtok corrupts the string, so we'll be using this copy instead. */
+	char str_copy[STR_MAX_LEN];
+	char *token;
+	int error;
+
+	if (strlen(str) + 1 > STR_MAX_LEN) {
+		log_err("'%s' is too long for this poor, limited parser...", str);
+		return -EINVAL;
+	}
+	strcpy(str_copy, str);
+
+	token = strtok(str_copy, "/");
+	if (!token) {
+		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+		return -EINVAL;
+	}
+	error = str_to_u16(token, psid, 0, MAX_PORT);
+	if (error)
+		return error; /* Error msg already printed. */
+
+	token = strtok(NULL, "/");
+	if (!token) {
+		log_err("'%s' does not seem to contain a length (format: %s).", str, FORMAT);
+		return -EINVAL;
+	}
+	return str_to_u8(token, len, 1, 16); /* Error msg already printed, if any. */
+}
+
+int str_to_port_timeout(const char *str, __u16 *port, __u64 *seconds)
+{
+	const char *FORMAT = "<port>=<seconds> (eg. 53=10)";
+	/* strtok corrupts the string, so we'll be using this copy instead. */
+	char str_copy[STR_MAX_LEN];
+	char *token;
+	int error;
+
+	if (strlen(str) + 1 > STR_MAX_LEN) {
+		log_err("'%s' is too long for this poor, limited parser...", str);
+		return -EINVAL;
+	}
+	strcpy(str_copy, str);
+
+	token = strtok(str_copy, "=");
+	if (!token) {
+		log_err("Cannot parse '%s' as a %s.", str, FORMAT);
+		return -EINVAL;
+	}
+	error = str_to_u16(token, port, 1, MAX_PORT);
+	if (error)
+		return error; /* Error msg already printed. */
+
+	token = strtok(NULL, "=");
+	if (!token) {
+		log_err("'%s' does not seem to contain a timeout (format: %s).", str, FORMAT);
+		return -EINVAL;
+	}
+	/* The kernel validates the minimum, since it depends on the port. */
+	return str_to_u64(token, seconds, 0, MAX_U32 / 1000); /* Error msg already printed. */
+}
+
 static void print_num_csv(__u64 num, char *separator)
 {
 	if (num < 10)
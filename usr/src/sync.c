@@ -0,0 +1,227 @@
+#include "nat64/usr/sync.h"
+#include "nat64/comm/config_proto.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Standard output carries the events, so the messages for the user go to standard error.
+ */
+#define sync_err(text, ...) fprintf(stderr, text "\n", ##__VA_ARGS__)
+
+/**
+ * Events per request to the kernel. The request has to fit in libnl's default message buffer
+ * (a page).
+ */
+#define EVENTS_PER_REQUEST 64
+
+static int event_handler(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	bool *write_failed = arg;
+	int len;
+
+	if (hdr->nlmsg_type != MSG_DBEVENTS)
+		return NL_SKIP;
+
+	len = nlmsg_datalen(hdr);
+	if (len % sizeof(struct dbevent_usr)) {
+		sync_err("The kernel sent an event batch of unexpected size (%d bytes).", len);
+		return NL_SKIP;
+	}
+
+	if (fwrite(nlmsg_data(hdr), 1, len, stdout) != len || fflush(stdout)) {
+		*write_failed = true;
+		return NL_STOP;
+	}
+
+	return NL_OK;
+}
+
+int sync_display(void)
+{
+	struct nl_sock *sk;
+	bool write_failed = false;
+	int error;
+
+	sk = nl_socket_alloc();
+	if (!sk) {
+		sync_err("Could not allocate a socket; cannot speak to the NAT64.");
+		return -ENOMEM;
+	}
+
+	/* Multicasts are not answers to anything; don't expect sequence numbers. */
+	nl_socket_disable_seq_check(sk);
+	error = nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, event_handler, &write_failed);
+	if (error < 0) {
+		sync_err("Could not register the event handler.\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		goto fail_free;
+	}
+
+	error = nl_connect(sk, NETLINK_USERSOCK);
+	if (error < 0) {
+		sync_err("Could not bind the socket to the NAT64.\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		goto fail_free;
+	}
+
+	error = nl_socket_add_membership(sk, DBEVENTS_GROUP);
+	if (error < 0) {
+		sync_err("Could not subscribe to the NAT64's events (are you root?).\n"
+				"Netlink error message: %s (Code %d)", nl_geterror(error), error);
+		goto fail_close;
+	}
+
+	while (!write_failed) {
+		error = nl_recvmsgs_default(sk);
+		if (error == -NLE_NOMEM) {
+			/* Our receive queue overflowed. The kernel counts what we missed. */
+			sync_err("Some events were lost; the peer is out of sync until they expire.");
+			continue;
+		}
+		if (error < 0) {
+			sync_err("%s (System error %d)", nl_geterror(error), error);
+			goto fail_close;
+		}
+	}
+
+	sync_err("Could not write the events to standard output.");
+	/* Fall through. */
+
+fail_close:
+	nl_close(sk);
+	/* Fall through. */
+
+fail_free:
+	nl_socket_free(sk);
+	return -EINVAL;
+}
+
+static int snapshot_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct request_session *payload = arg;
+	struct dbevent_usr *events = nlmsg_data(hdr);
+	int len = nlmsg_datalen(hdr);
+	unsigned int count = len / sizeof(*events);
+
+	if (len % sizeof(*events)) {
+		sync_err("The kernel sent a snapshot chunk of unexpected size (%d bytes).", len);
+		return -EINVAL;
+	}
+	if (fwrite(events, sizeof(*events), count, stdout) != count) {
+		sync_err("Could not write the snapshot to standard output.");
+		return -EIO;
+	}
+
+	if (hdr->nlmsg_flags == NLM_F_MULTI && count > 0) {
+		payload->display.iterate = true;
+		payload->display.addr4 = events[count - 1].local4;
+		payload->display.remote4 = events[count - 1].remote4;
+	} else {
+		payload->display.iterate = false;
+	}
+
+	return 0;
+}
+
+static int snapshot_table(l4_protocol l4_proto)
+{
+	unsigned char request[sizeof(struct request_hdr) + sizeof(struct request_session)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_session *payload = (struct request_session *) (hdr + 1);
+	int error;
+
+	hdr->length = sizeof(request);
+	hdr->mode = MODE_SYNC;
+	hdr->operation = OP_DISPLAY;
+	payload->l4_proto = l4_proto;
+	payload->display.iterate = false;
+	memset(&payload->display.addr4, 0, sizeof(payload->display.addr4));
+	memset(&payload->display.remote4, 0, sizeof(payload->display.remote4));
+	memset(&payload->display.filter, 0, sizeof(payload->display.filter));
+
+	do {
+		error = netlink_request(request, hdr->length, snapshot_response, payload);
+		if (error)
+			return error;
+	} while (payload->display.iterate);
+
+	return 0;
+}
+
+int sync_snapshot(void)
+{
+	int error;
+
+	error = snapshot_table(L4PROTO_TCP);
+	if (!error)
+		error = snapshot_table(L4PROTO_UDP);
+	if (!error)
+		error = snapshot_table(L4PROTO_ICMP);
+	if (!error && fflush(stdout)) {
+		sync_err("Could not write the snapshot to standard output.");
+		error = -EIO;
+	}
+
+	return error;
+}
+
+static int sync_add_response(struct nl_msg *msg, void *arg)
+{
+	return 0;
+}
+
+int sync_add(void)
+{
+	unsigned char request[sizeof(struct request_hdr)
+			+ EVENTS_PER_REQUEST * sizeof(struct dbevent_usr)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	unsigned char *payload = request + sizeof(*hdr);
+	const size_t capacity = EVENTS_PER_REQUEST * sizeof(struct dbevent_usr);
+	size_t pending = 0;
+	size_t sent;
+	ssize_t bytes;
+	int error;
+
+	hdr->mode = MODE_SYNC;
+	hdr->operation = OP_ADD;
+
+	/*
+	 * read() instead of fread() so the events are forwarded as soon as they arrive, rather than
+	 * once a whole request's worth has been buffered.
+	 */
+	while ((bytes = read(STDIN_FILENO, payload + pending, capacity - pending)) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			sync_err("Could not read the events from standard input: %s", strerror(errno));
+			return -errno;
+		}
+
+		pending += bytes;
+		sent = pending - (pending % sizeof(struct dbevent_usr));
+		if (!sent)
+			continue;
+
+		hdr->length = sizeof(*hdr) + sent;
+		error = netlink_request(request, hdr->length, sync_add_response, NULL);
+		if (error)
+			return error;
+
+		pending -= sent;
+		memmove(payload, payload + sent, pending);
+	}
+
+	if (pending) {
+		sync_err("The stream ended in the middle of an event; dropped its %zu bytes.", pending);
+		return -EINVAL;
+	}
+
+	return 0;
+}